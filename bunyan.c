@@ -19,6 +19,8 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "bunyan.h"
 #include "debug.h"
@@ -36,10 +38,12 @@ static const char *bunyan_name = NULL;
  * removed those annotations here (and the mutexes) but left the remainder of
  * the code as-is.
  *
- * As a result this version of bunyan.c is completely unsafe to use in the
- * face of multi-threading. This is fine within the pivy repo where all we have
- * is a couple of single-threaded commandline tools, but if you re-use this
- * code elsewhere, beware!
+ * The exceptions are bunyan_log() itself, which takes bunyan_log_mtx so that
+ * worker threads (e.g. piv_enumerate() probing readers) can log safely, and
+ * the frame stacks, which are per-thread (found through a pthread key rather
+ * than a thread-local) so that pivy-agent's token workers can each push
+ * their own. A frame itself still belongs to the thread that pushed it, so
+ * don't bunyan_add_vars() to someone else's.
  */
 
 /*
@@ -49,6 +53,7 @@ static const char *bunyan_name = NULL;
  * portable to lots of other operating systems.
  */
 
+static pthread_mutex_t bunyan_log_mtx = PTHREAD_MUTEX_INITIALIZER;
 static char *bunyan_buf = NULL;
 static size_t bunyan_buf_sz = 0;
 
@@ -83,9 +88,23 @@ struct bunyan_stack {
 	struct bunyan_frame *bs_top;
 };
 
-static struct bunyan_stack *thstack;
+static pthread_key_t bunyan_stack_key;
+static pthread_once_t bunyan_stack_once = PTHREAD_ONCE_INIT;
 static struct bunyan_stack *bunyan_stacks;
 
+static void
+bunyan_stack_key_init(void)
+{
+	VERIFY0(pthread_key_create(&bunyan_stack_key, NULL));
+}
+
+static struct bunyan_stack *
+bunyan_thstack(void)
+{
+	VERIFY0(pthread_once(&bunyan_stack_once, bunyan_stack_key_init));
+	return (pthread_getspecific(bunyan_stack_key));
+}
+
 void
 bunyan_set_level(enum bunyan_log_level level)
 {
@@ -296,6 +315,7 @@ _bunyan_push(const char *func, ...)
 {
 	va_list ap;
 	struct bunyan_frame *frame;
+	struct bunyan_stack *thstack;
 
 	frame = calloc(1, sizeof (struct bunyan_frame));
 	VERIFY(frame != NULL);
@@ -305,11 +325,15 @@ _bunyan_push(const char *func, ...)
 	bunyan_add_vars_p(frame, ap);
 	va_end(ap);
 
+	thstack = bunyan_thstack();
 	if (thstack == NULL) {
 		thstack = calloc(1, sizeof (struct bunyan_stack));
 		VERIFY(thstack != NULL);
+		VERIFY0(pthread_setspecific(bunyan_stack_key, thstack));
+		VERIFY0(pthread_mutex_lock(&bunyan_log_mtx));
 		thstack->bs_next = bunyan_stacks;
 		bunyan_stacks = thstack;
+		VERIFY0(pthread_mutex_unlock(&bunyan_log_mtx));
 	}
 
 	frame->bf_next = thstack->bs_top;
@@ -322,6 +346,7 @@ void
 bunyan_pop(struct bunyan_frame *frame)
 {
 	struct bunyan_var *var, *nvar;
+	struct bunyan_stack *thstack = bunyan_thstack();
 	VERIFY(frame != NULL);
 	VERIFY(thstack != NULL);
 	VERIFY(thstack->bs_top == frame);
@@ -394,8 +419,175 @@ print_frame(struct bunyan_frame *frame, uint *pn, struct bunyan_var **evars)
 	*pn = n;
 }
 
+/*
+ * Optional asynchronous output (see bunyan_set_async()).
+ *
+ * _bunyan_log() still formats each line under bunyan_log_mtx (so there's only
+ * ever one producer at a time), but then just copies it into bunyan_ring
+ * and leaves bunyan_writer() to get it out to stderr. The producer only ever
+ * advances bunyan_ring_head and the writer bunyan_ring_tail, so the two
+ * don't need a lock between them: the writer only takes bunyan_async_mtx to
+ * sleep when the ring is empty.
+ *
+ * If the ring fills up we drop lines (and say how many once there's room
+ * again), rather than make the caller wait for stderr.
+ */
+#define	BUNYAN_RING_SZ	(64 * 1024)
+
+static boolean_t bunyan_async = B_FALSE;
+static char bunyan_ring[BUNYAN_RING_SZ];
+static uint64_t bunyan_ring_head = 0;
+static uint64_t bunyan_ring_tail = 0;
+static uint64_t bunyan_ring_dropped = 0;
+static int bunyan_writer_sleeping = 0;
+static pthread_mutex_t bunyan_async_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bunyan_async_cv = PTHREAD_COND_INITIALIZER;
+
+static void *
+bunyan_writer(void *arg)
+{
+	uint64_t head, tail, off, n;
+	ssize_t wrote;
+
+	while (1) {
+		tail = bunyan_ring_tail;
+		head = __atomic_load_n(&bunyan_ring_head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			VERIFY0(pthread_mutex_lock(&bunyan_async_mtx));
+			__atomic_store_n(&bunyan_writer_sleeping, 1,
+			    __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&bunyan_ring_head,
+			    __ATOMIC_SEQ_CST) == tail) {
+				VERIFY0(pthread_cond_wait(&bunyan_async_cv,
+				    &bunyan_async_mtx));
+			}
+			__atomic_store_n(&bunyan_writer_sleeping, 0,
+			    __ATOMIC_SEQ_CST);
+			VERIFY0(pthread_mutex_unlock(&bunyan_async_mtx));
+			continue;
+		}
+		off = tail % BUNYAN_RING_SZ;
+		n = head - tail;
+		if (n > BUNYAN_RING_SZ - off)
+			n = BUNYAN_RING_SZ - off;
+		wrote = write(STDERR_FILENO, &bunyan_ring[off], n);
+		if (wrote < 0 && errno == EINTR)
+			continue;
+		/* If stderr is broken, there's nothing else to do with it. */
+		if (wrote <= 0)
+			wrote = n;
+		__atomic_store_n(&bunyan_ring_tail, tail + wrote,
+		    __ATOMIC_RELEASE);
+	}
+	return (NULL);
+}
+
+/* Called with bunyan_log_mtx held. */
+static boolean_t
+bunyan_ring_put(const char *line, size_t len)
+{
+	uint64_t head, tail, off, n;
+
+	head = bunyan_ring_head;
+	tail = __atomic_load_n(&bunyan_ring_tail, __ATOMIC_ACQUIRE);
+	if (len > BUNYAN_RING_SZ - (head - tail))
+		return (B_FALSE);
+
+	off = head % BUNYAN_RING_SZ;
+	n = len;
+	if (n > BUNYAN_RING_SZ - off)
+		n = BUNYAN_RING_SZ - off;
+	bcopy(line, &bunyan_ring[off], n);
+	bcopy(line + n, bunyan_ring, len - n);
+	__atomic_store_n(&bunyan_ring_head, head + len, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&bunyan_writer_sleeping, __ATOMIC_SEQ_CST)) {
+		VERIFY0(pthread_mutex_lock(&bunyan_async_mtx));
+		VERIFY0(pthread_cond_signal(&bunyan_async_cv));
+		VERIFY0(pthread_mutex_unlock(&bunyan_async_mtx));
+	}
+	return (B_TRUE);
+}
+
+static void
+bunyan_ring_drain(void)
+{
+	uint64_t head = __atomic_load_n(&bunyan_ring_head, __ATOMIC_ACQUIRE);
+
+	while (__atomic_load_n(&bunyan_ring_tail, __ATOMIC_ACQUIRE) != head)
+		(void) usleep(1000);
+}
+
+/*
+ * Start a background thread to do the writing of log lines to stderr, so
+ * that logging doesn't mean waiting on a (possibly slow, e.g. journald)
+ * stderr. Messages at BNY_ERROR and above are still written straight away
+ * (after anything already queued), since we might be about to exit.
+ *
+ * If the caller is going to fork() after this it had better exec() or
+ * _exit() without logging anything.
+ */
 void
-bunyan_log(enum bunyan_log_level level, const char *msg, ...)
+bunyan_set_async(void)
+{
+	pthread_t thr;
+	pthread_attr_t attr;
+	sigset_t set, oset;
+
+	VERIFY0(pthread_mutex_lock(&bunyan_log_mtx));
+	if (bunyan_async) {
+		VERIFY0(pthread_mutex_unlock(&bunyan_log_mtx));
+		return;
+	}
+	VERIFY0(pthread_attr_init(&attr));
+	VERIFY0(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED));
+	VERIFY0(sigfillset(&set));
+	VERIFY0(pthread_sigmask(SIG_BLOCK, &set, &oset));
+	if (pthread_create(&thr, &attr, bunyan_writer, NULL) == 0)
+		bunyan_async = B_TRUE;
+	VERIFY0(pthread_sigmask(SIG_SETMASK, &oset, NULL));
+	VERIFY0(pthread_attr_destroy(&attr));
+	VERIFY0(pthread_mutex_unlock(&bunyan_log_mtx));
+}
+
+/* Wait until everything logged so far has been written out. */
+void
+bunyan_flush(void)
+{
+	VERIFY0(pthread_mutex_lock(&bunyan_log_mtx));
+	if (bunyan_async)
+		bunyan_ring_drain();
+	VERIFY0(pthread_mutex_unlock(&bunyan_log_mtx));
+}
+
+static void
+bunyan_output(enum bunyan_log_level level)
+{
+	char note[64];
+	int len;
+
+	if (!bunyan_async) {
+		fprintf(stderr, "%s", bunyan_buf);
+		return;
+	}
+	if (bunyan_ring_dropped > 0) {
+		len = snprintf(note, sizeof (note),
+		    "(%" PRIu64 " log lines dropped)\n", bunyan_ring_dropped);
+		if (bunyan_ring_put(note, len))
+			bunyan_ring_dropped = 0;
+	}
+	if (level >= BNY_ERROR) {
+		bunyan_ring_drain();
+		fprintf(stderr, "%s", bunyan_buf);
+		return;
+	}
+	if (bunyan_ring_dropped > 0 ||
+	    !bunyan_ring_put(bunyan_buf, strlen(bunyan_buf)))
+		++bunyan_ring_dropped;
+}
+
+void
+_bunyan_log(enum bunyan_log_level level, const char *msg, ...)
 {
 	va_list ap;
 	const char *propname;
@@ -403,8 +595,17 @@ bunyan_log(enum bunyan_log_level level, const char *msg, ...)
 	enum bunyan_arg_type typ;
 	uint n = 0;
 	struct bunyan_frame *frame;
+	struct bunyan_stack *thstack;
 	struct bunyan_var *evars = NULL, *evar, *nevar;
 
+	/*
+	 * The bunyan_log() macro normally checks this before we get here, but
+	 * check again in case someone calls us directly.
+	 */
+	if (level < bunyan_min_level)
+		return;
+
+	VERIFY0(pthread_mutex_lock(&bunyan_log_mtx));
 	reset_buf();
 
 	if (!bunyan_omit_timestamp) {
@@ -437,7 +638,7 @@ bunyan_log(enum bunyan_log_level level, const char *msg, ...)
 
 	printf_buf("%s", msg);
 
-	if (thstack != NULL) {
+	if ((thstack = bunyan_thstack()) != NULL) {
 		frame = thstack->bs_top;
 		for (; frame != NULL; frame = frame->bf_next) {
 			print_frame(frame, &n, &evars);
@@ -528,8 +729,6 @@ bunyan_log(enum bunyan_log_level level, const char *msg, ...)
 		free(evar);
 	}
 
-	if (level < bunyan_min_level) {
-		return;
-	}
-	fprintf(stderr, "%s", bunyan_buf);
+	bunyan_output(level);
+	VERIFY0(pthread_mutex_unlock(&bunyan_log_mtx));
 }
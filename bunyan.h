@@ -32,16 +32,34 @@ enum bunyan_arg_type {
 	BNY_ERF,
 };
 
+/*
+ * Log calls below BUNYAN_MIN_LEVEL are compiled out completely (build with
+ * e.g. -DBUNYAN_MIN_LEVEL=BNY_INFO). For the rest, bunyan_log() checks the
+ * level set with bunyan_set_level() before evaluating any of its arguments,
+ * so a disabled call costs no more than a compare.
+ */
+#if !defined(BUNYAN_MIN_LEVEL)
+#define	BUNYAN_MIN_LEVEL	BNY_TRACE
+#endif
+
 void bunyan_init(void);
 void bunyan_unshare(void);
 void bunyan_set_name(const char *name);
 void bunyan_set_level(enum bunyan_log_level level);
 enum bunyan_log_level bunyan_get_level(void);
-void bunyan_log(enum bunyan_log_level level, const char *msg, ...);
+void bunyan_set_async(void);
+void bunyan_flush(void);
+void _bunyan_log(enum bunyan_log_level level, const char *msg, ...);
 struct bunyan_frame *_bunyan_push(const char *func, ...);
 void bunyan_add_vars(struct bunyan_frame *frame, ...);
 void bunyan_pop(struct bunyan_frame *frame);
 
 #define	bunyan_push(...)	_bunyan_push(__func__, __VA_ARGS__)
+#define	bunyan_log(level, ...)						\
+	do {								\
+		if ((level) >= BUNYAN_MIN_LEVEL &&			\
+		    (level) >= bunyan_get_level())			\
+			_bunyan_log((level), __VA_ARGS__);		\
+	} while (0)
 
 #endif
@@ -0,0 +1,74 @@
+/*
+ * Multi-block ChaCha20 kernel, included by chacha.c once for each vector
+ * width it supports. The includer defines:
+ *
+ *   CHACHA_KERNEL	the name of the function to define
+ *   CHACHA_NLANES	the number of 32-bit lanes per vector
+ *   CHACHA_TARGET	function attributes (e.g. a target("avx2") attribute)
+ *
+ * Each lane of a vector holds the same state word for a different block, so
+ * one pass through the rounds generates CHACHA_NLANES blocks of keystream
+ * (with consecutive counter values). The rounds are the same as the scalar
+ * QUARTERROUND() code, just with vector arithmetic.
+ */
+
+static void CHACHA_TARGET
+CHACHA_KERNEL(u32 *j, const u8 *m, u8 *c, u_int nblocks)
+{
+	typedef u32 vec __attribute__((vector_size(CHACHA_NLANES * 4)));
+	vec x[16], s[16], lane, mv, kv;
+	u32 ks[16][CHACHA_NLANES];
+	u32 kb[CHACHA_NLANES][16];
+	u32 j12;
+	u_int i, b, w;
+
+	for (i = 0; i < CHACHA_NLANES; ++i)
+		lane[i] = i;
+
+	for (; nblocks >= CHACHA_NLANES; nblocks -= CHACHA_NLANES) {
+		for (w = 0; w < 16; ++w)
+			s[w] = (vec){ 0 } + j[w];
+		/* Each lane gets its own block counter (with carry). */
+		s[12] += lane;
+		s[13] -= (vec)(s[12] < j[12]);
+
+		for (w = 0; w < 16; ++w)
+			x[w] = s[w];
+		for (i = 20; i > 0; i -= 2) {
+			VQUARTERROUND(x[0], x[4], x[8], x[12])
+			VQUARTERROUND(x[1], x[5], x[9], x[13])
+			VQUARTERROUND(x[2], x[6], x[10], x[14])
+			VQUARTERROUND(x[3], x[7], x[11], x[15])
+			VQUARTERROUND(x[0], x[5], x[10], x[15])
+			VQUARTERROUND(x[1], x[6], x[11], x[12])
+			VQUARTERROUND(x[2], x[7], x[8], x[13])
+			VQUARTERROUND(x[3], x[4], x[9], x[14])
+		}
+		for (w = 0; w < 16; ++w)
+			x[w] += s[w];
+
+		/*
+		 * Put the keystream back into block order (we only build this
+		 * on little-endian machines, so this is also byte order) and
+		 * then XOR it into the message a whole vector at a time.
+		 */
+		memcpy(ks, x, sizeof (ks));
+		for (b = 0; b < CHACHA_NLANES; ++b) {
+			for (w = 0; w < 16; ++w)
+				kb[b][w] = ks[w][b];
+		}
+		for (i = 0; i < sizeof (kb); i += sizeof (vec)) {
+			memcpy(&mv, m + i, sizeof (vec));
+			memcpy(&kv, (u8 *)kb + i, sizeof (vec));
+			mv ^= kv;
+			memcpy(c + i, &mv, sizeof (vec));
+		}
+		m += sizeof (kb);
+		c += sizeof (kb);
+
+		j12 = j[12];
+		j[12] = PLUS(j12, CHACHA_NLANES);
+		if (j[12] < j12)
+			j[13] = PLUSONE(j[13]);
+	}
+}
@@ -4,6 +4,9 @@ D. J. Bernstein
 Public domain.
 */
 
+#include <string.h>
+#include <pthread.h>
+
 #include "chacha.h"
 
 /* $OpenBSD: chacha.c,v 1.1 2013/11/21 00:45:44 djm Exp $ */
@@ -47,6 +50,124 @@ typedef struct chacha_ctx chacha_ctx;
   a = PLUS(a,b); d = ROTATE(XOR(d,a), 8); \
   c = PLUS(c,d); b = ROTATE(XOR(b,c), 7);
 
+/*
+ * Vectorised multi-block kernels, used for the bulk of long messages. These
+ * need GCC/clang vector extensions; other compilers (and other CPUs) get just
+ * the scalar code below.
+ *
+ * On x86 we choose the widest kernel the CPU supports at runtime: AVX-512
+ * (16 blocks at a time), AVX2 (8) or SSE2 (4). On arm64 NEON is always
+ * available, so there is nothing to detect. The kernels assume a
+ * little-endian machine.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__) || \
+    defined(__aarch64__)) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define	CHACHA_SIMD
+
+#define VROTATE(v,c) (((v) << (c)) | ((v) >> (32 - (c))))
+#define VQUARTERROUND(a,b,c,d) \
+  a += b; d = VROTATE(d ^ a,16); \
+  c += d; b = VROTATE(b ^ c,12); \
+  a += b; d = VROTATE(d ^ a, 8); \
+  c += d; b = VROTATE(b ^ c, 7);
+
+typedef void (*chacha_kernel_t)(u32 *, const u8 *, u8 *, u_int);
+
+#if defined(__x86_64__) || defined(__i386__)
+#define	CHACHA_KERNEL	chacha_blocks_avx512
+#define	CHACHA_NLANES	16
+#define	CHACHA_TARGET	__attribute__((target("avx512f")))
+#include "chacha-kernel.h"
+#undef	CHACHA_KERNEL
+#undef	CHACHA_NLANES
+#undef	CHACHA_TARGET
+
+#define	CHACHA_KERNEL	chacha_blocks_avx2
+#define	CHACHA_NLANES	8
+#define	CHACHA_TARGET	__attribute__((target("avx2")))
+#include "chacha-kernel.h"
+#undef	CHACHA_KERNEL
+#undef	CHACHA_NLANES
+#undef	CHACHA_TARGET
+
+#define	CHACHA_KERNEL	chacha_blocks_sse2
+#define	CHACHA_NLANES	4
+#define	CHACHA_TARGET	__attribute__((target("sse2")))
+#include "chacha-kernel.h"
+#undef	CHACHA_KERNEL
+#undef	CHACHA_NLANES
+#undef	CHACHA_TARGET
+
+static chacha_kernel_t
+chacha_simd_select(u_int *nlanes)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		*nlanes = 16;
+		return (chacha_blocks_avx512);
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		*nlanes = 8;
+		return (chacha_blocks_avx2);
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		*nlanes = 4;
+		return (chacha_blocks_sse2);
+	}
+	*nlanes = 0;
+	return (NULL);
+}
+#else	/* __aarch64__ */
+#define	CHACHA_KERNEL	chacha_blocks_neon
+#define	CHACHA_NLANES	4
+#define	CHACHA_TARGET
+#include "chacha-kernel.h"
+#undef	CHACHA_KERNEL
+#undef	CHACHA_NLANES
+#undef	CHACHA_TARGET
+
+static chacha_kernel_t
+chacha_simd_select(u_int *nlanes)
+{
+	*nlanes = 4;
+	return (chacha_blocks_neon);
+}
+#endif
+
+/*
+ * The kernel and its lane count are chosen once, under pthread_once, so that
+ * no thread can see one without the other.
+ */
+static pthread_once_t chacha_simd_once = PTHREAD_ONCE_INIT;
+static chacha_kernel_t chacha_simd_kernel = NULL;
+static u_int chacha_simd_nlanes = 0;
+
+static void
+chacha_simd_init(void)
+{
+  chacha_simd_kernel = chacha_simd_select(&chacha_simd_nlanes);
+}
+
+static void
+chacha_encrypt_simd(chacha_ctx *x, const u8 **m, u8 **c, u32 *bytes)
+{
+  u_int nblocks;
+
+  (void) pthread_once(&chacha_simd_once, chacha_simd_init);
+  if (chacha_simd_kernel == NULL)
+    return;
+  nblocks = *bytes / 64;
+  nblocks -= nblocks % chacha_simd_nlanes;
+  if (nblocks == 0)
+    return;
+  chacha_simd_kernel(x->input, *m, *c, nblocks);
+  *m += 64 * nblocks;
+  *c += 64 * nblocks;
+  *bytes -= 64 * nblocks;
+}
+#endif	/* CHACHA_SIMD */
+
 static const char sigma[16] = "expand 32-byte k";
 static const char tau[16] = "expand 16-byte k";
 
@@ -95,6 +216,12 @@ chacha_encrypt_bytes(chacha_ctx *x,const u8 *m,u8 *c,u32 bytes)
 
   if (!bytes) return;
 
+#ifdef CHACHA_SIMD
+  /* Do as many whole multi-block batches as we can, then the rest here. */
+  chacha_encrypt_simd(x, &m, &c, &bytes);
+  if (!bytes) return;
+#endif
+
   j0 = x->input[0];
   j1 = x->input[1];
   j2 = x->input[2];
@@ -8,6 +8,8 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "poly1305.h"
 
@@ -27,8 +29,33 @@
 		(p)[3] = (uint8_t)((v) >> 24); \
 	} while (0)
 
-void
-poly1305_auth(unsigned char out[POLY1305_TAGLEN], const unsigned char *m, size_t inlen, const unsigned char key[POLY1305_KEYLEN]) {
+/*
+ * Three implementations live here:
+ *
+ *  - the original 32-bit "donna" code, with 26-bit limbs and one block per
+ *    iteration. It is only built where the compiler has no 128-bit integer
+ *    type;
+ *  - a 64-bit version with three 44-bit limbs (poly1305-donna-64), which
+ *    does about half the multiplies of the 32-bit one;
+ *  - on x86, an AVX2 kernel which runs four independent Horner chains of
+ *    r^4 side by side and folds them together at the end. The 64-bit code
+ *    finishes off whatever is left over.
+ *
+ * poly1305_auth() picks between them at runtime.
+ */
+#if defined(__SIZEOF_INT128__)
+#define	POLY1305_64
+#endif
+
+#if defined(POLY1305_64) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define	POLY1305_AVX2
+#include <immintrin.h>
+#endif
+
+#if !defined(POLY1305_64)
+static void
+poly1305_auth_32(unsigned char out[POLY1305_TAGLEN], const unsigned char *m, size_t inlen, const unsigned char key[POLY1305_KEYLEN]) {
 	uint32_t t0,t1,t2,t3;
 	uint32_t h0,h1,h2,h3,h4;
 	uint32_t r0,r1,r2,r3,r4;
@@ -155,3 +182,289 @@ poly1305_donna_finish:
 	U32TO8_LE(&out[ 8], f2); f3 += (f2 >> 32);
 	U32TO8_LE(&out[12], f3);
 }
+#endif	/* !POLY1305_64 */
+
+#if defined(POLY1305_64)
+typedef unsigned __int128 uint128_t;
+
+#define U8TO64_LE(p) \
+	(((uint64_t)U8TO32_LE(p)) | ((uint64_t)U8TO32_LE((p) + 4) << 32))
+
+#define U64TO8_LE(p, v) \
+	do { \
+		U32TO8_LE((p), (uint32_t)(v)); \
+		U32TO8_LE((p) + 4, (uint32_t)((v) >> 32)); \
+	} while (0)
+
+#define	MASK44	0xfffffffffffULL
+#define	MASK42	0x3ffffffffffULL
+
+/* h *= r, with h only partially reduced afterwards */
+static inline void
+poly1305_mul64(uint64_t h[3], const uint64_t r[3])
+{
+	uint64_t s1 = r[1] * (5 << 2), s2 = r[2] * (5 << 2);
+	uint128_t d0, d1, d2;
+	uint64_t c;
+
+	d0 = (uint128_t)h[0] * r[0] + (uint128_t)h[1] * s2 +
+	    (uint128_t)h[2] * s1;
+	d1 = (uint128_t)h[0] * r[1] + (uint128_t)h[1] * r[0] +
+	    (uint128_t)h[2] * s2;
+	d2 = (uint128_t)h[0] * r[2] + (uint128_t)h[1] * r[1] +
+	    (uint128_t)h[2] * r[0];
+
+	               c = (uint64_t)(d0 >> 44); h[0] = (uint64_t)d0 & MASK44;
+	d1 += c;       c = (uint64_t)(d1 >> 44); h[1] = (uint64_t)d1 & MASK44;
+	d2 += c;       c = (uint64_t)(d2 >> 42); h[2] = (uint64_t)d2 & MASK42;
+	h[0] += c * 5; c = h[0] >> 44;           h[0] &= MASK44;
+	h[1] += c;
+}
+
+static void
+poly1305_blocks64(uint64_t h[3], const uint64_t r[3], const unsigned char *m,
+    size_t nblocks)
+{
+	uint64_t t0, t1;
+
+	for (; nblocks > 0; --nblocks, m += 16) {
+		t0 = U8TO64_LE(m);
+		t1 = U8TO64_LE(m + 8);
+		h[0] += t0 & MASK44;
+		h[1] += ((t0 >> 44) | (t1 << 20)) & MASK44;
+		h[2] += ((t1 >> 24) & MASK42) | (1ULL << 40);
+		poly1305_mul64(h, r);
+	}
+}
+
+static void
+poly1305_finish64(unsigned char out[POLY1305_TAGLEN], uint64_t h[3],
+    const uint64_t r[3], const unsigned char *m, size_t inlen,
+    const unsigned char key[POLY1305_KEYLEN])
+{
+	unsigned char mp[16];
+	uint64_t h0, h1, h2, g0, g1, g2, c, t0, t1;
+	size_t j;
+
+	if (inlen > 0) {
+		for (j = 0; j < inlen; j++) mp[j] = m[j];
+		mp[j++] = 1;
+		for (; j < 16; j++) mp[j] = 0;
+		t0 = U8TO64_LE(mp);
+		t1 = U8TO64_LE(mp + 8);
+		h[0] += t0 & MASK44;
+		h[1] += ((t0 >> 44) | (t1 << 20)) & MASK44;
+		h[2] += (t1 >> 24) & MASK42;
+		poly1305_mul64(h, r);
+	}
+
+	h0 = h[0]; h1 = h[1]; h2 = h[2];
+	             c = (h1 >> 44); h1 &= MASK44;
+	h2 += c;     c = (h2 >> 42); h2 &= MASK42;
+	h0 += c * 5; c = (h0 >> 44); h0 &= MASK44;
+	h1 += c;     c = (h1 >> 44); h1 &= MASK44;
+	h2 += c;     c = (h2 >> 42); h2 &= MASK42;
+	h0 += c * 5; c = (h0 >> 44); h0 &= MASK44;
+	h1 += c;
+
+	/* compute h - p, and keep it if it didn't go negative */
+	g0 = h0 + 5; c = (g0 >> 44); g0 &= MASK44;
+	g1 = h1 + c; c = (g1 >> 44); g1 &= MASK44;
+	g2 = h2 + c - (1ULL << 42);
+
+	c = (g2 >> 63) - 1;
+	h0 = (h0 & ~c) | (g0 & c);
+	h1 = (h1 & ~c) | (g1 & c);
+	h2 = (h2 & ~c) | (g2 & c);
+
+	t0 = U8TO64_LE(&key[16]);
+	t1 = U8TO64_LE(&key[24]);
+	h0 += t0 & MASK44;                          c = (h0 >> 44); h0 &= MASK44;
+	h1 += (((t0 >> 44) | (t1 << 20)) & MASK44) + c; c = (h1 >> 44); h1 &= MASK44;
+	h2 += ((t1 >> 24) & MASK42) + c;                            h2 &= MASK42;
+
+	h0 = h0 | (h1 << 44);
+	h1 = (h1 >> 20) | (h2 << 24);
+	U64TO8_LE(&out[0], h0);
+	U64TO8_LE(&out[8], h1);
+}
+
+#if defined(POLY1305_AVX2)
+typedef uint64_t v4u64 __attribute__((vector_size(32)));
+
+#define	M26	0x3ffffffULL
+#define	VMUL(a, b)	((v4u64)_mm256_mul_epu32((__m256i)(a), (__m256i)(b)))
+
+/* Split a 44-bit-limb value into five 26-bit limbs. h must be carried. */
+static void
+poly1305_to26(uint32_t l[5], const uint64_t h[3])
+{
+	l[0] = h[0] & M26;
+	l[1] = ((h[0] >> 26) | (h[1] << 18)) & M26;
+	l[2] = (h[1] >> 8) & M26;
+	l[3] = ((h[1] >> 34) | (h[2] << 10)) & M26;
+	l[4] = h[2] >> 16;
+}
+
+/*
+ * h[lane] = h[lane] * r[lane], for four lanes of 26-bit limbs, followed by
+ * a partial carry so that every limb ends up close to 26 bits again.
+ */
+static inline void __attribute__((target("avx2"), always_inline))
+poly1305_vmul(v4u64 h[5], const v4u64 r[5], const v4u64 s[5])
+{
+	v4u64 t0, t1, t2, t3, t4, c;
+
+	t0 = VMUL(h[0], r[0]) + VMUL(h[1], s[4]) + VMUL(h[2], s[3]) +
+	    VMUL(h[3], s[2]) + VMUL(h[4], s[1]);
+	t1 = VMUL(h[0], r[1]) + VMUL(h[1], r[0]) + VMUL(h[2], s[4]) +
+	    VMUL(h[3], s[3]) + VMUL(h[4], s[2]);
+	t2 = VMUL(h[0], r[2]) + VMUL(h[1], r[1]) + VMUL(h[2], r[0]) +
+	    VMUL(h[3], s[4]) + VMUL(h[4], s[3]);
+	t3 = VMUL(h[0], r[3]) + VMUL(h[1], r[2]) + VMUL(h[2], r[1]) +
+	    VMUL(h[3], r[0]) + VMUL(h[4], s[4]);
+	t4 = VMUL(h[0], r[4]) + VMUL(h[1], r[3]) + VMUL(h[2], r[2]) +
+	    VMUL(h[3], r[1]) + VMUL(h[4], r[0]);
+
+	          c = t0 >> 26; h[0] = t0 & M26;
+	t1 += c;  c = t1 >> 26; h[1] = t1 & M26;
+	t2 += c;  c = t2 >> 26; h[2] = t2 & M26;
+	t3 += c;  c = t3 >> 26; h[3] = t3 & M26;
+	t4 += c;  c = t4 >> 26; h[4] = t4 & M26;
+	h[0] += c + (c << 2);
+	c = h[0] >> 26; h[0] &= M26;
+	h[1] += c;
+}
+
+/*
+ * Run ngroups * 4 blocks through four parallel Horner chains. Lanes hold
+ * blocks 0, 2, 1, 3 of each 64-byte group (that's the order unpack gives
+ * us), and at the end each lane is multiplied by the power of r that
+ * puts it back in sequence: r^4, r^2, r^3, r^1 respectively. The lanes are
+ * then summed and returned in 44-bit limbs, ready for poly1305_blocks64().
+ */
+static void __attribute__((target("avx2")))
+poly1305_blocks_avx2(uint64_t hout[3], const uint32_t rp[4][5],
+    const unsigned char *m, size_t ngroups)
+{
+	const v4u64 mask = { M26, M26, M26, M26 };
+	const v4u64 hibit = { 1 << 24, 1 << 24, 1 << 24, 1 << 24 };
+	v4u64 r[5], s[5], h[5], lo, hi;
+	uint64_t l[5], b;
+	size_t i;
+
+	for (i = 0; i < 5; ++i) {
+		r[i] = (v4u64){ rp[3][i], rp[3][i], rp[3][i], rp[3][i] };
+		s[i] = r[i] * 5;
+	}
+	memset(h, 0, sizeof (h));
+
+	for (; ngroups > 0; --ngroups, m += 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)m);
+		__m256i z = _mm256_loadu_si256((const __m256i *)(m + 32));
+		lo = (v4u64)_mm256_unpacklo_epi64(a, z);
+		hi = (v4u64)_mm256_unpackhi_epi64(a, z);
+
+		h[0] += lo & mask;
+		h[1] += (lo >> 26) & mask;
+		h[2] += ((lo >> 52) | (hi << 12)) & mask;
+		h[3] += (hi >> 14) & mask;
+		h[4] += (hi >> 40) | hibit;
+
+		if (ngroups > 1)
+			poly1305_vmul(h, r, s);
+	}
+
+	for (i = 0; i < 5; ++i) {
+		r[i] = (v4u64){ rp[3][i], rp[1][i], rp[2][i], rp[0][i] };
+		s[i] = r[i] * 5;
+	}
+	poly1305_vmul(h, r, s);
+
+	for (i = 0; i < 5; ++i)
+		l[i] = h[i][0] + h[i][1] + h[i][2] + h[i][3];
+
+	             b = l[0] >> 26; l[0] &= M26;
+	l[1] +=     b; b = l[1] >> 26; l[1] &= M26;
+	l[2] +=     b; b = l[2] >> 26; l[2] &= M26;
+	l[3] +=     b; b = l[3] >> 26; l[3] &= M26;
+	l[4] +=     b; b = l[4] >> 26; l[4] &= M26;
+	l[0] += b * 5; b = l[0] >> 26; l[0] &= M26;
+	l[1] +=     b;
+
+	hout[0] = l[0] + ((l[1] & 0x3ffff) << 26);
+	b = hout[0] >> 44; hout[0] &= MASK44;
+	hout[1] = (l[1] >> 18) + (l[2] << 8) + ((l[3] & 0x3ff) << 34) + b;
+	b = hout[1] >> 44; hout[1] &= MASK44;
+	hout[2] = (l[3] >> 10) + (l[4] << 16) + b;
+}
+
+/*
+ * The power setup costs a few multiplies, so don't bother with the vector
+ * path for short messages (most SSH packets and ebox headers).
+ */
+#define	POLY1305_AVX2_MIN	256
+
+/* As in chacha.c, the CPU check runs once, under pthread_once. */
+static pthread_once_t poly1305_avx2_once = PTHREAD_ONCE_INIT;
+static int poly1305_avx2_ok = 0;
+
+static void
+poly1305_avx2_init(void)
+{
+	__builtin_cpu_init();
+	poly1305_avx2_ok = __builtin_cpu_supports("avx2") ? 1 : 0;
+}
+#endif	/* POLY1305_AVX2 */
+
+void
+poly1305_auth(unsigned char out[POLY1305_TAGLEN], const unsigned char *m,
+    size_t inlen, const unsigned char key[POLY1305_KEYLEN])
+{
+	uint64_t r[3], h[3] = { 0, 0, 0 };
+	uint64_t t0, t1;
+	size_t nblocks;
+
+	/* clamp key */
+	t0 = U8TO64_LE(&key[0]);
+	t1 = U8TO64_LE(&key[8]);
+	r[0] = t0 & 0xffc0fffffffULL;
+	r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+	r[2] = (t1 >> 24) & 0x00ffffffc0fULL;
+
+#if defined(POLY1305_AVX2)
+	(void) pthread_once(&poly1305_avx2_once, poly1305_avx2_init);
+	if (poly1305_avx2_ok && inlen >= POLY1305_AVX2_MIN) {
+		uint32_t rp[4][5];
+		uint64_t p[3];
+		size_t ngroups = inlen / 64;
+		u_int i;
+
+		/* rp[i] = r^(i+1) */
+		p[0] = r[0]; p[1] = r[1]; p[2] = r[2];
+		for (i = 0; i < 4; ++i) {
+			if (i > 0)
+				poly1305_mul64(p, r);
+			t0 = p[1] >> 44; p[1] &= MASK44; p[2] += t0;
+			poly1305_to26(rp[i], p);
+		}
+		poly1305_blocks_avx2(h, rp, m, ngroups);
+		m += ngroups * 64;
+		inlen -= ngroups * 64;
+	}
+#endif
+
+	nblocks = inlen / 16;
+	poly1305_blocks64(h, r, m, nblocks);
+	m += nblocks * 16;
+	inlen -= nblocks * 16;
+	poly1305_finish64(out, h, r, m, inlen, key);
+}
+#else	/* !POLY1305_64 */
+void
+poly1305_auth(unsigned char out[POLY1305_TAGLEN], const unsigned char *m,
+    size_t inlen, const unsigned char key[POLY1305_KEYLEN])
+{
+	poly1305_auth_32(out, m, inlen, key);
+}
+#endif	/* POLY1305_64 */
@@ -38,6 +38,8 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
 
 #include "libssh/sshkey.h"
 #include "libssh/sshbuf.h"
@@ -73,7 +75,9 @@ boolean_t ebox_ctx_init = B_FALSE;
 char *ebox_pin;
 uint ebox_min_retries = 1;
 boolean_t ebox_batch = B_FALSE;
-struct piv_token *ebox_enum_tokens = NULL;
+
+/* We only need GUIDs to match boxes against; the rest is read on demand. */
+static const struct piv_enum_opts ebox_enum_opts = { PIV_READ_CHUID };
 
 #if defined(__sun)
 static GetLine *sungl = NULL;
@@ -156,6 +160,15 @@ pin_type_to_name(enum piv_pin type)
 	}
 }
 
+static void
+forget_pin(void)
+{
+	if (ebox_pin == NULL)
+		return;
+	freezero_locked(ebox_pin, strlen(ebox_pin) + 1);
+	ebox_pin = NULL;
+}
+
 void
 assert_pin(struct piv_token *pk, struct piv_slot *slot, const char *partname,
     boolean_t prompt)
@@ -183,31 +196,37 @@ again:
 	if (ebox_pin == NULL && prompt) {
 		char prompt[64];
 		char *guid = piv_token_shortid(pk);
+		char *pin;
 		snprintf(prompt, 64, fmt,
 		    pin_type_to_name(auth), guid, partname);
 		do {
-			ebox_pin = getpass(prompt);
-		} while (ebox_pin == NULL && errno == EINTR);
-		if ((ebox_pin == NULL && errno == ENXIO) ||
-		    strlen(ebox_pin) < 1) {
+			pin = getpass(prompt);
+		} while (pin == NULL && errno == EINTR);
+		if ((pin == NULL && errno == ENXIO) || strlen(pin) < 1) {
 			piv_txn_end(pk);
 			errx(EXIT_PIN, "a PIN is required to unlock "
 			    "token %s", guid);
-		} else if (ebox_pin == NULL) {
+		} else if (pin == NULL) {
 			piv_txn_end(pk);
 			err(EXIT_PIN, "failed to read PIN");
-		} else if (strlen(ebox_pin) < 4 || strlen(ebox_pin) > 8) {
+		} else if (strlen(pin) < 4 || strlen(pin) > 8) {
 			const char *charType = "digits";
 			if (piv_token_is_ykpiv(pk))
 				charType = "characters";
 			warnx("a valid PIN must be 4-8 %s in length",
 			    charType);
-			free(ebox_pin);
+			explicit_bzero(pin, strlen(pin));
 			free(guid);
-			ebox_pin = NULL;
 			goto again;
 		}
-		ebox_pin = strdup(ebox_pin);
+		/*
+		 * getpass() hands us a static buffer: keep our copy in the
+		 * locked pool and scrub the original.
+		 */
+		ebox_pin = calloc_locked(1, strlen(pin) + 1);
+		VERIFY(ebox_pin != NULL);
+		bcopy(pin, ebox_pin, strlen(pin));
+		explicit_bzero(pin, strlen(pin));
 		free(guid);
 	}
 	retries = ebox_min_retries;
@@ -219,8 +238,7 @@ again:
 			    "many invalid PIN attempts");
 		}
 		warnx("invalid PIN (%d attempts remaining)", retries);
-		free(ebox_pin);
-		ebox_pin = NULL;
+		forget_pin();
 		errf_free(er);
 		goto again;
 	} else if (errf_caused_by(er, "MinRetriesError")) {
@@ -241,49 +259,24 @@ again:
 	}
 }
 
-errf_t *
-local_unlock_agent(struct piv_ecdh_box *box)
+/* Asks the agent to rebox "box" using idl->keys[i], which must be its key. */
+static errf_t *
+agent_unlock_key(struct piv_ecdh_box *box, const struct ssh_identitylist *idl,
+    size_t i)
 {
 	struct piv_ecdh_box *rebox = NULL;
 	struct sshkey *pubkey, *temp = NULL, *temppub = NULL;
 	errf_t *err;
 	int rc;
-	uint i;
 	uint8_t code;
-	struct ssh_identitylist *idl = NULL;
 	struct sshbuf *req = NULL, *buf = NULL, *boxbuf = NULL, *reply = NULL;
 	struct sshbuf *datab = NULL;
-	boolean_t found = B_FALSE;
-
-	if (ebox_authfd == -1 &&
-	    (rc = ssh_get_authentication_socket(&ebox_authfd)) == -1) {
-		err = ssherrf("ssh_get_authentication_socket", rc);
-		goto out;
-	}
 
 	pubkey = piv_box_pubkey(box);
 
-	rc = ssh_fetch_identitylist(ebox_authfd, &idl);
-	if (rc) {
-		err = ssherrf("ssh_fetch_identitylist", rc);
-		goto out;
-	}
-
-	for (i = 0; i < idl->nkeys; ++i) {
-		if (sshkey_equal_public(idl->keys[i], pubkey)) {
-			found = B_TRUE;
-			break;
-		}
-	}
-	if (!found) {
-		err = errf("KeyNotFound", NULL, "No matching key found in "
-		    "ssh agent");
-		goto out;
-	}
-
-	rc = sshkey_generate(KEY_ECDSA, sshkey_size(pubkey), &temp);
+	rc = piv_ephem_take(sshkey_size(pubkey), &temp);
 	if (rc) {
-		err = ssherrf("sshkey_generate", rc);
+		err = ssherrf("piv_ephem_take", rc);
 		goto out;
 	}
 	if ((rc = sshkey_demote(temp, &temppub))) {
@@ -385,38 +378,266 @@ out:
 	sshkey_free(temp);
 	sshkey_free(temppub);
 
-	ssh_free_identitylist(idl);
 	piv_box_free(rebox);
 	return (err);
 }
 
+static errf_t *
+agent_unlock_idl(struct piv_ecdh_box *box, const struct ssh_identitylist *idl)
+{
+	struct sshkey *pubkey = piv_box_pubkey(box);
+	size_t i;
+
+	for (i = 0; i < idl->nkeys; ++i) {
+		if (sshkey_equal_public(idl->keys[i], pubkey))
+			return (agent_unlock_key(box, idl, i));
+	}
+	return (errf("KeyNotFound", NULL, "No matching key found in "
+	    "ssh agent"));
+}
+
+errf_t *
+local_unlock_agent(struct piv_ecdh_box *box)
+{
+	struct ssh_identitylist *idl = NULL;
+	errf_t *err;
+	int rc;
+
+	if (ebox_authfd == -1 &&
+	    (rc = ssh_get_authentication_socket(&ebox_authfd)) == -1) {
+		return (ssherrf("ssh_get_authentication_socket", rc));
+	}
+
+	rc = ssh_fetch_identitylist(ebox_authfd, &idl);
+	if (rc)
+		return (ssherrf("ssh_fetch_identitylist", rc));
+
+	err = agent_unlock_idl(box, idl);
+	ssh_free_identitylist(idl);
+	return (err);
+}
+
+/*
+ * An unlock session holds on to everything we learn about the local system
+ * while trying to open boxes: the list of tokens (enumerated once), an index
+ * of the slots we've matched boxes to (by key fingerprint, so a second box
+ * for the same key never touches the card to find it again), the identities
+ * in the ssh-agent, and an open transaction on each token we've used, with
+ * its PIN and CAK state.
+ *
+ * Transactions stay open until ebox_session_end(), so a run of boxes for the
+ * same token costs one SELECT, one CAK check and one PIN entry between them.
+ */
+struct ebox_session_token {
+	struct ebox_session_token	*est_next;
+	struct piv_token		*est_token;
+	boolean_t			 est_txn;
+	boolean_t			 est_pinned;
+	struct sshkey			*est_cak;
+};
+
+struct ebox_session_slot {
+	struct ebox_session_slot	*ess_next;
+	struct ebox_session_token	*ess_est;
+	struct piv_slot			*ess_slot;
+	uint8_t				*ess_fp;
+	size_t				 ess_fplen;
+};
+
+/* An agent identity, by key fingerprint. */
+struct ebox_session_agent_key {
+	uint8_t				 esak_fp[32];
+	size_t				 esak_idx;	/* into es_idl */
+};
+
+struct ebox_session {
+	boolean_t			 es_enumerated;
+	struct piv_token		*es_tokens;
+	struct piv_key_index		*es_keyidx;
+	struct ebox_session_token	*es_toks;
+	struct ebox_session_slot	*es_slots;
+	boolean_t			 es_agent_tried;
+	struct ssh_identitylist		*es_idl;
+	/* es_idl's keys, sorted by fingerprint */
+	struct ebox_session_agent_key	*es_agent_keys;
+	size_t				 es_agent_nkeys;
+	boolean_t			 es_agent_batch;
+};
+
+static struct ebox_session *ebox_local_sess = NULL;
+
+struct ebox_session *
+ebox_session_new(void)
+{
+	struct ebox_session *sess;
+
+	sess = calloc(1, sizeof (struct ebox_session));
+	if (sess == NULL)
+		err(EXIT_ERROR, "failed to allocate memory");
+	return (sess);
+}
+
+struct ebox_session *
+ebox_local_session(void)
+{
+	if (ebox_local_sess == NULL)
+		ebox_local_sess = ebox_session_new();
+	return (ebox_local_sess);
+}
+
+void
+ebox_session_end(struct ebox_session *sess)
+{
+	struct ebox_session_token *est;
+
+	for (est = sess->es_toks; est != NULL; est = est->est_next) {
+		if (est->est_txn)
+			piv_txn_end(est->est_token);
+		est->est_txn = B_FALSE;
+		est->est_pinned = B_FALSE;
+		sshkey_free(est->est_cak);
+		est->est_cak = NULL;
+	}
+	ssh_free_identitylist(sess->es_idl);
+	sess->es_idl = NULL;
+	free(sess->es_agent_keys);
+	sess->es_agent_keys = NULL;
+	sess->es_agent_nkeys = 0;
+	sess->es_agent_tried = B_FALSE;
+	sess->es_agent_batch = B_FALSE;
+}
+
+void
+ebox_session_flush(struct ebox_session *sess)
+{
+	struct ebox_session_token *est, *nest;
+	struct ebox_session_slot *ess, *ness;
+
+	ebox_session_end(sess);
+	for (ess = sess->es_slots; ess != NULL; ess = ness) {
+		ness = ess->ess_next;
+		free(ess->ess_fp);
+		free(ess);
+	}
+	sess->es_slots = NULL;
+	for (est = sess->es_toks; est != NULL; est = nest) {
+		nest = est->est_next;
+		free(est);
+	}
+	sess->es_toks = NULL;
+	piv_key_index_free(sess->es_keyidx);
+	sess->es_keyidx = NULL;
+	piv_release(sess->es_tokens);
+	sess->es_tokens = NULL;
+	sess->es_enumerated = B_FALSE;
+}
+
+void
+ebox_session_free(struct ebox_session *sess)
+{
+	if (sess == NULL)
+		return;
+	ebox_session_flush(sess);
+	if (sess == ebox_local_sess)
+		ebox_local_sess = NULL;
+	free(sess);
+}
+
 void
 release_context(void)
 {
-	if (ebox_enum_tokens != NULL)
-		piv_release(ebox_enum_tokens);
-	ebox_enum_tokens = NULL;
+	ebox_session_free(ebox_local_sess);
 	if (ebox_ctx_init)
 		SCardReleaseContext(ebox_ctx);
 	ebox_ctx_init = B_FALSE;
 }
 
 errf_t *
-local_unlock(struct piv_ecdh_box *box, struct sshkey *cak, const char *name)
+ebox_session_tokens(struct ebox_session *sess, struct piv_token **ptokens)
 {
-	errf_t *err, *agerr = NULL;
+	errf_t *err;
 	int rc;
-	struct piv_slot *slot, *cakslot;
-	struct piv_token *tokens = NULL, *token;
 
-	if (ebox_authfd != -1 ||
-	    ssh_get_authentication_socket(&ebox_authfd) != -1) {
-		agerr = local_unlock_agent(box);
-		if (agerr == ERRF_OK)
+	if (!ebox_ctx_init) {
+		rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL,
+		    &ebox_ctx);
+		if (rc != SCARD_S_SUCCESS) {
+			errfx(EXIT_ERROR, pcscerrf("SCardEstablishContext", rc),
+			    "failed to initialise libpcsc");
+		}
+		ebox_ctx_init = B_TRUE;
+	}
+
+	if (!sess->es_enumerated) {
+		if ((err = piv_enumerate_opts(ebox_ctx, &ebox_enum_opts,
+		    &sess->es_tokens)))
+			return (err);
+		if ((err = piv_key_index_new(sess->es_tokens,
+		    &sess->es_keyidx))) {
+			piv_release(sess->es_tokens);
+			sess->es_tokens = NULL;
+			return (err);
+		}
+		sess->es_enumerated = B_TRUE;
+	}
+	*ptokens = sess->es_tokens;
+	return (ERRF_OK);
+}
+
+static struct ebox_session_token *
+session_token(struct ebox_session *sess, struct piv_token *token)
+{
+	struct ebox_session_token *est;
+
+	for (est = sess->es_toks; est != NULL; est = est->est_next) {
+		if (est->est_token == token)
+			return (est);
+	}
+	est = calloc(1, sizeof (struct ebox_session_token));
+	if (est == NULL)
+		err(EXIT_ERROR, "failed to allocate memory");
+	est->est_token = token;
+	est->est_next = sess->es_toks;
+	sess->es_toks = est;
+	return (est);
+}
+
+/*
+ * Finds the token and slot for "box", from the index if we've seen its key
+ * before, and otherwise by searching the enumerated tokens (by GUID and then
+ * in the session's piv_key_index). Takes ownership of "agerr", an error
+ * from trying the agent first (if any).
+ */
+static errf_t *
+session_find_slot(struct ebox_session *sess, struct piv_ecdh_box *box,
+    errf_t *agerr, struct ebox_session_slot **pess)
+{
+	struct ebox_session_slot *ess;
+	struct piv_token *tokens, *token;
+	struct piv_slot *slot;
+	uint8_t *fp = NULL;
+	size_t fplen;
+	errf_t *err;
+	int rc;
+
+	rc = sshkey_fingerprint_raw(piv_box_pubkey(box), SSH_DIGEST_SHA256,
+	    &fp, &fplen);
+	if (rc) {
+		errf_free(agerr);
+		return (ssherrf("sshkey_fingerprint_raw", rc));
+	}
+	for (ess = sess->es_slots; ess != NULL; ess = ess->ess_next) {
+		if (ess->ess_fplen == fplen &&
+		    bcmp(ess->ess_fp, fp, fplen) == 0) {
+			free(fp);
+			errf_free(agerr);
+			*pess = ess;
 			return (ERRF_OK);
+		}
 	}
 
 	if (!piv_box_has_guidslot(box)) {
+		free(fp);
 		if (agerr) {
 			return (errf("AgentError", agerr, "ssh-agent unlock "
 			    "failed, and box does not have GUID/slot info"));
@@ -425,104 +646,642 @@ local_unlock(struct piv_ecdh_box *box, struct sshkey *cak, const char *name)
 		    "and slot information, can't unlock with local hardware"));
 	}
 
-	if (!ebox_ctx_init) {
-		rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL,
-		    &ebox_ctx);
-		if (rc != SCARD_S_SUCCESS) {
-			errfx(EXIT_ERROR, pcscerrf("SCardEstablishContext", rc),
-			    "failed to initialise libpcsc");
-		}
-	}
-
-	/*
-	 * We might try to call local_unlock on a whole lot of configs in a
-	 * row (looking for one that works). If we resort to enumerating all
-	 * the tokens on the system at any point, cache them in
-	 * ebox_enum_tokens so that things are a bit faster.
-	 */
-	if (ebox_enum_tokens != NULL) {
-		tokens = ebox_enum_tokens;
-		err = NULL;
-	} else {
-		err = piv_find(ebox_ctx, piv_box_guid(box), GUID_LEN, &tokens);
-		if (errf_caused_by(err, "NotFoundError")) {
+	if ((err = ebox_session_tokens(sess, &tokens))) {
+		free(fp);
+		if (agerr) {
 			errf_free(err);
-			err = piv_enumerate(ebox_ctx, &tokens);
-			if (err && agerr) {
-				err = errf("AgentError", agerr, "ssh-agent "
-				"unlock failed, and no PIV tokens were "
-				"detected on the local system");
-			} else {
-				ebox_enum_tokens = tokens;
-			}
+			return (errf("AgentError", agerr, "ssh-agent "
+			    "unlock failed, and no PIV tokens were "
+			    "detected on the local system"));
 		}
+		return (err);
 	}
 	errf_free(agerr);
-	if (err)
-		goto out;
 
-	err = piv_box_find_token(tokens, box, &token, &slot);
+	err = piv_box_find_token_index(sess->es_keyidx, box, &token, &slot);
 	if (err) {
-		err = errf("LocalUnlockError", err, "failed to find token "
+		free(fp);
+		return (errf("LocalUnlockError", err, "failed to find token "
 		    "with GUID %s and key for box",
-		    piv_box_guid_hex(box));
-		goto out;
+		    piv_box_guid_hex(box)));
 	}
 
-	if ((err = piv_txn_begin(token)))
-		goto out;
-	if ((err = piv_select(token))) {
-		piv_txn_end(token);
-		goto out;
+	ess = calloc(1, sizeof (struct ebox_session_slot));
+	if (ess == NULL) {
+		free(fp);
+		return (ERRF_NOMEM);
 	}
+	ess->ess_est = session_token(sess, token);
+	ess->ess_slot = slot;
+	ess->ess_fp = fp;
+	ess->ess_fplen = fplen;
+	ess->ess_next = sess->es_slots;
+	sess->es_slots = ess;
 
-	if (cak != NULL) {
-		cakslot = piv_get_slot(token, PIV_SLOT_CARD_AUTH);
-		if (cakslot == NULL) {
-			err = piv_read_cert(token, PIV_SLOT_CARD_AUTH);
-			if (err) {
-				err = errf("CardAuthenticationError", err,
-				    "Failed to validate CAK");
-				goto out;
-			}
-			cakslot = piv_get_slot(token, PIV_SLOT_CARD_AUTH);
-		}
-		if (cakslot == NULL) {
-			err = errf("CardAuthenticationError", NULL,
-			    "Failed to validate CAK");
-			goto out;
+	*pess = ess;
+	return (ERRF_OK);
+}
+
+/*
+ * Makes sure we hold a transaction on the token with the applet selected,
+ * and that it has proven it holds "cak" (if given) during it.
+ */
+static errf_t *
+session_txn(struct ebox_session_token *est, struct sshkey *cak)
+{
+	struct piv_token *token = est->est_token;
+	struct piv_slot *cakslot;
+	errf_t *err;
+	int rc;
+
+	if (!est->est_txn) {
+		if ((err = piv_txn_begin(token)))
+			return (err);
+		if ((err = piv_select(token))) {
+			piv_txn_end(token);
+			return (err);
 		}
-		err = piv_auth_key(token, cakslot, cak);
+		est->est_txn = B_TRUE;
+	}
+
+	if (cak == NULL)
+		return (ERRF_OK);
+	if (est->est_cak != NULL && sshkey_equal_public(est->est_cak, cak))
+		return (ERRF_OK);
+
+	cakslot = piv_get_slot(token, PIV_SLOT_CARD_AUTH);
+	if (cakslot == NULL) {
+		err = piv_read_cert(token, PIV_SLOT_CARD_AUTH);
 		if (err) {
-			err = errf("CardAuthenticationError", err,
-			    "Failed to validate CAK");
-			goto out;
+			return (errf("CardAuthenticationError", err,
+			    "Failed to validate CAK"));
 		}
+		cakslot = piv_get_slot(token, PIV_SLOT_CARD_AUTH);
+	}
+	if (cakslot == NULL) {
+		return (errf("CardAuthenticationError", NULL,
+		    "Failed to validate CAK"));
 	}
+	err = piv_auth_key(token, cakslot, cak);
+	if (err) {
+		return (errf("CardAuthenticationError", err,
+		    "Failed to validate CAK"));
+	}
+	sshkey_free(est->est_cak);
+	est->est_cak = NULL;
+	if ((rc = sshkey_demote(cak, &est->est_cak)))
+		return (ssherrf("sshkey_demote", rc));
+	return (ERRF_OK);
+}
 
+static errf_t *
+session_local_unlock(struct ebox_session *sess, struct piv_ecdh_box *box,
+    struct sshkey *cak, const char *name, errf_t *agerr)
+{
+	struct ebox_session_slot *ess = NULL;
+	struct ebox_session_token *est;
 	boolean_t prompt = B_FALSE;
+	errf_t *err;
+
+	if ((err = session_find_slot(sess, box, agerr, &ess)))
+		return (err);
+	est = ess->ess_est;
+	if ((err = session_txn(est, cak)))
+		return (err);
+
+	/*
+	 * Once the PIN is verified it stays that way for the rest of the
+	 * transaction, so we only need to send it again if the card says so.
+	 */
 pin:
-	assert_pin(token, slot, name, prompt);
-	err = piv_box_open(token, slot, box);
+	if (!est->est_pinned) {
+		assert_pin(est->est_token, ess->ess_slot, name, prompt);
+		est->est_pinned = (ebox_pin != NULL);
+	}
+	err = piv_box_open(est->est_token, ess->ess_slot, box);
 	if (errf_caused_by(err, "PermissionError") && !prompt && !ebox_batch) {
 		errf_free(err);
 		prompt = B_TRUE;
+		est->est_pinned = B_FALSE;
 		goto pin;
 	} else if (err) {
-		piv_txn_end(token);
-		err = errf("LocalUnlockError", err, "failed to unlock box");
+		return (errf("LocalUnlockError", err, "failed to unlock box"));
+	}
+
+	return (ERRF_OK);
+}
+
+errf_t *
+ebox_session_local_unlock(struct ebox_session *sess, struct piv_ecdh_box *box,
+    struct sshkey *cak, const char *name)
+{
+	return (session_local_unlock(sess, box, cak, name, NULL));
+}
+
+/*
+ * Asks the agent which extensions it has, and returns B_TRUE if "name" is
+ * one of them. Agents which don't know "query" just fail it.
+ */
+static boolean_t
+agent_has_extension(const char *name)
+{
+	struct sshbuf *req = NULL, *reply = NULL;
+	boolean_t found = B_FALSE;
+	uint8_t code;
+	uint32_t n, i;
+	char *ext;
+	int rc;
+
+	req = sshbuf_new();
+	reply = sshbuf_new();
+	if (req == NULL || reply == NULL)
+		goto out;
+	if (sshbuf_put_u8(req, SSH2_AGENTC_EXTENSION) ||
+	    sshbuf_put_cstring(req, "query") ||
+	    sshbuf_put_u32(req, 0))
+		goto out;
+	if ((rc = ssh_request_reply(ebox_authfd, req, reply)))
+		goto out;
+	if (sshbuf_get_u8(reply, &code) || code != SSH_AGENT_SUCCESS ||
+	    sshbuf_get_u32(reply, &n))
 		goto out;
+	for (i = 0; i < n && !found; ++i) {
+		if (sshbuf_get_cstring(reply, &ext, NULL))
+			goto out;
+		found = (strcmp(ext, name) == 0);
+		free(ext);
+	}
+out:
+	sshbuf_free(req);
+	sshbuf_free(reply);
+	return (found);
+}
+
+static int
+agent_key_cmp(const void *a, const void *b)
+{
+	const struct ebox_session_agent_key *ka = a, *kb = b;
+	return (bcmp(ka->esak_fp, kb->esak_fp, sizeof (ka->esak_fp)));
+}
+
+/*
+ * Sorts the agent's identities by fingerprint, so that we can find the one
+ * for each box with a binary search rather than comparing its key to all of
+ * them.
+ */
+static void
+session_agent_index(struct ebox_session *sess)
+{
+	struct ebox_session_agent_key *ak;
+	uint8_t *fp;
+	size_t i, fplen;
+	int rc;
+
+	sess->es_agent_keys = calloc(sess->es_idl->nkeys,
+	    sizeof (struct ebox_session_agent_key));
+	if (sess->es_agent_keys == NULL)
+		err(EXIT_ERROR, "failed to allocate memory");
+	for (i = 0; i < sess->es_idl->nkeys; ++i) {
+		rc = sshkey_fingerprint_raw(sess->es_idl->keys[i],
+		    SSH_DIGEST_SHA256, &fp, &fplen);
+		if (rc)
+			continue;
+		VERIFY3U(fplen, ==, sizeof (ak->esak_fp));
+		ak = &sess->es_agent_keys[sess->es_agent_nkeys++];
+		bcopy(fp, ak->esak_fp, fplen);
+		ak->esak_idx = i;
+		free(fp);
+	}
+	qsort(sess->es_agent_keys, sess->es_agent_nkeys,
+	    sizeof (struct ebox_session_agent_key), agent_key_cmp);
+}
+
+/*
+ * Returns B_TRUE if the session has an agent to talk to, fetching its
+ * identities (and what it supports) the first time.
+ */
+static boolean_t
+session_agent(struct ebox_session *sess)
+{
+	errf_t *err;
+	int rc;
+
+	if (!sess->es_agent_tried) {
+		sess->es_agent_tried = B_TRUE;
+		if (ebox_authfd != -1 ||
+		    ssh_get_authentication_socket(&ebox_authfd) != -1) {
+			rc = ssh_fetch_identitylist(ebox_authfd,
+			    &sess->es_idl);
+			if (rc) {
+				err = ssherrf("ssh_fetch_identitylist", rc);
+				bunyan_log(BNY_DEBUG, "failed to list "
+				    "ssh-agent identities",
+				    "error", BNY_ERF, err, NULL);
+				errf_free(err);
+				sess->es_idl = NULL;
+			}
+		}
+		if (sess->es_idl != NULL && sess->es_idl->nkeys > 0) {
+			session_agent_index(sess);
+			sess->es_agent_batch = agent_has_extension(
+			    "ecdh-rebox-batch@joyent.com");
+		}
+	}
+	return (sess->es_idl != NULL);
+}
+
+/*
+ * Finds "key" among the agent's identities, setting *pidx to its index in
+ * es_idl.
+ */
+static boolean_t
+session_agent_key(struct ebox_session *sess, const struct sshkey *key,
+    size_t *pidx)
+{
+	struct ebox_session_agent_key ak, *found;
+	uint8_t *fp;
+	size_t fplen;
+	int rc;
+
+	if (!session_agent(sess) || sess->es_agent_nkeys == 0)
+		return (B_FALSE);
+	rc = sshkey_fingerprint_raw(key, SSH_DIGEST_SHA256, &fp, &fplen);
+	if (rc)
+		return (B_FALSE);
+	VERIFY3U(fplen, ==, sizeof (ak.esak_fp));
+	bcopy(fp, ak.esak_fp, fplen);
+	free(fp);
+	found = bsearch(&ak, sess->es_agent_keys, sess->es_agent_nkeys,
+	    sizeof (struct ebox_session_agent_key), agent_key_cmp);
+	if (found == NULL ||
+	    !sshkey_equal_public(sess->es_idl->keys[found->esak_idx], key))
+		return (B_FALSE);
+	*pidx = found->esak_idx;
+	return (B_TRUE);
+}
+
+errf_t *
+ebox_session_agent_unlock(struct ebox_session *sess, struct piv_ecdh_box *box)
+{
+	size_t i;
+
+	if (!session_agent(sess))
+		return (errf("AgentError", NULL, "no ssh-agent available"));
+	if (!session_agent_key(sess, piv_box_pubkey(box), &i)) {
+		return (errf("KeyNotFound", NULL, "No matching key found in "
+		    "ssh agent"));
+	}
+	return (agent_unlock_key(box, sess->es_idl, i));
+}
+
+static boolean_t
+session_agent_has_key(struct ebox_session *sess, const struct sshkey *key)
+{
+	size_t i;
+
+	return (session_agent_key(sess, key, &i));
+}
+
+/*
+ * Sends boxes[0..n-1] (which must all be for the same key) to the agent in
+ * one ecdh-rebox-batch@joyent.com request, and opens whatever comes back.
+ */
+static errf_t *
+agent_rebox_batch(struct piv_ecdh_box **boxes, boolean_t *opened, size_t n)
+{
+	struct piv_ecdh_box *rebox = NULL;
+	struct sshkey *temp = NULL, *temppub = NULL;
+	struct sshbuf *req = NULL, *buf = NULL, *boxbuf = NULL, *reply = NULL;
+	struct sshbuf *datab = NULL;
+	errf_t *err;
+	int rc;
+	size_t i;
+	uint8_t code;
+
+	rc = piv_ephem_take(sshkey_size(piv_box_pubkey(boxes[0])), &temp);
+	if (rc) {
+		err = ssherrf("piv_ephem_take", rc);
+		goto out;
+	}
+	if ((rc = sshkey_demote(temp, &temppub))) {
+		err = ssherrf("sshkey_demote", rc);
+		goto out;
+	}
+
+	req = sshbuf_new();
+	reply = sshbuf_new();
+	buf = sshbuf_new();
+	boxbuf = sshbuf_new();
+	if (req == NULL || reply == NULL || buf == NULL || boxbuf == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+
+	if ((rc = sshbuf_put_u8(req, SSH2_AGENTC_EXTENSION)) ||
+	    (rc = sshbuf_put_cstring(req, "ecdh-rebox-batch@joyent.com"))) {
+		err = ssherrf("sshbuf_put_cstring", rc);
+		goto out;
+	}
+	if ((rc = sshkey_puts(temppub, buf)) ||
+	    (rc = sshbuf_put_u32(buf, 0)) ||
+	    (rc = sshbuf_put_u32(buf, n))) {
+		err = ssherrf("sshkey_puts", rc);
+		goto out;
+	}
+	for (i = 0; i < n; ++i) {
+		sshbuf_reset(boxbuf);
+		if ((err = sshbuf_put_piv_box(boxbuf, boxes[i])))
+			goto out;
+		/* No GUID or slot for the new boxes, as with ecdh-rebox. */
+		if ((rc = sshbuf_put_stringb(buf, boxbuf)) ||
+		    (rc = sshbuf_put_u32(buf, 0)) ||
+		    (rc = sshbuf_put_u8(buf, 0))) {
+			err = ssherrf("sshbuf_put_stringb", rc);
+			goto out;
+		}
+	}
+	if ((rc = sshbuf_put_stringb(req, buf))) {
+		err = ssherrf("sshbuf_put_stringb", rc);
+		goto out;
+	}
+
+	fprintf(stderr, "Using ssh-agent to unlock %zu boxes...\n", n);
+	if ((rc = ssh_request_reply(ebox_authfd, req, reply))) {
+		err = ssherrf("ssh_request_reply", rc);
+		goto out;
+	}
+	if ((rc = sshbuf_get_u8(reply, &code))) {
+		err = ssherrf("sshbuf_get_u8", rc);
+		goto out;
+	}
+	if (code != SSH_AGENT_SUCCESS) {
+		err = errf("SSHAgentError", NULL, "SSH agent returned "
+		    "message code %d to rebox batch request", (int)code);
+		goto out;
+	}
+
+	for (i = 0; i < n; ++i) {
+		sshbuf_reset(boxbuf);
+		if ((rc = sshbuf_get_stringb(reply, boxbuf))) {
+			err = ssherrf("sshbuf_get_stringb", rc);
+			goto out;
+		}
+		if (sshbuf_len(boxbuf) == 0)
+			continue;
+		if ((err = sshbuf_get_piv_box(boxbuf, &rebox)) ||
+		    (err = piv_box_open_offline(temp, rebox)) ||
+		    (err = piv_box_take_datab(rebox, &datab)) ||
+		    (err = piv_box_set_datab(boxes[i], datab))) {
+			bunyan_log(BNY_WARN, "failed to open reboxed data "
+			    "from agent", "error", BNY_ERF, err, NULL);
+			errf_free(err);
+		} else {
+			opened[i] = B_TRUE;
+		}
+		sshbuf_free(datab);
+		datab = NULL;
+		piv_box_free(rebox);
+		rebox = NULL;
 	}
 
-	piv_txn_end(token);
 	err = ERRF_OK;
 
 out:
-	if (tokens != ebox_enum_tokens)
-		piv_release(tokens);
+	sshbuf_free(req);
+	sshbuf_free(reply);
+	sshbuf_free(buf);
+	sshbuf_free(boxbuf);
+	sshkey_free(temp);
+	sshkey_free(temppub);
+	return (err);
+}
+
+void
+ebox_session_agent_unlock_batch(struct ebox_session *sess,
+    struct piv_ecdh_box **boxes, boolean_t *opened, size_t n)
+{
+	struct piv_ecdh_box **gboxes;
+	boolean_t *gopened, *done;
+	size_t *idx, *keyidx;
+	size_t k, i, j, ng, off, chunk;
+	errf_t *error;
+
+	if (!session_agent(sess))
+		return;
+
+	gboxes = calloc(n, sizeof (struct piv_ecdh_box *));
+	gopened = calloc(n, sizeof (boolean_t));
+	done = calloc(n, sizeof (boolean_t));
+	idx = calloc(n, sizeof (size_t));
+	keyidx = calloc(n, sizeof (size_t));
+	if (gboxes == NULL || gopened == NULL || done == NULL || idx == NULL ||
+	    keyidx == NULL)
+		err(EXIT_ERROR, "failed to allocate memory");
+
+	/* Look up each box's key in the agent once, up front. */
+	for (i = 0; i < n; ++i) {
+		done[i] = opened[i] ||
+		    !session_agent_key(sess, piv_box_pubkey(boxes[i]),
+		    &keyidx[i]);
+	}
+
+	/*
+	 * Every box for the same key is on the same token, so each of these
+	 * groups can go in one request.
+	 */
+	for (j = 0; j < n; ++j) {
+		if (done[j])
+			continue;
+		k = keyidx[j];
+		ng = 0;
+		for (i = j; i < n; ++i) {
+			if (done[i] || keyidx[i] != k)
+				continue;
+			done[i] = B_TRUE;
+			idx[ng] = i;
+			gboxes[ng] = boxes[i];
+			gopened[ng] = B_FALSE;
+			++ng;
+		}
+		for (off = 0; off < ng; off += chunk) {
+			chunk = ng - off;
+			if (chunk > EBOX_REBOX_BATCH)
+				chunk = EBOX_REBOX_BATCH;
+			if (!sess->es_agent_batch) {
+				for (i = off; i < off + chunk; ++i) {
+					error = agent_unlock_key(gboxes[i],
+					    sess->es_idl, k);
+					gopened[i] = (error == ERRF_OK);
+					errf_free(error);
+				}
+				continue;
+			}
+			error = agent_rebox_batch(&gboxes[off],
+			    &gopened[off], chunk);
+			if (error) {
+				bunyan_log(BNY_DEBUG, "agent rebox batch "
+				    "failed", "error", BNY_ERF, error, NULL);
+				errf_free(error);
+			}
+		}
+		for (i = 0; i < ng; ++i) {
+			if (gopened[i])
+				opened[idx[i]] = B_TRUE;
+		}
+	}
+
+	free(gboxes);
+	free(gopened);
+	free(done);
+	free(idx);
+	free(keyidx);
+}
+
+errf_t *
+ebox_session_unlock(struct ebox_session *sess, struct piv_ecdh_box *box,
+    struct sshkey *cak, const char *name)
+{
+	errf_t *agerr;
+
+	agerr = ebox_session_agent_unlock(sess, box);
+	if (agerr == ERRF_OK)
+		return (ERRF_OK);
+	if (sess->es_idl == NULL) {
+		errf_free(agerr);
+		agerr = NULL;
+	}
+	return (session_local_unlock(sess, box, cak, name, agerr));
+}
+
+errf_t *
+local_unlock(struct piv_ecdh_box *box, struct sshkey *cak, const char *name)
+{
+	struct ebox_session *sess = ebox_local_session();
+	errf_t *err;
+
+	err = ebox_session_unlock(sess, box, cak, name);
+	ebox_session_end(sess);
 	return (err);
 }
 
+errf_t *
+load_primary_part(struct ebox *ebox, struct ebox_config *config,
+    struct ebox_part **ppart)
+{
+	struct ebox_part *part;
+	errf_t *err;
+
+	if ((err = ebox_config_load(ebox, config)))
+		return (err);
+	part = ebox_config_next_part(config, NULL);
+	if ((err = ebox_part_load(ebox, part)))
+		return (err);
+	*ppart = part;
+	return (ERRF_OK);
+}
+
+void
+local_unlock_eboxes(struct ebox **eboxes, boolean_t *unlocked, size_t n)
+{
+	struct ebox_session *sess = ebox_local_session();
+	struct ebox_config *config;
+	struct ebox_part *part;
+	struct ebox_tpl_part *tpart;
+	struct ebox_config **aconfigs;
+	struct piv_ecdh_box **aboxes;
+	boolean_t *aopened;
+	size_t *aidx;
+	size_t i, na = 0;
+	errf_t *error;
+
+	/*
+	 * First, everything the agent has a key for, in as few requests as we
+	 * can (one per key if it supports ecdh-rebox-batch).
+	 */
+	aconfigs = calloc(n, sizeof (struct ebox_config *));
+	aboxes = calloc(n, sizeof (struct piv_ecdh_box *));
+	aopened = calloc(n, sizeof (boolean_t));
+	aidx = calloc(n, sizeof (size_t));
+	if (aconfigs == NULL || aboxes == NULL || aopened == NULL ||
+	    aidx == NULL)
+		err(EXIT_ERROR, "failed to allocate memory");
+	for (i = 0; i < n; ++i) {
+		if (unlocked[i])
+			continue;
+		config = NULL;
+		while ((config = ebox_next_config(eboxes[i], config)) != NULL) {
+			if (ebox_tpl_config_type(ebox_config_tpl(config)) !=
+			    EBOX_PRIMARY)
+				continue;
+			error = load_primary_part(eboxes[i], config, &part);
+			if (error) {
+				bunyan_log(BNY_DEBUG, "failed to load primary "
+				    "config", "error", BNY_ERF, error, NULL);
+				errf_free(error);
+				continue;
+			}
+			if (!session_agent_has_key(sess,
+			    piv_box_pubkey(ebox_part_box(part))))
+				continue;
+			aconfigs[na] = config;
+			aboxes[na] = ebox_part_box(part);
+			aidx[na] = i;
+			++na;
+			break;
+		}
+	}
+	if (na > 0)
+		ebox_session_agent_unlock_batch(sess, aboxes, aopened, na);
+	for (i = 0; i < na; ++i) {
+		if (!aopened[i])
+			continue;
+		error = ebox_unlock(eboxes[aidx[i]], aconfigs[i]);
+		if (error) {
+			bunyan_log(BNY_DEBUG, "ebox_unlock failed after "
+			    "agent batch", "error", BNY_ERF, error, NULL);
+			errf_free(error);
+			continue;
+		}
+		unlocked[aidx[i]] = B_TRUE;
+	}
+	free(aconfigs);
+	free(aboxes);
+	free(aopened);
+	free(aidx);
+
+	for (i = 0; i < n; ++i) {
+		if (unlocked[i])
+			continue;
+		config = NULL;
+		while ((config = ebox_next_config(eboxes[i], config)) != NULL) {
+			if (ebox_tpl_config_type(ebox_config_tpl(config)) !=
+			    EBOX_PRIMARY)
+				continue;
+			error = load_primary_part(eboxes[i], config, &part);
+			if (error == ERRF_OK) {
+				tpart = ebox_part_tpl(part);
+				error = ebox_session_unlock(sess,
+				    ebox_part_box(part),
+				    ebox_tpl_part_cak(tpart),
+				    ebox_tpl_part_name(tpart));
+			}
+			if (error == ERRF_OK)
+				error = ebox_unlock(eboxes[i], config);
+			if (error) {
+				bunyan_log(BNY_DEBUG, "primary config failed "
+				    "in batch unlock",
+				    "error", BNY_ERF, error, NULL);
+				errf_free(error);
+				continue;
+			}
+			unlocked[i] = B_TRUE;
+			break;
+		}
+	}
+
+	ebox_session_end(sess);
+}
+
 void
 add_answer(struct question *q, struct answer *a)
 {
@@ -980,89 +1739,360 @@ partagain:
 			free(line);
 			goto partagain;
 		}
-		fprintf(stderr, "Device box decrypted ok.\n");
-		++ncur;
-		/*
-		 * Forget any PIN the user entered, we'll be talking to a
-		 * different device next.
-		 */
-		free(ebox_pin);
-		ebox_pin = NULL;
+		fprintf(stderr, "Device box decrypted ok.\n");
+		++ncur;
+		/*
+		 * Forget any PIN the user entered, we'll be talking to a
+		 * different device next.
+		 */
+		forget_pin();
+	}
+
+	buf = sshbuf_new();
+	VERIFY(buf != NULL);
+
+	part = NULL;
+	while ((part = ebox_config_next_part(config, part)) != NULL) {
+		state = (struct part_state *)ebox_part_private(part);
+		if (state->ps_intent != INTENT_CHAL_RESP)
+			continue;
+		state->ps_intent = INTENT_NONE;
+		make_answer_text_for_pstate(state);
+		state->ps_intent = INTENT_CHAL_RESP;
+		error = ebox_gen_challenge(config, part,
+		    "Recovering %s with part %s", what, state->ps_ans->a_text);
+		if (error) {
+			sshbuf_free(buf);
+			return (error);
+		}
+		chal = ebox_part_challenge(part);
+		sshbuf_reset(buf);
+		error = sshbuf_put_ebox_challenge(buf, chal);
+		if (error) {
+			sshbuf_free(buf);
+			return (error);
+		}
+		b64 = sshbuf_dtob64(buf);
+		VERIFY(b64 != NULL);
+		fprintf(stderr, "-- Begin challenge for remote device %s --\n",
+		    state->ps_ans->a_text);
+		printwrap(stderr, b64, BASE64_LINE_LEN);
+		fprintf(stderr, "-- End challenge for remote device %s --\n",
+		    state->ps_ans->a_text);
+		free(b64);
+		b64 = NULL;
+
+		words = ebox_challenge_words(chal, &wordlen);
+		fprintf(stderr, "\nVERIFICATION WORDS for %s:",
+		    state->ps_ans->a_text);
+		for (i = 0; i < wordlen; ++i)
+			fprintf(stderr, " %s", wordlist[words[i]]);
+		fprintf(stderr, "\n\n");
+	}
+
+	while (ncur < n) {
+		fprintf(stderr, "\nRemaining responses required:\n");
+		part = NULL;
+		while ((part = ebox_config_next_part(config, part)) != NULL) {
+			state = (struct part_state *)ebox_part_private(part);
+			if (state->ps_intent != INTENT_CHAL_RESP)
+				continue;
+			fprintf(stderr, "  * %s\n", state->ps_ans->a_text);
+		}
+		fprintf(stderr, "\n-- Enter response followed by newline --\n");
+		read_b64_box(&box);
+		fprintf(stderr, "-- End response --\n");
+		error = ebox_challenge_response(config, box, &part);
+		if (error) {
+			warnfx(error, "failed to parse input data as a "
+			    "valid response");
+			continue;
+		}
+		state = (struct part_state *)ebox_part_private(part);
+		if (state->ps_intent != INTENT_CHAL_RESP) {
+			fprintf(stderr, "Response already processed for "
+			    "device %s!\n", state->ps_ans->a_text);
+			continue;
+		}
+		fprintf(stderr, "Device box for %s decrypted ok.\n",
+		    state->ps_ans->a_text);
+		state->ps_intent = INTENT_NONE;
+		++ncur;
+	}
+	sshbuf_free(buf);
+	return (NULL);
+}
+
+/*
+ * The parts of the recovery configs being recovered in bulk which belong to
+ * one device, and the challenge bundle sent to it.
+ */
+struct recov_dev {
+	struct ebox_part	**rd_parts;
+	size_t			 *rd_ebox;	/* index of each part's ebox */
+	boolean_t		 *rd_got;	/* part has been answered */
+	size_t			  rd_n;
+	size_t			  rd_alloc;
+	const char		 *rd_name;
+	struct ebox_challenge	 *rd_chal;
+	boolean_t		  rd_done;
+};
+
+static void
+recov_dev_add(struct recov_dev *rd, struct ebox_part *part, size_t i)
+{
+	if (rd->rd_n >= rd->rd_alloc) {
+		rd->rd_alloc = (rd->rd_alloc == 0) ? 16 : rd->rd_alloc * 2;
+		rd->rd_parts = recallocarray(rd->rd_parts, rd->rd_n,
+		    rd->rd_alloc, sizeof (struct ebox_part *));
+		rd->rd_ebox = recallocarray(rd->rd_ebox, rd->rd_n,
+		    rd->rd_alloc, sizeof (size_t));
+		rd->rd_got = recallocarray(rd->rd_got, rd->rd_n,
+		    rd->rd_alloc, sizeof (boolean_t));
+		if (rd->rd_parts == NULL || rd->rd_ebox == NULL ||
+		    rd->rd_got == NULL)
+			err(EXIT_ERROR, "failed to allocate memory");
+	}
+	rd->rd_parts[rd->rd_n] = part;
+	rd->rd_ebox[rd->rd_n] = i;
+	++rd->rd_n;
+}
+
+errf_t *
+interactive_recovery_batch(struct ebox **eboxes, boolean_t *recovered,
+    size_t n, const char *what)
+{
+	struct ebox_config **configs = NULL, *config;
+	struct ebox_part *part, **answered = NULL;
+	struct recov_dev *devs = NULL, *rd;
+	struct ebox **rboxes = NULL;
+	struct ebox_config **rconfigs = NULL;
+	struct piv_ecdh_box *box;
+	struct sshkey *pubkey;
+	struct sshbuf *buf = NULL;
+	size_t *have = NULL, *need = NULL;
+	errf_t **errs = NULL;
+	size_t i, j, k, ndevs = 0, adevs = 0, nleft = 0, nans, nr;
+	const uint8_t *words;
+	size_t wordlen;
+	char *b64;
+	errf_t *error = ERRF_OK;
+
+	if (ebox_batch) {
+		return (errf("InteractiveError", NULL,
+		    "interactive recovery is required but the -b batch option "
+		    "was provided"));
+	}
+
+	configs = calloc(n, sizeof (struct ebox_config *));
+	have = calloc(n, sizeof (size_t));
+	need = calloc(n, sizeof (size_t));
+	if (configs == NULL || have == NULL || need == NULL)
+		err(EXIT_ERROR, "failed to allocate memory");
+
+	/*
+	 * Take the first recovery config of each ebox, and sort its parts out
+	 * by device key.
+	 */
+	for (i = 0; i < n; ++i) {
+		if (recovered[i])
+			continue;
+		if ((error = ebox_load(eboxes[i])))
+			goto out;
+		config = NULL;
+		while ((config = ebox_next_config(eboxes[i], config)) != NULL) {
+			if (ebox_tpl_config_type(ebox_config_tpl(config)) ==
+			    EBOX_RECOVERY)
+				break;
+		}
+		if (config == NULL)
+			continue;
+		configs[i] = config;
+		need[i] = ebox_tpl_config_n(ebox_config_tpl(config));
+		++nleft;
+		part = NULL;
+		while ((part = ebox_config_next_part(config, part)) != NULL) {
+			pubkey = piv_box_pubkey(ebox_part_box(part));
+			for (k = 0; k < ndevs; ++k) {
+				if (sshkey_equal_public(pubkey, piv_box_pubkey(
+				    ebox_part_box(devs[k].rd_parts[0]))))
+					break;
+			}
+			if (k == ndevs && ndevs >= adevs) {
+				adevs = (adevs == 0) ? 8 : adevs * 2;
+				devs = recallocarray(devs, ndevs, adevs,
+				    sizeof (struct recov_dev));
+				if (devs == NULL) {
+					err(EXIT_ERROR, "failed to allocate "
+					    "memory");
+				}
+			}
+			if (k == ndevs) {
+				devs[k].rd_name =
+				    ebox_tpl_part_name(ebox_part_tpl(part));
+				++ndevs;
+			}
+			recov_dev_add(&devs[k], part, i);
+		}
+	}
+	if (nleft == 0) {
+		error = errf("NoRecoveryConfig", NULL, "none of the eboxes "
+		    "have a recovery config");
+		goto out;
 	}
 
 	buf = sshbuf_new();
 	VERIFY(buf != NULL);
 
-	part = NULL;
-	while ((part = ebox_config_next_part(config, part)) != NULL) {
-		state = (struct part_state *)ebox_part_private(part);
-		if (state->ps_intent != INTENT_CHAL_RESP)
-			continue;
-		state->ps_intent = INTENT_NONE;
-		make_answer_text_for_pstate(state);
-		state->ps_intent = INTENT_CHAL_RESP;
-		error = ebox_gen_challenge(config, part,
-		    "Recovering %s with part %s", what, state->ps_ans->a_text);
-		if (error) {
-			sshbuf_free(buf);
-			return (error);
-		}
-		chal = ebox_part_challenge(part);
+	fprintf(stderr, "-- Beginning recovery of %zu eboxes --\n"
+	    "One challenge bundle is issued to each recovery device. Each "
+	    "one covers every\nebox the device holds a part of, and needs one "
+	    "response.\n\n", nleft);
+	for (k = 0; k < ndevs; ++k) {
+		rd = &devs[k];
+		if (rd->rd_name == NULL)
+			rd->rd_name = "(unnamed)";
+		error = ebox_gen_challenge_bundle(rd->rd_parts, rd->rd_n,
+		    &rd->rd_chal, "Recovering %zu %s with part %s", rd->rd_n,
+		    what, rd->rd_name);
+		if (error)
+			goto out;
 		sshbuf_reset(buf);
-		error = sshbuf_put_ebox_challenge(buf, chal);
-		if (error) {
-			sshbuf_free(buf);
-			return (error);
-		}
+		if ((error = sshbuf_put_ebox_challenge(buf, rd->rd_chal)))
+			goto out;
 		b64 = sshbuf_dtob64(buf);
 		VERIFY(b64 != NULL);
-		fprintf(stderr, "-- Begin challenge for remote device %s --\n",
-		    state->ps_ans->a_text);
+		fprintf(stderr, "-- Begin challenge bundle for remote device "
+		    "%s (%zu parts) --\n", rd->rd_name, rd->rd_n);
 		printwrap(stderr, b64, BASE64_LINE_LEN);
-		fprintf(stderr, "-- End challenge for remote device %s --\n",
-		    state->ps_ans->a_text);
+		fprintf(stderr, "-- End challenge bundle for remote device "
+		    "%s --\n", rd->rd_name);
 		free(b64);
-		b64 = NULL;
 
-		words = ebox_challenge_words(chal, &wordlen);
-		fprintf(stderr, "\nVERIFICATION WORDS for %s:",
-		    state->ps_ans->a_text);
+		words = ebox_challenge_words(rd->rd_chal, &wordlen);
+		fprintf(stderr, "\nVERIFICATION WORDS for %s:", rd->rd_name);
 		for (i = 0; i < wordlen; ++i)
 			fprintf(stderr, " %s", wordlist[words[i]]);
 		fprintf(stderr, "\n\n");
 	}
 
-	while (ncur < n) {
-		fprintf(stderr, "\nRemaining responses required:\n");
-		part = NULL;
-		while ((part = ebox_config_next_part(config, part)) != NULL) {
-			state = (struct part_state *)ebox_part_private(part);
-			if (state->ps_intent != INTENT_CHAL_RESP)
-				continue;
-			fprintf(stderr, "  * %s\n", state->ps_ans->a_text);
+	while (nleft > 0) {
+		for (k = 0; k < ndevs; ++k) {
+			if (!devs[k].rd_done)
+				break;
+		}
+		if (k == ndevs) {
+			fprintf(stderr, "\nAll devices have responded, but %zu "
+			    "eboxes still do not have enough parts.\n", nleft);
+			break;
+		}
+		fprintf(stderr, "\n%zu eboxes still need more responses. "
+		    "Devices not yet heard from:\n", nleft);
+		for (k = 0; k < ndevs; ++k) {
+			if (!devs[k].rd_done)
+				fprintf(stderr, "  * %s\n", devs[k].rd_name);
 		}
 		fprintf(stderr, "\n-- Enter response followed by newline --\n");
 		read_b64_box(&box);
 		fprintf(stderr, "-- End response --\n");
-		error = ebox_challenge_response(config, box, &part);
+
+		pubkey = piv_box_pubkey(box);
+		for (k = 0; k < ndevs; ++k) {
+			if (sshkey_equal_public(pubkey,
+			    ebox_challenge_destkey(devs[k].rd_chal)))
+				break;
+		}
+		if (k == ndevs) {
+			piv_box_free(box);
+			warnx("response is not for any of the challenge "
+			    "bundles issued");
+			continue;
+		}
+		rd = &devs[k];
+		if (rd->rd_done) {
+			piv_box_free(box);
+			fprintf(stderr, "Response already processed for "
+			    "device %s!\n", rd->rd_name);
+			continue;
+		}
+		answered = calloc(rd->rd_n, sizeof (struct ebox_part *));
+		if (answered == NULL)
+			err(EXIT_ERROR, "failed to allocate memory");
+		error = ebox_challenge_bundle_response(rd->rd_chal, box,
+		    answered, &nans);
 		if (error) {
 			warnfx(error, "failed to parse input data as a "
 			    "valid response");
+			errf_free(error);
+			error = ERRF_OK;
+			free(answered);
+			answered = NULL;
 			continue;
 		}
-		state = (struct part_state *)ebox_part_private(part);
-		if (state->ps_intent != INTENT_CHAL_RESP) {
-			fprintf(stderr, "Response already processed for "
-			    "device %s!\n", state->ps_ans->a_text);
+		/* answered[] is normally in the same order as rd_parts */
+		for (i = 0, j = 0; i < nans; ++i) {
+			for (nr = 0; nr < rd->rd_n; ++nr) {
+				if (rd->rd_parts[j] == answered[i])
+					break;
+				j = (j + 1) % rd->rd_n;
+			}
+			VERIFY3U(nr, <, rd->rd_n);
+			if (rd->rd_got[j])
+				continue;
+			rd->rd_got[j] = B_TRUE;
+			if (++have[rd->rd_ebox[j]] == need[rd->rd_ebox[j]])
+				--nleft;
+		}
+		free(answered);
+		answered = NULL;
+		rd->rd_done = B_TRUE;
+		fprintf(stderr, "Response from %s unlocked %zu of its %zu "
+		    "parts.\n", rd->rd_name, nans, rd->rd_n);
+	}
+
+	rboxes = calloc(n, sizeof (struct ebox *));
+	rconfigs = calloc(n, sizeof (struct ebox_config *));
+	errs = calloc(n, sizeof (errf_t *));
+	if (rboxes == NULL || rconfigs == NULL || errs == NULL)
+		err(EXIT_ERROR, "failed to allocate memory");
+	for (i = 0, nr = 0; i < n; ++i) {
+		if (configs[i] == NULL || have[i] < need[i])
+			continue;
+		rboxes[nr] = eboxes[i];
+		rconfigs[nr] = configs[i];
+		++nr;
+	}
+	error = ebox_recover_batch(rboxes, rconfigs, nr, errs);
+	errf_free(error);
+	error = ERRF_OK;
+	for (i = 0, j = 0; i < n; ++i) {
+		if (configs[i] == NULL || have[i] < need[i])
 			continue;
+		if (errs[j] == ERRF_OK) {
+			recovered[i] = B_TRUE;
+		} else {
+			warnfx(errs[j], "failed to recover ebox %zu", i + 1);
+			errf_free(errs[j]);
 		}
-		fprintf(stderr, "Device box for %s decrypted ok.\n",
-		    state->ps_ans->a_text);
-		state->ps_intent = INTENT_NONE;
-		++ncur;
+		++j;
 	}
+
+out:
+	for (k = 0; k < ndevs; ++k) {
+		free(devs[k].rd_parts);
+		free(devs[k].rd_ebox);
+		free(devs[k].rd_got);
+		ebox_challenge_free(devs[k].rd_chal);
+	}
+	free(devs);
+	free(configs);
+	free(have);
+	free(need);
+	free(rboxes);
+	free(rconfigs);
+	free(errs);
 	sshbuf_free(buf);
-	return (NULL);
+	return (error);
 }
 
 struct ebox_tpl_path_ent *ebox_tpl_path = NULL;
@@ -1397,10 +2427,478 @@ read_tpl_file(const char *tpl)
 	return (stpl);
 }
 
+/*
+ * For each template directory we keep an index listing the templates there
+ * along with a text summary of each one's configs, so that "tpl list"
+ * doesn't have to read and decode every template. The indexes live in the
+ * user's cache directory (so that read-only system template directories get
+ * one too), named after a hash of the template directory's path.
+ *
+ * An index is brought up to date on each use: we only re-read the directory
+ * if its mtime has changed, and only re-read a template if its inode, size
+ * or mtime have. Anything changed in the same second the index was written
+ * is treated as changed, since we can't tell otherwise.
+ */
+#define	TPL_INDEX_MAGIC		"pivy-box-tpl-index"
+#define	TPL_INDEX_VERSION	1
+#define	TPL_INDEX_MAX_SIZE	(1024 * 1024)
+#define	TPL_INDEX_DIR		"pivy-box/tpl-index"
+
+static char *
+tpl_index_path(const char *dpath, boolean_t mkdirs)
+{
+	const char *cache, *home;
+	char *path;
+	uint8_t hash[32];
+	char hex[2 * 16 + 1];
+	uint i, len;
+
+	cache = getenv("XDG_CACHE_HOME");
+	home = getenv("HOME");
+	if ((cache == NULL || cache[0] == '\0') && home == NULL)
+		return (NULL);
+
+	if (ssh_digest_memory(SSH_DIGEST_SHA256, dpath, strlen(dpath),
+	    hash, sizeof (hash)) != 0) {
+		return (NULL);
+	}
+	for (i = 0; i < 16; ++i)
+		snprintf(&hex[2 * i], 3, "%02x", hash[i]);
+
+	path = malloc(PATH_MAX);
+	if (path == NULL)
+		return (NULL);
+	if (cache != NULL && cache[0] != '\0') {
+		snprintf(path, PATH_MAX, "%s/" TPL_INDEX_DIR "/", cache);
+	} else {
+		snprintf(path, PATH_MAX, "%s/.cache/" TPL_INDEX_DIR "/",
+		    home);
+	}
+
+	if (mkdirs) {
+		len = strlen(path);
+		for (i = 1; i < len; ++i) {
+			if (path[i] != '/')
+				continue;
+			path[i] = '\0';
+			if (mkdir(path, 0700) != 0 && errno != EEXIST)
+				break;
+			path[i] = '/';
+		}
+	}
+
+	strlcat(path, hex, PATH_MAX);
+	return (path);
+}
+
+static void
+tpl_index_ent_free(struct tpl_index_ent *tie)
+{
+	uint i;
+
+	if (tie == NULL)
+		return;
+	for (i = 0; i < tie->tie_nconfigs; ++i)
+		free(tie->tie_configs[i]);
+	free(tie->tie_configs);
+	free(tie->tie_name);
+	free(tie);
+}
+
 void
-interactive_select_local_token(struct ebox_tpl_part **ppart)
+tpl_index_free(struct tpl_index *ti)
+{
+	struct tpl_index_ent *tie, *next;
+
+	if (ti == NULL)
+		return;
+	for (tie = ti->ti_ents; tie != NULL; tie = next) {
+		next = tie->tie_next;
+		tpl_index_ent_free(tie);
+	}
+	free(ti->ti_dpath);
+	free(ti);
+}
+
+static errf_t *
+tpl_index_load(struct tpl_index *ti, const char *path)
+{
+	errf_t *err = ERRF_OK;
+	struct sshbuf *buf = NULL;
+	struct tpl_index_ent *tie = NULL, *last = NULL;
+	char *magic = NULL;
+	uint8_t ver, nconfigs;
+	uint32_t nents, i, j;
+	uint64_t written, dir_mtime;
+	struct stat st;
+	ssize_t n;
+	int fd, rc;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return (errfno("open", errno, "%s", path));
+	if (fstat(fd, &st) != 0) {
+		err = errfno("fstat", errno, "%s", path);
+		goto out;
+	}
+	if (st.st_size <= 0 || st.st_size > TPL_INDEX_MAX_SIZE) {
+		err = errf("InvalidDataError", NULL, "Template index '%s' has "
+		    "invalid size %lld", path, (long long)st.st_size);
+		goto out;
+	}
+	if ((buf = sshbuf_new()) == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+	while ((size_t)st.st_size > sshbuf_len(buf)) {
+		uint8_t *p;
+		size_t want = st.st_size - sshbuf_len(buf);
+		if ((rc = sshbuf_reserve(buf, want, &p))) {
+			err = ssherrf("sshbuf_reserve", rc);
+			goto out;
+		}
+		n = read(fd, p, want);
+		if (n <= 0) {
+			err = errfno("read", n < 0 ? errno : EIO, "%s", path);
+			goto out;
+		}
+		VERIFY0(sshbuf_consume_end(buf, want - n));
+	}
+
+	if ((rc = sshbuf_get_cstring(buf, &magic, NULL)) ||
+	    (rc = sshbuf_get_u8(buf, &ver)) ||
+	    (rc = sshbuf_get_u64(buf, &written)) ||
+	    (rc = sshbuf_get_u64(buf, &dir_mtime)) ||
+	    (rc = sshbuf_get_u32(buf, &nents))) {
+		err = ssherrf("sshbuf_get", rc);
+		goto bad;
+	}
+	if (strcmp(magic, TPL_INDEX_MAGIC) != 0 || ver != TPL_INDEX_VERSION) {
+		err = errf("NotSupportedError", NULL, "Template index '%s' is "
+		    "of unknown format or version", path);
+		goto out;
+	}
+	for (i = 0; i < nents; ++i) {
+		tie = calloc(1, sizeof (*tie));
+		if (tie == NULL) {
+			err = ERRF_NOMEM;
+			goto out;
+		}
+		if ((rc = sshbuf_get_cstring(buf, &tie->tie_name, NULL)) ||
+		    (rc = sshbuf_get_u64(buf, &tie->tie_ino)) ||
+		    (rc = sshbuf_get_u64(buf, &tie->tie_size)) ||
+		    (rc = sshbuf_get_u64(buf, &tie->tie_mtime)) ||
+		    (rc = sshbuf_get_u8(buf, &nconfigs))) {
+			err = ssherrf("sshbuf_get", rc);
+			goto bad;
+		}
+		tie->tie_configs = calloc(nconfigs + 1, sizeof (char *));
+		if (tie->tie_configs == NULL) {
+			err = ERRF_NOMEM;
+			goto out;
+		}
+		for (j = 0; j < nconfigs; ++j) {
+			rc = sshbuf_get_cstring(buf, &tie->tie_configs[j],
+			    NULL);
+			if (rc) {
+				err = ssherrf("sshbuf_get_cstring", rc);
+				goto bad;
+			}
+			tie->tie_nconfigs = j + 1;
+		}
+		/* Entries changed as the index was written can't be trusted */
+		tie->tie_stale = (tie->tie_mtime >= written);
+		if (last == NULL)
+			ti->ti_ents = tie;
+		else
+			last->tie_next = tie;
+		last = tie;
+		tie = NULL;
+	}
+	if (sshbuf_len(buf) != 0) {
+		err = errf("LengthError", NULL, "Trailing garbage");
+		goto bad;
+	}
+	ti->ti_dir_mtime = dir_mtime;
+	ti->ti_written = written;
+
+out:
+	tpl_index_ent_free(tie);
+	(void) close(fd);
+	sshbuf_free(buf);
+	free(magic);
+	return (err);
+
+bad:
+	err = errf("InvalidDataError", err, "Template index '%s' is corrupt",
+	    path);
+	goto out;
+}
+
+static errf_t *
+tpl_index_save(const struct tpl_index *ti, const char *path)
 {
+	errf_t *err = ERRF_OK;
+	struct sshbuf *buf = NULL;
+	const struct tpl_index_ent *tie;
+	char *tmppath = NULL;
+	uint32_t nents = 0;
+	uint i;
+	FILE *f = NULL;
 	int rc;
+
+	for (tie = ti->ti_ents; tie != NULL; tie = tie->tie_next)
+		++nents;
+
+	if ((buf = sshbuf_new()) == NULL)
+		return (ERRF_NOMEM);
+	if ((rc = sshbuf_put_cstring(buf, TPL_INDEX_MAGIC)) ||
+	    (rc = sshbuf_put_u8(buf, TPL_INDEX_VERSION)) ||
+	    (rc = sshbuf_put_u64(buf, ti->ti_written)) ||
+	    (rc = sshbuf_put_u64(buf, ti->ti_dir_mtime)) ||
+	    (rc = sshbuf_put_u32(buf, nents))) {
+		err = ssherrf("sshbuf_put", rc);
+		goto out;
+	}
+	for (tie = ti->ti_ents; tie != NULL; tie = tie->tie_next) {
+		VERIFY3U(tie->tie_nconfigs, <=, UINT8_MAX);
+		if ((rc = sshbuf_put_cstring(buf, tie->tie_name)) ||
+		    (rc = sshbuf_put_u64(buf, tie->tie_ino)) ||
+		    (rc = sshbuf_put_u64(buf, tie->tie_size)) ||
+		    (rc = sshbuf_put_u64(buf, tie->tie_mtime)) ||
+		    (rc = sshbuf_put_u8(buf, tie->tie_nconfigs))) {
+			err = ssherrf("sshbuf_put", rc);
+			goto out;
+		}
+		for (i = 0; i < tie->tie_nconfigs; ++i) {
+			rc = sshbuf_put_cstring(buf, tie->tie_configs[i]);
+			if (rc) {
+				err = ssherrf("sshbuf_put_cstring", rc);
+				goto out;
+			}
+		}
+	}
+
+	if (asprintf(&tmppath, "%s.tmp%ld", path, (long)getpid()) < 0) {
+		tmppath = NULL;
+		err = ERRF_NOMEM;
+		goto out;
+	}
+	if ((f = fopen(tmppath, "w")) == NULL) {
+		err = errfno("fopen", errno, "%s", tmppath);
+		goto out;
+	}
+	if (fwrite(sshbuf_ptr(buf), sshbuf_len(buf), 1, f) != 1) {
+		err = errfno("fwrite", errno, "%s", tmppath);
+		goto out;
+	}
+	rc = fclose(f);
+	f = NULL;
+	if (rc != 0) {
+		err = errfno("fclose", errno, "%s", tmppath);
+		goto out;
+	}
+	if (rename(tmppath, path) != 0) {
+		err = errfno("rename", errno, "%s", path);
+		goto out;
+	}
+
+out:
+	if (f != NULL)
+		(void) fclose(f);
+	if (err != ERRF_OK && tmppath != NULL)
+		(void) unlink(tmppath);
+	free(tmppath);
+	sshbuf_free(buf);
+	return (err);
+}
+
+static struct tpl_index_ent *
+tpl_index_find(struct tpl_index *ti, const char *name)
+{
+	struct tpl_index_ent *tie;
+
+	for (tie = ti->ti_ents; tie != NULL; tie = tie->tie_next) {
+		if (strcmp(tie->tie_name, name) == 0)
+			return (tie);
+	}
+	return (NULL);
+}
+
+/*
+ * Fills in the summary of one template from the file itself (this exits if
+ * the file isn't a valid template, like read_tpl_file()).
+ */
+static void
+tpl_index_ent_read(struct tpl_index_ent *tie, const char *fpath,
+    const struct stat *st)
+{
+	struct ebox_tpl *tpl;
+	struct ebox_tpl_config *c;
+	struct answer a;
+	uint i, n;
+
+	for (i = 0; i < tie->tie_nconfigs; ++i)
+		free(tie->tie_configs[i]);
+	free(tie->tie_configs);
+	tie->tie_configs = NULL;
+	tie->tie_nconfigs = 0;
+
+	tpl = read_tpl_file(fpath);
+
+	n = 0;
+	c = NULL;
+	while ((c = ebox_tpl_next_config(tpl, c)) != NULL)
+		++n;
+	VERIFY3U(n, <=, UINT8_MAX);
+	tie->tie_configs = calloc(n + 1, sizeof (char *));
+	VERIFY(tie->tie_configs != NULL);
+	c = NULL;
+	while ((c = ebox_tpl_next_config(tpl, c)) != NULL) {
+		bzero(&a, sizeof (a));
+		make_answer_text_for_config(c, &a);
+		tie->tie_configs[tie->tie_nconfigs] = strdup(a.a_text);
+		VERIFY(tie->tie_configs[tie->tie_nconfigs] != NULL);
+		++tie->tie_nconfigs;
+	}
+	ebox_tpl_free(tpl);
+
+	tie->tie_ino = st->st_ino;
+	tie->tie_size = st->st_size;
+	tie->tie_mtime = st->st_mtime;
+	tie->tie_stale = B_FALSE;
+}
+
+errf_t *
+tpl_index_get(const struct ebox_tpl_path_ent *tpe, struct tpl_index **pti)
+{
+	errf_t *err;
+	struct tpl_index *ti;
+	struct tpl_index_ent *tie, **ptie;
+	struct dirent *ent;
+	struct stat st;
+	char *ipath = NULL, *fpath;
+	boolean_t dirty = B_FALSE;
+	DIR *d;
+	uint64_t now = time(NULL);
+
+	ti = calloc(1, sizeof (*ti));
+	if (ti == NULL)
+		return (ERRF_NOMEM);
+	ti->ti_dpath = compose_path(tpe->tpe_segs, "");
+
+	if (stat(ti->ti_dpath, &st) != 0) {
+		err = errfno("stat", errno, "%s", ti->ti_dpath);
+		goto fail;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		err = errfno("stat", ENOTDIR, "%s", ti->ti_dpath);
+		goto fail;
+	}
+
+	ipath = tpl_index_path(ti->ti_dpath, B_FALSE);
+	if (ipath == NULL)
+		err = errf("NotFoundError", NULL, "No cache directory");
+	else
+		err = tpl_index_load(ti, ipath);
+	if (err != ERRF_OK) {
+		errf_free(err);
+		err = ERRF_OK;
+		for (tie = ti->ti_ents; tie != NULL; tie = ti->ti_ents) {
+			ti->ti_ents = tie->tie_next;
+			tpl_index_ent_free(tie);
+		}
+		ti->ti_dir_mtime = 0;
+		ti->ti_written = 0;
+		dirty = B_TRUE;
+	}
+
+	/*
+	 * Templates can only have been added or removed if the directory has
+	 * changed since we wrote the index.
+	 */
+	if (ti->ti_dir_mtime != (uint64_t)st.st_mtime ||
+	    ti->ti_dir_mtime >= ti->ti_written) {
+		d = opendir(ti->ti_dpath);
+		if (d == NULL) {
+			err = errfno("opendir", errno, "%s", ti->ti_dpath);
+			goto fail;
+		}
+		for (tie = ti->ti_ents; tie != NULL; tie = tie->tie_next)
+			tie->tie_seen = B_FALSE;
+		while ((ent = readdir(d)) != NULL) {
+			if (ent->d_name[0] == '.')
+				continue;
+			if ((tie = tpl_index_find(ti, ent->d_name)) == NULL) {
+				tie = calloc(1, sizeof (*tie));
+				VERIFY(tie != NULL);
+				tie->tie_name = strdup(ent->d_name);
+				VERIFY(tie->tie_name != NULL);
+				tie->tie_stale = B_TRUE;
+				for (ptie = &ti->ti_ents; *ptie != NULL;
+				    ptie = &(*ptie)->tie_next)
+					;
+				*ptie = tie;
+			}
+			tie->tie_seen = B_TRUE;
+		}
+		closedir(d);
+		ptie = &ti->ti_ents;
+		while ((tie = *ptie) != NULL) {
+			if (!tie->tie_seen) {
+				*ptie = tie->tie_next;
+				tpl_index_ent_free(tie);
+				continue;
+			}
+			ptie = &tie->tie_next;
+		}
+		ti->ti_dir_mtime = st.st_mtime;
+		dirty = B_TRUE;
+	}
+
+	ptie = &ti->ti_ents;
+	while ((tie = *ptie) != NULL) {
+		fpath = compose_path(tpe->tpe_segs, tie->tie_name);
+		if (stat(fpath, &st) != 0 || !S_ISREG(st.st_mode)) {
+			free(fpath);
+			*ptie = tie->tie_next;
+			tpl_index_ent_free(tie);
+			dirty = B_TRUE;
+			continue;
+		}
+		if (tie->tie_stale || tie->tie_ino != (uint64_t)st.st_ino ||
+		    tie->tie_size != (uint64_t)st.st_size ||
+		    tie->tie_mtime != (uint64_t)st.st_mtime) {
+			tpl_index_ent_read(tie, fpath, &st);
+			dirty = B_TRUE;
+		}
+		free(fpath);
+		ptie = &tie->tie_next;
+	}
+
+	if (dirty) {
+		free(ipath);
+		ipath = tpl_index_path(ti->ti_dpath, B_TRUE);
+	}
+	if (dirty && ipath != NULL) {
+		ti->ti_written = now;
+		err = tpl_index_save(ti, ipath);
+		/* Not being able to write the index isn't fatal. */
+		errf_free(err);
+	}
+
+	free(ipath);
+	*pti = ti;
+	return (ERRF_OK);
+
+fail:
+	free(ipath);
+	tpl_index_free(ti);
+	return (err);
+}
+
+void
+interactive_select_local_token(struct ebox_tpl_part **ppart)
+{
 	errf_t *error;
 	struct piv_token *tokens = NULL, *token;
 	struct piv_slot *slot;
@@ -1412,18 +2910,10 @@ interactive_select_local_token(struct ebox_tpl_part **ppart)
 	char k = '0';
 	char *line, *p;
 	unsigned long parsed;
-
-	if (!ebox_ctx_init) {
-		rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL,
-		    &ebox_ctx);
-		if (rc != SCARD_S_SUCCESS) {
-			errfx(EXIT_ERROR, pcscerrf("SCardEstablishContext", rc),
-			    "failed to initialise libpcsc");
-		}
-	}
+	struct ebox_session *sess = ebox_local_session();
 
 reenum:
-	error = piv_enumerate(ebox_ctx, &tokens);
+	error = ebox_session_tokens(sess, &tokens);
 	if (error) {
 		warnfx(error, "failed to enumerate PIV tokens on the system");
 		*ppart = NULL;
@@ -1465,13 +2955,12 @@ again:
 	if (a->a_key == 'x') {
 		*ppart = NULL;
 		question_free(q);
-		piv_release(tokens);
 		return;
 	} else if (a->a_key == 'r') {
 		*ppart = NULL;
 		k = '0';
 		question_free(q);
-		piv_release(tokens);
+		ebox_session_flush(sess);
 		goto reenum;
 	} else if (a->a_key == 's') {
 		line = readline("Slot ID (hex)? ");
@@ -1526,7 +3015,6 @@ again:
 	piv_txn_end(token);
 
 	*ppart = part;
-	piv_release(tokens);
 }
 
 void
@@ -82,8 +82,12 @@ struct ebox_tpl_path_ent {
 extern struct ebox_tpl_path_ent *ebox_tpl_path;
 
 #define	TPL_MAX_SIZE		4096
+/* Challenge bundles can carry thousands of parts. */
+#define	CHAL_MAX_SIZE		(1024 * 1024)
 #define	EBOX_MAX_SIZE		16384
 #define	BASE64_LINE_LEN		65
+/* Most boxes we send the agent in one rebox batch. */
+#define	EBOX_REBOX_BATCH	128
 
 char *compose_path(const struct ebox_tpl_path_seg *segs, const char *tpl);
 FILE *open_tpl_file(const char *tpl, const char *mode);
@@ -98,10 +102,102 @@ void assert_pin(struct piv_token *pk, struct piv_slot *slot,
 
 struct ebox_tpl *read_tpl_file(const char *tpl);
 
+/*
+ * A summary of the templates in one ebox_tpl_path directory, from an index
+ * kept in the user's cache directory (see tpl_index_get()).
+ */
+struct tpl_index_ent {
+	struct tpl_index_ent *tie_next;
+	char *tie_name;
+	uint64_t tie_ino;
+	uint64_t tie_size;
+	uint64_t tie_mtime;
+	/* Text descriptions of each config (as in make_answer_text_for_config) */
+	uint tie_nconfigs;
+	char **tie_configs;
+
+	boolean_t tie_stale;
+	boolean_t tie_seen;
+};
+
+struct tpl_index {
+	char *ti_dpath;
+	uint64_t ti_written;
+	uint64_t ti_dir_mtime;
+	struct tpl_index_ent *ti_ents;
+};
+
+/*
+ * Returns the (up to date) index of the templates in a template path
+ * directory, re-reading only the templates which have changed since the
+ * index was last saved.
+ */
+errf_t *tpl_index_get(const struct ebox_tpl_path_ent *tpe,
+    struct tpl_index **pti);
+void tpl_index_free(struct tpl_index *ti);
+
+/*
+ * Returns the (first) part of a primary config, loading the config and the
+ * part first if the ebox came from sshbuf_get_ebox_lazy().
+ */
+errf_t *load_primary_part(struct ebox *ebox, struct ebox_config *config,
+    struct ebox_part **ppart);
+
 errf_t *local_unlock_agent(struct piv_ecdh_box *box);
 errf_t *local_unlock(struct piv_ecdh_box *box, struct sshkey *cak,
     const char *name);
+/*
+ * Tries to unlock each of eboxes[0..n-1] with its primary configs, all in one
+ * unlock session (so each token is opened and asked for its PIN only once).
+ * No recovery or other interaction besides the PIN. Sets unlocked[i] for each
+ * ebox which was unlocked (and skips any that are already set).
+ */
+void local_unlock_eboxes(struct ebox **eboxes, boolean_t *unlocked, size_t n);
+/*
+ * An unlock session caches the token enumeration, the slots matched to box
+ * keys (indexed by GUID and key fingerprint) and the ssh-agent's identities,
+ * and keeps a transaction open on each token it uses (with its PIN and CAK
+ * state) until ebox_session_end(). local_unlock() uses the process-wide
+ * session from ebox_local_session() and ends it before returning.
+ *
+ * Don't leave a session un-ended across user interaction: it holds the cards
+ * locked against other processes.
+ */
+struct ebox_session;
+struct ebox_session *ebox_session_new(void);
+struct ebox_session *ebox_local_session(void);
+/* Ends all transactions (and forgets the agent), keeping the enumeration. */
+void ebox_session_end(struct ebox_session *sess);
+/* Also forgets the enumeration and index, to pick up new tokens. */
+void ebox_session_flush(struct ebox_session *sess);
+void ebox_session_free(struct ebox_session *sess);
+errf_t *ebox_session_tokens(struct ebox_session *sess,
+    struct piv_token **ptokens);
+errf_t *ebox_session_agent_unlock(struct ebox_session *sess,
+    struct piv_ecdh_box *box);
+/*
+ * Opens as many of boxes[0..n-1] as the agent can, sending all the boxes for
+ * each key in one ecdh-rebox-batch@joyent.com request when the agent has it
+ * (and one ecdh-rebox per box when it doesn't). Sets opened[i] for each box
+ * opened, skipping any already set.
+ */
+void ebox_session_agent_unlock_batch(struct ebox_session *sess,
+    struct piv_ecdh_box **boxes, boolean_t *opened, size_t n);
+errf_t *ebox_session_local_unlock(struct ebox_session *sess,
+    struct piv_ecdh_box *box, struct sshkey *cak, const char *name);
+/* Tries the agent and then local hardware, like local_unlock(). */
+errf_t *ebox_session_unlock(struct ebox_session *sess,
+    struct piv_ecdh_box *box, struct sshkey *cak, const char *name);
+
 errf_t *interactive_recovery(struct ebox_config *config, const char *what);
+/*
+ * Recovers many eboxes at once using their first recovery configs, with one
+ * challenge bundle (and so one response) per recovery device rather than
+ * one challenge per part per ebox. Sets recovered[i] for each ebox recovered,
+ * skipping any already set.
+ */
+errf_t *interactive_recovery_batch(struct ebox **eboxes, boolean_t *recovered,
+    size_t n, const char *what);
 
 void interactive_select_local_token(struct ebox_tpl_part **ppart);
 
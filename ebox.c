@@ -16,8 +16,11 @@
 #include <limits.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <sys/errno.h>
 
+#include <zlib.h>
+
 #include "libssh/sshkey.h"
 #include "libssh/sshbuf.h"
 #include "libssh/digest.h"
@@ -102,6 +105,11 @@ struct ebox {
 	uint8_t *e_token;
 
 	void *e_priv;
+
+	/* Set on eboxes from sshbuf_get_ebox(), see ebox_arena_alloc() */
+	struct ebox_arena *e_arena;
+	/* Length of the ebox on the wire, if we parsed it */
+	size_t e_wirelen;
 };
 
 struct ebox_ephem_key {
@@ -123,6 +131,13 @@ struct ebox_config {
 	uint8_t *ec_nonce;
 	size_t ec_noncelen;
 
+	/*
+	 * Set on configs from sshbuf_get_ebox_lazy() until ebox_config_load()
+	 * is called: the (arena-owned) encoded body of the config.
+	 */
+	const uint8_t *ec_raw;
+	size_t ec_rawlen;
+
 	void *ec_priv;
 };
 
@@ -134,6 +149,9 @@ struct ebox_part {
 	struct ebox_challenge *ep_chal;
 	size_t ep_sharelen;
 	uint8_t *ep_share;
+	/* As for ec_raw, until ebox_part_load() */
+	const uint8_t *ep_raw;
+	size_t ep_rawlen;
 	void *ep_priv;
 };
 
@@ -147,6 +165,8 @@ enum chaltag {
 enum resptag {
 	RTAG_ID = 1,
 	RTAG_KEYPIECE = 2,
+	/* Starts each part's entry in a bundle response (u32 index) */
+	RTAG_INDEX = 3,
 };
 
 enum ebox_recov_tag {
@@ -154,6 +174,23 @@ enum ebox_recov_tag {
 	EBOX_RECOV_KEY = 0x02
 };
 
+/*
+ * Challenge bundles (version 2) carry the keyboxes of many parts (of many
+ * eboxes) which all belong to the same device, in place of c_id/c_keybox.
+ * They share one ephemeral key (and one response), rather than each config
+ * having its own ec_chalkey.
+ */
+#define	EBOX_CHAL_BUNDLE_MAX	4096
+
+struct ebox_challenge_ent {
+	uint8_t ce_id;
+	struct piv_ecdh_box *ce_keybox;
+	/* Only set on the side which generated the bundle */
+	struct ebox_part *ce_part;
+	/* Set while reading a response once this entry has been answered */
+	boolean_t ce_taken;
+};
+
 struct ebox_challenge {
 	uint8_t c_version;
 	enum ebox_chaltype c_type;
@@ -164,13 +201,61 @@ struct ebox_challenge {
 	uint8_t c_words[4];
 	struct sshkey *c_destkey;
 	struct piv_ecdh_box *c_keybox;
+
+	/* Bundles only: the parts, and the private half of c_destkey */
+	size_t c_nents;
+	struct ebox_challenge_ent *c_ents;
+	struct sshkey *c_chalkey;
+};
+
+enum ebox_stream_comp {
+	EBOX_COMP_NONE = 0,
+	EBOX_COMP_ZLIB,
 };
 
+#define	EBOX_MERKLE_HASHLEN		32
+#define	EBOX_MERKLE_MAXDEPTH		64
+
 struct ebox_stream {
 	struct ebox *es_ebox;
 	char *es_cipher;
 	char *es_mac;
 	size_t es_chunklen;
+	/* NULL if the stream isn't compressed */
+	char *es_comp;
+
+	/* Looked up from es_cipher and es_mac by ebox_stream_resolve() */
+	const struct sshcipher *es_cipher_alg;
+	int es_dgalg;
+	size_t es_ivlen;
+	size_t es_authlen;
+	size_t es_blocksz;
+	size_t es_keylen;
+	size_t es_maclen;
+	/* How many chunks' HMACs ssh_digest_hmac_multi() does at once */
+	uint es_maclanes;
+	boolean_t es_padded;
+	enum ebox_stream_comp es_compalg;
+
+	/*
+	 * Streams with a trailer keep count of the chunks given to
+	 * ebox_stream_add_chunk(), along with the roots of the perfect
+	 * subtrees of their Merkle tree so far (biggest first).
+	 */
+	boolean_t es_trailer;
+	boolean_t es_appended;
+	boolean_t es_appending;
+	uint64_t es_nchunks;
+	uint64_t es_plainlen;
+	uint es_mdepth;
+	uint8_t es_mheight[EBOX_MERKLE_MAXDEPTH];
+	uint8_t es_mstack[EBOX_MERKLE_MAXDEPTH][EBOX_MERKLE_HASHLEN];
+
+	/* What the trailer says, once ebox_stream_read_trailer() has run */
+	boolean_t es_tr_valid;
+	uint64_t es_tr_nchunks;
+	uint64_t es_tr_plainlen;
+	uint8_t es_tr_root[EBOX_MERKLE_HASHLEN];
 };
 
 struct ebox_stream_chunk {
@@ -178,8 +263,30 @@ struct ebox_stream_chunk {
 	uint32_t esc_seqnr;
 	size_t esc_enclen;
 	uint8_t *esc_enc;
+	size_t esc_encsz;
+	boolean_t esc_enc_borrowed;
 	size_t esc_plainlen;
 	uint8_t *esc_plain;
+	size_t esc_plainsz;
+
+	/*
+	 * Kept when a chunk is recycled, so that we only have to run the
+	 * key schedules once per chunk rather than once per seqnr.
+	 */
+	uint8_t *esc_iv;
+	struct sshcipher_ctx *esc_cctx;
+	int esc_cctx_dir;
+	struct ssh_hmac_ctx *esc_hctx;
+
+	/*
+	 * On compressed streams, the chunk as it goes through the cipher
+	 * (see ebox_stream_chunk_deflate()). The zlib state is kept too, like
+	 * the cipher context.
+	 */
+	uint8_t *esc_zbuf;
+	size_t esc_zbufsz;
+	z_stream *esc_zs;
+	int esc_zs_dir;
 };
 
 enum ebox_part_tag {
@@ -194,11 +301,111 @@ enum ebox_part_tag {
 };
 
 #define	EBOX_STREAM_DEFAULT_CHUNK	(128 * 1024)
+#define	EBOX_STREAM_MIN_CHUNK		(1024)
+/* An encrypted chunk has to fit in an sshbuf (SSHBUF_SIZE_MAX) */
+#define	EBOX_STREAM_MAX_CHUNK		(64 * 1024 * 1024)
+
+/*
+ * There are two kinds of ebox stream, which share the same header layout:
+ *
+ *  - the original kind uses a plain cipher (aes256-ctr) plus an HMAC over
+ *    each chunk, and pads every chunk to a whole number of cipher blocks
+ *    with PKCS#7 padding;
+ *
+ *  - AEAD streams have EBOX_STREAM_MAC_NONE as their MAC name and use an
+ *    authenticated cipher (chacha20-poly1305) whose tag is the only MAC on
+ *    each chunk. These chunks are not padded.
+ *
+ * Older versions of pivy reject the "none" MAC name as unsupported, rather
+ * than misinterpreting an AEAD stream.
+ */
+#define	EBOX_STREAM_MAC_NONE		"none"
+
+/*
+ * Compressed streams have an extra cstring8 after the MAC name, naming the
+ * compression codec, and have this bit set in the chunk size field so that
+ * we know to look for it. Older versions of pivy reject them as having a
+ * chunk size that's too large.
+ *
+ * Each chunk's plaintext is still at most es_chunklen bytes (and all but
+ * the last are exactly that long) before compression. After compression it
+ * starts with one of the ebox_stream_ctype bytes: chunks that don't get any
+ * smaller are stored as-is.
+ */
+#define	EBOX_STREAM_F_COMP		(1ULL << 63)
+#define	EBOX_STREAM_COMP_ZLIB		"zlib"
+
+enum ebox_stream_ctype {
+	EBOX_STREAM_CHUNK_STORED = 0x00,
+	EBOX_STREAM_CHUNK_DEFLATED = 0x01,
+};
+
+/*
+ * Streams with this bit set in the chunk size field end with a trailer: one
+ * more chunk, with seqnr EBOX_STREAM_TRAILER_SEQ | n (where n is the number
+ * of data chunks, which count up from 1), which is never compressed and
+ * whose plaintext is
+ *
+ *   u8      version (EBOX_STREAM_TRAILER_V1)
+ *   u64     number of data chunks
+ *   u64     total plaintext length
+ *   u8[32]  Merkle tree root over the data chunks
+ *
+ * The tree is the one from RFC 6962 with SHA-256, and a leaf for each chunk
+ * made from its seqnr and its tag (the HMAC, or the cipher's tag on AEAD
+ * streams): leaf = H(0x00 || u32 seqnr || tag), node = H(0x01 || l || r).
+ *
+ * Since the trailer is encrypted and MACed like any other chunk, it
+ * authenticates where the stream ends: without it a reader can't tell a
+ * complete stream from one cut off after any whole chunk. Older versions of
+ * pivy reject these streams as having a chunk size that's too large.
+ *
+ * The trailer's seqnr includes the chunk count so that when more chunks are
+ * appended to the stream, the new trailer never uses the same seqnr (and so
+ * the same IV or nonce) as the one it replaces. Data chunks in these streams
+ * must have seqnrs below EBOX_STREAM_TRAILER_SEQ.
+ *
+ * On HMAC streams with a trailer, each chunk's HMAC is taken over its u32
+ * seqnr followed by the ciphertext (older streams MAC only the ciphertext).
+ * Otherwise nothing would stop two full-size chunks' bodies being swapped
+ * between frames when a reader only looks at part of the stream. Since every
+ * stream has its own random key, chunks can't be moved between streams.
+ */
+#define	EBOX_STREAM_F_TRAILER		(1ULL << 62)
+#define	EBOX_STREAM_TRAILER_SEQ		0x80000000U
+#define	EBOX_STREAM_TRAILER_V1		0x01
+#define	EBOX_STREAM_TRAILER_LEN		(1 + 8 + 8 + EBOX_MERKLE_HASHLEN)
+
+/*
+ * Set on streams which have had more chunks appended after a last chunk
+ * that wasn't full (re-encrypting that chunk to fill it up would re-use its
+ * seqnr). Chunks in the middle of these streams can be short, so readers
+ * can't work out where a chunk is from its plaintext offset. The flag can be
+ * set in the header of an existing stream without changing its size.
+ */
+#define	EBOX_STREAM_F_APPENDED		(1ULL << 61)
+
+/*
+ * Appends happen in place, so that they only cost as much as the new data.
+ * With this bit set in the header, the new chunks and a new trailer are
+ * written after the old trailer and synced. Then the old trailer is killed
+ * by overwriting its frame's seqnr with EBOX_STREAM_DEAD_SEQ, and finally
+ * the bit is cleared again.
+ *
+ * Readers skip dead frames wherever they are. While the bit is set, the
+ * stream ends at the first trailer that isn't dead, and anything after it
+ * (the remains of an append that didn't finish) is ignored. Otherwise the
+ * trailer must be the last thing in the stream. The next append cuts off
+ * whatever an unfinished one left behind.
+ */
+#define	EBOX_STREAM_F_APPENDING		(1ULL << 60)
 
 enum ebox_version {
 	EBOX_V1 = 0x01,
 	EBOX_V2 = 0x02,
 	EBOX_V3 = 0x03,
+	/* Version 4 added the config and part index, see sshbuf_get_ebox_lazy */
+	EBOX_V4 = 0x04,
 	EBOX_VNEXT,
 	EBOX_VMIN = EBOX_V1
 };
@@ -225,6 +432,171 @@ enum ebox_tpl_version {
     errf("NotSupportedError", cause, \
     "ebox challenge is not supported")
 
+/*
+ * Parsing an ebox involves a lot of small allocations: the template
+ * structures, the config and part structs, the piv_ecdh_boxes and their
+ * nonces, IVs and ciphertexts, names and curve names. When we're auditing a
+ * large number of ZFS or LUKS key properties this adds up, so eboxes made by
+ * sshbuf_get_ebox() carry an arena: a list of chunks allocated with
+ * calloc_conceal() which these small pieces are carved out of, and which are
+ * zeroed and freed as a whole in ebox_free().
+ *
+ * Eboxes made by ebox_create() and friends have no arena, and anything which
+ * gets attached to a parsed ebox later (unlocked shares and keys, private
+ * data) comes from the heap as usual. The various _free() functions below
+ * check ebox_arena_owns() before freeing anything, so either kind of pointer
+ * is fine in any field.
+ */
+struct ebox_arena {
+	struct ebox_arena *ea_next;
+	size_t ea_size;
+	size_t ea_used;
+	uint8_t ea_data[];
+};
+
+#define	EBOX_ARENA_CHUNK	4096
+#define	EBOX_ARENA_ALIGN	16
+
+static void *
+ebox_arena_alloc(struct ebox_arena **pea, size_t len)
+{
+	struct ebox_arena *ea = *pea;
+	uintptr_t p;
+	size_t sz;
+
+	if (ea != NULL) {
+		p = (uintptr_t)&ea->ea_data[ea->ea_used];
+		p = (p + EBOX_ARENA_ALIGN - 1) & ~(EBOX_ARENA_ALIGN - 1);
+		if (p + len <= (uintptr_t)&ea->ea_data[ea->ea_size]) {
+			ea->ea_used = (p + len) - (uintptr_t)ea->ea_data;
+			return ((void *)p);
+		}
+	}
+
+	sz = len + EBOX_ARENA_ALIGN;
+	if (sz < EBOX_ARENA_CHUNK - sizeof (struct ebox_arena))
+		sz = EBOX_ARENA_CHUNK - sizeof (struct ebox_arena);
+	ea = calloc_conceal(1, sizeof (struct ebox_arena) + sz);
+	if (ea == NULL)
+		return (NULL);
+	ea->ea_size = sz;
+	/*
+	 * Only the newest chunk is ever allocated from, so a big allocation
+	 * which doesn't fit would waste whatever is left in the current one.
+	 * Put those behind the head instead.
+	 */
+	if (*pea != NULL && len > EBOX_ARENA_CHUNK / 2) {
+		ea->ea_next = (*pea)->ea_next;
+		(*pea)->ea_next = ea;
+	} else {
+		ea->ea_next = *pea;
+		*pea = ea;
+	}
+	p = (uintptr_t)ea->ea_data;
+	p = (p + EBOX_ARENA_ALIGN - 1) & ~(EBOX_ARENA_ALIGN - 1);
+	ea->ea_used = (p + len) - (uintptr_t)ea->ea_data;
+	return ((void *)p);
+}
+
+static boolean_t
+ebox_arena_owns(const struct ebox_arena *ea, const void *ptr)
+{
+	uintptr_t p = (uintptr_t)ptr;
+	for (; ea != NULL; ea = ea->ea_next) {
+		if (p >= (uintptr_t)ea->ea_data &&
+		    p < (uintptr_t)&ea->ea_data[ea->ea_size])
+			return (B_TRUE);
+	}
+	return (B_FALSE);
+}
+
+static void
+ebox_arena_free(struct ebox_arena *ea)
+{
+	struct ebox_arena *nea;
+	for (; ea != NULL; ea = nea) {
+		nea = ea->ea_next;
+		freezero(ea, sizeof (struct ebox_arena) + ea->ea_size);
+	}
+}
+
+/* free() for pointers that might be owned by the arena. */
+static void
+ebox_afree(const struct ebox_arena *ea, void *ptr)
+{
+	if (ptr != NULL && !ebox_arena_owns(ea, ptr))
+		free(ptr);
+}
+
+static void
+ebox_afreezero(const struct ebox_arena *ea, void *ptr, size_t len)
+{
+	if (ptr != NULL && !ebox_arena_owns(ea, ptr))
+		freezero(ptr, len);
+}
+
+/*
+ * Equivalents of sshbuf_get_string8() etc which copy into the arena. Like
+ * those, the copies are always NUL-terminated.
+ */
+static int
+ebox_arena_copy(struct ebox_arena **pea, const u_char *p, size_t len,
+    uint8_t **valp, size_t *lenp)
+{
+	uint8_t *v;
+	if ((v = ebox_arena_alloc(pea, len + 1)) == NULL)
+		return (SSH_ERR_ALLOC_FAIL);
+	if (len > 0)
+		bcopy(p, v, len);
+	v[len] = '\0';
+	*valp = v;
+	if (lenp != NULL)
+		*lenp = len;
+	return (0);
+}
+
+static int
+ebox_arena_get_string8(struct sshbuf *buf, struct ebox_arena **pea,
+    uint8_t **valp, size_t *lenp)
+{
+	const u_char *p;
+	size_t len;
+	int rc;
+	if ((rc = sshbuf_get_string8_direct(buf, &p, &len)))
+		return (rc);
+	return (ebox_arena_copy(pea, p, len, valp, lenp));
+}
+
+static int
+ebox_arena_get_string(struct sshbuf *buf, struct ebox_arena **pea,
+    uint8_t **valp, size_t *lenp)
+{
+	const u_char *p;
+	size_t len;
+	int rc;
+	if ((rc = sshbuf_get_string_direct(buf, &p, &len)))
+		return (rc);
+	return (ebox_arena_copy(pea, p, len, valp, lenp));
+}
+
+static int
+ebox_arena_get_cstring8(struct sshbuf *buf, struct ebox_arena **pea,
+    char **valp, size_t *lenp)
+{
+	const u_char *p, *z;
+	size_t len;
+	int rc;
+	if ((rc = sshbuf_peek_string8_direct(buf, &p, &len)))
+		return (rc);
+	/* Allow a \0 only at the end of the string, as sshbuf does */
+	if (len > 0 && (z = memchr(p, '\0', len)) != NULL &&
+	    z < p + len - 1)
+		return (SSH_ERR_INVALID_FORMAT);
+	if ((rc = sshbuf_skip_string8(buf)))
+		return (rc);
+	return (ebox_arena_copy(pea, p, len, (uint8_t **)valp, lenp));
+}
+
 static struct sshkey *
 ebox_get_ephem_for_nid(const struct ebox *ebox, int nid)
 {
@@ -255,7 +627,7 @@ ebox_make_ephem_for_nid(struct ebox *ebox, int nid)
 	eek->eek_next = ebox->e_ephemkeys;
 	ebox->e_ephemkeys = eek;
 	eek->eek_nid = nid;
-	VERIFY0(sshkey_generate(KEY_ECDSA, bits, &eek->eek_ephem));
+	VERIFY0(piv_ephem_take(bits, &eek->eek_ephem));
 	return (eek->eek_ephem);
 }
 
@@ -332,8 +704,13 @@ ebox_tpl_next_config(const struct ebox_tpl *tpl,
 	return (prev->etc_next);
 }
 
-void
-ebox_tpl_free(struct ebox_tpl *tpl)
+static void ebox_tpl_config_free_arena(struct ebox_tpl_config *,
+    const struct ebox_arena *);
+static void ebox_tpl_part_free_arena(struct ebox_tpl_part *,
+    const struct ebox_arena *);
+
+static void
+ebox_tpl_free_arena(struct ebox_tpl *tpl, const struct ebox_arena *ea)
 {
 	struct ebox_tpl_config *config, *nconfig;
 	if (tpl == NULL)
@@ -341,9 +718,15 @@ ebox_tpl_free(struct ebox_tpl *tpl)
 	free(tpl->et_priv);
 	for (config = tpl->et_configs; config != NULL; config = nconfig) {
 		nconfig = config->etc_next;
-		ebox_tpl_config_free(config);
+		ebox_tpl_config_free_arena(config, ea);
 	}
-	free(tpl);
+	ebox_afree(ea, tpl);
+}
+
+void
+ebox_tpl_free(struct ebox_tpl *tpl)
+{
+	ebox_tpl_free_arena(tpl, NULL);
 }
 
 struct ebox_tpl_config *
@@ -453,8 +836,9 @@ ebox_tpl_config_next_part(const struct ebox_tpl_config *config,
 	return (prev->etp_next);
 }
 
-void
-ebox_tpl_config_free(struct ebox_tpl_config *config)
+static void
+ebox_tpl_config_free_arena(struct ebox_tpl_config *config,
+    const struct ebox_arena *ea)
 {
 	struct ebox_tpl_part *part, *npart;
 	if (config == NULL)
@@ -462,9 +846,15 @@ ebox_tpl_config_free(struct ebox_tpl_config *config)
 	free(config->etc_priv);
 	for (part = config->etc_parts; part != NULL; part = npart) {
 		npart = part->etp_next;
-		ebox_tpl_part_free(part);
+		ebox_tpl_part_free_arena(part, ea);
 	}
-	free(config);
+	ebox_afree(ea, config);
+}
+
+void
+ebox_tpl_config_free(struct ebox_tpl_config *config)
+{
+	ebox_tpl_config_free_arena(config, NULL);
 }
 
 struct ebox_tpl_part *
@@ -485,16 +875,23 @@ ebox_tpl_part_alloc(const uint8_t *guid, size_t guidlen,
 	return (part);
 }
 
-void
-ebox_tpl_part_free(struct ebox_tpl_part *part)
+static void
+ebox_tpl_part_free_arena(struct ebox_tpl_part *part,
+    const struct ebox_arena *ea)
 {
 	if (part == NULL)
 		return;
 	free(part->etp_priv);
-	free(part->etp_name);
+	ebox_afree(ea, part->etp_name);
 	sshkey_free(part->etp_pubkey);
 	sshkey_free(part->etp_cak);
-	free(part);
+	ebox_afree(ea, part);
+}
+
+void
+ebox_tpl_part_free(struct ebox_tpl_part *part)
+{
+	ebox_tpl_part_free_arena(part, NULL);
 }
 
 void
@@ -1083,36 +1480,46 @@ out:
 	return (err);
 }
 
-void
-ebox_part_free(struct ebox_part *part)
+static void
+ebox_part_free_arena(struct ebox_part *part, const struct ebox_arena *ea)
 {
 	if (part == NULL)
 		return;
 	piv_box_free(part->ep_box);
 	ebox_challenge_free(part->ep_chal);
-	if (part->ep_share != NULL) {
-		explicit_bzero(part->ep_share, part->ep_sharelen);
-		free(part->ep_share);
-	}
+	ebox_afreezero(ea, part->ep_share, part->ep_sharelen);
 	free(part->ep_priv);
-	free(part);
+	ebox_afree(ea, part);
 }
 
 void
-ebox_config_free(struct ebox_config *config)
+ebox_part_free(struct ebox_part *part)
+{
+	ebox_part_free_arena(part, NULL);
+}
+
+static void
+ebox_config_free_arena(struct ebox_config *config,
+    const struct ebox_arena *ea)
 {
 	struct ebox_part *part, *npart;
 	if (config == NULL)
 		return;
 	if (config->ec_chalkey != NULL)
 		sshkey_free(config->ec_chalkey);
-	freezero(config->ec_nonce, config->ec_noncelen);
+	ebox_afreezero(ea, config->ec_nonce, config->ec_noncelen);
 	free(config->ec_priv);
 	for (part = config->ec_parts; part != NULL; part = npart) {
 		npart = part->ep_next;
-		ebox_part_free(part);
+		ebox_part_free_arena(part, ea);
 	}
-	free(config);
+	ebox_afree(ea, config);
+}
+
+void
+ebox_config_free(struct ebox_config *config)
+{
+	ebox_config_free_arena(config, NULL);
 }
 
 void
@@ -1120,26 +1527,20 @@ ebox_free(struct ebox *box)
 {
 	struct ebox_config *config, *nconfig;
 	struct ebox_ephem_key *eek, *neek;
+	struct ebox_arena *ea;
 	if (box == NULL)
 		return;
+	ea = box->e_arena;
 	free(box->e_priv);
-	if (box->e_key != NULL) {
-		explicit_bzero(box->e_key, box->e_keylen);
-		free(box->e_key);
-	}
+	freezero_locked(box->e_key, box->e_keylen);
 	if (box->e_token != NULL) {
 		explicit_bzero(box->e_token, box->e_tokenlen);
 		free(box->e_token);
 	}
-	if (box->e_rcv_key.b_data != NULL) {
-		explicit_bzero(box->e_rcv_key.b_data, box->e_rcv_key.b_len);
-		free(box->e_rcv_key.b_data);
-	}
-	free(box->e_rcv_cipher);
-	if (box->e_rcv_iv.b_data != NULL)
-		free(box->e_rcv_iv.b_data);
-	if (box->e_rcv_enc.b_data != NULL)
-		free(box->e_rcv_enc.b_data);
+	freezero_locked(box->e_rcv_key.b_data, box->e_rcv_key.b_len);
+	ebox_afree(ea, box->e_rcv_cipher);
+	ebox_afree(ea, box->e_rcv_iv.b_data);
+	ebox_afree(ea, box->e_rcv_enc.b_data);
 	if (box->e_rcv_plain.b_data != NULL) {
 		explicit_bzero(box->e_rcv_plain.b_data,
 		    box->e_rcv_plain.b_len);
@@ -1147,15 +1548,16 @@ ebox_free(struct ebox *box)
 	}
 	for (config = box->e_configs; config != NULL; config = nconfig) {
 		nconfig = config->ec_next;
-		ebox_config_free(config);
+		ebox_config_free_arena(config, ea);
 	}
 	for (eek = box->e_ephemkeys; eek != NULL; eek = neek) {
 		neek = eek->eek_next;
 		sshkey_free(eek->eek_ephem);
-		free(eek);
+		ebox_afree(ea, eek);
 	}
-	ebox_tpl_free(box->e_tpl);
+	ebox_tpl_free_arena(box->e_tpl, ea);
 	free(box);
+	ebox_arena_free(ea);
 }
 
 void *
@@ -1202,26 +1604,137 @@ ebox_part_free_private(struct ebox_part *part)
 	part->ep_priv = NULL;
 }
 
+/*
+ * Looks up the cipher and MAC named in a stream header once, so that the
+ * per-chunk code doesn't have to.
+ */
+static errf_t *
+ebox_stream_resolve(struct ebox_stream *es)
+{
+	const struct sshcipher *cipher;
+
+	cipher = cipher_by_name(es->es_cipher);
+	if (cipher == NULL) {
+		return (boxverrf(errf("BadAlgorithmError", NULL,
+		    "unsupported cipher '%s'", es->es_cipher)));
+	}
+	if (strcmp(es->es_mac, EBOX_STREAM_MAC_NONE) == 0) {
+		if (cipher_authlen(cipher) == 0) {
+			return (boxverrf(errf("BadAlgorithmError", NULL,
+			    "stream MAC '%s' requires an authenticated cipher "
+			    "(not '%s')", es->es_mac, es->es_cipher)));
+		}
+		es->es_dgalg = -1;
+		es->es_padded = B_FALSE;
+	} else {
+		es->es_dgalg = ssh_digest_alg_by_name(es->es_mac);
+		if (es->es_dgalg == -1) {
+			return (boxverrf(errf("BadAlgorithmError", NULL,
+			    "unsupported MAC algorithm '%s'", es->es_mac)));
+		}
+		es->es_padded = B_TRUE;
+	}
+	if (es->es_chunklen == 0) {
+		return (boxderrf(errf("LengthError", NULL,
+		    "stream chunk size must be non-zero")));
+	}
+	if (es->es_chunklen > EBOX_STREAM_MAX_CHUNK) {
+		return (boxderrf(errf("LengthError", NULL,
+		    "stream chunk size (%zu) is larger than the maximum "
+		    "supported (%u)", es->es_chunklen,
+		    EBOX_STREAM_MAX_CHUNK)));
+	}
+	if (es->es_comp == NULL) {
+		es->es_compalg = EBOX_COMP_NONE;
+	} else if (strcmp(es->es_comp, EBOX_STREAM_COMP_ZLIB) == 0) {
+		es->es_compalg = EBOX_COMP_ZLIB;
+	} else {
+		return (boxverrf(errf("BadAlgorithmError", NULL,
+		    "unsupported compression codec '%s'", es->es_comp)));
+	}
+
+	es->es_cipher_alg = cipher;
+	es->es_ivlen = cipher_ivlen(cipher);
+	es->es_authlen = cipher_authlen(cipher);
+	es->es_blocksz = cipher_blocksize(cipher);
+	es->es_keylen = cipher_keylen(cipher);
+	if (es->es_authlen == 0)
+		es->es_maclen = ssh_digest_bytes(es->es_dgalg);
+	else
+		es->es_maclen = 0;
+	es->es_maclanes = 1;
+	if (es->es_maclen > 0)
+		es->es_maclanes = ssh_digest_multi_lanes(es->es_dgalg);
+
+	return (ERRF_OK);
+}
+
 errf_t *
 ebox_stream_new(const struct ebox_tpl *tpl, struct ebox_stream **str)
+{
+	return (ebox_stream_new_cipher(tpl, "aes256-ctr", str));
+}
+
+/*
+ * Ciphers new streams may use. Every chunk is encrypted under the same key
+ * with its seqnr in the IV, so this has to be a counter mode or an AEAD:
+ * arcfour would reuse its keystream for each chunk, and CBC gains nothing.
+ */
+static const char *ebox_stream_ciphers[] = {
+	"aes128-ctr",
+	"aes192-ctr",
+	"aes256-ctr",
+	"aes128-gcm",
+	"aes256-gcm",
+	"chacha20-poly1305",
+	NULL
+};
+
+errf_t *
+ebox_stream_new_cipher(const struct ebox_tpl *tpl, const char *ciphername,
+    struct ebox_stream **str)
 {
 	struct ebox_stream *es;
+	const struct sshcipher *cipher;
 	uint8_t *key;
 	size_t keylen;
 	errf_t *err;
-	const struct sshcipher *cipher;
+	uint i;
+
+	for (i = 0; ebox_stream_ciphers[i] != NULL; ++i) {
+		if (strcmp(ebox_stream_ciphers[i], ciphername) == 0)
+			break;
+	}
+	if (ebox_stream_ciphers[i] == NULL) {
+		return (argerrf("cipher", "one of aes128-ctr, aes192-ctr, "
+		    "aes256-ctr, aes128-gcm, aes256-gcm or chacha20-poly1305",
+		    "'%s'", ciphername));
+	}
+
+	cipher = cipher_by_name(ciphername);
+	if (cipher == NULL) {
+		return (errf("BadAlgorithmError", NULL,
+		    "unsupported cipher '%s'", ciphername));
+	}
 
 	es = calloc(1, sizeof (struct ebox_stream));
 	VERIFY(es != NULL);
 	es->es_chunklen = EBOX_STREAM_DEFAULT_CHUNK;
 
-	es->es_cipher = strdup("aes256-ctr");
-	es->es_mac = strdup("sha256");
-	cipher = cipher_by_name(es->es_cipher);
-	VERIFY(cipher != NULL);
-	keylen = cipher_keylen(cipher);
+	es->es_cipher = strdup(ciphername);
+	if (cipher_authlen(cipher) > 0)
+		es->es_mac = strdup(EBOX_STREAM_MAC_NONE);
+	else
+		es->es_mac = strdup("sha256");
+	VERIFY(es->es_cipher != NULL && es->es_mac != NULL);
+	err = ebox_stream_resolve(es);
+	if (err) {
+		ebox_stream_free(es);
+		return (err);
+	}
+	keylen = es->es_keylen;
 
-	key = malloc_conceal(keylen);
+	key = calloc_locked(1, keylen);
 	VERIFY(key != NULL);
 	arc4random_buf(key, keylen);
 
@@ -1242,21 +1755,70 @@ ebox_stream_new(const struct ebox_tpl *tpl, struct ebox_stream **str)
 	return (ERRF_OK);
 }
 
+errf_t *
+ebox_stream_set_chunk_size(struct ebox_stream *es, size_t chunklen)
+{
+	if (chunklen < EBOX_STREAM_MIN_CHUNK ||
+	    chunklen > EBOX_STREAM_MAX_CHUNK) {
+		return (errf("LengthError", NULL, "stream chunk size (%zu) "
+		    "must be between %u and %u bytes", chunklen,
+		    EBOX_STREAM_MIN_CHUNK, EBOX_STREAM_MAX_CHUNK));
+	}
+	es->es_chunklen = chunklen;
+	return (ERRF_OK);
+}
+
+errf_t *
+ebox_stream_set_compression(struct ebox_stream *es, const char *codec)
+{
+	if (codec != NULL && strcmp(codec, "none") == 0)
+		codec = NULL;
+	if (codec != NULL && strcmp(codec, EBOX_STREAM_COMP_ZLIB) != 0) {
+		return (errf("BadAlgorithmError", NULL,
+		    "unsupported compression codec '%s'", codec));
+	}
+	free(es->es_comp);
+	es->es_comp = NULL;
+	if (codec != NULL && (es->es_comp = strdup(codec)) == NULL)
+		return (ERRF_NOMEM);
+	return (ebox_stream_resolve(es));
+}
+
 errf_t *
 sshbuf_put_ebox_stream(struct sshbuf *buf, struct ebox_stream *es)
 {
-	int rc;
 	errf_t *err;
 
 	err = sshbuf_put_ebox(buf, es->es_ebox);
 	if (err)
 		return (err);
+	return (sshbuf_put_ebox_stream_params(buf, es));
+}
 
-	if ((rc = sshbuf_put_u64(buf, es->es_chunklen)))
+errf_t *
+sshbuf_put_ebox_stream_params(struct sshbuf *buf,
+    const struct ebox_stream *es)
+{
+	uint64_t chunklen;
+	int rc;
+
+	chunklen = es->es_chunklen;
+	if (es->es_comp != NULL)
+		chunklen |= EBOX_STREAM_F_COMP;
+	if (es->es_trailer)
+		chunklen |= EBOX_STREAM_F_TRAILER;
+	if (es->es_appended)
+		chunklen |= EBOX_STREAM_F_APPENDED;
+	if (es->es_appending)
+		chunklen |= EBOX_STREAM_F_APPENDING;
+	if ((rc = sshbuf_put_u64(buf, chunklen)))
 		return (ssherrf("sshbuf_put_u64", rc));
 	if ((rc = sshbuf_put_cstring8(buf, es->es_cipher)) ||
 	    (rc = sshbuf_put_cstring8(buf, es->es_mac)))
 		return (ssherrf("sshbuf_put_cstring8", rc));
+	if (es->es_comp != NULL &&
+	    (rc = sshbuf_put_cstring8(buf, es->es_comp)))
+		return (ssherrf("sshbuf_put_cstring8", rc));
 
 	return (ERRF_OK);
 }
@@ -1267,7 +1829,7 @@ sshbuf_put_ebox_stream_chunk(struct sshbuf *buf,
 {
 	int rc;
 
-	if (esc->esc_enc == NULL) {
+	if (esc->esc_enc == NULL || esc->esc_enclen == 0) {
 		return (argerrf("chunk", "an encrypted chunk",
 		    "a chunk that hasn't had ebox_stream_encrypt_chunk() "
 		    "called yet"));
@@ -1305,6 +1867,7 @@ sshbuf_get_ebox_stream_chunk(struct sshbuf *buf, const struct ebox_stream *es,
 		err = boxderrf(ssherrf("sshbuf_get_string", rc));
 		goto out;
 	}
+	esc->esc_encsz = esc->esc_enclen;
 
 	*chunk = esc;
 	esc = NULL;
@@ -1315,15 +1878,70 @@ out:
 	return (err);
 }
 
+errf_t *
+sshbuf_get_ebox_stream_chunk_into(struct sshbuf *buf,
+    struct ebox_stream_chunk *esc)
+{
+	const uint8_t *enc;
+	size_t enclen;
+	uint32_t seqnr;
+	int rc;
+
+	if ((rc = sshbuf_get_u32(buf, &seqnr)))
+		return (boxderrf(ssherrf("sshbuf_get_u32", rc)));
+	if ((rc = sshbuf_get_string_direct(buf, &enc, &enclen)))
+		return (boxderrf(ssherrf("sshbuf_get_string_direct", rc)));
+
+	if (!esc->esc_enc_borrowed) {
+		free(esc->esc_enc);
+		esc->esc_encsz = 0;
+	}
+	esc->esc_enc = (uint8_t *)enc;
+	esc->esc_enclen = enclen;
+	esc->esc_enc_borrowed = B_TRUE;
+	esc->esc_seqnr = seqnr;
+	esc->esc_plainlen = 0;
+
+	return (ERRF_OK);
+}
+
+errf_t *
+sshbuf_get_ebox_stream_chunk_ref(struct sshbuf *buf,
+    const struct ebox_stream *es, struct ebox_stream_chunk **chunk)
+{
+	struct ebox_stream_chunk *esc;
+	errf_t *err;
+
+	esc = calloc(1, sizeof (struct ebox_stream_chunk));
+	if (esc == NULL)
+		return (ERRF_NOMEM);
+	esc->esc_stream = (struct ebox_stream *)es;
+
+	err = sshbuf_get_ebox_stream_chunk_into(buf, esc);
+	if (err) {
+		ebox_stream_chunk_free(esc);
+		return (err);
+	}
+
+	*chunk = esc;
+	return (ERRF_OK);
+}
+
+static void ebox_stream_chunk_zfree(struct ebox_stream_chunk *);
+
 void
 ebox_stream_chunk_free(struct ebox_stream_chunk *chunk)
 {
 	if (chunk == NULL)
 		return;
-	free(chunk->esc_enc);
-	if (chunk->esc_plainlen > 0)
-		explicit_bzero(chunk->esc_plain, chunk->esc_plainlen);
-	free(chunk->esc_plain);
+	if (!chunk->esc_enc_borrowed)
+		free(chunk->esc_enc);
+	freezero(chunk->esc_plain, chunk->esc_plainsz);
+	free(chunk->esc_iv);
+	cipher_free(chunk->esc_cctx);
+	ssh_hmac_free(chunk->esc_hctx);
+	freezero(chunk->esc_zbuf, chunk->esc_zbufsz);
+	ebox_stream_chunk_zfree(chunk);
 	free(chunk);
 }
 
@@ -1334,9 +1952,8 @@ sshbuf_get_ebox_stream(struct sshbuf *buf, struct ebox_stream **pes)
 	struct ebox *e = NULL;
 	int rc;
 	errf_t *err;
-	const struct sshcipher *cipher;
-	int dgalg;
 	uint64_t chunklen;
+	boolean_t comp;
 
 	err = sshbuf_get_ebox(buf, &e);
 	if (err)
@@ -1360,6 +1977,12 @@ sshbuf_get_ebox_stream(struct sshbuf *buf, struct ebox_stream **pes)
 		err = boxderrf(ssherrf("sshbuf_get_u64", rc));
 		goto out;
 	}
+	comp = (chunklen & EBOX_STREAM_F_COMP) != 0;
+	es->es_trailer = (chunklen & EBOX_STREAM_F_TRAILER) != 0;
+	es->es_appended = (chunklen & EBOX_STREAM_F_APPENDED) != 0;
+	es->es_appending = (chunklen & EBOX_STREAM_F_APPENDING) != 0;
+	chunklen &= ~(EBOX_STREAM_F_COMP | EBOX_STREAM_F_TRAILER |
+	    EBOX_STREAM_F_APPENDED | EBOX_STREAM_F_APPENDING);
 	if (chunklen > SIZE_MAX) {
 		err = boxderrf(errf("OverflowError", NULL,
 		    "stream chunk size (%" PRIu64 ") too large", chunklen));
@@ -1372,19 +1995,13 @@ sshbuf_get_ebox_stream(struct sshbuf *buf, struct ebox_stream **pes)
 		err = boxderrf(ssherrf("sshbuf_get_cstring8", rc));
 		goto out;
 	}
-
-	cipher = cipher_by_name(es->es_cipher);
-	if (cipher == NULL) {
-		err = boxverrf(errf("BadAlgorithmError", NULL,
-		    "unsupported cipher '%s'", es->es_cipher));
+	if (comp && (rc = sshbuf_get_cstring8(buf, &es->es_comp, NULL))) {
+		err = boxderrf(ssherrf("sshbuf_get_cstring8", rc));
 		goto out;
 	}
-	dgalg = ssh_digest_alg_by_name(es->es_mac);
-	if (dgalg == -1) {
-		err = boxverrf(errf("BadAlgorithmError", NULL,
-		    "unsupported MAC algorithm '%s'", es->es_mac));
+
+	if ((err = ebox_stream_resolve(es)))
 		goto out;
-	}
 
 	*pes = es;
 	es = NULL;
@@ -1396,173 +2013,467 @@ out:
 	return (err);
 }
 
-errf_t *
-ebox_stream_encrypt_chunk(struct ebox_stream_chunk *esc)
+/*
+ * Grows a chunk buffer to hold at least len bytes, keeping the first "keep"
+ * bytes of its contents.
+ */
+static errf_t *
+ebox_stream_buf_reserve(uint8_t **buf, size_t *bufsz, size_t keep, size_t len)
 {
-	struct ebox_stream *es;
-	const struct sshcipher *cipher;
-	int dgalg = -1;
-	size_t blocksz, ivlen, authlen, keylen, plainlen, enclen, maclen;
-	size_t padding, i;
-	uint8_t *key, *plain, *enc, *iv;
-	struct sshcipher_ctx *cctx = NULL;
-	struct ssh_hmac_ctx *hctx = NULL;
+	uint8_t *nbuf;
 
-	es = esc->esc_stream;
-	plainlen = esc->esc_plainlen;
+	if (*bufsz >= len)
+		return (ERRF_OK);
+	nbuf = malloc(len);
+	if (nbuf == NULL)
+		return (ERRF_NOMEM);
+	if (keep > 0)
+		bcopy(*buf, nbuf, keep);
+	freezero(*buf, *bufsz);
+	*buf = nbuf;
+	*bufsz = len;
+	return (ERRF_OK);
+}
 
-	cipher = cipher_by_name(es->es_cipher);
-	VERIFY(cipher != NULL);
-	ivlen = cipher_ivlen(cipher);
-	authlen = cipher_authlen(cipher);
-	blocksz = cipher_blocksize(cipher);
-	keylen = cipher_keylen(cipher);
+/*
+ * Gets a chunk's cipher and MAC contexts ready for its current seqnr. The
+ * key schedules are only computed the first time around: after that we just
+ * load the new IV and rewind the HMAC.
+ */
+static void
+ebox_stream_mac_seqnr(const struct ebox_stream_chunk *esc, uint8_t *seqbuf)
+{
+	seqbuf[0] = esc->esc_seqnr >> 24;
+	seqbuf[1] = esc->esc_seqnr >> 16;
+	seqbuf[2] = esc->esc_seqnr >> 8;
+	seqbuf[3] = esc->esc_seqnr;
+}
 
-	if (ivlen > 0) {
-		iv = calloc(1, ivlen);
-		VERIFY3U(ivlen, >=, sizeof (uint32_t));
-		*(uint32_t *)iv = htobe32(esc->esc_seqnr);
-	} else {
-		iv = NULL;
+static errf_t *
+ebox_stream_chunk_keysetup(struct ebox_stream_chunk *esc, int do_encrypt)
+{
+	struct ebox_stream *es = esc->esc_stream;
+	const uint8_t *key;
+	uint8_t seqbuf[4];
+	int rc;
+
+	VERIFY3U(es->es_ebox->e_keylen, >=, es->es_keylen);
+	key = es->es_ebox->e_key;
+	VERIFY(key != NULL);
+
+	if (es->es_ivlen > 0) {
+		if (esc->esc_iv == NULL) {
+			esc->esc_iv = calloc(1, es->es_ivlen);
+			if (esc->esc_iv == NULL)
+				return (ERRF_NOMEM);
+		}
+		VERIFY3U(es->es_ivlen, >=, sizeof (uint32_t));
+		bzero(esc->esc_iv, es->es_ivlen);
+		*(uint32_t *)esc->esc_iv = htobe32(esc->esc_seqnr);
+	}
+
+	if (esc->esc_cctx != NULL && (esc->esc_cctx_dir != do_encrypt ||
+	    cipher_set_keyiv(esc->esc_cctx, esc->esc_iv) != 0)) {
+		cipher_free(esc->esc_cctx);
+		esc->esc_cctx = NULL;
+	}
+	if (esc->esc_cctx == NULL) {
+		rc = cipher_init(&esc->esc_cctx, es->es_cipher_alg, key,
+		    es->es_keylen, esc->esc_iv, es->es_ivlen, do_encrypt);
+		if (rc != 0)
+			return (ssherrf("cipher_init", rc));
+		esc->esc_cctx_dir = do_encrypt;
+	}
+
+	if (es->es_maclen > 0) {
+		if (esc->esc_hctx == NULL) {
+			esc->esc_hctx = ssh_hmac_start(es->es_dgalg);
+			if (esc->esc_hctx == NULL)
+				return (ERRF_NOMEM);
+			VERIFY0(ssh_hmac_init(esc->esc_hctx, key,
+			    es->es_keylen));
+		} else {
+			VERIFY0(ssh_hmac_init(esc->esc_hctx, NULL, 0));
+		}
+		if (es->es_trailer) {
+			ebox_stream_mac_seqnr(esc, seqbuf);
+			VERIFY0(ssh_hmac_update(esc->esc_hctx, seqbuf,
+			    sizeof (seqbuf)));
+		}
 	}
 
-	if (authlen == 0) {
-		dgalg = ssh_digest_alg_by_name(es->es_mac);
-		VERIFY(dgalg != -1);
-		maclen = ssh_digest_bytes(dgalg);
+	return (ERRF_OK);
+}
+
+static void
+ebox_stream_chunk_zfree(struct ebox_stream_chunk *esc)
+{
+	if (esc->esc_zs == NULL)
+		return;
+	if (esc->esc_zs_dir == CIPHER_ENCRYPT)
+		(void) deflateEnd(esc->esc_zs);
+	else
+		(void) inflateEnd(esc->esc_zs);
+	free(esc->esc_zs);
+	esc->esc_zs = NULL;
+}
+
+/* Gets the chunk's zlib state ready for compressing or decompressing. */
+static errf_t *
+ebox_stream_chunk_zsetup(struct ebox_stream_chunk *esc, int do_encrypt)
+{
+	int rc;
+
+	if (esc->esc_zs != NULL && esc->esc_zs_dir == do_encrypt) {
+		if (do_encrypt == CIPHER_ENCRYPT)
+			rc = deflateReset(esc->esc_zs);
+		else
+			rc = inflateReset(esc->esc_zs);
+		if (rc == Z_OK)
+			return (ERRF_OK);
+	}
+	ebox_stream_chunk_zfree(esc);
+
+	esc->esc_zs = calloc(1, sizeof (z_stream));
+	if (esc->esc_zs == NULL)
+		return (ERRF_NOMEM);
+	/*
+	 * Streams are usually bulk data where throughput matters more than
+	 * the last few percent of compression.
+	 */
+	if (do_encrypt == CIPHER_ENCRYPT)
+		rc = deflateInit(esc->esc_zs, Z_BEST_SPEED);
+	else
+		rc = inflateInit(esc->esc_zs);
+	if (rc != Z_OK) {
+		free(esc->esc_zs);
+		esc->esc_zs = NULL;
+		return (errf("ZlibError", NULL, "failed to initialise zlib "
+		    "(rc = %d)", rc));
+	}
+	esc->esc_zs_dir = do_encrypt;
+	return (ERRF_OK);
+}
+
+/*
+ * Compresses the chunk's plaintext into esc_zbuf (with its type byte in
+ * front), leaving room after it for padding.
+ */
+static errf_t *
+ebox_stream_chunk_deflate(struct ebox_stream_chunk *esc, size_t *plen)
+{
+	struct ebox_stream *es = esc->esc_stream;
+	z_stream *zs;
+	size_t bound;
+	int rc;
+	errf_t *err;
+
+	if ((err = ebox_stream_chunk_zsetup(esc, CIPHER_ENCRYPT)))
+		return (err);
+	zs = esc->esc_zs;
+
+	bound = deflateBound(zs, esc->esc_plainlen);
+	if (bound < esc->esc_plainlen)
+		bound = esc->esc_plainlen;
+	err = ebox_stream_buf_reserve(&esc->esc_zbuf, &esc->esc_zbufsz, 0,
+	    1 + bound + es->es_blocksz);
+	if (err)
+		return (err);
+
+	zs->next_in = esc->esc_plain;
+	zs->avail_in = esc->esc_plainlen;
+	zs->next_out = &esc->esc_zbuf[1];
+	zs->avail_out = bound;
+	rc = deflate(zs, Z_FINISH);
+
+	if (rc == Z_STREAM_END && zs->total_out < esc->esc_plainlen) {
+		esc->esc_zbuf[0] = EBOX_STREAM_CHUNK_DEFLATED;
+		*plen = 1 + zs->total_out;
 	} else {
-		maclen = 0;
+		esc->esc_zbuf[0] = EBOX_STREAM_CHUNK_STORED;
+		bcopy(esc->esc_plain, &esc->esc_zbuf[1], esc->esc_plainlen);
+		*plen = 1 + esc->esc_plainlen;
 	}
+	return (ERRF_OK);
+}
 
-	VERIFY3U(es->es_ebox->e_keylen, >=, keylen);
-	key = es->es_ebox->e_key;
-	VERIFY(key != NULL);
+/*
+ * The reverse of ebox_stream_chunk_deflate(): takes the decrypted chunk in
+ * esc_zbuf and puts the original plaintext into esc_plain.
+ */
+static errf_t *
+ebox_stream_chunk_inflate(struct ebox_stream_chunk *esc, size_t zlen)
+{
+	struct ebox_stream *es = esc->esc_stream;
+	z_stream *zs;
+	int rc;
+	errf_t *err;
+
+	if (zlen < 1) {
+		return (errf("LengthError", NULL, "compressed stream chunk "
+		    "is missing its type byte"));
+	}
+	err = ebox_stream_buf_reserve(&esc->esc_plain, &esc->esc_plainsz, 0,
+	    es->es_chunklen);
+	if (err)
+		return (err);
+
+	switch (esc->esc_zbuf[0]) {
+	case EBOX_STREAM_CHUNK_STORED:
+		if (zlen - 1 > es->es_chunklen)
+			goto toolong;
+		bcopy(&esc->esc_zbuf[1], esc->esc_plain, zlen - 1);
+		esc->esc_plainlen = zlen - 1;
+		return (ERRF_OK);
+	case EBOX_STREAM_CHUNK_DEFLATED:
+		break;
+	default:
+		return (errf("ZlibError", NULL, "unknown stream chunk type "
+		    "0x%02x", esc->esc_zbuf[0]));
+	}
+
+	if ((err = ebox_stream_chunk_zsetup(esc, CIPHER_DECRYPT)))
+		return (err);
+	zs = esc->esc_zs;
+	zs->next_in = &esc->esc_zbuf[1];
+	zs->avail_in = zlen - 1;
+	zs->next_out = esc->esc_plain;
+	zs->avail_out = es->es_chunklen;
+	rc = inflate(zs, Z_FINISH);
+	if (rc == Z_BUF_ERROR && zs->avail_out == 0)
+		goto toolong;
+	if (rc != Z_STREAM_END || zs->avail_in != 0) {
+		explicit_bzero(esc->esc_plain, es->es_chunklen);
+		return (errf("ZlibError", NULL, "failed to decompress stream "
+		    "chunk (rc = %d)", rc));
+	}
+	esc->esc_plainlen = zs->total_out;
+	return (ERRF_OK);
+
+toolong:
+	explicit_bzero(esc->esc_plain, es->es_chunklen);
+	return (errf("LengthError", NULL, "decompressed stream chunk is "
+	    "longer than the chunk size (%zu)", es->es_chunklen));
+}
+
+static boolean_t
+ebox_stream_chunk_compressed(const struct ebox_stream_chunk *esc)
+{
+	const struct ebox_stream *es = esc->esc_stream;
+
+	if (es->es_compalg == EBOX_COMP_NONE)
+		return (B_FALSE);
+	return (!ebox_stream_chunk_is_trailer(esc));
+}
+
+/*
+ * Everything in encrypting a chunk except computing its MAC (the space for
+ * which is left at the end of esc_enc).
+ */
+static errf_t *
+ebox_stream_chunk_seal(struct ebox_stream_chunk *esc)
+{
+	struct ebox_stream *es;
+	size_t blocksz, authlen, plainlen, enclen, maclen;
+	size_t padding, i;
+	uint8_t *plain, *enc;
+	boolean_t comp;
+	int rc;
+	errf_t *err;
+
+	es = esc->esc_stream;
+	plainlen = esc->esc_plainlen;
+	blocksz = es->es_blocksz;
+	authlen = es->es_authlen;
+	maclen = es->es_maclen;
+	comp = ebox_stream_chunk_compressed(esc);
+
+	VERIFY(!esc->esc_enc_borrowed);
 
 	/*
 	 * We add PKCS#7 style padding, consisting of up to a block of bytes,
 	 * all set to the number of padding bytes added. This is easy to strip
 	 * off after decryption and avoids the need to include and validate the
 	 * real length of the payload separately.
+	 *
+	 * The padding goes in after the plaintext in the chunk's own buffer
+	 * (which ebox_stream_chunk_reset() leaves room for).
+	 *
+	 * AEAD streams don't need any of this: the cipher takes any length.
+	 *
+	 * On compressed streams it's the compressed chunk (in esc_zbuf) that
+	 * gets padded and encrypted (except for the trailer).
 	 */
-	padding = blocksz - (plainlen % blocksz);
-	VERIFY3U(padding, <=, blocksz);
-	VERIFY3U(padding, >, 0);
-	plainlen += padding;
-	plain = malloc(plainlen);
-	VERIFY3P(plain, !=, NULL);
-	bcopy(esc->esc_plain, plain, esc->esc_plainlen);
-	for (i = esc->esc_plainlen; i < plainlen; ++i)
+	if (comp) {
+		if ((err = ebox_stream_chunk_deflate(esc, &plainlen)))
+			return (err);
+	}
+	if (es->es_padded) {
+		padding = blocksz - (plainlen % blocksz);
+		VERIFY3U(padding, <=, blocksz);
+		VERIFY3U(padding, >, 0);
+	} else {
+		padding = 0;
+	}
+	if (comp) {
+		VERIFY3U(esc->esc_zbufsz, >=, plainlen + padding);
+		plain = esc->esc_zbuf;
+	} else {
+		err = ebox_stream_buf_reserve(&esc->esc_plain,
+		    &esc->esc_plainsz, plainlen, plainlen + padding);
+		if (err)
+			return (err);
+		plain = esc->esc_plain;
+	}
+	for (i = plainlen; i < plainlen + padding; ++i)
 		plain[i] = padding;
+	plainlen += padding;
 
 	enclen = plainlen + authlen + maclen;
-	esc->esc_enc = (enc = malloc(enclen));
-	VERIFY(enc != NULL);
+	err = ebox_stream_buf_reserve(&esc->esc_enc, &esc->esc_encsz, 0,
+	    enclen);
+	if (err)
+		return (err);
+	enc = esc->esc_enc;
 	esc->esc_enclen = enclen;
 
-	VERIFY0(cipher_init(&cctx, cipher, key, keylen, iv, ivlen, 1));
-	VERIFY0(cipher_crypt(cctx, esc->esc_seqnr, enc, plain, plainlen, 0,
-	    authlen));
-	cipher_free(cctx);
+	if ((err = ebox_stream_chunk_keysetup(esc, CIPHER_ENCRYPT)))
+		return (err);
 
-	if (dgalg != -1) {
-		hctx = ssh_hmac_start(dgalg);
-		VERIFY(hctx != NULL);
-		VERIFY0(ssh_hmac_init(hctx, key, keylen));
-		VERIFY0(ssh_hmac_update(hctx, enc, enclen - maclen));
-		VERIFY0(ssh_hmac_final(hctx, &enc[enclen - maclen], maclen));
-		ssh_hmac_free(hctx);
-	}
+	rc = cipher_crypt(esc->esc_cctx, esc->esc_seqnr, enc, plain,
+	    plainlen, 0, authlen);
+	if (rc != 0)
+		return (ssherrf("cipher_crypt", rc));
 
 	return (ERRF_OK);
 }
 
 errf_t *
-ebox_stream_decrypt_chunk(struct ebox_stream_chunk *esc)
+ebox_stream_encrypt_chunk(struct ebox_stream_chunk *esc)
 {
-	struct ebox_stream *es;
-	const struct sshcipher *cipher;
-	int dgalg = -1;
-	size_t blocksz, ivlen, authlen, keylen, plainlen, enclen, maclen;
-	size_t padding, i, reallen;
-	uint8_t *key, *plain, *enc, *mac, *iv;
-	struct sshcipher_ctx *cctx = NULL;
-	struct ssh_hmac_ctx *hctx = NULL;
-	int rc;
+	size_t enclen, maclen = esc->esc_stream->es_maclen;
+	uint8_t *enc;
 	errf_t *err;
 
-	es = esc->esc_stream;
-
-	cipher = cipher_by_name(es->es_cipher);
-	VERIFY(cipher != NULL);
-	ivlen = cipher_ivlen(cipher);
-	authlen = cipher_authlen(cipher);
-	blocksz = cipher_blocksize(cipher);
-	keylen = cipher_keylen(cipher);
-
-	if (ivlen > 0) {
-		iv = calloc(1, ivlen);
-		VERIFY3U(ivlen, >=, sizeof (uint32_t));
-		*(uint32_t *)iv = htobe32(esc->esc_seqnr);
-	} else {
-		iv = NULL;
+	if ((err = ebox_stream_chunk_seal(esc)))
+		return (err);
+	if (maclen > 0) {
+		enc = esc->esc_enc;
+		enclen = esc->esc_enclen;
+		VERIFY0(ssh_hmac_update(esc->esc_hctx, enc, enclen - maclen));
+		VERIFY0(ssh_hmac_final(esc->esc_hctx, &enc[enclen - maclen],
+		    maclen));
 	}
+	return (ERRF_OK);
+}
 
-	if (authlen == 0) {
-		dgalg = ssh_digest_alg_by_name(es->es_mac);
-		VERIFY(dgalg != -1);
-		maclen = ssh_digest_bytes(dgalg);
-	} else {
-		maclen = 0;
-	}
+/*
+ * The first part of decrypting a chunk: checks its length, and works out
+ * how much of it is (padded) plaintext.
+ */
+static errf_t *
+ebox_stream_chunk_open_start(struct ebox_stream_chunk *esc, size_t *plainlenp)
+{
+	struct ebox_stream *es;
+	size_t blocksz, authlen, plainlen, enclen, maclen;
 
-	VERIFY3U(es->es_ebox->e_keylen, >=, keylen);
-	key = es->es_ebox->e_key;
-	VERIFY(key != NULL);
+	es = esc->esc_stream;
+	blocksz = es->es_blocksz;
+	authlen = es->es_authlen;
+	maclen = es->es_maclen;
 
-	enc = esc->esc_enc;
 	enclen = esc->esc_enclen;
-	if (enclen < authlen + blocksz) {
-		err = errf("LengthError", NULL, "Ciphertext length (%d) "
-		    "is smaller than minimum length (auth tag + 1 block = %d)",
-		    enclen, authlen + blocksz);
-		free(iv);
-		return (err);
+	if (!es->es_padded) {
+		/* AEAD chunks have no padding, only the tag. */
+		if (enclen <= authlen) {
+			return (errf("LengthError", NULL, "Ciphertext length "
+			    "(%zu) is too short to contain an auth tag (%zu) "
+			    "and data", enclen, authlen));
+		}
+		plainlen = enclen - authlen;
+		goto decrypt;
+	}
+	if (enclen < authlen + maclen + blocksz) {
+		return (errf("LengthError", NULL, "Ciphertext length (%zu) "
+		    "is smaller than minimum length (auth tag + MAC + 1 "
+		    "block = %zu)", enclen, authlen + maclen + blocksz));
+	}
+	plainlen = enclen - authlen - maclen;
+	/*
+	 * Padding always brings us up to a whole number of blocks. This also
+	 * matters for reusing the cipher context: a partial block would leave
+	 * a CTR-mode keystream out of step for the next chunk.
+	 */
+	if ((plainlen % blocksz) != 0) {
+		return (errf("LengthError", NULL, "Ciphertext length (%zu) "
+		    "is not a whole number of cipher blocks", plainlen));
 	}
 
-	if (dgalg != -1) {
-		mac = malloc(maclen);
-		VERIFY(mac != NULL);
-		hctx = ssh_hmac_start(dgalg);
-		VERIFY(hctx != NULL);
-		VERIFY0(ssh_hmac_init(hctx, key, keylen));
-		VERIFY0(ssh_hmac_update(hctx, enc, enclen - maclen));
-		VERIFY0(ssh_hmac_final(hctx, mac, maclen));
-		ssh_hmac_free(hctx);
-		if (timingsafe_bcmp(mac, &enc[enclen - maclen], maclen) != 0) {
-			explicit_bzero(mac, maclen);
-			free(mac);
-			free(iv);
-			return (errf("MACError", NULL, "Ciphertext MAC failed "
-			    "validation"));
-		}
-		explicit_bzero(mac, maclen);
-		free(mac);
+decrypt:
+	*plainlenp = plainlen;
+	return (ebox_stream_chunk_keysetup(esc, CIPHER_DECRYPT));
+}
+
+static errf_t *
+ebox_stream_chunk_check_mac(const struct ebox_stream_chunk *esc,
+    const uint8_t *mac)
+{
+	size_t maclen = esc->esc_stream->es_maclen;
+
+	if (timingsafe_bcmp(mac, &esc->esc_enc[esc->esc_enclen - maclen],
+	    maclen) != 0) {
+		return (errf("MACError", NULL, "Ciphertext MAC failed "
+		    "validation"));
 	}
+	return (ERRF_OK);
+}
 
-	plainlen = enclen - authlen - maclen;
-	plain = malloc(plainlen);
-	VERIFY(plain != NULL);
+/* The rest of decrypting a chunk, once its MAC (if any) has checked out. */
+static errf_t *
+ebox_stream_chunk_open(struct ebox_stream_chunk *esc, size_t plainlen)
+{
+	struct ebox_stream *es;
+	size_t blocksz, authlen, padding, i, reallen;
+	uint8_t *plain, *enc;
+	boolean_t comp;
+	int rc;
+	errf_t *err;
 
-	VERIFY0(cipher_init(&cctx, cipher, key, keylen, iv, ivlen, 0));
-	rc = cipher_crypt(cctx, esc->esc_seqnr, plain, enc,
-	    enclen - authlen - maclen, 0, authlen);
-	cipher_free(cctx);
+	es = esc->esc_stream;
+	blocksz = es->es_blocksz;
+	authlen = es->es_authlen;
+	comp = ebox_stream_chunk_compressed(esc);
+	enc = esc->esc_enc;
 
-	if (rc != 0) {
-		err = ssherrf("cipher_crypt", rc);
+	esc->esc_plainlen = 0;
+	if (comp) {
+		err = ebox_stream_buf_reserve(&esc->esc_zbuf,
+		    &esc->esc_zbufsz, 0, plainlen);
+		if (err)
+			return (err);
+		plain = esc->esc_zbuf;
+	} else {
+		err = ebox_stream_buf_reserve(&esc->esc_plain,
+		    &esc->esc_plainsz, 0, plainlen);
+		if (err)
+			return (err);
+		plain = esc->esc_plain;
+	}
+
+	rc = cipher_crypt(esc->esc_cctx, esc->esc_seqnr, plain, enc,
+	    plainlen, 0, authlen);
+	if (rc == SSH_ERR_MAC_INVALID) {
 		explicit_bzero(plain, plainlen);
-		free(plain);
-		return (err);
+		return (errf("MACError", ssherrf("cipher_crypt", rc),
+		    "Ciphertext auth tag failed validation"));
+	} else if (rc != 0) {
+		explicit_bzero(plain, plainlen);
+		return (ssherrf("cipher_crypt", rc));
+	}
+
+	if (!es->es_padded) {
+		reallen = plainlen;
+		goto done;
 	}
 
 	/* Strip off the pkcs#7 padding and verify it. */
@@ -1576,16 +2487,190 @@ ebox_stream_decrypt_chunk(struct ebox_stream_chunk *esc)
 		}
 	}
 
-	esc->esc_plain = plain;
+done:
+	if (comp) {
+		err = ebox_stream_chunk_inflate(esc, reallen);
+		explicit_bzero(plain, plainlen);
+		return (err);
+	}
 	esc->esc_plainlen = reallen;
 
 	return (ERRF_OK);
 
 paderr:
-	err = errf("PaddingError", NULL, "Padding failed validation");
 	explicit_bzero(plain, plainlen);
-	free(plain);
-	return (err);
+	return (errf("PaddingError", NULL, "Padding failed validation"));
+}
+
+errf_t *
+ebox_stream_decrypt_chunk(struct ebox_stream_chunk *esc)
+{
+	size_t plainlen, enclen, maclen = esc->esc_stream->es_maclen;
+	uint8_t mac[SSH_DIGEST_MAX_LENGTH];
+	errf_t *err;
+
+	VERIFY3U(maclen, <=, sizeof (mac));
+	if ((err = ebox_stream_chunk_open_start(esc, &plainlen)))
+		return (err);
+	if (maclen > 0) {
+		enclen = esc->esc_enclen;
+		VERIFY0(ssh_hmac_update(esc->esc_hctx, esc->esc_enc,
+		    enclen - maclen));
+		VERIFY0(ssh_hmac_final(esc->esc_hctx, mac, maclen));
+		err = ebox_stream_chunk_check_mac(esc, mac);
+		explicit_bzero(mac, maclen);
+		if (err)
+			return (err);
+	}
+	return (ebox_stream_chunk_open(esc, plainlen));
+}
+
+uint
+ebox_stream_batch_size(const struct ebox_stream *es)
+{
+	return (es->es_maclanes);
+}
+
+/*
+ * Works out the HMACs of the chunks which don't have an error yet all in
+ * one go, writing them to macs[i] (which can point into the chunks).
+ *
+ * On streams with a trailer the seqnr goes in front of the ciphertext, as a
+ * per-chunk prefix to ssh_digest_hmac_multi().
+ */
+static void
+ebox_stream_chunks_mac(struct ebox_stream_chunk **escs, size_t n,
+    uint8_t **macs, errf_t **errs)
+{
+	struct ebox_stream *es = escs[0]->esc_stream;
+	const u_char **m;
+	const u_char **pfx = NULL;
+	uint8_t (*seqnrs)[4] = NULL;
+	size_t *mlen;
+	u_char **d;
+	size_t i;
+	uint nm = 0;
+	int rc;
+
+	m = calloc(n, sizeof (*m));
+	mlen = calloc(n, sizeof (*mlen));
+	d = calloc(n, sizeof (*d));
+	if (es->es_trailer) {
+		pfx = calloc(n, sizeof (*pfx));
+		seqnrs = calloc(n, sizeof (*seqnrs));
+	}
+	if (m == NULL || mlen == NULL || d == NULL ||
+	    (es->es_trailer && (pfx == NULL || seqnrs == NULL))) {
+		for (i = 0; i < n; ++i) {
+			if (errs[i] == ERRF_OK)
+				errs[i] = ERRF_NOMEM;
+		}
+		goto out;
+	}
+	for (i = 0; i < n; ++i) {
+		if (errs[i] != ERRF_OK)
+			continue;
+		if (es->es_trailer) {
+			ebox_stream_mac_seqnr(escs[i], seqnrs[nm]);
+			pfx[nm] = seqnrs[nm];
+		}
+		m[nm] = escs[i]->esc_enc;
+		mlen[nm] = escs[i]->esc_enclen - es->es_maclen;
+		d[nm] = macs[i];
+		++nm;
+	}
+	rc = ssh_digest_hmac_multi(es->es_dgalg, es->es_ebox->e_key,
+	    es->es_keylen, nm, pfx, sizeof (*seqnrs), m, mlen, d,
+	    es->es_maclen);
+	if (rc != 0) {
+		for (i = 0; i < n; ++i) {
+			if (errs[i] == ERRF_OK)
+				errs[i] = ssherrf("ssh_digest_hmac_multi", rc);
+		}
+	}
+out:
+	free(seqnrs);
+	free(pfx);
+	free(m);
+	free(mlen);
+	free(d);
+}
+
+void
+ebox_stream_encrypt_chunks(struct ebox_stream_chunk **escs, size_t n,
+    errf_t **errs)
+{
+	struct ebox_stream *es;
+	uint8_t **macs;
+	size_t i;
+
+	if (n == 0)
+		return;
+	es = escs[0]->esc_stream;
+	if (n == 1 || es->es_maclanes < 2) {
+		for (i = 0; i < n; ++i)
+			errs[i] = ebox_stream_encrypt_chunk(escs[i]);
+		return;
+	}
+
+	macs = calloc(n, sizeof (*macs));
+	for (i = 0; i < n; ++i) {
+		VERIFY(escs[i]->esc_stream == es);
+		errs[i] = (macs == NULL) ? ERRF_NOMEM :
+		    ebox_stream_chunk_seal(escs[i]);
+		if (errs[i] == ERRF_OK) {
+			macs[i] = &escs[i]->esc_enc[escs[i]->esc_enclen -
+			    es->es_maclen];
+		}
+	}
+	if (macs != NULL)
+		ebox_stream_chunks_mac(escs, n, macs, errs);
+	free(macs);
+}
+
+void
+ebox_stream_decrypt_chunks(struct ebox_stream_chunk **escs, size_t n,
+    errf_t **errs)
+{
+	struct ebox_stream *es;
+	uint8_t *macbuf, **macs;
+	size_t *plainlen;
+	size_t i;
+
+	if (n == 0)
+		return;
+	es = escs[0]->esc_stream;
+	if (n == 1 || es->es_maclanes < 2) {
+		for (i = 0; i < n; ++i)
+			errs[i] = ebox_stream_decrypt_chunk(escs[i]);
+		return;
+	}
+
+	macbuf = calloc(n, es->es_maclen);
+	macs = calloc(n, sizeof (*macs));
+	plainlen = calloc(n, sizeof (*plainlen));
+	for (i = 0; i < n; ++i) {
+		VERIFY(escs[i]->esc_stream == es);
+		if (macbuf == NULL || macs == NULL || plainlen == NULL) {
+			errs[i] = ERRF_NOMEM;
+			continue;
+		}
+		errs[i] = ebox_stream_chunk_open_start(escs[i], &plainlen[i]);
+		macs[i] = &macbuf[i * es->es_maclen];
+	}
+	if (macbuf != NULL && macs != NULL && plainlen != NULL)
+		ebox_stream_chunks_mac(escs, n, macs, errs);
+	for (i = 0; i < n; ++i) {
+		if (errs[i] != ERRF_OK)
+			continue;
+		errs[i] = ebox_stream_chunk_check_mac(escs[i], macs[i]);
+		if (errs[i] == ERRF_OK)
+			errs[i] = ebox_stream_chunk_open(escs[i], plainlen[i]);
+	}
+	if (macbuf != NULL)
+		freezero(macbuf, n * es->es_maclen);
+	free(macs);
+	free(plainlen);
 }
 
 const uint8_t *
@@ -1595,25 +2680,57 @@ ebox_stream_chunk_data(const struct ebox_stream_chunk *esc, size_t *size)
 	return (esc->esc_plain);
 }
 
+const uint8_t *
+ebox_stream_chunk_ciphertext(const struct ebox_stream_chunk *esc,
+    size_t *size)
+{
+	*size = esc->esc_enclen;
+	return (esc->esc_enc);
+}
+
+errf_t *
+ebox_stream_chunk_reset(struct ebox_stream_chunk *esc, const void *data,
+    size_t len, size_t seqnr)
+{
+	errf_t *err;
+
+	if (esc->esc_enc_borrowed) {
+		esc->esc_enc = NULL;
+		esc->esc_encsz = 0;
+		esc->esc_enc_borrowed = B_FALSE;
+	}
+	esc->esc_enclen = 0;
+	esc->esc_plainlen = 0;
+
+	/* Leave room for the padding ebox_stream_encrypt_chunk() adds. */
+	err = ebox_stream_buf_reserve(&esc->esc_plain, &esc->esc_plainsz, 0,
+	    len + esc->esc_stream->es_blocksz);
+	if (err)
+		return (err);
+	bcopy(data, esc->esc_plain, len);
+	esc->esc_plainlen = len;
+	esc->esc_seqnr = seqnr;
+
+	return (ERRF_OK);
+}
+
 errf_t *
 ebox_stream_chunk_new(const struct ebox_stream *es, const void *data,
     size_t len, size_t seqnr, struct ebox_stream_chunk **chunk)
 {
 	struct ebox_stream_chunk *esc;
+	errf_t *err;
 
 	esc = calloc(1, sizeof (struct ebox_stream_chunk));
 	if (esc == NULL)
 		return (ERRF_NOMEM);
 	esc->esc_stream = (struct ebox_stream *)es;
-	esc->esc_seqnr = seqnr;
-	esc->esc_plainlen = len;
-	esc->esc_plain = malloc(len);
-	if (esc->esc_plain == NULL) {
-		free(esc);
-		return (ERRF_NOMEM);
-	}
 
-	bcopy(data, esc->esc_plain, len);
+	err = ebox_stream_chunk_reset(esc, data, len, seqnr);
+	if (err) {
+		ebox_stream_chunk_free(esc);
+		return (err);
+	}
 
 	*chunk = esc;
 	return (ERRF_OK);
@@ -1626,6 +2743,7 @@ ebox_stream_free(struct ebox_stream *str)
 		return;
 	free(str->es_cipher);
 	free(str->es_mac);
+	free(str->es_comp);
 	ebox_free(str->es_ebox);
 	free(str);
 }
@@ -1648,22 +2766,420 @@ ebox_stream_mac(const struct ebox_stream *es)
 	return (es->es_mac);
 }
 
+const char *
+ebox_stream_compression(const struct ebox_stream *es)
+{
+	return (es->es_comp);
+}
+
 size_t
 ebox_stream_chunk_size(const struct ebox_stream *es)
 {
 	return (es->es_chunklen);
 }
 
+/*
+ * Returns the offset (relative to the end of the stream header) of the
+ * chunk which holds the given plaintext offset. Every chunk except the last
+ * one in a stream holds exactly es_chunklen bytes of plaintext, so each of
+ * them takes up the same amount of space on the wire (unless the stream has
+ * been appended to: see EBOX_STREAM_F_APPENDED).
+ */
+size_t
+ebox_stream_seek_offset(const struct ebox_stream *es, size_t offset)
+{
+	size_t blocksz = es->es_blocksz, enclen;
+
+	/* Padded full chunks always get a whole block of padding. */
+	enclen = es->es_chunklen;
+	if (es->es_padded)
+		enclen += blocksz - (es->es_chunklen % blocksz);
+	enclen += es->es_authlen + es->es_maclen;
+
+	/* Each chunk is a u32 seqnr followed by a u32-length string. */
+	return ((offset / es->es_chunklen) * (enclen + 2 * sizeof (uint32_t)));
+}
+
+errf_t *
+ebox_stream_set_trailer(struct ebox_stream *es, boolean_t enable)
+{
+	if (es->es_nchunks > 0) {
+		return (argerrf("stream", "a stream with no chunks added yet",
+		    "a stream with %" PRIu64 " chunks", es->es_nchunks));
+	}
+	es->es_trailer = enable;
+	return (ERRF_OK);
+}
+
+boolean_t
+ebox_stream_has_trailer(const struct ebox_stream *es)
+{
+	return (es->es_trailer);
+}
+
+boolean_t
+ebox_stream_is_trailer_seqnr(const struct ebox_stream *es, uint32_t seqnr)
+{
+	return (es->es_trailer && (seqnr & EBOX_STREAM_TRAILER_SEQ) != 0);
+}
+
+boolean_t
+ebox_stream_chunk_is_trailer(const struct ebox_stream_chunk *esc)
+{
+	return (ebox_stream_is_trailer_seqnr(esc->esc_stream, esc->esc_seqnr));
+}
+
+boolean_t
+ebox_stream_is_dead_seqnr(const struct ebox_stream *es, uint32_t seqnr)
+{
+	return (es->es_trailer && seqnr == EBOX_STREAM_DEAD_SEQ);
+}
+
+boolean_t
+ebox_stream_appending(const struct ebox_stream *es)
+{
+	return (es->es_appending);
+}
+
+void
+ebox_stream_set_appending(struct ebox_stream *es, boolean_t appending)
+{
+	es->es_appending = appending;
+}
+
+boolean_t
+ebox_stream_appended(const struct ebox_stream *es)
+{
+	return (es->es_appended);
+}
+
+void
+ebox_stream_set_appended(struct ebox_stream *es)
+{
+	es->es_appended = B_TRUE;
+}
+
+size_t
+ebox_stream_trailer_size(const struct ebox_stream *es)
+{
+	size_t enclen = EBOX_STREAM_TRAILER_LEN;
+
+	if (es->es_padded)
+		enclen += es->es_blocksz - (enclen % es->es_blocksz);
+	enclen += es->es_authlen + es->es_maclen;
+	return (enclen + 2 * sizeof (uint32_t));
+}
+
+static void
+ebox_merkle_node(uint8_t *out, const uint8_t *left, const uint8_t *right)
+{
+	struct ssh_digest_ctx *dg;
+	const uint8_t prefix = 0x01;
+	uint8_t node[EBOX_MERKLE_HASHLEN];
+
+	dg = ssh_digest_start(SSH_DIGEST_SHA256);
+	VERIFY(dg != NULL);
+	VERIFY0(ssh_digest_update(dg, &prefix, 1));
+	VERIFY0(ssh_digest_update(dg, left, EBOX_MERKLE_HASHLEN));
+	VERIFY0(ssh_digest_update(dg, right, EBOX_MERKLE_HASHLEN));
+	VERIFY0(ssh_digest_final(dg, node, sizeof (node)));
+	ssh_digest_free(dg);
+	/* out is allowed to be the same as left or right */
+	bcopy(node, out, sizeof (node));
+}
+
+/*
+ * The root of an RFC 6962 tree is what you get by folding up the perfect
+ * subtrees from the right.
+ */
+static void
+ebox_stream_merkle_root(const struct ebox_stream *es, uint8_t *root)
+{
+	uint i;
+
+	if (es->es_mdepth == 0) {
+		VERIFY0(ssh_digest_memory(SSH_DIGEST_SHA256, NULL, 0, root,
+		    EBOX_MERKLE_HASHLEN));
+		return;
+	}
+	i = es->es_mdepth - 1;
+	bcopy(es->es_mstack[i], root, EBOX_MERKLE_HASHLEN);
+	while (i-- > 0)
+		ebox_merkle_node(root, es->es_mstack[i], root);
+}
+
+size_t
+ebox_stream_tag_size(const struct ebox_stream *es)
+{
+	return ((es->es_maclen > 0) ? es->es_maclen : es->es_authlen);
+}
+
+errf_t *
+ebox_stream_add_chunk(struct ebox_stream *es,
+    const struct ebox_stream_chunk *esc)
+{
+	size_t taglen = ebox_stream_tag_size(es);
+
+	if (esc->esc_enclen == 0) {
+		return (argerrf("chunk", "an encrypted or decrypted chunk",
+		    "a chunk with no ciphertext"));
+	}
+	VERIFY3U(esc->esc_enclen, >=, taglen);
+	return (ebox_stream_add_tag(es, esc->esc_seqnr,
+	    &esc->esc_enc[esc->esc_enclen - taglen], taglen,
+	    esc->esc_plainlen));
+}
+
+errf_t *
+ebox_stream_add_tag(struct ebox_stream *es, uint32_t seqnr,
+    const uint8_t *tag, size_t taglen, size_t plainlen)
+{
+	struct ssh_digest_ctx *dg;
+	const uint8_t prefix = 0x00;
+	uint8_t seqbuf[4];
+	uint d;
+
+	if (taglen != ebox_stream_tag_size(es)) {
+		return (argerrf("taglen", "the stream's tag size (%zu)",
+		    "%zu", ebox_stream_tag_size(es), taglen));
+	}
+	if (seqnr != es->es_nchunks + 1) {
+		return (errf("InvalidDataError", NULL, "stream chunk out of "
+		    "sequence (expected %" PRIu64 ", got %u)",
+		    es->es_nchunks + 1, seqnr));
+	}
+	if ((seqnr & EBOX_STREAM_TRAILER_SEQ) != 0) {
+		return (errf("OverflowError", NULL, "too many chunks in "
+		    "stream (maximum is %u)", EBOX_STREAM_TRAILER_SEQ - 1));
+	}
+	/* A u32 seqnr can't make a tree deep enough to overflow this. */
+	VERIFY3U(es->es_mdepth, <, EBOX_MERKLE_MAXDEPTH);
+
+	d = es->es_mdepth++;
+	seqbuf[0] = seqnr >> 24;
+	seqbuf[1] = seqnr >> 16;
+	seqbuf[2] = seqnr >> 8;
+	seqbuf[3] = seqnr;
+	dg = ssh_digest_start(SSH_DIGEST_SHA256);
+	VERIFY(dg != NULL);
+	VERIFY0(ssh_digest_update(dg, &prefix, 1));
+	VERIFY0(ssh_digest_update(dg, seqbuf, sizeof (seqbuf)));
+	VERIFY0(ssh_digest_update(dg, tag, taglen));
+	VERIFY0(ssh_digest_final(dg, es->es_mstack[d], EBOX_MERKLE_HASHLEN));
+	ssh_digest_free(dg);
+	es->es_mheight[d] = 0;
+
+	/* Merge equal-sized subtrees, like carrying in binary addition. */
+	while (d > 0 && es->es_mheight[d - 1] == es->es_mheight[d]) {
+		ebox_merkle_node(es->es_mstack[d - 1], es->es_mstack[d - 1],
+		    es->es_mstack[d]);
+		++es->es_mheight[d - 1];
+		--d;
+	}
+	es->es_mdepth = d + 1;
+
+	++es->es_nchunks;
+	es->es_plainlen += plainlen;
+	return (ERRF_OK);
+}
+
+errf_t *
+ebox_stream_trailer_chunk(struct ebox_stream *es,
+    struct ebox_stream_chunk **pesc)
+{
+	struct ebox_stream_chunk *esc = NULL;
+	struct sshbuf *buf;
+	uint8_t root[EBOX_MERKLE_HASHLEN];
+	errf_t *err;
+
+	if (!es->es_trailer) {
+		return (argerrf("stream", "a stream with a trailer",
+		    "a stream without one"));
+	}
+
+	buf = sshbuf_new();
+	if (buf == NULL)
+		return (ERRF_NOMEM);
+	ebox_stream_merkle_root(es, root);
+	VERIFY0(sshbuf_put_u8(buf, EBOX_STREAM_TRAILER_V1));
+	VERIFY0(sshbuf_put_u64(buf, es->es_nchunks));
+	VERIFY0(sshbuf_put_u64(buf, es->es_plainlen));
+	VERIFY0(sshbuf_put(buf, root, sizeof (root)));
+	VERIFY3U(sshbuf_len(buf), ==, EBOX_STREAM_TRAILER_LEN);
+
+	err = ebox_stream_chunk_new(es, sshbuf_ptr(buf), sshbuf_len(buf),
+	    EBOX_STREAM_TRAILER_SEQ | es->es_nchunks, &esc);
+	sshbuf_free(buf);
+	if (err == ERRF_OK)
+		err = ebox_stream_encrypt_chunk(esc);
+	if (err) {
+		ebox_stream_chunk_free(esc);
+		return (err);
+	}
+
+	*pesc = esc;
+	return (ERRF_OK);
+}
+
+errf_t *
+ebox_stream_read_trailer(struct ebox_stream *es,
+    const struct ebox_stream_chunk *esc)
+{
+	struct sshbuf *buf;
+	uint8_t ver;
+	uint64_t nchunks, plainlen;
+	int rc;
+	errf_t *err = ERRF_OK;
+
+	if (!ebox_stream_chunk_is_trailer(esc)) {
+		return (argerrf("chunk", "a stream trailer chunk",
+		    "chunk %u", esc->esc_seqnr));
+	}
+	buf = sshbuf_from(esc->esc_plain, esc->esc_plainlen);
+	if (buf == NULL)
+		return (ERRF_NOMEM);
+
+	if ((rc = sshbuf_get_u8(buf, &ver)) ||
+	    (rc = sshbuf_get_u64(buf, &nchunks)) ||
+	    (rc = sshbuf_get_u64(buf, &plainlen)) ||
+	    (rc = sshbuf_get(buf, es->es_tr_root, sizeof (es->es_tr_root)))) {
+		err = boxderrf(ssherrf("sshbuf_get", rc));
+		goto out;
+	}
+	if (ver != EBOX_STREAM_TRAILER_V1) {
+		err = boxderrf(errf("VersionError", NULL, "unsupported stream "
+		    "trailer version: 0x%02x", ver));
+		goto out;
+	}
+	if (nchunks >= EBOX_STREAM_TRAILER_SEQ ||
+	    (esc->esc_seqnr & ~EBOX_STREAM_TRAILER_SEQ) != nchunks) {
+		err = boxderrf(errf("InvalidDataError", NULL, "stream trailer "
+		    "seqnr (0x%08x) doesn't match its chunk count (%" PRIu64
+		    ")", esc->esc_seqnr, nchunks));
+		goto out;
+	}
+	/*
+	 * All chunks but the last are full, and the last isn't empty. In an
+	 * appended stream any of them can be short, but none are empty.
+	 */
+	if ((nchunks == 0 && plainlen != 0) || plainlen < nchunks ||
+	    plainlen > nchunks * es->es_chunklen || (!es->es_appended &&
+	    nchunks > 0 && plainlen <= (nchunks - 1) * es->es_chunklen)) {
+		err = boxderrf(errf("InvalidDataError", NULL, "stream trailer "
+		    "length (%" PRIu64 ") doesn't fit its chunk count (%"
+		    PRIu64 ")", plainlen, nchunks));
+		goto out;
+	}
+
+	es->es_tr_nchunks = nchunks;
+	es->es_tr_plainlen = plainlen;
+	es->es_tr_valid = B_TRUE;
+
+out:
+	sshbuf_free(buf);
+	return (err);
+}
+
+errf_t *
+ebox_stream_trailer_info(const struct ebox_stream *es, uint64_t *nchunks,
+    uint64_t *plainlen)
+{
+	if (!es->es_tr_valid) {
+		return (argerrf("stream", "a stream whose trailer has been "
+		    "read", "one without"));
+	}
+	*nchunks = es->es_tr_nchunks;
+	*plainlen = es->es_tr_plainlen;
+	return (ERRF_OK);
+}
+
+errf_t *
+ebox_stream_check_chunk(const struct ebox_stream *es,
+    const struct ebox_stream_chunk *esc)
+{
+	size_t want;
+
+	if (!es->es_tr_valid)
+		return (ERRF_OK);
+	if (esc->esc_seqnr == 0 || esc->esc_seqnr > es->es_tr_nchunks) {
+		return (errf("InvalidDataError", NULL, "stream chunk %u is "
+		    "past the end of the stream (%" PRIu64 " chunks)",
+		    esc->esc_seqnr, es->es_tr_nchunks));
+	}
+	/* We can't say how long chunks in appended streams should be. */
+	if (es->es_appended)
+		return (ERRF_OK);
+	want = es->es_chunklen;
+	if (esc->esc_seqnr == es->es_tr_nchunks) {
+		want = es->es_tr_plainlen - (es->es_tr_nchunks - 1) *
+		    es->es_chunklen;
+	}
+	if (esc->esc_plainlen != want) {
+		return (errf("LengthError", NULL, "stream chunk %u has %zu "
+		    "bytes of plaintext (expected %zu)", esc->esc_seqnr,
+		    esc->esc_plainlen, want));
+	}
+	return (ERRF_OK);
+}
+
+errf_t *
+ebox_stream_resume(struct ebox_stream *es)
+{
+	uint8_t root[EBOX_MERKLE_HASHLEN];
+
+	if (!es->es_tr_valid) {
+		return (argerrf("stream", "a stream whose trailer has been "
+		    "read", "one without"));
+	}
+	if (es->es_nchunks != es->es_tr_nchunks) {
+		return (errf("InvalidDataError", NULL, "stream has %" PRIu64
+		    " chunks but its trailer says %" PRIu64, es->es_nchunks,
+		    es->es_tr_nchunks));
+	}
+	ebox_stream_merkle_root(es, root);
+	if (timingsafe_bcmp(root, es->es_tr_root, sizeof (root)) != 0) {
+		return (errf("InvalidDataError", NULL, "stream chunks don't "
+		    "match the Merkle root in its trailer"));
+	}
+	es->es_plainlen = es->es_tr_plainlen;
+	return (ERRF_OK);
+}
+
+errf_t *
+ebox_stream_verify_trailer(const struct ebox_stream *es)
+{
+	uint8_t root[EBOX_MERKLE_HASHLEN];
+
+	if (!es->es_tr_valid) {
+		return (errf("IncompleteInputError", NULL, "stream ended "
+		    "without its trailer (it may have been truncated)"));
+	}
+	if (es->es_nchunks != es->es_tr_nchunks ||
+	    es->es_plainlen != es->es_tr_plainlen) {
+		return (errf("InvalidDataError", NULL, "stream has %" PRIu64
+		    " chunks (%" PRIu64 " bytes) but its trailer says %" PRIu64
+		    " (%" PRIu64 " bytes)", es->es_nchunks, es->es_plainlen,
+		    es->es_tr_nchunks, es->es_tr_plainlen));
+	}
+	ebox_stream_merkle_root(es, root);
+	if (timingsafe_bcmp(root, es->es_tr_root, sizeof (root)) != 0) {
+		return (errf("InvalidDataError", NULL, "stream chunks don't "
+		    "match the Merkle root in its trailer"));
+	}
+	return (ERRF_OK);
+}
+
 static errf_t *
-sshbuf_get_ebox_part(struct sshbuf *buf, const struct ebox *ebox,
+sshbuf_get_ebox_part(struct sshbuf *buf, struct ebox *ebox,
     struct ebox_part **ppart)
 {
+	struct ebox_arena **pea = &ebox->e_arena;
 	struct ebox_part *part;
 	struct ebox_tpl_part *tpart;
-	struct sshbuf *kbuf;
 	int rc = 0;
 	size_t len;
-	uint8_t tag, *guid;
+	uint8_t tag;
+	const u_char *guid;
 	errf_t *err = NULL;
 	char *tname = NULL;
 	struct sshkey *k = NULL, *ephk;
@@ -1671,16 +3187,13 @@ sshbuf_get_ebox_part(struct sshbuf *buf, const struct ebox *ebox,
 	boolean_t gotguid = B_FALSE;
 	uint8_t slot = PIV_SLOT_KEY_MGMT;
 
-	part = calloc(1, sizeof (struct ebox_part));
+	part = ebox_arena_alloc(pea, sizeof (struct ebox_part));
 	VERIFY(part != NULL);
 
-	part->ep_tpl = calloc(1, sizeof (struct ebox_tpl_part));
+	part->ep_tpl = ebox_arena_alloc(pea, sizeof (struct ebox_tpl_part));
 	VERIFY(part->ep_tpl != NULL);
 	tpart = part->ep_tpl;
 
-	kbuf = sshbuf_new();
-	VERIFY(kbuf != NULL);
-
 	if ((rc = sshbuf_get_u8(buf, &tag))) {
 		err = ssherrf("sshbuf_get_u8", rc);
 		goto out;
@@ -1688,9 +3201,8 @@ sshbuf_get_ebox_part(struct sshbuf *buf, const struct ebox *ebox,
 	while (tag != EBOX_PART_END) {
 		switch (tag & ~EBOX_PART_OPTIONAL_FLAG) {
 		case EBOX_PART_PUBKEY:
-			free(tname);
-			tname = NULL;
-			if ((rc = sshbuf_get_cstring8(buf, &tname, NULL))) {
+			rc = ebox_arena_get_cstring8(buf, pea, &tname, NULL);
+			if (rc) {
 				err = ssherrf("sshbuf_get_cstring8", rc);
 				goto out;
 			}
@@ -1723,20 +3235,17 @@ sshbuf_get_ebox_part(struct sshbuf *buf, const struct ebox *ebox,
 			k = NULL;
 			break;
 		case EBOX_PART_CAK:
-			sshbuf_reset(kbuf);
-			rc = sshbuf_get_stringb(buf, kbuf);
-			if (rc) {
-				err = ssherrf("sshbuf_get_stringb", rc);
-				goto out;
-			}
-			rc = sshkey_fromb(kbuf, &tpart->etp_cak);
+			sshkey_free(tpart->etp_cak);
+			tpart->etp_cak = NULL;
+			rc = sshkey_froms(buf, &tpart->etp_cak);
 			if (rc) {
-				err = ssherrf("sshkey_fromb", rc);
+				err = ssherrf("sshkey_froms", rc);
 				goto out;
 			}
 			break;
 		case EBOX_PART_NAME:
-			rc = sshbuf_get_cstring8(buf, &tpart->etp_name, &len);
+			rc = ebox_arena_get_cstring8(buf, pea, &tpart->etp_name,
+			    &len);
 			if (rc) {
 				err = ssherrf("sshbuf_get_cstring8", rc);
 				goto out;
@@ -1750,7 +3259,7 @@ sshbuf_get_ebox_part(struct sshbuf *buf, const struct ebox *ebox,
 			}
 			break;
 		case EBOX_PART_GUID:
-			rc = sshbuf_get_string8(buf, &guid, &len);
+			rc = sshbuf_get_string8_direct(buf, &guid, &len);
 			if (rc) {
 				err = ssherrf("sshbuf_get_string8", rc);
 				goto out;
@@ -1760,9 +3269,7 @@ sshbuf_get_ebox_part(struct sshbuf *buf, const struct ebox *ebox,
 				    "guid is too short (%u bytes)", len);
 				goto out;
 			}
-			bcopy(guid, tpart->etp_guid, len);
-			free(guid);
-			guid = NULL;
+			bcopy(guid, tpart->etp_guid, len);
 			gotguid = B_TRUE;
 			break;
 		case EBOX_PART_BOX:
@@ -1772,36 +3279,37 @@ sshbuf_get_ebox_part(struct sshbuf *buf, const struct ebox *ebox,
 					goto out;
 				break;
 			}
-			box = piv_box_new();
+			box = ebox_arena_alloc(pea,
+			    sizeof (struct piv_ecdh_box));
 			if (box == NULL) {
 				err = ERRF_NOMEM;
 				goto out;
 			}
+			box->pdb_version = PIV_BOX_VNEXT - 1;
+			box->pdb_in_arena = B_TRUE;
 			box->pdb_guidslot_valid = B_TRUE;
 			box->pdb_slot = PIV_SLOT_KEY_MGMT;
-			box->pdb_free_str = B_TRUE;
-			rc = sshbuf_get_cstring8(buf, (char **)&box->pdb_cipher,
-			    NULL);
+			rc = ebox_arena_get_cstring8(buf, pea,
+			    (char **)&box->pdb_cipher, NULL);
 			if (rc) {
 				err = ssherrf("sshbuf_get_cstring8", rc);
 				goto out;
 			}
-			rc = sshbuf_get_cstring8(buf, (char **)&box->pdb_kdf,
-			    NULL);
+			rc = ebox_arena_get_cstring8(buf, pea,
+			    (char **)&box->pdb_kdf, NULL);
 			if (rc) {
 				err = ssherrf("sshbuf_get_cstring8", rc);
 				goto out;
 			}
-			rc = sshbuf_get_string8(buf, &box->pdb_nonce.b_data,
-			    &box->pdb_nonce.b_size);
+			rc = ebox_arena_get_string8(buf, pea,
+			    &box->pdb_nonce.b_data, &box->pdb_nonce.b_size);
 			if (rc) {
 				err = ssherrf("sshbuf_get_string8", rc);
 				goto out;
 			}
 			box->pdb_nonce.b_len = box->pdb_nonce.b_size;
-			free(tname);
-			tname = NULL;
-			if ((rc = sshbuf_get_cstring8(buf, &tname, NULL))) {
+			rc = ebox_arena_get_cstring8(buf, pea, &tname, NULL);
+			if (rc) {
 				err = ssherrf("sshbuf_get_cstring8", rc);
 				goto out;
 			}
@@ -1839,15 +3347,15 @@ sshbuf_get_ebox_part(struct sshbuf *buf, const struct ebox *ebox,
 			}
 			VERIFY0(sshkey_demote(ephk, &box->pdb_ephem_pub));
 
-			if ((rc = sshbuf_get_string8(buf, &box->pdb_iv.b_data,
-			    &box->pdb_iv.b_size))) {
+			if ((rc = ebox_arena_get_string8(buf, pea,
+			    &box->pdb_iv.b_data, &box->pdb_iv.b_size))) {
 				err = ssherrf("sshbuf_put_string8", rc);
 				goto out;
 			}
 			box->pdb_iv.b_len = box->pdb_iv.b_size;
 
-			if ((rc = sshbuf_get_string(buf, &box->pdb_enc.b_data,
-			    &box->pdb_enc.b_size))) {
+			if ((rc = ebox_arena_get_string(buf, pea,
+			    &box->pdb_enc.b_data, &box->pdb_enc.b_size))) {
 				err = ssherrf("sshbuf_put_string", rc);
 				goto out;
 			}
@@ -1911,18 +3419,37 @@ sshbuf_get_ebox_part(struct sshbuf *buf, const struct ebox *ebox,
 	*ppart = part;
 	part = NULL;
 out:
-	sshbuf_free(kbuf);
-	ebox_part_free(part);
+	if (part != NULL) {
+		ebox_tpl_part_free_arena(part->ep_tpl, *pea);
+		ebox_part_free_arena(part, *pea);
+	}
 	piv_box_free(box);
 	sshkey_free(k);
-	free(tname);
 	return (err);
 }
 
 static errf_t *
-sshbuf_get_ebox_config(struct sshbuf *buf, const struct ebox *ebox,
+ebox_config_check(const struct ebox_tpl_config *tconfig)
+{
+	if (tconfig->etc_type != EBOX_PRIMARY &&
+	    tconfig->etc_type != EBOX_RECOVERY) {
+		return (errf("UnknownConfigType", NULL,
+		    "ebox config has unknown type: 0x%02x", tconfig->etc_type));
+	}
+	if (tconfig->etc_type == EBOX_PRIMARY &&
+	    tconfig->etc_n > 1) {
+		return (errf("InvalidConfig", NULL,
+		    "ebox config is PRIMARY but has n > 1 (n = %d)",
+		    tconfig->etc_n));
+	}
+	return (ERRF_OK);
+}
+
+static errf_t *
+sshbuf_get_ebox_config(struct sshbuf *buf, struct ebox *ebox,
     struct ebox_config **pconfig)
 {
+	struct ebox_arena **pea = &ebox->e_arena;
 	struct ebox_config *config;
 	struct ebox_tpl_config *tconfig;
 	struct ebox_part *part;
@@ -1932,10 +3459,11 @@ sshbuf_get_ebox_config(struct sshbuf *buf, const struct ebox *ebox,
 	uint i, id;
 	errf_t *err = NULL;
 
-	config = calloc(1, sizeof (struct ebox_config));
+	config = ebox_arena_alloc(pea, sizeof (struct ebox_config));
 	VERIFY(config != NULL);
 
-	config->ec_tpl = calloc(1, sizeof (struct ebox_tpl_config));
+	config->ec_tpl = ebox_arena_alloc(pea,
+	    sizeof (struct ebox_tpl_config));
 	VERIFY(config->ec_tpl != NULL);
 	tconfig = config->ec_tpl;
 
@@ -1946,14 +3474,10 @@ sshbuf_get_ebox_config(struct sshbuf *buf, const struct ebox *ebox,
 		goto out;
 	}
 	tconfig->etc_type = (enum ebox_config_type)type;
-	if (tconfig->etc_type != EBOX_PRIMARY &&
-	    tconfig->etc_type != EBOX_RECOVERY) {
-		err = errf("UnknownConfigType", NULL,
-		    "ebox config has unknown type: 0x%02x", tconfig->etc_type);
+	if ((err = ebox_config_check(tconfig)))
 		goto out;
-	}
 	if (ebox->e_version >= EBOX_V3) {
-		rc = sshbuf_get_string8(buf, &config->ec_nonce,
+		rc = ebox_arena_get_string8(buf, pea, &config->ec_nonce,
 		    &config->ec_noncelen);
 		if (rc) {
 			err = ssherrf("sshbuf_get_string8", rc);
@@ -1966,13 +3490,6 @@ sshbuf_get_ebox_config(struct sshbuf *buf, const struct ebox *ebox,
 			goto out;
 		}
 	}
-	if (tconfig->etc_type == EBOX_PRIMARY &&
-	    tconfig->etc_n > 1) {
-		err = errf("InvalidConfig", NULL,
-		    "ebox config is PRIMARY but has n > 1 (n = %d)",
-		    tconfig->etc_n);
-		goto out;
-	}
 	id = 1;
 
 	if ((err = sshbuf_get_ebox_part(buf, ebox, &part)))
@@ -1981,6 +3498,7 @@ sshbuf_get_ebox_config(struct sshbuf *buf, const struct ebox *ebox,
 	config->ec_parts = part;
 	tpart = part->ep_tpl;
 	config->ec_tpl->etc_parts = tpart;
+	config->ec_tpl->etc_lastpart = tpart;
 
 	for (i = 1; i < tconfig->etc_m; ++i) {
 		if ((err = sshbuf_get_ebox_part(buf, ebox, &part->ep_next)))
@@ -1990,18 +3508,23 @@ sshbuf_get_ebox_config(struct sshbuf *buf, const struct ebox *ebox,
 		tpart->etp_next = part->ep_tpl;
 		part->ep_tpl->etp_prev = tpart;
 		tpart = part->ep_tpl;
+		config->ec_tpl->etc_lastpart = tpart;
 	}
 
 	*pconfig = config;
 	config = NULL;
 
 out:
-	ebox_config_free(config);
+	if (config != NULL) {
+		ebox_tpl_config_free_arena(config->ec_tpl, *pea);
+		ebox_config_free_arena(config, *pea);
+	}
 	return (err);
 }
 
 static errf_t *
-sshbuf_get_ebox_ephem_key(struct sshbuf *buf, struct ebox_ephem_key **peek)
+sshbuf_get_ebox_ephem_key(struct sshbuf *buf, struct ebox *ebox,
+    struct ebox_ephem_key **peek)
 {
 	struct ebox_ephem_key *eek = NULL;
 	char *tname = NULL;
@@ -2009,11 +3532,12 @@ sshbuf_get_ebox_ephem_key(struct sshbuf *buf, struct ebox_ephem_key **peek)
 	errf_t *err = NULL;
 	int rc;
 
-	eek = calloc(1, sizeof (struct ebox_ephem_key));
+	eek = ebox_arena_alloc(&ebox->e_arena, sizeof (struct ebox_ephem_key));
 	if (eek == NULL)
 		return (ERRF_NOMEM);
 
-	if ((rc = sshbuf_get_cstring8(buf, &tname, NULL))) {
+	if ((rc = ebox_arena_get_cstring8(buf, &ebox->e_arena, &tname,
+	    NULL))) {
 		err = ssherrf("sshbuf_get_cstring8", rc);
 		goto out;
 	}
@@ -2044,19 +3568,304 @@ sshbuf_get_ebox_ephem_key(struct sshbuf *buf, struct ebox_ephem_key **peek)
 	}
 
 	*peek = eek;
-	eek = NULL;
 	k = NULL;
 	err = ERRF_OK;
 
 out:
 	sshkey_free(k);
-	free(eek);
-	free(tname);
 	return (err);
 }
 
+/*
+ * From EBOX_V4 onwards the configs in an ebox are preceded by an index:
+ *
+ *   u8 nconfigs
+ *   nconfigs x { u8 type, u8 n, u8 m, u32 length }
+ *   nconfigs x config body (length bytes each)
+ *
+ * and each config body indexes its parts in the same way:
+ *
+ *   string8 nonce
+ *   m x { u8[16] guid, u8 slot, u32 length }
+ *   m x part body (tagged, as in EBOX_V3)
+ *
+ * so that sshbuf_get_ebox_lazy() can set up the configs without looking
+ * inside them, and ebox_config_load() can set up the parts of a config (with
+ * enough of their template to match them against a token) without decoding
+ * any keys or boxes. ebox_part_load() does the rest.
+ *
+ * The encoded bodies are copied into the arena, and ec_raw/ep_raw point into
+ * that copy until they're loaded.
+ */
+static errf_t *
+sshbuf_get_ebox_index(struct sshbuf *buf, struct ebox *box, uint nconfigs)
+{
+	struct ebox_arena **pea = &box->e_arena;
+	struct ebox_config *config, *lconfig = NULL;
+	struct ebox_tpl_config *tconfig;
+	uint32_t lens[UINT8_MAX];
+	uint8_t *raw, type;
+	size_t total = 0;
+	uint i;
+	int rc;
+	errf_t *err;
+
+	if (nconfigs < 1)
+		return (errf("InvalidConfig", NULL, "ebox has no configs"));
+
+	for (i = 0; i < nconfigs; ++i) {
+		config = ebox_arena_alloc(pea, sizeof (struct ebox_config));
+		tconfig = ebox_arena_alloc(pea, sizeof (struct ebox_tpl_config));
+		if (config == NULL || tconfig == NULL)
+			return (ERRF_NOMEM);
+		config->ec_tpl = tconfig;
+
+		/* Link it in straight away so that ebox_free() finds it. */
+		if (lconfig == NULL) {
+			box->e_configs = config;
+			box->e_tpl->et_configs = tconfig;
+		} else {
+			lconfig->ec_next = config;
+			lconfig->ec_tpl->etc_next = tconfig;
+			tconfig->etc_prev = lconfig->ec_tpl;
+		}
+		box->e_tpl->et_lastconfig = tconfig;
+		lconfig = config;
+
+		if ((rc = sshbuf_get_u8(buf, &type)) ||
+		    (rc = sshbuf_get_u8(buf, &tconfig->etc_n)) ||
+		    (rc = sshbuf_get_u8(buf, &tconfig->etc_m)) ||
+		    (rc = sshbuf_get_u32(buf, &lens[i]))) {
+			return (ssherrf("sshbuf_get_*", rc));
+		}
+		tconfig->etc_type = (enum ebox_config_type)type;
+		if ((err = ebox_config_check(tconfig)))
+			return (err);
+		if (tconfig->etc_m < 1) {
+			return (errf("InvalidConfig", NULL,
+			    "ebox config %u has no parts", i + 1));
+		}
+		if (lens[i] > sshbuf_len(buf) - total) {
+			return (errf("LengthError", NULL, "ebox config %u "
+			    "runs past the end of the ebox", i + 1));
+		}
+		total += lens[i];
+	}
+
+	if (total > sshbuf_len(buf)) {
+		return (errf("LengthError", NULL, "ebox configs run past the "
+		    "end of the ebox (%zu > %zu bytes)", total,
+		    sshbuf_len(buf)));
+	}
+	rc = ebox_arena_copy(pea, sshbuf_ptr(buf), total, &raw, NULL);
+	if (rc)
+		return (ssherrf("ebox_arena_copy", rc));
+	VERIFY0(sshbuf_consume(buf, total));
+
+	config = box->e_configs;
+	for (i = 0; config != NULL; config = config->ec_next, ++i) {
+		config->ec_raw = raw;
+		config->ec_rawlen = lens[i];
+		raw += lens[i];
+	}
+
+	return (ERRF_OK);
+}
+
+errf_t *
+ebox_config_load(struct ebox *box, struct ebox_config *config)
+{
+	struct ebox_arena **pea = &box->e_arena;
+	struct ebox_tpl_config *tconfig = config->ec_tpl;
+	struct ebox_part *part, *parts = NULL, *lpart = NULL;
+	struct ebox_tpl_part *tpart;
+	struct sshbuf *buf;
+	uint32_t lens[UINT8_MAX];
+	uint8_t *nonce = NULL;
+	size_t noncelen = 0;
+	uint8_t slot;
+	uint i;
+	int rc;
+	errf_t *err = NULL;
+
+	if (config->ec_raw == NULL)
+		return (ERRF_OK);
+
+	buf = sshbuf_from(config->ec_raw, config->ec_rawlen);
+	if (buf == NULL)
+		return (ERRF_NOMEM);
+
+	if ((rc = ebox_arena_get_string8(buf, pea, &nonce, &noncelen))) {
+		err = ssherrf("sshbuf_get_string8", rc);
+		goto out;
+	}
+	if (noncelen > 0 && tconfig->etc_type != EBOX_RECOVERY) {
+		err = errf("InvalidConfig", NULL,
+		    "ebox config is PRIMARY but has config nonce");
+		goto out;
+	}
+
+	for (i = 0; i < tconfig->etc_m; ++i) {
+		part = ebox_arena_alloc(pea, sizeof (struct ebox_part));
+		tpart = ebox_arena_alloc(pea, sizeof (struct ebox_tpl_part));
+		if (part == NULL || tpart == NULL) {
+			err = ERRF_NOMEM;
+			goto out;
+		}
+		part->ep_tpl = tpart;
+		part->ep_id = i + 1;
+		if (lpart == NULL) {
+			parts = part;
+		} else {
+			lpart->ep_next = part;
+			lpart->ep_tpl->etp_next = tpart;
+			tpart->etp_prev = lpart->ep_tpl;
+		}
+		lpart = part;
+
+		if ((rc = sshbuf_get(buf, tpart->etp_guid,
+		    sizeof (tpart->etp_guid))) ||
+		    (rc = sshbuf_get_u8(buf, &slot)) ||
+		    (rc = sshbuf_get_u32(buf, &lens[i]))) {
+			err = ssherrf("sshbuf_get_*", rc);
+			goto out;
+		}
+		tpart->etp_slot = slot;
+	}
+
+	for (i = 0, part = parts; part != NULL; part = part->ep_next, ++i) {
+		if (lens[i] > sshbuf_len(buf)) {
+			err = errf("LengthError", NULL, "ebox part %u runs "
+			    "past the end of its config", i + 1);
+			goto out;
+		}
+		part->ep_raw = sshbuf_ptr(buf);
+		part->ep_rawlen = lens[i];
+		VERIFY0(sshbuf_consume(buf, lens[i]));
+	}
+	if (sshbuf_len(buf) != 0) {
+		err = errf("LengthError", NULL, "ebox config has %zu bytes "
+		    "of trailing data", sshbuf_len(buf));
+		goto out;
+	}
+
+	config->ec_nonce = nonce;
+	config->ec_noncelen = noncelen;
+	config->ec_parts = parts;
+	tconfig->etc_parts = parts->ep_tpl;
+	tconfig->etc_lastpart = lpart->ep_tpl;
+	config->ec_raw = NULL;
+	config->ec_rawlen = 0;
+	parts = NULL;
+
+out:
+	for (part = parts; part != NULL; part = lpart) {
+		lpart = part->ep_next;
+		ebox_tpl_part_free_arena(part->ep_tpl, *pea);
+		ebox_part_free_arena(part, *pea);
+	}
+	sshbuf_free(buf);
+	if (err != NULL)
+		err = boxderrf(err);
+	return (err);
+}
+
+errf_t *
+ebox_part_load(struct ebox *box, struct ebox_part *part)
+{
+	struct ebox_tpl_part *tpart = part->ep_tpl;
+	struct ebox_tpl_part *ntpart;
+	struct ebox_part *npart = NULL;
+	struct sshbuf *buf;
+	errf_t *err = NULL;
+
+	if (part->ep_raw == NULL)
+		return (ERRF_OK);
+
+	buf = sshbuf_from(part->ep_raw, part->ep_rawlen);
+	if (buf == NULL)
+		return (ERRF_NOMEM);
+
+	if ((err = sshbuf_get_ebox_part(buf, box, &npart)))
+		goto out;
+	ntpart = npart->ep_tpl;
+	if (sshbuf_len(buf) != 0) {
+		err = errf("LengthError", NULL, "ebox part has %zu bytes "
+		    "of trailing data", sshbuf_len(buf));
+		goto out;
+	}
+	if (bcmp(ntpart->etp_guid, tpart->etp_guid,
+	    sizeof (tpart->etp_guid)) != 0 ||
+	    ntpart->etp_slot != tpart->etp_slot) {
+		err = errf("IndexMismatchError", NULL, "ebox part GUID or "
+		    "slot does not match the config index");
+		goto out;
+	}
+
+	/*
+	 * Callers may already hold pointers to part and tpart, so move the
+	 * decoded fields across rather than swapping the structs.
+	 */
+	part->ep_box = npart->ep_box;
+	npart->ep_box = NULL;
+	tpart->etp_name = ntpart->etp_name;
+	ntpart->etp_name = NULL;
+	tpart->etp_pubkey = ntpart->etp_pubkey;
+	ntpart->etp_pubkey = NULL;
+	tpart->etp_cak = ntpart->etp_cak;
+	ntpart->etp_cak = NULL;
+	part->ep_raw = NULL;
+	part->ep_rawlen = 0;
+
+out:
+	if (npart != NULL) {
+		ebox_tpl_part_free_arena(npart->ep_tpl, box->e_arena);
+		ebox_part_free_arena(npart, box->e_arena);
+	}
+	sshbuf_free(buf);
+	if (err != NULL)
+		err = boxderrf(err);
+	return (err);
+}
+
+errf_t *
+ebox_load(struct ebox *box)
+{
+	struct ebox_config *config;
+	struct ebox_part *part;
+	errf_t *err;
+
+	for (config = box->e_configs; config != NULL;
+	    config = config->ec_next) {
+		if ((err = ebox_config_load(box, config)))
+			return (err);
+		for (part = config->ec_parts; part != NULL;
+		    part = part->ep_next) {
+			if ((err = ebox_part_load(box, part)))
+				return (err);
+		}
+	}
+	return (ERRF_OK);
+}
+
 errf_t *
 sshbuf_get_ebox(struct sshbuf *buf, struct ebox **pbox)
+{
+	struct ebox *box;
+	errf_t *err;
+
+	if ((err = sshbuf_get_ebox_lazy(buf, &box)))
+		return (err);
+	if ((err = ebox_load(box))) {
+		ebox_free(box);
+		return (err);
+	}
+	*pbox = box;
+	return (ERRF_OK);
+}
+
+errf_t *
+sshbuf_get_ebox_lazy(struct sshbuf *buf, struct ebox **pbox)
 {
 	struct ebox *box;
 	struct ebox_config *config;
@@ -2064,12 +3873,15 @@ sshbuf_get_ebox(struct sshbuf *buf, struct ebox **pbox)
 	int rc = 0;
 	uint8_t ver, magic[2], type, nconfigs;
 	uint i;
+	size_t start;
 	errf_t *err = NULL;
 
+	start = sshbuf_len(buf);
+
 	box = calloc(1, sizeof (struct ebox));
 	VERIFY(box != NULL);
 
-	box->e_tpl = calloc(1, sizeof (struct ebox_tpl));
+	box->e_tpl = ebox_arena_alloc(&box->e_arena, sizeof (struct ebox_tpl));
 	VERIFY(box->e_tpl != NULL);
 
 	box->e_tpl->et_version = EBOX_TPL_VNEXT - 1;
@@ -2103,19 +3915,21 @@ sshbuf_get_ebox(struct sshbuf *buf, struct ebox **pbox)
 	box->e_version = ver;
 	box->e_type = (enum ebox_type)type;
 
-	if ((rc = sshbuf_get_cstring8(buf, &box->e_rcv_cipher, NULL))) {
+	rc = ebox_arena_get_cstring8(buf, &box->e_arena, &box->e_rcv_cipher,
+	    NULL);
+	if (rc) {
 		err = boxderrf(ssherrf("sshbuf_get_u8", rc));
 		goto out;
 	}
-	rc = sshbuf_get_string8(buf, &box->e_rcv_iv.b_data,
+	rc = ebox_arena_get_string8(buf, &box->e_arena, &box->e_rcv_iv.b_data,
 	    &box->e_rcv_iv.b_len);
 	if (rc) {
 		err = boxderrf(ssherrf("sshbuf_get_string8", rc));
 		goto out;
 	}
 
-	rc = sshbuf_get_string8(buf, &box->e_rcv_enc.b_data,
-	    &box->e_rcv_enc.b_len);
+	rc = ebox_arena_get_string8(buf, &box->e_arena,
+	    &box->e_rcv_enc.b_data, &box->e_rcv_enc.b_len);
 	if (rc) {
 		err = boxderrf(ssherrf("sshbuf_get_string8", rc));
 		goto out;
@@ -2131,7 +3945,7 @@ sshbuf_get_ebox(struct sshbuf *buf, struct ebox **pbox)
 		}
 
 		for (i = 0; i < neeks; ++i) {
-			if ((err = sshbuf_get_ebox_ephem_key(buf, &eek))) {
+			if ((err = sshbuf_get_ebox_ephem_key(buf, box, &eek))) {
 				err = boxderrf(err);
 				goto out;
 			}
@@ -2145,6 +3959,14 @@ sshbuf_get_ebox(struct sshbuf *buf, struct ebox **pbox)
 		goto out;
 	}
 
+	if (box->e_version >= EBOX_V4) {
+		if ((err = sshbuf_get_ebox_index(buf, box, nconfigs))) {
+			err = boxderrf(err);
+			goto out;
+		}
+		goto done;
+	}
+
 	if ((err = sshbuf_get_ebox_config(buf, box, &config))) {
 		err = boxderrf(err);
 		goto out;
@@ -2152,6 +3974,7 @@ sshbuf_get_ebox(struct sshbuf *buf, struct ebox **pbox)
 	box->e_configs = config;
 	tconfig = config->ec_tpl;
 	box->e_tpl->et_configs = tconfig;
+	box->e_tpl->et_lastconfig = tconfig;
 
 	for (i = 1; i < nconfigs; ++i) {
 		if ((err = sshbuf_get_ebox_config(buf, box,
@@ -2163,8 +3986,11 @@ sshbuf_get_ebox(struct sshbuf *buf, struct ebox **pbox)
 		tconfig->etc_next = config->ec_tpl;
 		config->ec_tpl->etc_prev = tconfig;
 		tconfig = config->ec_tpl;
+		box->e_tpl->et_lastconfig = tconfig;
 	}
 
+done:
+	box->e_wirelen = start - sshbuf_len(buf);
 	*pbox = box;
 	box = NULL;
 
@@ -2178,15 +4004,11 @@ sshbuf_put_ebox_part(struct sshbuf *buf, struct ebox *ebox,
     struct ebox_part *part)
 {
 	struct ebox_tpl_part *tpart;
-	struct sshbuf *kbuf;
 	int rc = 0;
 	errf_t *err;
 
 	tpart = part->ep_tpl;
 
-	kbuf = sshbuf_new();
-	VERIFY(kbuf != NULL);
-
 	if ((rc = sshbuf_put_u8(buf, EBOX_PART_GUID)) ||
 	    (rc = sshbuf_put_string8(buf, tpart->etp_guid,
 	    sizeof (tpart->etp_guid)))) {
@@ -2203,10 +4025,8 @@ sshbuf_put_ebox_part(struct sshbuf *buf, struct ebox *ebox,
 	}
 
 	if (tpart->etp_cak != NULL) {
-		sshbuf_reset(kbuf);
 		if ((rc = sshbuf_put_u8(buf, EBOX_PART_CAK)) ||
-		    (rc = sshkey_putb(tpart->etp_cak, kbuf)) ||
-		    (rc = sshbuf_put_stringb(buf, kbuf))) {
+		    (rc = sshkey_puts(tpart->etp_cak, buf))) {
 			err = ssherrf("sshbuf_put_*", rc);
 			goto out;
 		}
@@ -2277,7 +4097,50 @@ sshbuf_put_ebox_part(struct sshbuf *buf, struct ebox *ebox,
 	err = NULL;
 
 out:
-	sshbuf_free(kbuf);
+	return (err);
+}
+
+static errf_t *
+sshbuf_put_ebox_part_index(struct sshbuf *buf, struct ebox *ebox,
+    struct ebox_config *config)
+{
+	struct ebox_part *part;
+	struct ebox_tpl_part *tpart;
+	struct sshbuf *pbuf;
+	size_t start;
+	int rc;
+	errf_t *err = NULL;
+
+	if ((pbuf = sshbuf_new()) == NULL)
+		return (ERRF_NOMEM);
+
+	part = config->ec_parts;
+	for (; part != NULL; part = part->ep_next) {
+		tpart = part->ep_tpl;
+		start = sshbuf_len(pbuf);
+		if (part->ep_raw != NULL) {
+			rc = sshbuf_put(pbuf, part->ep_raw, part->ep_rawlen);
+			if (rc) {
+				err = ssherrf("sshbuf_put", rc);
+				goto out;
+			}
+		} else if ((err = sshbuf_put_ebox_part(pbuf, ebox, part))) {
+			goto out;
+		}
+		if ((rc = sshbuf_put(buf, tpart->etp_guid,
+		    sizeof (tpart->etp_guid))) ||
+		    (rc = sshbuf_put_u8(buf, tpart->etp_slot)) ||
+		    (rc = sshbuf_put_u32(buf, sshbuf_len(pbuf) - start))) {
+			err = ssherrf("sshbuf_put_*", rc);
+			goto out;
+		}
+	}
+
+	if ((rc = sshbuf_putb(buf, pbuf)))
+		err = ssherrf("sshbuf_putb", rc);
+
+out:
+	sshbuf_free(pbuf);
 	return (err);
 }
 
@@ -2292,9 +4155,11 @@ sshbuf_put_ebox_config(struct sshbuf *buf, struct ebox *ebox,
 
 	tconfig = config->ec_tpl;
 
-	if ((rc = sshbuf_put_u8(buf, tconfig->etc_type)) ||
+	/* In EBOX_V4 these are in the index, see sshbuf_put_ebox_index() */
+	if (ebox->e_version < EBOX_V4 &&
+	    ((rc = sshbuf_put_u8(buf, tconfig->etc_type)) ||
 	    (rc = sshbuf_put_u8(buf, tconfig->etc_n)) ||
-	    (rc = sshbuf_put_u8(buf, tconfig->etc_m))) {
+	    (rc = sshbuf_put_u8(buf, tconfig->etc_m)))) {
 		return (ssherrf("sshbuf_put_u8", rc));
 	}
 
@@ -2311,6 +4176,9 @@ sshbuf_put_ebox_config(struct sshbuf *buf, struct ebox *ebox,
 			return (ssherrf("sshbuf_put_u8", rc));
 	}
 
+	if (ebox->e_version >= EBOX_V4)
+		return (sshbuf_put_ebox_part_index(buf, ebox, config));
+
 	part = config->ec_parts;
 	for (; part != NULL; part = part->ep_next) {
 		if ((err = sshbuf_put_ebox_part(buf, ebox, part)))
@@ -2320,6 +4188,55 @@ sshbuf_put_ebox_config(struct sshbuf *buf, struct ebox *ebox,
 	return (NULL);
 }
 
+/*
+ * Writes the configs of an EBOX_V4 ebox with their index (see
+ * sshbuf_get_ebox_index()). Anything still not loaded from a lazy ebox is
+ * copied out as-is.
+ */
+static errf_t *
+sshbuf_put_ebox_index(struct sshbuf *buf, struct ebox *ebox)
+{
+	struct ebox_config *config;
+	struct ebox_tpl_config *tconfig;
+	struct sshbuf *cbuf;
+	size_t start;
+	int rc;
+	errf_t *err = NULL;
+
+	if ((cbuf = sshbuf_new()) == NULL)
+		return (ERRF_NOMEM);
+
+	config = ebox->e_configs;
+	for (; config != NULL; config = config->ec_next) {
+		tconfig = config->ec_tpl;
+		start = sshbuf_len(cbuf);
+		if (config->ec_raw != NULL) {
+			rc = sshbuf_put(cbuf, config->ec_raw,
+			    config->ec_rawlen);
+			if (rc) {
+				err = ssherrf("sshbuf_put", rc);
+				goto out;
+			}
+		} else if ((err = sshbuf_put_ebox_config(cbuf, ebox, config))) {
+			goto out;
+		}
+		if ((rc = sshbuf_put_u8(buf, tconfig->etc_type)) ||
+		    (rc = sshbuf_put_u8(buf, tconfig->etc_n)) ||
+		    (rc = sshbuf_put_u8(buf, tconfig->etc_m)) ||
+		    (rc = sshbuf_put_u32(buf, sshbuf_len(cbuf) - start))) {
+			err = ssherrf("sshbuf_put_*", rc);
+			goto out;
+		}
+	}
+
+	if ((rc = sshbuf_putb(buf, cbuf)))
+		err = ssherrf("sshbuf_putb", rc);
+
+out:
+	sshbuf_free(cbuf);
+	return (err);
+}
+
 static errf_t *
 sshbuf_put_ebox_ephem_key(struct sshbuf *buf, struct ebox_ephem_key *eek)
 {
@@ -2354,6 +4271,15 @@ sshbuf_put_ebox(struct sshbuf *buf, struct ebox *ebox)
 		++neeks;
 	}
 
+	/*
+	 * If this ebox came from sshbuf_get_ebox() we know how big it
+	 * is, so make room for it all at once.
+	 */
+	if (ebox->e_wirelen > 0 &&
+	    (rc = sshbuf_allocate(buf, ebox->e_wirelen))) {
+		return (ssherrf("sshbuf_allocate", rc));
+	}
+
 	if ((rc = sshbuf_put_u8(buf, 0xEB)) ||
 	    (rc = sshbuf_put_u8(buf, 0x0C)) ||
 	    (rc = sshbuf_put_u8(buf, ebox->e_version)) ||
@@ -2392,6 +4318,9 @@ sshbuf_put_ebox(struct sshbuf *buf, struct ebox *ebox)
 		return (ssherrf("sshbuf_put_u8", rc));
 	}
 
+	if (ebox->e_version >= EBOX_V4)
+		return (sshbuf_put_ebox_index(buf, ebox));
+
 	config = ebox->e_configs;
 	for (; config != NULL; config = config->ec_next) {
 		if ((err = sshbuf_put_ebox_config(buf, ebox, config)))
@@ -2603,22 +4532,106 @@ ebox_encrypt_recovery(struct ebox *box)
 	VERIFY(iv != NULL);
 	arc4random_buf(iv, ivlen);
 
-	box->e_rcv_key.b_data = (key = malloc_conceal(keylen));
+	box->e_rcv_key.b_data = (key = calloc_locked(1, keylen));
 	VERIFY(key != NULL);
 	box->e_rcv_key.b_len = keylen;
 	arc4random_buf(key, keylen);
 
-	VERIFY0(cipher_init(&cctx, cipher, key, keylen, iv, ivlen, 1));
-	enclen = plainlen + authlen;
-	enc = malloc(enclen);
-	VERIFY3P(enc, !=, NULL);
-	VERIFY0(cipher_crypt(cctx, 0, enc, plain, plainlen, 0, authlen));
-	cipher_free(cctx);
+	VERIFY0(cipher_init(&cctx, cipher, key, keylen, iv, ivlen, 1));
+	enclen = plainlen + authlen;
+	enc = malloc(enclen);
+	VERIFY3P(enc, !=, NULL);
+	VERIFY0(cipher_crypt(cctx, 0, enc, plain, plainlen, 0, authlen));
+	cipher_free(cctx);
+
+	freezero(plain, plainlen);
+
+	box->e_rcv_enc.b_data = enc;
+	box->e_rcv_enc.b_len = enclen;
+}
+
+/*
+ * Sealing the part boxes is the expensive bit of ebox_create() (an ECDH
+ * and KDF each), and they're all independent of each other once their data
+ * and ephemeral key are set, so for bigger templates we do them on a few
+ * threads.
+ *
+ * The ephemeral keys are shared between parts on the same curve, but they're
+ * all made by ebox_make_ephem_for_nid() before any of the threads start,
+ * and after that are only ever read.
+ */
+static uint ebox_seal_threads = 0;
+
+/* Fewer part boxes than this aren't worth starting threads for. */
+#define	EBOX_SEAL_MIN_PARALLEL	4
+
+struct ebox_seal_job {
+	struct sshkey *esj_pubkey;
+	struct piv_ecdh_box *esj_box;
+};
+
+struct ebox_seal_pool {
+	struct ebox_seal_job *esp_jobs;
+	size_t esp_njobs;
+	size_t esp_next;	/* atomic */
+};
+
+void
+ebox_set_seal_threads(uint n)
+{
+	ebox_seal_threads = n;
+}
 
-	freezero(plain, plainlen);
+static void *
+ebox_seal_worker(void *arg)
+{
+	struct ebox_seal_pool *esp = arg;
+	struct ebox_seal_job *j;
+	size_t i;
 
-	box->e_rcv_enc.b_data = enc;
-	box->e_rcv_enc.b_len = enclen;
+	while ((i = __atomic_fetch_add(&esp->esp_next, 1, __ATOMIC_RELAXED)) <
+	    esp->esp_njobs) {
+		j = &esp->esp_jobs[i];
+		VERIFY0(piv_box_seal_offline(j->esj_pubkey, j->esj_box));
+	}
+	return (NULL);
+}
+
+static void
+ebox_seal_all(struct ebox_seal_job *jobs, size_t njobs)
+{
+	struct ebox_seal_pool esp;
+	pthread_t thr[EBOX_SEAL_MAX_THREADS];
+	uint nthr, started, i;
+	long ncpu;
+
+	nthr = ebox_seal_threads;
+	if (nthr == 0) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nthr = (ncpu < 1) ? 1 : ncpu;
+	}
+	if (nthr > EBOX_SEAL_MAX_THREADS)
+		nthr = EBOX_SEAL_MAX_THREADS;
+	if (nthr > njobs)
+		nthr = njobs;
+
+	bzero(&esp, sizeof (esp));
+	esp.esp_jobs = jobs;
+	esp.esp_njobs = njobs;
+
+	started = 0;
+	if (nthr > 1 && njobs >= EBOX_SEAL_MIN_PARALLEL) {
+		/* The calling thread is one of the workers. */
+		for (i = 0; i < nthr - 1; ++i) {
+			if (pthread_create(&thr[i], NULL, ebox_seal_worker,
+			    &esp) != 0)
+				break;
+			++started;
+		}
+	}
+	(void) ebox_seal_worker(&esp);
+	for (i = 0; i < started; ++i)
+		VERIFY0(pthread_join(thr[i], NULL));
 }
 
 errf_t *
@@ -2637,11 +4650,22 @@ ebox_create(const struct ebox_tpl *tpl, const uint8_t *key, size_t keylen,
 	struct piv_ecdh_box *pbox;
 	sss_Keyshare *share, *shares = NULL;
 	size_t shareslen = 0;
+	struct ebox_seal_job *jobs;
+	size_t njobs = 0, maxjobs = 0;
 	uint i;
 
 	box = calloc(1, sizeof (struct ebox));
 	VERIFY(box != NULL);
 
+	tconfig = tpl->et_configs;
+	for (; tconfig != NULL; tconfig = tconfig->etc_next) {
+		tpart = tconfig->etc_parts;
+		for (; tpart != NULL; tpart = tpart->etp_next)
+			++maxjobs;
+	}
+	jobs = calloc(maxjobs + 1, sizeof (struct ebox_seal_job));
+	VERIFY(jobs != NULL);
+
 	box->e_version = EBOX_VNEXT - 1;
 	box->e_type = EBOX_KEY;
 
@@ -2691,18 +4715,18 @@ ebox_create(const struct ebox_tpl *tpl, const uint8_t *key, size_t keylen,
 			VERIFY(nconfig->ec_nonce != NULL);
 			arc4random_buf(nconfig->ec_nonce, nconfig->ec_noncelen);
 
-			configkey = calloc_conceal(1, nconfig->ec_noncelen);
+			configkey = calloc_locked(1, nconfig->ec_noncelen);
 			for (i = 0; i < nconfig->ec_noncelen; ++i) {
 				configkey[i] = nconfig->ec_nonce[i] ^
 				    box->e_rcv_key.b_data[i];
 			}
 
 			shareslen = tconfig->etc_m * sizeof (sss_Keyshare);
-			shares = calloc_conceal(1, shareslen);
+			shares = calloc_locked(1, shareslen);
 			sss_create_keyshares(shares, configkey, tconfig->etc_m,
 			    tconfig->etc_n);
 
-			freezero(configkey, nconfig->ec_noncelen);
+			freezero_locked(configkey, nconfig->ec_noncelen);
 		}
 
 		ppart = NULL;
@@ -2752,13 +4776,16 @@ ebox_create(const struct ebox_tpl *tpl, const uint8_t *key, size_t keylen,
 			}
 			pbox->pdb_ephem = ebox_make_ephem_for_nid(box,
 			    tpart->etp_pubkey->ecdsa_nid);
-			VERIFY0(piv_box_seal_offline(tpart->etp_pubkey, pbox));
+			VERIFY3U(njobs, <, maxjobs);
+			jobs[njobs].esj_pubkey = tpart->etp_pubkey;
+			jobs[njobs].esj_box = pbox;
+			++njobs;
 
 			ppart = npart;
 		}
 
 		if (shares != NULL) {
-			freezero(shares, shareslen);
+			freezero_locked(shares, shareslen);
 			shares = NULL;
 			shareslen = 0;
 		}
@@ -2766,22 +4793,50 @@ ebox_create(const struct ebox_tpl *tpl, const uint8_t *key, size_t keylen,
 		pconfig = nconfig;
 	}
 
+	ebox_seal_all(jobs, njobs);
+	free(jobs);
+
 	*pebox = box;
 	return (ERRF_OK);
 }
 
+/*
+ * The ebox's key lives in the locked pool (see calloc_locked()) rather than
+ * wherever it was decrypted into, so it stays out of swap without needing
+ * mlockall().
+ */
+static void
+ebox_set_key(struct ebox *ebox, const uint8_t *key, size_t keylen)
+{
+	freezero_locked(ebox->e_key, ebox->e_keylen);
+	ebox->e_key = calloc_locked(1, keylen);
+	VERIFY(ebox->e_key != NULL);
+	bcopy(key, ebox->e_key, keylen);
+	ebox->e_keylen = keylen;
+}
+
 errf_t *
 ebox_unlock(struct ebox *ebox, struct ebox_config *config)
 {
 	struct ebox_part *part;
+	uint8_t *key;
+	size_t keylen;
+	errf_t *err;
 
 	for (part = config->ec_parts; part != NULL; part = part->ep_next) {
 		struct piv_ecdh_box *box = part->ep_box;
+		/* Not loaded yet, so it can't have been unsealed */
+		if (box == NULL)
+			continue;
 		if (box->pdb_plain.b_data == NULL)
 			continue;
 		if (box->pdb_plain.b_len < 1)
 			continue;
-		return (piv_box_take_data(box, &ebox->e_key, &ebox->e_keylen));
+		if ((err = piv_box_take_data(box, &key, &keylen)))
+			return (err);
+		ebox_set_key(ebox, key, keylen);
+		freezero(key, keylen);
+		return (ERRF_OK);
 	}
 
 	return (errf("InsufficientParts", NULL, "ebox_unlock requires at "
@@ -2794,20 +4849,21 @@ ebox_config_nonce_len(const struct ebox_config *config)
 	return (config->ec_noncelen);
 }
 
-errf_t *
-ebox_recover(struct ebox *ebox, struct ebox_config *config)
+/*
+ * First half of ebox_recover(): check the ebox is in a state to be recovered
+ * and collect the available key shares from the config's parts into
+ * *pshares (which has room for etc_m shares, and must be zeroed and freed
+ * by the caller).
+ */
+static errf_t *
+ebox_recover_gather(struct ebox *ebox, struct ebox_config *config,
+    sss_Keyshare **pshares)
 {
 	struct ebox_part *part;
 	struct ebox_tpl_config *tconfig = config->ec_tpl;
-	struct sshbuf *buf = NULL;
 	uint n = tconfig->etc_n, m = tconfig->etc_m;
-	uint i = 0, j;
-	errf_t *err;
-	int rc;
-	uint8_t tag;
-	uint8_t *configkey;
-	size_t cklen;
-	sss_Keyshare *share, *shares = NULL;
+	uint i = 0;
+	sss_Keyshare *share, *shares;
 
 	if (ebox->e_key != NULL || ebox->e_keylen > 0) {
 		return (errf("AlreadyUnlocked", NULL,
@@ -2822,14 +4878,15 @@ ebox_recover(struct ebox *ebox, struct ebox_config *config)
 		    "ebox has already been recovered"));
 	}
 
-	shares = calloc_conceal(m, sizeof (sss_Keyshare));
+	shares = calloc_locked(m, sizeof (sss_Keyshare));
 
 	for (part = config->ec_parts; part != NULL; part = part->ep_next) {
 		if (part->ep_share != NULL && part->ep_sharelen >= 1) {
 			VERIFY3U(part->ep_sharelen, ==, sizeof (sss_Keyshare));
 			share = &shares[i++];
 			bcopy(part->ep_share, share, sizeof (sss_Keyshare));
-		} else if (!piv_box_sealed(part->ep_box)) {
+		} else if (part->ep_box != NULL &&
+		    !piv_box_sealed(part->ep_box)) {
 			/*
 			 * We can't use take_data_* because we don't want to
 			 * consume the data buffer (we're not sure yet whether
@@ -2845,24 +4902,41 @@ ebox_recover(struct ebox *ebox, struct ebox_config *config)
 	}
 
 	if (i < n) {
-		err = errf("InsufficientParts", NULL,
+		freezero_locked(shares, m * sizeof (sss_Keyshare));
+		return (errf("InsufficientParts", NULL,
 		    "ebox needs %u parts available to recover (has %u)",
-		    n, i);
-		goto out;
+		    n, i));
 	}
 
-	/* sss_* only supports 32-byte keys */
-	ebox->e_rcv_key.b_len = (cklen = 32);
-	ebox->e_rcv_key.b_data = calloc_conceal(1, cklen);
+	*pshares = shares;
+	return (ERRF_OK);
+}
 
-	configkey = calloc_conceal(1, cklen);
-	sss_combine_keyshares(configkey, (const sss_Keyshare *)shares, n);
+/*
+ * Second half of ebox_recover(): given the config key combined from the
+ * shares, decrypt the recovery box and take the key (and token, if any)
+ * out of it.
+ */
+static errf_t *
+ebox_recover_finish(struct ebox *ebox, struct ebox_config *config,
+    const uint8_t *configkey, size_t cklen)
+{
+	struct ebox_part *part;
+	struct sshbuf *buf = NULL;
+	errf_t *err;
+	int rc;
+	uint8_t tag;
+	const uint8_t *key;
+	size_t i, keylen;
+
+	ebox->e_rcv_key.b_len = cklen;
+	ebox->e_rcv_key.b_data = calloc_locked(1, cklen);
 
 	if (config->ec_noncelen > 0 && config->ec_nonce != NULL) {
 		if (config->ec_noncelen < cklen) {
-			free(ebox->e_rcv_key.b_data);
-			freezero(configkey, cklen);
-			freezero(shares, m * sizeof (sss_Keyshare));
+			freezero_locked(ebox->e_rcv_key.b_data, cklen);
+			ebox->e_rcv_key.b_data = NULL;
+			ebox->e_rcv_key.b_len = 0;
 			return (errf("RecoveryFailed", errf("BadConfigNonce",
 			    NULL, "recovery config nonce has bad length: %zu "
 			    "(need %zu bytes)", config->ec_noncelen, cklen),
@@ -2876,7 +4950,6 @@ ebox_recover(struct ebox *ebox, struct ebox_config *config)
 	} else {
 		bcopy(configkey, ebox->e_rcv_key.b_data, cklen);
 	}
-	free(configkey);
 
 	err = ebox_decrypt_recovery(ebox);
 	if (err) {
@@ -2908,11 +4981,12 @@ ebox_recover(struct ebox *ebox, struct ebox_config *config)
 		    "ebox recovery failed");
 		goto out;
 	}
-	rc = sshbuf_get_string8_conceal(buf, &ebox->e_key, &ebox->e_keylen);
+	rc = sshbuf_get_string8_direct(buf, &key, &keylen);
 	if (rc) {
 		err = ssherrf("sshbuf_get_string8", rc);
 		goto out;
 	}
+	ebox_set_key(ebox, key, keylen);
 
 	for (part = config->ec_parts; part != NULL; part = part->ep_next) {
 		if (part->ep_share != NULL) {
@@ -2933,22 +5007,112 @@ ebox_recover(struct ebox *ebox, struct ebox_config *config)
 
 out:
 	sshbuf_free(buf);
-	for (j = 0; j < m; ++j)
-		explicit_bzero(&shares[j], sizeof (sss_Keyshare));
-	free(shares);
 	return (err);
 }
 
 errf_t *
-ebox_gen_challenge(struct ebox_config *config, struct ebox_part *part,
-    const char *descfmt, ...)
+ebox_recover(struct ebox *ebox, struct ebox_config *config)
+{
+	struct ebox_tpl_config *tconfig = config->ec_tpl;
+	uint n = tconfig->etc_n, m = tconfig->etc_m;
+	errf_t *err;
+	/* sss_* only supports 32-byte keys */
+	uint8_t configkey[32];
+	sss_Keyshare *shares = NULL;
+
+	if ((err = ebox_recover_gather(ebox, config, &shares)))
+		return (err);
+
+	sss_combine_keyshares(configkey, (const sss_Keyshare *)shares, n);
+	freezero_locked(shares, m * sizeof (sss_Keyshare));
+
+	err = ebox_recover_finish(ebox, config, configkey, sizeof (configkey));
+	explicit_bzero(configkey, sizeof (configkey));
+	return (err);
+}
+
+errf_t *
+ebox_recover_batch(struct ebox **eboxes, struct ebox_config **configs,
+    size_t count, errf_t **errs)
+{
+	sss_Keyshare **shares;
+	const sss_Keyshare **set;
+	uint8_t (*keys)[32];
+	size_t *idx;
+	size_t i, j, nset, nfailed = 0;
+	uint n;
+
+	shares = calloc(count, sizeof (sss_Keyshare *));
+	set = calloc(count, sizeof (sss_Keyshare *));
+	idx = calloc(count, sizeof (size_t));
+	keys = calloc_locked(count, sizeof (*keys));
+	if (shares == NULL || set == NULL || idx == NULL || keys == NULL) {
+		free(shares);
+		free(set);
+		free(idx);
+		freezero_locked(keys, count * sizeof (*keys));
+		return (ERRF_NOMEM);
+	}
+
+	for (i = 0; i < count; ++i)
+		errs[i] = ebox_recover_gather(eboxes[i], configs[i], &shares[i]);
+
+	/*
+	 * sss_combine_keyshares_batch() needs every set in a call to have
+	 * the same number of shares, so group the eboxes by N first.
+	 */
+	for (i = 0; i < count; ++i) {
+		if (errs[i] != NULL || shares[i] == NULL)
+			continue;
+		n = configs[i]->ec_tpl->etc_n;
+		nset = 0;
+		for (j = i; j < count; ++j) {
+			if (errs[j] != NULL || shares[j] == NULL)
+				continue;
+			if (configs[j]->ec_tpl->etc_n != n)
+				continue;
+			set[nset] = shares[j];
+			idx[nset++] = j;
+		}
+		sss_combine_keyshares_batch(keys, set, n, nset);
+		for (j = 0; j < nset; ++j) {
+			freezero_locked(shares[idx[j]], configs[idx[j]]->ec_tpl->etc_m *
+			    sizeof (sss_Keyshare));
+			shares[idx[j]] = NULL;
+			errs[idx[j]] = ebox_recover_finish(eboxes[idx[j]],
+			    configs[idx[j]], keys[j], sizeof (keys[j]));
+			explicit_bzero(keys[j], sizeof (keys[j]));
+		}
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (errs[i] != NULL)
+			++nfailed;
+	}
+
+	freezero_locked(keys, count * sizeof (*keys));
+	free(shares);
+	free(set);
+	free(idx);
+
+	if (nfailed > 0) {
+		return (errf("RecoveryFailed", NULL, "%zu of %zu eboxes could "
+		    "not be recovered", nfailed, count));
+	}
+	return (ERRF_OK);
+}
+
+/*
+ * Fills in the fields common to single challenges and bundles: hostname,
+ * time, description and verification words.
+ */
+static errf_t *
+ebox_challenge_init(struct ebox_challenge *chal, const char *descfmt,
+    va_list ap)
 {
-	struct ebox_challenge *chal;
-	int rc = 0;
 	size_t hnamelen;
 	char *hostname = NULL;
 	char desc[255] = {0};
-	va_list ap;
 	int wrote;
 	errf_t *err = NULL;
 
@@ -2963,22 +5127,12 @@ ebox_gen_challenge(struct ebox_config *config, struct ebox_part *part,
 	if (hostname == NULL)
 		return (ERRF_NOMEM);
 
-	chal = calloc(1, sizeof (struct ebox_challenge));
-	if (chal == NULL) {
-		err = ERRF_NOMEM;
-		goto out;
-	}
-
-	chal->c_version = 1;
 	chal->c_type = CHAL_RECOVERY;
-	chal->c_id = part->ep_id;
 	if (gethostname(hostname, hnamelen)) {
 		err = errfno("gethostname", errno, NULL);
 		goto out;
 	}
 	chal->c_hostname = strdup(hostname);
-	free(hostname);
-	hostname = NULL;
 	if (chal->c_hostname == NULL) {
 		err = ERRF_NOMEM;
 		goto out;
@@ -2988,6 +5142,51 @@ ebox_gen_challenge(struct ebox_config *config, struct ebox_part *part,
 		err = errfno("time", errno, NULL);
 		goto out;
 	}
+
+	wrote = vsnprintf(desc, sizeof (desc), descfmt, ap);
+	if (wrote < 0) {
+		err = errfno("vsnprintf", errno, NULL);
+		goto out;
+	}
+	if (wrote >= sizeof (desc)) {
+		err = errf("LengthError", NULL, "description field is too "
+		    "long to fit in challenge");
+		goto out;
+	}
+	chal->c_description = strdup(desc);
+	if (chal->c_description == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+
+	arc4random_buf(chal->c_words, sizeof (chal->c_words));
+
+out:
+	free(hostname);
+	return (err);
+}
+
+errf_t *
+ebox_gen_challenge(struct ebox_config *config, struct ebox_part *part,
+    const char *descfmt, ...)
+{
+	struct ebox_challenge *chal;
+	int rc = 0;
+	va_list ap;
+	errf_t *err = NULL;
+
+	chal = calloc(1, sizeof (struct ebox_challenge));
+	if (chal == NULL)
+		return (ERRF_NOMEM);
+
+	chal->c_version = 1;
+	chal->c_id = part->ep_id;
+	va_start(ap, descfmt);
+	err = ebox_challenge_init(chal, descfmt, ap);
+	va_end(ap);
+	if (err)
+		goto out;
+
 	chal->c_keybox = piv_box_clone(part->ep_box);
 	if (chal->c_keybox == NULL) {
 		err = ERRF_NOMEM;
@@ -2998,9 +5197,9 @@ ebox_gen_challenge(struct ebox_config *config, struct ebox_part *part,
 		uint bits;
 		VERIFY3S(part->ep_box->pdb_pub->type, ==, KEY_ECDSA);
 		bits = sshkey_size(part->ep_box->pdb_pub);
-		rc = sshkey_generate(KEY_ECDSA, bits, &config->ec_chalkey);
+		rc = piv_ephem_take(bits, &config->ec_chalkey);
 		if (rc) {
-			err = ssherrf("sshkey_generate", rc);
+			err = ssherrf("piv_ephem_take", rc);
 			goto out;
 		}
 	} else {
@@ -3013,56 +5212,117 @@ ebox_gen_challenge(struct ebox_config *config, struct ebox_part *part,
 		goto out;
 	}
 
-	va_start(ap, descfmt);
-	wrote = vsnprintf(desc, sizeof (desc), descfmt, ap);
-	if (wrote < 0) {
-		err = errfno("vsnprintf", errno, NULL);
-		goto out;
+	part->ep_chal = chal;
+	chal = NULL;
+
+out:
+	ebox_challenge_free(chal);
+	return (err);
+}
+
+errf_t *
+ebox_gen_challenge_bundle(struct ebox_part **parts, size_t nparts,
+    struct ebox_challenge **pchal, const char *descfmt, ...)
+{
+	struct ebox_challenge *chal;
+	struct ebox_challenge_ent *ent;
+	const struct piv_ecdh_box *kb0, *kb;
+	int rc = 0;
+	va_list ap;
+	size_t i;
+	errf_t *err = NULL;
+
+	if (nparts == 0 || nparts > EBOX_CHAL_BUNDLE_MAX) {
+		return (argerrf("nparts", "between 1 and "
+		    "EBOX_CHAL_BUNDLE_MAX", "%zu", nparts));
 	}
-	if (wrote >= sizeof (desc)) {
-		err = errf("LengthError", NULL, "description field is too "
-		    "long to fit in challenge");
-		goto out;
+
+	/*
+	 * The whole bundle is sealed to the device key of the first part, and
+	 * the keyboxes inside it are only sent with their ephemeral keys and
+	 * ciphertext, so they all have to match it.
+	 */
+	kb0 = parts[0]->ep_box;
+	VERIFY3S(kb0->pdb_pub->type, ==, KEY_ECDSA);
+	for (i = 1; i < nparts; ++i) {
+		kb = parts[i]->ep_box;
+		if (!sshkey_equal_public(kb->pdb_pub, kb0->pdb_pub) ||
+		    strcmp(kb->pdb_cipher, kb0->pdb_cipher) != 0 ||
+		    strcmp(kb->pdb_kdf, kb0->pdb_kdf) != 0) {
+			return (argerrf("parts", "parts all using the same "
+			    "device key, cipher and KDF", "part %zu "
+			    "differing from the first", i));
+		}
 	}
+
+	chal = calloc(1, sizeof (struct ebox_challenge));
+	if (chal == NULL)
+		return (ERRF_NOMEM);
+
+	chal->c_version = 2;
+	va_start(ap, descfmt);
+	err = ebox_challenge_init(chal, descfmt, ap);
 	va_end(ap);
-	chal->c_description = strdup(desc);
-	if (chal->c_description == NULL) {
+	if (err)
+		goto out;
+
+	chal->c_ents = calloc(nparts, sizeof (struct ebox_challenge_ent));
+	if (chal->c_ents == NULL) {
 		err = ERRF_NOMEM;
 		goto out;
 	}
+	for (i = 0; i < nparts; ++i) {
+		ent = &chal->c_ents[chal->c_nents];
+		ent->ce_keybox = piv_box_clone(parts[i]->ep_box);
+		if (ent->ce_keybox == NULL) {
+			err = ERRF_NOMEM;
+			goto out;
+		}
+		ent->ce_id = parts[i]->ep_id;
+		ent->ce_part = parts[i];
+		++chal->c_nents;
+	}
 
-	arc4random_buf(chal->c_words, sizeof (chal->c_words));
+	rc = piv_ephem_take(sshkey_size(kb0->pdb_pub), &chal->c_chalkey);
+	if (rc) {
+		err = ssherrf("piv_ephem_take", rc);
+		goto out;
+	}
+	if ((rc = sshkey_demote(chal->c_chalkey, &chal->c_destkey))) {
+		err = ssherrf("sshkey_demote", rc);
+		goto out;
+	}
 
-	part->ep_chal = chal;
+	*pchal = chal;
 	chal = NULL;
 
 out:
-	free(hostname);
 	ebox_challenge_free(chal);
 	return (err);
 }
 
+/* The parts of a keybox that aren't the same as the challenge's own box. */
 static errf_t *
-sshbuf_put_ebox_challenge_raw(struct sshbuf *buf,
-    const struct ebox_challenge *chal)
+sshbuf_put_chal_keybox(struct sshbuf *buf, const struct piv_ecdh_box *kb)
 {
-	int rc = 0;
-	const struct piv_ecdh_box *kb = chal->c_keybox;
 	const struct apdubuf *nonce = &kb->pdb_nonce;
 	const struct apdubuf *iv = &kb->pdb_iv;
 	const struct apdubuf *enc = &kb->pdb_enc;
+	int rc;
 
-	if ((rc = sshbuf_put_u8(buf, chal->c_version)) ||
-	    (rc = sshbuf_put_u8(buf, chal->c_type)) ||
-	    (rc = sshbuf_put_u8(buf, chal->c_id)))
-		return (ssherrf("sshbuf_put_u8", rc));
-	if ((rc = sshbuf_put_eckey8(buf, chal->c_destkey->ecdsa)))
-		return (ssherrf("sshbuf_put_eckey8", rc));
 	if ((rc = sshbuf_put_eckey8(buf, kb->pdb_ephem_pub->ecdsa)) ||
 	    (rc = sshbuf_put_string8(buf, nonce->b_data, nonce->b_len)) ||
 	    (rc = sshbuf_put_string8(buf, iv->b_data, iv->b_len)) ||
 	    (rc = sshbuf_put_string8(buf, enc->b_data, enc->b_len)))
 		return (ssherrf("sshbuf_put_*", rc));
+	return (ERRF_OK);
+}
+
+static errf_t *
+sshbuf_put_chal_tags(struct sshbuf *buf, const struct ebox_challenge *chal)
+{
+	int rc;
+
 	if ((rc = sshbuf_put_u8(buf, CTAG_HOSTNAME)) ||
 	    (rc = sshbuf_put_cstring8(buf, chal->c_hostname)) ||
 	    (rc = sshbuf_put_u8(buf, CTAG_CTIME)) ||
@@ -3077,18 +5337,54 @@ sshbuf_put_ebox_challenge_raw(struct sshbuf *buf,
 	    (rc = sshbuf_put_u8(buf, chal->c_words[2])) ||
 	    (rc = sshbuf_put_u8(buf, chal->c_words[3])))
 		return (ssherrf("sshbuf_put_*", rc));
-
 	return (ERRF_OK);
 }
 
+static errf_t *
+sshbuf_put_ebox_challenge_raw(struct sshbuf *buf,
+    const struct ebox_challenge *chal)
+{
+	int rc = 0;
+	size_t i;
+	errf_t *err;
+
+	if ((rc = sshbuf_put_u8(buf, chal->c_version)) ||
+	    (rc = sshbuf_put_u8(buf, chal->c_type)))
+		return (ssherrf("sshbuf_put_u8", rc));
+	if (chal->c_version == 1 && (rc = sshbuf_put_u8(buf, chal->c_id)))
+		return (ssherrf("sshbuf_put_u8", rc));
+	if ((rc = sshbuf_put_eckey8(buf, chal->c_destkey->ecdsa)))
+		return (ssherrf("sshbuf_put_eckey8", rc));
+	if (chal->c_version == 1) {
+		if ((err = sshbuf_put_chal_keybox(buf, chal->c_keybox)))
+			return (err);
+	} else {
+		if ((rc = sshbuf_put_u32(buf, chal->c_nents)))
+			return (ssherrf("sshbuf_put_u32", rc));
+		for (i = 0; i < chal->c_nents; ++i) {
+			if ((rc = sshbuf_put_u8(buf, chal->c_ents[i].ce_id)))
+				return (ssherrf("sshbuf_put_u8", rc));
+			err = sshbuf_put_chal_keybox(buf,
+			    chal->c_ents[i].ce_keybox);
+			if (err)
+				return (err);
+		}
+	}
+
+	return (sshbuf_put_chal_tags(buf, chal));
+}
+
 errf_t *
 sshbuf_put_ebox_challenge(struct sshbuf *buf, const struct ebox_challenge *chal)
 {
 	struct piv_ecdh_box *box;
 	struct sshbuf *cbuf;
-	struct piv_ecdh_box *kb = chal->c_keybox;
+	struct piv_ecdh_box *kb;
 	errf_t *err;
 
+	kb = (chal->c_version == 1) ? chal->c_keybox :
+	    chal->c_ents[0].ce_keybox;
+
 	box = piv_box_new();
 	VERIFY(box != NULL);
 
@@ -3117,49 +5413,18 @@ out:
 	return (err);
 }
 
-errf_t *
-sshbuf_get_ebox_challenge(struct piv_ecdh_box *box,
-    struct ebox_challenge **pchal)
+/* Reads an EC point on the same curve as the challenge box's key. */
+static errf_t *
+sshbuf_get_chal_eckey(struct sshbuf *buf, const struct piv_ecdh_box *box,
+    struct sshkey **pkey)
 {
-	int rc;
-	errf_t *err;
-	struct sshbuf *buf = NULL, *kbuf = NULL;
-	struct ebox_challenge *chal;
-	uint8_t type;
 	struct sshkey *k;
+	errf_t *err;
+	int rc;
 
-	VERIFY0(piv_box_take_datab(box, &buf));
-
-	chal = calloc(1, sizeof (struct ebox_challenge));
-	VERIFY(chal != NULL);
-
-	if ((rc = sshbuf_get_u8(buf, &chal->c_version))) {
-		err = ssherrf("sshbuf_get_u8", rc);
-		goto out;
-	}
-	if (chal->c_version != 1) {
-		err = chalverrf(errf("VersionError", NULL,
-		    "unsupported challenge version: v%d",
-		    (int)chal->c_version));
-		goto out;
-	}
-
-	if ((rc = sshbuf_get_u8(buf, &type))) {
-		err = ssherrf("sshbuf_get_u8", rc);
-		goto out;
-	}
-	chal->c_type = (enum ebox_chaltype)type;
-
-	if ((rc = sshbuf_get_u8(buf, &chal->c_id))) {
-		err = ssherrf("sshbuf_get_u8", rc);
-		goto out;
-	}
-
-	chal->c_destkey = (k = sshkey_new(KEY_ECDSA));
-	if (k == NULL) {
-		err = ERRF_NOMEM;
-		goto out;
-	}
+	k = sshkey_new(KEY_ECDSA);
+	if (k == NULL)
+		return (ERRF_NOMEM);
 	k->ecdsa_nid = box->pdb_pub->ecdsa_nid;
 	k->ecdsa = EC_KEY_new_by_curve_name(k->ecdsa_nid);
 	if (k->ecdsa == NULL) {
@@ -3175,78 +5440,91 @@ sshbuf_get_ebox_challenge(struct piv_ecdh_box *box,
 		err = ssherrf("sshkey_ec_validate_public", rc);
 		goto out;
 	}
+	*pkey = k;
+	k = NULL;
+	err = ERRF_OK;
 
-	chal->c_keybox = piv_box_new();
-	if (chal->c_keybox == NULL) {
-		err = ERRF_NOMEM;
-		goto out;
-	}
+out:
+	sshkey_free(k);
+	return (err);
+}
+
+/*
+ * Reads a keybox written by sshbuf_put_chal_keybox(), filling in the rest of
+ * it from the box the challenge came in.
+ */
+static errf_t *
+sshbuf_get_chal_keybox(struct sshbuf *buf, const struct piv_ecdh_box *box,
+    struct piv_ecdh_box **pkb)
+{
+	struct piv_ecdh_box *kb;
+	errf_t *err;
+	int rc;
+
+	kb = piv_box_new();
+	if (kb == NULL)
+		return (ERRF_NOMEM);
 
-	chal->c_keybox->pdb_guidslot_valid = box->pdb_guidslot_valid;
-	chal->c_keybox->pdb_slot = box->pdb_slot;
-	bcopy(box->pdb_guid, chal->c_keybox->pdb_guid, sizeof (box->pdb_guid));
+	kb->pdb_guidslot_valid = box->pdb_guidslot_valid;
+	kb->pdb_slot = box->pdb_slot;
+	bcopy(box->pdb_guid, kb->pdb_guid, sizeof (box->pdb_guid));
 
-	chal->c_keybox->pdb_cipher = strdup(box->pdb_cipher);
-	chal->c_keybox->pdb_kdf = strdup(box->pdb_kdf);
-	chal->c_keybox->pdb_free_str = B_TRUE;
-	if (chal->c_keybox->pdb_cipher == NULL ||
-	    chal->c_keybox->pdb_kdf == NULL) {
+	kb->pdb_cipher = strdup(box->pdb_cipher);
+	kb->pdb_kdf = strdup(box->pdb_kdf);
+	kb->pdb_free_str = B_TRUE;
+	if (kb->pdb_cipher == NULL || kb->pdb_kdf == NULL) {
 		err = ERRF_NOMEM;
 		goto out;
 	}
 
-	rc = sshkey_demote(box->pdb_pub, &chal->c_keybox->pdb_pub);
+	rc = sshkey_demote(box->pdb_pub, &kb->pdb_pub);
 	if (rc) {
 		err = ssherrf("sshkey_demote", rc);
 		goto out;
 	}
 
-	chal->c_keybox->pdb_ephem_pub = (k = sshkey_new(KEY_ECDSA));
-	if (k == NULL) {
-		err = ERRF_NOMEM;
-		goto out;
-	}
-	k->ecdsa_nid = box->pdb_pub->ecdsa_nid;
-	k->ecdsa = EC_KEY_new_by_curve_name(k->ecdsa_nid);
-	if (k->ecdsa == NULL) {
-		err = ERRF_NOMEM;
-		goto out;
-	}
-	if ((rc = sshbuf_get_eckey8(buf, k->ecdsa))) {
-		err = ssherrf("sshbuf_get_eckey8", rc);
-		goto out;
-	}
-	if ((rc = sshkey_ec_validate_public(EC_KEY_get0_group(k->ecdsa),
-	    EC_KEY_get0_public_key(k->ecdsa)))) {
-		err = ssherrf("sshkey_ec_validate_public", rc);
+	if ((err = sshbuf_get_chal_eckey(buf, box, &kb->pdb_ephem_pub)))
 		goto out;
-	}
 
-	if ((rc = sshbuf_get_string8(buf, &chal->c_keybox->pdb_nonce.b_data,
-	    &chal->c_keybox->pdb_nonce.b_size))) {
+	if ((rc = sshbuf_get_string8(buf, &kb->pdb_nonce.b_data,
+	    &kb->pdb_nonce.b_size))) {
 		err = ssherrf("sshbuf_get_string8", rc);
 		goto out;
 	}
-	chal->c_keybox->pdb_nonce.b_len = chal->c_keybox->pdb_nonce.b_size;
+	kb->pdb_nonce.b_len = kb->pdb_nonce.b_size;
 
-	if ((rc = sshbuf_get_string8(buf, &chal->c_keybox->pdb_iv.b_data,
-	    &chal->c_keybox->pdb_iv.b_size))) {
+	if ((rc = sshbuf_get_string8(buf, &kb->pdb_iv.b_data,
+	    &kb->pdb_iv.b_size))) {
 		err = ssherrf("sshbuf_get_string8", rc);
 		goto out;
 	}
-	chal->c_keybox->pdb_iv.b_len = chal->c_keybox->pdb_iv.b_size;
-	if ((rc = sshbuf_get_string8(buf, &chal->c_keybox->pdb_enc.b_data,
-	    &chal->c_keybox->pdb_enc.b_size))) {
+	kb->pdb_iv.b_len = kb->pdb_iv.b_size;
+	if ((rc = sshbuf_get_string8(buf, &kb->pdb_enc.b_data,
+	    &kb->pdb_enc.b_size))) {
 		err = ssherrf("sshbuf_get_string8", rc);
 		goto out;
 	}
-	chal->c_keybox->pdb_enc.b_len = chal->c_keybox->pdb_enc.b_size;
+	kb->pdb_enc.b_len = kb->pdb_enc.b_size;
+
+	*pkb = kb;
+	kb = NULL;
+	err = ERRF_OK;
+
+out:
+	piv_box_free(kb);
+	return (err);
+}
+
+static errf_t *
+sshbuf_get_chal_tags(struct sshbuf *buf, struct ebox_challenge *chal)
+{
+	struct sshbuf *kbuf;
+	errf_t *err = ERRF_OK;
+	int rc;
 
 	kbuf = sshbuf_new();
-	if (kbuf == NULL) {
-		err = ERRF_NOMEM;
-		goto out;
-	}
+	if (kbuf == NULL)
+		return (ERRF_NOMEM);
 
 	while (sshbuf_len(buf) > 0) {
 		uint8_t tag;
@@ -3295,13 +5573,96 @@ sshbuf_get_ebox_challenge(struct piv_ecdh_box *box,
 		}
 	}
 
+out:
+	sshbuf_free(kbuf);
+	return (err);
+}
+
+errf_t *
+sshbuf_get_ebox_challenge(struct piv_ecdh_box *box,
+    struct ebox_challenge **pchal)
+{
+	int rc;
+	errf_t *err;
+	struct sshbuf *buf = NULL;
+	struct ebox_challenge *chal;
+	struct ebox_challenge_ent *ent;
+	uint8_t type;
+	uint32_t nents;
+
+	VERIFY0(piv_box_take_datab(box, &buf));
+
+	chal = calloc(1, sizeof (struct ebox_challenge));
+	VERIFY(chal != NULL);
+
+	if ((rc = sshbuf_get_u8(buf, &chal->c_version))) {
+		err = ssherrf("sshbuf_get_u8", rc);
+		goto out;
+	}
+	if (chal->c_version != 1 && chal->c_version != 2) {
+		err = chalverrf(errf("VersionError", NULL,
+		    "unsupported challenge version: v%d",
+		    (int)chal->c_version));
+		goto out;
+	}
+
+	if ((rc = sshbuf_get_u8(buf, &type))) {
+		err = ssherrf("sshbuf_get_u8", rc);
+		goto out;
+	}
+	chal->c_type = (enum ebox_chaltype)type;
+
+	if (chal->c_version == 1 &&
+	    (rc = sshbuf_get_u8(buf, &chal->c_id))) {
+		err = ssherrf("sshbuf_get_u8", rc);
+		goto out;
+	}
+
+	if ((err = sshbuf_get_chal_eckey(buf, box, &chal->c_destkey)))
+		goto out;
+
+	if (chal->c_version == 1) {
+		err = sshbuf_get_chal_keybox(buf, box, &chal->c_keybox);
+		if (err)
+			goto out;
+	} else {
+		if ((rc = sshbuf_get_u32(buf, &nents))) {
+			err = ssherrf("sshbuf_get_u32", rc);
+			goto out;
+		}
+		if (nents == 0 || nents > EBOX_CHAL_BUNDLE_MAX) {
+			err = chalderrf(errf("LengthError", NULL, "challenge "
+			    "bundle has invalid number of parts: %u", nents));
+			goto out;
+		}
+		chal->c_ents = calloc(nents,
+		    sizeof (struct ebox_challenge_ent));
+		if (chal->c_ents == NULL) {
+			err = ERRF_NOMEM;
+			goto out;
+		}
+		for (; chal->c_nents < nents; ++chal->c_nents) {
+			ent = &chal->c_ents[chal->c_nents];
+			if ((rc = sshbuf_get_u8(buf, &ent->ce_id))) {
+				err = ssherrf("sshbuf_get_u8", rc);
+				goto out;
+			}
+			err = sshbuf_get_chal_keybox(buf, box,
+			    &ent->ce_keybox);
+			if (err)
+				goto out;
+		}
+	}
+
+	if ((err = sshbuf_get_chal_tags(buf, chal)))
+		goto out;
+
 	*pchal = chal;
 	chal = NULL;
 	err = NULL;
 
 out:
 	sshbuf_free(buf);
-	sshbuf_free(kbuf);
 	ebox_challenge_free(chal);
 	return (err);
 }
@@ -3352,7 +5713,144 @@ ebox_challenge_destkey(const struct ebox_challenge *chal)
 struct piv_ecdh_box *
 ebox_challenge_box(const struct ebox_challenge *chal)
 {
-	return (chal->c_keybox);
+	return (ebox_challenge_box_at(chal, 0));
+}
+
+boolean_t
+ebox_challenge_is_bundle(const struct ebox_challenge *chal)
+{
+	return (chal->c_version == 2);
+}
+
+size_t
+ebox_challenge_nboxes(const struct ebox_challenge *chal)
+{
+	if (chal->c_version == 1)
+		return (1);
+	return (chal->c_nents);
+}
+
+struct piv_ecdh_box *
+ebox_challenge_box_at(const struct ebox_challenge *chal, size_t i)
+{
+	if (chal->c_version == 1) {
+		VERIFY3U(i, ==, 0);
+		return (chal->c_keybox);
+	}
+	VERIFY3U(i, <, chal->c_nents);
+	return (chal->c_ents[i].ce_keybox);
+}
+
+/* Hands the keypiece for c_ents[idx] of a bundle over to its part. */
+static errf_t *
+ebox_challenge_bundle_take(struct ebox_challenge *chal, uint32_t idx,
+    boolean_t gotid, uint8_t id, uint8_t **keypiece, size_t klen,
+    struct ebox_part **parts, size_t *nparts)
+{
+	struct ebox_challenge_ent *ent;
+	struct ebox_part *part;
+
+	if (idx >= chal->c_nents || !gotid || *keypiece == NULL) {
+		return (errf("InvalidDataError", NULL, "Challenge bundle "
+		    "response entry was invalid or missing compulsory "
+		    "fields"));
+	}
+	ent = &chal->c_ents[idx];
+	if (ent->ce_taken || *nparts >= chal->c_nents) {
+		return (errf("InvalidDataError", NULL, "Challenge bundle "
+		    "response answers entry %u more than once", idx));
+	}
+	if (ent->ce_id != id) {
+		return (errf("InvalidDataError", NULL, "Challenge bundle "
+		    "response entry %u has ID %u, but the challenge was for "
+		    "ID %u", idx, (uint)id, (uint)ent->ce_id));
+	}
+	part = ent->ce_part;
+	freezero(part->ep_share, part->ep_sharelen);
+	part->ep_sharelen = klen;
+	part->ep_share = *keypiece;
+	*keypiece = NULL;
+	ent->ce_taken = B_TRUE;
+	parts[(*nparts)++] = part;
+	return (ERRF_OK);
+}
+
+errf_t *
+ebox_challenge_bundle_response(struct ebox_challenge *chal,
+    struct piv_ecdh_box *rbox, struct ebox_part **parts, size_t *nparts)
+{
+	int rc = 0;
+	struct sshbuf *buf = NULL;
+	boolean_t inent = B_FALSE, gotid = B_FALSE;
+	uint8_t tag, id = 0;
+	uint32_t idx = 0;
+	errf_t *err;
+	uint8_t *keypiece = NULL;
+	size_t klen = 0;
+	size_t i;
+
+	VERIFY3U(chal->c_version, ==, 2);
+	VERIFY(chal->c_chalkey != NULL);
+	*nparts = 0;
+	for (i = 0; i < chal->c_nents; ++i)
+		chal->c_ents[i].ce_taken = B_FALSE;
+
+	if ((err = piv_box_open_offline(chal->c_chalkey, rbox)))
+		goto out;
+	if ((err = piv_box_take_datab(rbox, &buf)))
+		goto out;
+
+	while (sshbuf_len(buf) > 0) {
+		if ((rc = sshbuf_get_u8(buf, &tag))) {
+			err = ssherrf("sshbuf_get_u8", rc);
+			goto out;
+		}
+		switch ((enum resptag)tag) {
+		case RTAG_INDEX:
+			if (inent && (err = ebox_challenge_bundle_take(chal,
+			    idx, gotid, id, &keypiece, klen, parts, nparts)))
+				goto out;
+			if ((rc = sshbuf_get_u32(buf, &idx))) {
+				err = ssherrf("sshbuf_get_u32", rc);
+				goto out;
+			}
+			inent = B_TRUE;
+			gotid = B_FALSE;
+			break;
+		case RTAG_ID:
+			if ((rc = sshbuf_get_u8(buf, &id))) {
+				err = ssherrf("sshbuf_get_u8", rc);
+				goto out;
+			}
+			gotid = B_TRUE;
+			break;
+		case RTAG_KEYPIECE:
+			freezero(keypiece, klen);
+			keypiece = NULL;
+			rc = sshbuf_get_string8_conceal(buf, &keypiece, &klen);
+			if (rc) {
+				err = ssherrf("sshbuf_get_string8", rc);
+				goto out;
+			}
+			break;
+		default:
+			/* For forwards compatibility, ignore unknown tags. */
+			break;
+		}
+	}
+	if (!inent) {
+		err = errf("InvalidDataError", NULL, "Challenge bundle "
+		    "response contained no parts");
+		goto out;
+	}
+	err = ebox_challenge_bundle_take(chal, idx, gotid, id, &keypiece,
+	    klen, parts, nparts);
+
+out:
+	freezero(keypiece, klen);
+	piv_box_free(rbox);
+	sshbuf_free(buf);
+	return (err);
 }
 
 errf_t *
@@ -3430,6 +5928,50 @@ out:
 	return (err);
 }
 
+/*
+ * Writes an entry for each keybox in a bundle which has been opened (the
+ * responder might not have been able to open them all).
+ */
+static errf_t *
+sshbuf_put_chal_bundle_response(struct sshbuf *buf,
+    const struct ebox_challenge *chal)
+{
+	const struct ebox_challenge_ent *ent;
+	uint8_t *keypiece = NULL;
+	size_t klen = 0, i, n = 0;
+	errf_t *err = ERRF_OK;
+	int rc;
+
+	for (i = 0; i < chal->c_nents; ++i) {
+		ent = &chal->c_ents[i];
+		if (ent->ce_keybox->pdb_plain.b_data == NULL)
+			continue;
+		if ((err = piv_box_take_data(ent->ce_keybox, &keypiece,
+		    &klen)))
+			goto out;
+		if ((rc = sshbuf_put_u8(buf, RTAG_INDEX)) ||
+		    (rc = sshbuf_put_u32(buf, i)) ||
+		    (rc = sshbuf_put_u8(buf, RTAG_ID)) ||
+		    (rc = sshbuf_put_u8(buf, ent->ce_id)) ||
+		    (rc = sshbuf_put_u8(buf, RTAG_KEYPIECE)) ||
+		    (rc = sshbuf_put_string8(buf, keypiece, klen))) {
+			err = ssherrf("sshbuf_put_*", rc);
+			goto out;
+		}
+		freezero(keypiece, klen);
+		keypiece = NULL;
+		++n;
+	}
+	if (n == 0) {
+		err = errf("InsufficientParts", NULL, "None of the parts in "
+		    "the challenge bundle have been unlocked");
+	}
+
+out:
+	freezero(keypiece, klen);
+	return (err);
+}
+
 errf_t *
 sshbuf_put_ebox_challenge_response(struct sshbuf *dbuf,
     const struct ebox_challenge *chal)
@@ -3445,6 +5987,12 @@ sshbuf_put_ebox_challenge_response(struct sshbuf *dbuf,
 	if (buf == NULL)
 		return (ERRF_NOMEM);
 
+	if (chal->c_version == 2) {
+		if ((err = sshbuf_put_chal_bundle_response(buf, chal)))
+			goto out;
+		goto seal;
+	}
+
 	if ((rc = sshbuf_put_u8(buf, RTAG_ID)) ||
 	    (rc = sshbuf_put_u8(buf, chal->c_id))) {
 		err = ssherrf("sshbuf_put_u8", rc);
@@ -3467,6 +6015,7 @@ sshbuf_put_ebox_challenge_response(struct sshbuf *dbuf,
 	freezero(keypiece, klen);
 	keypiece = NULL;
 
+seal:
 	box = piv_box_new();
 	if (box == NULL) {
 		err = ERRF_NOMEM;
@@ -3493,12 +6042,18 @@ out:
 void
 ebox_challenge_free(struct ebox_challenge *chal)
 {
+	size_t i;
+
 	if (chal == NULL)
 		return;
 	free(chal->c_description);
 	free(chal->c_hostname);
 	sshkey_free(chal->c_destkey);
 	piv_box_free(chal->c_keybox);
+	for (i = 0; i < chal->c_nents; ++i)
+		piv_box_free(chal->c_ents[i].ce_keybox);
+	free(chal->c_ents);
+	sshkey_free(chal->c_chalkey);
 	explicit_bzero(chal->c_words, sizeof (chal->c_words));
 	free(chal);
 }
@@ -146,11 +146,19 @@ errf_t *sshbuf_put_ebox_tpl(struct sshbuf *buf, struct ebox_tpl *tpl);
 /*
  * Creates a new ebox based on a given template, sealing up the provided key
  * and (optional) recovery token.
+ *
+ * Templates with several parts have them sealed on up to
+ * ebox_set_seal_threads() threads at once (by default, one per CPU, at most
+ * EBOX_SEAL_MAX_THREADS). Callers which are already running ebox_create() on
+ * several threads of their own may want to set this to 1.
  */
 MUST_CHECK
 errf_t *ebox_create(const struct ebox_tpl *tpl, const uint8_t *key,
     size_t keylen, const uint8_t *rtoken, size_t rtokenlen,
     struct ebox **pebox);
+#define	EBOX_SEAL_MAX_THREADS	8
+/* 0 = choose automatically (the default) */
+void ebox_set_seal_threads(uint n);
 void ebox_free(struct ebox *box);
 
 uint ebox_version(const struct ebox *ebox);
@@ -201,6 +209,31 @@ errf_t *sshbuf_get_ebox(struct sshbuf *buf, struct ebox **box);
 MUST_CHECK
 errf_t *sshbuf_put_ebox(struct sshbuf *buf, struct ebox *box);
 
+/*
+ * Like sshbuf_get_ebox(), but leaves the configs and parts of the ebox
+ * encoded until they're needed. Newer eboxes (version 4 onwards) have an
+ * index which lets us skip over them; older ones are loaded in full.
+ *
+ * The configs of a lazy ebox have only their type, N and M set (in their
+ * ebox_config_tpl()) and no parts, until ebox_config_load() is called on
+ * them. After that their parts are there too, but only have a GUID and slot
+ * in their ebox_part_tpl() and no ebox_part_box(), until ebox_part_load().
+ * ebox_load() does all of this for the whole ebox, after which it's the same
+ * as one from sshbuf_get_ebox() (including its ebox_tpl()).
+ *
+ * The _load() functions do nothing if the thing is already loaded.
+ * sshbuf_put_ebox() works on a lazy ebox, and copies out anything not yet
+ * loaded as-is.
+ */
+MUST_CHECK
+errf_t *sshbuf_get_ebox_lazy(struct sshbuf *buf, struct ebox **box);
+MUST_CHECK
+errf_t *ebox_config_load(struct ebox *box, struct ebox_config *config);
+MUST_CHECK
+errf_t *ebox_part_load(struct ebox *box, struct ebox_part *part);
+MUST_CHECK
+errf_t *ebox_load(struct ebox *box);
+
 /*
  * Unlock an ebox using a primary config.
  *
@@ -228,6 +261,23 @@ errf_t *ebox_unlock(struct ebox *ebox, struct ebox_config *config);
 MUST_CHECK
 errf_t *ebox_recover(struct ebox *ebox, struct ebox_config *config);
 
+/*
+ * Recover many eboxes at once: equivalent to calling ebox_recover() on each
+ * eboxes[i] with configs[i], except that the secret-sharing step for boxes
+ * with the same N is done in bulk, which is considerably faster when there
+ * are a lot of them (e.g. re-keying after a rotation).
+ *
+ * errs[i] receives the result for each box (NULL on success). The return
+ * value is ERRF_OK if every box was recovered.
+ *
+ * Errors:
+ *  - RecoveryFailed: one or more of the eboxes could not be recovered (see
+ *                    errs[] for the reason)
+ */
+MUST_CHECK
+errf_t *ebox_recover_batch(struct ebox **eboxes, struct ebox_config **configs,
+    size_t count, errf_t **errs);
+
 /*
  * These functions allow an opaque "private" data pointer to be stashed on
  * a struct ebox_*, which can be freely used by client applications. This is
@@ -258,6 +308,29 @@ errf_t *ebox_gen_challenge(struct ebox_config *config, struct ebox_part *part,
     const char *descfmt, ...);
 const struct ebox_challenge *ebox_part_challenge(const struct ebox_part *part);
 
+/*
+ * Generate a challenge bundle covering many parts at once (typically the
+ * parts belonging to one recovery participant across a lot of eboxes), so
+ * that they can all be answered with one response.
+ *
+ * All of the parts must be for the same device key (and use the same cipher
+ * and KDF). The bundle uses one ephemeral key of its own rather than the
+ * configs' keys, so responses to it must be given to
+ * ebox_challenge_bundle_response() rather than ebox_challenge_response().
+ *
+ * The caller owns the returned challenge and must keep it (and the parts)
+ * around until the response comes back. It's serialised the same way as a
+ * single challenge, with sshbuf_put_ebox_challenge().
+ *
+ * Errors:
+ *  - ArgumentError: the parts aren't all for the same device key, or there
+ *                   are too many (or none)
+ *  - LengthError: description was too long for available space
+ */
+MUST_CHECK
+errf_t *ebox_gen_challenge_bundle(struct ebox_part **parts, size_t nparts,
+    struct ebox_challenge **chal, const char *descfmt, ...);
+
 void ebox_challenge_free(struct ebox_challenge *chal);
 
 /*
@@ -295,6 +368,19 @@ struct sshkey *ebox_challenge_destkey(const struct ebox_challenge *chal);
  */
 struct piv_ecdh_box *ebox_challenge_box(const struct ebox_challenge *chal);
 
+/*
+ * A challenge bundle has a keybox for each of its parts rather than just one
+ * (and ebox_challenge_id() means nothing for it). ebox_challenge_box() is the
+ * same as ebox_challenge_box_at(chal, 0).
+ *
+ * sshbuf_put_ebox_challenge_response() on a bundle answers for every keybox
+ * in it which has been opened, and needs at least one.
+ */
+boolean_t ebox_challenge_is_bundle(const struct ebox_challenge *chal);
+size_t ebox_challenge_nboxes(const struct ebox_challenge *chal);
+struct piv_ecdh_box *ebox_challenge_box_at(const struct ebox_challenge *chal,
+    size_t i);
+
 
 /*
  * Generate and serialise a response to an ebox challenge inside a piv_ecdh_box
@@ -320,10 +406,31 @@ MUST_CHECK
 errf_t *ebox_challenge_response(struct ebox_config *config,
     struct piv_ecdh_box *respbox, struct ebox_part **ppart);
 
+/*
+ * Process an incoming response to a challenge bundle from
+ * ebox_gen_challenge_bundle(), setting up each part it answers for as
+ * ebox_challenge_response() would.
+ *
+ * The parts answered for are written to parts[] (which must have room for
+ * ebox_challenge_nboxes(chal) of them) and *nparts set to how many there
+ * were. Takes ownership of respbox, and will free it.
+ */
+MUST_CHECK
+errf_t *ebox_challenge_bundle_response(struct ebox_challenge *chal,
+    struct piv_ecdh_box *respbox, struct ebox_part **parts, size_t *nparts);
+
 MUST_CHECK
 errf_t *sshbuf_get_ebox_stream(struct sshbuf *buf, struct ebox_stream **str);
 MUST_CHECK
 errf_t *sshbuf_put_ebox_stream(struct sshbuf *buf, struct ebox_stream *str);
+/*
+ * Writes only the part of the stream header after its ebox (the chunk size,
+ * flags and algorithm names). Rewriting these in place in an existing stream
+ * (e.g. after ebox_stream_set_appended()) doesn't change their size.
+ */
+MUST_CHECK
+errf_t *sshbuf_put_ebox_stream_params(struct sshbuf *buf,
+    const struct ebox_stream *str);
 MUST_CHECK
 errf_t *sshbuf_get_ebox_stream_chunk(struct sshbuf *buf,
     const struct ebox_stream *stream, struct ebox_stream_chunk **chunk);
@@ -331,24 +438,202 @@ MUST_CHECK
 errf_t *sshbuf_put_ebox_stream_chunk(struct sshbuf *buf,
     struct ebox_stream_chunk *chunk);
 
+/*
+ * Like sshbuf_get_ebox_stream_chunk(), but the chunk does not take a copy of
+ * the ciphertext: it points directly into the buffer's memory instead. The
+ * memory backing buf must not be changed or freed until the chunk has been
+ * freed (it's fine to free the struct sshbuf itself if it was made with
+ * sshbuf_from()).
+ */
+MUST_CHECK
+errf_t *sshbuf_get_ebox_stream_chunk_ref(struct sshbuf *buf,
+    const struct ebox_stream *stream, struct ebox_stream_chunk **chunk);
+
+/*
+ * Parses the next chunk in buf into an existing chunk, replacing whatever
+ * it held before. Like sshbuf_get_ebox_stream_chunk_ref(), the ciphertext
+ * is borrowed from buf rather than copied.
+ *
+ * Recycling chunks this way (or with ebox_stream_chunk_reset() when
+ * encrypting) keeps their buffers and cipher/MAC contexts around, so they
+ * aren't set up again for every chunk. A chunk must only be used by one
+ * thread at a time.
+ */
+MUST_CHECK
+errf_t *sshbuf_get_ebox_stream_chunk_into(struct sshbuf *buf,
+    struct ebox_stream_chunk *chunk);
+
 struct ebox *ebox_stream_ebox(const struct ebox_stream *str);
 const char *ebox_stream_cipher(const struct ebox_stream *str);
 const char *ebox_stream_mac(const struct ebox_stream *str);
+/* Returns NULL if the stream is not compressed. */
+const char *ebox_stream_compression(const struct ebox_stream *str);
 size_t ebox_stream_chunk_size(const struct ebox_stream *str);
+/*
+ * Returns the byte offset (from the end of the stream header) at which the
+ * chunk containing plaintext byte "offset" begins.
+ *
+ * Compressed streams have chunks of varying size on the wire, so this is
+ * only a guess for those (you'll have to walk the chunk frames from the
+ * start instead, though the chunk for an offset is still offset divided by
+ * the chunk size).
+ */
 size_t ebox_stream_seek_offset(const struct ebox_stream *str, size_t offset);
 
 MUST_CHECK
 errf_t *ebox_stream_new(const struct ebox_tpl *tpl, struct ebox_stream **str);
+/*
+ * Like ebox_stream_new(), but with a choice of cipher: one of the aes*-ctr,
+ * aes*-gcm or "chacha20-poly1305" (anything else is an ArgumentError).
+ * Authenticated ciphers make an AEAD stream, which uses the cipher's tag in
+ * place of a separate HMAC and doesn't pad its chunks. These can't be read by
+ * older versions of pivy.
+ */
+MUST_CHECK
+errf_t *ebox_stream_new_cipher(const struct ebox_tpl *tpl, const char *cipher,
+    struct ebox_stream **str);
+/*
+ * Sets the amount of plaintext in each chunk of a new stream (the default is
+ * 128KiB). Must be called before the stream header is written out.
+ */
+MUST_CHECK
+errf_t *ebox_stream_set_chunk_size(struct ebox_stream *str, size_t size);
+/*
+ * Compresses each chunk of a new stream before it is encrypted. The only
+ * codec supported is "zlib" ("none" or NULL turns compression off again).
+ * Compressed streams can't be read by older versions of pivy. Must be called
+ * before the stream header is written out.
+ */
+MUST_CHECK
+errf_t *ebox_stream_set_compression(struct ebox_stream *str,
+    const char *codec);
 MUST_CHECK
 errf_t *ebox_stream_chunk_new(const struct ebox_stream *str, const void *data,
     size_t size, size_t seqnr, struct ebox_stream_chunk **chunk);
+/* Replaces a chunk's plaintext, as if it had come from _chunk_new(). */
+MUST_CHECK
+errf_t *ebox_stream_chunk_reset(struct ebox_stream_chunk *chunk,
+    const void *data, size_t size, size_t seqnr);
 
 MUST_CHECK
 errf_t *ebox_stream_decrypt_chunk(struct ebox_stream_chunk *chunk);
 MUST_CHECK
 errf_t *ebox_stream_encrypt_chunk(struct ebox_stream_chunk *chunk);
+/*
+ * Encrypt or decrypt n chunks of the same stream, setting errs[i] to the
+ * result for chunks[i]. On streams with an HMAC this can do the MACs of
+ * several chunks at once (see ssh_digest_hmac_multi()), which is worth it
+ * for batches of up to ebox_stream_batch_size() chunks (1 means there's
+ * nothing to gain over doing them one at a time).
+ */
+uint ebox_stream_batch_size(const struct ebox_stream *str);
+void ebox_stream_encrypt_chunks(struct ebox_stream_chunk **chunks, size_t n,
+    errf_t **errs);
+void ebox_stream_decrypt_chunks(struct ebox_stream_chunk **chunks, size_t n,
+    errf_t **errs);
 const uint8_t *ebox_stream_chunk_data(const struct ebox_stream_chunk *chunk,
     size_t *size);
+/*
+ * The ciphertext of an encrypted chunk, for writing out without the copy
+ * that sshbuf_put_ebox_stream_chunk() makes. On the wire it's preceded by the
+ * chunk's u32 seqnr and its u32 length.
+ */
+const uint8_t *ebox_stream_chunk_ciphertext(
+    const struct ebox_stream_chunk *chunk, size_t *size);
+
+/*
+ * Stream trailers. A stream with a trailer ends with one extra chunk (with
+ * the top bit of its seqnr set) which authenticates the number of chunks, the total plaintext
+ * length and a Merkle tree root over the chunks' tags, so that readers can
+ * tell a complete stream from a truncated one.
+ *
+ * Writers turn it on with ebox_stream_set_trailer() before writing the
+ * header, give each chunk to ebox_stream_add_chunk() (in seqnr order) after
+ * encrypting it, and finish with the chunk from ebox_stream_trailer_chunk().
+ *
+ * Readers check ebox_stream_chunk_is_trailer() on each chunk they decrypt:
+ * ebox_stream_read_trailer() takes in the (decrypted) trailer. Reading the
+ * whole stream, add each data chunk with ebox_stream_add_chunk() and then
+ * call ebox_stream_verify_trailer() at the end. Reading only part of it,
+ * read the trailer first (it's the last ebox_stream_trailer_size() bytes,
+ * unless ebox_stream_appending()) and check each chunk with
+ * ebox_stream_check_chunk() instead.
+ *
+ * Appending to a stream, read its trailer, give the tag from the end of each
+ * existing chunk's ciphertext (the last ebox_stream_tag_size() bytes) to
+ * ebox_stream_add_tag() and then call ebox_stream_resume(), which checks
+ * them against the trailer. New chunks and a new trailer follow as usual,
+ * after the old trailer (see ebox_stream_set_appending()).
+ */
+MUST_CHECK
+errf_t *ebox_stream_set_trailer(struct ebox_stream *str, boolean_t enable);
+boolean_t ebox_stream_has_trailer(const struct ebox_stream *str);
+boolean_t ebox_stream_chunk_is_trailer(const struct ebox_stream_chunk *chunk);
+/* For telling the trailer's frame apart from the others before parsing it. */
+boolean_t ebox_stream_is_trailer_seqnr(const struct ebox_stream *str,
+    uint32_t seqnr);
+/* Size on the wire of the trailer's frame, including seqnr and length. */
+size_t ebox_stream_trailer_size(const struct ebox_stream *str);
+/*
+ * An append kills the trailer it replaces by setting its frame's seqnr to
+ * EBOX_STREAM_DEAD_SEQ, which no real chunk uses. Readers skip dead frames.
+ */
+#define	EBOX_STREAM_DEAD_SEQ	0
+boolean_t ebox_stream_is_dead_seqnr(const struct ebox_stream *str,
+    uint32_t seqnr);
+MUST_CHECK
+errf_t *ebox_stream_add_chunk(struct ebox_stream *str,
+    const struct ebox_stream_chunk *chunk);
+size_t ebox_stream_tag_size(const struct ebox_stream *str);
+MUST_CHECK
+errf_t *ebox_stream_add_tag(struct ebox_stream *str, uint32_t seqnr,
+    const uint8_t *tag, size_t taglen, size_t plainlen);
+/*
+ * Checks the tags added so far against the trailer that's been read, and
+ * carries on from its plaintext length.
+ */
+MUST_CHECK
+errf_t *ebox_stream_resume(struct ebox_stream *str);
+/* Makes the encrypted trailer for all the chunks added so far. */
+MUST_CHECK
+errf_t *ebox_stream_trailer_chunk(struct ebox_stream *str,
+    struct ebox_stream_chunk **chunk);
+MUST_CHECK
+errf_t *ebox_stream_read_trailer(struct ebox_stream *str,
+    const struct ebox_stream_chunk *chunk);
+/* The chunk count and plaintext length from the trailer. */
+MUST_CHECK
+errf_t *ebox_stream_trailer_info(const struct ebox_stream *str,
+    uint64_t *nchunks, uint64_t *plainlen);
+/*
+ * Checks that a decrypted data chunk is within the stream according to its
+ * trailer, and has the length it should for its position. Does nothing if
+ * the trailer hasn't been read.
+ */
+MUST_CHECK
+errf_t *ebox_stream_check_chunk(const struct ebox_stream *str,
+    const struct ebox_stream_chunk *chunk);
+/* Checks the chunks added with ebox_stream_add_chunk() against the trailer */
+MUST_CHECK
+errf_t *ebox_stream_verify_trailer(const struct ebox_stream *str);
+
+/*
+ * Appended streams have had chunks added after a short last chunk, so their
+ * chunks can't be found by plaintext offset (ebox_stream_seek_offset()).
+ * Setting the flag changes the stream header, which must then be written
+ * out again (see sshbuf_put_ebox_stream_params()).
+ */
+boolean_t ebox_stream_appended(const struct ebox_stream *str);
+void ebox_stream_set_appended(struct ebox_stream *str);
+
+/*
+ * Set in the header while an append is in progress. Until it's cleared, the
+ * stream ends at the first trailer that isn't dead, and anything after that
+ * is left over from the append and must be ignored. Like the appended flag,
+ * it's written out with sshbuf_put_ebox_stream_params().
+ */
+boolean_t ebox_stream_appending(const struct ebox_stream *str);
+void ebox_stream_set_appending(struct ebox_stream *str, boolean_t appending);
 
 void ebox_stream_free(struct ebox_stream *str);
 void ebox_stream_chunk_free(struct ebox_stream_chunk *chunk);
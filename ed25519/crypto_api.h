@@ -41,6 +41,9 @@ int	crypto_sign_ed25519(unsigned char *, unsigned long long *,
     const unsigned char *, unsigned long long, const unsigned char *);
 int	crypto_sign_ed25519_open(unsigned char *, unsigned long long *,
     const unsigned char *, unsigned long long, const unsigned char *);
+int	crypto_sign_ed25519_open_batch(const unsigned char * const *,
+    const unsigned long long *, const unsigned char * const *,
+    unsigned long long, int *);
 int	crypto_sign_ed25519_keypair(unsigned char *, unsigned char *);
 
 #endif /* crypto_api_h */
@@ -99,34 +99,47 @@ int crypto_sign_ed25519(
   return 0;
 }
 
-int crypto_sign_ed25519_open(
-    unsigned char *m,unsigned long long *mlen,
-    const unsigned char *sm,unsigned long long smlen,
-    const unsigned char *pk
-    )
+/*
+ * Checks the signature at the front of sm against pk, using playground (which
+ * must be smlen bytes) to hash in.
+ * return 0 if it's good, -1 otherwise
+ */
+static int verify_one(const unsigned char *sm, unsigned long long smlen, const unsigned char *pk, unsigned char *playground)
 {
-  unsigned int i;
-  int ret;
   unsigned char t2[32];
   ge25519 get1, get2;
   sc25519 schram, scs;
   unsigned char hram[crypto_hash_sha512_BYTES];
 
-  *mlen = (unsigned long long) -1;
   if (smlen < 64) return -1;
 
   if (ge25519_unpackneg_vartime(&get1, pk)) return -1;
 
-  get_hram(hram,sm,pk,m,smlen);
+  get_hram(hram,sm,pk,playground,smlen);
 
   sc25519_from64bytes(&schram, hram);
 
   sc25519_from32bytes(&scs, sm+32);
 
-  ge25519_double_scalarmult_vartime(&get2, &get1, &schram, &ge25519_base, &scs);
+  ge25519_double_scalarmult_base_vartime(&get2, &get1, &schram, &scs);
   ge25519_pack(t2, &get2);
 
-  ret = crypto_verify_32(sm, t2);
+  return crypto_verify_32(sm, t2);
+}
+
+int crypto_sign_ed25519_open(
+    unsigned char *m,unsigned long long *mlen,
+    const unsigned char *sm,unsigned long long smlen,
+    const unsigned char *pk
+    )
+{
+  unsigned int i;
+  int ret;
+
+  *mlen = (unsigned long long) -1;
+  if (smlen < 64) return -1;
+
+  ret = verify_one(sm, smlen, pk, m);
 
   if (!ret)
   {
@@ -142,6 +155,153 @@ int crypto_sign_ed25519_open(
   return ret;
 }
 
+/*
+ * Is p the encoding ge25519_pack() would give the point it decodes to? (y
+ * reduced mod 2^255-19, and no sign bit on x = 0)
+ */
+static int canonical_vartime(const unsigned char p[32])
+{
+  int i;
+
+  if ((p[31] & 0x7f) == 0x7f && p[0] >= 0xec)
+  {
+    for (i = 1;i < 31;++i)
+      if (p[i] != 0xff) break;
+    if (i == 31)
+    {
+      if (p[0] > 0xec) return 0; /* y >= p */
+      if (p[31] & 0x80) return 0; /* y = -1, so x = 0 */
+    }
+  }
+  if ((p[31] & 0x80) && p[0] == 0x01)
+  {
+    for (i = 1;i < 31;++i)
+      if (p[i] != 0) break;
+    if (i == 31 && (p[31] & 0x7f) == 0) return 0; /* y = 1, so x = 0 */
+  }
+  return 1;
+}
+
+#define ED25519_BATCH_MAX 64
+
+/*
+ * Checks up to ED25519_BATCH_MAX signatures at once: with a random 128-bit
+ * z[i] for each, they're all good if
+ *
+ *   [8]([sum z[i]*s[i]]B - sum [z[i]*h[i]]A[i] - sum [z[i]]R[i]) = 0
+ *
+ * which is one multi-scalar multiplication. Any that won't decode are marked
+ * bad up front and left out.
+ * return 0 if all the rest were good, 1 if not, and -1 on allocation failure
+ */
+static int open_batch_chunk(const unsigned char * const *sm, const unsigned long long *smlen, const unsigned char * const *pk, unsigned long long n, int *valid, unsigned char *playground)
+{
+  ge25519 *pts, r;
+  sc25519 *scs, z, t;
+  unsigned char zb[32], hram[crypto_hash_sha512_BYTES];
+  unsigned long long i, np = 1;
+  int ret;
+
+  pts = calloc(2 * n + 1, sizeof (ge25519));
+  scs = calloc(2 * n + 1, sizeof (sc25519));
+  if (pts == NULL || scs == NULL)
+  {
+    free(pts);
+    free(scs);
+    return -1;
+  }
+
+  /* pts[0] is B, and the rest go in pairs of -A[i], -R[i] */
+  pts[0] = ge25519_base;
+  for (i = 0;i < 32;++i) zb[i] = 0;
+
+  for (i = 0;i < n;++i)
+  {
+    valid[i] = 0;
+    if (smlen[i] < 64) continue;
+    if (!canonical_vartime(sm[i])) continue;
+    if (ge25519_unpackneg_vartime(&pts[np], pk[i])) continue;
+    if (ge25519_unpackneg_vartime(&pts[np + 1], sm[i])) continue;
+    valid[i] = 1;
+
+    randombytes(zb, 16);
+    zb[15] |= 0x80; /* never zero */
+    sc25519_from32bytes(&z, zb);
+
+    get_hram(hram, sm[i], pk[i], playground, smlen[i]);
+    sc25519_from64bytes(&t, hram);
+    sc25519_mul(&scs[np], &z, &t);
+    scs[np + 1] = z;
+
+    sc25519_from32bytes(&t, sm[i] + 32);
+    sc25519_mul(&t, &z, &t);
+    sc25519_add(&scs[0], &scs[0], &t);
+    np += 2;
+  }
+
+  ret = ge25519_multi_scalarmult_vartime(&r, pts, scs, np);
+  if (ret == 0)
+  {
+    ge25519_double(&r, &r);
+    ge25519_double(&r, &r);
+    ge25519_double(&r, &r);
+    ret = ge25519_isneutral_vartime(&r) ? 0 : 1;
+  }
+
+  free(pts);
+  free(scs);
+  return ret;
+}
+
+/*
+ * Checks n signatures, each at the front of sm[i] (as for
+ * crypto_sign_ed25519_open) against pk[i], setting valid[i] to 1 or 0.
+ *
+ * They're checked in batches, and a batch that fails as a whole (or that we
+ * can't allocate the tables for) is gone through one at a time to find the
+ * bad ones. The batch equation is the
+ * cofactored one, so a batch can pass with a signature in it which has been
+ * given a small-order component, that crypto_sign_ed25519_open() would turn
+ * down. Nobody without the private key can make one of those, though.
+ *
+ * return 0 if all of them were good, -1 otherwise (including if we couldn't
+ * allocate any memory at all, in which case valid[] is all 0)
+ */
+int crypto_sign_ed25519_open_batch(
+    const unsigned char * const *sm,const unsigned long long *smlen,
+    const unsigned char * const *pk,unsigned long long n,
+    int *valid
+    )
+{
+  unsigned char *playground;
+  unsigned long long i, j, c, maxlen = 0;
+  int ret = 0, r;
+
+  for (i = 0;i < n;++i)
+  {
+    valid[i] = 0;
+    if (smlen[i] > maxlen) maxlen = smlen[i];
+  }
+  if (n == 0) return 0;
+  if ((playground = malloc(maxlen > 0 ? maxlen : 1)) == NULL) return -1;
+
+  for (i = 0;i < n;i += c)
+  {
+    c = n - i;
+    if (c > ED25519_BATCH_MAX) c = ED25519_BATCH_MAX;
+    r = open_batch_chunk(sm + i, smlen + i, pk + i, c, valid + i, playground);
+    for (j = i;j < i + c;++j)
+    {
+      if (r == -1 || (r == 1 && valid[j]))
+        valid[j] = (verify_one(sm[j], smlen[j], pk[j], playground) == 0);
+      if (!valid[j]) ret = -1;
+    }
+  }
+
+  free(playground);
+  return ret;
+}
+
 /* $OpenBSD: verify.c,v 1.3 2013/12/09 11:03:45 markus Exp $ */
 
 /*
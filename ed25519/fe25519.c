@@ -7,11 +7,209 @@
  */
 
 
-#define WINDOWSIZE 1 /* Should be 1,2, or 4 */
-#define WINDOWMASK ((1<<WINDOWSIZE)-1)
+#include <string.h>
 
 #include "fe25519.h"
 
+#if defined(ED25519_FE51)
+
+/*
+ * 51-bit limb backend, along the lines of curve25519-donna-c64 and the
+ * amd64-51 code in SUPERCOP. Limbs are kept loosely reduced (a little
+ * over 51 bits) between operations; fe25519_freeze() makes them canonical.
+ */
+
+typedef unsigned __int128 uint128_t;
+
+#define MASK51 0x7ffffffffffffULL
+
+static uint64_t load64(const unsigned char *p)
+{
+  uint64_t r = 0;
+  int i;
+  for(i=7;i>=0;i--) r = (r << 8) | p[i];
+  return r;
+}
+
+static void store64(unsigned char *p, uint64_t v)
+{
+  int i;
+  for(i=0;i<8;i++) { p[i] = v & 0xff; v >>= 8; }
+}
+
+static void carry(fe25519 *r)
+{
+  uint64_t c;
+  c = r->v[0] >> 51; r->v[0] &= MASK51; r->v[1] += c;
+  c = r->v[1] >> 51; r->v[1] &= MASK51; r->v[2] += c;
+  c = r->v[2] >> 51; r->v[2] &= MASK51; r->v[3] += c;
+  c = r->v[3] >> 51; r->v[3] &= MASK51; r->v[4] += c;
+  c = r->v[4] >> 51; r->v[4] &= MASK51; r->v[0] += c * 19;
+}
+
+/* reduction modulo 2^255-19 */
+void fe25519_freeze(fe25519 *r)
+{
+  uint64_t q;
+
+  carry(r);
+  carry(r);
+  /* now r < 2^255 + small; subtract p if r >= p */
+  q = (r->v[0] + 19) >> 51;
+  q = (r->v[1] + q) >> 51;
+  q = (r->v[2] + q) >> 51;
+  q = (r->v[3] + q) >> 51;
+  q = (r->v[4] + q) >> 51;
+
+  r->v[0] += 19 * q;
+  q = r->v[0] >> 51; r->v[0] &= MASK51; r->v[1] += q;
+  q = r->v[1] >> 51; r->v[1] &= MASK51; r->v[2] += q;
+  q = r->v[2] >> 51; r->v[2] &= MASK51; r->v[3] += q;
+  q = r->v[3] >> 51; r->v[3] &= MASK51; r->v[4] += q;
+  r->v[4] &= MASK51;
+}
+
+void fe25519_unpack(fe25519 *r, const unsigned char x[32])
+{
+  r->v[0] = load64(x) & MASK51;
+  r->v[1] = (load64(x + 6) >> 3) & MASK51;
+  r->v[2] = (load64(x + 12) >> 6) & MASK51;
+  r->v[3] = (load64(x + 19) >> 1) & MASK51;
+  r->v[4] = (load64(x + 24) >> 12) & MASK51;
+}
+
+void fe25519_pack(unsigned char r[32], const fe25519 *x)
+{
+  fe25519 y = *x;
+  fe25519_freeze(&y);
+  store64(r, y.v[0] | (y.v[1] << 51));
+  store64(r + 8, (y.v[1] >> 13) | (y.v[2] << 38));
+  store64(r + 16, (y.v[2] >> 26) | (y.v[3] << 25));
+  store64(r + 24, (y.v[3] >> 39) | (y.v[4] << 12));
+}
+
+int fe25519_iszero(const fe25519 *x)
+{
+  fe25519 t = *x;
+  fe25519_freeze(&t);
+  return ((t.v[0] | t.v[1] | t.v[2] | t.v[3] | t.v[4]) == 0);
+}
+
+int fe25519_iseq_vartime(const fe25519 *x, const fe25519 *y)
+{
+  fe25519 t1 = *x;
+  fe25519 t2 = *y;
+  fe25519_freeze(&t1);
+  fe25519_freeze(&t2);
+  return (memcmp(t1.v, t2.v, sizeof (t1.v)) == 0);
+}
+
+void fe25519_cmov(fe25519 *r, const fe25519 *x, unsigned char b)
+{
+  int i;
+  uint64_t mask = b;
+  mask = -mask;
+  for(i=0;i<5;i++) r->v[i] ^= mask & (x->v[i] ^ r->v[i]);
+}
+
+unsigned char fe25519_getparity(const fe25519 *x)
+{
+  fe25519 t = *x;
+  fe25519_freeze(&t);
+  return t.v[0] & 1;
+}
+
+void fe25519_setone(fe25519 *r)
+{
+  r->v[0] = 1;
+  r->v[1] = r->v[2] = r->v[3] = r->v[4] = 0;
+}
+
+void fe25519_setzero(fe25519 *r)
+{
+  r->v[0] = r->v[1] = r->v[2] = r->v[3] = r->v[4] = 0;
+}
+
+void fe25519_neg(fe25519 *r, const fe25519 *x)
+{
+  fe25519 t;
+  fe25519_setzero(&t);
+  fe25519_sub(r, &t, x);
+}
+
+void fe25519_add(fe25519 *r, const fe25519 *x, const fe25519 *y)
+{
+  int i;
+  for(i=0;i<5;i++) r->v[i] = x->v[i] + y->v[i];
+  carry(r);
+}
+
+void fe25519_sub(fe25519 *r, const fe25519 *x, const fe25519 *y)
+{
+  /* add 4p first so that nothing goes negative */
+  r->v[0] = (x->v[0] + 0x1fffffffffffb4ULL) - y->v[0];
+  r->v[1] = (x->v[1] + 0x1ffffffffffffcULL) - y->v[1];
+  r->v[2] = (x->v[2] + 0x1ffffffffffffcULL) - y->v[2];
+  r->v[3] = (x->v[3] + 0x1ffffffffffffcULL) - y->v[3];
+  r->v[4] = (x->v[4] + 0x1ffffffffffffcULL) - y->v[4];
+  carry(r);
+}
+
+static void reduce_wide(fe25519 *r, uint128_t t[5])
+{
+  uint64_t c;
+  t[1] += (uint64_t)(t[0] >> 51); r->v[0] = (uint64_t)t[0] & MASK51;
+  t[2] += (uint64_t)(t[1] >> 51); r->v[1] = (uint64_t)t[1] & MASK51;
+  t[3] += (uint64_t)(t[2] >> 51); r->v[2] = (uint64_t)t[2] & MASK51;
+  t[4] += (uint64_t)(t[3] >> 51); r->v[3] = (uint64_t)t[3] & MASK51;
+  c = (uint64_t)(t[4] >> 51); r->v[4] = (uint64_t)t[4] & MASK51;
+  r->v[0] += c * 19;
+  c = r->v[0] >> 51; r->v[0] &= MASK51; r->v[1] += c;
+}
+
+void fe25519_mul(fe25519 *r, const fe25519 *x, const fe25519 *y)
+{
+  uint64_t x0 = x->v[0], x1 = x->v[1], x2 = x->v[2], x3 = x->v[3], x4 = x->v[4];
+  uint64_t y0 = y->v[0], y1 = y->v[1], y2 = y->v[2], y3 = y->v[3], y4 = y->v[4];
+  uint64_t y1_19 = 19 * y1, y2_19 = 19 * y2, y3_19 = 19 * y3, y4_19 = 19 * y4;
+  uint128_t t[5];
+
+  t[0] = (uint128_t)x0 * y0 + (uint128_t)x1 * y4_19 + (uint128_t)x2 * y3_19 +
+    (uint128_t)x3 * y2_19 + (uint128_t)x4 * y1_19;
+  t[1] = (uint128_t)x0 * y1 + (uint128_t)x1 * y0 + (uint128_t)x2 * y4_19 +
+    (uint128_t)x3 * y3_19 + (uint128_t)x4 * y2_19;
+  t[2] = (uint128_t)x0 * y2 + (uint128_t)x1 * y1 + (uint128_t)x2 * y0 +
+    (uint128_t)x3 * y4_19 + (uint128_t)x4 * y3_19;
+  t[3] = (uint128_t)x0 * y3 + (uint128_t)x1 * y2 + (uint128_t)x2 * y1 +
+    (uint128_t)x3 * y0 + (uint128_t)x4 * y4_19;
+  t[4] = (uint128_t)x0 * y4 + (uint128_t)x1 * y3 + (uint128_t)x2 * y2 +
+    (uint128_t)x3 * y1 + (uint128_t)x4 * y0;
+
+  reduce_wide(r, t);
+}
+
+void fe25519_square(fe25519 *r, const fe25519 *x)
+{
+  uint64_t x0 = x->v[0], x1 = x->v[1], x2 = x->v[2], x3 = x->v[3], x4 = x->v[4];
+  uint64_t x0_2 = 2 * x0, x1_2 = 2 * x1;
+  uint64_t x1_38 = 38 * x1, x2_38 = 38 * x2, x3_38 = 38 * x3;
+  uint64_t x3_19 = 19 * x3, x4_19 = 19 * x4;
+  uint128_t t[5];
+
+  t[0] = (uint128_t)x0 * x0 + (uint128_t)x1_38 * x4 + (uint128_t)x2_38 * x3;
+  t[1] = (uint128_t)x0_2 * x1 + (uint128_t)x2_38 * x4 + (uint128_t)x3_19 * x3;
+  t[2] = (uint128_t)x0_2 * x2 + (uint128_t)x1 * x1 + (uint128_t)x3_38 * x4;
+  t[3] = (uint128_t)x0_2 * x3 + (uint128_t)x1_2 * x2 + (uint128_t)x4_19 * x4;
+  t[4] = (uint128_t)x0_2 * x4 + (uint128_t)x1_2 * x3 + (uint128_t)x2 * x2;
+
+  reduce_wide(r, t);
+}
+
+#else	/* !ED25519_FE51 */
+
+#define WINDOWSIZE 1 /* Should be 1,2, or 4 */
+#define WINDOWMASK ((1<<WINDOWSIZE)-1)
+
 static crypto_uint32 equal(crypto_uint32 a,crypto_uint32 b) /* 16-bit inputs */
 {
   crypto_uint32 x = a ^ b; /* 0: yes; 1..65535: no */
@@ -214,6 +412,8 @@ void fe25519_square(fe25519 *r, const fe25519 *x)
   fe25519_mul(r, x, x);
 }
 
+#endif	/* ED25519_FE51 */
+
 void fe25519_invert(fe25519 *r, const fe25519 *x)
 {
 	fe25519 z2;
@@ -16,6 +16,14 @@
  * Base point: (15112221349535400772501151409588531511454012693041857206046113283949847762202,46316835694926478169428394003475163141307993866256225615783033603165251855960);
  */
 
+#if defined(ED25519_FE51)
+/* d */
+static const fe25519 ge25519_ecd = {{0x34dca135978a3, 0x1a8283b156ebd, 0x5e7a26001c029, 0x739c663a03cbb, 0x52036cee2b6ff}};
+/* 2*d */
+static const fe25519 ge25519_ec2d = {{0x69b9426b2f159, 0x35050762add7a, 0x3cf44c0038052, 0x6738cc7407977, 0x2406d9dc56dff}};
+/* sqrt(-1) */
+static const fe25519 ge25519_sqrtm1 = {{0x61b274a0ea0b0, 0x0d5a5fc8f189d, 0x7ef5e9cbd0c60, 0x78595a6804c9e, 0x2b8324804fc1d}};
+#else
 /* d */
 static const fe25519 ge25519_ecd = {{0xA3, 0x78, 0x59, 0x13, 0xCA, 0x4D, 0xEB, 0x75, 0xAB, 0xD8, 0x41, 0x41, 0x4D, 0x0A, 0x70, 0x00, 
                       0x98, 0xE8, 0x79, 0x77, 0x79, 0x40, 0xC7, 0x8C, 0x73, 0xFE, 0x6F, 0x2B, 0xEE, 0x6C, 0x03, 0x52}};
@@ -25,6 +33,7 @@ static const fe25519 ge25519_ec2d = {{0x59, 0xF1, 0xB2, 0x26, 0x94, 0x9B, 0xD6,
 /* sqrt(-1) */
 static const fe25519 ge25519_sqrtm1 = {{0xB0, 0xA0, 0x0E, 0x4A, 0x27, 0x1B, 0xEE, 0xC4, 0x78, 0xE4, 0x2F, 0xAD, 0x06, 0x18, 0x43, 0x2F, 
                          0xA7, 0xD7, 0xFB, 0x3D, 0x99, 0x00, 0x4D, 0x2B, 0x0B, 0xDF, 0xC1, 0x4F, 0x80, 0x24, 0x83, 0x2B}};
+#endif
 
 #define ge25519_p3 ge25519
 
@@ -50,6 +59,40 @@ typedef struct
 } ge25519_aff;
 
 
+#if defined(ED25519_FE51)
+/* Precomputed (y+x, y-x, 2dxy) form of an affine point */
+typedef struct
+{
+  fe25519 yplusx;
+  fe25519 yminusx;
+  fe25519 xy2d;
+} ge25519_niels;
+
+/* The same for a projective point, with Z kept */
+typedef struct
+{
+  fe25519 yplusx;
+  fe25519 yminusx;
+  fe25519 z;
+  fe25519 t2d;
+} ge25519_pniels;
+
+/* The base point */
+const ge25519 ge25519_base = {{{0x62d608f25d51a, 0x412a4b4f6592a, 0x75b7171a4b31d, 0x1ff60527118fe, 0x216936d3cd6e5}},
+                              {{0x6666666666658, 0x4cccccccccccc, 0x1999999999999, 0x3333333333333, 0x6666666666666}},
+                              {{0x0000000000001, 0x0000000000000, 0x0000000000000, 0x0000000000000, 0x0000000000000}},
+                              {{0x68ab3a5b7dda3, 0x00eea2a5eadbb, 0x2af8df483c27e, 0x332b375274732, 0x67875f0fd78b7}}};
+
+/* Multiples of the base point, ready for mixed addition */
+static const ge25519_niels ge25519_base_multiples_niels[425] = {
+#include "ge25519_base51.data"
+};
+
+/* Odd multiples B, 3B, ..., 15B of the base point */
+static const ge25519_niels ge25519_base_odd_niels[8] = {
+#include "ge25519_base51_odd.data"
+};
+#else
 /* Packed coordinates of the base point */
 const ge25519 ge25519_base = {{{0x1A, 0xD5, 0x25, 0x8F, 0x60, 0x2D, 0x56, 0xC9, 0xB2, 0xA7, 0x25, 0x95, 0x60, 0xC7, 0x2C, 0x69, 
                                 0x5C, 0xDC, 0xD6, 0xFD, 0x31, 0xE2, 0xA4, 0xC0, 0xFE, 0x53, 0x6E, 0xCD, 0xD3, 0x36, 0x69, 0x21}},
@@ -64,6 +107,7 @@ const ge25519 ge25519_base = {{{0x1A, 0xD5, 0x25, 0x8F, 0x60, 0x2D, 0x56, 0xC9,
 static const ge25519_aff ge25519_base_multiples_affine[425] = {
 #include "ge25519_base.data"
 };
+#endif
 
 static void p1p1_to_p2(ge25519_p2 *r, const ge25519_p1p1 *p)
 {
@@ -78,6 +122,7 @@ static void p1p1_to_p3(ge25519_p3 *r, const ge25519_p1p1 *p)
   fe25519_mul(&r->t, &p->x, &p->y);
 }
 
+#if !defined(ED25519_FE51)
 static void ge25519_mixadd2(ge25519_p3 *r, const ge25519_aff *q)
 {
   fe25519 a,b,t1,t2,c,d,e,f,g,h,qt;
@@ -101,6 +146,8 @@ static void ge25519_mixadd2(ge25519_p3 *r, const ge25519_aff *q)
   fe25519_mul(&r->t, &e, &h);
 }
 
+#endif
+
 static void add_p1p1(ge25519_p1p1 *r, const ge25519_p3 *p, const ge25519_p3 *q)
 {
   fe25519 a, b, c, d, t;
@@ -140,12 +187,94 @@ static void dbl_p1p1(ge25519_p1p1 *r, const ge25519_p2 *p)
   fe25519_sub(&r->y, &d, &b);
 }
 
+#if defined(ED25519_FE51)
+static void madd_p1p1(ge25519_p1p1 *r, const ge25519_p3 *p, const ge25519_niels *q)
+{
+  fe25519 a, b, c, d;
+  fe25519_add(&a, &p->y, &p->x);
+  fe25519_sub(&b, &p->y, &p->x);
+  fe25519_mul(&a, &a, &q->yplusx); /* A = (Y1+X1)*(y2+x2) */
+  fe25519_mul(&b, &b, &q->yminusx); /* B = (Y1-X1)*(y2-x2) */
+  fe25519_mul(&c, &p->t, &q->xy2d); /* C = T1*2d*x2*y2 */
+  fe25519_add(&d, &p->z, &p->z); /* D = Z1*2 */
+  fe25519_sub(&r->x, &a, &b); /* E = A-B */
+  fe25519_sub(&r->t, &d, &c); /* F = D-C */
+  fe25519_add(&r->z, &d, &c); /* G = D+C */
+  fe25519_add(&r->y, &a, &b); /* H = A+B */
+}
+
+/* as madd_p1p1, with q negated */
+static void msub_p1p1(ge25519_p1p1 *r, const ge25519_p3 *p, const ge25519_niels *q)
+{
+  fe25519 a, b, c, d;
+  fe25519_add(&a, &p->y, &p->x);
+  fe25519_sub(&b, &p->y, &p->x);
+  fe25519_mul(&a, &a, &q->yminusx);
+  fe25519_mul(&b, &b, &q->yplusx);
+  fe25519_mul(&c, &p->t, &q->xy2d);
+  fe25519_add(&d, &p->z, &p->z);
+  fe25519_sub(&r->x, &a, &b);
+  fe25519_add(&r->t, &d, &c);
+  fe25519_sub(&r->z, &d, &c);
+  fe25519_add(&r->y, &a, &b);
+}
+
+static void p3_to_pniels(ge25519_pniels *r, const ge25519_p3 *p)
+{
+  fe25519_add(&r->yplusx, &p->y, &p->x);
+  fe25519_sub(&r->yminusx, &p->y, &p->x);
+  r->z = p->z;
+  fe25519_mul(&r->t2d, &p->t, &ge25519_ec2d);
+}
+
+static void add_pniels_p1p1(ge25519_p1p1 *r, const ge25519_p3 *p, const ge25519_pniels *q)
+{
+  fe25519 a, b, c, d;
+  fe25519_add(&a, &p->y, &p->x);
+  fe25519_sub(&b, &p->y, &p->x);
+  fe25519_mul(&a, &a, &q->yplusx); /* A = (Y1+X1)*(Y2+X2) */
+  fe25519_mul(&b, &b, &q->yminusx); /* B = (Y1-X1)*(Y2-X2) */
+  fe25519_mul(&c, &p->t, &q->t2d); /* C = T1*2d*T2 */
+  fe25519_mul(&d, &p->z, &q->z); /* D = Z1*2*Z2 */
+  fe25519_add(&d, &d, &d);
+  fe25519_sub(&r->x, &a, &b); /* E = A-B */
+  fe25519_sub(&r->t, &d, &c); /* F = D-C */
+  fe25519_add(&r->z, &d, &c); /* G = D+C */
+  fe25519_add(&r->y, &a, &b); /* H = A+B */
+}
+
+/* as add_pniels_p1p1, with q negated */
+static void sub_pniels_p1p1(ge25519_p1p1 *r, const ge25519_p3 *p, const ge25519_pniels *q)
+{
+  fe25519 a, b, c, d;
+  fe25519_add(&a, &p->y, &p->x);
+  fe25519_sub(&b, &p->y, &p->x);
+  fe25519_mul(&a, &a, &q->yminusx);
+  fe25519_mul(&b, &b, &q->yplusx);
+  fe25519_mul(&c, &p->t, &q->t2d);
+  fe25519_mul(&d, &p->z, &q->z);
+  fe25519_add(&d, &d, &d);
+  fe25519_sub(&r->x, &a, &b);
+  fe25519_add(&r->t, &d, &c);
+  fe25519_sub(&r->z, &d, &c);
+  fe25519_add(&r->y, &a, &b);
+}
+
+/* Constant-time version of: if(b) r = p */
+static void cmov_niels(ge25519_niels *r, const ge25519_niels *p, unsigned char b)
+{
+  fe25519_cmov(&r->yplusx, &p->yplusx, b);
+  fe25519_cmov(&r->yminusx, &p->yminusx, b);
+  fe25519_cmov(&r->xy2d, &p->xy2d, b);
+}
+#else
 /* Constant-time version of: if(b) r = p */
 static void cmov_aff(ge25519_aff *r, const ge25519_aff *p, unsigned char b)
 {
   fe25519_cmov(&r->x, &p->x, b);
   fe25519_cmov(&r->y, &p->y, b);
 }
+#endif
 
 static unsigned char equal(signed char b,signed char c)
 {
@@ -165,6 +294,24 @@ static unsigned char negative(signed char b)
   return x;
 }
 
+#if defined(ED25519_FE51)
+static void choose_t(ge25519_niels *t, unsigned long long pos, signed char b)
+{
+  /* constant time */
+  ge25519_niels v;
+  *t = ge25519_base_multiples_niels[5*pos+0];
+  cmov_niels(t, &ge25519_base_multiples_niels[5*pos+1],equal(b,1) | equal(b,-1));
+  cmov_niels(t, &ge25519_base_multiples_niels[5*pos+2],equal(b,2) | equal(b,-2));
+  cmov_niels(t, &ge25519_base_multiples_niels[5*pos+3],equal(b,3) | equal(b,-3));
+  cmov_niels(t, &ge25519_base_multiples_niels[5*pos+4],equal(b,-4));
+  /* -(x,y) = (-x,y): swap y+x and y-x, negate 2dxy */
+  v.yplusx = t->yminusx;
+  v.yminusx = t->yplusx;
+  fe25519_neg(&v.xy2d, &t->xy2d);
+  cmov_niels(t, &v, negative(b));
+}
+
+#else
 static void choose_t(ge25519_aff *t, unsigned long long pos, signed char b)
 {
   /* constant time */
@@ -177,6 +324,44 @@ static void choose_t(ge25519_aff *t, unsigned long long pos, signed char b)
   fe25519_neg(&v, &t->x);
   fe25519_cmov(&t->x, &v, negative(b));
 }
+#endif
+
+/*
+ * Signed sliding-window recoding of a scalar, as in ref10: every non-zero
+ * r[i] is odd and in [-15,15], and there are at least 4 zeroes between
+ * non-zero digits.
+ */
+static void slide(signed char r[256], const unsigned char a[32])
+{
+  int i, b, k;
+
+  for (i = 0;i < 256;++i)
+    r[i] = 1 & (a[i >> 3] >> (i & 7));
+
+  for (i = 0;i < 256;++i)
+  {
+    if (!r[i]) continue;
+    for (b = 1;b <= 6 && i + b < 256;++b)
+    {
+      if (!r[i + b]) continue;
+      if (r[i] + (r[i + b] << b) <= 15)
+      {
+        r[i] += r[i + b] << b; r[i + b] = 0;
+      }
+      else if (r[i] - (r[i + b] << b) >= -15)
+      {
+        r[i] -= r[i + b] << b;
+        for (k = i + b;k < 256;++k)
+        {
+          if (!r[k]) { r[k] = 1; break; }
+          r[k] = 0;
+        }
+      }
+      else
+        break;
+    }
+  }
+}
 
 static void setneutral(ge25519 *r)
 {
@@ -301,6 +486,86 @@ void ge25519_double_scalarmult_vartime(ge25519_p3 *r, const ge25519_p3 *p1, cons
   }
 }
 
+#if defined(ED25519_FE51)
+/* computes [s1]p1 + [s2]B, where B is the base point */
+void ge25519_double_scalarmult_base_vartime(ge25519_p3 *r, const ge25519_p3 *p1, const sc25519 *s1, const sc25519 *s2)
+{
+  signed char as[256], bs[256];
+  unsigned char a[32], b[32];
+  ge25519_pniels ai[8]; /* p1, 3*p1, ..., 15*p1 */
+  ge25519_p1p1 tp1p1;
+  ge25519_p3 u, p1x2;
+  int i;
+
+  sc25519_to32bytes(a, s1);
+  sc25519_to32bytes(b, s2);
+  slide(as, a);
+  slide(bs, b);
+
+  p3_to_pniels(&ai[0], p1);
+  dbl_p1p1(&tp1p1, (ge25519_p2 *)p1); p1p1_to_p3(&p1x2, &tp1p1);
+  for (i = 0;i < 7;++i)
+  {
+    add_pniels_p1p1(&tp1p1, &p1x2, &ai[i]);
+    p1p1_to_p3(&u, &tp1p1);
+    p3_to_pniels(&ai[i + 1], &u);
+  }
+
+  setneutral(r);
+  for (i = 255;i >= 0;--i)
+    if (as[i] || bs[i]) break;
+
+  for (;i >= 0;--i)
+  {
+    dbl_p1p1(&tp1p1, (ge25519_p2 *)r);
+    if (as[i] > 0)
+    {
+      p1p1_to_p3(&u, &tp1p1);
+      add_pniels_p1p1(&tp1p1, &u, &ai[as[i] / 2]);
+    }
+    else if (as[i] < 0)
+    {
+      p1p1_to_p3(&u, &tp1p1);
+      sub_pniels_p1p1(&tp1p1, &u, &ai[(-as[i]) / 2]);
+    }
+    if (bs[i] > 0)
+    {
+      p1p1_to_p3(&u, &tp1p1);
+      madd_p1p1(&tp1p1, &u, &ge25519_base_odd_niels[bs[i] / 2]);
+    }
+    else if (bs[i] < 0)
+    {
+      p1p1_to_p3(&u, &tp1p1);
+      msub_p1p1(&tp1p1, &u, &ge25519_base_odd_niels[(-bs[i]) / 2]);
+    }
+    if (i != 0) p1p1_to_p2((ge25519_p2 *)r, &tp1p1);
+    else p1p1_to_p3(r, &tp1p1);
+  }
+}
+
+void ge25519_scalarmult_base(ge25519_p3 *r, const sc25519 *s)
+{
+  signed char b[85];
+  int i;
+  ge25519_niels t;
+  ge25519_p1p1 tp1p1;
+  sc25519_window3(b,s);
+
+  setneutral(r);
+  for(i=0;i<85;i++)
+  {
+    choose_t(&t, (unsigned long long) i, b[i]);
+    madd_p1p1(&tp1p1, r, &t);
+    p1p1_to_p3(r, &tp1p1);
+  }
+}
+#else
+/* computes [s1]p1 + [s2]B, where B is the base point */
+void ge25519_double_scalarmult_base_vartime(ge25519_p3 *r, const ge25519_p3 *p1, const sc25519 *s1, const sc25519 *s2)
+{
+  ge25519_double_scalarmult_vartime(r, p1, s1, &ge25519_base, s2);
+}
+
 void ge25519_scalarmult_base(ge25519_p3 *r, const sc25519 *s)
 {
   signed char b[85];
@@ -317,3 +582,88 @@ void ge25519_scalarmult_base(ge25519_p3 *r, const sc25519 *s)
     ge25519_mixadd2(r, &t);
   }
 }
+#endif
+
+void ge25519_double(ge25519_p3 *r, const ge25519_p3 *p)
+{
+  ge25519_p1p1 tp1p1;
+  dbl_p1p1(&tp1p1, (const ge25519_p2 *)p);
+  p1p1_to_p3(r, &tp1p1);
+}
+
+/*
+ * computes [s[0]]p[0] + ... + [s[n-1]]p[n-1] (Straus: the doublings are
+ * shared between all the points, and each scalar gets its own sliding
+ * window over the odd multiples of its point).
+ * return 0 on success, -1 if the tables couldn't be allocated
+ */
+int ge25519_multi_scalarmult_vartime(ge25519_p3 *r, const ge25519_p3 *p, const sc25519 *s, unsigned long long n)
+{
+  ge25519_p3 *pre; /* for each point: p, 3*p, ..., 15*p */
+  signed char *sl;
+  unsigned char b[32];
+  ge25519_p1p1 tp1p1;
+  ge25519_p3 p2, neg;
+  unsigned long long j;
+  int i, k;
+  signed char d;
+
+  setneutral(r);
+  if (n == 0) return 0;
+  pre = calloc(n, 8 * sizeof(ge25519_p3));
+  sl = calloc(n, 256);
+  if (pre == NULL || sl == NULL)
+  {
+    free(pre);
+    free(sl);
+    return -1;
+  }
+
+  for (j = 0;j < n;++j)
+  {
+    sc25519_to32bytes(b, &s[j]);
+    slide(&sl[256 * j], b);
+    pre[8 * j] = p[j];
+    dbl_p1p1(&tp1p1, (const ge25519_p2 *)&p[j]); p1p1_to_p3(&p2, &tp1p1);
+    for (k = 1;k < 8;++k)
+    {
+      add_p1p1(&tp1p1, &pre[8 * j + k - 1], &p2);
+      p1p1_to_p3(&pre[8 * j + k], &tp1p1);
+    }
+  }
+
+  for (i = 255;i >= 0;--i)
+  {
+    for (j = 0;j < n;++j)
+      if (sl[256 * j + i]) break;
+    if (j < n) break;
+  }
+
+  for (;i >= 0;--i)
+  {
+    dbl_p1p1(&tp1p1, (ge25519_p2 *)r);
+    p1p1_to_p3(r, &tp1p1);
+    for (j = 0;j < n;++j)
+    {
+      d = sl[256 * j + i];
+      if (d > 0)
+      {
+        add_p1p1(&tp1p1, r, &pre[8 * j + d / 2]);
+        p1p1_to_p3(r, &tp1p1);
+      }
+      else if (d < 0)
+      {
+        /* -(x,y) = (-x,y) */
+        neg = pre[8 * j + (-d) / 2];
+        fe25519_neg(&neg.x, &neg.x);
+        fe25519_neg(&neg.t, &neg.t);
+        add_p1p1(&tp1p1, r, &neg);
+        p1p1_to_p3(r, &tp1p1);
+      }
+    }
+  }
+
+  free(pre);
+  free(sl);
+  return 0;
+}
@@ -18,7 +18,10 @@
 #define ge25519_pack                      crypto_sign_ed25519_ref_pack
 #define ge25519_isneutral_vartime         crypto_sign_ed25519_ref_isneutral_vartime
 #define ge25519_double_scalarmult_vartime crypto_sign_ed25519_ref_double_scalarmult_vartime
+#define ge25519_double_scalarmult_base_vartime crypto_sign_ed25519_ref_double_scalarmult_base_vartime
 #define ge25519_scalarmult_base           crypto_sign_ed25519_ref_scalarmult_base
+#define ge25519_double                    crypto_sign_ed25519_ref_double
+#define ge25519_multi_scalarmult_vartime  crypto_sign_ed25519_ref_multi_scalarmult_vartime
 
 typedef struct
 {
@@ -38,6 +41,12 @@ int ge25519_isneutral_vartime(const ge25519 *p);
 
 void ge25519_double_scalarmult_vartime(ge25519 *r, const ge25519 *p1, const sc25519 *s1, const ge25519 *p2, const sc25519 *s2);
 
+void ge25519_double_scalarmult_base_vartime(ge25519 *r, const ge25519 *p1, const sc25519 *s1, const sc25519 *s2);
+
 void ge25519_scalarmult_base(ge25519 *r, const sc25519 *s);
 
+void ge25519_double(ge25519 *r, const ge25519 *p);
+
+int ge25519_multi_scalarmult_vartime(ge25519 *r, const ge25519 *p, const sc25519 *s, unsigned long long n);
+
 #endif
@@ -23,6 +23,8 @@ struct errf {
 	char errf_function[64];
 	char errf_file[64];
 	uint errf_line;
+	/* Never freed, see errf_static() */
+	boolean_t errf_static;
 };
 
 /*
@@ -85,7 +87,8 @@ struct errf errf_nomem = {
     .errf_name = "OutOfMemoryError",
     .errf_message = "Process failed to allocate new memory",
     .errf_file = "erf.c",
-    .errf_line = __LINE__
+    .errf_line = __LINE__,
+    .errf_static = B_TRUE
 };
 
 struct errf *ERRF_NOMEM = &errf_nomem;
@@ -220,6 +223,34 @@ _errfno(const char *enofunc, int eno, const char *func, const char *file,
 	return (e);
 }
 
+struct errf *
+_errf_static(struct errf_static *es)
+{
+	struct errf *e, *prev = NULL;
+
+	e = __atomic_load_n(&es->es_errf, __ATOMIC_ACQUIRE);
+	if (e != NULL)
+		return (e);
+
+	e = calloc(1, sizeof (struct errf));
+	if (e == NULL)
+		return (ERRF_NOMEM);
+	strlcpy(e->errf_name, es->es_name, sizeof (e->errf_name));
+	strlcpy(e->errf_message, es->es_msg, sizeof (e->errf_message));
+	strlcpy(e->errf_function, es->es_func, sizeof (e->errf_function));
+	strlcpy(e->errf_file, es->es_file, sizeof (e->errf_file));
+	e->errf_line = es->es_line;
+	e->errf_static = B_TRUE;
+
+	/* If another thread got here first, use theirs. */
+	if (!__atomic_compare_exchange_n(&es->es_errf, &prev, e, B_FALSE,
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(e);
+		return (prev);
+	}
+	return (e);
+}
+
 static void
 vperrf(const struct errf *etop, const char *type, const char *fmt, va_list args)
 {
@@ -274,7 +305,7 @@ errf_free(struct errf *ep)
 	while (ep != NULL) {
 		struct errf *tofree = ep;
 		ep = ep->errf_cause;
-		if (tofree != ERRF_NOMEM)
+		if (!tofree->errf_static)
 			free(tofree);
 	}
 }
@@ -104,6 +104,25 @@ struct errf *errf_cause(const struct errf *e);
     _errfno(func, eno, __func__, __FILE__, __LINE__, \
     fmt, ##__VA_ARGS__)
 
+/*
+ * Returns a shared, immutable error object for an expected outcome on a hot
+ * path (e.g. NotFoundError for an empty cert slot), where the caller is just
+ * going to check it with errf_caused_by() and throw it away.
+ *
+ * errf_t *errf_static(const char *name, const char *msg);
+ *
+ * The name and message must be string constants. Each call site gets one
+ * error object, made on first use: after that no memory is allocated and no
+ * formatting is done. The object has no cause, and errf_free() on it (or on
+ * a cause chain containing it) is safe and leaves it alone.
+ */
+#define	errf_static(name, msg)	\
+    __extension__ ({ \
+	static struct errf_static _es = { \
+	    name, msg, __func__, __FILE__, __LINE__, NULL }; \
+	_errf_static(&_es); \
+    })
+
 /*
  * An example error subclass used to report an invalid argument.
  */
@@ -118,12 +137,26 @@ struct errf *errf_cause(const struct errf *e);
 #define	errf(name, cause, fmt, ...)	\
     _errf(name, cause, __func__, __FILE__, __LINE__, fmt)
 
+#define	errf_static(name, msg)	\
+    _errf(name, NULL, __func__, __FILE__, __LINE__, msg)
+
 #endif
 
+/* Internal only -- the call site state behind errf_static(). */
+struct errf_static {
+	const char *es_name;
+	const char *es_msg;
+	const char *es_func;
+	const char *es_file;
+	uint es_line;
+	struct errf *es_errf;
+};
+
 /* Internal only -- used by the above macros. */
 struct errf *_errf(const char *name, struct errf *cause, const char *func,
     const char *file, uint line, const char *fmt, ...);
 struct errf *_errfno(const char *enofunc, int eno, const char *func,
     const char *file, uint line, const char *fmt, ...);
+struct errf *_errf_static(struct errf_static *es);
 
 #endif
@@ -18,10 +18,13 @@
 #include <sys/types.h>
 #include <sys/param.h>
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "../utils.h"
+#include "../debug.h"
 
 #include "blf.h"
 
@@ -60,45 +63,159 @@
 #define BCRYPT_WORDS 8
 #define BCRYPT_HASHSIZE (BCRYPT_WORDS * 4)
 
+/*
+ * Each output block (one value of "count" below) depends only on the
+ * password, salt and its own count, so the blocks are computed
+ * independently: split between up to BCRYPT_MAX_THREADS threads, and
+ * within a thread up to BLF_LANES at a time through the multi-lane
+ * Blowfish functions. Mixing the blocks into the key is done afterwards
+ * exactly as before, so the output does not change.
+ */
+#define BCRYPT_MAX_THREADS 8
+
+struct bcrypt_work {
+	pthread_t bw_thread;
+	const uint8_t *bw_sha2pass;
+	const uint8_t *bw_salt;
+	size_t bw_saltlen;
+	unsigned int bw_rounds;
+	uint32_t bw_first;		/* first count, from 1 */
+	uint32_t bw_nblocks;
+	uint8_t (*bw_out)[BCRYPT_HASHSIZE];	/* bw_nblocks of them */
+	int bw_rc;
+};
+
 static void
-bcrypt_hash(uint8_t *sha2pass, uint8_t *sha2salt, uint8_t *out)
+bcrypt_hash_lanes(const uint8_t *sha2pass,
+    uint8_t sha2salt[][SHA512_DIGEST_LENGTH], uint8_t out[][BCRYPT_HASHSIZE],
+    uint16_t nlanes)
 {
-	blf_ctx state;
+	blf_ctx state[BLF_LANES];
+	const uint8_t *passp[BLF_LANES];
+	const uint8_t *saltp[BLF_LANES];
 	uint8_t ciphertext[BCRYPT_HASHSIZE] =
 	    "OxychromaticBlowfishSwatDynamite";
-	uint32_t cdata[BCRYPT_WORDS];
-	int i;
-	uint16_t j;
+	uint32_t cdata[BLF_LANES][BCRYPT_WORDS];
+	uint32_t xl[BLF_LANES], xr[BLF_LANES];
+	int i, k;
+	uint16_t j, l;
 	size_t shalen = SHA512_DIGEST_LENGTH;
 
+	for (l = 0; l < nlanes; l++) {
+		passp[l] = sha2pass;
+		saltp[l] = sha2salt[l];
+		Blowfish_initstate(&state[l]);
+	}
+
 	/* key expansion */
-	Blowfish_initstate(&state);
-	Blowfish_expandstate(&state, sha2salt, shalen, sha2pass, shalen);
+	Blowfish_expandstate_lanes(state, saltp, shalen, passp, shalen,
+	    nlanes);
 	for (i = 0; i < 64; i++) {
-		Blowfish_expand0state(&state, sha2salt, shalen);
-		Blowfish_expand0state(&state, sha2pass, shalen);
+		Blowfish_expand0state_lanes(state, saltp, shalen, nlanes);
+		Blowfish_expand0state_lanes(state, passp, shalen, nlanes);
 	}
 
 	/* encryption */
 	j = 0;
 	for (i = 0; i < BCRYPT_WORDS; i++)
-		cdata[i] = Blowfish_stream2word(ciphertext, sizeof(ciphertext),
-		    &j);
-	for (i = 0; i < 64; i++)
-		blf_enc(&state, cdata, sizeof(cdata) / sizeof(uint64_t));
+		cdata[0][i] = Blowfish_stream2word(ciphertext,
+		    sizeof(ciphertext), &j);
+	for (l = 1; l < nlanes; l++)
+		memcpy(cdata[l], cdata[0], sizeof(cdata[0]));
+	for (i = 0; i < 64; i++) {
+		for (k = 0; k < BCRYPT_WORDS; k += 2) {
+			for (l = 0; l < nlanes; l++) {
+				xl[l] = cdata[l][k];
+				xr[l] = cdata[l][k + 1];
+			}
+			Blowfish_encipher_lanes(state, xl, xr, nlanes);
+			for (l = 0; l < nlanes; l++) {
+				cdata[l][k] = xl[l];
+				cdata[l][k + 1] = xr[l];
+			}
+		}
+	}
 
 	/* copy out */
-	for (i = 0; i < BCRYPT_WORDS; i++) {
-		out[4 * i + 3] = (cdata[i] >> 24) & 0xff;
-		out[4 * i + 2] = (cdata[i] >> 16) & 0xff;
-		out[4 * i + 1] = (cdata[i] >> 8) & 0xff;
-		out[4 * i + 0] = cdata[i] & 0xff;
+	for (l = 0; l < nlanes; l++) {
+		for (i = 0; i < BCRYPT_WORDS; i++) {
+			out[l][4 * i + 3] = (cdata[l][i] >> 24) & 0xff;
+			out[l][4 * i + 2] = (cdata[l][i] >> 16) & 0xff;
+			out[l][4 * i + 1] = (cdata[l][i] >> 8) & 0xff;
+			out[l][4 * i + 0] = cdata[l][i] & 0xff;
+		}
 	}
 
 	/* zap */
 	explicit_bzero(ciphertext, sizeof(ciphertext));
 	explicit_bzero(cdata, sizeof(cdata));
-	explicit_bzero(&state, sizeof(state));
+	explicit_bzero(xl, sizeof(xl));
+	explicit_bzero(xr, sizeof(xr));
+	explicit_bzero(state, sizeof(state));
+}
+
+/*
+ * Computes output blocks bw_first .. bw_first + bw_nblocks - 1 (before
+ * mixing) into bw_out, BLF_LANES at a time.
+ */
+static void *
+bcrypt_blocks(void *arg)
+{
+	struct bcrypt_work *bw = arg;
+	uint8_t sha2salt[BLF_LANES][SHA512_DIGEST_LENGTH];
+	uint8_t tmpout[BLF_LANES][BCRYPT_HASHSIZE];
+	uint8_t *countsalt;
+	uint8_t (*out)[BCRYPT_HASHSIZE];
+	size_t i, j, saltlen = bw->bw_saltlen;
+	uint32_t b, count;
+	uint16_t l, nlanes;
+
+	bw->bw_rc = -1;
+	if ((countsalt = calloc(1, saltlen + 4)) == NULL)
+		return (NULL);
+	memcpy(countsalt, bw->bw_salt, saltlen);
+
+	for (b = 0; b < bw->bw_nblocks; b += nlanes) {
+		nlanes = MINIMUM(BLF_LANES, bw->bw_nblocks - b);
+		out = &bw->bw_out[b];
+
+		for (l = 0; l < nlanes; l++) {
+			count = bw->bw_first + b + l;
+			countsalt[saltlen + 0] = (count >> 24) & 0xff;
+			countsalt[saltlen + 1] = (count >> 16) & 0xff;
+			countsalt[saltlen + 2] = (count >> 8) & 0xff;
+			countsalt[saltlen + 3] = count & 0xff;
+
+			/* first round, salt is salt */
+			crypto_hash_sha512(sha2salt[l], countsalt,
+			    saltlen + 4);
+		}
+
+		bcrypt_hash_lanes(bw->bw_sha2pass, sha2salt, tmpout, nlanes);
+		memcpy(out, tmpout, nlanes * sizeof(tmpout[0]));
+
+		for (i = 1; i < bw->bw_rounds; i++) {
+			/* subsequent rounds, salt is previous output */
+			for (l = 0; l < nlanes; l++) {
+				crypto_hash_sha512(sha2salt[l], tmpout[l],
+				    sizeof(tmpout[l]));
+			}
+			bcrypt_hash_lanes(bw->bw_sha2pass, sha2salt, tmpout,
+			    nlanes);
+			for (l = 0; l < nlanes; l++) {
+				for (j = 0; j < sizeof(out[l]); j++)
+					out[l][j] ^= tmpout[l][j];
+			}
+		}
+	}
+
+	/* zap */
+	explicit_bzero(sha2salt, sizeof(sha2salt));
+	explicit_bzero(tmpout, sizeof(tmpout));
+	free(countsalt);
+
+	bw->bw_rc = 0;
+	return (NULL);
 }
 
 int
@@ -106,54 +223,84 @@ bcrypt_pbkdf(const char *pass, size_t passlen, const uint8_t *salt, size_t saltl
     uint8_t *key, size_t keylen, unsigned int rounds)
 {
 	uint8_t sha2pass[SHA512_DIGEST_LENGTH];
-	uint8_t sha2salt[SHA512_DIGEST_LENGTH];
-	uint8_t out[BCRYPT_HASHSIZE];
-	uint8_t tmpout[BCRYPT_HASHSIZE];
-	uint8_t *countsalt;
-	size_t i, j, amt, stride;
-	uint32_t count;
+	uint8_t (*outs)[BCRYPT_HASHSIZE];
+	uint8_t *out;
+	struct bcrypt_work work[BCRYPT_MAX_THREADS];
+	size_t i, amt, stride;
+	size_t nthreads, started, per, extra;
+	uint32_t count, first;
+	long ncpu;
+	int rc = 0;
 	size_t origkeylen = keylen;
 
 	/* nothing crazy */
 	if (rounds < 1)
 		return -1;
 	if (passlen == 0 || saltlen == 0 || keylen == 0 ||
-	    keylen > sizeof(out) * sizeof(out) || saltlen > 1<<20)
-		return -1;
-	if ((countsalt = calloc(1, saltlen + 4)) == NULL)
+	    keylen > BCRYPT_HASHSIZE * BCRYPT_HASHSIZE || saltlen > 1<<20)
 		return -1;
-	stride = (keylen + sizeof(out) - 1) / sizeof(out);
+	stride = (keylen + BCRYPT_HASHSIZE - 1) / BCRYPT_HASHSIZE;
 	amt = (keylen + stride - 1) / stride;
-
-	memcpy(countsalt, salt, saltlen);
+	if ((outs = calloc(stride, sizeof(outs[0]))) == NULL)
+		return -1;
 
 	/* collapse password */
 	crypto_hash_sha512(sha2pass, (const u_char *)pass, passlen);
 
-	/* generate key, sizeof(out) at a time */
-	for (count = 1; keylen > 0; count++) {
-		countsalt[saltlen + 0] = (count >> 24) & 0xff;
-		countsalt[saltlen + 1] = (count >> 16) & 0xff;
-		countsalt[saltlen + 2] = (count >> 8) & 0xff;
-		countsalt[saltlen + 3] = count & 0xff;
-
-		/* first round, salt is salt */
-		crypto_hash_sha512(sha2salt, countsalt, saltlen + 4);
+	/*
+	 * One thread per group of blocks, but never more than we have CPUs
+	 * for. Spread the blocks evenly: the first "extra" threads take one
+	 * more than the rest.
+	 */
+	nthreads = stride;
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu > 0 && nthreads > (size_t)ncpu)
+		nthreads = ncpu;
+	if (nthreads > BCRYPT_MAX_THREADS)
+		nthreads = BCRYPT_MAX_THREADS;
+	per = stride / nthreads;
+	extra = stride % nthreads;
 
-		bcrypt_hash(sha2pass, sha2salt, tmpout);
-		memcpy(out, tmpout, sizeof(out));
+	first = 1;
+	for (i = 0; i < nthreads; i++) {
+		struct bcrypt_work *bw = &work[i];
+		bw->bw_sha2pass = sha2pass;
+		bw->bw_salt = salt;
+		bw->bw_saltlen = saltlen;
+		bw->bw_rounds = rounds;
+		bw->bw_first = first;
+		bw->bw_nblocks = per + (i < extra ? 1 : 0);
+		bw->bw_out = &outs[first - 1];
+		bw->bw_rc = -1;
+		first += bw->bw_nblocks;
+	}
 
-		for (i = 1; i < rounds; i++) {
-			/* subsequent rounds, salt is previous output */
-			crypto_hash_sha512(sha2salt, tmpout, sizeof(tmpout));
-			bcrypt_hash(sha2pass, sha2salt, tmpout);
-			for (j = 0; j < sizeof(out); j++)
-				out[j] ^= tmpout[j];
-		}
+	/*
+	 * This thread does work[0] itself. If we can't start a thread for
+	 * one of the others, we just do that one here too.
+	 */
+	for (started = 1; started < nthreads; started++) {
+		if (pthread_create(&work[started].bw_thread, NULL,
+		    bcrypt_blocks, &work[started]) != 0)
+			break;
+	}
+	bcrypt_blocks(&work[0]);
+	for (i = started; i < nthreads; i++)
+		bcrypt_blocks(&work[i]);
+	for (i = 1; i < started; i++)
+		VERIFY0(pthread_join(work[i].bw_thread, NULL));
+	for (i = 0; i < nthreads; i++) {
+		if (work[i].bw_rc != 0)
+			rc = -1;
+	}
+	if (rc != 0)
+		goto out;
 
-		/*
-		 * pbkdf2 deviation: output the key material non-linearly.
-		 */
+	/*
+	 * pbkdf2 deviation: output the key material non-linearly.
+	 */
+	for (count = 1; keylen > 0; count++) {
+		out = outs[count - 1];
 		amt = MINIMUM(amt, keylen);
 		for (i = 0; i < amt; i++) {
 			size_t dest = i * stride + (count - 1);
@@ -164,9 +311,11 @@ bcrypt_pbkdf(const char *pass, size_t passlen, const uint8_t *salt, size_t saltl
 		keylen -= i;
 	}
 
+out:
 	/* zap */
-	explicit_bzero(out, sizeof(out));
-	free(countsalt);
+	explicit_bzero(sha2pass, sizeof(sha2pass));
+	explicit_bzero(outs, stride * sizeof(outs[0]));
+	free(outs);
 
-	return 0;
+	return rc;
 }
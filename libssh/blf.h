@@ -68,6 +68,16 @@ void Blowfish_expand0state(blf_ctx *, const uint8_t *, uint16_t);
 void Blowfish_expandstate
 (blf_ctx *, const uint8_t *, uint16_t, const uint8_t *, uint16_t);
 
+/* Multi-lane variants: run up to BLF_LANES independent contexts at once */
+#define BLF_LANES	4
+
+void Blowfish_encipher_lanes(blf_ctx *, uint32_t *, uint32_t *, uint16_t);
+void Blowfish_expand0state_lanes
+(blf_ctx *, const uint8_t * const *, uint16_t, uint16_t);
+void Blowfish_expandstate_lanes
+(blf_ctx *, const uint8_t * const *, uint16_t, const uint8_t * const *,
+    uint16_t, uint16_t);
+
 /* Standard Blowfish */
 
 void blf_key(blf_ctx *, const uint8_t *, uint16_t);
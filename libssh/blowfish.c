@@ -497,6 +497,137 @@ Blowfish_expandstate(blf_ctx *c, const uint8_t *data, uint16_t databytes,
 
 }
 
+/*
+ * The _lanes variants below operate on an array of nlanes (<= BLF_LANES)
+ * independent contexts, each with its own key/data stream. Every Feistel
+ * round is done for all lanes before moving to the next one, so the S-box
+ * loads for one lane overlap with the arithmetic for the others instead of
+ * each encipher waiting on its own chain of dependent loads. The results
+ * are identical to calling the single-context functions once per lane.
+ */
+void
+Blowfish_encipher_lanes(blf_ctx *c, uint32_t *xl, uint32_t *xr,
+    uint16_t nlanes)
+{
+	uint32_t Xl[BLF_LANES];
+	uint32_t Xr[BLF_LANES];
+	uint32_t *s[BLF_LANES];
+	uint32_t *p[BLF_LANES];
+	uint16_t l;
+	uint16_t n;
+
+	for (l = 0; l < nlanes; l++) {
+		s[l] = c[l].S[0];
+		p[l] = c[l].P;
+		Xl[l] = xl[l] ^ p[l][0];
+		Xr[l] = xr[l];
+	}
+	for (n = 1; n <= BLF_N; n += 2) {
+		for (l = 0; l < nlanes; l++)
+			BLFRND(s[l], p[l], Xr[l], Xl[l], n);
+		for (l = 0; l < nlanes; l++)
+			BLFRND(s[l], p[l], Xl[l], Xr[l], n + 1);
+	}
+	for (l = 0; l < nlanes; l++) {
+		xl[l] = Xr[l] ^ p[l][BLF_N + 1];
+		xr[l] = Xl[l];
+	}
+}
+
+void
+Blowfish_expand0state_lanes(blf_ctx *c, const uint8_t * const *key,
+    uint16_t keybytes, uint16_t nlanes)
+{
+	uint16_t i;
+	uint16_t j[BLF_LANES];
+	uint16_t k;
+	uint16_t l;
+	uint32_t datal[BLF_LANES];
+	uint32_t datar[BLF_LANES];
+
+	for (l = 0; l < nlanes; l++) {
+		j[l] = 0;
+		for (i = 0; i < BLF_N + 2; i++) {
+			c[l].P[i] ^= Blowfish_stream2word(key[l], keybytes,
+			    &j[l]);
+		}
+		datal[l] = 0x00000000;
+		datar[l] = 0x00000000;
+	}
+
+	for (i = 0; i < BLF_N + 2; i += 2) {
+		Blowfish_encipher_lanes(c, datal, datar, nlanes);
+		for (l = 0; l < nlanes; l++) {
+			c[l].P[i] = datal[l];
+			c[l].P[i + 1] = datar[l];
+		}
+	}
+
+	for (i = 0; i < 4; i++) {
+		for (k = 0; k < 256; k += 2) {
+			Blowfish_encipher_lanes(c, datal, datar, nlanes);
+			for (l = 0; l < nlanes; l++) {
+				c[l].S[i][k] = datal[l];
+				c[l].S[i][k + 1] = datar[l];
+			}
+		}
+	}
+}
+
+void
+Blowfish_expandstate_lanes(blf_ctx *c, const uint8_t * const *data,
+    uint16_t databytes, const uint8_t * const *key, uint16_t keybytes,
+    uint16_t nlanes)
+{
+	uint16_t i;
+	uint16_t j[BLF_LANES];
+	uint16_t k;
+	uint16_t l;
+	uint32_t datal[BLF_LANES];
+	uint32_t datar[BLF_LANES];
+
+	for (l = 0; l < nlanes; l++) {
+		j[l] = 0;
+		for (i = 0; i < BLF_N + 2; i++) {
+			c[l].P[i] ^= Blowfish_stream2word(key[l], keybytes,
+			    &j[l]);
+		}
+		j[l] = 0;
+		datal[l] = 0x00000000;
+		datar[l] = 0x00000000;
+	}
+
+	for (i = 0; i < BLF_N + 2; i += 2) {
+		for (l = 0; l < nlanes; l++) {
+			datal[l] ^= Blowfish_stream2word(data[l], databytes,
+			    &j[l]);
+			datar[l] ^= Blowfish_stream2word(data[l], databytes,
+			    &j[l]);
+		}
+		Blowfish_encipher_lanes(c, datal, datar, nlanes);
+		for (l = 0; l < nlanes; l++) {
+			c[l].P[i] = datal[l];
+			c[l].P[i + 1] = datar[l];
+		}
+	}
+
+	for (i = 0; i < 4; i++) {
+		for (k = 0; k < 256; k += 2) {
+			for (l = 0; l < nlanes; l++) {
+				datal[l] ^= Blowfish_stream2word(data[l],
+				    databytes, &j[l]);
+				datar[l] ^= Blowfish_stream2word(data[l],
+				    databytes, &j[l]);
+			}
+			Blowfish_encipher_lanes(c, datal, datar, nlanes);
+			for (l = 0; l < nlanes; l++) {
+				c[l].S[i][k] = datal[l];
+				c[l].S[i][k + 1] = datar[l];
+			}
+		}
+	}
+}
+
 void
 blf_key(blf_ctx *c, const uint8_t *k, uint16_t len)
 {
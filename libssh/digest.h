@@ -75,5 +75,19 @@ int ssh_digest_final(struct ssh_digest_ctx *ctx, u_char *d, size_t dlen)
     __bounded(__buffer__, 2, 3);
 void ssh_digest_free(struct ssh_digest_ctx *ctx);
 
+/*
+ * Batch HMAC: computes the HMACs of n messages under the same key. For
+ * SHA256 on CPUs where it's faster (AVX2 without the SHA extensions), up to
+ * ssh_digest_multi_lanes() of them are hashed at once in SIMD lanes;
+ * otherwise this is the same as doing them one at a time.
+ *
+ * If pfx is not NULL, message i is pfx[i] (pfxlen bytes) followed by m[i],
+ * without the two being copied together first.
+ */
+u_int ssh_digest_multi_lanes(int alg);
+int ssh_digest_hmac_multi(int alg, const void *key, size_t klen, u_int n,
+    const u_char *const *pfx, size_t pfxlen, const u_char *const *m,
+    const size_t *mlen, u_char *const *d, size_t dlen);
+
 #endif /* _DIGEST_H */
 
@@ -182,3 +182,110 @@ ssh_ed25519_verify(const struct sshkey *key,
 	free(ktype);
 	return r;
 }
+
+/*
+ * Batch version of ssh_ed25519_verify(): checks every Ed25519 signature in
+ * checks[] in one go with crypto_sign_ed25519_open_batch(), setting their
+ * sc_result. Entries for other key types, or which already have a non-zero
+ * sc_result, are left alone.
+ */
+int
+ssh_ed25519_verify_batch(struct sshkey_sig_check *checks, size_t n,
+    u_int compat)
+{
+	struct sshbuf *b = NULL;
+	char *ktype = NULL;
+	const u_char *sigblob;
+	u_char **sm = NULL;
+	const u_char **pk = NULL;
+	unsigned long long *smlen = NULL;
+	size_t *idx = NULL;
+	int *valid = NULL;
+	size_t i, j, nb = 0, len;
+	int r;
+
+	if (n == 0)
+		return 0;
+	if ((sm = calloc(n, sizeof (*sm))) == NULL ||
+	    (pk = calloc(n, sizeof (*pk))) == NULL ||
+	    (smlen = calloc(n, sizeof (*smlen))) == NULL ||
+	    (idx = calloc(n, sizeof (*idx))) == NULL ||
+	    (valid = calloc(n, sizeof (*valid))) == NULL) {
+		r = SSH_ERR_ALLOC_FAIL;
+		goto out;
+	}
+
+	for (i = 0; i < n; ++i) {
+		struct sshkey_sig_check *sc = &checks[i];
+		const struct sshkey *key = sc->sc_key;
+
+		if (sc->sc_result != 0 || key == NULL ||
+		    sshkey_type_plain(key->type) != KEY_ED25519)
+			continue;
+		if (key->ed25519_pk == NULL ||
+		    sc->sc_datalen >= INT_MAX - crypto_sign_ed25519_BYTES ||
+		    sc->sc_sig == NULL || sc->sc_siglen == 0) {
+			sc->sc_result = SSH_ERR_INVALID_ARGUMENT;
+			continue;
+		}
+		if ((b = sshbuf_from(sc->sc_sig, sc->sc_siglen)) == NULL) {
+			r = SSH_ERR_ALLOC_FAIL;
+			goto out;
+		}
+		if ((r = sshbuf_get_cstring(b, &ktype, NULL)) != 0 ||
+		    (r = sshbuf_get_string_direct(b, &sigblob, &len)) != 0)
+			goto next;
+		if (strcmp("ssh-ed25519", ktype) != 0) {
+			r = SSH_ERR_KEY_TYPE_MISMATCH;
+			goto next;
+		}
+		if (sshbuf_len(b) != 0) {
+			r = SSH_ERR_UNEXPECTED_TRAILING_DATA;
+			goto next;
+		}
+		if (len > crypto_sign_ed25519_BYTES) {
+			r = SSH_ERR_INVALID_FORMAT;
+			goto next;
+		}
+		if ((sm[nb] = malloc(len + sc->sc_datalen)) == NULL) {
+			r = SSH_ERR_ALLOC_FAIL;
+			goto out;
+		}
+		memcpy(sm[nb], sigblob, len);
+		memcpy(sm[nb] + len, sc->sc_data, sc->sc_datalen);
+		smlen[nb] = len + sc->sc_datalen;
+		pk[nb] = key->ed25519_pk;
+		idx[nb++] = i;
+		r = 0;
+next:
+		sc->sc_result = r;
+		sshbuf_free(b);
+		b = NULL;
+		free(ktype);
+		ktype = NULL;
+	}
+
+	(void) crypto_sign_ed25519_open_batch((const u_char * const *)sm,
+	    smlen, pk, nb, valid);
+	for (j = 0; j < nb; ++j) {
+		checks[idx[j]].sc_result = valid[j] ? 0 :
+		    SSH_ERR_SIGNATURE_INVALID;
+	}
+	r = 0;
+
+ out:
+	if (sm != NULL) {
+		for (j = 0; j < nb; ++j) {
+			explicit_bzero(sm[j], smlen[j]);
+			free(sm[j]);
+		}
+		free(sm);
+	}
+	free(pk);
+	free(smlen);
+	free(idx);
+	free(valid);
+	sshbuf_free(b);
+	free(ktype);
+	return r;
+}
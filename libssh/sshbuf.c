@@ -18,6 +18,7 @@
 #define SSHBUF_INTERNAL
 
 #include <sys/types.h>
+#include <errno.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -164,12 +165,6 @@ sshbuf_free(struct sshbuf *buf)
 	 */
 	if (sshbuf_check_sanity(buf) != 0)
 		return;
-	/*
-	 * If we are a child, the free our parent to decrement its reference
-	 * count and possibly free it.
-	 */
-	sshbuf_free(buf->parent);
-	buf->parent = NULL;
 	/*
 	 * If we are a parent with still-extant children, then don't free just
 	 * yet. The last child's call to sshbuf_free should decrement our
@@ -178,6 +173,14 @@ sshbuf_free(struct sshbuf *buf)
 	buf->refcount--;
 	if (buf->refcount > 0)
 		return;
+	/*
+	 * If we are a child, then free our parent to decrement its reference
+	 * count and possibly free it. This has to wait until our own last
+	 * reference goes: a view of a view still points into the parent's
+	 * memory after the middle one has been freed by its owner.
+	 */
+	sshbuf_free(buf->parent);
+	buf->parent = NULL;
 	dont_free = buf->dont_free;
 	if (!buf->readonly) {
 		explicit_bzero(buf->d, buf->alloc);
@@ -188,6 +191,28 @@ sshbuf_free(struct sshbuf *buf)
 		free(buf);
 }
 
+int
+sshbuf_unshare(struct sshbuf **bufp)
+{
+	struct sshbuf *buf = *bufp, *nbuf;
+	int r;
+
+	if ((r = sshbuf_check_sanity(buf)) != 0)
+		return r;
+	if (buf->readonly || buf->refcount == 1)
+		return 0;
+	if ((nbuf = sshbuf_new()) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	if ((r = sshbuf_set_max_size(nbuf, buf->max_size)) != 0 ||
+	    (r = sshbuf_putb(nbuf, buf)) != 0) {
+		sshbuf_free(nbuf);
+		return r;
+	}
+	sshbuf_free(buf);
+	*bufp = nbuf;
+	return 0;
+}
+
 void
 sshbuf_reset(struct sshbuf *buf)
 {
@@ -1432,6 +1457,41 @@ sshbuf_dup_string(struct sshbuf *buf)
 	return r;
 }
 
+int
+sshbuf_read(int fd, struct sshbuf *buf, size_t maxlen, size_t *rlen)
+{
+	int r, oerrno;
+	size_t adjust;
+	ssize_t rr;
+	u_char *d;
+
+	if (rlen != NULL)
+		*rlen = 0;
+	if ((r = sshbuf_reserve(buf, maxlen, &d)) != 0)
+		return r;
+	rr = read(fd, d, maxlen);
+	oerrno = errno;
+
+	/* Adjust the buffer to include only what was actually read */
+	if ((adjust = maxlen - (rr > 0 ? rr : 0)) != 0) {
+		if ((r = sshbuf_consume_end(buf, adjust)) != 0) {
+			/* avoid returning uninitialised data to caller */
+			memset(d + (rr > 0 ? rr : 0), '\0', adjust);
+			return SSH_ERR_INTERNAL_ERROR; /* shouldn't happen */
+		}
+	}
+	if (rr < 0) {
+		errno = oerrno;
+		return SSH_ERR_SYSTEM_ERROR;
+	} else if (rr == 0) {
+		errno = EPIPE;
+		return SSH_ERR_SYSTEM_ERROR;
+	}
+	if (rlen != NULL)
+		*rlen = (size_t)rr;
+	return 0;
+}
+
 #define MUL_NO_OVERFLOW	((size_t)1 << (sizeof(size_t) * 4))
 #include <errno.h>
 
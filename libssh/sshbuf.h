@@ -90,6 +90,16 @@ int	sshbuf_froms(struct sshbuf *buf, struct sshbuf **bufp);
  */
 void	sshbuf_free(struct sshbuf *buf);
 
+/*
+ * If buf still has read-only children made by sshbuf_fromb() or
+ * sshbuf_froms() (which stop it from being written to), replace *bufp with
+ * a fresh buffer holding a copy of just its unread data, and drop our
+ * reference on the old one. The children keep it alive for as long as
+ * they need it. Does nothing if there are no children.
+ * Returns 0 on success, or a negative SSH_ERR_* error code on failure.
+ */
+int	sshbuf_unshare(struct sshbuf **bufp);
+
 /*
  * Reset buf, clearing its contents. NB. max_size is preserved.
  */
@@ -162,6 +172,14 @@ int	sshbuf_consume(struct sshbuf *buf, size_t len);
  */
 int	sshbuf_consume_end(struct sshbuf *buf, size_t len);
 
+/*
+ * Read up to maxlen bytes from fd directly onto the end of buf, returning
+ * the number read via the optional rlen. End of file is reported as
+ * SSH_ERR_SYSTEM_ERROR with errno set to EPIPE.
+ * Returns 0 on success, or a negative SSH_ERR_* error code on failure.
+ */
+int	sshbuf_read(int fd, struct sshbuf *buf, size_t maxlen, size_t *rlen);
+
 /* Extract or deposit some bytes */
 int	sshbuf_get(struct sshbuf *buf, void *v, size_t len);
 int	sshbuf_put(struct sshbuf *buf, const void *v, size_t len);
@@ -2182,6 +2182,46 @@ sshkey_verify(const struct sshkey *key,
 	}
 }
 
+/*
+ * Checks n signatures, setting sc_result on each. The Ed25519 ones are
+ * verified together as a batch, which is much quicker than one at a time
+ * when there are lots of them; the rest just go through sshkey_verify().
+ * Returns 0 if they all verified, otherwise the first failure.
+ */
+int
+sshkey_verify_batch(struct sshkey_sig_check *checks, size_t n, u_int compat)
+{
+	struct sshkey_sig_check *sc;
+	size_t i;
+	int r;
+
+	for (i = 0; i < n; ++i) {
+		sc = &checks[i];
+		sc->sc_result = 0;
+		if (sc->sc_key == NULL || sc->sc_siglen == 0 ||
+		    sc->sc_datalen > SSH_KEY_MAX_SIGN_DATA_SIZE) {
+			sc->sc_result = SSH_ERR_INVALID_ARGUMENT;
+			continue;
+		}
+		switch (sc->sc_key->type) {
+		case KEY_ED25519:
+		case KEY_ED25519_CERT:
+			break;
+		default:
+			sc->sc_result = sshkey_verify(sc->sc_key, sc->sc_sig,
+			    sc->sc_siglen, sc->sc_data, sc->sc_datalen, compat);
+			break;
+		}
+	}
+	if ((r = ssh_ed25519_verify_batch(checks, n, compat)) != 0)
+		return r;
+	for (i = 0; i < n; ++i) {
+		if (checks[i].sc_result != 0)
+			return checks[i].sc_result;
+	}
+	return 0;
+}
+
 /* Converts a private to a public key */
 int
 sshkey_demote(const struct sshkey *k, struct sshkey **dkp)
@@ -174,6 +174,17 @@ int	 sshkey_sign(const struct sshkey *, u_char **, size_t *,
 int	 sshkey_verify(const struct sshkey *, const u_char *, size_t,
     const u_char *, size_t, u_int);
 
+/* One signature for sshkey_verify_batch() to check. */
+struct sshkey_sig_check {
+	const struct sshkey	*sc_key;
+	const u_char		*sc_sig;
+	size_t			 sc_siglen;
+	const u_char		*sc_data;
+	size_t			 sc_datalen;
+	int			 sc_result;	/* 0 or SSH_ERR_* */
+};
+int	 sshkey_verify_batch(struct sshkey_sig_check *, size_t, u_int);
+
 int	 sshkey_sig_from_asn1(const struct sshkey *,
     enum sshdigest_types dtype, const uint8_t *sig, size_t siglen,
     struct sshbuf *buf);
@@ -220,6 +231,8 @@ int ssh_ed25519_sign(const struct sshkey *key, u_char **sigp, size_t *lenp,
 int ssh_ed25519_verify(const struct sshkey *key,
     const u_char *signature, size_t signaturelen,
     const u_char *data, size_t datalen, u_int compat);
+int ssh_ed25519_verify_batch(struct sshkey_sig_check *checks, size_t n,
+    u_int compat);
 
 int ssh_ecdsa_sig_from_asn1(enum sshdigest_types dtype, const uint8_t *sig,
     size_t siglen, struct sshbuf *buf);
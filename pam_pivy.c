@@ -21,6 +21,7 @@
 #include <limits.h>
 #include <err.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #if defined(__APPLE__)
 #include <PCSC/wintypes.h>
@@ -70,10 +71,28 @@
 #define	PIVY_AGENT_SOCKET	"%s/piv-ssh-%s.socket"
 #define	SSH_AUTH_KEYS		"%s/.ssh/authorized_keys"
 
-struct keylist {
-	struct sshkey *kl_key;
-	char *kl_comment;
-	struct keylist *kl_next;
+/* Length of the SHA256 fingerprints we index authorized_keys by */
+#define	AK_FP_LEN		32
+
+/*
+ * The parsed contents of an authorized_keys file, sorted by the SHA256
+ * fingerprint of each key so we can look up slot keys with bsearch().
+ */
+struct akentry {
+	uint8_t ake_fp[AK_FP_LEN];
+	struct sshkey *ake_key;
+};
+
+struct akindex {
+	uint aki_refcnt;		/* protected by akcache_mtx */
+	char *aki_path;
+	dev_t aki_dev;
+	ino_t aki_ino;
+	off_t aki_size;
+	time_t aki_mtime;
+	time_t aki_ctime;
+	struct akentry *aki_ents;
+	size_t aki_nents;
 };
 
 struct tkconfig {
@@ -84,6 +103,29 @@ struct tkconfig {
 	struct sshkey *tkc_cak;
 };
 
+/*
+ * We're loaded into long-running processes (e.g. sshd's listener, login
+ * managers) which call us many times, so we keep the last authorized_keys
+ * index we built (reused for as long as the file's inode, size and times
+ * are unchanged) and a PCSC context between calls.
+ *
+ * The context is only ever used by one call at a time: pam_sm_authenticate()
+ * takes it out of pam_ctx and puts it back (or releases it, if another call
+ * already has) when it's done. After a fork we make a new one, since PCSC
+ * contexts don't survive that.
+ */
+static pthread_mutex_t akcache_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct akindex *akcache = NULL;
+static boolean_t pam_ctx_valid = B_FALSE;
+static SCARDCONTEXT pam_ctx;
+static pid_t pam_ctx_pid;
+
+/*
+ * We only read the CHUID (to match GUIDs) when finding a token; anything
+ * else is read if and when the auth actually needs it.
+ */
+static const struct piv_enum_opts pam_find_opts = { PIV_READ_CHUID };
+
 static const char *
 pin_type_to_name(enum piv_pin type)
 {
@@ -143,20 +185,303 @@ get_agent_socket(const char *authsocket, int *fdp)
 	return 0;
 }
 
+static int
+akentry_cmp(const void *a, const void *b)
+{
+	const struct akentry *ea = a, *eb = b;
+	return (memcmp(ea->ake_fp, eb->ake_fp, AK_FP_LEN));
+}
+
+static int
+key_fp(const struct sshkey *key, uint8_t *fp)
+{
+	u_char *raw = NULL;
+	size_t len;
+	int rc;
+
+	rc = sshkey_fingerprint_raw(key, SSH_DIGEST_SHA256, &raw, &len);
+	if (rc != 0)
+		return (rc);
+	if (len != AK_FP_LEN) {
+		free(raw);
+		return (SSH_ERR_INTERNAL_ERROR);
+	}
+	bcopy(raw, fp, AK_FP_LEN);
+	free(raw);
+	return (0);
+}
+
+static void
+akindex_rele(struct akindex *aki)
+{
+	size_t i;
+
+	if (aki == NULL)
+		return;
+	VERIFY0(pthread_mutex_lock(&akcache_mtx));
+	VERIFY(aki->aki_refcnt > 0);
+	if (--aki->aki_refcnt > 0) {
+		VERIFY0(pthread_mutex_unlock(&akcache_mtx));
+		return;
+	}
+	VERIFY0(pthread_mutex_unlock(&akcache_mtx));
+	for (i = 0; i < aki->aki_nents; ++i)
+		sshkey_free(aki->aki_ents[i].ake_key);
+	free(aki->aki_ents);
+	free(aki->aki_path);
+	free(aki);
+}
+
+static struct akindex *
+akindex_read(const char *path, FILE *f, const struct stat *st)
+{
+	struct akindex *aki;
+	struct akentry *ents;
+	struct sshkey *key;
+	char *lbuf = NULL, *cp;
+	size_t lsz, nalloc = 0;
+
+	aki = calloc(1, sizeof (struct akindex));
+	if (aki == NULL)
+		return (NULL);
+	aki->aki_refcnt = 1;
+	aki->aki_path = strdup(path);
+	aki->aki_dev = st->st_dev;
+	aki->aki_ino = st->st_ino;
+	aki->aki_size = st->st_size;
+	aki->aki_mtime = st->st_mtime;
+	aki->aki_ctime = st->st_ctime;
+	if (aki->aki_path == NULL)
+		goto fail;
+
+	while (getline(&lbuf, &lsz, f) != -1) {
+		cp = lbuf;
+		while (*cp == ' ' || *cp == '\t')
+			++cp;
+		if (!*cp || *cp == '\n' || *cp == '#')
+			continue;
+		key = sshkey_new(KEY_UNSPEC);
+		if (key == NULL)
+			goto fail;
+		if (sshkey_read(key, &cp) != 0) {
+			sshkey_free(key);
+			continue;
+		}
+		if (aki->aki_nents >= nalloc) {
+			nalloc = (nalloc == 0) ? 16 : nalloc * 2;
+			ents = recallocarray(aki->aki_ents, aki->aki_nents,
+			    nalloc, sizeof (struct akentry));
+			if (ents == NULL) {
+				sshkey_free(key);
+				goto fail;
+			}
+			aki->aki_ents = ents;
+		}
+		if (key_fp(key, aki->aki_ents[aki->aki_nents].ake_fp) != 0) {
+			sshkey_free(key);
+			continue;
+		}
+		aki->aki_ents[aki->aki_nents++].ake_key = key;
+	}
+	free(lbuf);
+
+	qsort(aki->aki_ents, aki->aki_nents, sizeof (struct akentry),
+	    akentry_cmp);
+
+	return (aki);
+
+fail:
+	free(lbuf);
+	akindex_rele(aki);
+	return (NULL);
+}
+
+/*
+ * Returns a held index of the authorized_keys file at path (release it with
+ * akindex_rele()), re-reading the file only if it has changed since last
+ * time.
+ */
+static struct akindex *
+akindex_get(const char *path)
+{
+	struct akindex *aki, *old = NULL;
+	struct stat st;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return (NULL);
+	if (fstat(fileno(f), &st) != 0) {
+		fclose(f);
+		return (NULL);
+	}
+
+	VERIFY0(pthread_mutex_lock(&akcache_mtx));
+	aki = akcache;
+	if (aki != NULL && strcmp(aki->aki_path, path) == 0 &&
+	    aki->aki_dev == st.st_dev && aki->aki_ino == st.st_ino &&
+	    aki->aki_size == st.st_size && aki->aki_mtime == st.st_mtime &&
+	    aki->aki_ctime == st.st_ctime) {
+		++aki->aki_refcnt;
+		VERIFY0(pthread_mutex_unlock(&akcache_mtx));
+		fclose(f);
+		return (aki);
+	}
+	VERIFY0(pthread_mutex_unlock(&akcache_mtx));
+
+	aki = akindex_read(path, f, &st);
+	fclose(f);
+	if (aki == NULL)
+		return (NULL);
+
+	VERIFY0(pthread_mutex_lock(&akcache_mtx));
+	old = akcache;
+	akcache = aki;
+	++aki->aki_refcnt;
+	VERIFY0(pthread_mutex_unlock(&akcache_mtx));
+	akindex_rele(old);
+
+	return (aki);
+}
+
+static const struct sshkey *
+akindex_find(const struct akindex *aki, const struct sshkey *key)
+{
+	struct akentry ent, *found;
+
+	if (key == NULL || key_fp(key, ent.ake_fp) != 0)
+		return (NULL);
+	found = bsearch(&ent, aki->aki_ents, aki->aki_nents,
+	    sizeof (struct akentry), akentry_cmp);
+	if (found == NULL || !sshkey_equal_public(found->ake_key, key))
+		return (NULL);
+	return (found->ake_key);
+}
+
+static int
+pam_ctx_get(SCARDCONTEXT *ctx)
+{
+	int rv;
+
+	VERIFY0(pthread_mutex_lock(&akcache_mtx));
+	if (pam_ctx_valid) {
+		pam_ctx_valid = B_FALSE;
+		if (pam_ctx_pid == getpid() &&
+		    SCardIsValidContext(pam_ctx) == SCARD_S_SUCCESS) {
+			*ctx = pam_ctx;
+			VERIFY0(pthread_mutex_unlock(&akcache_mtx));
+			return (SCARD_S_SUCCESS);
+		}
+		/* Not ours to release if we've forked since. */
+		if (pam_ctx_pid == getpid())
+			(void) SCardReleaseContext(pam_ctx);
+	}
+	VERIFY0(pthread_mutex_unlock(&akcache_mtx));
+
+	rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, ctx);
+	return (rv);
+}
+
+static void
+pam_ctx_put(SCARDCONTEXT ctx)
+{
+	VERIFY0(pthread_mutex_lock(&akcache_mtx));
+	if (!pam_ctx_valid) {
+		pam_ctx = ctx;
+		pam_ctx_pid = getpid();
+		pam_ctx_valid = B_TRUE;
+		VERIFY0(pthread_mutex_unlock(&akcache_mtx));
+		return;
+	}
+	VERIFY0(pthread_mutex_unlock(&akcache_mtx));
+	(void) SCardReleaseContext(ctx);
+}
+
+/*
+ * Converts the (possibly partial) GUID in a PIV_AGENT_GUID line to bytes
+ * for piv_find(). An odd trailing digit is left off: the caller still
+ * checks the whole prefix against piv_token_guid_hex().
+ */
+static size_t
+guid_hex_prefix(const char *hex, uint8_t *guid, size_t guidlen)
+{
+	size_t i;
+	uint v;
+
+	for (i = 0; i < guidlen && hex[2 * i] != '\0' &&
+	    hex[2 * i + 1] != '\0'; ++i) {
+		if (sscanf(&hex[2 * i], "%2x", &v) != 1)
+			break;
+		guid[i] = v;
+	}
+	return (i);
+}
+
+/*
+ * Asks the user's pivy-agent for this token to sign a random challenge with
+ * one of their authorized keys (if it has one). This saves us having to go to
+ * the card ourselves if the agent already holds the PIN.
+ *
+ * Unlike the card path, the key's CAK is not checked here: the socket must be
+ * owned by the user, but anything able to sign with an authorized key passes.
+ */
+static int
+agent_auth(const struct passwd *pwent, const struct tkconfig *tkc,
+    const struct akindex *aki)
+{
+	struct ssh_identitylist *idl = NULL;
+	const struct sshkey *key = NULL;
+	struct stat st;
+	uint8_t chal[32];
+	u_char *sig = NULL;
+	size_t siglen, i;
+	int fd = -1, res = PAM_AUTHINFO_UNAVAIL;
+
+	if (stat(tkc->tkc_sockpath, &st) != 0 || !S_ISSOCK(st.st_mode) ||
+	    st.st_uid != pwent->pw_uid)
+		return (PAM_AUTHINFO_UNAVAIL);
+	if (get_agent_socket(tkc->tkc_sockpath, &fd) != 0)
+		return (PAM_AUTHINFO_UNAVAIL);
+
+	if (ssh_fetch_identitylist(fd, &idl) != 0)
+		goto out;
+	for (i = 0; i < idl->nkeys && key == NULL; ++i)
+		key = akindex_find(aki, idl->keys[i]);
+	if (key == NULL)
+		goto out;
+
+	arc4random_buf(chal, sizeof (chal));
+	if (ssh_agent_sign(fd, key, &sig, &siglen, chal, sizeof (chal),
+	    NULL, 0) != 0)
+		goto out;
+	if (sshkey_verify(key, sig, siglen, chal, sizeof (chal), 0) != 0)
+		goto out;
+
+	res = PAM_SUCCESS;
+
+out:
+	free(sig);
+	ssh_free_identitylist(idl);
+	close(fd);
+	return (res);
+}
+
 PAM_EXTERN int
 pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 {
 	const char *user, *env;
 	const struct passwd *pwent;
 	int res = PAM_AUTHINFO_UNAVAIL;
-	int rc;
+	int rc, i;
 	SCARDCONTEXT ctx;
-	struct piv_token *tokens = NULL, *token;
-	struct keylist *keys = NULL, *keyle, *nkeyle;
+	boolean_t have_ctx = B_FALSE, try_agent = B_FALSE;
+	struct piv_token *token = NULL;
+	struct akindex *aki = NULL;
 	struct tkconfig *tkcs = NULL, *tkc, *ntkc;
 	char *akpath = NULL, *lbuf = NULL, *cp, *spath = NULL, *rdir = NULL;
 	char *pin = NULL;
-	size_t lsz;
+	size_t lsz, guidlen;
+	uint8_t guid[GUID_LEN];
 	struct dirent *de;
 	struct piv_slot *slot;
 	DIR *d = NULL;
@@ -164,6 +489,12 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 	errf_t *err = NULL;
 	int fd;
 
+	for (i = 0; i < argc; ++i) {
+		if (strcmp(argv[i], "try_agent") == 0)
+			try_agent = B_TRUE;
+	}
+	piv_compact_slots = B_TRUE;
+
 	if ((res = pam_get_user(pamh, &user, NULL)) != PAM_SUCCESS)
 		return (res);
 
@@ -171,10 +502,6 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 	if (pwent == NULL)
 		return (PAM_AUTHINFO_UNAVAIL);
 
-	res = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &ctx);
-	if (res != SCARD_S_SUCCESS)
-		return (PAM_AUTHINFO_UNAVAIL);
-
 	akpath = malloc(PATH_MAX);
 	if (akpath == NULL) {
 		res = PAM_AUTHINFO_UNAVAIL;
@@ -182,39 +509,8 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 	}
 	snprintf(akpath, PATH_MAX, SSH_AUTH_KEYS, pwent->pw_dir);
 
-	f = fopen(akpath, "r");
-	if (f == NULL) {
-		res = PAM_AUTHINFO_UNAVAIL;
-		goto out;
-	}
-	while (getline(&lbuf, &lsz, f) != -1) {
-		cp = lbuf;
-		while (*cp == ' ' || *cp == '\t')
-			++cp;
-		if (!*cp || *cp == '\n' || *cp == '#')
-			continue;
-		keyle = calloc(1, sizeof (struct keylist));
-		if (keyle == NULL) {
-			res = PAM_AUTHINFO_UNAVAIL;
-			goto out;
-		}
-		keyle->kl_next = keys;
-		keyle->kl_key = sshkey_new(KEY_UNSPEC);
-		if (sshkey_read(keyle->kl_key, &cp) != 0) {
-			sshkey_free(keyle->kl_key);
-			free(keyle);
-			continue;
-		}
-		while (*cp == ' ' || *cp == '\t')
-			++cp;
-		cp[strlen(cp) - 1] = '\0';
-		keyle->kl_comment = strdup(cp);
-		keys = keyle;
-	}
-	fclose(f);
-	f = NULL;
-
-	if (keys == NULL) {
+	aki = akindex_get(akpath);
+	if (aki == NULL || aki->aki_nents == 0) {
 		res = PAM_AUTHINFO_UNAVAIL;
 		goto out;
 	}
@@ -289,66 +585,71 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 		d = NULL;
 	}
 
-	err = piv_enumerate(ctx, &tokens);
-	if (err) {
-		errf_free(err);
+	if (try_agent) {
+		for (tkc = tkcs; tkc != NULL; tkc = tkc->tkc_next) {
+			if (agent_auth(pwent, tkc, aki) == PAM_SUCCESS) {
+				res = PAM_SUCCESS;
+				goto out;
+			}
+		}
+	}
+
+	if (pam_ctx_get(&ctx) != SCARD_S_SUCCESS) {
 		res = PAM_AUTHINFO_UNAVAIL;
 		goto out;
 	}
+	have_ctx = B_TRUE;
 
-	for (token = tokens; token != NULL; token = piv_token_next(token)) {
-		int found = 0;
+	for (tkc = tkcs; tkc != NULL; tkc = tkc->tkc_next) {
+		boolean_t found = B_FALSE;
 
-		for (tkc = tkcs; tkc != NULL; tkc = tkc->tkc_next) {
-			const int cmp = strncasecmp(tkc->tkc_guidhex,
-			    piv_token_guid_hex(token),
-			    strlen(tkc->tkc_guidhex));
-			if (cmp == 0) {
-				err = piv_txn_begin(token);
-				if (err) {
-					errf_free(err);
-					continue;
-				}
+		piv_release(token);
+		token = NULL;
 
-				err = piv_select(token);
-				if (err == NULL)
-					err = piv_read_all_certs(token);
-				slot = piv_get_slot(token, PIV_SLOT_CARD_AUTH);
-				if (err == NULL && slot != NULL) {
-					err = piv_auth_key(token, slot,
-					    tkc->tkc_cak);
-				}
+		guidlen = guid_hex_prefix(tkc->tkc_guidhex, guid,
+		    sizeof (guid));
+		err = piv_find_opts(ctx, guid, guidlen, &pam_find_opts,
+		    &token);
+		if (err) {
+			errf_free(err);
+			token = NULL;
+			continue;
+		}
+		if (strncasecmp(tkc->tkc_guidhex, piv_token_guid_hex(token),
+		    strlen(tkc->tkc_guidhex)) != 0) {
+			continue;
+		}
 
-				if (err) {
-					piv_txn_end(token);
-					errf_free(err);
-					continue;
-				}
+		err = piv_txn_begin(token);
+		if (err) {
+			errf_free(err);
+			continue;
+		}
 
-				slot = NULL;
-				while ((slot = piv_slot_next(token, slot))) {
-					const struct sshkey *pubk =
-					    piv_slot_pubkey(slot);
-					for (keyle = keys; keyle != NULL;
-					    keyle = keyle->kl_next) {
-						if (sshkey_equal_public(
-						    keyle->kl_key,
-						    pubk)) {
-							found = 1;
-							break;
-						}
-					}
-					if (found)
-						break;
-				}
-				if (found)
-					break;
-				piv_txn_end(token);
-			}
+		err = piv_select(token);
+		if (err == NULL)
+			err = piv_read_all_pubkeys(token);
+		slot = piv_get_slot(token, PIV_SLOT_CARD_AUTH);
+		if (err == NULL && slot != NULL)
+			err = piv_auth_key(token, slot, tkc->tkc_cak);
+
+		if (err) {
+			piv_txn_end(token);
+			errf_free(err);
+			continue;
 		}
 
-		if (!found)
+		slot = NULL;
+		while ((slot = piv_slot_next(token, slot)) != NULL) {
+			if (akindex_find(aki, piv_slot_pubkey(slot)) != NULL) {
+				found = B_TRUE;
+				break;
+			}
+		}
+		if (!found) {
+			piv_txn_end(token);
 			continue;
+		}
 
 again:
 		err = piv_auth_key(token, slot, piv_slot_pubkey(slot));
@@ -481,12 +782,7 @@ out:
 		fclose(f);
 	if (d != NULL)
 		closedir(d);
-	for (keyle = keys; keyle != NULL; keyle = nkeyle) {
-		nkeyle = keyle->kl_next;
-		free(keyle->kl_comment);
-		sshkey_free(keyle->kl_key);
-		free(keyle);
-	}
+	akindex_rele(aki);
 	for (tkc = tkcs; tkc != NULL; tkc = ntkc) {
 		ntkc = tkc->tkc_next;
 		free(tkc->tkc_source);
@@ -504,8 +800,9 @@ out:
 		free(pin);
 		pin = NULL;
 	}
-	piv_release(tokens);
-	SCardReleaseContext(ctx);
+	piv_release(token);
+	if (have_ctx)
+		pam_ctx_put(ctx);
 
 	return (res);
 }
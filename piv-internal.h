@@ -61,6 +61,13 @@ struct piv_ecdh_box {
 	struct apdubuf pdb_iv;
 	struct apdubuf pdb_enc;
 
+	/*
+	 * If true, this struct itself, pdb_cipher/kdf and the nonce, IV and
+	 * ciphertext buffers all live in an ebox's arena (see ebox.c), and
+	 * piv_box_free() must only free the keys and the other fields.
+	 */
+	boolean_t pdb_in_arena;
+
 	/*
 	 * Never written out as part of the box structure: the in-memory
 	 * cached plaintext after we unseal a box goes here.
@@ -85,4 +92,31 @@ enum piv_certinfo_flags {
 	PIV_CI_COMPTYPE = 0x03,
 };
 
+/*
+ * A non-PCSC way to talk to a token. piv.c calls these in place of
+ * SCardTransmit(), SCardBeginTransaction() and SCardEndTransaction() when a
+ * piv_token has pt_xport set.
+ *
+ * ptr_transmit() takes a whole command APDU and writes the reply (including
+ * the SW bytes) into rbuf, setting *rlen. On input *rlen is the size of rbuf.
+ */
+struct piv_transport {
+	const char *ptr_name;
+	errf_t *(*ptr_transmit)(void *priv, const uint8_t *cmd, size_t cmdlen,
+	    uint8_t *rbuf, size_t *rlen);
+	errf_t *(*ptr_begin)(void *priv);
+	void (*ptr_end)(void *priv, boolean_t reset);
+};
+
+/* The software PIV token in piv-soft.c */
+struct piv_soft_card;
+extern const struct piv_transport piv_soft_transport;
+
+/*
+ * Walks the list of registered software tokens (start with prev = NULL).
+ * Tokens are never unregistered, so the pointers stay good.
+ */
+struct piv_soft_card *piv_soft_card_next(struct piv_soft_card *prev);
+const char *piv_soft_card_name(const struct piv_soft_card *card);
+
 #endif
@@ -0,0 +1,967 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * A software PIV token which lives in-process and plugs in underneath
+ * struct piv_token as a piv_transport (see piv-internal.h). It's meant for
+ * load-testing pivy-agent and pivy-box without USB in the way, not for
+ * keeping real keys: the private keys sit in a plain file on disk.
+ *
+ * The "applet" implements just enough of SP 800-73-4 for the rest of pivy:
+ * SELECT, GET DATA (CHUID and the certs), VERIFY (PIV PIN only) and GENERAL
+ * AUTHENTICATE for signing and ECDH. Everything else gets SW_INS_NOT_SUP.
+ * Each APDU can be delayed by a fixed latency to model a real device.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <errno.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <pthread.h>
+
+#include "libssh/ssherr.h"
+#include "libssh/sshkey.h"
+#include "libssh/sshbuf.h"
+
+#include <openssl/err.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/ecdh.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#include "utils.h"
+#include "debug.h"
+#include "tlv.h"
+#include "errf.h"
+#include "bunyan.h"
+#include "piv.h"
+#include "piv-internal.h"
+
+#define	SOFT_MAGIC		"pivy-soft-token"
+#define	SOFT_VERSION		1
+#define	SOFT_MAX_SIZE		(64 * 1024)
+#define	SOFT_MAX_SLOTS		24
+#define	SOFT_DEFAULT_PIN	"123456"
+#define	SOFT_PIN_RETRIES	3
+
+extern const uint8_t AID_PIV[11];
+
+struct piv_soft_slot {
+	enum piv_slotid pss_slot;
+	enum piv_alg pss_alg;
+	struct sshkey *pss_key;
+	/* Pre-built GET DATA reply for the cert object */
+	uint8_t *pss_certobj;
+	size_t pss_certobjlen;
+};
+
+struct piv_soft_card {
+	struct piv_soft_card *psc_next;
+	char *psc_name;
+	uint psc_latency;		/* usec, added to each APDU */
+
+	uint8_t psc_guid[GUID_LEN];
+	uint8_t psc_pin[8];		/* padded with 0xFF, as sent */
+
+	/* Pre-built replies to SELECT and GET DATA(CHUID) */
+	uint8_t *psc_select;
+	size_t psc_selectlen;
+	uint8_t *psc_chuid;
+	size_t psc_chuidlen;
+
+	struct piv_soft_slot psc_slots[SOFT_MAX_SLOTS];
+	uint psc_nslots;
+
+	/*
+	 * psc_busy plays the part of a PCSC transaction: only the token
+	 * which holds it may transmit, so the card state below it needs no
+	 * further locking.
+	 */
+	pthread_mutex_t psc_mtx;
+	pthread_cond_t psc_cv;
+	boolean_t psc_busy;
+
+	boolean_t psc_pin_ok;
+	uint psc_pin_retries;
+};
+
+static pthread_mutex_t soft_cards_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct piv_soft_card *soft_cards = NULL;
+
+static const enum piv_slotid soft_default_slots[] = {
+	PIV_SLOT_9A, PIV_SLOT_9C, PIV_SLOT_9D, PIV_SLOT_9E
+};
+
+static const uint soft_cert_tags[] = {
+	[PIV_SLOT_9A] = PIV_TAG_CERT_9A,
+	[PIV_SLOT_9C] = PIV_TAG_CERT_9C,
+	[PIV_SLOT_9D] = PIV_TAG_CERT_9D,
+	[PIV_SLOT_9E] = PIV_TAG_CERT_9E,
+};
+
+static uint
+soft_cert_tag(enum piv_slotid slotid)
+{
+	if (slotid >= PIV_SLOT_RETIRED_1 && slotid <= PIV_SLOT_RETIRED_20)
+		return (PIV_TAG_CERT_82 + (slotid - PIV_SLOT_82));
+	if (slotid < sizeof (soft_cert_tags) / sizeof (soft_cert_tags[0]))
+		return (soft_cert_tags[slotid]);
+	return (0);
+}
+
+struct piv_soft_card *
+piv_soft_card_next(struct piv_soft_card *prev)
+{
+	struct piv_soft_card *card;
+
+	if (prev != NULL)
+		return (prev->psc_next);
+	VERIFY0(pthread_mutex_lock(&soft_cards_mtx));
+	card = soft_cards;
+	VERIFY0(pthread_mutex_unlock(&soft_cards_mtx));
+	return (card);
+}
+
+const char *
+piv_soft_card_name(const struct piv_soft_card *card)
+{
+	return (card->psc_name);
+}
+
+static void
+soft_card_free(struct piv_soft_card *card)
+{
+	uint i;
+
+	if (card == NULL)
+		return;
+	for (i = 0; i < card->psc_nslots; ++i) {
+		sshkey_free(card->psc_slots[i].pss_key);
+		free(card->psc_slots[i].pss_certobj);
+	}
+	free(card->psc_select);
+	free(card->psc_chuid);
+	free(card->psc_name);
+	explicit_bzero(card->psc_pin, sizeof (card->psc_pin));
+	VERIFY0(pthread_mutex_destroy(&card->psc_mtx));
+	VERIFY0(pthread_cond_destroy(&card->psc_cv));
+	free(card);
+}
+
+static errf_t *
+soft_set_pin(struct piv_soft_card *card, const char *pin)
+{
+	size_t len = strlen(pin);
+
+	if (len < 1 || len > sizeof (card->psc_pin)) {
+		return (argerrf("pin", "a string of 1-8 characters",
+		    "%zu characters", len));
+	}
+	memset(card->psc_pin, 0xFF, sizeof (card->psc_pin));
+	bcopy(pin, card->psc_pin, len);
+	return (ERRF_OK);
+}
+
+static errf_t *
+soft_key_alg(const struct sshkey *key, enum piv_alg *alg)
+{
+	switch (key->type) {
+	case KEY_ECDSA:
+		switch (key->ecdsa_nid) {
+		case NID_X9_62_prime256v1:
+			*alg = PIV_ALG_ECCP256;
+			return (ERRF_OK);
+		case NID_secp384r1:
+			*alg = PIV_ALG_ECCP384;
+			return (ERRF_OK);
+		}
+		break;
+	case KEY_RSA:
+		switch (sshkey_size(key)) {
+		case 1024:
+			*alg = PIV_ALG_RSA1024;
+			return (ERRF_OK);
+		case 2048:
+			*alg = PIV_ALG_RSA2048;
+			return (ERRF_OK);
+		}
+		break;
+	}
+	return (errf("NotSupportedError", NULL, "Software PIV tokens only "
+	    "support P-256, P-384, RSA1024 and RSA2048 keys (got %s %u)",
+	    sshkey_type(key), sshkey_size(key)));
+}
+
+/*
+ * Makes a throwaway self-signed cert for a slot's key and wraps it up as the
+ * PIV cert object (tag 0x53), ready to send back from GET DATA.
+ */
+static errf_t *
+soft_make_certobj(struct piv_soft_card *card, struct piv_soft_slot *slot)
+{
+	errf_t *err = ERRF_OK;
+	EVP_PKEY *pkey = NULL;
+	X509 *cert = NULL;
+	X509_NAME *subj = NULL;
+	uint8_t *cdata = NULL;
+	struct tlv_state *tlv;
+	char cn[64];
+	int rv;
+
+	pkey = EVP_PKEY_new();
+	VERIFY(pkey != NULL);
+	if (slot->pss_key->type == KEY_RSA)
+		rv = EVP_PKEY_set1_RSA(pkey, slot->pss_key->rsa);
+	else
+		rv = EVP_PKEY_set1_EC_KEY(pkey, slot->pss_key->ecdsa);
+	if (rv != 1) {
+		make_sslerrf(err, "EVP_PKEY_set1", "making soft token cert");
+		goto out;
+	}
+
+	cert = X509_new();
+	VERIFY(cert != NULL);
+	VERIFY(X509_set_version(cert, 2) == 1);
+	VERIFY(ASN1_INTEGER_set(X509_get_serialNumber(cert),
+	    slot->pss_slot) == 1);
+	VERIFY(X509_gmtime_adj(X509_get_notBefore(cert), 0) != NULL);
+	VERIFY(X509_gmtime_adj(X509_get_notAfter(cert), 315360000L) != NULL);
+
+	(void) snprintf(cn, sizeof (cn), "%s slot %02X", card->psc_name,
+	    (uint)slot->pss_slot);
+	subj = X509_NAME_new();
+	VERIFY(subj != NULL);
+	VERIFY(X509_NAME_add_entry_by_NID(subj, NID_commonName,
+	    MBSTRING_ASC, (unsigned char *)cn, -1, -1, 0) == 1);
+	VERIFY(X509_set_subject_name(cert, subj) == 1);
+	VERIFY(X509_set_issuer_name(cert, subj) == 1);
+	VERIFY(X509_set_pubkey(cert, pkey) == 1);
+
+	if (X509_sign(cert, pkey, EVP_sha256()) == 0) {
+		make_sslerrf(err, "X509_sign", "making soft token cert");
+		goto out;
+	}
+	rv = i2d_X509(cert, &cdata);
+	if (cdata == NULL || rv <= 0) {
+		make_sslerrf(err, "i2d_X509", "making soft token cert");
+		goto out;
+	}
+
+	tlv = tlv_init_write();
+	tlv_push64k(tlv, 0x53);
+	tlv_push64k(tlv, 0x70);
+	tlv_write(tlv, cdata, rv);
+	tlv_pop(tlv);
+	tlv_push(tlv, 0x71);
+	tlv_write_byte(tlv, PIV_COMP_NONE);
+	tlv_pop(tlv);
+	tlv_push(tlv, 0xFE);
+	tlv_pop(tlv);
+	tlv_pop(tlv);
+
+	slot->pss_certobjlen = tlv_len(tlv);
+	slot->pss_certobj = malloc(slot->pss_certobjlen);
+	VERIFY(slot->pss_certobj != NULL);
+	bcopy(tlv_buf(tlv), slot->pss_certobj, slot->pss_certobjlen);
+	tlv_free(tlv);
+
+out:
+	OPENSSL_free(cdata);
+	X509_NAME_free(subj);
+	X509_free(cert);
+	EVP_PKEY_free(pkey);
+	return (err);
+}
+
+/* Builds the canned replies once the GUID and keys are in place. */
+static errf_t *
+soft_card_build(struct piv_soft_card *card)
+{
+	struct tlv_state *tlv;
+	errf_t *err;
+	uint i;
+
+	tlv = tlv_init_write();
+	tlv_push(tlv, 0x61);
+	tlv_push(tlv, 0x4F);
+	tlv_write(tlv, &AID_PIV[5], 4);
+	tlv_pop(tlv);
+	tlv_push(tlv, 0x79);
+	tlv_push(tlv, 0x4F);
+	tlv_write(tlv, AID_PIV, 5);
+	tlv_pop(tlv);
+	tlv_pop(tlv);
+	tlv_push(tlv, 0x50);
+	tlv_write(tlv, (const uint8_t *)"pivy soft token", 15);
+	tlv_pop(tlv);
+	tlv_push(tlv, 0xAC);
+	for (i = 0; i < card->psc_nslots; ++i) {
+		tlv_push(tlv, 0x80);
+		tlv_write_byte(tlv, card->psc_slots[i].pss_alg);
+		tlv_pop(tlv);
+	}
+	tlv_push(tlv, 0x06);
+	tlv_pop(tlv);
+	tlv_pop(tlv);
+	tlv_pop(tlv);
+	card->psc_selectlen = tlv_len(tlv);
+	card->psc_select = malloc(card->psc_selectlen);
+	VERIFY(card->psc_select != NULL);
+	bcopy(tlv_buf(tlv), card->psc_select, card->psc_selectlen);
+	tlv_free(tlv);
+
+	tlv = tlv_init_write();
+	tlv_push(tlv, 0x53);
+	tlv_push(tlv, 0x34);
+	tlv_write(tlv, card->psc_guid, sizeof (card->psc_guid));
+	tlv_pop(tlv);
+	tlv_push(tlv, 0x35);
+	tlv_write(tlv, (const uint8_t *)"20991231", 8);
+	tlv_pop(tlv);
+	tlv_push(tlv, 0x3E);
+	tlv_pop(tlv);
+	tlv_push(tlv, 0xFE);
+	tlv_pop(tlv);
+	tlv_pop(tlv);
+	card->psc_chuidlen = tlv_len(tlv);
+	card->psc_chuid = malloc(card->psc_chuidlen);
+	VERIFY(card->psc_chuid != NULL);
+	bcopy(tlv_buf(tlv), card->psc_chuid, card->psc_chuidlen);
+	tlv_free(tlv);
+
+	for (i = 0; i < card->psc_nslots; ++i) {
+		if ((err = soft_make_certobj(card, &card->psc_slots[i])))
+			return (err);
+	}
+	return (ERRF_OK);
+}
+
+static struct piv_soft_card *
+soft_card_alloc(const char *path)
+{
+	struct piv_soft_card *card;
+	const char *base;
+
+	card = calloc(1, sizeof (struct piv_soft_card));
+	VERIFY(card != NULL);
+	VERIFY0(pthread_mutex_init(&card->psc_mtx, NULL));
+	VERIFY0(pthread_cond_init(&card->psc_cv, NULL));
+	card->psc_pin_retries = SOFT_PIN_RETRIES;
+
+	if ((base = strrchr(path, '/')) != NULL)
+		++base;
+	else
+		base = path;
+	VERIFY(asprintf(&card->psc_name, "pivy soft token (%s)", base) > 0);
+	return (card);
+}
+
+static errf_t *
+soft_card_save(const struct piv_soft_card *card, const char *path)
+{
+	errf_t *err = ERRF_OK;
+	struct sshbuf *buf;
+	const uint8_t *p;
+	size_t len;
+	ssize_t n;
+	uint i;
+	int fd = -1, rv;
+
+	buf = sshbuf_new();
+	VERIFY(buf != NULL);
+	if ((rv = sshbuf_put_cstring(buf, SOFT_MAGIC)) ||
+	    (rv = sshbuf_put_u8(buf, SOFT_VERSION)) ||
+	    (rv = sshbuf_put_string(buf, card->psc_guid,
+	    sizeof (card->psc_guid))) ||
+	    (rv = sshbuf_put_string(buf, card->psc_pin,
+	    sizeof (card->psc_pin))) ||
+	    (rv = sshbuf_put_u8(buf, card->psc_nslots))) {
+		err = ssherrf("sshbuf_put", rv);
+		goto out;
+	}
+	for (i = 0; i < card->psc_nslots; ++i) {
+		if ((rv = sshbuf_put_u8(buf, card->psc_slots[i].pss_slot)) ||
+		    (rv = sshkey_private_serialize(card->psc_slots[i].pss_key,
+		    buf))) {
+			err = ssherrf("sshbuf_put", rv);
+			goto out;
+		}
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		err = errfno("open", errno, "%s", path);
+		goto out;
+	}
+	p = sshbuf_ptr(buf);
+	len = sshbuf_len(buf);
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			err = errfno("write", errno, "%s", path);
+			goto out;
+		}
+		p += n;
+		len -= n;
+	}
+	if (close(fd) != 0) {
+		fd = -1;
+		err = errfno("close", errno, "%s", path);
+		goto out;
+	}
+	fd = -1;
+
+out:
+	if (fd >= 0) {
+		(void) close(fd);
+		(void) unlink(path);
+	}
+	sshbuf_free(buf);
+	return (err);
+}
+
+static errf_t *
+soft_card_generate(const char *path, struct piv_soft_card **cardp)
+{
+	struct piv_soft_card *card;
+	struct piv_soft_slot *slot;
+	errf_t *err;
+	uint i;
+	int rv;
+
+	card = soft_card_alloc(path);
+	arc4random_buf(card->psc_guid, sizeof (card->psc_guid));
+	if ((err = soft_set_pin(card, SOFT_DEFAULT_PIN)))
+		goto out;
+	for (i = 0; i < sizeof (soft_default_slots) /
+	    sizeof (soft_default_slots[0]); ++i) {
+		slot = &card->psc_slots[card->psc_nslots];
+		slot->pss_slot = soft_default_slots[i];
+		slot->pss_alg = PIV_ALG_ECCP256;
+		if ((rv = sshkey_generate(KEY_ECDSA, 256, &slot->pss_key))) {
+			err = ssherrf("sshkey_generate", rv);
+			goto out;
+		}
+		++card->psc_nslots;
+	}
+	if ((err = soft_card_save(card, path)))
+		goto out;
+
+	bunyan_log(BNY_INFO, "generated new soft PIV token",
+	    "path", BNY_STRING, path,
+	    "guid", BNY_BIN_HEX, card->psc_guid, sizeof (card->psc_guid),
+	    NULL);
+
+	*cardp = card;
+	card = NULL;
+out:
+	soft_card_free(card);
+	return (err);
+}
+
+static errf_t *
+soft_card_load(const char *path, struct piv_soft_card **cardp)
+{
+	errf_t *err = ERRF_OK;
+	struct piv_soft_card *card = NULL;
+	struct piv_soft_slot *slot;
+	struct sshbuf *buf = NULL;
+	struct stat st;
+	char *magic = NULL;
+	const uint8_t *guid, *pin;
+	size_t guidlen, pinlen;
+	uint8_t ver, nslots, slotid, i;
+	ssize_t n;
+	int fd = -1, rv;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		if (errno == ENOENT)
+			return (soft_card_generate(path, cardp));
+		return (errfno("open", errno, "%s", path));
+	}
+	if (fstat(fd, &st) != 0) {
+		err = errfno("fstat", errno, "%s", path);
+		goto out;
+	}
+	if (st.st_size <= 0 || st.st_size > SOFT_MAX_SIZE) {
+		err = errf("InvalidDataError", NULL, "Soft token file '%s' "
+		    "has invalid size %lld", path, (long long)st.st_size);
+		goto out;
+	}
+	buf = sshbuf_new();
+	VERIFY(buf != NULL);
+	while ((size_t)st.st_size > sshbuf_len(buf)) {
+		uint8_t *p;
+		size_t want = st.st_size - sshbuf_len(buf);
+		if ((rv = sshbuf_reserve(buf, want, &p))) {
+			err = ssherrf("sshbuf_reserve", rv);
+			goto out;
+		}
+		n = read(fd, p, want);
+		if (n <= 0) {
+			err = errfno("read", n < 0 ? errno : EIO, "%s", path);
+			goto out;
+		}
+		VERIFY0(sshbuf_consume_end(buf, want - n));
+	}
+
+	if ((rv = sshbuf_get_cstring(buf, &magic, NULL)) ||
+	    (rv = sshbuf_get_u8(buf, &ver)) ||
+	    (rv = sshbuf_get_string_direct(buf, &guid, &guidlen)) ||
+	    (rv = sshbuf_get_string_direct(buf, &pin, &pinlen)) ||
+	    (rv = sshbuf_get_u8(buf, &nslots))) {
+		err = ssherrf("sshbuf_get", rv);
+		goto bad;
+	}
+	if (strcmp(magic, SOFT_MAGIC) != 0 || ver != SOFT_VERSION) {
+		err = errf("NotSupportedError", NULL, "Soft token file '%s' "
+		    "is of unknown format or version", path);
+		goto out;
+	}
+	card = soft_card_alloc(path);
+	if (guidlen != sizeof (card->psc_guid) ||
+	    pinlen != sizeof (card->psc_pin) || nslots > SOFT_MAX_SLOTS) {
+		err = errf("LengthError", NULL, "GUID, PIN or slot count "
+		    "is invalid");
+		goto bad;
+	}
+	bcopy(guid, card->psc_guid, guidlen);
+	bcopy(pin, card->psc_pin, pinlen);
+
+	for (i = 0; i < nslots; ++i) {
+		slot = &card->psc_slots[card->psc_nslots];
+		if ((rv = sshbuf_get_u8(buf, &slotid)) ||
+		    (rv = sshkey_private_deserialize(buf, &slot->pss_key))) {
+			err = ssherrf("sshbuf_get", rv);
+			goto bad;
+		}
+		++card->psc_nslots;
+		slot->pss_slot = slotid;
+		if (soft_cert_tag(slotid) == 0) {
+			err = errf("NotSupportedError", NULL, "Slot %02x is "
+			    "not supported", (uint)slotid);
+			goto bad;
+		}
+		if ((err = soft_key_alg(slot->pss_key, &slot->pss_alg)))
+			goto bad;
+	}
+
+	*cardp = card;
+	card = NULL;
+
+out:
+	if (fd >= 0)
+		(void) close(fd);
+	soft_card_free(card);
+	sshbuf_free(buf);
+	free(magic);
+	return (err);
+
+bad:
+	err = errf("InvalidDataError", err, "Soft token file '%s' is "
+	    "corrupt", path);
+	goto out;
+}
+
+errf_t *
+piv_soft_card_add(const char *path, uint latency_usec)
+{
+	struct piv_soft_card *card = NULL;
+	errf_t *err;
+
+	if ((err = soft_card_load(path, &card)))
+		goto out;
+	card->psc_latency = latency_usec;
+	if ((err = soft_card_build(card)))
+		goto out;
+
+	VERIFY0(pthread_mutex_lock(&soft_cards_mtx));
+	card->psc_next = soft_cards;
+	soft_cards = card;
+	VERIFY0(pthread_mutex_unlock(&soft_cards_mtx));
+
+	bunyan_log(BNY_DEBUG, "registered soft PIV token",
+	    "name", BNY_STRING, card->psc_name,
+	    "latency_usec", BNY_UINT, latency_usec, NULL);
+	card = NULL;
+
+out:
+	soft_card_free(card);
+	if (err) {
+		err = errf("SoftTokenError", err, "Failed to set up soft PIV "
+		    "token from '%s'", path);
+	}
+	return (err);
+}
+
+errf_t *
+piv_soft_card_add_env(void)
+{
+	const char *path, *lat;
+	char *p;
+	unsigned long parsed;
+	uint latency = 0;
+
+	if ((path = getenv("PIVY_SOFT_TOKEN")) == NULL || *path == '\0')
+		return (ERRF_OK);
+	if ((lat = getenv("PIVY_SOFT_TOKEN_LATENCY")) != NULL) {
+		errno = 0;
+		parsed = strtoul(lat, &p, 10);
+		if (errno != 0 || *lat == '\0' || *p != '\0' ||
+		    lat[0] == '-' || parsed > 10000000) {
+			return (argerrf("PIVY_SOFT_TOKEN_LATENCY",
+			    "a latency in microseconds (at most 10000000)",
+			    "'%s'", lat));
+		}
+		latency = parsed;
+	}
+	return (piv_soft_card_add(path, latency));
+}
+
+static struct piv_soft_slot *
+soft_find_slot(struct piv_soft_card *card, uint slotid)
+{
+	uint i;
+
+	for (i = 0; i < card->psc_nslots; ++i) {
+		if (card->psc_slots[i].pss_slot == slotid)
+			return (&card->psc_slots[i]);
+	}
+	return (NULL);
+}
+
+/*
+ * Each handler writes its reply data into out (of size *outlen, which it
+ * updates) and returns the status word.
+ */
+static uint
+soft_select(struct piv_soft_card *card, uint p1, const uint8_t *data,
+    size_t len, uint8_t *out, size_t *outlen)
+{
+	if (p1 != SEL_APP_AID || len < 5 || len > sizeof (AID_PIV) ||
+	    bcmp(data, AID_PIV, len) != 0) {
+		return (SW_FILE_NOT_FOUND);
+	}
+	if (card->psc_selectlen > *outlen)
+		return (SW_OUT_OF_MEMORY);
+	bcopy(card->psc_select, out, card->psc_selectlen);
+	*outlen = card->psc_selectlen;
+	return (SW_NO_ERROR);
+}
+
+static uint
+soft_get_data(struct piv_soft_card *card, const uint8_t *data, size_t len,
+    uint8_t *out, size_t *outlen)
+{
+	struct tlv_state stlv, *tlv;
+	const uint8_t *obj = NULL;
+	size_t objlen = 0;
+	uint tag, i;
+	uint32_t objtag;
+	errf_t *err;
+
+	tlv = tlv_init_local(&stlv, data, 0, len);
+	if ((err = tlv_read_tag(tlv, &tag)))
+		goto bad;
+	if (tag != 0x5C) {
+		tlv_skip(tlv);
+		goto nf;
+	}
+	if ((err = tlv_read_u8to32(tlv, &objtag)) || (err = tlv_end(tlv)))
+		goto bad;
+
+	if (objtag == PIV_TAG_CHUID) {
+		obj = card->psc_chuid;
+		objlen = card->psc_chuidlen;
+	}
+	for (i = 0; obj == NULL && i < card->psc_nslots; ++i) {
+		if (soft_cert_tag(card->psc_slots[i].pss_slot) == objtag) {
+			obj = card->psc_slots[i].pss_certobj;
+			objlen = card->psc_slots[i].pss_certobjlen;
+		}
+	}
+	if (obj == NULL)
+		return (SW_FILE_NOT_FOUND);
+	if (objlen > *outlen)
+		return (SW_OUT_OF_MEMORY);
+	bcopy(obj, out, objlen);
+	*outlen = objlen;
+	return (SW_NO_ERROR);
+
+nf:
+	tlv_abort(tlv);
+	return (SW_FILE_NOT_FOUND);
+bad:
+	errf_free(err);
+	tlv_abort(tlv);
+	return (SW_WRONG_DATA);
+}
+
+static uint
+soft_verify(struct piv_soft_card *card, uint p1, uint p2,
+    const uint8_t *data, size_t len)
+{
+	if (p2 != PIV_PIN)
+		return (SW_INCORRECT_P1P2);
+	if (p1 == 0xFF && len == 0) {
+		card->psc_pin_ok = B_FALSE;
+		return (SW_NO_ERROR);
+	}
+	if (p1 != 0x00)
+		return (SW_INCORRECT_P1P2);
+	if (len == 0) {
+		if (card->psc_pin_ok)
+			return (SW_NO_ERROR);
+		return (SW_INCORRECT_PIN | card->psc_pin_retries);
+	}
+	if (len != sizeof (card->psc_pin))
+		return (SW_WRONG_DATA);
+	if (card->psc_pin_retries == 0)
+		return (SW_FILE_INVALID);
+	if (timingsafe_bcmp(data, card->psc_pin, len) != 0) {
+		card->psc_pin_ok = B_FALSE;
+		--card->psc_pin_retries;
+		return (SW_INCORRECT_PIN | card->psc_pin_retries);
+	}
+	card->psc_pin_ok = B_TRUE;
+	card->psc_pin_retries = SOFT_PIN_RETRIES;
+	return (SW_NO_ERROR);
+}
+
+static uint
+soft_gen_auth(struct piv_soft_card *card, uint p1, uint p2,
+    const uint8_t *data, size_t len, uint8_t *out, size_t *outlen)
+{
+	struct tlv_state stlv, *tlv;
+	struct tlv_state wtlv, *wt;
+	struct piv_soft_slot *slot;
+	const uint8_t *chal = NULL, *exp = NULL;
+	size_t challen = 0, explen = 0, reslen, fieldlen;
+	uint8_t res[512];
+	uint tag;
+	errf_t *err;
+	EC_POINT *pt;
+	const EC_GROUP *g;
+	unsigned int siglen;
+	int rv;
+
+	if ((slot = soft_find_slot(card, p2)) == NULL)
+		return (SW_WRONG_DATA);
+	if (p1 != slot->pss_alg)
+		return (SW_INCORRECT_P1P2);
+	if (slot->pss_slot != PIV_SLOT_9E && !card->psc_pin_ok)
+		return (SW_SECURITY_STATUS_NOT_SATISFIED);
+
+	tlv = tlv_init_local(&stlv, data, 0, len);
+	if ((err = tlv_read_tag(tlv, &tag)))
+		goto bad;
+	if (tag != 0x7C) {
+		tlv_skip(tlv);
+		tlv_abort(tlv);
+		return (SW_WRONG_DATA);
+	}
+	while (!tlv_at_end(tlv)) {
+		if ((err = tlv_read_tag(tlv, &tag)))
+			goto bad;
+		switch (tag) {
+		case 0x81:	/* GA_TAG_CHALLENGE */
+			if ((err = tlv_read_ref(tlv, &chal, &challen)) ||
+			    (err = tlv_end(tlv)))
+				goto bad;
+			break;
+		case 0x85:	/* GA_TAG_EXP */
+			if ((err = tlv_read_ref(tlv, &exp, &explen)) ||
+			    (err = tlv_end(tlv)))
+				goto bad;
+			break;
+		default:
+			tlv_skip(tlv);
+			break;
+		}
+	}
+	if ((err = tlv_end(tlv)))
+		goto bad;
+
+	if (chal != NULL && slot->pss_key->type == KEY_RSA) {
+		if (challen != (size_t)RSA_size(slot->pss_key->rsa))
+			return (SW_WRONG_DATA);
+		rv = RSA_private_encrypt(challen, chal, res,
+		    slot->pss_key->rsa, RSA_NO_PADDING);
+		if (rv <= 0)
+			return (SW_WRONG_DATA);
+		reslen = rv;
+
+	} else if (chal != NULL) {
+		siglen = ECDSA_size(slot->pss_key->ecdsa);
+		VERIFY3U(siglen, <=, sizeof (res));
+		if (ECDSA_sign(0, chal, challen, res, &siglen,
+		    slot->pss_key->ecdsa) != 1) {
+			return (SW_WRONG_DATA);
+		}
+		reslen = siglen;
+
+	} else if (exp != NULL && slot->pss_key->type == KEY_ECDSA) {
+		g = EC_KEY_get0_group(slot->pss_key->ecdsa);
+		fieldlen = (EC_GROUP_get_degree(g) + 7) / 8;
+		pt = EC_POINT_new(g);
+		VERIFY(pt != NULL);
+		if (EC_POINT_oct2point(g, pt, exp, explen, NULL) != 1) {
+			EC_POINT_free(pt);
+			return (SW_WRONG_DATA);
+		}
+		rv = ECDH_compute_key(res, fieldlen, pt, slot->pss_key->ecdsa,
+		    NULL);
+		EC_POINT_free(pt);
+		if (rv <= 0)
+			return (SW_WRONG_DATA);
+		reslen = rv;
+
+	} else {
+		return (SW_WRONG_DATA);
+	}
+
+	if (tlv_hdr_len(0x7C, tlv_hdr_len(0x82, reslen) + reslen) +
+	    tlv_hdr_len(0x82, reslen) + reslen > *outlen) {
+		explicit_bzero(res, sizeof (res));
+		return (SW_OUT_OF_MEMORY);
+	}
+	wt = tlv_init_write_local(&wtlv, out, *outlen);
+	tlv_pushl(wt, 0x7C, tlv_hdr_len(0x82, reslen) + reslen);
+	tlv_pushl(wt, 0x82, reslen);
+	tlv_write(wt, res, reslen);
+	tlv_pop(wt);
+	tlv_pop(wt);
+	*outlen = tlv_len(wt);
+	tlv_free(wt);
+	explicit_bzero(res, sizeof (res));
+	return (SW_NO_ERROR);
+
+bad:
+	errf_free(err);
+	tlv_abort(tlv);
+	return (SW_WRONG_DATA);
+}
+
+static errf_t *
+soft_transmit(void *priv, const uint8_t *cmd, size_t cmdlen, uint8_t *rbuf,
+    size_t *rlen)
+{
+	struct piv_soft_card *card = priv;
+	const uint8_t *data = NULL;
+	size_t len = 0, outlen;
+	uint cla, ins, p1, p2, sw;
+
+	VERIFY(card->psc_busy);
+	if (*rlen < 2 || cmdlen < 4) {
+		return (errf("APDUError", NULL, "APDU buffers too short "
+		    "(cmd %zu, reply %zu)", cmdlen, *rlen));
+	}
+
+	if (card->psc_latency > 0)
+		(void) usleep(card->psc_latency);
+
+	cla = cmd[0];
+	ins = cmd[1];
+	p1 = cmd[2];
+	p2 = cmd[3];
+	/*
+	 * Short form: Lc is one byte. Extended form: a zero byte and then a
+	 * 2-byte Lc. In both, a command of only the header plus Le has no
+	 * data at all.
+	 */
+	if (cmdlen > 5 && cmd[4] != 0) {
+		len = cmd[4];
+		data = &cmd[5];
+		if (5 + len > cmdlen)
+			len = 0;
+	} else if (cmdlen > 7 && cmd[4] == 0) {
+		len = (cmd[5] << 8) | cmd[6];
+		data = &cmd[7];
+		if (7 + len > cmdlen)
+			len = 0;
+	}
+
+	outlen = *rlen - 2;
+	if (cla & CLA_CHAIN) {
+		/* Nothing we handle needs a command chain. */
+		sw = SW_FUNC_NOT_SUPPORTED;
+	} else if (cla != CLA_ISO) {
+		sw = SW_INS_NOT_SUP;
+	} else {
+		switch (ins) {
+		case INS_SELECT:
+			sw = soft_select(card, p1, data, len, rbuf, &outlen);
+			break;
+		case INS_GET_DATA:
+			sw = soft_get_data(card, data, len, rbuf, &outlen);
+			break;
+		case INS_VERIFY:
+			sw = soft_verify(card, p1, p2, data, len);
+			break;
+		case INS_GEN_AUTH:
+			sw = soft_gen_auth(card, p1, p2, data, len, rbuf,
+			    &outlen);
+			break;
+		default:
+			sw = SW_INS_NOT_SUP;
+			break;
+		}
+	}
+	if (sw != SW_NO_ERROR)
+		outlen = 0;
+
+	rbuf[outlen] = sw >> 8;
+	rbuf[outlen + 1] = sw & 0xFF;
+	*rlen = outlen + 2;
+	return (ERRF_OK);
+}
+
+static errf_t *
+soft_begin(void *priv)
+{
+	struct piv_soft_card *card = priv;
+
+	VERIFY0(pthread_mutex_lock(&card->psc_mtx));
+	while (card->psc_busy)
+		VERIFY0(pthread_cond_wait(&card->psc_cv, &card->psc_mtx));
+	card->psc_busy = B_TRUE;
+	VERIFY0(pthread_mutex_unlock(&card->psc_mtx));
+	return (ERRF_OK);
+}
+
+static void
+soft_end(void *priv, boolean_t reset)
+{
+	struct piv_soft_card *card = priv;
+
+	VERIFY0(pthread_mutex_lock(&card->psc_mtx));
+	VERIFY(card->psc_busy);
+	if (reset)
+		card->psc_pin_ok = B_FALSE;
+	card->psc_busy = B_FALSE;
+	VERIFY0(pthread_cond_signal(&card->psc_cv));
+	VERIFY0(pthread_mutex_unlock(&card->psc_mtx));
+}
+
+const struct piv_transport piv_soft_transport = {
+	.ptr_name = "soft",
+	.ptr_transmit = soft_transmit,
+	.ptr_begin = soft_begin,
+	.ptr_end = soft_end,
+};
@@ -37,9 +37,13 @@
 #include <sys/mman.h>
 #include <sys/errno.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
 
+#include <pthread.h>
+
 #include <zlib.h>
 
 #include "libssh/ssherr.h"
@@ -58,17 +62,35 @@
 #include "bunyan.h"
 #include "utils.h"
 #include "debug.h"
+#include "probes.h"
 
 /* Contains structs apdubuf, piv_ecdh_box, and enum piv_box_version */
 #include "piv-internal.h"
 
 #define	PIV_MAX_CERT_LEN		16384
 
+/*
+ * Largest command segment we send in one extended-length APDU. Cards don't
+ * tell us their real buffer size without reading EF.ATR, so stay under what
+ * YubiKey 4/5 accept (3052 bytes) and chain anything bigger.
+ */
+#define	PIV_EXT_MAX_LC			2048
+
+/* Longest command apdu_to_buffer() can produce (extended Lc and Le). */
+#define	PIV_APDU_CMD_MAX		(PIV_EXT_MAX_LC + 9)
+
+/* Number of APDUs a token can lend out at once from its pool. */
+#define	PIV_APDU_POOL_SIZE		4
+
 const uint8_t AID_PIV[] = {
 	0xA0, 0x00, 0x00, 0x03, 0x08, 0x00, 0x00, 0x10, 0x00, 0x01, 0x00
 };
 
 boolean_t piv_full_apdu_debug = B_FALSE;
+const char *piv_cert_cache_dir = NULL;
+boolean_t piv_compact_slots = B_FALSE;
+piv_apdu_observer_t piv_apdu_observer = NULL;
+boolean_t piv_apdu_recording = B_TRUE;
 
 #define pcscerrf(call, rv)	\
     errf("PCSCError", NULL, call " failed: %d (%s)", \
@@ -133,10 +155,33 @@ struct apdu {
 	uint8_t a_p1;
 	uint8_t a_p2;
 	uint8_t a_le;
+	/*
+	 * If non-zero, this APDU is sent in extended-length form and this
+	 * is the Le to encode (65536 is sent as 0x0000).
+	 */
+	uint32_t a_extle;
 
 	struct apdubuf a_cmd;
 	uint16_t a_sw;
 	struct apdubuf a_reply;
+
+	/* If borrowed with piv_apdu_borrow(), the arena we live in. */
+	struct piv_apdu_arena *a_arena;
+};
+
+/*
+ * One entry in a token's APDU pool: an apdu plus fixed-size buffers for the
+ * encoded command and the reply, so that borrowing one does no allocation.
+ * The whole pool is allocated with calloc_conceal() since both buffers see
+ * PINs and key material, and each buffer is wiped before going back.
+ */
+struct piv_apdu_arena {
+	struct apdu pa_apdu;
+	boolean_t pa_inuse;
+	/* How much of pa_reply has been written to (and must be wiped) */
+	size_t pa_used;
+	uint8_t pa_cmd[PIV_APDU_CMD_MAX];
+	uint8_t pa_reply[MAX_APDU_SIZE];
 };
 
 /* Tags used in the GENERAL AUTHENTICATE command. */
@@ -147,6 +192,12 @@ enum gen_auth_tag {
 	GA_TAG_EXP = 0x85,
 };
 
+/*
+ * Big enough for the GENERAL AUTHENTICATE commands we build for signing and
+ * ECDH: a 256-byte RSA2048 input or a 97-byte P-384 point plus tags.
+ */
+#define	PIV_GA_CMD_MAX	512
+
 /* Tags used in the response to select on the PIV applet. */
 enum piv_sel_tag {
 	PIV_TAG_APT = 0x61,
@@ -172,6 +223,13 @@ struct piv_slot {
 	enum piv_slot_auth ps_auth;
 
 	boolean_t ps_got_metadata;
+
+	/*
+	 * SHA-256 of the DER cert we last read for this slot. Kept even when
+	 * ps_x509 isn't (see piv_compact_slots).
+	 */
+	boolean_t ps_have_cert_hash;
+	uint8_t ps_cert_hash[32];
 };
 
 struct piv_token {
@@ -187,9 +245,38 @@ struct piv_token {
 	SCARDHANDLE pt_cardhdl;
 	DWORD pt_proto;
 	SCARD_IO_REQUEST pt_sendpci;
+	/*
+	 * If pt_ownctx is set, pt_ctx is a PCSC context we established just
+	 * for this token (see piv_probe_readers()) and release with it.
+	 */
+	SCARDCONTEXT pt_ctx;
+	boolean_t pt_ownctx;
+	/*
+	 * If set, this token doesn't talk PCSC at all: APDUs and transactions
+	 * go through pt_xport instead (e.g. a software token from piv-soft.c)
+	 * and pt_cardhdl/pt_proto/pt_sendpci are unused.
+	 */
+	const struct piv_transport *pt_xport;
+	void *pt_xport_priv;
+	/*
+	 * Can we send extended-length APDUs to this card? Set from the ATR
+	 * or the YubicoPIV version, and cleared again if the card or reader
+	 * turns out to refuse them.
+	 */
+	boolean_t pt_extlen;
+
+	/* Pool for piv_apdu_borrow(), PIV_APDU_POOL_SIZE long (lazy) */
+	struct piv_apdu_arena *pt_apdu_pool;
 
 	/* Are we in a transaction right now? */
 	boolean_t pt_intxn;
+	/*
+	 * Did we select the PIV applet, and has nothing happened since that
+	 * could have changed that? See piv_select_cached(). pt_evcount is the
+	 * reader's event counter at the time.
+	 */
+	boolean_t pt_selected;
+	DWORD pt_evcount;
 	/*
 	 * Do we need to reset at the end of this txn? (e.g. because we sent
 	 * a PIN VERIFY command and it succeeded)
@@ -209,6 +296,14 @@ struct piv_token {
 	/* Is it signed? */
 	boolean_t pt_signedchuid;
 
+	/*
+	 * SHA-256 of the raw CHUID and Key History objects as read from the
+	 * card (zero if absent). These are what decide whether an entry in
+	 * piv_cert_cache_dir is still good for this token.
+	 */
+	uint8_t pt_chuid_dg[32];
+	uint8_t pt_keyhist_dg[32];
+
 	/* Fields from the CHUID file. */
 	uint8_t pt_fascn[26];
 	size_t pt_fascn_len;
@@ -255,8 +350,19 @@ struct piv_token {
 
 	boolean_t pt_ykserial_valid;	/* YubiKey serial # only on YK5 */
 	uint32_t pt_ykserial;
+
+	/*
+	 * Which of the objects above (PIV_READ_* flags) we've read. Whatever
+	 * piv_enumerate_opts() was told to skip is filled in by
+	 * piv_token_lazy_load() the first time something asks for it.
+	 */
+	uint pt_loaded;
 };
 
+static void piv_apdu_pool_free(struct piv_token *);
+static void piv_cert_cache_forget(struct piv_token *);
+static void piv_token_lazy_load(const struct piv_token *, uint);
+
 /* Helper to dump out APDU data */
 static inline void
 debug_dump(errf_t *err, struct apdu *apdu)
@@ -327,6 +433,7 @@ piv_token_in_txn(const struct piv_token *token)
 const uint8_t *
 piv_token_fascn(const struct piv_token *token, size_t *len)
 {
+	piv_token_lazy_load(token, PIV_READ_CHUID);
 	if (token->pt_fascn_len == 0) {
 		*len = 0;
 		return (NULL);
@@ -338,6 +445,7 @@ piv_token_fascn(const struct piv_token *token, size_t *len)
 const uint8_t *
 piv_token_guid(const struct piv_token *token)
 {
+	piv_token_lazy_load(token, PIV_READ_CHUID);
 	if (token->pt_nochuid)
 		return (NULL);
 	return (token->pt_guid);
@@ -346,6 +454,7 @@ piv_token_guid(const struct piv_token *token)
 const char *
 piv_token_guid_hex(const struct piv_token *token)
 {
+	piv_token_lazy_load(token, PIV_READ_CHUID);
 	if (token->pt_nochuid)
 		return (NULL);
 	if (token->pt_guidhex == NULL) {
@@ -359,6 +468,7 @@ piv_token_guid_hex(const struct piv_token *token)
 const uint8_t *
 piv_token_chuuid(const struct piv_token *token)
 {
+	piv_token_lazy_load(token, PIV_READ_CHUID);
 	if (token->pt_nochuid || !token->pt_haschuuid)
 		return (NULL);
 	return (token->pt_chuuid);
@@ -367,6 +477,7 @@ piv_token_chuuid(const struct piv_token *token)
 const uint8_t *
 piv_token_expiry(const struct piv_token *token, size_t *len)
 {
+	piv_token_lazy_load(token, PIV_READ_CHUID);
 	if (token->pt_nochuid) {
 		*len = 0;
 		return (NULL);
@@ -391,24 +502,28 @@ piv_token_alg(const struct piv_token *token, size_t idx)
 boolean_t
 piv_token_has_chuid(const struct piv_token *token)
 {
+	piv_token_lazy_load(token, PIV_READ_CHUID);
 	return (!token->pt_nochuid);
 }
 
 boolean_t
 piv_token_has_signed_chuid(const struct piv_token *token)
 {
+	piv_token_lazy_load(token, PIV_READ_CHUID);
 	return (token->pt_signedchuid);
 }
 
 enum piv_pin
 piv_token_default_auth(const struct piv_token *token)
 {
+	piv_token_lazy_load(token, PIV_READ_DISCOV);
 	return (token->pt_auth);
 }
 
 boolean_t
 piv_token_has_auth(const struct piv_token *token, enum piv_pin auth)
 {
+	piv_token_lazy_load(token, PIV_READ_DISCOV);
 	switch (auth) {
 	case PIV_PIN:
 		return (token->pt_pin_app);
@@ -426,24 +541,28 @@ piv_token_has_auth(const struct piv_token *token, enum piv_pin auth)
 boolean_t
 piv_token_has_vci(const struct piv_token *token)
 {
+	piv_token_lazy_load(token, PIV_READ_DISCOV);
 	return (token->pt_vci);
 }
 
 uint
 piv_token_keyhistory_oncard(const struct piv_token *token)
 {
+	piv_token_lazy_load(token, PIV_READ_KEYHIST);
 	return (token->pt_hist_oncard);
 }
 
 uint
 piv_token_keyhistory_offcard(const struct piv_token *token)
 {
+	piv_token_lazy_load(token, PIV_READ_KEYHIST);
 	return (token->pt_hist_offcard);
 }
 
 const char *
 piv_token_offcard_url(const struct piv_token *token)
 {
+	piv_token_lazy_load(token, PIV_READ_KEYHIST);
 	return (token->pt_hist_url);
 }
 
@@ -462,12 +581,14 @@ piv_token_app_uri(const struct piv_token *token)
 boolean_t
 piv_token_is_ykpiv(const struct piv_token *token)
 {
+	piv_token_lazy_load(token, PIV_READ_YKPIV);
 	return (token->pt_ykpiv);
 }
 
 const uint8_t *
 ykpiv_token_version(const struct piv_token *token)
 {
+	piv_token_lazy_load(token, PIV_READ_YKPIV);
 	VERIFY(token->pt_ykpiv);
 	return (token->pt_ykver);
 }
@@ -476,6 +597,7 @@ int
 ykpiv_version_compare(const struct piv_token *token, uint8_t major,
     uint8_t minor, uint8_t patch)
 {
+	piv_token_lazy_load(token, PIV_READ_YKPIV);
 	VERIFY(token->pt_ykpiv);
 	if (token->pt_ykver[0] < major)
 		return (-1);
@@ -495,6 +617,7 @@ ykpiv_version_compare(const struct piv_token *token, uint8_t major,
 boolean_t
 ykpiv_token_has_serial(const struct piv_token *token)
 {
+	piv_token_lazy_load(token, PIV_READ_YKPIV);
 	VERIFY(token->pt_ykpiv);
 	return (token->pt_ykserial_valid);
 }
@@ -502,6 +625,7 @@ ykpiv_token_has_serial(const struct piv_token *token)
 uint32_t
 ykpiv_token_serial(const struct piv_token *token)
 {
+	piv_token_lazy_load(token, PIV_READ_YKPIV);
 	VERIFY(token->pt_ykpiv);
 	VERIFY(token->pt_ykserial_valid);
 	return (token->pt_ykserial);
@@ -600,7 +724,7 @@ ykpiv_get_version(struct piv_token *pk)
 
 	VERIFY(pk->pt_intxn == B_TRUE);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GET_VER, 0x00, 0x00);
+	apdu = piv_apdu_borrow(pk, CLA_ISO, INS_GET_VER, 0x00, 0x00);
 
 	err = piv_apdu_transceive_chain(pk, apdu);
 	if (err) {
@@ -621,6 +745,9 @@ ykpiv_get_version(struct piv_token *pk)
 		}
 		pk->pt_ykpiv = B_TRUE;
 		bcopy(reply, pk->pt_ykver, 3);
+		/* YubiKey 4 and later take extended APDUs over T=1 */
+		if (pk->pt_ykver[0] >= 4 && pk->pt_proto == SCARD_PROTOCOL_T1)
+			pk->pt_extlen = B_TRUE;
 		err = NULL;
 	} else {
 		err = notsuperrf(swerrf("INS_YK_GET_VER", apdu->a_sw),
@@ -648,7 +775,7 @@ ykpiv_read_serial(struct piv_token *pt)
 
 	VERIFY(pt->pt_intxn);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GET_SERIAL, 0x00, 0x00);
+	apdu = piv_apdu_borrow(pt, CLA_ISO, INS_GET_SERIAL, 0x00, 0x00);
 
 	err = piv_apdu_transceive_chain(pt, apdu);
 	if (err) {
@@ -690,6 +817,7 @@ piv_read_discov(struct piv_token *pk)
 	errf_t *err;
 	struct apdu *apdu;
 	struct tlv_state *tlv;
+	struct tlv_state rtlv;
 	uint tag, policy;
 
 	VERIFY(pk->pt_intxn == B_TRUE);
@@ -699,7 +827,7 @@ piv_read_discov(struct piv_token *pk)
 	tlv_write_u8to32(tlv, PIV_TAG_DISCOV);
 	tlv_pop(tlv);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
+	apdu = piv_apdu_borrow(pk, CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -717,8 +845,8 @@ piv_read_discov(struct piv_token *pk)
 	if (apdu->a_sw == SW_NO_ERROR ||
 	    (apdu->a_sw & 0xFF00) == SW_WARNING_NO_CHANGE_00 ||
 	    (apdu->a_sw & 0xFF00) == SW_WARNING_00) {
-		tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
-		    apdu->a_reply.b_len);
+		tlv = tlv_init_local(&rtlv, apdu->a_reply.b_data,
+		    apdu->a_reply.b_offset, apdu->a_reply.b_len);
 		if ((err = tlv_read_tag(tlv, &tag)))
 			goto invdata;
 		if (tag != 0x7E) {
@@ -822,6 +950,7 @@ piv_read_keyhist(struct piv_token *pk)
 	errf_t *rv;
 	struct apdu *apdu;
 	struct tlv_state *tlv;
+	struct tlv_state rtlv;
 	uint tag, uval;
 
 	VERIFY(pk->pt_intxn == B_TRUE);
@@ -831,7 +960,7 @@ piv_read_keyhist(struct piv_token *pk)
 	tlv_write_u8to32(tlv, PIV_TAG_KEYHIST);
 	tlv_pop(tlv);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
+	apdu = piv_apdu_borrow(pk, CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -855,8 +984,12 @@ piv_read_keyhist(struct piv_token *pk)
 			    "INS_GET_DATA(KEYHIST)");
 			goto invdata;
 		}
-		tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
-		    apdu->a_reply.b_len);
+		VERIFY0(ssh_digest_memory(SSH_DIGEST_SHA256,
+		    apdu->a_reply.b_data + apdu->a_reply.b_offset,
+		    apdu->a_reply.b_len, pk->pt_keyhist_dg,
+		    sizeof (pk->pt_keyhist_dg)));
+		tlv = tlv_init_local(&rtlv, apdu->a_reply.b_data,
+		    apdu->a_reply.b_offset, apdu->a_reply.b_len);
 		if ((rv = tlv_read_tag(tlv, &tag)))
 			goto invdata;
 		if (tag != 0x53) {
@@ -943,6 +1076,7 @@ piv_read_chuid(struct piv_token *pk)
 	errf_t *err;
 	struct apdu *apdu;
 	struct tlv_state *tlv;
+	struct tlv_state rtlv;
 	uint tag, i;
 
 	VERIFY(pk->pt_intxn == B_TRUE);
@@ -954,7 +1088,7 @@ piv_read_chuid(struct piv_token *pk)
 
 	bunyan_log(BNY_DEBUG, "reading CHUID file", NULL);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
+	apdu = piv_apdu_borrow(pk, CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -972,8 +1106,12 @@ piv_read_chuid(struct piv_token *pk)
 	if (apdu->a_sw == SW_NO_ERROR ||
 	    (apdu->a_sw & 0xFF00) == SW_WARNING_NO_CHANGE_00 ||
 	    (apdu->a_sw & 0xFF00) == SW_WARNING_00) {
-		tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
-		    apdu->a_reply.b_len);
+		VERIFY0(ssh_digest_memory(SSH_DIGEST_SHA256,
+		    apdu->a_reply.b_data + apdu->a_reply.b_offset,
+		    apdu->a_reply.b_len, pk->pt_chuid_dg,
+		    sizeof (pk->pt_chuid_dg)));
+		tlv = tlv_init_local(&rtlv, apdu->a_reply.b_data,
+		    apdu->a_reply.b_offset, apdu->a_reply.b_len);
 		if ((err = tlv_read_tag(tlv, &tag)))
 			goto invdata;
 		if (tag != 0x53) {
@@ -1091,357 +1229,788 @@ invdata:
 	goto out;
 }
 
-errf_t *
-piv_enumerate(SCARDCONTEXT ctx, struct piv_token **tokens)
+/*
+ * Works out whether we can send extended-length APDUs to this card, based on
+ * the "card capabilities" compact-TLV object in the ATR historical bytes
+ * (ISO 7816-4 section 8.1.1.2.7). We only do this over T=1: T=0 needs
+ * ENVELOPE to carry them and isn't worth the trouble.
+ *
+ * YubiKeys don't advertise this in their ATR, so ykpiv_get_version() also
+ * sets pt_extlen based on the firmware version.
+ */
+static void
+piv_detect_extlen(struct piv_token *pk)
 {
-	DWORD rv, readersLen = 0;
-	LPTSTR readers, thisrdr;
-	struct piv_token *ks = NULL;
-	errf_t *err;
-
-	rv = SCardListReaders(ctx, NULL, NULL, &readersLen);
-	switch (rv) {
-	case SCARD_S_SUCCESS:
-		break;
-	case SCARD_E_NO_SERVICE:
-	case SCARD_E_INVALID_HANDLE:
-	case SCARD_E_SERVICE_STOPPED:
-		return (errf("PCSCContextError",
-		    pcscerrf("SCardListReaders", rv),
-		    "PCSC context is not functional"));
-	default:
-		return (pcscerrf("SCardListReaders", rv));
-	}
-	readers = calloc(1, readersLen);
-	rv = SCardListReaders(ctx, NULL, readers, &readersLen);
-	if (rv != SCARD_S_SUCCESS) {
-		free(readers);
-		return (pcscerrf("SCardListReaders", rv));
-	}
-
-	for (thisrdr = readers; *thisrdr != 0; thisrdr += strlen(thisrdr) + 1) {
-		SCARDHANDLE card;
-		struct piv_token *key;
-		DWORD activeProtocol;
+	uint8_t atr[MAX_ATR_SIZE];
+	DWORD atrlen = sizeof (atr), rdrlen = 0, state, proto;
+	const uint8_t *hist;
+	uint nhist, y, i, j, end, tag, len;
+	LONG rv;
 
-		rv = SCardConnect(ctx, thisrdr, SCARD_SHARE_SHARED,
-		    SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &card,
-		    &activeProtocol);
-		if (rv != SCARD_S_SUCCESS) {
-			err = pcscrerrf("SCardConnect", thisrdr, rv);
-			bunyan_log(BNY_DEBUG, "SCardConnect failed",
-			    "error", BNY_ERF, err, NULL);
-			errf_free(err);
-			continue;
-		}
+	if (pk->pt_proto != SCARD_PROTOCOL_T1)
+		return;
 
-		key = calloc(1, sizeof (struct piv_token));
-		key->pt_cardhdl = card;
-		key->pt_rdrname = strdup(thisrdr);
-		key->pt_proto = activeProtocol;
+	rv = SCardStatus(pk->pt_cardhdl, NULL, &rdrlen, &state, &proto,
+	    atr, &atrlen);
+	if (rv != SCARD_S_SUCCESS || atrlen < 2 || atrlen > sizeof (atr))
+		return;
 
-		switch (activeProtocol) {
-		case SCARD_PROTOCOL_T0:
-			key->pt_sendpci = *SCARD_PCI_T0;
+	/* Skip over TS, T0 and the interface bytes to the historical bytes */
+	nhist = atr[1] & 0x0F;
+	y = atr[1] >> 4;
+	i = 2;
+	while (y != 0) {
+		if (y & 0x1)
+			++i;		/* TAi */
+		if (y & 0x2)
+			++i;		/* TBi */
+		if (y & 0x4)
+			++i;		/* TCi */
+		if ((y & 0x8) == 0)
 			break;
-		case SCARD_PROTOCOL_T1:
-			key->pt_sendpci = *SCARD_PCI_T1;
-			break;
-		default:
-			VERIFY(0);
-		}
+		if (i >= atrlen)
+			return;
+		y = atr[i++] >> 4;	/* TDi */
+	}
+	if (i + nhist > atrlen || nhist < 1)
+		return;
+	hist = &atr[i];
 
-		if ((err = piv_txn_begin(key))) {
-			bunyan_log(BNY_DEBUG, "piv_txn_begin failed",
-			    "error", BNY_ERF, err, NULL);
-			errf_free(err);
-			continue;
-		}
-		err = piv_select(key);
-		if (err == ERRF_OK) {
-			err = piv_read_chuid(key);
-			if (errf_caused_by(err, "NotFoundError")) {
-				errf_free(err);
-				err = ERRF_OK;
-				key->pt_nochuid = B_TRUE;
-			}
-		}
-		if (err == ERRF_OK) {
-			err = piv_read_discov(key);
-			if (errf_caused_by(err, "NotFoundError") ||
-			    errf_caused_by(err, "NotSupportedError")) {
-				errf_free(err);
-				err = ERRF_OK;
-				/*
-				 * Default to preferring the application PIN if
-				 * we have no discovery object.
-				 */
-				key->pt_pin_app = B_TRUE;
-				key->pt_auth = PIV_PIN;
-			}
-		}
-		if (err == ERRF_OK) {
-			err = piv_read_keyhist(key);
-			if (errf_caused_by(err, "NotFoundError") ||
-			    errf_caused_by(err, "NotSupportedError")) {
-				errf_free(err);
-				err = ERRF_OK;
-			}
-		}
-		if (err == ERRF_OK) {
-			err = ykpiv_get_version(key);
-			if (err == ERRF_OK) {
-				err = ykpiv_read_serial(key);
-			}
-			if (errf_caused_by(err, "NotSupportedError")) {
-				errf_free(err);
-				err = ERRF_OK;
-			}
-		}
-		piv_txn_end(key);
+	/*
+	 * Category 0x80 is all compact-TLV; 0x00 is compact-TLV with a 3-byte
+	 * status indicator at the end.
+	 */
+	if (hist[0] == 0x80) {
+		end = nhist;
+	} else if (hist[0] == 0x00 && nhist >= 4) {
+		end = nhist - 3;
+	} else {
+		return;
+	}
 
-		if (err == ERRF_OK) {
-			key->pt_next = ks;
-			ks = key;
-		} else {
-			bunyan_log(BNY_DEBUG, "piv_enumerate() eliminated reader "
-			    "due to error", "reader", BNY_STRING, thisrdr,
-			    "error", BNY_ERF, err, NULL);
-			errf_free(err);
-			(void) SCardDisconnect(card, SCARD_RESET_CARD);
+	for (j = 1; j < end; j += len) {
+		tag = hist[j] >> 4;
+		len = hist[j] & 0x0F;
+		++j;
+		if (j + len > end)
+			return;
+		/* Third software function byte, bit 7: extended Lc and Le */
+		if (tag == 0x7 && len >= 3 && (hist[j + 2] & 0x40)) {
+			pk->pt_extlen = B_TRUE;
+			bunyan_log(BNY_DEBUG, "card supports extended APDUs",
+			    "reader", BNY_STRING, pk->pt_rdrname, NULL);
+			return;
 		}
 	}
+}
 
-	*tokens = ks;
+/*
+ * piv_enumerate() and piv_find() probe readers concurrently, with each worker
+ * using its own PCSC context (so that the calls actually run in parallel). A
+ * token which comes out of a worker keeps that context for the rest of its
+ * life (pt_ctx/pt_ownctx) and it's released along with the token.
+ */
+#define	PIV_PROBE_MAX_THREADS		16
 
-	free(readers);
-	return (ERRF_OK);
-}
+enum piv_probe_mode {
+	PIV_PROBE_ENUM,		/* piv_enumerate(): read what pp_read says */
+	PIV_PROBE_FIND		/* piv_find(): just enough to match GUIDs */
+};
 
-errf_t *
-piv_find(SCARDCONTEXT ctx, const uint8_t *guid, size_t guidlen,
-    struct piv_token **token)
-{
-	DWORD rv, readersLen = 0;
-	LPTSTR readers, thisrdr;
-	struct piv_token *found = NULL, *key;
-	errf_t *err;
+struct piv_probe {
+	const char *pp_rdrname;
+	enum piv_probe_mode pp_mode;
+	uint pp_read;		/* PIV_READ_* flags, for PIV_PROBE_ENUM */
+	const uint8_t *pp_guid;
+	size_t pp_guidlen;
 
-	rv = SCardListReaders(ctx, NULL, NULL, &readersLen);
-	switch (rv) {
-	case SCARD_S_SUCCESS:
-		break;
-	case SCARD_E_NO_SERVICE:
-	case SCARD_E_INVALID_HANDLE:
-	case SCARD_E_SERVICE_STOPPED:
-		return (errf("PCSCContextError",
-		    pcscerrf("SCardListReaders", rv),
-		    "PCSC context is not functional"));
-	default:
-		return (pcscerrf("SCardListReaders", rv));
-	}
-	readers = calloc(1, readersLen);
-	rv = SCardListReaders(ctx, NULL, readers, &readersLen);
-	if (rv != SCARD_S_SUCCESS) {
-		free(readers);
-		return (pcscerrf("SCardListReaders", rv));
-	}
+	/* If set, this is a software token rather than a PCSC reader */
+	struct piv_soft_card *pp_soft;
 
-	key = calloc(1, sizeof (struct piv_token));
-	VERIFY(key != NULL);
+	/* If B_FALSE, use pp_ctx rather than establishing our own */
+	boolean_t pp_ownctx;
+	SCARDCONTEXT pp_ctx;
 
-	for (thisrdr = readers; *thisrdr != 0; thisrdr += strlen(thisrdr) + 1) {
-		SCARDHANDLE card;
-		DWORD activeProtocol;
+	/*
+	 * The token, if it survived. In PIV_PROBE_FIND mode it matched the
+	 * GUID and is still in a transaction.
+	 */
+	struct piv_token *pp_token;
+};
 
-		rv = SCardConnect(ctx, thisrdr, SCARD_SHARE_SHARED,
-		    SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &card,
-		    &activeProtocol);
-		if (rv != SCARD_S_SUCCESS) {
-			err = pcscrerrf("SCardConnect", thisrdr, rv);
-			bunyan_log(BNY_DEBUG, "SCardConnect failed",
-			    "error", BNY_ERF, err, NULL);
-			errf_free(err);
-			continue;
-		}
+struct piv_probe_set {
+	pthread_mutex_t pps_mtx;
+	struct piv_probe *pps_probes;
+	size_t pps_n;
+	size_t pps_next;
+};
 
-		key->pt_cardhdl = card;
-		key->pt_rdrname = strdup(thisrdr);
-		VERIFY(key->pt_rdrname != NULL);
-		key->pt_proto = activeProtocol;
+/* What we assume about a token's PINs if it has no discovery object. */
+static void
+piv_discov_default(struct piv_token *pk)
+{
+	pk->pt_pin_app = B_TRUE;
+	pk->pt_auth = PIV_PIN;
+}
 
-		switch (activeProtocol) {
-		case SCARD_PROTOCOL_T0:
-			key->pt_sendpci = *SCARD_PCI_T0;
-			break;
-		case SCARD_PROTOCOL_T1:
-			key->pt_sendpci = *SCARD_PCI_T1;
-			break;
-		default:
-			VERIFY(0);
-		}
+/*
+ * Reads whichever of the objects in "what" (PIV_READ_* flags) the token
+ * doesn't have yet. Objects the card doesn't have aren't an error. The
+ * token must be in a transaction with the applet selected.
+ */
+static errf_t *
+piv_token_load(struct piv_token *pk, uint what)
+{
+	errf_t *err;
 
-		if ((err = piv_txn_begin(key))) {
-			errf_free(err);
-			goto nopenotxn;
-		}
-		err = piv_select(key);
-		if (err) {
-			errf_free(err);
-			goto nope;
-		}
-		err = piv_read_chuid(key);
-		if (errf_caused_by(err, "NotFoundError") && guidlen == 0) {
+	what &= ~pk->pt_loaded;
+
+	if ((what & PIV_READ_CHUID)) {
+		err = piv_read_chuid(pk);
+		if (errf_caused_by(err, "NotFoundError")) {
 			errf_free(err);
 			err = ERRF_OK;
-			key->pt_nochuid = B_TRUE;
-			if (found != NULL) {
-				piv_txn_end(key);
-				(void) SCardDisconnect(card, SCARD_RESET_CARD);
-				free((char *)key->pt_rdrname);
-				free(key);
-				piv_txn_end(found);
-				(void) SCardDisconnect(found->pt_cardhdl,
-				    SCARD_RESET_CARD);
-				free((char *)found->pt_rdrname);
-				free(found);
-				free(readers);
-				return (errf("DuplicateError", NULL,
-				    "More than one PIV token matched GUID"));
-			}
-			found = key;
-			key = calloc(1, sizeof (struct piv_token));
-			continue;
-		} else if (err) {
-			bunyan_log(BNY_DEBUG, "piv_find() eliminated reader "
-			    "due to error", "reader", BNY_STRING, thisrdr,
-			    "error", BNY_ERF, err, NULL);
-			errf_free(err);
-			goto nope;
-		}
-		if (guidlen == 0 || bcmp(guid, key->pt_guid, guidlen) != 0)
-			goto nope;
-
-		if (found != NULL) {
-			piv_txn_end(key);
-			(void) SCardDisconnect(card, SCARD_RESET_CARD);
-			free((char *)key->pt_rdrname);
-			free(key);
-			piv_txn_end(found);
-			(void) SCardDisconnect(found->pt_cardhdl,
-			    SCARD_RESET_CARD);
-			free((char *)found->pt_rdrname);
-			free(found);
-			free(readers);
-			return (errf("DuplicateError", NULL,
-			    "More than one PIV token matched GUID"));
+			pk->pt_nochuid = B_TRUE;
 		}
-		found = key;
-		key = calloc(1, sizeof (struct piv_token));
-		continue;
-
-nope:
-		piv_txn_end(key);
-nopenotxn:
-		(void) SCardDisconnect(card, SCARD_RESET_CARD);
-		free((char *)key->pt_rdrname);
-		bzero(key, sizeof (struct piv_token));
-	}
-
-	free(key);
-
-	if (found == NULL) {
-		free(readers);
-		return (errf("NotFoundError", NULL,
-		    "No PIV token found matching GUID"));
+		if (err)
+			return (err);
+		pk->pt_loaded |= PIV_READ_CHUID;
 	}
-
-	key = found;
-	err = ERRF_OK;
-
-	if (err == ERRF_OK) {
-		err = piv_read_discov(key);
+	if ((what & PIV_READ_DISCOV)) {
+		err = piv_read_discov(pk);
 		if (errf_caused_by(err, "NotFoundError") ||
 		    errf_caused_by(err, "NotSupportedError")) {
 			errf_free(err);
 			err = ERRF_OK;
-			/*
-			 * Default to preferring the application PIN if
-			 * we have no discovery object.
-			 */
-			key->pt_pin_app = B_TRUE;
-			key->pt_auth = PIV_PIN;
+			piv_discov_default(pk);
 		}
+		if (err)
+			return (err);
+		pk->pt_loaded |= PIV_READ_DISCOV;
 	}
-	if (err == ERRF_OK) {
-		err = piv_read_keyhist(key);
+	if ((what & PIV_READ_KEYHIST)) {
+		err = piv_read_keyhist(pk);
 		if (errf_caused_by(err, "NotFoundError") ||
 		    errf_caused_by(err, "NotSupportedError")) {
 			errf_free(err);
 			err = ERRF_OK;
 		}
+		if (err)
+			return (err);
+		pk->pt_loaded |= PIV_READ_KEYHIST;
 	}
-	if (err == ERRF_OK) {
-		err = ykpiv_get_version(key);
-		if (err == ERRF_OK) {
-			err = ykpiv_read_serial(key);
-		}
+	if ((what & PIV_READ_YKPIV)) {
+		err = ykpiv_get_version(pk);
+		if (err == ERRF_OK)
+			err = ykpiv_read_serial(pk);
 		if (errf_caused_by(err, "NotSupportedError")) {
 			errf_free(err);
 			err = ERRF_OK;
 		}
+		if (err)
+			return (err);
+		pk->pt_loaded |= PIV_READ_YKPIV;
 	}
-	piv_txn_end(key);
+	return (ERRF_OK);
+}
+
+/*
+ * Called by the accessors for anything a piv_enumerate_opts() caller chose
+ * not to read up front. If the token is already in a transaction then the
+ * caller has the applet selected and we just read; otherwise this takes a
+ * transaction of its own.
+ *
+ * The accessors have no way to return an error, so if the read fails we
+ * log it and carry on as though the card didn't have the object (and don't
+ * try again).
+ */
+static void
+piv_token_lazy_load(const struct piv_token *token, uint what)
+{
+	struct piv_token *pk = (struct piv_token *)token;
+	boolean_t txn = B_FALSE;
+	errf_t *err;
+
+	what &= ~pk->pt_loaded;
+	if (what == 0)
+		return;
+
+	if (!pk->pt_intxn) {
+		if ((err = piv_txn_begin(pk)))
+			goto out;
+		txn = B_TRUE;
+		if ((err = piv_select_cached(pk)))
+			goto out;
+	}
+	err = piv_token_load(pk, what);
 
+out:
+	if (txn)
+		piv_txn_end(pk);
 	if (err) {
-		bunyan_log(BNY_DEBUG, "piv_find() eliminated reader "
-		    "due to error", "reader", BNY_STRING, thisrdr,
+		bunyan_log(BNY_DEBUG, "lazy read of token objects failed",
+		    "reader", BNY_STRING, pk->pt_rdrname,
+		    "what", BNY_UINT, (uint)(what & ~pk->pt_loaded),
 		    "error", BNY_ERF, err, NULL);
 		errf_free(err);
-		(void) SCardDisconnect(key->pt_cardhdl, SCARD_RESET_CARD);
-		free((char *)key->pt_rdrname);
-		free(key);
+		if ((what & PIV_READ_CHUID) &&
+		    !(pk->pt_loaded & PIV_READ_CHUID)) {
+			pk->pt_nochuid = B_TRUE;
+		}
+		if ((what & PIV_READ_DISCOV) &&
+		    !(pk->pt_loaded & PIV_READ_DISCOV)) {
+			piv_discov_default(pk);
+		}
 	}
-
-	*token = key;
-	free(readers);
-	return (ERRF_OK);
+	pk->pt_loaded |= what;
 }
 
-void
-piv_release(struct piv_token *pk)
+static void
+piv_token_free(struct piv_token *pk, DWORD disposition)
 {
-	struct piv_token *next;
 	struct piv_slot *ps, *psnext;
 
-	for (; pk != NULL; pk = next) {
-		VERIFY(pk->pt_intxn == B_FALSE);
-		(void) SCardDisconnect(pk->pt_cardhdl, SCARD_LEAVE_CARD);
-
-		for (ps = pk->pt_slots; ps != NULL; ps = psnext) {
-			OPENSSL_free((void *)ps->ps_subj);
-			X509_free(ps->ps_x509);
-			sshkey_free(ps->ps_pubkey);
-			psnext = ps->ps_next;
-			free(ps);
-		}
-		free(pk->pt_hist_url);
-		free(pk->pt_app_label);
-		free(pk->pt_app_uri);
-		free((char *)pk->pt_rdrname);
-		free(pk->pt_guidhex);
-
-		next = pk->pt_next;
-		free(pk);
-	}
+	if (pk->pt_intxn)
+		piv_txn_end(pk);
+	if (pk->pt_xport == NULL)
+		(void) SCardDisconnect(pk->pt_cardhdl, disposition);
+	if (pk->pt_ownctx)
+		(void) SCardReleaseContext(pk->pt_ctx);
+
+	for (ps = pk->pt_slots; ps != NULL; ps = psnext) {
+		OPENSSL_free((void *)ps->ps_subj);
+		X509_free(ps->ps_x509);
+		sshkey_free(ps->ps_pubkey);
+		psnext = ps->ps_next;
+		free(ps);
+	}
+	free(pk->pt_hist_url);
+	free(pk->pt_app_label);
+	free(pk->pt_app_uri);
+	free((char *)pk->pt_rdrname);
+	free(pk->pt_guidhex);
+	piv_apdu_pool_free(pk);
+
+	free(pk);
 }
 
-struct piv_slot *
-piv_get_slot(struct piv_token *tk, enum piv_slotid slotid)
+static void
+piv_probe_reader(struct piv_probe *pp)
 {
-	struct piv_slot *s;
-	for (s = tk->pt_slots; s != NULL; s = s->ps_next) {
-		if (s->ps_slot == slotid)
+	SCARDCONTEXT ctx = pp->pp_ctx;
+	SCARDHANDLE card;
+	DWORD activeProtocol;
+	struct piv_token *key;
+	errf_t *err;
+	LONG rv;
+
+	if (pp->pp_soft != NULL) {
+		key = calloc(1, sizeof (struct piv_token));
+		VERIFY(key != NULL);
+		key->pt_xport = &piv_soft_transport;
+		key->pt_xport_priv = pp->pp_soft;
+		key->pt_ctx = ctx;
+		key->pt_rdrname = strdup(pp->pp_rdrname);
+		VERIFY(key->pt_rdrname != NULL);
+		key->pt_extlen = B_TRUE;
+		goto connected;
+	}
+
+	if (pp->pp_ownctx) {
+		rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL,
+		    &ctx);
+		if (rv != SCARD_S_SUCCESS) {
+			err = pcscerrf("SCardEstablishContext", rv);
+			bunyan_log(BNY_DEBUG, "SCardEstablishContext failed",
+			    "reader", BNY_STRING, pp->pp_rdrname,
+			    "error", BNY_ERF, err, NULL);
+			errf_free(err);
+			return;
+		}
+	}
+
+	rv = SCardConnect(ctx, pp->pp_rdrname, SCARD_SHARE_SHARED,
+	    SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &card, &activeProtocol);
+	if (rv != SCARD_S_SUCCESS) {
+		err = pcscrerrf("SCardConnect", pp->pp_rdrname, rv);
+		bunyan_log(BNY_DEBUG, "SCardConnect failed",
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+		if (pp->pp_ownctx)
+			(void) SCardReleaseContext(ctx);
+		return;
+	}
+
+	key = calloc(1, sizeof (struct piv_token));
+	VERIFY(key != NULL);
+	key->pt_cardhdl = card;
+	key->pt_ctx = ctx;
+	key->pt_ownctx = pp->pp_ownctx;
+	key->pt_rdrname = strdup(pp->pp_rdrname);
+	VERIFY(key->pt_rdrname != NULL);
+	key->pt_proto = activeProtocol;
+
+	switch (activeProtocol) {
+	case SCARD_PROTOCOL_T0:
+		key->pt_sendpci = *SCARD_PCI_T0;
+		break;
+	case SCARD_PROTOCOL_T1:
+		key->pt_sendpci = *SCARD_PCI_T1;
+		break;
+	default:
+		VERIFY(0);
+	}
+	piv_detect_extlen(key);
+
+connected:
+	if ((err = piv_txn_begin(key))) {
+		bunyan_log(BNY_DEBUG, "piv_txn_begin failed",
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+		goto discard;
+	}
+	err = piv_select(key);
+	if (err == ERRF_OK && pp->pp_mode == PIV_PROBE_ENUM) {
+		err = piv_token_load(key, pp->pp_read);
+	} else if (err == ERRF_OK) {
+		err = piv_read_chuid(key);
+		if (errf_caused_by(err, "NotFoundError") &&
+		    pp->pp_guidlen == 0) {
+			errf_free(err);
+			err = ERRF_OK;
+			key->pt_nochuid = B_TRUE;
+		}
+		if (err == ERRF_OK)
+			key->pt_loaded |= PIV_READ_CHUID;
+	}
+
+	if (pp->pp_mode == PIV_PROBE_FIND) {
+		if (err) {
+			bunyan_log(BNY_DEBUG, "piv_find() eliminated reader "
+			    "due to error", "reader", BNY_STRING,
+			    pp->pp_rdrname, "error", BNY_ERF, err, NULL);
+			errf_free(err);
+			goto discard;
+		}
+		/*
+		 * A zero-length GUID only matches a token with no CHUID.
+		 */
+		if (!key->pt_nochuid && (pp->pp_guidlen == 0 ||
+		    bcmp(pp->pp_guid, key->pt_guid, pp->pp_guidlen) != 0)) {
+			goto discard;
+		}
+		pp->pp_token = key;
+		return;
+	}
+
+	piv_txn_end(key);
+
+	if (err) {
+		bunyan_log(BNY_DEBUG, "piv_enumerate() eliminated reader "
+		    "due to error", "reader", BNY_STRING, pp->pp_rdrname,
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+		goto discard;
+	}
+	pp->pp_token = key;
+	return;
+
+discard:
+	piv_token_free(key, SCARD_RESET_CARD);
+}
+
+static void *
+piv_probe_worker(void *arg)
+{
+	struct piv_probe_set *pps = arg;
+	size_t i;
+
+	while (1) {
+		VERIFY0(pthread_mutex_lock(&pps->pps_mtx));
+		i = pps->pps_next++;
+		VERIFY0(pthread_mutex_unlock(&pps->pps_mtx));
+		if (i >= pps->pps_n)
+			break;
+		piv_probe_reader(&pps->pps_probes[i]);
+	}
+	return (NULL);
+}
+
+/*
+ * Lists the readers on ctx and probes every one of them, followed by any
+ * registered software tokens. The results come back in *probesp (in reader
+ * order), and the caller frees the array.
+ */
+static errf_t *
+piv_probe_readers(SCARDCONTEXT ctx, enum piv_probe_mode mode, uint read,
+    const uint8_t *guid, size_t guidlen, struct piv_probe **probesp,
+    size_t *nprobesp)
+{
+	DWORD rv, readersLen = 0;
+	LPTSTR readers, thisrdr;
+	struct piv_probe_set pps;
+	struct piv_probe *probes;
+	pthread_t threads[PIV_PROBE_MAX_THREADS];
+	struct piv_soft_card *soft;
+	size_t n = 0, nsoft = 0, i, nthreads = 0;
+
+	for (soft = piv_soft_card_next(NULL); soft != NULL;
+	    soft = piv_soft_card_next(soft)) {
+		++nsoft;
+	}
+
+	rv = SCardListReaders(ctx, NULL, NULL, &readersLen);
+	switch (rv) {
+	case SCARD_S_SUCCESS:
+		break;
+	case SCARD_E_NO_READERS_AVAILABLE:
+		if (nsoft > 0) {
+			readersLen = 0;
+			break;
+		}
+		return (pcscerrf("SCardListReaders", rv));
+	case SCARD_E_NO_SERVICE:
+	case SCARD_E_INVALID_HANDLE:
+	case SCARD_E_SERVICE_STOPPED:
+		return (errf("PCSCContextError",
+		    pcscerrf("SCardListReaders", rv),
+		    "PCSC context is not functional"));
+	default:
+		return (pcscerrf("SCardListReaders", rv));
+	}
+	readers = calloc(1, readersLen + 1);
+	VERIFY(readers != NULL);
+	if (readersLen > 0) {
+		rv = SCardListReaders(ctx, NULL, readers, &readersLen);
+		if (rv != SCARD_S_SUCCESS) {
+			free(readers);
+			return (pcscerrf("SCardListReaders", rv));
+		}
+	}
+
+	for (thisrdr = readers; *thisrdr != 0; thisrdr += strlen(thisrdr) + 1)
+		++n;
+	n += nsoft;
+	probes = calloc(n + 1, sizeof (struct piv_probe));
+	VERIFY(probes != NULL);
+	for (i = 0, thisrdr = readers; *thisrdr != 0;
+	    thisrdr += strlen(thisrdr) + 1, ++i) {
+		probes[i].pp_rdrname = thisrdr;
+		probes[i].pp_mode = mode;
+		probes[i].pp_read = read;
+		probes[i].pp_guid = guid;
+		probes[i].pp_guidlen = guidlen;
+		probes[i].pp_ctx = ctx;
+		probes[i].pp_ownctx = (n > 1);
+	}
+	for (soft = piv_soft_card_next(NULL); soft != NULL && i < n;
+	    soft = piv_soft_card_next(soft), ++i) {
+		probes[i].pp_rdrname = piv_soft_card_name(soft);
+		probes[i].pp_soft = soft;
+		probes[i].pp_mode = mode;
+		probes[i].pp_read = read;
+		probes[i].pp_guid = guid;
+		probes[i].pp_guidlen = guidlen;
+		probes[i].pp_ctx = ctx;
+	}
+
+	bzero(&pps, sizeof (pps));
+	VERIFY0(pthread_mutex_init(&pps.pps_mtx, NULL));
+	pps.pps_probes = probes;
+	pps.pps_n = n;
+
+	if (n > 1) {
+		for (i = 0; i < n && i < PIV_PROBE_MAX_THREADS; ++i) {
+			if (pthread_create(&threads[nthreads], NULL,
+			    piv_probe_worker, &pps) != 0) {
+				break;
+			}
+			++nthreads;
+		}
+	}
+	/* Join in ourselves (this is all the work if n <= 1). */
+	(void) piv_probe_worker(&pps);
+	for (i = 0; i < nthreads; ++i)
+		VERIFY0(pthread_join(threads[i], NULL));
+	VERIFY0(pthread_mutex_destroy(&pps.pps_mtx));
+
+	for (i = 0; i < n; ++i)
+		probes[i].pp_rdrname = NULL;
+	free(readers);
+
+	*probesp = probes;
+	*nprobesp = n;
+	return (ERRF_OK);
+}
+
+errf_t *
+piv_enumerate(SCARDCONTEXT ctx, struct piv_token **tokens)
+{
+	return (piv_enumerate_opts(ctx, NULL, tokens));
+}
+
+errf_t *
+piv_enumerate_opts(SCARDCONTEXT ctx, const struct piv_enum_opts *opts,
+    struct piv_token **tokens)
+{
+	struct piv_token *ks = NULL;
+	struct piv_probe *probes;
+	uint read = PIV_READ_ALL;
+	size_t n, i;
+	errf_t *err;
+
+	if (opts != NULL)
+		read = opts->peo_read;
+	err = piv_probe_readers(ctx, PIV_PROBE_ENUM, read, NULL, 0, &probes,
+	    &n);
+	if (err)
+		return (err);
+
+	for (i = 0; i < n; ++i) {
+		struct piv_token *key = probes[i].pp_token;
+		if (key == NULL)
+			continue;
+		key->pt_next = ks;
+		ks = key;
+	}
+	free(probes);
+
+	*tokens = ks;
+	return (ERRF_OK);
+}
+
+/*
+ * The reader each full GUID was last found on by piv_find() or piv_find_at(),
+ * so that piv_find() can try that reader on its own before falling back to
+ * probing all of them. Small, and overwritten round-robin.
+ */
+#define	PIV_FIND_HINTS	8
+
+struct piv_find_hint {
+	uint8_t pfh_guid[GUID_LEN];
+	char *pfh_rdrname;
+};
+
+static pthread_mutex_t piv_find_hint_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct piv_find_hint piv_find_hints[PIV_FIND_HINTS];
+static uint piv_find_hint_next = 0;
+
+static void
+piv_find_hint_set(const struct piv_token *pk)
+{
+	struct piv_find_hint *h = NULL;
+	uint i;
+
+	if (pk->pt_nochuid)
+		return;
+	VERIFY0(pthread_mutex_lock(&piv_find_hint_mtx));
+	for (i = 0; i < PIV_FIND_HINTS; ++i) {
+		if (piv_find_hints[i].pfh_rdrname != NULL &&
+		    bcmp(piv_find_hints[i].pfh_guid, pk->pt_guid,
+		    GUID_LEN) == 0) {
+			h = &piv_find_hints[i];
+			break;
+		}
+	}
+	if (h == NULL) {
+		h = &piv_find_hints[piv_find_hint_next];
+		piv_find_hint_next = (piv_find_hint_next + 1) % PIV_FIND_HINTS;
+		bcopy(pk->pt_guid, h->pfh_guid, GUID_LEN);
+	}
+	free(h->pfh_rdrname);
+	h->pfh_rdrname = strdup(pk->pt_rdrname);
+	VERIFY0(pthread_mutex_unlock(&piv_find_hint_mtx));
+}
+
+/* Returns a copy of the hinted reader name for guid, if we have one. */
+static char *
+piv_find_hint_get(const uint8_t *guid)
+{
+	char *rdrname = NULL;
+	uint i;
+
+	VERIFY0(pthread_mutex_lock(&piv_find_hint_mtx));
+	for (i = 0; i < PIV_FIND_HINTS; ++i) {
+		if (piv_find_hints[i].pfh_rdrname != NULL &&
+		    bcmp(piv_find_hints[i].pfh_guid, guid, GUID_LEN) == 0) {
+			rdrname = strdup(piv_find_hints[i].pfh_rdrname);
+			break;
+		}
+	}
+	VERIFY0(pthread_mutex_unlock(&piv_find_hint_mtx));
+	return (rdrname);
+}
+
+/*
+ * Probes just the one named reader (or software token) in PIV_PROBE_FIND
+ * mode. On success the token is still in a transaction.
+ */
+static errf_t *
+piv_probe_one(SCARDCONTEXT ctx, const char *rdrname, const uint8_t *guid,
+    size_t guidlen, struct piv_token **token)
+{
+	struct piv_probe pp;
+	struct piv_soft_card *soft;
+
+	bzero(&pp, sizeof (pp));
+	pp.pp_rdrname = rdrname;
+	pp.pp_mode = PIV_PROBE_FIND;
+	pp.pp_guid = guid;
+	pp.pp_guidlen = guidlen;
+	pp.pp_ctx = ctx;
+	pp.pp_ownctx = B_FALSE;
+	for (soft = piv_soft_card_next(NULL); soft != NULL;
+	    soft = piv_soft_card_next(soft)) {
+		if (strcmp(piv_soft_card_name(soft), rdrname) == 0) {
+			pp.pp_soft = soft;
+			break;
+		}
+	}
+
+	piv_probe_reader(&pp);
+	if (pp.pp_token == NULL) {
+		return (errf("NotFoundError", NULL, "No PIV token found "
+		    "matching GUID in reader '%s'", rdrname));
+	}
+	*token = pp.pp_token;
+	return (ERRF_OK);
+}
+
+/*
+ * The rest of what piv_find() reads once it has its token (which must be in
+ * a transaction, which this ends). On error the token is freed.
+ */
+static errf_t *
+piv_find_finish(struct piv_token *key, uint read)
+{
+	errf_t *err;
+
+	err = piv_token_load(key, read);
+	piv_txn_end(key);
+
+	if (err) {
+		bunyan_log(BNY_DEBUG, "piv_find() eliminated reader "
+		    "due to error", "reader", BNY_STRING, key->pt_rdrname,
+		    "error", BNY_ERF, err, NULL);
+		piv_token_free(key, SCARD_RESET_CARD);
+		return (err);
+	}
+	piv_find_hint_set(key);
+	return (ERRF_OK);
+}
+
+errf_t *
+piv_find_at(SCARDCONTEXT ctx, const char *rdrname, const uint8_t *guid,
+    size_t guidlen, struct piv_token **token)
+{
+	struct piv_token *key;
+	errf_t *err;
+
+	if ((err = piv_probe_one(ctx, rdrname, guid, guidlen, &key)))
+		return (err);
+	if ((err = piv_find_finish(key, PIV_READ_ALL)))
+		return (err);
+	*token = key;
+	return (ERRF_OK);
+}
+
+errf_t *
+piv_find(SCARDCONTEXT ctx, const uint8_t *guid, size_t guidlen,
+    struct piv_token **token)
+{
+	return (piv_find_opts(ctx, guid, guidlen, NULL, token));
+}
+
+errf_t *
+piv_find_opts(SCARDCONTEXT ctx, const uint8_t *guid, size_t guidlen,
+    const struct piv_enum_opts *opts, struct piv_token **token)
+{
+	struct piv_token *found = NULL, *key;
+	struct piv_probe *probes;
+	uint read = PIV_READ_ALL;
+	size_t n, i;
+	char *rdrname;
+	errf_t *err;
+
+	if (opts != NULL)
+		read = opts->peo_read;
+
+	/*
+	 * A full GUID can only match one token, so if we know where it was
+	 * last time, look there first.
+	 */
+	if (guidlen == GUID_LEN &&
+	    (rdrname = piv_find_hint_get(guid)) != NULL) {
+		err = piv_probe_one(ctx, rdrname, guid, guidlen, &key);
+		if (err == ERRF_OK) {
+			free(rdrname);
+			found = key;
+			goto found;
+		}
+		bunyan_log(BNY_DEBUG, "piv_find() hinted reader did not "
+		    "match, probing all readers", "reader", BNY_STRING,
+		    rdrname, "error", BNY_ERF, err, NULL);
+		errf_free(err);
+		free(rdrname);
+	}
+
+	err = piv_probe_readers(ctx, PIV_PROBE_FIND, 0, guid, guidlen,
+	    &probes, &n);
+	if (err)
+		return (err);
+
+	for (i = 0; i < n; ++i) {
+		if ((key = probes[i].pp_token) == NULL)
+			continue;
+		if (found != NULL) {
+			for (; i < n; ++i) {
+				if (probes[i].pp_token != NULL) {
+					piv_token_free(probes[i].pp_token,
+					    SCARD_RESET_CARD);
+				}
+			}
+			piv_token_free(found, SCARD_RESET_CARD);
+			free(probes);
+			return (errf("DuplicateError", NULL,
+			    "More than one PIV token matched GUID"));
+		}
+		found = key;
+	}
+	free(probes);
+
+	if (found == NULL) {
+		return (errf("NotFoundError", NULL,
+		    "No PIV token found matching GUID"));
+	}
+
+found:
+	if ((err = piv_find_finish(found, read))) {
+		errf_free(err);
+		found = NULL;
+	}
+
+	*token = found;
+	return (ERRF_OK);
+}
+
+void
+piv_release(struct piv_token *pk)
+{
+	struct piv_token *next;
+
+	for (; pk != NULL; pk = next) {
+		VERIFY(pk->pt_intxn == B_FALSE);
+		next = pk->pt_next;
+		piv_token_free(pk, SCARD_LEAVE_CARD);
+	}
+}
+
+struct piv_slot *
+piv_get_slot(struct piv_token *tk, enum piv_slotid slotid)
+{
+	struct piv_slot *s;
+	for (s = tk->pt_slots; s != NULL; s = s->ps_next) {
+		if (s->ps_slot == slotid)
 			return (s);
 	}
 	return (NULL);
@@ -1502,6 +2071,15 @@ piv_slot_subject(const struct piv_slot *slot)
 	return (slot->ps_subj);
 }
 
+const uint8_t *
+piv_slot_cert_hash(const struct piv_slot *slot, size_t *plen)
+{
+	if (!slot->ps_have_cert_hash)
+		return (NULL);
+	*plen = sizeof (slot->ps_cert_hash);
+	return (slot->ps_cert_hash);
+}
+
 struct sshkey *
 piv_slot_pubkey(const struct piv_slot *slot)
 {
@@ -1519,9 +2097,75 @@ piv_apdu_make(enum iso_class cls, enum iso_ins ins, uint8_t p1, uint8_t p2)
 	return (a);
 }
 
+static void
+piv_apdu_pool_free(struct piv_token *pk)
+{
+	uint i;
+
+	if (pk->pt_apdu_pool == NULL)
+		return;
+	for (i = 0; i < PIV_APDU_POOL_SIZE; ++i)
+		VERIFY(!pk->pt_apdu_pool[i].pa_inuse);
+	freezero(pk->pt_apdu_pool,
+	    PIV_APDU_POOL_SIZE * sizeof (struct piv_apdu_arena));
+	pk->pt_apdu_pool = NULL;
+}
+
+struct apdu *
+piv_apdu_borrow(struct piv_token *pk, enum iso_class cls, enum iso_ins ins,
+    uint8_t p1, uint8_t p2)
+{
+	struct piv_apdu_arena *pa = NULL;
+	struct apdu *a;
+	uint i;
+
+	if (pk->pt_apdu_pool == NULL) {
+		pk->pt_apdu_pool = calloc_conceal(PIV_APDU_POOL_SIZE,
+		    sizeof (struct piv_apdu_arena));
+	}
+	if (pk->pt_apdu_pool != NULL) {
+		for (i = 0; i < PIV_APDU_POOL_SIZE; ++i) {
+			if (!pk->pt_apdu_pool[i].pa_inuse) {
+				pa = &pk->pt_apdu_pool[i];
+				break;
+			}
+		}
+	}
+	/* Pool exhausted (or couldn't allocate it): use the heap instead. */
+	if (pa == NULL)
+		return (piv_apdu_make(cls, ins, p1, p2));
+
+	pa->pa_inuse = B_TRUE;
+	pa->pa_used = 0;
+	a = &pa->pa_apdu;
+	a->a_cls = cls;
+	a->a_ins = ins;
+	a->a_p1 = p1;
+	a->a_p2 = p2;
+	a->a_arena = pa;
+	a->a_reply.b_data = pa->pa_reply;
+	a->a_reply.b_size = sizeof (pa->pa_reply);
+	return (a);
+}
+
 void
 piv_apdu_free(struct apdu *a)
 {
+	struct piv_apdu_arena *pa;
+
+	if (a == NULL)
+		return;
+
+	if ((pa = a->a_arena) != NULL) {
+		VERIFY(pa->pa_inuse);
+		VERIFY(a->a_reply.b_data == pa->pa_reply);
+		explicit_bzero(pa->pa_reply, pa->pa_used);
+		bzero(a, sizeof (struct apdu));
+		pa->pa_used = 0;
+		pa->pa_inuse = B_FALSE;
+		return;
+	}
+
 	if (a->a_reply.b_data != NULL) {
 		freezero(a->a_reply.b_data, a->a_reply.b_size);
 	}
@@ -1550,11 +2194,58 @@ piv_apdu_get_reply(const struct apdu *apdu, size_t *len)
 	return (apdu->a_reply.b_data + apdu->a_reply.b_offset);
 }
 
+/*
+ * Encodes an APDU for sending. If the APDU came from a token's pool, the
+ * encoding goes into its arena instead of a fresh allocation (in which case
+ * the caller must not free it).
+ */
 static uint8_t *
 apdu_to_buffer(struct apdu *apdu, uint *outlen)
 {
 	struct apdubuf *d = &(apdu->a_cmd);
-	uint8_t *buf = calloc(1, 6 + d->b_len);
+	uint8_t *buf = NULL;
+	uint le;
+
+	if (apdu->a_arena != NULL) {
+		VERIFY3U(d->b_len + 9, <=, sizeof (apdu->a_arena->pa_cmd));
+		buf = apdu->a_arena->pa_cmd;
+	}
+
+	if (apdu->a_extle != 0) {
+		if (apdu->a_arena == NULL)
+			buf = calloc(1, 9 + d->b_len);
+		if (buf == NULL)
+			return (NULL);
+		le = (apdu->a_extle >= 0x10000) ? 0 : apdu->a_extle;
+		buf[0] = apdu->a_cls;
+		buf[1] = apdu->a_ins;
+		buf[2] = apdu->a_p1;
+		buf[3] = apdu->a_p2;
+		buf[4] = 0x00;
+		if (d->b_data == NULL) {
+			buf[5] = (le >> 8) & 0xFF;
+			buf[6] = le & 0xFF;
+			*outlen = 7;
+			return (buf);
+		}
+		VERIFY(d->b_len <= 0xFFFF && d->b_len > 0);
+		buf[5] = (d->b_len >> 8) & 0xFF;
+		buf[6] = d->b_len & 0xFF;
+		bcopy(d->b_data + d->b_offset, buf + 7, d->b_len);
+		if (apdu->a_cls & CLA_CHAIN) {
+			*outlen = d->b_len + 7;
+		} else {
+			buf[d->b_len + 7] = (le >> 8) & 0xFF;
+			buf[d->b_len + 8] = le & 0xFF;
+			*outlen = d->b_len + 9;
+		}
+		return (buf);
+	}
+
+	if (apdu->a_arena == NULL)
+		buf = calloc(1, 6 + d->b_len);
+	if (buf == NULL)
+		return (NULL);
 	buf[0] = apdu->a_cls;
 	buf[1] = apdu->a_ins;
 	buf[2] = apdu->a_p1;
@@ -1564,7 +2255,6 @@ apdu_to_buffer(struct apdu *apdu, uint *outlen)
 		*outlen = 5;
 		return (buf);
 	} else {
-		/* TODO: maybe look at handling ext APDUs? */
 		VERIFY(d->b_len < 256 && d->b_len > 0);
 		buf[4] = d->b_len;
 		bcopy(d->b_data + d->b_offset, buf + 5, d->b_len);
@@ -1621,10 +2311,156 @@ ins_to_name(enum iso_ins ins)
 	}
 }
 
+/*
+ * The APDU flight recorder (see piv_apdu_rec_dump() in piv.h).
+ *
+ * Writers claim the next sequence number with an atomic add, so APDUs on
+ * different threads (e.g. piv_find()'s probes) don't need a lock between
+ * them. Each record's par_seq is zeroed while it's being filled in and set
+ * last, so that a reader can tell if it raced with a writer.
+ */
+static struct piv_apdu_rec apdu_recs[PIV_APDU_REC_COUNT];
+static uint64_t apdu_rec_last = 0;
+
+/*
+ * PUT DATA is redacted wholesale: pivy-tool can store the admin key in the
+ * PRINTINFO object, and we can't tell from the header alone which object a
+ * chained command is writing.
+ */
+static boolean_t
+apdu_rec_redact(const struct apdu *apdu)
+{
+	switch (apdu->a_ins) {
+	case INS_VERIFY:
+	case INS_CHANGE_PIN:
+	case INS_RESET_PIN:
+	case INS_SET_MGMT:
+	case INS_IMPORT_ASYM:
+	case INS_PUT_DATA:
+		return (B_TRUE);
+	case INS_GEN_AUTH:
+		return (apdu->a_p2 == PIV_SLOT_ADMIN);
+	default:
+		return (B_FALSE);
+	}
+}
+
+static void
+apdu_record(const struct apdu *apdu, const struct timespec *when,
+    uint64_t usec, size_t lr, boolean_t pcscfail)
+{
+	struct piv_apdu_rec *rec;
+	const struct apdubuf *c = &apdu->a_cmd;
+	uint64_t seq;
+	size_t n;
+
+	seq = __atomic_add_fetch(&apdu_rec_last, 1, __ATOMIC_RELAXED);
+	rec = &apdu_recs[(seq - 1) % PIV_APDU_REC_COUNT];
+	__atomic_store_n(&rec->par_seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	rec->par_time = when->tv_sec * 1000000ULL + when->tv_nsec / 1000;
+	rec->par_usec = (usec > UINT32_MAX) ? UINT32_MAX : usec;
+	rec->par_lc = (c->b_data == NULL) ? 0 : c->b_len;
+	rec->par_le = (apdu->a_extle != 0) ? apdu->a_extle : apdu->a_le;
+	rec->par_lr = lr;
+	rec->par_sw = pcscfail ? 0 : apdu->a_sw;
+	rec->par_cls = apdu->a_cls;
+	rec->par_ins = apdu->a_ins;
+	rec->par_p1 = apdu->a_p1;
+	rec->par_p2 = apdu->a_p2;
+	rec->par_flags = 0;
+	if (apdu->a_extle != 0)
+		rec->par_flags |= PIV_APDU_REC_EXTLEN;
+	if (pcscfail)
+		rec->par_flags |= PIV_APDU_REC_PCSC_FAIL;
+	rec->par_datalen = 0;
+	if (apdu_rec_redact(apdu)) {
+		rec->par_flags |= PIV_APDU_REC_REDACTED;
+	} else if (rec->par_lc > 0) {
+		n = rec->par_lc;
+		if (n > PIV_APDU_REC_DATA)
+			n = PIV_APDU_REC_DATA;
+		bcopy(c->b_data + c->b_offset, rec->par_data, n);
+		rec->par_datalen = n;
+	}
+
+	__atomic_store_n(&rec->par_seq, seq, __ATOMIC_RELEASE);
+}
+
+const char *
+piv_ins_name(uint8_t ins)
+{
+	return (ins_to_name(ins));
+}
+
+const char *
+piv_sw_name(uint16_t sw)
+{
+	return (sw_to_name(sw));
+}
+
+size_t
+piv_apdu_rec_dump(struct piv_apdu_rec *out, size_t max)
+{
+	const struct piv_apdu_rec *rec;
+	uint64_t first, last, seq;
+	size_t n = 0;
+
+	last = __atomic_load_n(&apdu_rec_last, __ATOMIC_ACQUIRE);
+	if (last == 0 || max == 0)
+		return (0);
+	first = 1;
+	if (last > PIV_APDU_REC_COUNT)
+		first = last - PIV_APDU_REC_COUNT + 1;
+	if (last - first + 1 > max)
+		first = last - max + 1;
+
+	for (seq = first; seq <= last; ++seq) {
+		rec = &apdu_recs[(seq - 1) % PIV_APDU_REC_COUNT];
+		if (__atomic_load_n(&rec->par_seq, __ATOMIC_ACQUIRE) != seq)
+			continue;
+		bcopy(rec, &out[n], sizeof (struct piv_apdu_rec));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&rec->par_seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		out[n++].par_seq = seq;
+	}
+	return (n);
+}
+
 /*
  * The basic APDU transceiver function. Doesn't handle any chaining or length
  * correction logic at all.
  */
+/*
+ * Status words the PIV applet gives back in normal use: success, more data,
+ * warnings (including PIN retry counts), or refusals to do with auth or the
+ * data asked for. Anything else might be another applet answering.
+ */
+static boolean_t
+piv_sw_expected(uint16_t sw)
+{
+	switch (sw & 0xFF00) {
+	case SW_NO_ERROR:
+	case SW_BYTES_REMAINING_00:
+	case SW_CORRECT_LE_00:
+	case SW_WARNING_NO_CHANGE_00:
+	case SW_WARNING_00:
+		return (B_TRUE);
+	}
+	switch (sw) {
+	case SW_SECURITY_STATUS_NOT_SATISFIED:
+	case SW_FILE_INVALID:
+	case SW_CONDITIONS_NOT_SATISFIED:
+	case SW_WRONG_DATA:
+	case SW_FILE_NOT_FOUND:
+		return (B_TRUE);
+	default:
+		return (B_FALSE);
+	}
+}
+
 errf_t *
 piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
 {
@@ -1636,11 +2472,13 @@ piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
 	DWORD recvLength;
 	uint8_t *cmd;
 	struct apdubuf *r = &(apdu->a_reply);
+	struct timespec t0, t1, when;
+	boolean_t timed;
+	uint64_t usec = 0;
 
 	VERIFY(key->pt_intxn == B_TRUE);
 
 	cmd = apdu_to_buffer(apdu, &cmdLen);
-	VERIFY(cmd != NULL);
 	if (cmd == NULL || cmdLen < 5)
 		return (ERRF_NOMEM);
 
@@ -1659,9 +2497,44 @@ piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
 		    NULL);
 	}
 
-	rv = SCardTransmit(key->pt_cardhdl, &key->pt_sendpci, cmd,
-	    cmdLen, NULL, r->b_data + r->b_offset, &recvLength);
-	freezero(cmd, cmdLen);
+	timed = (piv_apdu_observer != NULL || piv_apdu_recording);
+	if (piv_apdu_recording)
+		(void) clock_gettime(CLOCK_REALTIME, &when);
+	if (timed)
+		(void) clock_gettime(CLOCK_MONOTONIC, &t0);
+	PIVY_PROBE4(apdu__start, apdu->a_ins, apdu->a_p1, apdu->a_p2,
+	    apdu->a_cmd.b_data == NULL ? 0 : apdu->a_cmd.b_len);
+	if (key->pt_xport != NULL) {
+		size_t rlen = recvLength;
+		err = key->pt_xport->ptr_transmit(key->pt_xport_priv, cmd,
+		    cmdLen, r->b_data + r->b_offset, &rlen);
+		rv = (err == ERRF_OK) ? SCARD_S_SUCCESS : SCARD_F_COMM_ERROR;
+		recvLength = rlen;
+	} else {
+		err = ERRF_OK;
+		rv = SCardTransmit(key->pt_cardhdl, &key->pt_sendpci, cmd,
+		    cmdLen, NULL, r->b_data + r->b_offset, &recvLength);
+	}
+	if (timed) {
+		(void) clock_gettime(CLOCK_MONOTONIC, &t1);
+		usec = (t1.tv_sec - t0.tv_sec) * 1000000ULL;
+		usec += t1.tv_nsec / 1000;
+		usec -= t0.tv_nsec / 1000;
+	}
+	if (apdu->a_arena != NULL) {
+		struct piv_apdu_arena *pa = apdu->a_arena;
+		size_t end;
+		explicit_bzero(cmd, cmdLen);
+		/* We don't trust recvLength on failure: wipe it all later. */
+		end = r->b_size;
+		if (rv == SCARD_S_SUCCESS &&
+		    recvLength <= r->b_size - r->b_offset)
+			end = r->b_offset + recvLength;
+		if (end > pa->pa_used)
+			pa->pa_used = end;
+	} else {
+		freezero(cmd, cmdLen);
+	}
 
 	if (piv_full_apdu_debug) {
 		bunyan_log(BNY_TRACE, "received APDU",
@@ -1670,7 +2543,12 @@ piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
 	}
 
 	if (rv != SCARD_S_SUCCESS) {
-		err = pcscrerrf("SCardTransmit", key->pt_rdrname, rv);
+		key->pt_selected = B_FALSE;
+		PIVY_PROBE2(apdu__fail, apdu->a_ins, rv);
+		if (piv_apdu_recording)
+			apdu_record(apdu, &when, usec, 0, B_TRUE);
+		if (err == ERRF_OK)
+			err = pcscrerrf("SCardTransmit", key->pt_rdrname, rv);
 		bunyan_log(BNY_DEBUG, "SCardTransmit failed",
 		    "error", BNY_ERF, err, NULL);
 		if (freedata) {
@@ -1684,6 +2562,14 @@ piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
 	r->b_len = recvLength;
 	apdu->a_sw = (r->b_data[r->b_offset + recvLength] << 8) |
 	    r->b_data[r->b_offset + recvLength + 1];
+	/*
+	 * Anything the PIV applet doesn't say in the normal course of things
+	 * might mean we're not talking to it any more (someone else selected
+	 * another applet without resetting the card), so SELECT next time.
+	 */
+	if (!piv_sw_expected(apdu->a_sw))
+		key->pt_selected = B_FALSE;
+	PIVY_PROBE4(apdu__done, apdu->a_ins, apdu->a_sw, usec, r->b_len);
 
 	bunyan_log(BNY_DEBUG, "APDU exchanged",
 	    "class", BNY_UINT, (uint)apdu->a_cls,
@@ -1691,46 +2577,104 @@ piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
 	    "ins_name", BNY_STRING, ins_to_name(apdu->a_ins),
 	    "p1", BNY_UINT, (uint)apdu->a_p1,
 	    "p2", BNY_UINT, (uint)apdu->a_p2,
-	    "lc", BNY_UINT, (uint)(cmdLen - 5),
-	    "le", BNY_UINT, (uint)apdu->a_le,
+	    "lc", BNY_UINT, (uint)(apdu->a_cmd.b_data == NULL ? 0 :
+	    apdu->a_cmd.b_len),
+	    "le", BNY_UINT, (uint)(apdu->a_extle != 0 ? apdu->a_extle :
+	    apdu->a_le),
 	    "sw", BNY_UINT, (uint)apdu->a_sw,
 	    "sw_name", BNY_STRING, sw_to_name(apdu->a_sw),
 	    "lr", BNY_UINT, (uint)r->b_len,
 	    NULL);
 
+	if (piv_apdu_recording)
+		apdu_record(apdu, &when, usec, r->b_len, B_FALSE);
+	if (piv_apdu_observer != NULL) {
+		piv_apdu_observer(apdu->a_ins, ins_to_name(apdu->a_ins),
+		    apdu->a_sw, usec);
+	}
+
 	return (ERRF_OK);
 }
 
 /*
  * This function sends and receives chains of commands so that the data length
  * can be arbitrarily long on either side.
+ *
+ * If the card supports extended-length APDUs (pt_extlen) we send the command
+ * in PIV_EXT_MAX_LC-sized pieces instead of 0xFF and ask for the whole reply
+ * buffer in one go, so most exchanges become a single round trip. If the card
+ * or reader refuses the extended form we clear pt_extlen and fall back to
+ * short APDUs for the rest of this token's life.
  */
 errf_t *
 piv_apdu_transceive_chain(struct piv_token *pk, struct apdu *apdu)
 {
 	errf_t *rv;
 	size_t offset;
-	size_t rem;
+	size_t rem, seg;
+	size_t cmdoff, cmdlen;
 	boolean_t gotok = B_FALSE;
+	boolean_t ext;
+	enum iso_class cls;
 
 	VERIFY(pk->pt_intxn == B_TRUE);
 
+	cmdoff = apdu->a_cmd.b_offset;
+	cmdlen = apdu->a_cmd.b_len;
+	cls = apdu->a_cls;
+
+restart:
+	ext = pk->pt_extlen;
+	seg = 0xFF;
+	apdu->a_extle = 0;
+	if (ext) {
+		seg = PIV_EXT_MAX_LC;
+		if (apdu->a_reply.b_data == NULL) {
+			apdu->a_extle = MAX_APDU_SIZE - 2;
+		} else {
+			VERIFY3U(apdu->a_reply.b_size, >=,
+			    apdu->a_reply.b_offset + 2);
+			apdu->a_extle = apdu->a_reply.b_size -
+			    apdu->a_reply.b_offset - 2;
+		}
+		if (apdu->a_extle > 0x10000)
+			apdu->a_extle = 0x10000;
+		if (apdu->a_extle == 0)
+			ext = B_FALSE;
+	}
+
 	/* First, send the command. */
-	rem = apdu->a_cmd.b_len;
+	rem = cmdlen;
 	do {
 		/* Is there another block needed in the chain? */
-		if (rem > 0xFF) {
+		if (rem > seg) {
 			apdu->a_cls |= CLA_CHAIN;
-			apdu->a_cmd.b_len = 0xFF;
+			apdu->a_cmd.b_len = seg;
 		} else {
 			apdu->a_cls &= ~CLA_CHAIN;
 			apdu->a_cmd.b_len = rem;
 		}
 again:
 		rv = piv_apdu_transceive(pk, apdu);
+		if (ext && (rv != ERRF_OK || apdu->a_sw == SW_WRONG_LENGTH)) {
+			if (rv == ERRF_OK)
+				rv = swerrf("extended-length APDU", apdu->a_sw);
+			bunyan_log(BNY_DEBUG, "extended APDU refused, "
+			    "falling back to short APDUs",
+			    "reader", BNY_STRING, pk->pt_rdrname,
+			    "error", BNY_ERF, rv, NULL);
+			errf_free(rv);
+			pk->pt_extlen = B_FALSE;
+			apdu->a_cmd.b_offset = cmdoff;
+			apdu->a_cmd.b_len = cmdlen;
+			apdu->a_cls = cls;
+			goto restart;
+		}
 		if (rv)
 			return (rv);
 		if ((apdu->a_sw & 0xFF00) == SW_CORRECT_LE_00) {
+			if (ext)
+				apdu->a_extle = apdu->a_sw & 0x00FF;
 			apdu->a_le = apdu->a_sw & 0x00FF;
 			/*
 			 * We have to explicitly jump here because this case
@@ -1749,10 +2693,14 @@ again:
 			 * Return any other error straight away -- we can
 			 * only get response chaining on BYTES_REMAINING
 			 */
+			apdu->a_extle = 0;
 			return (ERRF_OK);
 		}
 	} while (rem > 0);
 
+	/* CONTINUE commands are always short, whatever we started with. */
+	apdu->a_extle = 0;
+
 	/*
 	 * We keep the original reply offset so we can calculate how much
 	 * data we actually received later.
@@ -1765,10 +2713,12 @@ again:
 	 *
 	 * Note the case where we got SW_NO_ERROR but max length data -- we try
 	 * a CONTINUE just in case -- there are a few cards which are buggy
-	 * and don't always give us SW_BYTES_REMAINING.
+	 * and don't always give us SW_BYTES_REMAINING. This doesn't apply to
+	 * extended replies, which can legitimately be any length.
 	 */
 	while ((apdu->a_sw & 0xFF00) == SW_BYTES_REMAINING_00 ||
-	    (apdu->a_sw == SW_NO_ERROR && apdu->a_reply.b_len >= 0xFF)) {
+	    (!ext && apdu->a_sw == SW_NO_ERROR &&
+	    apdu->a_reply.b_len >= 0xFF)) {
 		if (apdu->a_sw == SW_NO_ERROR)
 			gotok = B_TRUE;
 		apdu->a_cls = CLA_ISO;
@@ -1805,9 +2755,20 @@ piv_txn_begin(struct piv_token *key)
 	LONG rv;
 	errf_t *err;
 	DWORD activeProtocol = 0;
+
+	PIVY_PROBE1(txn__begin, key->pt_rdrname);
+	if (key->pt_xport != NULL) {
+		if ((err = key->pt_xport->ptr_begin(key->pt_xport_priv))) {
+			err = ioerrf(err, key->pt_rdrname);
+			PIVY_PROBE2(txn__begun, key->pt_rdrname, 0);
+			return (err);
+		}
+		goto begun;
+	}
 retry:
 	rv = SCardBeginTransaction(key->pt_cardhdl);
 	if (rv == SCARD_W_RESET_CARD) {
+		key->pt_selected = B_FALSE;
 		rv = SCardReconnect(key->pt_cardhdl, SCARD_SHARE_SHARED,
 		    SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, SCARD_RESET_CARD,
 		    &activeProtocol);
@@ -1816,15 +2777,19 @@ retry:
 		} else {
 			err = ioerrf(pcscerrf("SCardReconnect", rv),
 			    key->pt_rdrname);
+			PIVY_PROBE2(txn__begun, key->pt_rdrname, 0);
 			return (err);
 		}
 	}
 	if (rv != SCARD_S_SUCCESS) {
 		err = ioerrf(pcscerrf("SCardBeginTransaction", rv),
 		    key->pt_rdrname);
+		PIVY_PROBE2(txn__begun, key->pt_rdrname, 0);
 		return (err);
 	}
+begun:
 	key->pt_intxn = B_TRUE;
+	PIVY_PROBE2(txn__begun, key->pt_rdrname, 1);
 	return (0);
 }
 
@@ -1833,14 +2798,22 @@ piv_txn_end(struct piv_token *key)
 {
 	VERIFY(key->pt_intxn == B_TRUE);
 	LONG rv;
-	rv = SCardEndTransaction(key->pt_cardhdl,
-	    key->pt_reset ? SCARD_RESET_CARD : SCARD_LEAVE_CARD);
+	PIVY_PROBE1(txn__end, key->pt_rdrname);
+	if (key->pt_xport != NULL) {
+		key->pt_xport->ptr_end(key->pt_xport_priv, key->pt_reset);
+		rv = SCARD_S_SUCCESS;
+	} else {
+		rv = SCardEndTransaction(key->pt_cardhdl,
+		    key->pt_reset ? SCARD_RESET_CARD : SCARD_LEAVE_CARD);
+	}
 	if (rv != SCARD_S_SUCCESS) {
 		bunyan_log(BNY_ERROR, "SCardEndTransaction failed",
 		    "reader", BNY_STRING, key->pt_rdrname,
 		    "err", BNY_STRING, pcsc_stringify_error(rv),
 		    NULL);
 	}
+	if (key->pt_reset || rv != SCARD_S_SUCCESS)
+		key->pt_selected = B_FALSE;
 	key->pt_intxn = B_FALSE;
 	key->pt_reset = B_FALSE;
 }
@@ -1851,12 +2824,13 @@ piv_select(struct piv_token *tk)
 	errf_t *rv = ERRF_OK;
 	struct apdu *apdu;
 	struct tlv_state *tlv = NULL;
+	struct tlv_state rtlv;
 	uint tag, idx, uval;
 	boolean_t extra_apt = B_FALSE;
 
 	VERIFY(tk->pt_intxn == B_TRUE);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_SELECT, SEL_APP_AID, 0);
+	apdu = piv_apdu_borrow(tk, CLA_ISO, INS_SELECT, SEL_APP_AID, 0);
 	apdu->a_cmd.b_data = (uint8_t *)AID_PIV;
 	apdu->a_cmd.b_len = sizeof (AID_PIV);
 
@@ -1874,8 +2848,8 @@ piv_select(struct piv_token *tk)
 		 * [piv] 800-73-4 part 2, section 3.1.1
 		 * In particular, table 3 has the list of tags here.
 		 */
-		tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
-		    apdu->a_reply.b_len);
+		tlv = tlv_init_local(&rtlv, apdu->a_reply.b_data,
+		    apdu->a_reply.b_offset, apdu->a_reply.b_len);
 		if ((rv = tlv_read_tag(tlv, &tag)))
 			goto invdata;
 		if (tag != PIV_TAG_APT) {
@@ -1951,6 +2925,7 @@ piv_select(struct piv_token *tk)
 	}
 
 out:
+	tk->pt_selected = (rv == ERRF_OK);
 	tlv_free(tlv);
 	piv_apdu_free(apdu);
 	return (rv);
@@ -1962,6 +2937,54 @@ invdata:
 	goto out;
 }
 
+/*
+ * Gets the reader's event counter, which pcsc-lite keeps in the top 16 bits
+ * of dwEventState and bumps on every card insertion or removal. Other PCSC
+ * implementations leave it at zero, which just means we only notice resets.
+ */
+static boolean_t
+piv_reader_evcount(struct piv_token *tk, DWORD *evcount)
+{
+	SCARD_READERSTATE rs;
+	LONG rv;
+
+	if (tk->pt_xport != NULL) {
+		*evcount = 0;
+		return (B_TRUE);
+	}
+	bzero(&rs, sizeof (rs));
+	rs.szReader = tk->pt_rdrname;
+	rs.dwCurrentState = SCARD_STATE_UNAWARE;
+	rv = SCardGetStatusChange(tk->pt_ctx, 0, &rs, 1);
+	if (rv != SCARD_S_SUCCESS || !(rs.dwEventState & SCARD_STATE_PRESENT))
+		return (B_FALSE);
+	*evcount = rs.dwEventState >> 16;
+	return (B_TRUE);
+}
+
+errf_t *
+piv_select_cached(struct piv_token *tk)
+{
+	DWORD evcount;
+	errf_t *err;
+
+	VERIFY(tk->pt_intxn == B_TRUE);
+
+	if (!piv_reader_evcount(tk, &evcount)) {
+		tk->pt_selected = B_FALSE;
+		return (piv_select(tk));
+	}
+	if (tk->pt_selected && evcount == tk->pt_evcount) {
+		bunyan_log(BNY_TRACE, "skipping SELECT, applet still selected",
+		    "reader", BNY_STRING, tk->pt_rdrname, NULL);
+		return (ERRF_OK);
+	}
+	if ((err = piv_select(tk)))
+		return (err);
+	tk->pt_evcount = evcount;
+	return (ERRF_OK);
+}
+
 /*
  * see [piv] 800-73-4 part 2 appendix A.1
  */
@@ -1973,6 +2996,7 @@ piv_auth_admin(struct piv_token *pt, const uint8_t *key, size_t keylen,
 	int rv;
 	struct apdu *apdu = NULL;
 	struct tlv_state *tlv;
+	struct tlv_state rtlv;
 	uint tag;
 	uint8_t *chal = NULL, *resp = NULL, *iv = NULL;
 	size_t challen = 0, ivlen, resplen = 0;
@@ -2016,7 +3040,7 @@ piv_auth_admin(struct piv_token *pt, const uint8_t *key, size_t keylen,
 	tlv_pop(tlv);
 	tlv_pop(tlv);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GEN_AUTH, keyalg,
+	apdu = piv_apdu_borrow(pt, CLA_ISO, INS_GEN_AUTH, keyalg,
 	    PIV_SLOT_ADMIN);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
@@ -2052,8 +3076,8 @@ piv_auth_admin(struct piv_token *pt, const uint8_t *key, size_t keylen,
 		return (err);
 	}
 
-	tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
-	    apdu->a_reply.b_len);
+	tlv = tlv_init_local(&rtlv, apdu->a_reply.b_data,
+	    apdu->a_reply.b_offset, apdu->a_reply.b_len);
 	if ((err = tlv_read_tag(tlv, &tag)))
 		goto invdata;
 	if (tag != 0x7C) {
@@ -2114,7 +3138,7 @@ piv_auth_admin(struct piv_token *pt, const uint8_t *key, size_t keylen,
 
 	pt->pt_reset = B_TRUE;
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GEN_AUTH, keyalg,
+	apdu = piv_apdu_borrow(pt, CLA_ISO, INS_GEN_AUTH, keyalg,
 	    PIV_SLOT_ADMIN);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
@@ -2170,40 +3194,33 @@ invdata:
 /*
  * see [piv] 800-73-4 part 2 section 3.3.1
  */
-errf_t *
-piv_write_file(struct piv_token *pt, uint tag, const uint8_t *data, size_t len)
+/*
+ * Sends a PUT DATA command already built into the buffer cmd (the 0x5C tag
+ * and the 0x53 file contents).
+ */
+static errf_t *
+piv_put_data(struct piv_token *pt, uint tag, uint8_t *cmd, size_t cmdlen)
 {
 	errf_t *err;
 	struct apdu *apdu;
-	struct tlv_state *tlv;
 
 	VERIFY(pt->pt_intxn == B_TRUE);
 
-	tlv = tlv_init_write();
-	tlv_push(tlv, 0x5C);
-	tlv_write_u8to32(tlv, tag);
-	tlv_pop(tlv);
-	tlv_pushl(tlv, 0x53, len + 8);
-	tlv_write(tlv, (uint8_t *)data, len);
-	tlv_pop(tlv);
+	piv_cert_cache_forget(pt);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_PUT_DATA, 0x3F, 0xFF);
-	apdu->a_cmd.b_data = tlv_buf(tlv);
-	apdu->a_cmd.b_len = tlv_len(tlv);
+	apdu = piv_apdu_borrow(pt, CLA_ISO, INS_PUT_DATA, 0x3F, 0xFF);
+	apdu->a_cmd.b_data = cmd;
+	apdu->a_cmd.b_len = cmdlen;
 
 	err = piv_apdu_transceive_chain(pt, apdu);
 	if (err) {
 		err = ioerrf(err, pt->pt_rdrname);
 		bunyan_log(BNY_WARN, "piv_write_file.transceive_chain failed",
 		    "error", BNY_ERF, err, NULL);
-		tlv_free(tlv);
 		piv_apdu_free(apdu);
 		return (err);
 	}
 
-	tlv_free(tlv);
-	tlv = NULL;
-
 	if (apdu->a_sw == SW_NO_ERROR) {
 		err = ERRF_OK;
 	} else if (apdu->a_sw == SW_OUT_OF_MEMORY) {
@@ -2225,6 +3242,152 @@ piv_write_file(struct piv_token *pt, uint tag, const uint8_t *data, size_t len)
 	return (err);
 }
 
+/* Size of a PUT DATA command for file "tag" with contents of length len. */
+static size_t
+piv_put_data_len(uint tag, size_t len)
+{
+	return (tlv_hdr_len(0x5C, tlv_u8to32_len(tag)) +
+	    tlv_u8to32_len(tag) + tlv_hdr_len(0x53, len) + len);
+}
+
+/*
+ * Writes the start of that command, leaving the 0x53 tag open for the caller
+ * to write the contents into and tlv_pop().
+ */
+static void
+piv_put_data_begin(struct tlv_state *tlv, uint tag, size_t len)
+{
+	tlv_pushl(tlv, 0x5C, tlv_u8to32_len(tag));
+	tlv_write_u8to32(tlv, tag);
+	tlv_pop(tlv);
+	tlv_pushl(tlv, 0x53, len);
+}
+
+errf_t *
+piv_write_file(struct piv_token *pt, uint tag, const uint8_t *data, size_t len)
+{
+	errf_t *err;
+	struct tlv_state wtlv, *tlv;
+	uint8_t *cmd;
+	size_t cmdlen;
+
+	VERIFY(pt->pt_intxn == B_TRUE);
+
+	cmdlen = piv_put_data_len(tag, len);
+	cmd = malloc(cmdlen);
+	if (cmd == NULL)
+		return (ERRF_NOMEM);
+
+	tlv = tlv_init_write_local(&wtlv, cmd, cmdlen);
+	piv_put_data_begin(tlv, tag, len);
+	tlv_write(tlv, data, len);
+	tlv_pop(tlv);
+	VERIFY3U(tlv_len(tlv), ==, cmdlen);
+	tlv_free(tlv);
+
+	err = piv_put_data(pt, tag, cmd, cmdlen);
+
+	freezero(cmd, cmdlen);
+	return (err);
+}
+
+/*
+ * Reads the public key data objects which make up a key in both the
+ * INS_GEN_ASYM response and the YubicoPIV GET METADATA response (tags 0x81
+ * and 0x82 for RSA, 0x86 for EC), up to the end of the enclosing tag.
+ *
+ * see [piv] 800-73-4 part 2 section 3.3.2 table 10
+ */
+static errf_t *
+piv_read_pubkey_tags(struct tlv_state *tlv, enum piv_alg alg, const char *ins,
+    struct sshkey **pubkey)
+{
+	errf_t *err;
+	int rv;
+	uint tag;
+	struct sshkey *k = NULL;
+
+	if (alg == PIV_ALG_RSA1024 || alg == PIV_ALG_RSA2048) {
+		k = sshkey_new(KEY_RSA);
+		VERIFY(k != NULL);
+	} else if (alg == PIV_ALG_ECCP256) {
+		k = sshkey_new(KEY_ECDSA);
+		VERIFY(k != NULL);
+		k->ecdsa_nid = NID_X9_62_prime256v1;
+		k->ecdsa = EC_KEY_new_by_curve_name(k->ecdsa_nid);
+		EC_KEY_set_asn1_flag(k->ecdsa, OPENSSL_EC_NAMED_CURVE);
+	} else if (alg == PIV_ALG_ECCP384) {
+		k = sshkey_new(KEY_ECDSA);
+		VERIFY(k != NULL);
+		k->ecdsa_nid = NID_secp384r1;
+		k->ecdsa = EC_KEY_new_by_curve_name(k->ecdsa_nid);
+		EC_KEY_set_asn1_flag(k->ecdsa, OPENSSL_EC_NAMED_CURVE);
+	} else {
+		return (argerrf("alg", "a supported algorithm", "%d", alg));
+	}
+	while (!tlv_at_end(tlv)) {
+		if ((err = tlv_read_tag(tlv, &tag)))
+			goto out;
+		if (alg == PIV_ALG_RSA1024 || alg == PIV_ALG_RSA2048) {
+			if (tag == 0x81) {		/* Modulus */
+				VERIFY(BN_bin2bn(tlv_ptr(tlv),
+				    tlv_rem(tlv), k->rsa->n) != NULL);
+				tlv_skip(tlv);
+				continue;
+			} else if (tag == 0x82) {	/* Exponent */
+				VERIFY(BN_bin2bn(tlv_ptr(tlv),
+				    tlv_rem(tlv), k->rsa->e) != NULL);
+				tlv_skip(tlv);
+				continue;
+			}
+		} else if (tag == 0x86) {
+			const EC_GROUP *g;
+			EC_POINT *point;
+
+			g = EC_KEY_get0_group(k->ecdsa);
+			VERIFY(g != NULL);
+			point = EC_POINT_new(g);
+			VERIFY(point != NULL);
+			rv = EC_POINT_oct2point(g, point,
+			    tlv_ptr(tlv), tlv_rem(tlv), NULL);
+			if (rv != 1) {
+				make_sslerrf(err, "EC_POINT_oct2point",
+				    "parsing pubkey");
+				EC_POINT_free(point);
+				goto out;
+			}
+
+			rv = sshkey_ec_validate_public(g, point);
+			if (rv) {
+				err = ssherrf("sshkey_ec_validate_public", rv);
+				EC_POINT_free(point);
+				goto out;
+			}
+			rv = EC_KEY_set_public_key(k->ecdsa, point);
+			EC_POINT_free(point);
+			if (rv != 1) {
+				make_sslerrf(err, "EC_KEY_set_public_key",
+				    "parsing pubkey");
+				goto out;
+			}
+
+			tlv_skip(tlv);
+			continue;
+		}
+		err = errf("PIVTagError", NULL, "Invalid tag 0x%x in PIV %s "
+		    "response", (uint)tag, ins);
+		goto out;
+	}
+
+	*pubkey = k;
+	k = NULL;
+	err = ERRF_OK;
+
+out:
+	sshkey_free(k);
+	return (err);
+}
+
 /*
  * see [piv] 800-73-4 part 2 section 3.3.2
  */
@@ -2234,9 +3397,11 @@ piv_generate_common(struct piv_token *pt, struct apdu *apdu,
     struct sshkey **pubkey)
 {
 	errf_t *err;
-	int rv;
 	uint tag;
 	struct sshkey *k = NULL;
+	struct tlv_state rtlv;
+
+	piv_cert_cache_forget(pt);
 
 	err = piv_apdu_transceive_chain(pt, apdu);
 	if (err) {
@@ -2249,98 +3414,28 @@ piv_generate_common(struct piv_token *pt, struct apdu *apdu,
 	tlv_free(tlv);
 	tlv = NULL;
 
-	if (apdu->a_sw == SW_NO_ERROR ||
-	    (apdu->a_sw & 0xFF00) == SW_WARNING_NO_CHANGE_00 ||
-	    (apdu->a_sw & 0xFF00) == SW_WARNING_00) {
-		tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
-		    apdu->a_reply.b_len);
-		if ((err = tlv_read_tag(tlv, &tag)))
-			goto invdata;
-		if (tag != 0x7F49) {
-			err = tagerrf("INS_GEN_ASYM", tag);
-			goto invdata;
-		}
-		if (alg == PIV_ALG_RSA1024 || alg == PIV_ALG_RSA2048) {
-			k = sshkey_new(KEY_RSA);
-			VERIFY(k != NULL);
-		} else if (alg == PIV_ALG_ECCP256) {
-			k = sshkey_new(KEY_ECDSA);
-			VERIFY(k != NULL);
-			k->ecdsa_nid = NID_X9_62_prime256v1;
-			k->ecdsa = EC_KEY_new_by_curve_name(k->ecdsa_nid);
-			EC_KEY_set_asn1_flag(k->ecdsa, OPENSSL_EC_NAMED_CURVE);
-		} else if (alg == PIV_ALG_ECCP384) {
-			k = sshkey_new(KEY_ECDSA);
-			VERIFY(k != NULL);
-			k->ecdsa_nid = NID_secp384r1;
-			k->ecdsa = EC_KEY_new_by_curve_name(k->ecdsa_nid);
-			EC_KEY_set_asn1_flag(k->ecdsa, OPENSSL_EC_NAMED_CURVE);
-		} else {
-			err = argerrf("alg", "a supported algorithm", "%d", alg);
-			tlv_abort(tlv);
-			goto out;
-		}
-		while (!tlv_at_end(tlv)) {
-			if ((err = tlv_read_tag(tlv, &tag)))
-				goto invdata;
-			if (alg == PIV_ALG_RSA1024 || alg == PIV_ALG_RSA2048) {
-				if (tag == 0x81) {		/* Modulus */
-					VERIFY(BN_bin2bn(tlv_ptr(tlv),
-					    tlv_rem(tlv), k->rsa->n) != NULL);
-					tlv_skip(tlv);
-					continue;
-				} else if (tag == 0x82) {	/* Exponent */
-					VERIFY(BN_bin2bn(tlv_ptr(tlv),
-					    tlv_rem(tlv), k->rsa->e) != NULL);
-					tlv_skip(tlv);
-					continue;
-				}
-			} else if (alg == PIV_ALG_ECCP256 ||
-			    alg == PIV_ALG_ECCP384) {
-				if (tag == 0x86) {
-					const EC_GROUP *g;
-					EC_POINT *point;
-
-					g = EC_KEY_get0_group(k->ecdsa);
-					VERIFY(g != NULL);
-					point = EC_POINT_new(g);
-					VERIFY(point != NULL);
-					rv = EC_POINT_oct2point(g, point,
-					    tlv_ptr(tlv), tlv_rem(tlv), NULL);
-					if (rv != 1) {
-						make_sslerrf(err,
-						    "EC_POINT_oct2point",
-						    "parsing pubkey");
-						goto invdata;
-					}
-
-					rv = sshkey_ec_validate_public(g,
-					    point);
-					if (rv) {
-						err = ssherrf(
-						    "sshkey_ec_validate_public",
-						    rv);
-						goto invdata;
-					}
-					rv = EC_KEY_set_public_key(
-					    k->ecdsa, point);
-					if (rv != 1) {
-						make_sslerrf(err,
-						    "EC_KEY_set_public_key",
-						    "parsing pubkey");
-						goto invdata;
-					}
-					EC_POINT_free(point);
-
-					tlv_skip(tlv);
-					continue;
-				}
-			}
+	if (apdu->a_sw == SW_NO_ERROR ||
+	    (apdu->a_sw & 0xFF00) == SW_WARNING_NO_CHANGE_00 ||
+	    (apdu->a_sw & 0xFF00) == SW_WARNING_00) {
+		tlv = tlv_init_local(&rtlv, apdu->a_reply.b_data,
+		    apdu->a_reply.b_offset, apdu->a_reply.b_len);
+		if ((err = tlv_read_tag(tlv, &tag)))
+			goto invdata;
+		if (tag != 0x7F49) {
 			err = tagerrf("INS_GEN_ASYM", tag);
 			goto invdata;
 		}
-		if ((err = tlv_end(tlv)))
+		err = piv_read_pubkey_tags(tlv, alg, "INS_GEN_ASYM", &k);
+		if (err && errf_caused_by(err, "ArgumentError")) {
+			tlv_abort(tlv);
+			goto out;
+		} else if (err) {
+			goto invdata;
+		}
+		if ((err = tlv_end(tlv))) {
+			sshkey_free(k);
 			goto invdata;
+		}
 
 		*pubkey = k;
 
@@ -2385,7 +3480,7 @@ piv_generate(struct piv_token *pt, enum piv_slotid slotid, enum piv_alg alg,
 	tlv_pop(tlv);
 	tlv_pop(tlv);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GEN_ASYM, 0x00, slotid);
+	apdu = piv_apdu_borrow(pt, CLA_ISO, INS_GEN_ASYM, 0x00, slotid);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -2403,6 +3498,7 @@ ykpiv_get_metadata(struct piv_token *pt, struct piv_slot *slot)
 {
 	struct apdu *apdu;
 	struct tlv_state *tlv = NULL;
+	struct tlv_state rtlv;
 	errf_t *err;
 	uint tag;
 	enum ykpiv_pin_policy pinpol;
@@ -2412,7 +3508,7 @@ ykpiv_get_metadata(struct piv_token *pt, struct piv_slot *slot)
 	VERIFY(pt->pt_intxn);
 
 	/* Reject if this isn't a YubicoPIV card. */
-	if (!pt->pt_ykpiv)
+	if (!piv_token_is_ykpiv(pt))
 		return (argerrf("tk", "a YubicoPIV-compatible token", "not"));
 	if (ykpiv_version_compare(pt, 5, 3, 0) == -1) {
 		return (argerrf("touchpolicy", "GET_METADATA only on YubicoPIV "
@@ -2420,7 +3516,8 @@ ykpiv_get_metadata(struct piv_token *pt, struct piv_slot *slot)
 		    pt->pt_ykver[0], pt->pt_ykver[1], pt->pt_ykver[2]));
 	}
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GET_METADATA, 0x00, slot->ps_slot);
+	apdu = piv_apdu_borrow(pt, CLA_ISO, INS_GET_METADATA, 0x00,
+	    slot->ps_slot);
 
 	err = piv_apdu_transceive_chain(pt, apdu);
 	if (err) {
@@ -2431,8 +3528,8 @@ ykpiv_get_metadata(struct piv_token *pt, struct piv_slot *slot)
 	if (apdu->a_sw == SW_NO_ERROR ||
 	    (apdu->a_sw & 0xFF00) == SW_WARNING_NO_CHANGE_00 ||
 	    (apdu->a_sw & 0xFF00) == SW_WARNING_00) {
-		tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
-		    apdu->a_reply.b_len);
+		tlv = tlv_init_local(&rtlv, apdu->a_reply.b_data,
+		    apdu->a_reply.b_offset, apdu->a_reply.b_len);
 		while (!tlv_at_end(tlv)) {
 			if ((err = tlv_read_tag(tlv, &tag)))
 				goto invdata;
@@ -2482,6 +3579,28 @@ ykpiv_get_metadata(struct piv_token *pt, struct piv_slot *slot)
 					slot->ps_auth &= ~PIV_SLOT_AUTH_TOUCH;
 				}
 				break;
+			case 0x04:
+				/*
+				 * The public key. If we've already got one
+				 * from the cert, that one wins.
+				 */
+				if (slot->ps_pubkey != NULL) {
+					tlv_skip(tlv);
+					break;
+				}
+				err = piv_read_pubkey_tags(tlv, slot->ps_alg,
+				    "YK_INS_GET_METADATA", &slot->ps_pubkey);
+				if (err && errf_caused_by(err, "ArgumentError")) {
+					/* A key type we don't know about. */
+					errf_free(err);
+					tlv_skip(tlv);
+					break;
+				} else if (err) {
+					goto invdata;
+				}
+				if ((err = tlv_end(tlv)))
+					goto invdata;
+				break;
 			default:
 				tlv_skip(tlv);
 			}
@@ -2492,6 +3611,11 @@ ykpiv_get_metadata(struct piv_token *pt, struct piv_slot *slot)
 		err = notsuperrf(swerrf("YK_INS_GET_METADATA", apdu->a_sw),
 		    pt->pt_rdrname, "key slot 0x%02x", slot->ps_slot);
 
+	} else if (apdu->a_sw == SW_FILE_NOT_FOUND) {
+		err = errf("NotFoundError", swerrf("YK_INS_GET_METADATA",
+		    apdu->a_sw), "No key found in slot %02x in device '%s'",
+		    (uint)slot->ps_slot, pt->pt_rdrname);
+
 	} else {
 		err = swerrf("YK_INS_GET_METADATA", apdu->a_sw);
 		bunyan_log(BNY_DEBUG, "unexpected card error",
@@ -2608,7 +3732,7 @@ ykpiv_generate(struct piv_token *pt, enum piv_slotid slotid,
 	VERIFY(pt->pt_intxn);
 
 	/* Reject if this isn't a YubicoPIV card. */
-	if (!pt->pt_ykpiv)
+	if (!piv_token_is_ykpiv(pt))
 		return (argerrf("tk", "a YubicoPIV-compatible token", "not"));
 	/* The TOUCH_CACHED option is only supported on versions >=4.3 */
 	if (touchpolicy == YKPIV_TOUCH_CACHED &&
@@ -2635,7 +3759,7 @@ ykpiv_generate(struct piv_token *pt, enum piv_slotid slotid,
 	}
 	tlv_pop(tlv);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GEN_ASYM, 0x00, slotid);
+	apdu = piv_apdu_borrow(pt, CLA_ISO, INS_GEN_ASYM, 0x00, slotid);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -2683,6 +3807,8 @@ ykpiv_import(struct piv_token *pt, enum piv_slotid slotid, struct sshkey *key,
 
 	VERIFY(pt->pt_intxn);
 
+	piv_cert_cache_forget(pt);
+
 	tlv = tlv_init_write();
 
 	switch (key->type) {
@@ -2729,7 +3855,7 @@ ykpiv_import(struct piv_token *pt, enum piv_slotid slotid, struct sshkey *key,
 		goto out;
 	}
 
-	apdu = piv_apdu_make(CLA_ISO, INS_IMPORT_ASYM, alg, slotid);
+	apdu = piv_apdu_borrow(pt, CLA_ISO, INS_IMPORT_ASYM, alg, slotid);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -2826,8 +3952,10 @@ piv_write_cert(struct piv_token *pk, enum piv_slotid slotid,
     const uint8_t *data, size_t datalen, uint flags)
 {
 	errf_t *err;
-	struct tlv_state *tlv;
+	struct tlv_state wtlv, *tlv;
 	uint tag;
+	uint8_t *cmd;
+	size_t bodylen, cmdlen;
 
 	VERIFY(pk->pt_intxn == B_TRUE);
 
@@ -2854,18 +3982,32 @@ piv_write_cert(struct piv_token *pk, enum piv_slotid slotid,
 		    "%02x", slotid));
 	}
 
-	tlv = tlv_init_write();
-	tlv_pushl(tlv, 0x70, datalen + 3);
+	/*
+	 * Build the whole PUT DATA command (file tag, then the cert and
+	 * certinfo tags inside 0x53) in one buffer of exactly the right size.
+	 */
+	bodylen = tlv_hdr_len(0x70, datalen) + datalen +
+	    tlv_hdr_len(0x71, 1) + 1;
+	cmdlen = piv_put_data_len(tag, bodylen);
+	cmd = malloc(cmdlen);
+	if (cmd == NULL)
+		return (ERRF_NOMEM);
+
+	tlv = tlv_init_write_local(&wtlv, cmd, cmdlen);
+	piv_put_data_begin(tlv, tag, bodylen);
+	tlv_pushl(tlv, 0x70, datalen);
 	tlv_write(tlv, data, datalen);
 	tlv_pop(tlv);
-	tlv_push(tlv, 0x71);
+	tlv_pushl(tlv, 0x71, 1);
 	tlv_write_byte(tlv, (uint8_t)flags);
 	tlv_pop(tlv);
-
-	err = piv_write_file(pk, tag, tlv_buf(tlv), tlv_len(tlv));
-
+	tlv_pop(tlv);
+	VERIFY3U(tlv_len(tlv), ==, cmdlen);
 	tlv_free(tlv);
 
+	err = piv_put_data(pk, tag, cmd, cmdlen);
+
+	free(cmd);
 	return (err);
 }
 
@@ -2883,10 +4025,11 @@ ykpiv_attest(struct piv_token *pt, struct piv_slot *slot, uint8_t **data,
 	struct apdu *apdu;
 
 	VERIFY(pt->pt_intxn == B_TRUE);
-	if (!pt->pt_ykpiv)
+	if (!piv_token_is_ykpiv(pt))
 		return (argerrf("tk", "a YubicoPIV-compatible token", "not"));
 
-	apdu = piv_apdu_make(CLA_ISO, INS_ATTEST, (uint8_t)slot->ps_slot, 0x00);
+	apdu = piv_apdu_borrow(pt, CLA_ISO, INS_ATTEST, (uint8_t)slot->ps_slot,
+	    0x00);
 
 	err = piv_apdu_transceive_chain(pt, apdu);
 	if (err) {
@@ -2945,6 +4088,7 @@ piv_read_file(struct piv_token *pt, uint tag, uint8_t **data, size_t *len)
 	errf_t *err;
 	struct apdu *apdu;
 	struct tlv_state *tlv;
+	struct tlv_state rtlv;
 	uint rtag;
 
 	VERIFY(pt->pt_intxn);
@@ -2954,7 +4098,7 @@ piv_read_file(struct piv_token *pt, uint tag, uint8_t **data, size_t *len)
 	tlv_write_u8to32(tlv, tag);
 	tlv_pop(tlv);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
+	apdu = piv_apdu_borrow(pt, CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -2980,8 +4124,8 @@ piv_read_file(struct piv_token *pt, uint tag, uint8_t **data, size_t *len)
 			    "INS_GET_DATA(%x)", tag), pt->pt_rdrname);
 			goto out;
 		}
-		tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
-		    apdu->a_reply.b_len);
+		tlv = tlv_init_local(&rtlv, apdu->a_reply.b_data,
+		    apdu->a_reply.b_offset, apdu->a_reply.b_len);
 		if ((err = tlv_read_tag(tlv, &rtag)))
 			goto invdata;
 		if (rtag != 0x53) {
@@ -3034,21 +4178,33 @@ piv_file_data_free(uint8_t *data, size_t len)
  *
  * Towards the end of Appendix A (after table 39 or so) there is some
  * additional text explaining how CertInfo works and compression.
+ *
+ * If "cheap" is set, the outcomes we expect all the time when sweeping a
+ * whole card (empty slot, no permission, slot not supported) come back as
+ * errf_static() errors rather than a full cause chain describing the slot
+ * and reader.
+ *
+ * If "keep" is not set and piv_compact_slots is, we drop the X509 once we've
+ * taken what we need from it.
  */
-errf_t *
-piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
+static errf_t *
+piv_read_cert_impl(struct piv_token *pk, enum piv_slotid slotid,
+    boolean_t cheap, boolean_t keep)
 {
 	errf_t *err;
 	int rv;
 	struct apdu *apdu;
 	struct tlv_state *tlv;
+	struct tlv_state rtlv;
 	uint tag;
-	uint8_t *ptr, *buf = NULL;
+	const uint8_t *ptr = NULL;
+	uint8_t *buf = NULL;
 	size_t len = 0;
 	X509 *cert;
 	struct piv_slot *pc;
 	EVP_PKEY *pkey;
 	uint8_t certinfo = 0;
+	uint8_t hash[32];
 
 	VERIFY(pk->pt_intxn == B_TRUE);
 
@@ -3087,7 +4243,7 @@ piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 	    "cdata", BNY_BIN_HEX, tlv_buf(tlv), tlv_len(tlv),
 	    NULL);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
+	apdu = piv_apdu_borrow(pk, CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -3111,8 +4267,8 @@ piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 			    "for slot %02x", slotid), pk->pt_rdrname);
 			goto out;
 		}
-		tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
-		    apdu->a_reply.b_len);
+		tlv = tlv_init_local(&rtlv, apdu->a_reply.b_data,
+		    apdu->a_reply.b_offset, apdu->a_reply.b_len);
 		if ((err = tlv_read_tag(tlv, &tag)))
 			goto invdata;
 		if (tag != 0x53) {
@@ -3130,8 +4286,11 @@ piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 				continue;
 			}
 			if (tag == 0x70) {
-				ptr = tlv_ptr(tlv);
-				len = tlv_rem(tlv);
+				if ((err = tlv_read_ref(tlv, &ptr, &len)) ||
+				    (err = tlv_end(tlv))) {
+					goto invdata;
+				}
+				continue;
 			}
 			tlv_skip(tlv);
 		}
@@ -3155,7 +4314,7 @@ piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 			VERIFY0(inflateInit2(&strm, 31));
 
 			strm.avail_in = len;
-			strm.next_in = ptr;
+			strm.next_in = (uint8_t *)ptr;
 			strm.avail_out = PIV_MAX_CERT_LEN;
 			strm.next_out = buf;
 
@@ -3192,7 +4351,9 @@ piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 			goto invdata;
 		}
 
-		cert = d2i_X509(NULL, (const uint8_t **)&ptr, len);
+		VERIFY0(ssh_digest_memory(SSH_DIGEST_SHA256, ptr, len, hash,
+		    sizeof (hash)));
+		cert = d2i_X509(NULL, &ptr, len);
 		if (cert == NULL) {
 			make_sslerrf(err, "d2i_X509", "parsing cert %02x",
 			    (uint)slotid);
@@ -3232,6 +4393,8 @@ piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 		pc->ps_x509 = cert;
 		pc->ps_subj = X509_NAME_oneline(
 		    X509_get_subject_name(cert), NULL, 0);
+		pc->ps_have_cert_hash = B_TRUE;
+		bcopy(hash, pc->ps_cert_hash, sizeof (hash));
 		pkey = X509_get_pubkey(cert);
 		VERIFY(pkey != NULL);
 		rv = sshkey_from_evp_pkey(pkey, KEY_UNSPEC,
@@ -3241,6 +4404,10 @@ piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 			err = ssherrf("sshkey_from_evp_pkey", rv);
 			goto invdata;
 		}
+		if (piv_compact_slots && !keep) {
+			X509_free(pc->ps_x509);
+			pc->ps_x509 = NULL;
+		}
 
 		err = NULL;
 
@@ -3283,7 +4450,7 @@ piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 			    "%s", sshkey_type(pc->ps_pubkey)), pk->pt_rdrname);
 		}
 
-		if (err == NULL && pk->pt_ykpiv &&
+		if (err == NULL && piv_token_is_ykpiv(pk) &&
 		    ykpiv_version_compare(pk, 5, 3, 0) >= 0) {
 			err = ykpiv_get_metadata(pk, pc);
 			if (err == ERRF_OK) {
@@ -3295,15 +4462,27 @@ piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
 			}
 		}
 
+	} else if (apdu->a_sw == SW_FILE_NOT_FOUND && cheap) {
+		err = errf_static("NotFoundError", "No certificate found");
+
 	} else if (apdu->a_sw == SW_FILE_NOT_FOUND) {
 		err = errf("NotFoundError", swerrf("INS_GET_DATA", apdu->a_sw),
 		    "No certificate found for slot %02x in device '%s'",
 		    slotid, pk->pt_rdrname);
 
+	} else if (apdu->a_sw == SW_SECURITY_STATUS_NOT_SATISFIED && cheap) {
+		err = errf_static("PermissionError",
+		    "Permission denied reading certificate");
+
 	} else if (apdu->a_sw == SW_SECURITY_STATUS_NOT_SATISFIED) {
 		err = permerrf(swerrf("INS_GET_DATA", apdu->a_sw), pk->pt_rdrname,
 		    "reading certificate for slot %02x", (uint)slotid);
 
+	} else if ((apdu->a_sw == SW_FUNC_NOT_SUPPORTED ||
+	    apdu->a_sw == SW_WRONG_DATA) && cheap) {
+		err = errf_static("NotSupportedError",
+		    "Certificate slot not supported by PIV device");
+
 	} else if (apdu->a_sw == SW_FUNC_NOT_SUPPORTED ||
 	    apdu->a_sw == SW_WRONG_DATA) {
 		err = notsuperrf(swerrf("INS_GET_DATA", apdu->a_sw),
@@ -3329,6 +4508,32 @@ invdata:
 	goto out;
 }
 
+errf_t *
+piv_read_cert(struct piv_token *pk, enum piv_slotid slotid)
+{
+	return (piv_read_cert_impl(pk, slotid, B_FALSE, B_FALSE));
+}
+
+errf_t *
+piv_slot_load_cert(struct piv_token *pk, struct piv_slot *slot)
+{
+	errf_t *err;
+	uint8_t hash[32];
+	boolean_t had_hash;
+
+	if (slot->ps_x509 != NULL)
+		return (ERRF_OK);
+	had_hash = slot->ps_have_cert_hash;
+	bcopy(slot->ps_cert_hash, hash, sizeof (hash));
+	if ((err = piv_read_cert_impl(pk, slot->ps_slot, B_FALSE, B_TRUE)))
+		return (err);
+	if (had_hash && bcmp(hash, slot->ps_cert_hash, sizeof (hash)) != 0) {
+		bunyan_log(BNY_WARN, "slot cert changed since it was last read",
+		    "slot", BNY_UINT, (uint)slot->ps_slot, NULL);
+	}
+	return (ERRF_OK);
+}
+
 enum piv_slot_auth
 piv_slot_get_auth(struct piv_token *pt, struct piv_slot *slot)
 {
@@ -3337,7 +4542,7 @@ piv_slot_get_auth(struct piv_token *pt, struct piv_slot *slot)
 	if (slot->ps_got_metadata)
 		return (slot->ps_auth);
 
-	if (pt->pt_ykpiv && ykpiv_version_compare(pt, 5, 3, 0) >= 0) {
+	if (piv_token_is_ykpiv(pt) && ykpiv_version_compare(pt, 5, 3, 0) >= 0) {
 		err = ykpiv_get_metadata(pt, slot);
 		if (err == ERRF_OK) {
 			slot->ps_got_metadata = B_TRUE;
@@ -3350,7 +4555,7 @@ piv_slot_get_auth(struct piv_token *pt, struct piv_slot *slot)
 		}
 	}
 
-	if (pt->pt_ykpiv && ykpiv_version_compare(pt, 4, 0, 0) >= 0) {
+	if (piv_token_is_ykpiv(pt) && ykpiv_version_compare(pt, 4, 0, 0) >= 0) {
 		err = ykpiv_attest_metadata(pt, slot);
 		if (err == ERRF_OK) {
 			slot->ps_got_metadata = B_TRUE;
@@ -3370,13 +4575,486 @@ piv_slot_get_auth(struct piv_token *pt, struct piv_slot *slot)
 	return (slot->ps_auth);
 }
 
-static inline int
-read_all_aborts_on(errf_t *err)
-{
-	return (err &&
-	    !errf_caused_by(err, "NotFoundError") &&
-	    !errf_caused_by(err, "PermissionError") &&
-	    !errf_caused_by(err, "NotSupportedError"));
+/*
+ * The cert cache is a directory holding one file per token GUID, each
+ * containing the parsed public key, algorithm, certificate subject and
+ * certificate hash of every slot piv_read_all_certs() found. An entry is
+ * only used if the CHUID and Key History objects we just read from the card
+ * hash to the same values as when it was written, so e.g. re-initing a card
+ * invalidates it. Anything in this library that changes a slot's contents
+ * (generate, import, writing a cert, factory reset) also removes the token's
+ * entry.
+ *
+ * The cache never holds the X509 certs themselves: piv_slot_cert() returns
+ * NULL for slots loaded from it until piv_read_cert() is used on them.
+ */
+#define	CERT_CACHE_MAGIC	"piv-cert-cache"
+#define	CERT_CACHE_VERSION	2
+#define	CERT_CACHE_MAX_SIZE	(64 * 1024)
+
+static char *
+piv_cert_cache_path(const struct piv_token *tk, const char *suffix)
+{
+	const char *guidhex;
+	char *path = NULL;
+
+	if (piv_cert_cache_dir == NULL)
+		return (NULL);
+	/* Entries are checked against the key history too. */
+	piv_token_lazy_load(tk, PIV_READ_CHUID | PIV_READ_KEYHIST);
+	if ((guidhex = piv_token_guid_hex(tk)) == NULL)
+		return (NULL);
+	if (asprintf(&path, "%s/%s%s", piv_cert_cache_dir, guidhex,
+	    suffix) < 0) {
+		return (NULL);
+	}
+	return (path);
+}
+
+static void
+piv_cert_cache_forget(struct piv_token *tk)
+{
+	char *path;
+
+	if ((path = piv_cert_cache_path(tk, "")) == NULL)
+		return;
+	if (unlink(path) != 0 && errno != ENOENT) {
+		bunyan_log(BNY_WARN, "failed to remove cert cache entry",
+		    "path", BNY_STRING, path,
+		    "errno", BNY_INT, errno, NULL);
+	}
+	free(path);
+}
+
+static errf_t *
+piv_cert_cache_load(struct piv_token *tk)
+{
+	errf_t *err = ERRF_OK;
+	struct sshbuf *buf = NULL;
+	struct piv_slot *pc, *slots = NULL, *last = NULL;
+	char *path = NULL, *magic = NULL, *subj = NULL;
+	const uint8_t *guid, *chuid_dg, *keyhist_dg, *certhash;
+	size_t guidlen, chuid_dglen, keyhist_dglen, certhashlen;
+	struct stat st;
+	uint8_t ver, nslots, slotid, alg, auth, gotmeta, i;
+	struct sshkey *pubkey = NULL;
+	ssize_t n;
+	int fd = -1, rv;
+
+	if ((path = piv_cert_cache_path(tk, "")) == NULL)
+		return (errf("NotFoundError", NULL, "No cert cache available"));
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		err = errf("NotFoundError", errfno("open", errno, "%s", path),
+		    "No cert cache entry for token");
+		goto out;
+	}
+	if (fstat(fd, &st) != 0) {
+		err = errfno("fstat", errno, "%s", path);
+		goto out;
+	}
+	if (st.st_size <= 0 || st.st_size > CERT_CACHE_MAX_SIZE) {
+		err = errf("InvalidDataError", NULL, "Cert cache entry '%s' "
+		    "has invalid size %lld", path, (long long)st.st_size);
+		goto out;
+	}
+	buf = sshbuf_new();
+	VERIFY(buf != NULL);
+	while ((size_t)st.st_size > sshbuf_len(buf)) {
+		uint8_t *p;
+		size_t want = st.st_size - sshbuf_len(buf);
+		if ((rv = sshbuf_reserve(buf, want, &p))) {
+			err = ssherrf("sshbuf_reserve", rv);
+			goto out;
+		}
+		n = read(fd, p, want);
+		if (n <= 0) {
+			err = errfno("read", n < 0 ? errno : EIO, "%s", path);
+			goto out;
+		}
+		VERIFY0(sshbuf_consume_end(buf, want - n));
+	}
+
+	if ((rv = sshbuf_get_cstring(buf, &magic, NULL)) ||
+	    (rv = sshbuf_get_u8(buf, &ver)) ||
+	    (rv = sshbuf_get_string_direct(buf, &guid, &guidlen)) ||
+	    (rv = sshbuf_get_string_direct(buf, &chuid_dg, &chuid_dglen)) ||
+	    (rv = sshbuf_get_string_direct(buf, &keyhist_dg,
+	    &keyhist_dglen)) ||
+	    (rv = sshbuf_get_u8(buf, &nslots))) {
+		err = ssherrf("sshbuf_get", rv);
+		goto bad;
+	}
+	if (strcmp(magic, CERT_CACHE_MAGIC) != 0 || ver != CERT_CACHE_VERSION) {
+		err = errf("NotSupportedError", NULL, "Cert cache entry '%s' "
+		    "is of unknown format or version", path);
+		goto out;
+	}
+	if (guidlen != sizeof (tk->pt_guid) ||
+	    bcmp(guid, tk->pt_guid, guidlen) != 0 ||
+	    chuid_dglen != sizeof (tk->pt_chuid_dg) ||
+	    bcmp(chuid_dg, tk->pt_chuid_dg, chuid_dglen) != 0 ||
+	    keyhist_dglen != sizeof (tk->pt_keyhist_dg) ||
+	    bcmp(keyhist_dg, tk->pt_keyhist_dg, keyhist_dglen) != 0) {
+		err = errf("StaleCacheError", NULL, "Cert cache entry '%s' "
+		    "does not match token CHUID/Key History", path);
+		goto out;
+	}
+
+	for (i = 0; i < nslots; ++i) {
+		if ((rv = sshbuf_get_u8(buf, &slotid)) ||
+		    (rv = sshbuf_get_u8(buf, &alg)) ||
+		    (rv = sshbuf_get_u8(buf, &auth)) ||
+		    (rv = sshbuf_get_u8(buf, &gotmeta)) ||
+		    (rv = sshbuf_get_cstring(buf, &subj, NULL)) ||
+		    (rv = sshbuf_get_string_direct(buf, &certhash,
+		    &certhashlen)) ||
+		    (rv = sshkey_froms(buf, &pubkey))) {
+			err = ssherrf("sshbuf_get", rv);
+			goto bad;
+		}
+		if (certhashlen != 0 &&
+		    certhashlen != sizeof (pc->ps_cert_hash)) {
+			err = errf("LengthError", NULL, "Cert hash has wrong "
+			    "length: %zu", certhashlen);
+			goto bad;
+		}
+		pc = calloc(1, sizeof (struct piv_slot));
+		VERIFY(pc != NULL);
+		pc->ps_slot = slotid;
+		pc->ps_alg = alg;
+		pc->ps_auth = auth;
+		pc->ps_got_metadata = (gotmeta != 0);
+		if (certhashlen != 0) {
+			pc->ps_have_cert_hash = B_TRUE;
+			bcopy(certhash, pc->ps_cert_hash, certhashlen);
+		}
+		if (subj[0] == '\0') {
+			/* Written by piv_read_all_pubkeys(): no cert read. */
+			free(subj);
+			subj = NULL;
+		}
+		pc->ps_subj = subj;
+		pc->ps_pubkey = pubkey;
+		subj = NULL;
+		pubkey = NULL;
+		if (last == NULL)
+			slots = pc;
+		else
+			last->ps_next = pc;
+		last = pc;
+	}
+	if (sshbuf_len(buf) != 0) {
+		err = errf("LengthError", NULL, "Trailing garbage");
+		goto bad;
+	}
+
+	/* Only now replace anything we already had for these slots. */
+	while ((pc = slots) != NULL) {
+		struct piv_slot *old;
+		slots = pc->ps_next;
+		pc->ps_next = NULL;
+		for (old = tk->pt_slots; old != NULL; old = old->ps_next) {
+			if (old->ps_slot == pc->ps_slot)
+				break;
+		}
+		if (old != NULL) {
+			OPENSSL_free((void *)old->ps_subj);
+			X509_free(old->ps_x509);
+			sshkey_free(old->ps_pubkey);
+			old->ps_x509 = NULL;
+			old->ps_alg = pc->ps_alg;
+			old->ps_auth = pc->ps_auth;
+			old->ps_got_metadata = pc->ps_got_metadata;
+			old->ps_subj = pc->ps_subj;
+			old->ps_pubkey = pc->ps_pubkey;
+			old->ps_have_cert_hash = pc->ps_have_cert_hash;
+			bcopy(pc->ps_cert_hash, old->ps_cert_hash,
+			    sizeof (old->ps_cert_hash));
+			free(pc);
+			continue;
+		}
+		if (tk->pt_last_slot == NULL)
+			tk->pt_slots = pc;
+		else
+			tk->pt_last_slot->ps_next = pc;
+		tk->pt_last_slot = pc;
+	}
+
+	bunyan_log(BNY_DEBUG, "loaded slots from cert cache",
+	    "path", BNY_STRING, path,
+	    "nslots", BNY_UINT, (uint)nslots, NULL);
+
+out:
+	while ((pc = slots) != NULL) {
+		slots = pc->ps_next;
+		free((void *)pc->ps_subj);
+		sshkey_free(pc->ps_pubkey);
+		free(pc);
+	}
+	if (fd >= 0)
+		(void) close(fd);
+	sshbuf_free(buf);
+	sshkey_free(pubkey);
+	free(subj);
+	free(magic);
+	free(path);
+	return (err);
+
+bad:
+	err = errf("InvalidDataError", err, "Cert cache entry '%s' is corrupt",
+	    path);
+	goto out;
+}
+
+static errf_t *
+piv_cert_cache_save(struct piv_token *tk)
+{
+	errf_t *err = ERRF_OK;
+	struct sshbuf *buf = NULL;
+	struct piv_slot *pc;
+	char *path = NULL, *tmppath = NULL;
+	char sfx[32];
+	uint nslots = 0;
+	const uint8_t *p;
+	size_t len;
+	ssize_t n;
+	int fd = -1, rv;
+
+	if ((path = piv_cert_cache_path(tk, "")) == NULL)
+		return (ERRF_OK);
+	(void) snprintf(sfx, sizeof (sfx), ".tmp%ld", (long)getpid());
+	if ((tmppath = piv_cert_cache_path(tk, sfx)) == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+
+	for (pc = tk->pt_slots; pc != NULL; pc = pc->ps_next) {
+		if (pc->ps_pubkey != NULL)
+			++nslots;
+	}
+	VERIFY3U(nslots, <=, UINT8_MAX);
+
+	buf = sshbuf_new();
+	VERIFY(buf != NULL);
+	if ((rv = sshbuf_put_cstring(buf, CERT_CACHE_MAGIC)) ||
+	    (rv = sshbuf_put_u8(buf, CERT_CACHE_VERSION)) ||
+	    (rv = sshbuf_put_string(buf, tk->pt_guid,
+	    sizeof (tk->pt_guid))) ||
+	    (rv = sshbuf_put_string(buf, tk->pt_chuid_dg,
+	    sizeof (tk->pt_chuid_dg))) ||
+	    (rv = sshbuf_put_string(buf, tk->pt_keyhist_dg,
+	    sizeof (tk->pt_keyhist_dg))) ||
+	    (rv = sshbuf_put_u8(buf, nslots))) {
+		err = ssherrf("sshbuf_put", rv);
+		goto out;
+	}
+	for (pc = tk->pt_slots; pc != NULL; pc = pc->ps_next) {
+		if (pc->ps_pubkey == NULL)
+			continue;
+		if ((rv = sshbuf_put_u8(buf, pc->ps_slot)) ||
+		    (rv = sshbuf_put_u8(buf, pc->ps_alg)) ||
+		    (rv = sshbuf_put_u8(buf, pc->ps_auth)) ||
+		    (rv = sshbuf_put_u8(buf, pc->ps_got_metadata ? 1 : 0)) ||
+		    (rv = sshbuf_put_cstring(buf,
+		    pc->ps_subj == NULL ? "" : pc->ps_subj)) ||
+		    (rv = sshbuf_put_string(buf, pc->ps_cert_hash,
+		    pc->ps_have_cert_hash ? sizeof (pc->ps_cert_hash) : 0)) ||
+		    (rv = sshkey_puts(pc->ps_pubkey, buf))) {
+			err = ssherrf("sshbuf_put", rv);
+			goto out;
+		}
+	}
+
+	if (mkdir(piv_cert_cache_dir, 0700) != 0 && errno != EEXIST) {
+		err = errfno("mkdir", errno, "%s", piv_cert_cache_dir);
+		goto out;
+	}
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		err = errfno("open", errno, "%s", tmppath);
+		goto out;
+	}
+	p = sshbuf_ptr(buf);
+	len = sshbuf_len(buf);
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			err = errfno("write", errno, "%s", tmppath);
+			goto out;
+		}
+		p += n;
+		len -= n;
+	}
+	if (close(fd) != 0) {
+		fd = -1;
+		err = errfno("close", errno, "%s", tmppath);
+		goto out;
+	}
+	fd = -1;
+	if (rename(tmppath, path) != 0) {
+		err = errfno("rename", errno, "%s", path);
+		goto out;
+	}
+
+out:
+	if (fd >= 0)
+		(void) close(fd);
+	if (err != ERRF_OK && tmppath != NULL)
+		(void) unlink(tmppath);
+	sshbuf_free(buf);
+	free(tmppath);
+	free(path);
+	return (err);
+}
+
+static inline int
+read_all_aborts_on(errf_t *err)
+{
+	return (err &&
+	    !errf_caused_by(err, "NotFoundError") &&
+	    !errf_caused_by(err, "PermissionError") &&
+	    !errf_caused_by(err, "NotSupportedError"));
+}
+
+/*
+ * A cache entry written by piv_read_all_pubkeys() has no subjects in it, so
+ * after loading one, piv_read_all_certs() has to go and read the certs for
+ * those slots (and then updates the entry so next time we don't have to).
+ */
+static errf_t *
+piv_read_missing_certs(struct piv_token *tk)
+{
+	errf_t *err;
+	struct piv_slot *pc;
+	uint nread = 0;
+
+	for (pc = tk->pt_slots; pc != NULL; pc = pc->ps_next) {
+		if (pc->ps_subj != NULL)
+			continue;
+		err = piv_read_cert_impl(tk, pc->ps_slot, B_TRUE, B_FALSE);
+		if (read_all_aborts_on(err) && !errf_caused_by(err, "APDUError"))
+			return (err);
+		else if (err)
+			errf_free(err);
+		else
+			++nread;
+	}
+
+	if (nread > 0) {
+		err = piv_cert_cache_save(tk);
+		if (err) {
+			bunyan_log(BNY_WARN, "failed to write cert cache",
+			    "error", BNY_ERF, err, NULL);
+			errf_free(err);
+		}
+	}
+
+	return (ERRF_OK);
+}
+
+/*
+ * Fills in the public key, algorithm and PIN/touch policy of a slot from
+ * YubicoPIV GET METADATA, without reading its cert. The slot is left with
+ * ps_x509 and ps_subj NULL.
+ */
+static errf_t *
+piv_read_pubkey_impl(struct piv_token *tk, enum piv_slotid slotid)
+{
+	errf_t *err;
+	struct piv_slot *pc;
+
+	if (piv_get_slot(tk, slotid) != NULL)
+		return (ERRF_OK);
+
+	pc = calloc(1, sizeof (struct piv_slot));
+	VERIFY(pc != NULL);
+	pc->ps_slot = slotid;
+	switch (slotid) {
+	case PIV_SLOT_CARD_AUTH:
+	case PIV_SLOT_YK_ATTESTATION:
+		break;
+	default:
+		pc->ps_auth |= PIV_SLOT_AUTH_PIN;
+		break;
+	}
+
+	err = ykpiv_get_metadata(tk, pc);
+	if (err == ERRF_OK && pc->ps_pubkey == NULL) {
+		err = errf("NotFoundError", NULL, "GET METADATA for slot %02x "
+		    "in device '%s' returned no public key", (uint)slotid,
+		    tk->pt_rdrname);
+	}
+	if (err != ERRF_OK) {
+		sshkey_free(pc->ps_pubkey);
+		free(pc);
+		return (err);
+	}
+	pc->ps_got_metadata = B_TRUE;
+
+	if (tk->pt_last_slot == NULL)
+		tk->pt_slots = pc;
+	else
+		tk->pt_last_slot->ps_next = pc;
+	tk->pt_last_slot = pc;
+
+	return (ERRF_OK);
+}
+
+errf_t *
+piv_read_all_pubkeys(struct piv_token *tk)
+{
+	errf_t *err;
+	uint i;
+	const enum piv_slotid slots[] = {
+		PIV_SLOT_9E, PIV_SLOT_9A, PIV_SLOT_9C, PIV_SLOT_9D
+	};
+
+	VERIFY(tk->pt_intxn == B_TRUE);
+
+	if (!piv_token_is_ykpiv(tk) || ykpiv_version_compare(tk, 5, 3, 0) < 0)
+		return (piv_read_all_certs(tk));
+
+	if (piv_cert_cache_dir != NULL) {
+		err = piv_cert_cache_load(tk);
+		if (err == ERRF_OK) {
+			tk->pt_did_read_all = B_TRUE;
+			return (ERRF_OK);
+		}
+		bunyan_log(BNY_DEBUG, "not using cert cache",
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+	}
+
+	for (i = 0; i < sizeof (slots) / sizeof (slots[0]); ++i) {
+		err = piv_read_pubkey_impl(tk, slots[i]);
+		if (read_all_aborts_on(err))
+			return (err);
+		else if (err)
+			errf_free(err);
+	}
+	for (i = 0; i < piv_token_keyhistory_oncard(tk); ++i) {
+		err = piv_read_pubkey_impl(tk, PIV_SLOT_RETIRED_1 + i);
+		if (read_all_aborts_on(err) && !errf_caused_by(err, "APDUError"))
+			return (err);
+		else if (err)
+			errf_free(err);
+	}
+
+	tk->pt_did_read_all = B_TRUE;
+
+	if (piv_cert_cache_dir != NULL) {
+		err = piv_cert_cache_save(tk);
+		if (err) {
+			bunyan_log(BNY_WARN, "failed to write cert cache",
+			    "error", BNY_ERF, err, NULL);
+			errf_free(err);
+		}
+	}
+
+	return (ERRF_OK);
 }
 
 errf_t *
@@ -3387,29 +5065,41 @@ piv_read_all_certs(struct piv_token *tk)
 
 	VERIFY(tk->pt_intxn == B_TRUE);
 
-	err = piv_read_cert(tk, PIV_SLOT_9E);
+	if (piv_cert_cache_dir != NULL) {
+		err = piv_cert_cache_load(tk);
+		if (err == ERRF_OK) {
+			tk->pt_did_read_all = B_TRUE;
+			return (piv_read_missing_certs(tk));
+		}
+		bunyan_log(BNY_DEBUG, "not using cert cache",
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+	}
+
+	err = piv_read_cert_impl(tk, PIV_SLOT_9E, B_TRUE, B_FALSE);
 	if (read_all_aborts_on(err))
 		return (err);
 	else if (err)
 		errf_free(err);
-	err = piv_read_cert(tk, PIV_SLOT_9A);
+	err = piv_read_cert_impl(tk, PIV_SLOT_9A, B_TRUE, B_FALSE);
 	if (read_all_aborts_on(err))
 		return (err);
 	else if (err)
 		errf_free(err);
-	err = piv_read_cert(tk, PIV_SLOT_9C);
+	err = piv_read_cert_impl(tk, PIV_SLOT_9C, B_TRUE, B_FALSE);
 	if (read_all_aborts_on(err))
 		return (err);
 	else if (err)
 		errf_free(err);
-	err = piv_read_cert(tk, PIV_SLOT_9D);
+	err = piv_read_cert_impl(tk, PIV_SLOT_9D, B_TRUE, B_FALSE);
 	if (read_all_aborts_on(err))
 		return (err);
 	else if (err)
 		errf_free(err);
 
-	for (i = 0; i < tk->pt_hist_oncard; ++i) {
-		err = piv_read_cert(tk, PIV_SLOT_RETIRED_1 + i);
+	for (i = 0; i < piv_token_keyhistory_oncard(tk); ++i) {
+		err = piv_read_cert_impl(tk, PIV_SLOT_RETIRED_1 + i,
+		    B_TRUE, B_FALSE);
 		if (read_all_aborts_on(err) && !errf_caused_by(err, "APDUError"))
 			return (err);
 		else if (err)
@@ -3418,6 +5108,15 @@ piv_read_all_certs(struct piv_token *tk)
 
 	tk->pt_did_read_all = B_TRUE;
 
+	if (piv_cert_cache_dir != NULL) {
+		err = piv_cert_cache_save(tk);
+		if (err) {
+			bunyan_log(BNY_WARN, "failed to write cert cache",
+			    "error", BNY_ERF, err, NULL);
+			errf_free(err);
+		}
+	}
+
 	return (ERRF_OK);
 }
 
@@ -3453,7 +5152,7 @@ piv_change_pin(struct piv_token *pk, enum piv_pin type, const char *pin,
 		pinbuf[i] = newpin[i - 8];
 	VERIFY(newpin[i - 8] == 0);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_CHANGE_PIN, 0x00, type);
+	apdu = piv_apdu_borrow(pk, CLA_ISO, INS_CHANGE_PIN, 0x00, type);
 	apdu->a_cmd.b_data = pinbuf;
 	apdu->a_cmd.b_len = 16;
 
@@ -3521,7 +5220,7 @@ piv_reset_pin(struct piv_token *pk, enum piv_pin type, const char *puk,
 		pinbuf[i] = newpin[i - 8];
 	VERIFY(newpin[i - 8] == 0);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_RESET_PIN, 0x00, type);
+	apdu = piv_apdu_borrow(pk, CLA_ISO, INS_RESET_PIN, 0x00, type);
 	apdu->a_cmd.b_data = pinbuf;
 	apdu->a_cmd.b_len = 16;
 
@@ -3568,10 +5267,12 @@ ykpiv_reset(struct piv_token *pt)
 	struct apdu *apdu;
 
 	VERIFY(pt->pt_intxn);
-	if (!pt->pt_ykpiv)
+	if (!piv_token_is_ykpiv(pt))
 		return (argerrf("tk", "a YubicoPIV-compatible token", "not"));
 
-	apdu = piv_apdu_make(CLA_ISO, INS_RESET, 0, 0);
+	piv_cert_cache_forget(pt);
+
+	apdu = piv_apdu_borrow(pt, CLA_ISO, INS_RESET, 0, 0);
 
 	err = piv_apdu_transceive(pt, apdu);
 	if (err) {
@@ -3613,10 +5314,11 @@ ykpiv_set_pin_retries(struct piv_token *pk, uint pintries, uint puktries)
 	struct apdu *apdu;
 
 	VERIFY(pk->pt_intxn);
-	if (!pk->pt_ykpiv)
+	if (!piv_token_is_ykpiv(pk))
 		return (argerrf("tk", "a YubicoPIV-compatible token", "not"));
 
-	apdu = piv_apdu_make(CLA_ISO, INS_SET_PIN_RETRIES, pintries, puktries);
+	apdu = piv_apdu_borrow(pk, CLA_ISO, INS_SET_PIN_RETRIES, pintries,
+	    puktries);
 
 	err = piv_apdu_transceive_chain(pk, apdu);
 	if (err) {
@@ -3662,7 +5364,7 @@ ykpiv_set_admin(struct piv_token *pk, const uint8_t *key, size_t keylen,
 	uint p2;
 
 	VERIFY(pk->pt_intxn);
-	if (!pk->pt_ykpiv) {
+	if (!piv_token_is_ykpiv(pk)) {
 		return (argerrf("tk", "a YubicoPIV-compatible PIV token",
 		    "not"));
 	}
@@ -3684,7 +5386,7 @@ ykpiv_set_admin(struct piv_token *pk, const uint8_t *key, size_t keylen,
 	databuf[2] = keylen;
 	bcopy(key, &databuf[3], keylen);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_SET_MGMT, 0xFF, p2);
+	apdu = piv_apdu_borrow(pk, CLA_ISO, INS_SET_MGMT, 0xFF, p2);
 	apdu->a_cmd.b_data = databuf;
 	apdu->a_cmd.b_len = 3 + keylen;
 
@@ -3762,7 +5464,7 @@ piv_verify_pin(struct piv_token *pk, enum piv_pin type, const char *pin,
 	 * 3 and 4 we want to do it only if canskip is set.
 	 */
 	if (pin == NULL || canskip || (retries != NULL && *retries > 0)) {
-		apdu = piv_apdu_make(CLA_ISO, INS_VERIFY, 0x00, type);
+		apdu = piv_apdu_borrow(pk, CLA_ISO, INS_VERIFY, 0x00, type);
 
 		err = piv_apdu_transceive_chain(pk, apdu);
 		if (err) {
@@ -3868,7 +5570,7 @@ piv_verify_pin(struct piv_token *pk, enum piv_pin type, const char *pin,
 		pinbuf[i] = pin[i];
 	VERIFY(pin[i] == 0);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_VERIFY, 0x00, type);
+	apdu = piv_apdu_borrow(pk, CLA_ISO, INS_VERIFY, 0x00, type);
 	apdu->a_cmd.b_data = pinbuf;
 	apdu->a_cmd.b_len = 8;
 
@@ -3920,8 +5622,8 @@ piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
 	int i;
 	errf_t *err;
 	struct ssh_digest_ctx *hctx;
-	uint8_t *buf;
-	size_t nread, dglen, inplen;
+	uint8_t dg[SSH_DIGEST_MAX_LENGTH];
+	size_t dglen;
 	boolean_t cardhash = B_FALSE, ch_sha256 = B_FALSE, ch_sha384 = B_FALSE;
 	enum piv_alg oldalg;
 
@@ -3929,7 +5631,6 @@ piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
 
 	switch (slot->ps_alg) {
 	case PIV_ALG_RSA1024:
-		inplen = 128;
 		if (*hashalgo == SSH_DIGEST_SHA1) {
 			dglen = 20;
 		} else {
@@ -3938,7 +5639,6 @@ piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
 		}
 		break;
 	case PIV_ALG_RSA2048:
-		inplen = 256;
 		if (*hashalgo == SSH_DIGEST_SHA1) {
 			dglen = 20;
 		} else if (*hashalgo == SSH_DIGEST_SHA512) {
@@ -3949,7 +5649,6 @@ piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
 		}
 		break;
 	case PIV_ALG_ECCP256:
-		inplen = 32;
 		/*
 		 * JC22x cards running PivApplet have proprietary algorithm IDs
 		 * for hash-on-card ECDSA since they can't sign a precomputed
@@ -3993,7 +5692,6 @@ piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
 		}
 		break;
 	case PIV_ALG_ECCP384:
-		inplen = 48;
 		/*
 		 * JC22x cards running PivApplet have proprietary algorithm IDs
 		 * for hash-on-card ECDSA since they can't sign a precomputed
@@ -4056,20 +5754,117 @@ piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
 		    slot->ps_slot, slot->ps_alg, tk->pt_rdrname));
 	}
 
-	if (!cardhash) {
-		buf = calloc(1, inplen);
-		VERIFY(buf != NULL);
+	PIVY_PROBE2(sign__start, slot->ps_slot, datalen);
 
+	if (!cardhash) {
 		hctx = ssh_digest_start(*hashalgo);
 		VERIFY(hctx != NULL);
 		VERIFY0(ssh_digest_update(hctx, data, datalen));
-		VERIFY0(ssh_digest_final(hctx, buf, dglen));
+		VERIFY0(ssh_digest_final(hctx, dg, dglen));
 		ssh_digest_free(hctx);
+
+		err = piv_sign_digest(tk, slot, dg, dglen, *hashalgo,
+		    signature, siglen);
+		explicit_bzero(dg, sizeof (dg));
 	} else {
 		bunyan_log(BNY_TRACE, "doing hash on card", NULL);
-		buf = (uint8_t *)data;
-		inplen = datalen;
+		err = piv_sign_prehash(tk, slot, data, datalen, signature,
+		    siglen);
+		slot->ps_alg = oldalg;
+	}
+
+	PIVY_PROBE2(sign__done, slot->ps_slot, err == ERRF_OK);
+	return (err);
+}
+
+errf_t *
+piv_sign_hashalg(struct piv_token *tk, struct piv_slot *slot,
+    enum sshdigest_types *hashalgo)
+{
+	int i;
+
+	switch (slot->ps_alg) {
+	case PIV_ALG_RSA1024:
+		if (*hashalgo != SSH_DIGEST_SHA1)
+			*hashalgo = SSH_DIGEST_SHA256;
+		return (ERRF_OK);
+	case PIV_ALG_RSA2048:
+		if (*hashalgo != SSH_DIGEST_SHA1 &&
+		    *hashalgo != SSH_DIGEST_SHA512)
+			*hashalgo = SSH_DIGEST_SHA256;
+		return (ERRF_OK);
+	case PIV_ALG_ECCP256:
+	case PIV_ALG_ECCP384:
+		/* See piv_sign(): these cards can't sign a host-side hash. */
+		for (i = 0; i < tk->pt_alg_count; ++i) {
+			switch (tk->pt_algs[i]) {
+			case PIV_ALG_ECCP256_SHA1:
+			case PIV_ALG_ECCP256_SHA256:
+			case PIV_ALG_ECCP384_SHA1:
+			case PIV_ALG_ECCP384_SHA256:
+			case PIV_ALG_ECCP384_SHA384:
+				return (errf("NotSupportedError", NULL,
+				    "PIV device '%s' can only sign with EC "
+				    "keys by hashing the data on the card",
+				    tk->pt_rdrname));
+			default:
+				break;
+			}
+		}
+		if (slot->ps_alg == PIV_ALG_ECCP256) {
+			if (*hashalgo != SSH_DIGEST_SHA1)
+				*hashalgo = SSH_DIGEST_SHA256;
+		} else {
+			if (*hashalgo != SSH_DIGEST_SHA1 &&
+			    *hashalgo != SSH_DIGEST_SHA256)
+				*hashalgo = SSH_DIGEST_SHA384;
+		}
+		return (ERRF_OK);
+	default:
+		return (errf("NotSupportedError", NULL, "Unsupported key "
+		    "algorithm used in slot %x (%d) of PIV device '%s'",
+		    slot->ps_slot, slot->ps_alg, tk->pt_rdrname));
+	}
+}
+
+errf_t *
+piv_sign_digest(struct piv_token *tk, struct piv_slot *slot,
+    const uint8_t *dg, size_t dglen, enum sshdigest_types hashalgo,
+    uint8_t **signature, size_t *siglen)
+{
+	errf_t *err;
+	uint8_t *buf;
+	size_t nread, inplen;
+
+	VERIFY(tk->pt_intxn);
+
+	switch (slot->ps_alg) {
+	case PIV_ALG_RSA1024:
+		inplen = 128;
+		break;
+	case PIV_ALG_RSA2048:
+		inplen = 256;
+		break;
+	case PIV_ALG_ECCP256:
+		inplen = 32;
+		break;
+	case PIV_ALG_ECCP384:
+		inplen = 48;
+		break;
+	default:
+		return (errf("NotSupportedError", NULL, "Unsupported key "
+		    "algorithm used in slot %x (%d) of PIV device '%s'",
+		    slot->ps_slot, slot->ps_alg, tk->pt_rdrname));
 	}
+	if (dglen != ssh_digest_bytes(hashalgo) || dglen > inplen) {
+		return (argerrf("dglen", "the length of the digest",
+		    "%zu bytes for %s", dglen,
+		    ssh_digest_alg_name(hashalgo)));
+	}
+
+	buf = calloc(1, inplen);
+	VERIFY(buf != NULL);
+	bcopy(dg, buf, dglen);
 
 	/*
 	 * If it's an RSA signature, we have to generate the PKCS#1 style
@@ -4099,7 +5894,7 @@ piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
 		 * XXX: I thought this should be sha256WithRSAEncryption (etc)
 		 *      rather than just NID_sha256 but that doesn't work
 		 */
-		switch (*hashalgo) {
+		switch (hashalgo) {
 		case SSH_DIGEST_SHA1:
 			nid = NID_sha1;
 			break;
@@ -4110,8 +5905,11 @@ piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
 			nid = NID_sha512;
 			break;
 		default:
-			VERIFY(0);
-			nid = -1;
+			free(tmp);
+			free(buf);
+			return (errf("NotSupportedError", NULL, "Hash "
+			    "algorithm %s can't be used with RSA keys",
+			    ssh_digest_alg_name(hashalgo)));
 		}
 		bcopy(buf, tmp, dglen);
 		digestInfo.algor = &algor;
@@ -4140,12 +5938,7 @@ piv_sign(struct piv_token *tk, struct piv_slot *slot, const uint8_t *data,
 	}
 
 	err = piv_sign_prehash(tk, slot, buf, inplen, signature, siglen);
-
-	if (!cardhash)
-		free(buf);
-
-	if (cardhash)
-		slot->ps_alg = oldalg;
+	freezero(buf, inplen);
 
 	return (err);
 }
@@ -4157,13 +5950,18 @@ piv_sign_prehash(struct piv_token *pk, struct piv_slot *pc,
 	errf_t *err;
 	struct apdu *apdu;
 	struct tlv_state *tlv;
+	struct tlv_state rtlv, wtlv;
 	uint tag;
 	uint8_t *buf = NULL;
+	uint8_t cmd[PIV_GA_CMD_MAX];
+	size_t galen;
 
 	VERIFY(pk->pt_intxn == B_TRUE);
 
-	tlv = tlv_init_write();
-	tlv_pushl(tlv, 0x7C, hashlen + 16);
+	galen = tlv_hdr_len(GA_TAG_RESPONSE, 0) +
+	    tlv_hdr_len(GA_TAG_CHALLENGE, hashlen) + hashlen;
+	tlv = tlv_init_write_local(&wtlv, cmd, sizeof (cmd));
+	tlv_pushl(tlv, 0x7C, galen);
 	/* Push an empty RESPONSE tag to say that's what we're asking for. */
 	tlv_push(tlv, GA_TAG_RESPONSE);
 	tlv_pop(tlv);
@@ -4173,7 +5971,8 @@ piv_sign_prehash(struct piv_token *pk, struct piv_slot *pc,
 	tlv_pop(tlv);
 	tlv_pop(tlv);
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GEN_AUTH, pc->ps_alg, pc->ps_slot);
+	apdu = piv_apdu_borrow(pk, CLA_ISO, INS_GEN_AUTH, pc->ps_alg,
+	    pc->ps_slot);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
 
@@ -4191,8 +5990,8 @@ piv_sign_prehash(struct piv_token *pk, struct piv_slot *pc,
 	if (apdu->a_sw == SW_NO_ERROR ||
 	    (apdu->a_sw & 0xFF00) == SW_WARNING_NO_CHANGE_00 ||
 	    (apdu->a_sw & 0xFF00) == SW_WARNING_00) {
-		tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
-		    apdu->a_reply.b_len);
+		tlv = tlv_init_local(&rtlv, apdu->a_reply.b_data,
+		    apdu->a_reply.b_offset, apdu->a_reply.b_len);
 		if ((err = tlv_read_tag(tlv, &tag)))
 			goto invdata;
 		if (tag != 0x7C) {
@@ -4258,12 +6057,15 @@ piv_ecdh(struct piv_token *pk, struct piv_slot *slot, struct sshkey *pubkey,
 	errf_t *err;
 	struct apdu *apdu;
 	struct tlv_state *tlv;
+	struct tlv_state rtlv, wtlv;
 	uint tag;
 	uint8_t *buf = NULL;
 	struct sshbuf *sbuf;
-	size_t len;
+	size_t len, galen;
+	uint8_t cmd[PIV_GA_CMD_MAX];
 
 	VERIFY(pk->pt_intxn);
+	PIVY_PROBE1(ecdh__start, slot->ps_slot);
 
 	sbuf = sshbuf_new();
 	VERIFY(sbuf != NULL);
@@ -4274,8 +6076,10 @@ piv_ecdh(struct piv_token *pk, struct piv_slot *slot, struct sshkey *pubkey,
 	buf = (uint8_t *)sshbuf_ptr(sbuf) + 4;
 	VERIFY3U(*buf, ==, 0x04);
 
-	tlv = tlv_init_write();
-	tlv_pushl(tlv, 0x7C, len + 16);
+	galen = tlv_hdr_len(GA_TAG_RESPONSE, 0) +
+	    tlv_hdr_len(GA_TAG_EXP, len) + len;
+	tlv = tlv_init_write_local(&wtlv, cmd, sizeof (cmd));
+	tlv_pushl(tlv, 0x7C, galen);
 	tlv_push(tlv, GA_TAG_RESPONSE);
 	tlv_pop(tlv);
 	tlv_pushl(tlv, GA_TAG_EXP, len);
@@ -4286,7 +6090,7 @@ piv_ecdh(struct piv_token *pk, struct piv_slot *slot, struct sshkey *pubkey,
 
 	buf = NULL;
 
-	apdu = piv_apdu_make(CLA_ISO, INS_GEN_AUTH, slot->ps_alg,
+	apdu = piv_apdu_borrow(pk, CLA_ISO, INS_GEN_AUTH, slot->ps_alg,
 	    slot->ps_slot);
 	apdu->a_cmd.b_data = tlv_buf(tlv);
 	apdu->a_cmd.b_len = tlv_len(tlv);
@@ -4305,8 +6109,8 @@ piv_ecdh(struct piv_token *pk, struct piv_slot *slot, struct sshkey *pubkey,
 	if (apdu->a_sw == SW_NO_ERROR ||
 	    (apdu->a_sw & 0xFF00) == SW_WARNING_NO_CHANGE_00 ||
 	    (apdu->a_sw & 0xFF00) == SW_WARNING_00) {
-		tlv = tlv_init(apdu->a_reply.b_data, apdu->a_reply.b_offset,
-		    apdu->a_reply.b_len);
+		tlv = tlv_init_local(&rtlv, apdu->a_reply.b_data,
+		    apdu->a_reply.b_offset, apdu->a_reply.b_len);
 		if ((err = tlv_read_tag(tlv, &tag)))
 			goto invdata;
 		if (tag != 0x7C) {
@@ -4345,6 +6149,7 @@ piv_ecdh(struct piv_token *pk, struct piv_slot *slot, struct sshkey *pubkey,
 	}
 
 out:
+	PIVY_PROBE2(ecdh__done, slot->ps_slot, err == ERRF_OK);
 	free(buf);
 	tlv_free(tlv);
 	piv_apdu_free(apdu);
@@ -4387,7 +6192,7 @@ piv_box_clone(const struct piv_ecdh_box *box)
 		goto err;
 	if (sshkey_demote(box->pdb_pub, &nbox->pdb_pub))
 		goto err;
-	if (box->pdb_free_str) {
+	if (box->pdb_free_str || box->pdb_in_arena) {
 		nbox->pdb_free_str = B_TRUE;
 		nbox->pdb_cipher = strdup(box->pdb_cipher);
 		nbox->pdb_kdf = strdup(box->pdb_kdf);
@@ -4444,6 +6249,12 @@ piv_box_free(struct piv_ecdh_box *box)
 		return;
 	sshkey_free(box->pdb_ephem_pub);
 	sshkey_free(box->pdb_pub);
+	free(box->pdb_guidhex);
+	if (box->pdb_plain.b_data != NULL) {
+		freezero(box->pdb_plain.b_data, box->pdb_plain.b_size);
+	}
+	if (box->pdb_in_arena)
+		return;
 	if (box->pdb_free_str) {
 		free((void *)box->pdb_cipher);
 		free((void *)box->pdb_kdf);
@@ -4451,10 +6262,6 @@ piv_box_free(struct piv_ecdh_box *box)
 	free(box->pdb_iv.b_data);
 	free(box->pdb_enc.b_data);
 	free(box->pdb_nonce.b_data);
-	free(box->pdb_guidhex);
-	if (box->pdb_plain.b_data != NULL) {
-		freezero(box->pdb_plain.b_data, box->pdb_plain.b_size);
-	}
 	free(box);
 }
 
@@ -4590,13 +6397,13 @@ piv_box_open_offline(struct sshkey *privkey, struct piv_ecdh_box *box)
 
 	fieldsz = EC_GROUP_get_degree(EC_KEY_get0_group(privkey->ecdsa));
 	seclen = (fieldsz + 7) / 8;
-	sec = calloc_conceal(1, seclen);
+	sec = calloc_locked(1, seclen);
 	VERIFY(sec != NULL);
 	rv = ECDH_compute_key(sec, seclen,
 	    EC_KEY_get0_public_key(box->pdb_ephem_pub->ecdsa), privkey->ecdsa,
 	    NULL);
 	if (rv <= 0) {
-		free(sec);
+		freezero_locked(sec, seclen);
 		make_sslerrf(err, "ECDH_compute_key", "performing ECDH");
 		err = boxderrf(err);
 		return (err);
@@ -4621,18 +6428,19 @@ piv_box_open_offline(struct sshkey *privkey, struct piv_ecdh_box *box)
 		VERIFY0(ssh_digest_update(dgctx, box->pdb_nonce.b_data +
 		    box->pdb_nonce.b_offset, box->pdb_nonce.b_len));
 	}
-	key = calloc_conceal(1, dglen);
+	key = calloc_locked(1, dglen);
 	VERIFY3P(key, !=, NULL);
 	VERIFY0(ssh_digest_final(dgctx, key, dglen));
 	ssh_digest_free(dgctx);
 
-	freezero(sec, seclen);
+	freezero_locked(sec, seclen);
 
 	VERIFYB(box->pdb_iv);
 	iv = box->pdb_iv.b_data + box->pdb_iv.b_offset;
 	if (box->pdb_iv.b_len != ivlen) {
 		err = boxderrf(errf("LengthError", NULL, "IV length (%d) is not "
 		    "appropriate for cipher '%s'", ivlen, box->pdb_cipher));
+		freezero_locked(key, dglen);
 		return (err);
 	}
 
@@ -4643,6 +6451,7 @@ piv_box_open_offline(struct sshkey *privkey, struct piv_ecdh_box *box)
 		err = boxderrf(errf("LengthError", NULL, "Ciphertext length (%d) "
 		    "is smaller than minimum length (auth tag + 1 block = %d)",
 		    enclen, authlen + blocksz));
+		freezero_locked(key, dglen);
 		return (err);
 	}
 
@@ -4655,7 +6464,7 @@ piv_box_open_offline(struct sshkey *privkey, struct piv_ecdh_box *box)
 	    authlen);
 	cipher_free(cctx);
 
-	freezero(key, dglen);
+	freezero_locked(key, dglen);
 
 	if (rv != 0) {
 		err = boxderrf(ssherrf("cipher_crypt", rv));
@@ -4689,8 +6498,8 @@ paderr:
 	return (err);
 }
 
-errf_t *
-piv_box_open(struct piv_token *tk, struct piv_slot *slot,
+static errf_t *
+piv_box_open_impl(struct piv_token *tk, struct piv_slot *slot,
     struct piv_ecdh_box *box)
 {
 	const struct sshcipher *cipher;
@@ -4742,83 +6551,516 @@ piv_box_open(struct piv_token *tk, struct piv_slot *slot,
 		    "operation needed to decrypt PIVBox");
 		return (err);
 	}
-	VERIFY3P(sec, !=, NULL);
-	VERIFY3U(seclen, >=, 0);
+	VERIFY3P(sec, !=, NULL);
+	VERIFY3U(seclen, >=, 0);
+
+	dgctx = ssh_digest_start(dgalg);
+	VERIFY3P(dgctx, !=, NULL);
+	VERIFY0(ssh_digest_update(dgctx, sec, seclen));
+	if (box->pdb_nonce.b_len > 0) {
+		/* See comment in piv_box_open_offline */
+		VERIFY0(ssh_digest_update(dgctx, box->pdb_nonce.b_data +
+		    box->pdb_nonce.b_offset, box->pdb_nonce.b_len));
+	}
+	key = calloc_locked(1, dglen);
+	VERIFY3P(key, !=, NULL);
+	VERIFY0(ssh_digest_final(dgctx, key, dglen));
+	ssh_digest_free(dgctx);
+
+	freezero(sec, seclen);
+
+	VERIFYB(box->pdb_iv);
+	iv = box->pdb_iv.b_data + box->pdb_iv.b_offset;
+	if (box->pdb_iv.b_len != ivlen) {
+		err = boxderrf(errf("LengthError", NULL, "IV length (%d) is not "
+		    "appropriate for cipher '%s'", ivlen, box->pdb_cipher));
+		freezero_locked(key, dglen);
+		return (err);
+	}
+
+	VERIFYB(box->pdb_enc);
+	enc = box->pdb_enc.b_data + box->pdb_enc.b_offset;
+	enclen = box->pdb_enc.b_len;
+	if (enclen < authlen + blocksz) {
+		err = boxderrf(errf("LengthError", NULL, "Ciphertext length (%d) "
+		    "is smaller than minimum length (auth tag + 1 block = %d)",
+		    enclen, authlen + blocksz));
+		freezero_locked(key, dglen);
+		return (err);
+	}
+
+	plainlen = enclen - authlen;
+	plain = calloc_conceal(1, plainlen);
+	VERIFY3P(plain, !=, NULL);
+
+	VERIFY0(cipher_init(&cctx, cipher, key, keylen, iv, ivlen, 0));
+	rv = cipher_crypt(cctx, 0, plain, enc, enclen - authlen, 0,
+	    authlen);
+	cipher_free(cctx);
+
+	freezero_locked(key, dglen);
+
+	if (rv != 0) {
+		err = boxderrf(ssherrf("cipher_crypt", rv));
+		return (err);
+	}
+
+	/* Strip off the pkcs#7 padding and verify it. */
+	padding = plain[plainlen - 1];
+	if (padding < 1 || padding > blocksz)
+		goto paderr;
+	reallen = plainlen - padding;
+	for (i = reallen; i < plainlen; ++i) {
+		if (plain[i] != padding) {
+			goto paderr;
+		}
+	}
+
+	if (box->pdb_plain.b_data != NULL) {
+		freezero(box->pdb_plain.b_data, box->pdb_plain.b_size);
+	}
+	box->pdb_plain.b_data = plain;
+	box->pdb_plain.b_offset = 0;
+	box->pdb_plain.b_size = plainlen;
+	box->pdb_plain.b_len = reallen;
+
+	return (ERRF_OK);
+
+paderr:
+	err = boxderrf(errf("PaddingError", NULL, "Padding failed validation"));
+	freezero(plain, plainlen);
+	return (err);
+}
+
+errf_t *
+piv_box_open(struct piv_token *tk, struct piv_slot *slot,
+    struct piv_ecdh_box *box)
+{
+	errf_t *err;
+
+	PIVY_PROBE1(box__open__start, slot->ps_slot);
+	err = piv_box_open_impl(tk, slot, box);
+	PIVY_PROBE2(box__open__done, slot->ps_slot, err == ERRF_OK);
+	return (err);
+}
+
+/*
+ * Cache of recipient public keys for piv_box_seal_offline().
+ *
+ * Bulk ebox creation seals to the same few template part keys over and over.
+ * Each entry keeps its own copy of the curve group and the decoded recipient
+ * point, keyed on the point's uncompressed encoding, so that we don't have to
+ * set either up again (or go through ECDH_compute_key(), which allocates a
+ * fresh BN_CTX every call). Each thread keeps one BN_CTX for its scalar mults.
+ *
+ * We don't precompute multiples of the recipient point: the secret scalar is
+ * the ephemeral key, and libcrypto only uses its constant-time ladder for
+ * that, which ignores precomputed tables.
+ */
+#define	PIV_BOX_RKEY_CACHE_SIZE		64
+
+struct piv_box_rkey {
+	int		 pbr_nid;
+	uint8_t		*pbr_pt;
+	size_t		 pbr_ptlen;
+	EC_GROUP	*pbr_group;
+	EC_POINT	*pbr_point;
+	/* Holders, counting the cache itself while we're in pbr_cache */
+	uint		 pbr_refcnt;
+	uint64_t	 pbr_lastuse;
+};
+
+static pthread_mutex_t piv_box_rkey_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct piv_box_rkey *piv_box_rkey_cache[PIV_BOX_RKEY_CACHE_SIZE];
+static uint64_t piv_box_rkey_clock = 0;
+
+static pthread_once_t piv_box_bnctx_once = PTHREAD_ONCE_INIT;
+static pthread_key_t piv_box_bnctx_key;
+
+static void
+piv_box_bnctx_free(void *arg)
+{
+	BN_CTX_free(arg);
+}
+
+static void
+piv_box_bnctx_init(void)
+{
+	VERIFY0(pthread_key_create(&piv_box_bnctx_key, piv_box_bnctx_free));
+}
+
+static BN_CTX *
+piv_box_bnctx(void)
+{
+	BN_CTX *ctx;
+
+	VERIFY0(pthread_once(&piv_box_bnctx_once, piv_box_bnctx_init));
+	ctx = pthread_getspecific(piv_box_bnctx_key);
+	if (ctx == NULL) {
+		ctx = BN_CTX_new();
+		VERIFY(ctx != NULL);
+		VERIFY0(pthread_setspecific(piv_box_bnctx_key, ctx));
+	}
+	return (ctx);
+}
+
+static void
+piv_box_rkey_free(struct piv_box_rkey *rk)
+{
+	if (rk == NULL)
+		return;
+	EC_POINT_free(rk->pbr_point);
+	EC_GROUP_free(rk->pbr_group);
+	free(rk->pbr_pt);
+	free(rk);
+}
+
+static void
+piv_box_rkey_rele(struct piv_box_rkey *rk)
+{
+	uint refcnt;
+
+	VERIFY0(pthread_mutex_lock(&piv_box_rkey_mtx));
+	VERIFY3U(rk->pbr_refcnt, >, 0);
+	refcnt = --rk->pbr_refcnt;
+	VERIFY0(pthread_mutex_unlock(&piv_box_rkey_mtx));
+	if (refcnt == 0)
+		piv_box_rkey_free(rk);
+}
+
+static errf_t *
+piv_box_rkey_hold(const struct sshkey *pubk, struct piv_box_rkey **outp)
+{
+	const EC_GROUP *g;
+	const EC_POINT *pt;
+	struct piv_box_rkey *rk = NULL, *nrk;
+	uint8_t *ptbuf = NULL;
+	size_t ptlen, i, victim;
+	BN_CTX *bnctx;
+	errf_t *err;
+
+	g = EC_KEY_get0_group(pubk->ecdsa);
+	pt = EC_KEY_get0_public_key(pubk->ecdsa);
+	if (g == NULL || pt == NULL) {
+		return (argerrf("pubkey", "an EC public key with a point",
+		    "no point"));
+	}
+	bnctx = piv_box_bnctx();
+
+	ptlen = EC_POINT_point2oct(g, pt, POINT_CONVERSION_UNCOMPRESSED,
+	    NULL, 0, bnctx);
+	if (ptlen == 0) {
+		make_sslerrf(err, "EC_POINT_point2oct", "encoding pubkey");
+		return (err);
+	}
+	ptbuf = malloc(ptlen);
+	VERIFY(ptbuf != NULL);
+	VERIFY3U(EC_POINT_point2oct(g, pt, POINT_CONVERSION_UNCOMPRESSED,
+	    ptbuf, ptlen, bnctx), ==, ptlen);
+
+	VERIFY0(pthread_mutex_lock(&piv_box_rkey_mtx));
+	for (i = 0; i < PIV_BOX_RKEY_CACHE_SIZE; ++i) {
+		rk = piv_box_rkey_cache[i];
+		if (rk != NULL && rk->pbr_nid == pubk->ecdsa_nid &&
+		    rk->pbr_ptlen == ptlen &&
+		    bcmp(rk->pbr_pt, ptbuf, ptlen) == 0) {
+			++rk->pbr_refcnt;
+			rk->pbr_lastuse = ++piv_box_rkey_clock;
+			VERIFY0(pthread_mutex_unlock(&piv_box_rkey_mtx));
+			free(ptbuf);
+			*outp = rk;
+			return (ERRF_OK);
+		}
+	}
+	VERIFY0(pthread_mutex_unlock(&piv_box_rkey_mtx));
+
+	nrk = calloc(1, sizeof (*nrk));
+	VERIFY(nrk != NULL);
+	nrk->pbr_nid = pubk->ecdsa_nid;
+	nrk->pbr_pt = ptbuf;
+	nrk->pbr_ptlen = ptlen;
+	nrk->pbr_group = EC_GROUP_dup(g);
+	nrk->pbr_point = EC_POINT_dup(pt, g);
+	if (nrk->pbr_group == NULL || nrk->pbr_point == NULL) {
+		piv_box_rkey_free(nrk);
+		make_sslerrf(err, "EC_GROUP_dup", "copying pubkey");
+		return (err);
+	}
+	/* One ref for our caller, one for the cache. */
+	nrk->pbr_refcnt = 2;
+
+	/*
+	 * Another thread may have added the same key while we were unlocked;
+	 * if so, use theirs. Otherwise take an empty slot, or evict the least
+	 * recently used entry. Anyone still holding it keeps it alive.
+	 */
+	VERIFY0(pthread_mutex_lock(&piv_box_rkey_mtx));
+	victim = 0;
+	for (i = 0; i < PIV_BOX_RKEY_CACHE_SIZE; ++i) {
+		rk = piv_box_rkey_cache[i];
+		if (rk == NULL) {
+			victim = i;
+			continue;
+		}
+		if (rk->pbr_nid == nrk->pbr_nid && rk->pbr_ptlen == ptlen &&
+		    bcmp(rk->pbr_pt, ptbuf, ptlen) == 0) {
+			++rk->pbr_refcnt;
+			rk->pbr_lastuse = ++piv_box_rkey_clock;
+			VERIFY0(pthread_mutex_unlock(&piv_box_rkey_mtx));
+			piv_box_rkey_free(nrk);
+			*outp = rk;
+			return (ERRF_OK);
+		}
+		if (piv_box_rkey_cache[victim] != NULL &&
+		    rk->pbr_lastuse < piv_box_rkey_cache[victim]->pbr_lastuse)
+			victim = i;
+	}
+	rk = piv_box_rkey_cache[victim];
+	piv_box_rkey_cache[victim] = nrk;
+	nrk->pbr_lastuse = ++piv_box_rkey_clock;
+	if (rk != NULL && --rk->pbr_refcnt > 0)
+		rk = NULL;
+	VERIFY0(pthread_mutex_unlock(&piv_box_rkey_mtx));
+	piv_box_rkey_free(rk);
+
+	*outp = nrk;
+	return (ERRF_OK);
+}
+
+void
+piv_box_seal_cache_flush(void)
+{
+	struct piv_box_rkey *rk;
+	size_t i;
+
+	for (i = 0; i < PIV_BOX_RKEY_CACHE_SIZE; ++i) {
+		VERIFY0(pthread_mutex_lock(&piv_box_rkey_mtx));
+		rk = piv_box_rkey_cache[i];
+		piv_box_rkey_cache[i] = NULL;
+		if (rk != NULL && --rk->pbr_refcnt > 0)
+			rk = NULL;
+		VERIFY0(pthread_mutex_unlock(&piv_box_rkey_mtx));
+		piv_box_rkey_free(rk);
+	}
+}
+
+/*
+ * ECDH between the ephemeral private key "pkey" and the cached recipient key
+ * "rk". Produces the same output as ECDH_compute_key() with no KDF: the
+ * shared point's x co-ordinate, left-padded to the field size.
+ */
+static errf_t *
+piv_box_rkey_ecdh(struct piv_box_rkey *rk, const struct sshkey *pkey,
+    uint8_t *sec, size_t seclen)
+{
+	const BIGNUM *priv;
+	EC_POINT *shared = NULL;
+	BIGNUM *x = NULL;
+	BN_CTX *bnctx;
+	size_t xlen;
+	errf_t *err;
+
+	if (pkey->ecdsa_nid != rk->pbr_nid) {
+		return (argerrf("ephemeral key", "on the same curve as the "
+		    "recipient", "on curve %d", pkey->ecdsa_nid));
+	}
+	priv = EC_KEY_get0_private_key(pkey->ecdsa);
+	VERIFY(priv != NULL);
+	bnctx = piv_box_bnctx();
 
-	dgctx = ssh_digest_start(dgalg);
-	VERIFY3P(dgctx, !=, NULL);
-	VERIFY0(ssh_digest_update(dgctx, sec, seclen));
-	if (box->pdb_nonce.b_len > 0) {
-		/* See comment in piv_box_open_offline */
-		VERIFY0(ssh_digest_update(dgctx, box->pdb_nonce.b_data +
-		    box->pdb_nonce.b_offset, box->pdb_nonce.b_len));
+	shared = EC_POINT_new(rk->pbr_group);
+	x = BN_new();
+	VERIFY(shared != NULL && x != NULL);
+
+	if (EC_POINT_mul(rk->pbr_group, shared, NULL, rk->pbr_point, priv,
+	    bnctx) != 1) {
+		make_sslerrf(err, "EC_POINT_mul", "performing ECDH");
+		goto out;
 	}
-	key = calloc_conceal(1, dglen);
-	VERIFY3P(key, !=, NULL);
-	VERIFY0(ssh_digest_final(dgctx, key, dglen));
-	ssh_digest_free(dgctx);
+	if (EC_POINT_get_affine_coordinates_GFp(rk->pbr_group, shared, x,
+	    NULL, bnctx) != 1) {
+		make_sslerrf(err, "EC_POINT_get_affine_coordinates_GFp",
+		    "performing ECDH");
+		goto out;
+	}
+	xlen = BN_num_bytes(x);
+	VERIFY3U(xlen, <=, seclen);
+	bzero(sec, seclen - xlen);
+	VERIFY3U(BN_bn2bin(x, sec + (seclen - xlen)), ==, xlen);
+	err = ERRF_OK;
 
-	freezero(sec, seclen);
+out:
+	BN_clear_free(x);
+	EC_POINT_clear_free(shared);
+	return (err);
+}
 
-	VERIFYB(box->pdb_iv);
-	iv = box->pdb_iv.b_data + box->pdb_iv.b_offset;
-	if (box->pdb_iv.b_len != ivlen) {
-		err = boxderrf(errf("LengthError", NULL, "IV length (%d) is not "
-		    "appropriate for cipher '%s'", ivlen, box->pdb_cipher));
-		return (err);
+/*
+ * Pool of pre-generated ephemeral EC keys, so that sealing a box (and making
+ * ebox challenges) doesn't have to wait for a key generation. There's one per
+ * curve, each holding up to piv_ephem_pool_size keys; a curve's pool only
+ * starts being filled once someone has asked it for a key (except P-256,
+ * which nearly everything uses). Keys are handed out once and the pool
+ * forgets them, so it's up to the taker to sshkey_free() them.
+ *
+ * Nothing fills the pools by itself: that's piv_ephem_pool_refill(), which
+ * the agent calls when it's idle, or the thread started by
+ * piv_ephem_pool_start().
+ */
+struct piv_ephem_pool {
+	uint		 pep_bits;
+	boolean_t	 pep_active;
+	uint		 pep_count;
+	uint		 pep_pending;
+	struct sshkey	**pep_keys;
+};
+
+static pthread_mutex_t piv_ephem_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t piv_ephem_cv = PTHREAD_COND_INITIALIZER;
+static uint piv_ephem_pool_size = 0;
+static uint64_t piv_ephem_hits = 0;
+static uint64_t piv_ephem_misses = 0;
+static struct piv_ephem_pool piv_ephem_pools[] = {
+	{ 256, B_TRUE },
+	{ 384 },
+	{ 521 }
+};
+#define	PIV_EPHEM_NPOOLS	\
+	(sizeof (piv_ephem_pools) / sizeof (piv_ephem_pools[0]))
+
+void
+piv_ephem_pool_init(uint size)
+{
+	struct piv_ephem_pool *pep;
+	uint i;
+
+	VERIFY0(pthread_mutex_lock(&piv_ephem_mtx));
+	VERIFY3U(piv_ephem_pool_size, ==, 0);
+	piv_ephem_pool_size = size;
+	for (i = 0; i < PIV_EPHEM_NPOOLS; ++i) {
+		pep = &piv_ephem_pools[i];
+		pep->pep_keys = calloc(size, sizeof (struct sshkey *));
+		VERIFY(pep->pep_keys != NULL);
 	}
+	VERIFY0(pthread_cond_broadcast(&piv_ephem_cv));
+	VERIFY0(pthread_mutex_unlock(&piv_ephem_mtx));
+}
 
-	VERIFYB(box->pdb_enc);
-	enc = box->pdb_enc.b_data + box->pdb_enc.b_offset;
-	enclen = box->pdb_enc.b_len;
-	if (enclen < authlen + blocksz) {
-		err = boxderrf(errf("LengthError", NULL, "Ciphertext length (%d) "
-		    "is smaller than minimum length (auth tag + 1 block = %d)",
-		    enclen, authlen + blocksz));
-		return (err);
+int
+piv_ephem_take(uint bits, struct sshkey **keyp)
+{
+	struct piv_ephem_pool *pep = NULL;
+	uint i;
+
+	VERIFY0(pthread_mutex_lock(&piv_ephem_mtx));
+	for (i = 0; i < PIV_EPHEM_NPOOLS && piv_ephem_pool_size > 0; ++i) {
+		if (piv_ephem_pools[i].pep_bits == bits) {
+			pep = &piv_ephem_pools[i];
+			break;
+		}
+	}
+	if (pep != NULL && pep->pep_count > 0) {
+		*keyp = pep->pep_keys[--pep->pep_count];
+		pep->pep_keys[pep->pep_count] = NULL;
+		++piv_ephem_hits;
+		VERIFY0(pthread_cond_broadcast(&piv_ephem_cv));
+		VERIFY0(pthread_mutex_unlock(&piv_ephem_mtx));
+		return (0);
+	}
+	if (pep != NULL) {
+		++piv_ephem_misses;
+		if (!pep->pep_active) {
+			pep->pep_active = B_TRUE;
+			VERIFY0(pthread_cond_broadcast(&piv_ephem_cv));
+		}
 	}
+	VERIFY0(pthread_mutex_unlock(&piv_ephem_mtx));
 
-	plainlen = enclen - authlen;
-	plain = calloc_conceal(1, plainlen);
-	VERIFY3P(plain, !=, NULL);
+	return (sshkey_generate(KEY_ECDSA, bits, keyp));
+}
 
-	VERIFY0(cipher_init(&cctx, cipher, key, keylen, iv, ivlen, 0));
-	rv = cipher_crypt(cctx, 0, plain, enc, enclen - authlen, 0,
-	    authlen);
-	cipher_free(cctx);
+/* Called with piv_ephem_mtx held. */
+static struct piv_ephem_pool *
+piv_ephem_pool_wanting(void)
+{
+	struct piv_ephem_pool *pep;
+	uint i;
+
+	for (i = 0; i < PIV_EPHEM_NPOOLS; ++i) {
+		pep = &piv_ephem_pools[i];
+		if (pep->pep_active && pep->pep_count + pep->pep_pending <
+		    piv_ephem_pool_size)
+			return (pep);
+	}
+	return (NULL);
+}
 
-	freezero(key, dglen);
+boolean_t
+piv_ephem_pool_refill(void)
+{
+	struct piv_ephem_pool *pep;
+	struct sshkey *key = NULL;
+	boolean_t more;
+	int rv;
 
-	if (rv != 0) {
-		err = boxderrf(ssherrf("cipher_crypt", rv));
-		return (err);
+	VERIFY0(pthread_mutex_lock(&piv_ephem_mtx));
+	if ((pep = piv_ephem_pool_wanting()) == NULL) {
+		VERIFY0(pthread_mutex_unlock(&piv_ephem_mtx));
+		return (B_FALSE);
 	}
+	++pep->pep_pending;
+	VERIFY0(pthread_mutex_unlock(&piv_ephem_mtx));
 
-	/* Strip off the pkcs#7 padding and verify it. */
-	padding = plain[plainlen - 1];
-	if (padding < 1 || padding > blocksz)
-		goto paderr;
-	reallen = plainlen - padding;
-	for (i = reallen; i < plainlen; ++i) {
-		if (plain[i] != padding) {
-			goto paderr;
+	rv = sshkey_generate(KEY_ECDSA, pep->pep_bits, &key);
+
+	VERIFY0(pthread_mutex_lock(&piv_ephem_mtx));
+	--pep->pep_pending;
+	if (rv == 0)
+		pep->pep_keys[pep->pep_count++] = key;
+	more = (rv == 0 && piv_ephem_pool_wanting() != NULL);
+	VERIFY0(pthread_mutex_unlock(&piv_ephem_mtx));
+
+	return (more);
+}
+
+static void *
+piv_ephem_pool_thread(void *arg)
+{
+	while (1) {
+		VERIFY0(pthread_mutex_lock(&piv_ephem_mtx));
+		while (piv_ephem_pool_wanting() == NULL) {
+			VERIFY0(pthread_cond_wait(&piv_ephem_cv,
+			    &piv_ephem_mtx));
 		}
+		VERIFY0(pthread_mutex_unlock(&piv_ephem_mtx));
+		(void) piv_ephem_pool_refill();
 	}
+	return (NULL);
+}
 
-	if (box->pdb_plain.b_data != NULL) {
-		freezero(box->pdb_plain.b_data, box->pdb_plain.b_size);
-	}
-	box->pdb_plain.b_data = plain;
-	box->pdb_plain.b_offset = 0;
-	box->pdb_plain.b_size = plainlen;
-	box->pdb_plain.b_len = reallen;
+errf_t *
+piv_ephem_pool_start(void)
+{
+	pthread_t thr;
+	pthread_attr_t attr;
+	int rc;
 
+	VERIFY0(pthread_attr_init(&attr));
+	VERIFY0(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED));
+	rc = pthread_create(&thr, &attr, piv_ephem_pool_thread, NULL);
+	VERIFY0(pthread_attr_destroy(&attr));
+	if (rc != 0)
+		return (errfno("pthread_create", rc, "ephemeral key pool"));
 	return (ERRF_OK);
+}
 
-paderr:
-	err = boxderrf(errf("PaddingError", NULL, "Padding failed validation"));
-	freezero(plain, plainlen);
-	return (err);
+void
+piv_ephem_pool_stats(uint64_t *hits, uint64_t *misses)
+{
+	VERIFY0(pthread_mutex_lock(&piv_ephem_mtx));
+	*hits = piv_ephem_hits;
+	*misses = piv_ephem_misses;
+	VERIFY0(pthread_mutex_unlock(&piv_ephem_mtx));
 }
 
 errf_t *
@@ -4829,6 +7071,7 @@ piv_box_seal_offline(struct sshkey *pubk, struct piv_ecdh_box *box)
 	errf_t *err;
 	int dgalg;
 	struct sshkey *pkey;
+	struct piv_box_rkey *rk;
 	struct sshcipher_ctx *cctx;
 	struct ssh_digest_ctx *dgctx;
 	uint8_t *iv, *key, *sec, *enc, *plain, *nonce;
@@ -4842,9 +7085,9 @@ piv_box_seal_offline(struct sshkey *pubk, struct piv_ecdh_box *box)
 	}
 
 	if (box->pdb_ephem == NULL) {
-		rv = sshkey_generate(KEY_ECDSA, sshkey_size(pubk), &pkey);
+		rv = piv_ephem_take(sshkey_size(pubk), &pkey);
 		if (rv != 0) {
-			err = boxaerrf(ssherrf("sshkey_generate", rv));
+			err = boxaerrf(ssherrf("piv_ephem_take", rv));
 			return (err);
 		}
 	} else {
@@ -4900,20 +7143,20 @@ piv_box_seal_offline(struct sshkey *pubk, struct piv_ecdh_box *box)
 
 	fieldsz = EC_GROUP_get_degree(EC_KEY_get0_group(pkey->ecdsa));
 	seclen = (fieldsz + 7) / 8;
-	sec = calloc(1, seclen);
+	sec = calloc_locked(1, seclen);
 	VERIFY(sec != NULL);
-	rv = ECDH_compute_key(sec, seclen,
-	    EC_KEY_get0_public_key(pubk->ecdsa), pkey->ecdsa, NULL);
-	if (rv <= 0) {
-		free(sec);
-		make_sslerrf(err, "ECDH_compute_key", "performing ECDH");
-		err = boxaerrf(err);
-		return (err);
+	err = piv_box_rkey_hold(pubk, &rk);
+	if (err == ERRF_OK) {
+		err = piv_box_rkey_ecdh(rk, pkey, sec, seclen);
+		piv_box_rkey_rele(rk);
 	}
-	seclen = (size_t)rv;
-
 	if (box->pdb_ephem == NULL)
 		sshkey_free(pkey);
+	if (err != ERRF_OK) {
+		freezero_locked(sec, seclen);
+		err = boxaerrf(err);
+		return (err);
+	}
 
 	dgctx = ssh_digest_start(dgalg);
 	VERIFY3P(dgctx, !=, NULL);
@@ -4923,12 +7166,12 @@ piv_box_seal_offline(struct sshkey *pubk, struct piv_ecdh_box *box)
 		VERIFY0(ssh_digest_update(dgctx, box->pdb_nonce.b_data +
 		    box->pdb_nonce.b_offset, box->pdb_nonce.b_len));
 	}
-	key = calloc(1, dglen);
+	key = calloc_locked(1, dglen);
 	VERIFY3P(key, !=, NULL);
 	VERIFY0(ssh_digest_final(dgctx, key, dglen));
 	ssh_digest_free(dgctx);
 
-	freezero(sec, seclen);
+	freezero_locked(sec, seclen);
 
 	iv = calloc(1, ivlen);
 	VERIFY3P(iv, !=, NULL);
@@ -4973,7 +7216,7 @@ piv_box_seal_offline(struct sshkey *pubk, struct piv_ecdh_box *box)
 	cipher_free(cctx);
 
 	freezero(plain, plainlen);
-	freezero(key, dglen);
+	freezero_locked(key, dglen);
 
 	VERIFY0(sshkey_demote(pubk, &box->pdb_pub));
 
@@ -4996,6 +7239,7 @@ piv_box_seal(struct piv_token *tk, struct piv_slot *slot,
 	if (err)
 		return (err);
 
+	piv_token_lazy_load(tk, PIV_READ_CHUID);
 	box->pdb_guidslot_valid = B_TRUE;
 	bcopy(tk->pt_guid, box->pdb_guid, sizeof (tk->pt_guid));
 	box->pdb_slot = slot->ps_slot;
@@ -5003,32 +7247,37 @@ piv_box_seal(struct piv_token *tk, struct piv_slot *slot,
 	return (ERRF_OK);
 }
 
-errf_t *
-piv_box_find_token(struct piv_token *tks, struct piv_ecdh_box *box,
+/*
+ * Looks for the token with the GUID the box names and checks that the slot
+ * it names has the box's key. Sets *tk to NULL if there's no such token.
+ */
+static errf_t *
+piv_box_find_guid(struct piv_token *tks, struct piv_ecdh_box *box,
     struct piv_token **tk, struct piv_slot **slot)
 {
 	struct piv_token *pt;
 	struct piv_slot *s;
 	errf_t *err;
-	enum piv_slotid slotid;
-
-	if (!box->pdb_guidslot_valid)
-		goto allslots;
+	boolean_t txn;
 
-	/* First, try for an exact match on the GUID */
+	*tk = NULL;
 	for (pt = tks; pt != NULL; pt = pt->pt_next) {
+		piv_token_lazy_load(pt, PIV_READ_CHUID);
 		if (bcmp(pt->pt_guid, box->pdb_guid,
 		    sizeof (pt->pt_guid)) == 0) {
 			s = piv_get_slot(pt, box->pdb_slot);
 			if (s == NULL) {
-				if ((err = piv_txn_begin(pt)))
+				txn = !pt->pt_intxn;
+				if (txn && (err = piv_txn_begin(pt)))
 					return (err);
 				if ((err = piv_select(pt)) ||
 				    (err = piv_read_cert(pt, box->pdb_slot))) {
-					piv_txn_end(pt);
+					if (txn)
+						piv_txn_end(pt);
 					return (err);
 				}
-				piv_txn_end(pt);
+				if (txn)
+					piv_txn_end(pt);
 				s = piv_get_slot(pt, box->pdb_slot);
 			}
 			if (s == NULL)
@@ -5038,9 +7287,32 @@ piv_box_find_token(struct piv_token *tks, struct piv_ecdh_box *box,
 				    "PIV token on system with matching "
 				    "GUID for box has different key"));
 			}
-			goto found;
+			*tk = pt;
+			*slot = s;
+			return (ERRF_OK);
 		}
 	}
+	return (ERRF_OK);
+}
+
+errf_t *
+piv_box_find_token(struct piv_token *tks, struct piv_ecdh_box *box,
+    struct piv_token **tk, struct piv_slot **slot)
+{
+	struct piv_token *pt;
+	struct piv_slot *s;
+	errf_t *err;
+	enum piv_slotid slotid;
+	boolean_t txn;
+
+	if (!box->pdb_guidslot_valid)
+		goto allslots;
+
+	/* First, try for an exact match on the GUID */
+	if ((err = piv_box_find_guid(tks, box, tk, slot)))
+		return (err);
+	if (*tk != NULL)
+		return (ERRF_OK);
 	/*
 	 * If no GUID matches, try probing the relevant slot (or 9D) on all
 	 * the cards we can see to see if the key matches.
@@ -5051,13 +7323,21 @@ piv_box_find_token(struct piv_token *tks, struct piv_ecdh_box *box,
 	for (pt = tks; pt != NULL; pt = pt->pt_next) {
 		s = piv_get_slot(pt, slotid);
 		if (s == NULL) {
-			if (piv_txn_begin(pt))
+			txn = !pt->pt_intxn;
+			if (txn && (err = piv_txn_begin(pt))) {
+				errf_free(err);
 				continue;
-			if (piv_select(pt) || piv_read_cert(pt, slotid)) {
-				piv_txn_end(pt);
+			}
+			if ((err = piv_select(pt)) ||
+			    (err = piv_read_cert_impl(pt, slotid, B_TRUE,
+			    B_FALSE))) {
+				if (txn)
+					piv_txn_end(pt);
+				errf_free(err);
 				continue;
 			}
-			piv_txn_end(pt);
+			if (txn)
+				piv_txn_end(pt);
 			s = piv_get_slot(pt, slotid);
 		}
 		if (s == NULL)
@@ -5073,13 +7353,20 @@ allslots:
 	 */
 	for (pt = tks; pt != NULL; pt = pt->pt_next) {
 		if (!pt->pt_did_read_all) {
-			if (piv_txn_begin(pt))
+			txn = !pt->pt_intxn;
+			if (txn && (err = piv_txn_begin(pt))) {
+				errf_free(err);
 				continue;
-			if (piv_select(pt) || piv_read_all_certs(pt)) {
-				piv_txn_end(pt);
+			}
+			if ((err = piv_select(pt)) ||
+			    (err = piv_read_all_pubkeys(pt))) {
+				if (txn)
+					piv_txn_end(pt);
+				errf_free(err);
 				continue;
 			}
-			piv_txn_end(pt);
+			if (txn)
+				piv_txn_end(pt);
 		}
 
 		s = NULL;
@@ -5098,6 +7385,199 @@ found:
 	return (ERRF_OK);
 }
 
+/*
+ * The key index is an open-addressed hash table of the keys in every slot
+ * of a list of tokens, by their SHA-256 fingerprints (which are already
+ * evenly spread, so the first few bytes of one make a fine hash). We work
+ * out each slot's fingerprint once, when the index is built, so finding a
+ * key costs one hash of it and a probe or two rather than comparing it
+ * against every slot in turn.
+ */
+#define	PIV_KEY_INDEX_FPLEN	32
+
+struct piv_key_index_ent {
+	boolean_t		 pke_used;
+	uint8_t			 pke_fp[PIV_KEY_INDEX_FPLEN];
+	struct piv_token	*pke_token;
+	struct piv_slot		*pke_slot;
+};
+
+struct piv_key_index {
+	struct piv_token		*pki_tokens;
+	boolean_t			 pki_built;
+	struct piv_key_index_ent	*pki_ents;
+	size_t				 pki_size;	/* a power of 2 */
+};
+
+static errf_t *
+piv_key_fp(const struct sshkey *key, uint8_t *fp)
+{
+	uint8_t *raw = NULL;
+	size_t len;
+	int rc;
+
+	rc = sshkey_fingerprint_raw(key, SSH_DIGEST_SHA256, &raw, &len);
+	if (rc)
+		return (ssherrf("sshkey_fingerprint_raw", rc));
+	VERIFY3U(len, ==, PIV_KEY_INDEX_FPLEN);
+	bcopy(raw, fp, len);
+	free(raw);
+	return (ERRF_OK);
+}
+
+static struct piv_key_index_ent *
+piv_key_index_probe(const struct piv_key_index *idx, const uint8_t *fp)
+{
+	struct piv_key_index_ent *ent;
+	size_t i, mask = idx->pki_size - 1;
+
+	i = ((size_t)fp[0] << 24 | (size_t)fp[1] << 16 |
+	    (size_t)fp[2] << 8 | fp[3]) & mask;
+	for (;; i = (i + 1) & mask) {
+		ent = &idx->pki_ents[i];
+		if (!ent->pke_used ||
+		    bcmp(ent->pke_fp, fp, PIV_KEY_INDEX_FPLEN) == 0)
+			return (ent);
+	}
+}
+
+/*
+ * Reads the public keys from every slot on the tokens (where we haven't
+ * already), and indexes them. Tokens we can't read are left out, as in the
+ * last pass of piv_box_find_token().
+ */
+static errf_t *
+piv_key_index_build(struct piv_key_index *idx)
+{
+	struct piv_token *pt;
+	struct piv_slot *s;
+	struct piv_key_index_ent *ent;
+	uint8_t fp[PIV_KEY_INDEX_FPLEN];
+	size_t n = 0;
+	boolean_t txn;
+	errf_t *err;
+
+	for (pt = idx->pki_tokens; pt != NULL; pt = pt->pt_next) {
+		if (!pt->pt_did_read_all) {
+			txn = !pt->pt_intxn;
+			if (txn && (err = piv_txn_begin(pt))) {
+				errf_free(err);
+				continue;
+			}
+			if ((err = piv_select(pt)) ||
+			    (err = piv_read_all_pubkeys(pt))) {
+				if (txn)
+					piv_txn_end(pt);
+				errf_free(err);
+				continue;
+			}
+			if (txn)
+				piv_txn_end(pt);
+		}
+		s = NULL;
+		while ((s = piv_slot_next(pt, s)) != NULL)
+			++n;
+	}
+
+	/* Keep it at most half full. */
+	idx->pki_size = 16;
+	while (idx->pki_size < 2 * n)
+		idx->pki_size *= 2;
+	idx->pki_ents = calloc(idx->pki_size, sizeof (*idx->pki_ents));
+	if (idx->pki_ents == NULL)
+		return (ERRF_NOMEM);
+
+	for (pt = idx->pki_tokens; pt != NULL; pt = pt->pt_next) {
+		s = NULL;
+		while ((s = piv_slot_next(pt, s)) != NULL) {
+			if (s->ps_pubkey == NULL)
+				continue;
+			if ((err = piv_key_fp(s->ps_pubkey, fp)))
+				return (err);
+			/* The first slot with a given key wins. */
+			ent = piv_key_index_probe(idx, fp);
+			if (ent->pke_used)
+				continue;
+			ent->pke_used = B_TRUE;
+			bcopy(fp, ent->pke_fp, sizeof (fp));
+			ent->pke_token = pt;
+			ent->pke_slot = s;
+		}
+	}
+	idx->pki_built = B_TRUE;
+	return (ERRF_OK);
+}
+
+errf_t *
+piv_key_index_new(struct piv_token *tks, struct piv_key_index **pidx)
+{
+	struct piv_key_index *idx;
+
+	idx = calloc(1, sizeof (struct piv_key_index));
+	if (idx == NULL)
+		return (ERRF_NOMEM);
+	idx->pki_tokens = tks;
+	*pidx = idx;
+	return (ERRF_OK);
+}
+
+errf_t *
+piv_key_index_find(struct piv_key_index *idx, const struct sshkey *key,
+    struct piv_token **tk, struct piv_slot **slot)
+{
+	struct piv_key_index_ent *ent;
+	uint8_t fp[PIV_KEY_INDEX_FPLEN];
+	errf_t *err;
+
+	if (!idx->pki_built) {
+		free(idx->pki_ents);
+		idx->pki_ents = NULL;
+		if ((err = piv_key_index_build(idx)))
+			return (err);
+	}
+	if ((err = piv_key_fp(key, fp)))
+		return (err);
+	ent = piv_key_index_probe(idx, fp);
+	/* The slot could have had a new key put in it since we looked. */
+	if (!ent->pke_used || ent->pke_slot->ps_pubkey == NULL ||
+	    !sshkey_equal_public(ent->pke_slot->ps_pubkey, key)) {
+		return (errf("NotFoundError", NULL, "No PIV token found on "
+		    "system with the given key"));
+	}
+	*tk = ent->pke_token;
+	*slot = ent->pke_slot;
+	return (ERRF_OK);
+}
+
+void
+piv_key_index_free(struct piv_key_index *idx)
+{
+	if (idx == NULL)
+		return;
+	free(idx->pki_ents);
+	free(idx);
+}
+
+errf_t *
+piv_box_find_token_index(struct piv_key_index *idx, struct piv_ecdh_box *box,
+    struct piv_token **tk, struct piv_slot **slot)
+{
+	errf_t *err;
+
+	if (box->pdb_guidslot_valid) {
+		err = piv_box_find_guid(idx->pki_tokens, box, tk, slot);
+		if (err || *tk != NULL)
+			return (err);
+	}
+	err = piv_key_index_find(idx, box->pdb_pub, tk, slot);
+	if (errf_caused_by(err, "NotFoundError")) {
+		errf_free(err);
+		return (errf("NotFoundError", NULL, "No PIV token found on "
+		    "system to unlock box"));
+	}
+	return (err);
+}
+
 errf_t *
 sshbuf_put_piv_box(struct sshbuf *buf, struct piv_ecdh_box *box)
 {
@@ -236,6 +236,38 @@ struct piv_token;
 MUST_CHECK
 errf_t *piv_enumerate(SCARDCONTEXT ctx, struct piv_token **tokens);
 
+/*
+ * The objects piv_enumerate_opts() and piv_find_opts() can read from each
+ * token as they find it. SELECT is always done.
+ */
+enum piv_read_flags {
+	PIV_READ_CHUID		= (1 << 0),	/* CHUID: GUID, FASC-N etc */
+	PIV_READ_DISCOV		= (1 << 1),	/* Discovery object: PINs */
+	PIV_READ_KEYHIST	= (1 << 2),	/* Key History object */
+	PIV_READ_YKPIV		= (1 << 3),	/* YubicoPIV version, serial */
+	PIV_READ_ALL		= 0x0F
+};
+
+struct piv_enum_opts {
+	/*
+	 * PIV_READ_* flags for what to read up front. Anything left out is
+	 * read the first time one of the piv_token_*() or ykpiv_token_*()
+	 * functions (or an operation on the token) needs it, in a transaction
+	 * of its own if the token isn't already in one.
+	 */
+	uint peo_read;
+};
+
+/*
+ * Like piv_enumerate(), but only reads the objects from each token that
+ * opts->peo_read asks for (opts == NULL is the same as PIV_READ_ALL).
+ * For example, with just PIV_READ_CHUID, finding out which tokens are
+ * plugged in costs a SELECT and a CHUID read per reader.
+ */
+MUST_CHECK
+errf_t *piv_enumerate_opts(SCARDCONTEXT ctx, const struct piv_enum_opts *opts,
+    struct piv_token **tokens);
+
 /*
  * Retrieves a PIV token on the system which matches a given GUID or GUID
  * prefix. If guidlen < GUID_LEN, then guid will be interpreted as a prefix
@@ -243,7 +275,8 @@ errf_t *piv_enumerate(SCARDCONTEXT ctx, struct piv_token **tokens);
  *
  * This is faster than using piv_enumerate() and searching the list yourself
  * since it doesn't try to fully probe each token for capabilities before
- * checking the GUID.
+ * checking the GUID. It also remembers which reader each full GUID was last
+ * found in, and given a full GUID tries that reader alone first.
  *
  * Errors:
  *  - PCSCError: a PCSC call failed in a way that is not retryable
@@ -256,6 +289,28 @@ MUST_CHECK
 errf_t *piv_find(SCARDCONTEXT ctx, const uint8_t *guid, size_t guidlen,
     struct piv_token **token);
 
+/*
+ * Like piv_find(), but only reads what opts->peo_read asks for from the
+ * token once it's found (it always has to read the CHUID to match on).
+ */
+MUST_CHECK
+errf_t *piv_find_opts(SCARDCONTEXT ctx, const uint8_t *guid, size_t guidlen,
+    const struct piv_enum_opts *opts, struct piv_token **token);
+
+/*
+ * Like piv_find(), but only looks at the one reader named rdrname (e.g. as
+ * returned by piv_token_rdrname() on an earlier token). This is a single
+ * connect and CHUID read, so it's a cheap way to get a token back after a
+ * reset or a lost context, before falling back to piv_find().
+ *
+ * Errors:
+ *  - NotFoundError: the reader is gone, or has no token matching guid
+ *  - IOError, InvalidDataError, etc: reading the matched token failed
+ */
+MUST_CHECK
+errf_t *piv_find_at(SCARDCONTEXT ctx, const char *rdrname,
+    const uint8_t *guid, size_t guidlen, struct piv_token **token);
+
 /*
  * Returns the next token on a list of tokens such as that returned by
  * piv_enumerate().
@@ -268,6 +323,30 @@ struct piv_token *piv_token_next(struct piv_token *token);
  */
 void piv_release(struct piv_token *pk);
 
+/*
+ * Registers an in-process software PIV token, for testing without hardware.
+ * From then on piv_enumerate() and piv_find() will turn it up after the real
+ * readers, under the name "pivy soft token (<basename of path>)". It answers
+ * SELECT, GET DATA, VERIFY and GENERAL AUTHENTICATE, waiting latency_usec
+ * before each APDU to stand in for a real device.
+ *
+ * The private keys live unprotected in the file at path. If it doesn't
+ * exist, a new token is made there (PIN 123456, P-256 keys in 9A, 9C, 9D
+ * and 9E). Its certs are throwaway self-signed ones made at startup.
+ *
+ * A PCSC context is still needed to enumerate, but the system need not have
+ * any readers.
+ */
+MUST_CHECK
+errf_t *piv_soft_card_add(const char *path, uint latency_usec);
+
+/*
+ * Calls piv_soft_card_add() with the path in the PIVY_SOFT_TOKEN env var
+ * and latency from PIVY_SOFT_TOKEN_LATENCY (usec), if it is set.
+ */
+MUST_CHECK
+errf_t *piv_soft_card_add_env(void);
+
 /* Returns the string PCSC "reader name" for the token. */
 const char *piv_token_rdrname(const struct piv_token *token);
 
@@ -391,15 +470,29 @@ enum piv_slotid piv_slot_id(const struct piv_slot *slot);
 enum piv_alg piv_slot_alg(const struct piv_slot *slot);
 
 /*
- * Returns the certificate stored for a given slot.
+ * Returns the certificate stored for a given slot. This is NULL if the slot
+ * was loaded from piv_cert_cache_dir or found by piv_read_all_pubkeys() rather
+ * than read from the card, or if piv_compact_slots is set (in which case use
+ * piv_slot_load_cert() first).
  *
  * The memory referenced by the returned pointer should be treated as const
  * and not freed or modified (it will be freed with the piv_slot).
  */
 X509 *piv_slot_cert(const struct piv_slot *slot);
-/* Helper: retrieves the subject DN from the certificate for a slot. */
+/*
+ * Helper: retrieves the subject DN from the certificate for a slot. Like
+ * piv_slot_cert() this is NULL if the cert hasn't been read (e.g. the slot was
+ * found by piv_read_all_pubkeys()).
+ */
 const char *piv_slot_subject(const struct piv_slot *slot);
 
+/*
+ * Returns the SHA-256 hash of the DER certificate for a slot (setting *len),
+ * or NULL if we've never read one for it. Unlike piv_slot_cert(), this is kept
+ * when piv_compact_slots is set, and is saved in piv_cert_cache_dir.
+ */
+const uint8_t *piv_slot_cert_hash(const struct piv_slot *slot, size_t *len);
+
 /*
  * Returns the public key for a slot.
  *
@@ -452,6 +545,19 @@ boolean_t piv_token_in_txn(const struct piv_token *token);
 MUST_CHECK
 errf_t *piv_select(struct piv_token *tk);
 
+/*
+ * Like piv_select(), but skips the SELECT if this token selected the applet
+ * in an earlier transaction and nothing since suggests the card state could
+ * have changed: no reset (by us or anyone else), no failed APDU, and no
+ * change in the reader's event counter (card removed/inserted).
+ *
+ * PCSC can't tell us whether another process used the card without
+ * resetting it, so only use this where every other user of the card is
+ * known to reset or re-select (e.g. pivy-agent's own warm path).
+ */
+MUST_CHECK
+errf_t *piv_select_cached(struct piv_token *tk);
+
 /*
  * Reads the certificate in a given slot on the card, and updates the list
  * of struct piv_slots with info about it.
@@ -472,6 +578,17 @@ errf_t *piv_select(struct piv_token *tk);
  */
 MUST_CHECK
 errf_t *piv_read_cert(struct piv_token *tk, enum piv_slotid slotid);
+/*
+ * Makes sure piv_slot_cert() will return the certificate for a slot, reading
+ * it from the card again if we don't have it (e.g. because piv_compact_slots
+ * is set). The certificate is kept until the slot is freed, whatever
+ * piv_compact_slots says.
+ *
+ * Requires an open transaction and the applet to be selected. Errors are as
+ * for piv_read_cert().
+ */
+MUST_CHECK
+errf_t *piv_slot_load_cert(struct piv_token *tk, struct piv_slot *slot);
 /*
  * Attempts to read certificates in all supported PIV slots on the card, by
  * calling piv_read_cert repeatedly. Ignores ENOENT and ENOTSUP errors. Any
@@ -480,6 +597,19 @@ errf_t *piv_read_cert(struct piv_token *tk, enum piv_slotid slotid);
 MUST_CHECK
 errf_t *piv_read_all_certs(struct piv_token *tk);
 
+/*
+ * Like piv_read_all_certs(), but only fetches what's needed to use the keys:
+ * on YubicoPIV 5.3+ tokens each slot's public key, algorithm and PIN/touch
+ * policy come from GET METADATA and no certificates are read at all (which
+ * saves a lot of time on tokens with many retired slots in use). Other tokens
+ * fall back to piv_read_all_certs().
+ *
+ * Afterwards piv_slot_cert() and piv_slot_subject() may return NULL for any
+ * slot; use piv_read_cert() on the slots whose subject you want to display.
+ */
+MUST_CHECK
+errf_t *piv_read_all_pubkeys(struct piv_token *tk);
+
 /*
  * Authenticates as the card administrator using a 3DES key.
  *
@@ -820,6 +950,29 @@ MUST_CHECK
 errf_t *piv_sign_prehash(struct piv_token *tk, struct piv_slot *slot,
     const uint8_t *hash, size_t hashlen, uint8_t **signature, size_t *siglen);
 
+/*
+ * For callers that want to hash the data themselves (e.g. because there's a
+ * lot of it and it's being streamed in): piv_sign_hashalg() works out which
+ * hash algorithm piv_sign() would use for the slot, taking "hashalgo" as a
+ * preference in the same way, and piv_sign_digest() then signs the "dglen"
+ * byte digest made with it (doing the PKCS#1 padding for RSA keys).
+ *
+ * piv_sign_hashalg() needs the card's algorithm list, so the token must have
+ * been selected first. It doesn't talk to the card.
+ *
+ * Errors (in addition to those of piv_sign()):
+ *   - NotSupportedError: the card can only sign with this key by hashing the
+ *                        data on-card, so it has to go through piv_sign()
+ *   - ArgumentError: dglen doesn't match hashalgo
+ */
+MUST_CHECK
+errf_t *piv_sign_hashalg(struct piv_token *tk, struct piv_slot *slot,
+    enum sshdigest_types *hashalgo);
+MUST_CHECK
+errf_t *piv_sign_digest(struct piv_token *tk, struct piv_slot *slot,
+    const uint8_t *dg, size_t dglen, enum sshdigest_types hashalgo,
+    uint8_t **signature, size_t *siglen);
+
 /*
  * Performs an ECDH key derivation between the private key on the token and
  * the given EC public key.
@@ -857,6 +1010,34 @@ errf_t *piv_box_seal(struct piv_token *tk, struct piv_slot *slot,
     struct piv_ecdh_box *box);
 MUST_CHECK
 errf_t *piv_box_seal_offline(struct sshkey *pubk, struct piv_ecdh_box *box);
+
+/*
+ * piv_box_seal_offline() keeps a small cache of recipient keys it has sealed
+ * to recently (their curve group and decoded point). This drops every entry.
+ * It's safe to call at any time, including while other threads are sealing.
+ */
+void piv_box_seal_cache_flush(void);
+
+/*
+ * A pool of pre-generated ephemeral EC keys for piv_box_seal_offline() (and
+ * ebox, for its challenges) to use instead of generating one on the spot.
+ *
+ * piv_ephem_pool_init() turns it on, with room for "size" keys per curve (it
+ * starts off disabled). Keys are only made by piv_ephem_pool_refill(), which
+ * makes at most one and returns B_TRUE if the pool wants more, or by the
+ * background thread piv_ephem_pool_start() runs.
+ *
+ * piv_ephem_take() hands out a key from the pool, or generates one if there
+ * are none left (or the pool is off). It returns an SSH_ERR_* code like
+ * sshkey_generate(), and the caller owns (and must sshkey_free()) the key.
+ */
+void piv_ephem_pool_init(uint size);
+MUST_CHECK
+int piv_ephem_take(uint bits, struct sshkey **keyp);
+boolean_t piv_ephem_pool_refill(void);
+MUST_CHECK
+errf_t *piv_ephem_pool_start(void);
+void piv_ephem_pool_stats(uint64_t *hits, uint64_t *misses);
 MUST_CHECK
 errf_t *piv_box_to_binary(struct piv_ecdh_box *box, uint8_t **output, size_t *len);
 
@@ -885,6 +1066,30 @@ errf_t *piv_box_from_binary(const uint8_t *input, size_t len,
 MUST_CHECK
 errf_t *piv_box_find_token(struct piv_token *tks, struct piv_ecdh_box *box,
     struct piv_token **tk, struct piv_slot **slot);
+
+/*
+ * An index of the public keys on a list of tokens, for matching lots of
+ * boxes (or other keys) against them. The first lookup reads the public keys
+ * from every slot of every token (skipping any we can't talk to), after which
+ * lookups are by key fingerprint and don't touch the tokens. Slots added to
+ * the tokens after that aren't in the index.
+ *
+ * piv_box_find_token_index() is piv_box_find_token() using an index: it
+ * still goes by the GUID and slot in the box first (if it has them).
+ *
+ * The index must be freed before the tokens are released.
+ */
+struct piv_key_index;
+
+MUST_CHECK
+errf_t *piv_key_index_new(struct piv_token *tks, struct piv_key_index **idx);
+MUST_CHECK
+errf_t *piv_key_index_find(struct piv_key_index *idx,
+    const struct sshkey *key, struct piv_token **tk, struct piv_slot **slot);
+void piv_key_index_free(struct piv_key_index *idx);
+MUST_CHECK
+errf_t *piv_box_find_token_index(struct piv_key_index *idx,
+    struct piv_ecdh_box *box, struct piv_token **tk, struct piv_slot **slot);
 MUST_CHECK
 errf_t *piv_box_open(struct piv_token *tk, struct piv_slot *slot,
     struct piv_ecdh_box *box);
@@ -952,6 +1157,7 @@ enum iso_sw {
 	SW_OUT_OF_MEMORY = 0x6A84,
 	SW_WRONG_LENGTH = 0x6700,
 	SW_INS_NOT_SUP = 0x6D00,
+	SW_CLA_NOT_SUP = 0x6E00,
 	SW_FILE_INVALID = 0x6983,
 };
 
@@ -961,6 +1167,16 @@ enum iso_sw {
 struct apdu *piv_apdu_make(enum iso_class cls, enum iso_ins ins, uint8_t p1,
     uint8_t p2);
 
+/*
+ * Like piv_apdu_make(), but takes the APDU and its command and reply buffers
+ * from a small pool owned by the token, so that no allocation is done. The
+ * buffers are wiped when the APDU is given back with piv_apdu_free(), which
+ * must happen before the token is released. If the pool is exhausted this
+ * falls back to piv_apdu_make().
+ */
+struct apdu *piv_apdu_borrow(struct piv_token *pk, enum iso_class cls,
+    enum iso_ins ins, uint8_t p1, uint8_t p2);
+
 /*
  * Sets the command data for an apdu. The command data is not copied, so
  * the data behind this pointer must remain valid until the apdu has been used
@@ -982,7 +1198,10 @@ uint16_t piv_apdu_sw(const struct apdu *apdu);
  */
 const uint8_t *piv_apdu_get_reply(const struct apdu *apdu, size_t *len);
 
-/* Frees an APDU and any reply data held by it. */
+/*
+ * Frees an APDU and any reply data held by it (or returns it to its token's
+ * pool, if it came from piv_apdu_borrow()).
+ */
 void piv_apdu_free(struct apdu *pdu);
 
 /*
@@ -1006,4 +1225,88 @@ errf_t *piv_apdu_transceive_chain(struct piv_token *pk, struct apdu *apdu);
  */
 extern boolean_t piv_full_apdu_debug;
 
+/*
+ * If set to a directory path, piv_read_all_certs() and piv_read_all_pubkeys()
+ * keep a cache there of each token's slot public keys and cert subjects, keyed
+ * on its GUID and the contents of its CHUID and Key History objects. On a
+ * cache hit no certificates are read from the card, and piv_slot_cert() will
+ * return NULL for the slots (until piv_read_cert() is called on them).
+ *
+ * The directory is created (mode 0700) if it does not exist.
+ */
+extern const char *piv_cert_cache_dir;
+
+/*
+ * If set to B_TRUE, reading a slot's certificate keeps only its public key,
+ * algorithm, subject and hash, and frees the parsed X509 straight away. This
+ * saves memory in long-running programs (and ones started often) that only
+ * need the keys, like pivy-agent and pam_pivy. piv_slot_load_cert() reads the
+ * certificate again for anything that needs it.
+ */
+extern boolean_t piv_compact_slots;
+
+/*
+ * If set, called after every APDU exchanged with a card, with the instruction
+ * byte (and its name, as used in our logs), the status word returned and the
+ * time SCardTransmit() took in microseconds. Not called for APDUs which failed
+ * at the PC/SC level.
+ *
+ * Note that piv_enumerate() and piv_find() probe readers in parallel, so this
+ * may be called from threads other than the one that called them.
+ */
+typedef void (*piv_apdu_observer_t)(uint8_t ins, const char *ins_name,
+    uint16_t sw, uint64_t usec);
+extern piv_apdu_observer_t piv_apdu_observer;
+
+/*
+ * APDU flight recorder: a fixed-size ring holding the last
+ * PIV_APDU_REC_COUNT APDUs exchanged with any card by this process, as
+ * compact binary records. It's cheap enough to leave on (it is, by default),
+ * so that when something goes wrong we can look at what the card was doing
+ * without having to turn on piv_full_apdu_debug and reproduce it.
+ *
+ * Only the first PIV_APDU_REC_DATA bytes of the command data are kept, and
+ * none at all (PIV_APDU_REC_REDACTED is set instead) for instructions which
+ * carry PINs or keys: VERIFY, CHANGE/RESET PIN, admin key auth, etc. Reply
+ * data is never kept.
+ */
+#define	PIV_APDU_REC_COUNT	256
+#define	PIV_APDU_REC_DATA	16
+
+enum piv_apdu_rec_flags {
+	PIV_APDU_REC_REDACTED	= (1 << 0),
+	PIV_APDU_REC_EXTLEN	= (1 << 1),
+	PIV_APDU_REC_PCSC_FAIL	= (1 << 2),	/* par_sw is not valid */
+};
+
+struct piv_apdu_rec {
+	uint64_t par_seq;	/* 1 for the first APDU, 2 for the next... */
+	uint64_t par_time;	/* usec since the epoch, when sent */
+	uint32_t par_usec;	/* how long SCardTransmit() took */
+	uint32_t par_lc;
+	uint32_t par_le;
+	uint32_t par_lr;	/* length of reply data */
+	uint16_t par_sw;
+	uint8_t par_cls;
+	uint8_t par_ins;
+	uint8_t par_p1;
+	uint8_t par_p2;
+	uint8_t par_flags;
+	uint8_t par_datalen;
+	uint8_t par_data[PIV_APDU_REC_DATA];
+};
+
+extern boolean_t piv_apdu_recording;
+
+/*
+ * Copies out up to "max" of the most recent records, oldest first, and returns
+ * the number copied. Safe to call from any thread, though a record which is
+ * being written at the time may be skipped.
+ */
+size_t piv_apdu_rec_dump(struct piv_apdu_rec *out, size_t max);
+
+/* Names for instruction bytes and status words, as used in our logs. */
+const char *piv_ins_name(uint8_t ins);
+const char *piv_sw_name(uint16_t sw);
+
 #endif
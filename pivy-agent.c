@@ -87,6 +87,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <pthread.h>
 
 #include "libssh/ssh2.h"
 #include "libssh/sshbuf.h"
@@ -100,6 +101,7 @@
 #include "tlv.h"
 #include "piv.h"
 #include "errf.h"
+#include "probes.h"
 
 #if defined(__APPLE__)
 #include <PCSC/wintypes.h>
@@ -120,11 +122,19 @@
 #include <libproc.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+    defined(__NetBSD__) || defined(__DragonFly__)
+#include <sys/event.h>
+#endif
+
 #include "libssh/digest.h"
 #include "libssh/cipher.h"
 #include "libssh/ssherr.h"
 
 #define	MINIMUM(a,b) (((a) < (b)) ? (a) : (b))
+#define	MAXIMUM(a,b) (((a) > (b)) ? (a) : (b))
 
 /*
  * Name of the environment variable containing the process ID of the
@@ -161,16 +171,184 @@ typedef enum confirm_mode {
 	C_FORWARDED
 } confirm_mode_t;
 
-static struct piv_token *ks = NULL;
-static struct piv_token *selk = NULL;
-static boolean_t txnopen = B_FALSE;
-static uint64_t txntimeout = 0;
-static SCARDCONTEXT ctx;
-static uint64_t last_update;
-static uint64_t last_op;
-static uint8_t *guid = NULL;
-static size_t guid_len = 0;
+struct agent_job;
+
+/*
+ * Everything we know about one of the PIV tokens we're serving (one per -g
+ * option).
+ *
+ * Each token gets a worker thread (token_worker()) which owns everything in
+ * here apart from the fields under at_mtx, and the main thread just routes
+ * requests to the right one. That way a card that's waiting for a touch or
+ * a PIN doesn't hold up requests for any of the others, or anything the
+ * main thread can answer itself (like identity listings and queries).
+ */
+struct agent_token {
+	uint at_idx;
+	uint8_t *at_guid;
+	size_t at_guid_len;
+	struct sshkey *at_cak;
+
+	SCARDCONTEXT at_ctx;
+	struct piv_token *at_ks;
+	struct piv_token *at_selk;
+	/* Reader at_selk was last found in, to try first after a reconnect */
+	char *at_rdrname;
+	boolean_t at_txnopen;
+	boolean_t at_txnbatch;
+	uint64_t at_txntimeout;
+	uint64_t at_hold_avg;
+	uint64_t at_hold_last_req;
+	uint64_t at_last_update;
+	uint64_t at_last_op;
+	time_t at_probe_interval;
+	uint at_probe_fails;
+	/*
+	 * When the CAK was last checked on at_selk (0 if it hasn't been since
+	 * we last connected to the card). See agent_check_cak().
+	 */
+	uint64_t at_cak_checked;
+
+	char *at_pin;
+	size_t at_pin_len;
+
+	pthread_t at_thread;
+	pthread_mutex_t at_mtx;
+	pthread_cond_t at_cv;
+
+	/* Protected by at_mtx */
+	struct agent_job *at_jobs;
+	struct agent_job *at_jobs_tail;
+	struct sshkey **at_keys;	/* public keys, for routing */
+	uint at_nkeys;
+	boolean_t at_pub_txnopen;
+	boolean_t at_pub_havepin;
+	uint64_t at_pub_hold_avg;
+	/*
+	 * A copy of at_idcache for the main thread to answer identity
+	 * requests with while the worker is busy, and the at_last_update it
+	 * went with.
+	 */
+	struct sshbuf *at_pub_ids;
+	uint64_t at_pub_ids_update;
+	boolean_t at_pub_busy;
+
+	/* Worker only: at_last_update as of the at_keys we published */
+	uint64_t at_keys_update;
+	struct piv_token *at_keys_selk;
+
+	/*
+	 * Worker only, with -l: the next retired slot (counting from
+	 * PIV_SLOT_RETIRED_1) for token_lazy_load() to read, and whether
+	 * there are any left.
+	 */
+	uint at_lazy_next;
+	boolean_t at_lazy_pending;
+
+	/*
+	 * The serialised SSH2_AGENT_IDENTITIES_ANSWER for this token, valid
+	 * while at_selk and at_last_update are what they were when we built
+	 * it (i.e. until the certs are read again, or we find the card again).
+	 */
+	struct sshbuf *at_idcache;
+	uint64_t at_idcache_update;
+	struct piv_token *at_idcache_selk;
+};
+
+static struct agent_token *tokens = NULL;
+static uint ntokens = 0;
+
+/*
+ * How long we hold the card transaction open after a request, in case
+ * another one arrives. With the "fixed" policy this is always txn_hold_min
+ * milliseconds. With "adaptive" we keep a moving average of the gaps
+ * between requests and hold for twice that (so we stay in the transaction
+ * for a burst of requests, but let other processes at the card quickly
+ * when things are quiet), clamped to [txn_hold_min, txn_hold_max].
+ */
+enum txn_hold_policy {
+	TXN_HOLD_FIXED,
+	TXN_HOLD_ADAPTIVE
+};
+static enum txn_hold_policy txn_hold_policy = TXN_HOLD_FIXED;
+static uint64_t txn_hold_min = 2000;
+static uint64_t txn_hold_max = 2000;
+
+/*
+ * How long (ms) we trust a CAK check for while we stay connected to the card
+ * (-A). 0 means check on every probe and open.
+ */
+static uint64_t cak_recheck_ms = 300000;
+
+/* Record of the decisions made by txn_hold_extend(), for stats. */
+struct txn_hold_stats {
+	uint64_t ths_decisions;
+	uint64_t ths_last_hold;
+	uint64_t ths_clamped_min;
+	uint64_t ths_clamped_max;
+	uint64_t ths_idle_gaps;
+};
+static struct txn_hold_stats txn_hold_stats;
+
+/* Counters reported by the stats@joyent.com extension. */
+struct agent_stats {
+	uint64_t as_sign;
+	uint64_t as_sign_fail;
+	uint64_t as_ecdh;
+	uint64_t as_ecdh_fail;
+	uint64_t as_rebox;
+	uint64_t as_rebox_fail;
+	uint64_t as_txn_open;
+	uint64_t as_txn_reuse;
+	uint64_t as_reconnect;
+	uint64_t as_reconnect_direct;
+	uint64_t as_piv_find;
+	uint64_t as_probe;
+	uint64_t as_probe_fail;
+	uint64_t as_cak_run;
+	uint64_t as_cak_skip;
+	uint64_t as_cak_fail;
+	uint64_t as_ident_cached;
+	uint64_t as_ident_rebuild;
+	uint64_t as_ident_coalesced;
+};
+static struct agent_stats agent_stats;
+
+/* Protects agent_stats and txn_hold_stats, which token workers update. */
+static pthread_mutex_t stats_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+stat_inc(uint64_t *stat)
+{
+	VERIFY0(pthread_mutex_lock(&stats_mtx));
+	++(*stat);
+	VERIFY0(pthread_mutex_unlock(&stats_mtx));
+}
+
+/*
+ * APDU latency histograms, one per instruction byte. Bucket i counts APDUs
+ * that took at most apdu_lat_bounds[i] usec, and the last bucket the rest.
+ *
+ * These are filled in by apdu_observe(), which can run on piv_find()'s probe
+ * threads, so they're protected by apdu_lat_mtx.
+ */
+static const uint64_t apdu_lat_bounds[] = {
+	500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+	1000000, 2500000
+};
+#define	APDU_LAT_NBOUNDS	\
+	(sizeof (apdu_lat_bounds) / sizeof (apdu_lat_bounds[0]))
+
+struct apdu_lat {
+	const char *al_name;
+	uint64_t al_count;
+	uint64_t al_sum;
+	uint64_t al_buckets[APDU_LAT_NBOUNDS + 1];
+};
+static struct apdu_lat apdu_lat[256];
+static pthread_mutex_t apdu_lat_mtx = PTHREAD_MUTEX_INITIALIZER;
 static boolean_t sign_9d = B_FALSE;
+static boolean_t lazy_slots = B_FALSE;
 static boolean_t check_client_uid = B_TRUE;
 static confirm_mode_t confirm_mode = C_NEVER;
 #if defined(__sun)
@@ -179,16 +357,15 @@ static boolean_t check_client_zoneid = B_TRUE;
 /* One bit per slot, bit# = slot# & 0x7f */
 static uint64_t slot_ena_mask = 0x743ffffc;
 
-static char *pinmem = NULL;
-static char *pin = NULL;
-static size_t pin_len = 0;
-
-static struct sshkey *cak = NULL;
-
-static struct bunyan_frame *msg_log_frame;
-
 /* Maximum accepted message length */
 #define AGENT_MAX_LEN	(256*1024)
+/* How long a token must be idle before -l reads more retired slots (ms) */
+#define	LAZY_IDLE_MS	200
+
+/* Ephemeral keys (per curve) the token workers keep ready for rebox. */
+#define	AGENT_EPHEM_POOL	8
+/* Most boxes in one ecdh-rebox-batch@joyent.com request. */
+#define	REBOX_BATCH_MAX	1024
 
 typedef enum sock_type {
 	AUTH_UNUSED,
@@ -215,33 +392,104 @@ typedef struct socket_entry {
 	struct sshbuf *se_request;
 	struct pid_entry *se_pid_ent;
 	uint se_pid_idx;
+	boolean_t se_wantwrite;
+	struct agent_token *se_tok;	/* NULL if we have token workers */
+	boolean_t se_busy;		/* a token worker has our request */
+	boolean_t se_pin_checked;	/* UNLOCK: got a definite answer */
+	uint64_t se_gen;
+	struct bunyan_frame *se_log_frame;
 } socket_entry_t;
 
 u_int sockets_alloc = 0;
 socket_entry_t *sockets = NULL;
+/*
+ * Bumped for each new connection, so that a token worker's answer can be
+ * dropped if the connection it was for has gone (and its slot been reused).
+ */
+static uint64_t sockets_gen = 0;
 
+/*
+ * What we know about each client process, hashed on (pid, uid). Entries are
+ * held by every connection from the process (pe_refs), which lets us skip
+ * checking the start time for another connection from a process we checked
+ * recently and still have a connection open to: it can't have gone away and
+ * had its pid reused in the meantime.
+ *
+ * The exe path and args are read again on every connection, though, since
+ * the process can have exec'd something else (e.g. ssh -A) since we last
+ * looked. If they've changed, it gets a new entry (and no pe_last_auth).
+ *
+ * Entries nobody holds are kept around for PID_CACHE_TTL (so pe_last_auth
+ * survives clients which connect once per operation), and we never keep
+ * more than PID_CACHE_MAX of those.
+ */
 typedef struct pid_entry {
+	struct pid_entry *pe_next;
 	boolean_t pe_valid;
 	uint64_t pe_time;
+	uint64_t pe_checked;
 	pid_t pe_pid;
+	uid_t pe_uid;
 	uint64_t pe_start_time;
+	uint pe_refs;
 	uint pe_conn_count;
 	uint64_t pe_last_auth;
+	char *pe_exepath;
+	char *pe_exeargs;
 } pid_entry_t;
 
-pid_entry_t *pids = NULL;
-uint pids_alloc = 0;
+#define	PID_HASH_SIZE	256
+#define	PID_CACHE_MAX	1024
+#define	PID_CACHE_TTL	30000
+
+static pid_entry_t *pid_hash[PID_HASH_SIZE];
+static uint pids_idle = 0;
 
 int max_fd = 0;
 
+/*
+ * Map from fd to index into sockets[] (or -1), so that handling a ready fd
+ * doesn't need a scan over every socket. We store indexes rather than
+ * pointers since new_socket() may move sockets[] around.
+ */
+static int *fd_socks = NULL;
+static size_t fd_socks_alloc = 0;
+
+static void
+fd_sock_set(int fd, int socknum)
+{
+	size_t i, new_alloc;
+
+	VERIFY(fd >= 0);
+	if ((size_t)fd >= fd_socks_alloc) {
+		new_alloc = fd_socks_alloc * 2;
+		if (new_alloc < 64)
+			new_alloc = 64;
+		if (new_alloc <= (size_t)fd)
+			new_alloc = fd + 1;
+		fd_socks = reallocarray(fd_socks, new_alloc, sizeof (int));
+		VERIFY(fd_socks != NULL);
+		for (i = fd_socks_alloc; i < new_alloc; ++i)
+			fd_socks[i] = -1;
+		fd_socks_alloc = new_alloc;
+	}
+	fd_socks[fd] = socknum;
+}
+
+static int
+fd_sock_get(int fd)
+{
+	if (fd < 0 || (size_t)fd >= fd_socks_alloc)
+		return (-1);
+	return (fd_socks[fd]);
+}
+
 const time_t card_probe_interval_nopin = 120;
 const time_t card_probe_interval_pin = 30;
 const uint card_probe_limit = 3;
 
 const uint64_t pid_auth_cache_time = 15000;
 
-time_t card_probe_interval = 120; /* card_probe_interval_nopin */
-uint card_probe_fails = 0;
 
 /* pid of shell == parent of agent */
 pid_t parent_pid = -1;
@@ -314,6 +562,126 @@ fatal(const char *fmt, ...)
 	exit(1);
 }
 
+/*
+ * Event loop backends. On Linux we use epoll and on the BSDs and macOS we
+ * use kqueue: both keep the set of fds we're interested in inside the
+ * kernel, so each trip around the main loop only has to tell it about the
+ * sockets whose write interest changed. Everywhere else (or if we fail to
+ * set up the kernel queue) we rebuild a pollfd array every time, as
+ * prepare_poll() and after_poll() do.
+ */
+#if defined(__linux__)
+#define	AGENT_EPOLL
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+    defined(__NetBSD__) || defined(__DragonFly__)
+#define	AGENT_KQUEUE
+#endif
+
+#if defined(AGENT_EPOLL) || defined(AGENT_KQUEUE)
+#define	EV_MAX_EVENTS	64
+
+static int ev_fd = -1;
+static boolean_t ev_failed = B_FALSE;
+
+#if defined(AGENT_EPOLL)
+static struct epoll_event ev_list[EV_MAX_EVENTS];
+#else
+static struct kevent ev_list[EV_MAX_EVENTS];
+#endif
+
+static boolean_t
+ev_init(void)
+{
+	if (ev_fd != -1)
+		return (B_TRUE);
+	if (ev_failed)
+		return (B_FALSE);
+#if defined(AGENT_EPOLL)
+	ev_fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+	ev_fd = kqueue();
+	if (ev_fd != -1)
+		(void) fcntl(ev_fd, F_SETFD, FD_CLOEXEC);
+#endif
+	if (ev_fd == -1) {
+		error("failed to create event queue, falling back to "
+		    "poll(): %s", strerror(errno));
+		ev_failed = B_TRUE;
+		return (B_FALSE);
+	}
+	return (B_TRUE);
+}
+
+static void
+ev_add(int fd)
+{
+#if defined(AGENT_EPOLL)
+	struct epoll_event ev;
+#else
+	struct kevent ev;
+#endif
+
+	if (!ev_init())
+		return;
+#if defined(AGENT_EPOLL)
+	bzero(&ev, sizeof (ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(ev_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+		fatal("%s: epoll_ctl(ADD, %d): %s", __func__, fd,
+		    strerror(errno));
+#else
+	EV_SET(&ev, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	if (kevent(ev_fd, &ev, 1, NULL, 0, NULL) != 0)
+		fatal("%s: kevent(ADD, %d): %s", __func__, fd,
+		    strerror(errno));
+#endif
+}
+
+static void
+ev_del(int fd, boolean_t wantwrite)
+{
+#if defined(AGENT_EPOLL)
+	if (ev_fd == -1)
+		return;
+	(void) epoll_ctl(ev_fd, EPOLL_CTL_DEL, fd, NULL);
+#else
+	struct kevent ev[2];
+	int n = 0;
+
+	if (ev_fd == -1)
+		return;
+	EV_SET(&ev[n++], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	if (wantwrite)
+		EV_SET(&ev[n++], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+	(void) kevent(ev_fd, ev, n, NULL, 0, NULL);
+#endif
+}
+
+static void
+ev_set_write(int fd, boolean_t wantwrite)
+{
+#if defined(AGENT_EPOLL)
+	struct epoll_event ev;
+
+	bzero(&ev, sizeof (ev));
+	ev.events = EPOLLIN | (wantwrite ? EPOLLOUT : 0);
+	ev.data.fd = fd;
+	if (epoll_ctl(ev_fd, EPOLL_CTL_MOD, fd, &ev) != 0)
+		fatal("%s: epoll_ctl(MOD, %d): %s", __func__, fd,
+		    strerror(errno));
+#else
+	struct kevent ev;
+
+	EV_SET(&ev, fd, EVFILT_WRITE, wantwrite ? EV_ADD : EV_DELETE,
+	    0, 0, NULL);
+	if (kevent(ev_fd, &ev, 1, NULL, 0, NULL) != 0)
+		fatal("%s: kevent(WRITE, %d): %s", __func__, fd,
+		    strerror(errno));
+#endif
+}
+#endif	/* AGENT_EPOLL || AGENT_KQUEUE */
+
 static uint64_t
 monotime(void)
 {
@@ -326,16 +694,22 @@ monotime(void)
 }
 
 static void
-agent_piv_close(boolean_t force)
+agent_piv_close(struct agent_token *at, boolean_t force)
 {
 	uint64_t now = monotime();
-	VERIFY(txnopen);
-	if (force || now >= txntimeout) {
+	VERIFY(at->at_txnopen);
+	/*
+	 * While a token worker is running a batch of card requests, keep
+	 * the transaction open between them unless something went wrong.
+	 */
+	if (!force && at->at_txnbatch)
+		return;
+	if (force || now >= at->at_txntimeout) {
 		bunyan_log(BNY_TRACE, "closing txn",
 		    "now", BNY_UINT64, now,
-		    "txntimeout", BNY_UINT64, txntimeout, NULL);
-		piv_txn_end(selk);
-		txnopen = B_FALSE;
+		    "txntimeout", BNY_UINT64, at->at_txntimeout, NULL);
+		piv_txn_end(at->at_selk);
+		at->at_txnopen = B_FALSE;
 	}
 }
 
@@ -388,28 +762,28 @@ valid_pin(const char *pin)
 }
 
 static void
-drop_pin(void)
+drop_pin(struct agent_token *at)
 {
-	if (pin_len != 0) {
+	if (at->at_pin_len != 0) {
 		bunyan_log(BNY_INFO, "clearing PIN from memory", NULL);
-		explicit_bzero(pin, pin_len);
+		explicit_bzero(at->at_pin, at->at_pin_len);
 	}
-	pin_len = 0;
-	card_probe_interval = card_probe_interval_nopin;
+	at->at_pin_len = 0;
+	at->at_probe_interval = card_probe_interval_nopin;
 }
 
 static errf_t *
-auth_cak(void)
+auth_cak(struct agent_token *at)
 {
 	struct piv_slot *slot;
 	errf_t *err;
-	slot = piv_get_slot(selk, PIV_SLOT_CARD_AUTH);
+	slot = piv_get_slot(at->at_selk, PIV_SLOT_CARD_AUTH);
 	if (slot == NULL) {
 		err = errf("CAKAuthError", NULL, "No key was found in the "
 		    "CARD_AUTH (CAK) slot");
 		return (err);
 	}
-	err = piv_auth_key(selk, slot, cak);
+	err = piv_auth_key(at->at_selk, slot, at->at_cak);
 	if (err) {
 		err = errf("CAKAuthError", err, "Key in CARD_AUTH slot (CAK) "
 		    "does not match the configured CAK: this card may be "
@@ -419,196 +793,734 @@ auth_cak(void)
 	return (NULL);
 }
 
+/*
+ * Checks the CAK if we haven't since (re)connecting to the card, or it's been
+ * cak_recheck_ms since we last did. In between we go by the card handle: if
+ * the card is pulled (or swapped for another) our handle goes bad and
+ * piv_txn_begin() on it fails, which sends agent_piv_open() back through
+ * piv_find() and clears at_cak_checked. A reset by someone else is handled
+ * in piv_txn_begin() by reconnecting to the same card, so it doesn't count.
+ */
+static errf_t *
+agent_check_cak(struct agent_token *at)
+{
+	errf_t *err;
+	uint64_t now;
+
+	if (at->at_cak == NULL)
+		return (ERRF_OK);
+	now = monotime();
+	if (at->at_cak_checked != 0 && cak_recheck_ms != 0 &&
+	    (now - at->at_cak_checked) < cak_recheck_ms) {
+		stat_inc(&agent_stats.as_cak_skip);
+		return (ERRF_OK);
+	}
+	stat_inc(&agent_stats.as_cak_run);
+	if ((err = auth_cak(at))) {
+		stat_inc(&agent_stats.as_cak_fail);
+		at->at_cak_checked = 0;
+		return (err);
+	}
+	at->at_cak_checked = monotime();
+	return (ERRF_OK);
+}
+
+#if defined(__APPLE__)
+static long long strtonum(const char *, long long, long long, const char **);
+#endif
+
+static errf_t *
+parse_hold_spec(const char *str)
+{
+	const char *errstr = NULL;
+	char *buf, *p;
+	long long min, max;
+
+	if (strcmp(str, "adaptive") == 0) {
+		txn_hold_policy = TXN_HOLD_ADAPTIVE;
+		txn_hold_min = 250;
+		txn_hold_max = 5000;
+		return (ERRF_OK);
+	}
+	if (strncmp(str, "adaptive:", strlen("adaptive:")) == 0) {
+		buf = strdup(str + strlen("adaptive:"));
+		VERIFY(buf != NULL);
+		if ((p = strchr(buf, '-')) == NULL) {
+			free(buf);
+			return (errf("ParseError", NULL, "Adaptive hold spec "
+			    "must be of the form 'adaptive:min-max'"));
+		}
+		*p++ = '\0';
+		min = strtonum(buf, 0, 60000, &errstr);
+		if (errstr == NULL)
+			max = strtonum(p, 0, 60000, &errstr);
+		free(buf);
+		if (errstr != NULL) {
+			return (errf("ParseError", NULL, "Hold time is %s",
+			    errstr));
+		}
+		if (min > max) {
+			return (errf("ParseError", NULL, "Minimum hold time "
+			    "(%lld) is greater than maximum (%lld)", min, max));
+		}
+		txn_hold_policy = TXN_HOLD_ADAPTIVE;
+		txn_hold_min = min;
+		txn_hold_max = max;
+		return (ERRF_OK);
+	}
+	min = strtonum(str, 0, 60000, &errstr);
+	if (errstr != NULL)
+		return (errf("ParseError", NULL, "Hold time is %s", errstr));
+	txn_hold_policy = TXN_HOLD_FIXED;
+	txn_hold_min = txn_hold_max = min;
+	return (ERRF_OK);
+}
+
+static errf_t *
+parse_cak_spec(const char *str)
+{
+	const char *errstr = NULL;
+	long long secs;
+
+	if (strcmp(str, "always") == 0) {
+		cak_recheck_ms = 0;
+		return (ERRF_OK);
+	}
+	secs = strtonum(str, 1, 86400, &errstr);
+	if (errstr != NULL) {
+		return (errf("ParseError", NULL, "CAK recheck interval "
+		    "'%s' is %s", str, errstr));
+	}
+	cak_recheck_ms = secs * 1000;
+	return (ERRF_OK);
+}
+
+/*
+ * Called each time a request opens (or reuses) the card transaction: works
+ * out how long to keep it open for and sets txntimeout.
+ */
+static void
+txn_hold_extend(struct agent_token *at)
+{
+	uint64_t now, gap, hold;
+
+	now = monotime();
+	hold = txn_hold_min;
+
+	if (txn_hold_policy == TXN_HOLD_ADAPTIVE) {
+		gap = now - at->at_hold_last_req;
+		if (at->at_hold_last_req == 0 || gap > txn_hold_max) {
+			/*
+			 * A gap longer than we'd ever hold for is the start of
+			 * a new burst rather than a sample of this one.
+			 */
+			stat_inc(&txn_hold_stats.ths_idle_gaps);
+		} else if (at->at_hold_avg == 0) {
+			at->at_hold_avg = gap;
+		} else {
+			at->at_hold_avg = (at->at_hold_avg * 3 + gap) / 4;
+		}
+		hold = at->at_hold_avg * 2;
+		if (hold <= txn_hold_min) {
+			hold = txn_hold_min;
+			stat_inc(&txn_hold_stats.ths_clamped_min);
+		} else if (hold >= txn_hold_max) {
+			hold = txn_hold_max;
+			stat_inc(&txn_hold_stats.ths_clamped_max);
+		}
+	}
+
+	at->at_hold_last_req = now;
+	at->at_txntimeout = now + hold;
+	VERIFY0(pthread_mutex_lock(&stats_mtx));
+	++txn_hold_stats.ths_decisions;
+	txn_hold_stats.ths_last_hold = hold;
+	VERIFY0(pthread_mutex_unlock(&stats_mtx));
+}
+
+/*
+ * Reads the certs (and so the public keys) in at_selk's slots. With -l this
+ * only reads the four primary slots, and leaves the retired ones for
+ * token_lazy_load() to pick up while the card is idle.
+ */
+static errf_t *
+agent_read_certs(struct agent_token *at)
+{
+	const enum piv_slotid primary[] = {
+		PIV_SLOT_9E, PIV_SLOT_9A, PIV_SLOT_9C, PIV_SLOT_9D
+	};
+	errf_t *err;
+	uint i;
+
+	if (!lazy_slots)
+		return (piv_read_all_certs(at->at_selk));
+
+	for (i = 0; i < sizeof (primary) / sizeof (primary[0]); ++i) {
+		err = piv_read_cert(at->at_selk, primary[i]);
+		if (err && !errf_caused_by(err, "NotFoundError") &&
+		    !errf_caused_by(err, "PermissionError") &&
+		    !errf_caused_by(err, "NotSupportedError")) {
+			return (err);
+		}
+		errf_free(err);
+	}
+	at->at_lazy_next = 0;
+	at->at_lazy_pending =
+	    (piv_token_keyhistory_oncard(at->at_selk) > 0);
+
+	return (ERRF_OK);
+}
+
 static errf_t *
-agent_piv_open(void)
+agent_piv_open(struct agent_token *at)
 {
 	struct piv_slot *slot;
 	errf_t *err = NULL;
 	int rv;
 
-	if (txnopen) {
-		txntimeout = monotime() + 2000;
+	if (at->at_txnopen) {
+		stat_inc(&agent_stats.as_txn_reuse);
+		txn_hold_extend(at);
 		return (NULL);
 	}
 
-	if (selk == NULL || (err = piv_txn_begin(selk))) {
+	if (at->at_selk == NULL || (err = piv_txn_begin(at->at_selk))) {
+		if (at->at_selk != NULL)
+			stat_inc(&agent_stats.as_reconnect);
 		errf_free(err);
 
-		selk = NULL;
-		if (ks != NULL)
-			piv_release(ks);
+		at->at_selk = NULL;
+		at->at_cak_checked = 0;
+		if (at->at_ks != NULL)
+			piv_release(at->at_ks);
+		at->at_ks = NULL;
+
+		/*
+		 * Try the reader we last saw the card in before scanning all
+		 * of them: after a reset or a transient error it's almost
+		 * always still there.
+		 */
+		if (at->at_rdrname != NULL) {
+			err = piv_find_at(at->at_ctx, at->at_rdrname,
+			    at->at_guid, at->at_guid_len, &at->at_ks);
+			if (err == ERRF_OK) {
+				stat_inc(&agent_stats.as_reconnect_direct);
+				goto found;
+			}
+			bunyan_log(BNY_TRACE, "direct reconnect failed",
+			    "reader", BNY_STRING, at->at_rdrname,
+			    "error", BNY_ERF, err, NULL);
+			errf_free(err);
+			at->at_ks = NULL;
+		}
 
 findagain:
-		err = piv_find(ctx, guid, guid_len, &ks);
+		stat_inc(&agent_stats.as_piv_find);
+		err = piv_find(at->at_ctx, at->at_guid, at->at_guid_len,
+		    &at->at_ks);
 		if (err && errf_caused_by(err, "PCSCContextError")) {
-			ks = NULL;
+			at->at_ks = NULL;
 			bunyan_log(BNY_TRACE, "got context error, re-initing",
 			    "error", BNY_ERF, err, NULL);
 			errf_free(err);
-			SCardReleaseContext(ctx);
+			SCardReleaseContext(at->at_ctx);
 			rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL,
-			    NULL, &ctx);
+			    NULL, &at->at_ctx);
 			if (rv != SCARD_S_SUCCESS) {
 				err = pcscerrf("SCardEstablishContext", rv);
 				return (err);
 			}
 			goto findagain;
 		} else if (err) {
-			ks = NULL;
+			at->at_ks = NULL;
 			err = errf("EnumerationError", err, "Failed to "
 			    "find specified PIV token on the system");
 			return (err);
 		}
-		selk = ks;
+found:
+		at->at_selk = at->at_ks;
 
-		if (selk == NULL) {
+		if (at->at_selk == NULL) {
 			err = errf("NotFoundError", NULL, "PIV card with "
 			    "given GUID is not present on the system");
-			if (monotime() - last_update > 5000)
-				drop_pin();
+			if (monotime() - at->at_last_update > 5000)
+				drop_pin(at);
 			return (err);
 		}
 
-		if ((err = piv_txn_begin(selk))) {
+		free(at->at_rdrname);
+		at->at_rdrname = strdup(piv_token_rdrname(at->at_selk));
+
+		if ((err = piv_txn_begin(at->at_selk))) {
 			return (err);
 		}
 
-		if ((err = piv_select(selk))) {
-			piv_txn_end(selk);
+		if ((err = piv_select(at->at_selk))) {
+			piv_txn_end(at->at_selk);
 			return (err);
 		}
 
-		err = piv_read_all_certs(selk);
+		err = agent_read_certs(at);
 		if (err && !errf_caused_by(err, "NotFoundError") &&
 		    !errf_caused_by(err, "NotSupportedError")) {
-			piv_txn_end(selk);
+			piv_txn_end(at->at_selk);
 			return (err);
 		}
-		if (cak != NULL && (err = auth_cak())) {
-			piv_txn_end(selk);
-			drop_pin();
+		if ((err = agent_check_cak(at))) {
+			piv_txn_end(at->at_selk);
+			drop_pin(at);
 			return (err);
 		}
-		last_update = monotime();
+		at->at_last_update = monotime();
 
 	} else {
-		if ((err = piv_select(selk))) {
-			piv_txn_end(selk);
+		/*
+		 * The card is usually still sitting in the PIV applet from
+		 * our last transaction, so only re-SELECT if it might not be.
+		 */
+		if ((err = piv_select_cached(at->at_selk))) {
+			piv_txn_end(at->at_selk);
 			return (err);
 		}
 	}
-	if (cak == NULL) {
-		slot = piv_get_slot(selk, PIV_SLOT_CARD_AUTH);
+	if (at->at_cak == NULL) {
+		slot = piv_get_slot(at->at_selk, PIV_SLOT_CARD_AUTH);
 		if (slot != NULL)
-			VERIFY0(sshkey_demote(piv_slot_pubkey(slot), &cak));
+			VERIFY0(sshkey_demote(piv_slot_pubkey(slot),
+			    &at->at_cak));
 	}
 	bunyan_log(BNY_TRACE, "opened new txn", NULL);
-	txnopen = B_TRUE;
-	txntimeout = monotime() + 2000;
-	card_probe_fails = 0;
+	stat_inc(&agent_stats.as_txn_open);
+	at->at_txnopen = B_TRUE;
+	txn_hold_extend(at);
+	at->at_probe_fails = 0;
 	return (NULL);
 }
 
 static void
-probe_card(void)
+probe_card(struct agent_token *at)
 {
 	errf_t *err;
-	if (card_probe_fails > card_probe_limit)
+	if (at->at_probe_fails > card_probe_limit)
 		return;
 	bunyan_log(BNY_TRACE, "doing idle probe", NULL);
 
-	last_op = monotime();
-	if ((err = agent_piv_open())) {
+	at->at_last_op = monotime();
+	stat_inc(&agent_stats.as_probe);
+	if ((err = agent_piv_open(at))) {
 		bunyan_log(BNY_TRACE, "error opening for idle probe",
 		    "error", BNY_ERF, err, NULL);
 		errf_free(err);
+		stat_inc(&agent_stats.as_probe_fail);
 		/*
 		 * Allow one failure due to connectivity issues before we
 		 * drop the PIN (so that transient glitches aren't so
 		 * inconvenient).
 		 */
-		if (card_probe_fails++ > 0)
-			drop_pin();
-		selk = NULL;
+		if (at->at_probe_fails++ > 0)
+			drop_pin(at);
+		at->at_selk = NULL;
 		return;
 	}
-	if (cak != NULL && (err = auth_cak())) {
+	if ((err = agent_check_cak(at))) {
 		bunyan_log(BNY_WARN, "CAK authentication failed",
 		    "error", BNY_ERF, err, NULL);
-		agent_piv_close(B_TRUE);
+		agent_piv_close(at, B_TRUE);
 		/* Always drop PIN on a CAK failure. */
-		drop_pin();
-		selk = NULL;
-		card_probe_fails++;
+		drop_pin(at);
+		at->at_selk = NULL;
+		at->at_probe_fails++;
+		stat_inc(&agent_stats.as_probe_fail);
 		return;
 	}
-	agent_piv_close(B_FALSE);
-	card_probe_fails = 0;
+	agent_piv_close(at, B_FALSE);
+	at->at_probe_fails = 0;
 }
 
-static errf_t *
-wrap_pin_error(errf_t *err, int retries)
-{
-	if (errf_caused_by(err, "PermissionError")) {
-		if (retries == 0) {
-			err = errf("TokenLocked", err,
-			    "PIV token is locked due to too many "
-			    "invalid PIN code attempts");
-		} else {
-			err = errf("InvalidPIN", err,
-			    "Invalid PIN code supplied (%d attempts "
-			    "remaining)", retries);
-			drop_pin();
-		}
-	} else if (errf_caused_by(err, "MinRetriesError")) {
-		err = errf("TokenLocked", err,
-		    "Refusing to use up the last PIN code attempt: "
-		    "unlock the token with another tool to clear "
-		    "the counter");
-		drop_pin();
-	}
-	return (err);
-}
+/*
+ * Card presence watcher.
+ *
+ * Rather than waking up every card_probe_interval to open a transaction and
+ * poke the card, we run a thread which sits in SCardGetStatusChange() on its
+ * own PCSC context and tells the main loop about card insertions and removals
+ * through a pipe. The main loop reacts to these straight away (dropping the
+ * PIN on removal, re-finding the token and re-checking the CAK on insertion).
+ *
+ * If the watcher can't be started, or dies, we fall back to polling.
+ */
+enum card_event_type {
+	CARD_EV_INSERTED = 'I',
+	CARD_EV_REMOVED = 'R',
+	CARD_EV_FAILED = 'X'
+};
 
-static const char *askpass = NULL;
-static const char *confirm = NULL;
-static const char *notify = NULL;
+/*
+ * Fixed-size so that each write to the pipe is atomic. For CARD_EV_FAILED the
+ * "reader name" is the PCSC error string instead.
+ */
+struct card_event {
+	char ce_type;
+	char ce_rdrname[255];
+};
+
+static boolean_t card_watcher = B_FALSE;
+static int card_watch_fds[2] = { -1, -1 };
+static uint8_t card_watch_buf[16 * sizeof (struct card_event)];
+static size_t card_watch_len = 0;
+
+/* Used only by the watcher thread. */
+#define	CARD_PNP_NOTIFY		"\\\\?PnP?\\Notification"
+#define	CARD_POLL_READERS_MS	5000
 
 static void
-try_askpass(void)
+card_watch_send(enum card_event_type type, const char *rdrname)
 {
-	int p[2], status;
-	pid_t kid, ret;
-	size_t len;
-	errf_t *err;
-	uint retries = 1;
-	char prompt[64], buf[1024];
-	char *guid = piv_token_shortid(selk);
-	enum piv_pin auth = piv_token_default_auth(selk);
-	snprintf(prompt, 64, "Enter %s for token %s",
-	    pin_type_to_name(auth), guid);
-
-	if (askpass == NULL)
-		askpass = getenv("SSH_ASKPASS");
-	if (askpass == NULL)
-		return;
+	struct card_event ev;
 
-	if (pipe(p) == -1)
-		return;
-	if ((kid = fork()) == -1)
-		return;
-	if (kid == 0) {
-		close(p[0]);
-		if (dup2(p[1], STDOUT_FILENO) == -1)
-			exit(1);
-		execlp(askpass, askpass, prompt, (char *)NULL);
-		exit(1);
+	bzero(&ev, sizeof (ev));
+	ev.ce_type = type;
+	if (rdrname != NULL)
+		(void) strlcpy(ev.ce_rdrname, rdrname, sizeof (ev.ce_rdrname));
+	while (write(card_watch_fds[1], &ev, sizeof (ev)) < 0) {
+		if (errno != EINTR)
+			break;
 	}
-	close(p[1]);
+}
 
-	len = 0;
-	do {
-		ssize_t r = read(p[0], buf + len, sizeof(buf) - 1 - len);
+static void *
+card_watch_thread(void *arg)
+{
+	SCARDCONTEXT wctx;
+	SCARD_READERSTATE *rs = NULL;
+	DWORD nrs = 0, i, j, readersLen;
+	char *readers = NULL, *thisrdr;
+	boolean_t pnp = B_TRUE, first = B_TRUE;
+	LONG rv;
+
+	rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &wctx);
+	if (rv != SCARD_S_SUCCESS) {
+		card_watch_send(CARD_EV_FAILED, pcsc_stringify_error(rv));
+		return (NULL);
+	}
+
+	while (1) {
+		SCARD_READERSTATE *nrs_arr;
+		DWORD nnrs = 1;
+		char *nreaders = NULL;
+
+		/* Re-list the readers, keeping the state of ones we knew. */
+		readersLen = 0;
+		rv = SCardListReaders(wctx, NULL, NULL, &readersLen);
+		if (rv == SCARD_S_SUCCESS) {
+			nreaders = calloc(1, readersLen);
+			VERIFY(nreaders != NULL);
+			rv = SCardListReaders(wctx, NULL, nreaders,
+			    &readersLen);
+		}
+		if (rv != SCARD_S_SUCCESS &&
+		    rv != SCARD_E_NO_READERS_AVAILABLE) {
+			free(nreaders);
+			break;
+		}
+		if (rv != SCARD_S_SUCCESS) {
+			free(nreaders);
+			nreaders = NULL;
+		}
+		for (thisrdr = nreaders; thisrdr != NULL && *thisrdr != 0;
+		    thisrdr += strlen(thisrdr) + 1) {
+			++nnrs;
+		}
+		nrs_arr = calloc(nnrs, sizeof (SCARD_READERSTATE));
+		VERIFY(nrs_arr != NULL);
+		nrs_arr[0].szReader = CARD_PNP_NOTIFY;
+		nrs_arr[0].dwCurrentState = (nrs > 0) ?
+		    rs[0].dwCurrentState : SCARD_STATE_UNAWARE;
+		for (j = 1, thisrdr = nreaders;
+		    thisrdr != NULL && *thisrdr != 0;
+		    thisrdr += strlen(thisrdr) + 1, ++j) {
+			nrs_arr[j].szReader = thisrdr;
+			nrs_arr[j].dwCurrentState = SCARD_STATE_UNAWARE;
+			for (i = 1; i < nrs; ++i) {
+				if (strcmp(rs[i].szReader, thisrdr) == 0) {
+					nrs_arr[j].dwCurrentState =
+					    rs[i].dwCurrentState;
+					break;
+				}
+			}
+		}
+		/* A reader going away takes its card with it. */
+		for (i = 1; i < nrs; ++i) {
+			if (!(rs[i].dwCurrentState & SCARD_STATE_PRESENT))
+				continue;
+			for (j = 1; j < nnrs; ++j) {
+				if (strcmp(rs[i].szReader,
+				    nrs_arr[j].szReader) == 0)
+					break;
+			}
+			if (j == nnrs)
+				card_watch_send(CARD_EV_REMOVED, rs[i].szReader);
+		}
+		free(rs);
+		free(readers);
+		rs = nrs_arr;
+		nrs = nnrs;
+		readers = nreaders;
+
+		/*
+		 * Wait for something to change. If the PnP pseudo-reader
+		 * isn't supported we have to re-list the readers every so
+		 * often (this doesn't involve talking to any cards).
+		 */
+		if (!pnp) {
+			rs[0].dwCurrentState = SCARD_STATE_IGNORE;
+			if (nrs == 1) {
+				(void) usleep(CARD_POLL_READERS_MS * 1000);
+				continue;
+			}
+		}
+		do {
+			rv = SCardGetStatusChange(wctx,
+			    pnp ? INFINITE : CARD_POLL_READERS_MS, rs, nrs);
+		} while (rv == SCARD_E_TIMEOUT && pnp);
+		if (rv == SCARD_E_TIMEOUT)
+			continue;
+		if (rv == SCARD_E_UNKNOWN_READER) {
+			/*
+			 * Either a reader vanished under us (and we'll see
+			 * that when we re-list) or there's no PnP support.
+			 */
+			pnp = B_FALSE;
+			continue;
+		}
+		if (rv != SCARD_S_SUCCESS)
+			break;
+		if (rs[0].dwEventState & SCARD_STATE_UNKNOWN)
+			pnp = B_FALSE;
+
+		for (i = 1; i < nrs; ++i) {
+			DWORD old = rs[i].dwCurrentState;
+			DWORD new = rs[i].dwEventState;
+			if (!(new & SCARD_STATE_CHANGED))
+				continue;
+			rs[i].dwCurrentState = new & ~SCARD_STATE_CHANGED;
+			if (first && (old == SCARD_STATE_UNAWARE))
+				continue;
+			if ((new & SCARD_STATE_PRESENT) &&
+			    !(old & SCARD_STATE_PRESENT)) {
+				card_watch_send(CARD_EV_INSERTED,
+				    rs[i].szReader);
+			} else if (!(new & SCARD_STATE_PRESENT) &&
+			    (old & SCARD_STATE_PRESENT)) {
+				card_watch_send(CARD_EV_REMOVED,
+				    rs[i].szReader);
+			}
+		}
+		rs[0].dwCurrentState = rs[0].dwEventState &
+		    ~SCARD_STATE_CHANGED;
+		first = B_FALSE;
+	}
+
+	free(rs);
+	free(readers);
+	(void) SCardReleaseContext(wctx);
+	card_watch_send(CARD_EV_FAILED, pcsc_stringify_error(rv));
+	return (NULL);
+}
+
+static void
+card_watch_start(void)
+{
+	pthread_t thr;
+	pthread_attr_t attr;
+	sigset_t set, oset;
+	int r;
+
+	if (pipe(card_watch_fds) != 0) {
+		bunyan_log(BNY_WARN, "failed to create card watcher pipe",
+		    "errno", BNY_INT, errno, NULL);
+		return;
+	}
+	(void) fcntl(card_watch_fds[0], F_SETFL, O_NONBLOCK);
+	(void) fcntl(card_watch_fds[0], F_SETFD, FD_CLOEXEC);
+	(void) fcntl(card_watch_fds[1], F_SETFD, FD_CLOEXEC);
+
+	VERIFY0(pthread_attr_init(&attr));
+	VERIFY0(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED));
+	/* Leave SIGUSR1 and friends for the main thread's poll(). */
+	VERIFY0(sigfillset(&set));
+	VERIFY0(pthread_sigmask(SIG_BLOCK, &set, &oset));
+	r = pthread_create(&thr, &attr, card_watch_thread, NULL);
+	VERIFY0(pthread_sigmask(SIG_SETMASK, &oset, NULL));
+	if (r != 0) {
+		bunyan_log(BNY_WARN, "failed to start card watcher thread",
+		    "errno", BNY_INT, r, NULL);
+		(void) close(card_watch_fds[0]);
+		(void) close(card_watch_fds[1]);
+		card_watch_fds[0] = card_watch_fds[1] = -1;
+	} else {
+		card_watcher = B_TRUE;
+#if defined(AGENT_EPOLL) || defined(AGENT_KQUEUE)
+		ev_add(card_watch_fds[0]);
+#endif
+	}
+	VERIFY0(pthread_attr_destroy(&attr));
+}
+
+static void token_submit_event(struct agent_token *, const struct card_event *);
+
+/* Called on the thread which owns the token (see struct agent_token). */
+static void
+card_token_event(struct agent_token *at, const struct card_event *ev)
+{
+	errf_t *err;
+
+	switch (ev->ce_type) {
+	case CARD_EV_REMOVED:
+		if (at->at_selk == NULL || strcmp(ev->ce_rdrname,
+		    piv_token_rdrname(at->at_selk)) != 0)
+			break;
+		bunyan_log(BNY_INFO, "card removed",
+		    "reader", BNY_STRING, ev->ce_rdrname, NULL);
+		if (at->at_txnopen)
+			agent_piv_close(at, B_TRUE);
+		drop_pin(at);
+		at->at_selk = NULL;
+		break;
+	case CARD_EV_INSERTED:
+		if (at->at_selk != NULL)
+			break;
+		bunyan_log(BNY_INFO, "card inserted",
+		    "reader", BNY_STRING, ev->ce_rdrname, NULL);
+		at->at_last_op = monotime();
+		if ((err = agent_piv_open(at))) {
+			bunyan_log(BNY_DEBUG, "failed to open inserted card",
+			    "error", BNY_ERF, err, NULL);
+			errf_free(err);
+			break;
+		}
+		agent_piv_close(at, B_FALSE);
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+card_watch_event(const struct card_event *ev)
+{
+	uint i;
+
+	switch (ev->ce_type) {
+	case CARD_EV_REMOVED:
+	case CARD_EV_INSERTED:
+		for (i = 0; i < ntokens; ++i)
+			token_submit_event(&tokens[i], ev);
+		break;
+	case CARD_EV_FAILED:
+		bunyan_log(BNY_WARN, "card watcher stopped, falling back to "
+		    "polling the card", "error", BNY_STRING, ev->ce_rdrname,
+		    NULL);
+		card_watcher = B_FALSE;
+#if defined(AGENT_EPOLL) || defined(AGENT_KQUEUE)
+		ev_del(card_watch_fds[0], B_FALSE);
+#endif
+		(void) close(card_watch_fds[0]);
+		card_watch_fds[0] = -1;
+		break;
+	}
+}
+
+static void
+card_watch_read(void)
+{
+	ssize_t n;
+	size_t off;
+
+	while (card_watch_fds[0] != -1) {
+		n = read(card_watch_fds[0], card_watch_buf + card_watch_len,
+		    sizeof (card_watch_buf) - card_watch_len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		card_watch_len += n;
+		for (off = 0; off + sizeof (struct card_event) <=
+		    card_watch_len; off += sizeof (struct card_event)) {
+			struct card_event ev;
+			bcopy(card_watch_buf + off, &ev, sizeof (ev));
+			ev.ce_rdrname[sizeof (ev.ce_rdrname) - 1] = '\0';
+			card_watch_event(&ev);
+			if (card_watch_fds[0] == -1)
+				return;
+		}
+		card_watch_len -= off;
+		bcopy(card_watch_buf + off, card_watch_buf, card_watch_len);
+	}
+}
+
+static errf_t *
+wrap_pin_error(struct agent_token *at, errf_t *err, int retries)
+{
+	if (errf_caused_by(err, "PermissionError")) {
+		if (retries == 0) {
+			err = errf("TokenLocked", err,
+			    "PIV token is locked due to too many "
+			    "invalid PIN code attempts");
+		} else {
+			err = errf("InvalidPIN", err,
+			    "Invalid PIN code supplied (%d attempts "
+			    "remaining)", retries);
+			drop_pin(at);
+		}
+	} else if (errf_caused_by(err, "MinRetriesError")) {
+		err = errf("TokenLocked", err,
+		    "Refusing to use up the last PIN code attempt: "
+		    "unlock the token with another tool to clear "
+		    "the counter");
+		drop_pin(at);
+	}
+	return (err);
+}
+
+static const char *askpass = NULL;
+static const char *confirm = NULL;
+static const char *notify = NULL;
+
+static void
+try_askpass(struct agent_token *at)
+{
+	int p[2], status;
+	pid_t kid, ret;
+	size_t len;
+	errf_t *err;
+	uint retries = 1;
+	char prompt[64], buf[1024];
+	char *guid = piv_token_shortid(at->at_selk);
+	enum piv_pin auth = piv_token_default_auth(at->at_selk);
+	snprintf(prompt, 64, "Enter %s for token %s",
+	    pin_type_to_name(auth), guid);
+
+	if (askpass == NULL)
+		askpass = getenv("SSH_ASKPASS");
+	if (askpass == NULL)
+		return;
+
+	if (pipe(p) == -1)
+		return;
+	if ((kid = fork()) == -1)
+		return;
+	if (kid == 0) {
+		close(p[0]);
+		if (dup2(p[1], STDOUT_FILENO) == -1)
+			exit(1);
+		execlp(askpass, askpass, prompt, (char *)NULL);
+		exit(1);
+	}
+	close(p[1]);
+
+	len = 0;
+	do {
+		ssize_t r = read(p[0], buf + len, sizeof(buf) - 1 - len);
 
 		if (r == -1 && errno == EINTR)
 			continue;
@@ -635,25 +1547,25 @@ try_askpass(void)
 		errf_free(err);
 		goto out;
 	}
-	if ((err = agent_piv_open())) {
+	if ((err = agent_piv_open(at))) {
 		errf_free(err);
 		goto out;
 	}
-	err = piv_verify_pin(selk, auth, buf, &retries, B_FALSE);
+	err = piv_verify_pin(at->at_selk, auth, buf, &retries, B_FALSE);
 	if (err != ERRF_OK) {
-		err = wrap_pin_error(err, retries);
+		err = wrap_pin_error(at, err, retries);
 		bunyan_log(BNY_WARN, "failed to use PIN provided by askpass",
 		    "error", BNY_ERF, err, NULL);
 		errf_free(err);
 		goto out;
 	}
-	agent_piv_close(B_FALSE);
-	if (pin_len != 0)
-		explicit_bzero(pin, pin_len);
-	pin_len = strlen(buf);
-	bcopy(buf, pin, pin_len);
+	agent_piv_close(at, B_FALSE);
+	if (at->at_pin_len != 0)
+		explicit_bzero(at->at_pin, at->at_pin_len);
+	at->at_pin_len = strlen(buf);
+	bcopy(buf, at->at_pin, at->at_pin_len);
 	bunyan_log(BNY_INFO, "storing PIN in memory", NULL);
-	card_probe_interval = card_probe_interval_pin;
+	at->at_probe_interval = card_probe_interval_pin;
 
 out:
 	explicit_bzero(buf, sizeof(buf));
@@ -662,6 +1574,7 @@ out:
 static void
 send_touch_notify(socket_entry_t *e, enum piv_slotid slotid)
 {
+	struct agent_token *at = e->se_tok;
 	int status;
 	pid_t kid, ret;
 	char msg[1024];
@@ -673,7 +1586,7 @@ send_touch_notify(socket_entry_t *e, enum piv_slotid slotid)
 	if (notify == NULL)
 		return;
 
-	guid = piv_token_shortid(selk);
+	guid = piv_token_shortid(at->at_selk);
 	snprintf(title, sizeof (title),
 	    "pivy-agent for token %s", guid);
 	snprintf(msg, sizeof (msg),
@@ -706,6 +1619,7 @@ send_touch_notify(socket_entry_t *e, enum piv_slotid slotid)
 static void
 try_confirm_client(socket_entry_t *e, enum piv_slotid slotid)
 {
+	struct agent_token *at = e->se_tok;
 	int status;
 	pid_t kid, ret;
 	boolean_t add_zenity_args = B_FALSE;
@@ -753,7 +1667,7 @@ try_confirm_client(socket_entry_t *e, enum piv_slotid slotid)
 		free(tmp);
 	}
 
-	guid = piv_token_shortid(selk);
+	guid = piv_token_shortid(at->at_selk);
 	snprintf(prompt, sizeof (prompt),
 	    "%sA new client is trying to use PIV token %s\n\n"
 	    "Client PID: %d\nClient executable: %s\nClient cmd: %s\n"
@@ -807,16 +1721,17 @@ try_confirm_client(socket_entry_t *e, enum piv_slotid slotid)
 }
 
 static errf_t *
-agent_piv_try_pin(boolean_t canskip)
+agent_piv_try_pin(struct agent_token *at, boolean_t canskip)
 {
 	errf_t *err = NULL;
 	uint retries = 1;
-	if (pin_len == 0 && !canskip)
-		try_askpass();
-	if (pin_len != 0) {
-		err = piv_verify_pin(selk, piv_token_default_auth(selk),
-		    pin, &retries, canskip);
-		err = wrap_pin_error(err, retries);
+	if (at->at_pin_len == 0 && !canskip)
+		try_askpass(at);
+	if (at->at_pin_len != 0) {
+		err = piv_verify_pin(at->at_selk,
+		    piv_token_default_auth(at->at_selk),
+		    at->at_pin, &retries, canskip);
+		err = wrap_pin_error(at, err, retries);
 	}
 	return (err);
 }
@@ -900,72 +1815,234 @@ get_pid_start_time(pid_t pid)
 	return (val);
 }
 
-static struct pid_entry *
-find_or_make_pid_entry(pid_t pid, uint64_t start_time)
+static void
+get_pid_exe(pid_t pid, char **exepath, char **exeargs)
 {
-	uint i;
-	uint64_t now = monotime();
-	uint npids_alloc;
-
-	for (i = 0; i < pids_alloc; ++i) {
-		if (pids[i].pe_valid && pids[i].pe_pid == pid &&
-		    pids[i].pe_start_time == start_time) {
-			pids[i].pe_time = now;
-			return (&pids[i]);
-		}
-		if (pids[i].pe_valid && pids[i].pe_pid == pid) {
-			pids[i].pe_time = now;
-			pids[i].pe_start_time = start_time;
-			pids[i].pe_conn_count = 0;
-			pids[i].pe_last_auth = 0;
-			return (&pids[i]);
-		}
-		if (pids[i].pe_valid) {
-			uint64_t delta = now - pids[i].pe_time;
-			if (delta > 30000) {
-				uint64_t nstart;
-				nstart = get_pid_start_time(pids[i].pe_pid);
-				if (nstart == 0 ||
-				    nstart != pids[i].pe_start_time) {
-					pids[i].pe_valid = B_FALSE;
+#if defined(__sun)
+	struct psinfo *psinfo;
+	FILE *f;
+	char fn[128];
+
+	psinfo = calloc(1, sizeof (struct psinfo));
+	snprintf(fn, sizeof (fn), "/proc/%d/psinfo", (int)pid);
+	f = fopen(fn, "r");
+	if (f != NULL) {
+		if (fread(psinfo, sizeof (struct psinfo), 1, f) == 1) {
+			*exepath = strndup(psinfo->pr_fname,
+			    sizeof (psinfo->pr_fname));
+			*exeargs = strndup(psinfo->pr_psargs,
+			    sizeof (psinfo->pr_psargs));
+		}
+		fclose(f);
+	}
+	free(psinfo);
+#elif defined(__APPLE__)
+	char pathBuf[PROC_PIDPATHINFO_MAXSIZE];
+	int rc;
+
+	if (pid == 0)
+		return;
+	rc = proc_pidpath(pid, pathBuf, sizeof (pathBuf));
+	if (rc > 0)
+		*exepath = strdup(pathBuf);
+#elif defined(__linux__)
+	char fn[128], ln[1024];
+	ssize_t len;
+	size_t i;
+	FILE *f;
+
+	snprintf(fn, sizeof (fn), "/proc/%d/exe", (int)pid);
+	len = readlink(fn, ln, sizeof (ln));
+	if (len > 0 && len < sizeof (ln))
+		*exepath = strndup(ln, len);
+	snprintf(fn, sizeof (fn), "/proc/%d/cmdline", (int)pid);
+	if ((f = fopen(fn, "r")) == NULL)
+		return;
+	len = fread(ln, 1, sizeof (ln) - 1, f);
+	fclose(f);
+	for (i = 0; i < len; ++i) {
+		if (ln[i] == '\0')
+			ln[i] = ' ';
+	}
+	*exeargs = strndup(ln, len);
+#endif
+}
+
+static uint
+pid_hash_idx(pid_t pid, uid_t uid)
+{
+	uint64_t h = ((uint64_t)(uint)pid << 32) | (uint)uid;
+
+	h *= 0x9E3779B97F4A7C15ULL;
+	return ((uint)(h >> 56) % PID_HASH_SIZE);
+}
+
+static void
+pid_entry_free(pid_entry_t *pe)
+{
+	free(pe->pe_exepath);
+	free(pe->pe_exeargs);
+	free(pe);
+}
+
+/*
+ * Drop idle entries: ones past PID_CACHE_TTL, and then (if there are still
+ * too many) any of them at all.
+ */
+static void
+pid_cache_trim(uint64_t now)
+{
+	pid_entry_t **pp, *pe;
+	uint i, pass;
+
+	for (pass = 0; pass < 2; ++pass) {
+		if (pass == 1 && pids_idle <= PID_CACHE_MAX)
+			break;
+		for (i = 0; i < PID_HASH_SIZE; ++i) {
+			pp = &pid_hash[i];
+			while ((pe = *pp) != NULL) {
+				if (pe->pe_refs > 0 || (pass == 0 &&
+				    (now - pe->pe_time) < PID_CACHE_TTL) ||
+				    (pass == 1 && pids_idle <= PID_CACHE_MAX)) {
+					pp = &pe->pe_next;
+					continue;
 				}
+				*pp = pe->pe_next;
+				--pids_idle;
+				pid_entry_free(pe);
 			}
 		}
 	}
+}
 
-	for (i = 0; i < pids_alloc; ++i) {
-		if (!pids[i].pe_valid)
-			goto newpid;
+static void
+pid_entry_unlink(pid_entry_t *pe)
+{
+	pid_entry_t **pp;
+
+	pp = &pid_hash[pid_hash_idx(pe->pe_pid, pe->pe_uid)];
+	while (*pp != pe)
+		pp = &(*pp)->pe_next;
+	*pp = pe->pe_next;
+	pe->pe_next = NULL;
+	pe->pe_valid = B_FALSE;
+	if (pe->pe_refs == 0) {
+		--pids_idle;
+		pid_entry_free(pe);
 	}
+}
+
+static boolean_t
+strsame(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return (a == b);
+	return (strcmp(a, b) == 0);
+}
+
+/*
+ * Find (or make) the entry for a newly connected client, and take a hold on
+ * it for the connection. The returned entry's pe_exepath and pe_exeargs
+ * belong to it.
+ */
+static pid_entry_t *
+find_or_make_pid_entry(pid_t pid, uid_t uid)
+{
+	pid_entry_t *pe, *next;
+	uint64_t now = monotime();
+	uint64_t start_time = 0;
+	boolean_t checked = B_FALSE;
+	char *exepath = NULL, *exeargs = NULL;
+	uint idx;
+
+	pid_cache_trim(now);
+
+	get_pid_exe(pid, &exepath, &exeargs);
+
+	idx = pid_hash_idx(pid, uid);
+	for (pe = pid_hash[idx]; pe != NULL; pe = next) {
+		next = pe->pe_next;
+		if (pe->pe_pid != pid || pe->pe_uid != uid)
+			continue;
+		if (!strsame(exepath, pe->pe_exepath) ||
+		    !strsame(exeargs, pe->pe_exeargs)) {
+			/* It's exec'd something else. */
+			pid_entry_unlink(pe);
+			continue;
+		}
+		if (pe->pe_refs == 0 || (now - pe->pe_checked) >=
+		    PID_CACHE_TTL) {
+			if (!checked) {
+				start_time = get_pid_start_time(pid);
+				checked = B_TRUE;
+			}
+			if (start_time == 0 ||
+			    start_time != pe->pe_start_time) {
+				/* Not the same process any more. */
+				pid_entry_unlink(pe);
+				continue;
+			}
+			pe->pe_checked = now;
+		}
+		if (pe->pe_refs++ == 0)
+			--pids_idle;
+		pe->pe_time = now;
+		free(exepath);
+		free(exeargs);
+		return (pe);
+	}
+
+	if (!checked)
+		start_time = get_pid_start_time(pid);
+	pe = calloc(1, sizeof (pid_entry_t));
+	VERIFY(pe != NULL);
+	pe->pe_valid = B_TRUE;
+	pe->pe_pid = pid;
+	pe->pe_uid = uid;
+	pe->pe_start_time = start_time;
+	pe->pe_time = pe->pe_checked = now;
+	pe->pe_refs = 1;
+	pe->pe_exepath = exepath;
+	pe->pe_exeargs = exeargs;
+	pe->pe_next = pid_hash[idx];
+	pid_hash[idx] = pe;
+	return (pe);
+}
 
-	npids_alloc = pids_alloc + 128;
-	pids = reallocarray(pids, npids_alloc, sizeof (pid_entry_t));
-	VERIFY(pids != NULL);
-	for (i = pids_alloc; i < npids_alloc; ++i)
-		pids[i].pe_valid = B_FALSE;
-	i = pids_alloc;
-	pids_alloc = npids_alloc;
-newpid:
-	pids[i].pe_valid = B_TRUE;
-	pids[i].pe_pid = pid;
-	pids[i].pe_start_time = start_time;
-	pids[i].pe_time = now;
-	pids[i].pe_conn_count = 0;
-	pids[i].pe_last_auth = 0;
-	return (&pids[i]);
+static void
+pid_entry_rele(pid_entry_t *pe)
+{
+	VERIFY(pe->pe_refs > 0);
+	pe->pe_time = monotime();
+	if (--pe->pe_refs > 0)
+		return;
+	if (!pe->pe_valid) {
+		/* Already unlinked: the pid now belongs to someone else. */
+		pid_entry_free(pe);
+		return;
+	}
+	++pids_idle;
 }
 
 static void
 close_socket(socket_entry_t *e)
 {
+#if defined(AGENT_EPOLL) || defined(AGENT_KQUEUE)
+	ev_del(e->se_fd, e->se_wantwrite);
+#endif
+	fd_sock_set(e->se_fd, -1);
 	close(e->se_fd);
 	e->se_fd = -1;
 	e->se_type = AUTH_UNUSED;
 	e->se_authz = AUTHZ_NOT_YET;
+	if (e->se_pid_ent != NULL)
+		pid_entry_rele(e->se_pid_ent);
 	e->se_pid_ent = NULL;
+	e->se_busy = B_FALSE;
 	sshbuf_free(e->se_input);
 	sshbuf_free(e->se_output);
 	sshbuf_free(e->se_request);
+	e->se_request = NULL;
 	free(e->se_exepath);
 	free(e->se_exeargs);;
 }
@@ -1105,37 +2182,42 @@ maskout:
 }
 
 /* send list of supported public keys to 'client' */
-static errf_t *
-process_request_identities(socket_entry_t *e)
+static void
+put_identity(struct sshbuf *msg, struct piv_slot *slot)
 {
-	struct sshbuf *msg;
-	struct piv_slot *slot = NULL;
 	char comment[256];
-	uint64_t now;
-	int r, n;
-	errf_t *err = NULL;
+	int r;
 
-	if ((msg = sshbuf_new()) == NULL)
-		fatal("%s: sshbuf_new failed", __func__);
+	comment[0] = 0;
+	snprintf(comment, sizeof (comment), "PIV_slot_%02X %s",
+	    piv_slot_id(slot), piv_slot_subject(slot));
+	if ((r = sshkey_puts(piv_slot_pubkey(slot), msg)) != 0 ||
+	    (r = sshbuf_put_cstring(msg, comment)) != 0) {
+		fatal("%s: put key/comment: %s", __func__, ssh_err(r));
+	}
+}
 
-	if ((err = agent_piv_open()))
-		goto out;
+static boolean_t
+idcache_valid(const struct agent_token *at)
+{
+	return (at->at_idcache != NULL && at->at_selk != NULL &&
+	    at->at_idcache_selk == at->at_selk &&
+	    at->at_idcache_update == at->at_last_update);
+}
 
-	now = monotime();
-	if ((now - last_update) >= card_probe_interval * 1000) {
-		last_update = now;
-		err = piv_read_all_certs(selk);
-		errf_free(err);
-		if (cak != NULL && (err = auth_cak())) {
-			agent_piv_close(B_TRUE);
-			drop_pin();
-			goto out;
-		}
-	}
-	agent_piv_close(B_FALSE);
+static void
+idcache_build(struct agent_token *at)
+{
+	struct sshbuf *msg = at->at_idcache;
+	struct piv_slot *slot = NULL;
+	int r, n;
+
+	if (msg == NULL && (msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	sshbuf_reset(msg);
 
 	n = 0;
-	while ((slot = piv_slot_next(selk, slot)) != NULL) {
+	while ((slot = piv_slot_next(at->at_selk, slot)) != NULL) {
 		if (!is_slot_enabled(slot))
 			continue;
 		++n;
@@ -1145,56 +2227,85 @@ process_request_identities(socket_entry_t *e)
 	    (r = sshbuf_put_u32(msg, n)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 
-	while ((slot = piv_slot_next(selk, slot)) != NULL) {
+	while ((slot = piv_slot_next(at->at_selk, slot)) != NULL) {
 		if (piv_slot_id(slot) == PIV_SLOT_KEY_MGMT)
 			continue;
 		if (!is_slot_enabled(slot))
 			continue;
-		comment[0] = 0;
-		snprintf(comment, sizeof (comment), "PIV_slot_%02X %s",
-		    piv_slot_id(slot), piv_slot_subject(slot));
-		if ((r = sshkey_puts(piv_slot_pubkey(slot), msg)) != 0 ||
-		    (r = sshbuf_put_cstring(msg, comment)) != 0) {
-			fatal("%s: put key/comment: %s", __func__,
-			    ssh_err(r));
-		}
+		put_identity(msg, slot);
 	}
 	/*
 	 * Always put key mgmt last so that SSH clients not aware of the fact
 	 * that this slot is not used for signing by default will be unlikely
 	 * to try using it.
 	 */
-	if ((slot = piv_get_slot(selk, PIV_SLOT_KEY_MGMT)) != NULL &&
+	if ((slot = piv_get_slot(at->at_selk, PIV_SLOT_KEY_MGMT)) != NULL &&
 	    is_slot_enabled(slot)) {
-		comment[0] = 0;
-		snprintf(comment, sizeof (comment), "PIV_slot_%02X %s",
-		    piv_slot_id(slot), piv_slot_subject(slot));
-		if ((r = sshkey_puts(piv_slot_pubkey(slot), msg)) != 0 ||
-		    (r = sshbuf_put_cstring(msg, comment)) != 0) {
-			fatal("%s: put key/comment: %s", __func__,
-			    ssh_err(r));
-		}
+		put_identity(msg, slot);
 	}
-	if ((r = sshbuf_put_stringb(e->se_output, msg)) != 0)
+
+	at->at_idcache = msg;
+	at->at_idcache_selk = at->at_selk;
+	at->at_idcache_update = at->at_last_update;
+}
+
+static errf_t *
+process_request_identities(socket_entry_t *e)
+{
+	struct agent_token *at = e->se_tok;
+	uint64_t now;
+	int r;
+	errf_t *err = NULL;
+
+	/*
+	 * Clients ask for this on every connection, so unless it's time to
+	 * probe the card again (or we haven't found it yet) we answer from
+	 * what we already know without touching it.
+	 */
+	now = monotime();
+	if (at->at_selk == NULL ||
+	    (now - at->at_last_update) >= at->at_probe_interval * 1000) {
+		if ((err = agent_piv_open(at)))
+			return (err);
+		now = monotime();
+		if ((now - at->at_last_update) >=
+		    at->at_probe_interval * 1000) {
+			at->at_last_update = now;
+			err = agent_read_certs(at);
+			errf_free(err);
+			if ((err = agent_check_cak(at))) {
+				agent_piv_close(at, B_TRUE);
+				drop_pin(at);
+				return (err);
+			}
+		}
+		agent_piv_close(at, B_FALSE);
+	}
+
+	if (idcache_valid(at)) {
+		stat_inc(&agent_stats.as_ident_cached);
+	} else {
+		stat_inc(&agent_stats.as_ident_rebuild);
+		idcache_build(at);
+	}
+
+	if ((r = sshbuf_put_stringb(e->se_output, at->at_idcache)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 
-out:
-	sshbuf_free(msg);
-	return (err);
+	return (ERRF_OK);
 }
 
 /* ssh2 only */
 static errf_t *
 process_sign_request2(socket_entry_t *e)
 {
+	struct agent_token *at = e->se_tok;
 	const u_char *data;
-	u_char *signature = NULL;
 	u_char *rawsig = NULL;
-	size_t dlen, rslen = 0, slen = 0;
+	size_t dlen, rslen = 0;
 	u_int flags;
 	int r;
 	errf_t *err = NULL;
-	struct sshbuf *msg;
 	struct sshbuf *buf;
 	struct sshkey *key = NULL;
 	struct piv_slot *slot = NULL;
@@ -1203,8 +2314,6 @@ process_sign_request2(socket_entry_t *e)
 	boolean_t canskip = B_TRUE;
 	enum piv_slot_auth rauth;
 
-	if ((msg = sshbuf_new()) == NULL)
-		fatal("%s: sshbuf_new failed", __func__);
 	if ((r = sshkey_froms(e->se_request, &key)) != 0 ||
 	    (r = sshbuf_get_string_direct(e->se_request, &data, &dlen)) != 0 ||
 	    (r = sshbuf_get_u32(e->se_request, &flags)) != 0) {
@@ -1212,21 +2321,21 @@ process_sign_request2(socket_entry_t *e)
 		goto out;
 	}
 
-	if ((err = agent_piv_open()))
+	if ((err = agent_piv_open(at)))
 		goto out;
 
-	while ((slot = piv_slot_next(selk, slot)) != NULL) {
+	while ((slot = piv_slot_next(at->at_selk, slot)) != NULL) {
 		if (sshkey_equal(piv_slot_pubkey(slot), key)) {
 			found = 1;
 			break;
 		}
 	}
 	if (!found || slot == NULL || !is_slot_enabled(slot)) {
-		agent_piv_close(B_FALSE);
+		agent_piv_close(at, B_FALSE);
 		err = errf("NotFoundError", NULL, "specified key not found");
 		goto out;
 	}
-	bunyan_add_vars(msg_log_frame,
+	bunyan_add_vars(e->se_log_frame,
 	    "slotid", BNY_UINT, (uint)piv_slot_id(slot), NULL);
 
 	try_confirm_client(e, piv_slot_id(slot));
@@ -1241,15 +2350,15 @@ process_sign_request2(socket_entry_t *e)
 		goto out;
 	}
 
-	rauth = piv_slot_get_auth(selk, slot);
+	rauth = piv_slot_get_auth(at->at_selk, slot);
 	if (rauth & PIV_SLOT_AUTH_PIN)
 		canskip = B_FALSE;
 	if (rauth & PIV_SLOT_AUTH_TOUCH)
 		send_touch_notify(e, piv_slot_id(slot));
 
 pin_again:
-	if ((err = agent_piv_try_pin(canskip))) {
-		agent_piv_close(B_TRUE);
+	if ((err = agent_piv_try_pin(at, canskip))) {
+		agent_piv_close(at, B_TRUE);
 		goto out;
 	}
 	if (key->type == KEY_RSA) {
@@ -1274,10 +2383,11 @@ pin_again:
 		}
 	}
 	ohashalg = hashalg;
-	err = piv_sign(selk, slot, data, dlen, &hashalg, &rawsig, &rslen);
+	err = piv_sign(at->at_selk, slot, data, dlen, &hashalg, &rawsig,
+	    &rslen);
 
-	if (errf_caused_by(err, "PermissionError") && pin_len != 0 &&
-	    piv_token_is_ykpiv(selk) && canskip) {
+	if (errf_caused_by(err, "PermissionError") && at->at_pin_len != 0 &&
+	    piv_token_is_ykpiv(at->at_selk) && canskip) {
 		/*
 		 * On a Yubikey, slots other than 9C (SIGNATURE) can also be
 		 * set to "PIN Always" mode. We might have one, so try again
@@ -1286,19 +2396,19 @@ pin_again:
 		canskip = B_FALSE;
 		goto pin_again;
 	} else if (errf_caused_by(err, "PermissionError")) {
-		try_askpass();
-		if (pin_len != 0) {
+		try_askpass(at);
+		if (at->at_pin_len != 0) {
 			canskip = B_FALSE;
 			goto pin_again;
 		}
-		agent_piv_close(B_TRUE);
+		agent_piv_close(at, B_TRUE);
 		err = nopinerrf(err);
 		goto out;
 	} else if (err) {
-		agent_piv_close(B_TRUE);
+		agent_piv_close(at, B_TRUE);
 		goto out;
 	}
-	agent_piv_close(B_FALSE);
+	agent_piv_close(at, B_FALSE);
 
 	if (hashalg != ohashalg) {
 		err = errf("HashMismatch", NULL,
@@ -1315,29 +2425,23 @@ pin_again:
 	explicit_bzero(rawsig, rslen);
 	free(rawsig);
 
-	signature = calloc(1, sshbuf_len(buf));
-	slen = sshbuf_len(buf);
-	VERIFY0(sshbuf_get(buf, signature, slen));
-	sshbuf_free(buf);
-
-	if ((r = sshbuf_put_u8(msg, SSH2_AGENT_SIGN_RESPONSE)) != 0 ||
-	    (r = sshbuf_put_string(msg, signature, slen)) != 0)
-		fatal("%s: buffer error: %s", __func__, ssh_err(r));
-	if ((r = sshbuf_put_stringb(e->se_output, msg)) != 0)
+	/* Frame the reply straight into se_output around the signature. */
+	if ((r = sshbuf_put_u32(e->se_output, 1 + 4 + sshbuf_len(buf))) != 0 ||
+	    (r = sshbuf_put_u8(e->se_output, SSH2_AGENT_SIGN_RESPONSE)) != 0 ||
+	    (r = sshbuf_put_stringb(e->se_output, buf)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	sshbuf_free(buf);
 
 out:
 	sshkey_free(key);
-	sshbuf_free(msg);
-	explicit_bzero(signature, slen);
-	free(signature);
 	return (err);
 }
 
 static errf_t *
 process_remove_all_identities(socket_entry_t *e)
 {
-	drop_pin();
+	struct agent_token *at = e->se_tok;
+	drop_pin(at);
 	send_status(e, 1);
 	return (NULL);
 }
@@ -1351,6 +2455,7 @@ struct exthandler exthandlers[];
 static errf_t *
 process_ext_ecdh(socket_entry_t *e, struct sshbuf *buf)
 {
+	struct agent_token *at = e->se_tok;
 	int r;
 	errf_t *err;
 	struct sshbuf *msg;
@@ -1381,21 +2486,21 @@ process_ext_ecdh(socket_entry_t *e, struct sshbuf *buf)
 		goto out;
 	}
 
-	if ((err = agent_piv_open()))
+	if ((err = agent_piv_open(at)))
 		goto out;
 
-	while ((slot = piv_slot_next(selk, slot)) != NULL) {
+	while ((slot = piv_slot_next(at->at_selk, slot)) != NULL) {
 		if (sshkey_equal(piv_slot_pubkey(slot), key) == 1) {
 			found = 1;
 			break;
 		}
 	}
 	if (!found || !is_slot_enabled(slot)) {
-		agent_piv_close(B_FALSE);
+		agent_piv_close(at, B_FALSE);
 		err = errf("NotFoundError", NULL, "specified key not found");
 		goto out;
 	}
-	bunyan_add_vars(msg_log_frame,
+	bunyan_add_vars(e->se_log_frame,
 	    "slotid", BNY_UINT, (uint)piv_slot_id(slot), NULL);
 
 	try_confirm_client(e, piv_slot_id(slot));
@@ -1405,44 +2510,44 @@ process_ext_ecdh(socket_entry_t *e, struct sshbuf *buf)
 	}
 
 	if (key->type != KEY_ECDSA || partner->type != KEY_ECDSA) {
-		agent_piv_close(B_FALSE);
+		agent_piv_close(at, B_FALSE);
 		err = errf("InvalidKeysError", NULL,
 		    "keys are not both EC keys (%s and %s)",
 		    sshkey_type(key), sshkey_type(partner));
 		goto out;
 	}
 
-	rauth = piv_slot_get_auth(selk, slot);
+	rauth = piv_slot_get_auth(at->at_selk, slot);
 	if (rauth & PIV_SLOT_AUTH_PIN)
 		canskip = B_FALSE;
 	if (rauth & PIV_SLOT_AUTH_TOUCH)
 		send_touch_notify(e, piv_slot_id(slot));
 
 pin_again:
-	if ((err = agent_piv_try_pin(canskip))) {
-		agent_piv_close(B_TRUE);
+	if ((err = agent_piv_try_pin(at, canskip))) {
+		agent_piv_close(at, B_TRUE);
 		goto out;
 	}
-	err = piv_ecdh(selk, slot, partner, &secret, &seclen);
-	if (errf_caused_by(err, "PermissionError") && pin_len != 0 &&
-	    piv_token_is_ykpiv(selk) && canskip) {
+	err = piv_ecdh(at->at_selk, slot, partner, &secret, &seclen);
+	if (errf_caused_by(err, "PermissionError") && at->at_pin_len != 0 &&
+	    piv_token_is_ykpiv(at->at_selk) && canskip) {
 		/* Yubikey can have slots other than 9C as "PIN Always" */
 		canskip = B_FALSE;
 		goto pin_again;
 	} else if (errf_caused_by(err, "PermissionError")) {
-		try_askpass();
-		if (pin_len != 0) {
+		try_askpass(at);
+		if (at->at_pin_len != 0) {
 			canskip = B_FALSE;
 			goto pin_again;
 		}
-		agent_piv_close(B_TRUE);
+		agent_piv_close(at, B_TRUE);
 		err = nopinerrf(err);
 		goto out;
 	} else if (err) {
-		agent_piv_close(B_TRUE);
+		agent_piv_close(at, B_TRUE);
 		goto out;
 	}
-	agent_piv_close(B_FALSE);
+	agent_piv_close(at, B_FALSE);
 
 	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
 	    (r = sshbuf_put_string(msg, secret, seclen)) != 0)
@@ -1460,14 +2565,44 @@ out:
 	return (err);
 }
 
+/*
+ * Seals "secret" into a new box for "partner", carrying over the GUID and
+ * slot hint the client gave us (if any).
+ */
+static errf_t *
+rebox_seal(const uint8_t *secret, size_t seclen, const struct sshbuf *guidb,
+    uint8_t slotid, struct sshkey *partner, uint8_t **out, size_t *outlen)
+{
+	struct piv_ecdh_box *newbox;
+	errf_t *err;
+
+	newbox = piv_box_new();
+	VERIFY(newbox != NULL);
+
+	if (sshbuf_len(guidb) > 0) {
+		piv_box_set_guid(newbox, sshbuf_ptr(guidb), GUID_LEN);
+		piv_box_set_slot(newbox, slotid);
+	}
+	VERIFY0(piv_box_set_data(newbox, secret, seclen));
+	if ((err = piv_box_seal_offline(partner, newbox))) {
+		piv_box_free(newbox);
+		return (err);
+	}
+
+	VERIFY0(piv_box_to_binary(newbox, out, outlen));
+	piv_box_free(newbox);
+	return (ERRF_OK);
+}
+
 static errf_t *
 process_ext_rebox(socket_entry_t *e, struct sshbuf *buf)
 {
+	struct agent_token *at = e->se_tok;
 	int r;
 	errf_t *err;
 	struct sshbuf *msg, *boxbuf = NULL, *guidb = NULL;
 	struct sshkey *partner = NULL;
-	struct piv_ecdh_box *box = NULL, *newbox = NULL;
+	struct piv_ecdh_box *box = NULL;
 	uint8_t slotid;
 	uint flags;
 	struct piv_slot *slot;
@@ -1512,10 +2647,10 @@ process_ext_rebox(socket_entry_t *e, struct sshbuf *buf)
 	if (err)
 		goto out;
 
-	err = piv_box_find_token(selk, box, &tk, &slot);
+	err = piv_box_find_token(at->at_selk, box, &tk, &slot);
 	if (err)
 		goto out;
-	if (tk != selk) {
+	if (tk != at->at_selk) {
 		err = errf("WrongTokenError", NULL, "box can only be unlocked "
 		    "by a different PIV device");
 		goto out;
@@ -1532,16 +2667,16 @@ process_ext_rebox(socket_entry_t *e, struct sshbuf *buf)
 	if (rauth & PIV_SLOT_AUTH_TOUCH)
 		send_touch_notify(e, piv_slot_id(slot));
 
-	if ((err = agent_piv_open()))
+	if ((err = agent_piv_open(at)))
 		goto out;
 pin_again:
-	if ((err = agent_piv_try_pin(canskip))) {
-		agent_piv_close(B_TRUE);
+	if ((err = agent_piv_try_pin(at, canskip))) {
+		agent_piv_close(at, B_TRUE);
 		goto out;
 	}
-	err = piv_box_open(selk, slot, box);
-	if (errf_caused_by(err, "PermissionError") && pin_len != 0 &&
-	    piv_token_is_ykpiv(selk) && canskip) {
+	err = piv_box_open(at->at_selk, slot, box);
+	if (errf_caused_by(err, "PermissionError") && at->at_pin_len != 0 &&
+	    piv_token_is_ykpiv(at->at_selk) && canskip) {
 		/*
 		 * On a Yubikey, slots other than 9C (SIGNATURE) can also be
 		 * set to "PIN Always" mode. We might have one, so try again
@@ -1550,36 +2685,26 @@ pin_again:
 		canskip = B_FALSE;
 		goto pin_again;
 	} else if (errf_caused_by(err, "PermissionError")) {
-		try_askpass();
-		if (pin_len != 0) {
+		try_askpass(at);
+		if (at->at_pin_len != 0) {
 			canskip = B_FALSE;
 			goto pin_again;
 		}
-		agent_piv_close(B_TRUE);
+		agent_piv_close(at, B_TRUE);
 		err = nopinerrf(err);
 		goto out;
 	} else if (err) {
-		agent_piv_close(B_TRUE);
+		agent_piv_close(at, B_TRUE);
 		goto out;
 	}
 
 	VERIFY0(piv_box_take_data(box, &secret, &seclen));
-	agent_piv_close(B_FALSE);
-
+	agent_piv_close(at, B_FALSE);
 
-	newbox = piv_box_new();
-	VERIFY(newbox != NULL);
-
-	if (sshbuf_len(guidb) > 0) {
-		piv_box_set_guid(newbox, sshbuf_ptr(guidb), GUID_LEN);
-		piv_box_set_slot(newbox, slotid);
-	}
-	VERIFY0(piv_box_set_data(newbox, secret, seclen));
-	if ((err = piv_box_seal_offline(partner, newbox)))
+	err = rebox_seal(secret, seclen, guidb, slotid, partner, &out, &outlen);
+	if (err)
 		goto out;
 
-	VERIFY0(piv_box_to_binary(newbox, &out, &outlen));
-
 	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
 	    (r = sshbuf_put_string(msg, out, outlen)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
@@ -1589,7 +2714,6 @@ pin_again:
 
 out:
 	piv_box_free(box);
-	piv_box_free(newbox);
 	if (secret != NULL) {
 		explicit_bzero(secret, seclen);
 		free(secret);
@@ -1605,6 +2729,218 @@ out:
 	return (err);
 }
 
+struct rebox_ent {
+	struct sshbuf		*re_guidb;
+	uint8_t			 re_slotid;
+	struct piv_ecdh_box	*re_box;
+	struct piv_slot		*re_slot;
+	uint8_t			*re_secret;
+	size_t			 re_seclen;
+};
+
+/*
+ * The batched form of ecdh-rebox@joyent.com: a list of boxes, all to be
+ * re-sealed to the same partner key, which we open in one card transaction
+ * with (at most) one PIN check. Someone unlocking a lot of eboxes over a
+ * forwarded agent then pays for one round-trip rather than one per box.
+ *
+ *   string partner, uint32 flags, uint32 nboxes,
+ *   nboxes * { string box, string guid, byte slotid }
+ *
+ * The reply has one string per box, in order: the new box, or an empty
+ * string if that one couldn't be opened here (e.g. it belongs to another
+ * token). Errors that affect every box (no PIN, client not allowed) fail
+ * the whole request instead.
+ */
+static errf_t *
+process_ext_rebox_batch(socket_entry_t *e, struct sshbuf *buf)
+{
+	struct agent_token *at = e->se_tok;
+	int r;
+	errf_t *err = NULL, *berr;
+	struct sshbuf *msg, *boxbuf = NULL;
+	struct sshkey *partner = NULL;
+	struct rebox_ent *ents = NULL, *ent;
+	struct piv_token *tk;
+	struct piv_key_index *keyidx = NULL;
+	struct piv_slot *touched = NULL;
+	uint flags, nents = 0, i;
+	uint8_t *out = NULL;
+	size_t outlen;
+	boolean_t canskip, pinned = B_FALSE, force = B_FALSE;
+	enum piv_slot_auth rauth;
+
+	if ((msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshkey_froms(buf, &partner)) != 0) {
+		err = parserrf("sshkey_froms(partner)", r);
+		goto out;
+	}
+	if ((r = sshbuf_get_u32(buf, &flags)) != 0 ||
+	    (r = sshbuf_get_u32(buf, &nents)) != 0) {
+		err = parserrf("sshbuf_get_u32", r);
+		nents = 0;
+		goto out;
+	}
+	if (flags != 0) {
+		err = flagserrf(flags);
+		nents = 0;
+		goto out;
+	}
+	if (nents == 0 || nents > REBOX_BATCH_MAX) {
+		err = errf("ArgumentError", NULL, "batch of %u boxes is not "
+		    "allowed (max %u)", nents, REBOX_BATCH_MAX);
+		nents = 0;
+		goto out;
+	}
+
+	ents = calloc(nents, sizeof (struct rebox_ent));
+	if (ents == NULL)
+		fatal("%s: calloc failed", __func__);
+	for (i = 0; i < nents; ++i) {
+		ent = &ents[i];
+		sshbuf_free(boxbuf);
+		boxbuf = NULL;
+		if ((r = sshbuf_froms(buf, &boxbuf)) != 0 ||
+		    (r = sshbuf_froms(buf, &ent->re_guidb)) != 0) {
+			err = parserrf("sshbuf_froms", r);
+			goto out;
+		}
+		if ((r = sshbuf_get_u8(buf, &ent->re_slotid)) != 0) {
+			err = parserrf("sshbuf_get_u8(slotid)", r);
+			goto out;
+		}
+		if ((err = sshbuf_get_piv_box(boxbuf, &ent->re_box)))
+			goto out;
+	}
+	bunyan_add_vars(e->se_log_frame,
+	    "nboxes", BNY_UINT, nents, NULL);
+
+	try_confirm_client(e, PIV_SLOT_KEY_MGMT);
+	if (e->se_authz == AUTHZ_DENIED) {
+		err = errf("AuthzError", NULL, "client blocked");
+		goto out;
+	}
+
+	if ((err = piv_key_index_new(at->at_selk, &keyidx)))
+		goto out;
+	for (i = 0; i < nents; ++i) {
+		ent = &ents[i];
+		berr = piv_box_find_token_index(keyidx, ent->re_box, &tk,
+		    &ent->re_slot);
+		if (berr == ERRF_OK && tk != at->at_selk) {
+			berr = errf("WrongTokenError", NULL, "box can only be "
+			    "unlocked by a different PIV device");
+		} else if (berr == ERRF_OK && !is_slot_enabled(ent->re_slot)) {
+			berr = errf("KeyDisabledError", NULL, "box can only be "
+			    "unlocked by a disabled key slot");
+		}
+		if (berr) {
+			bunyan_log(BNY_DEBUG, "skipping box in batch",
+			    "index", BNY_UINT, i, "error", BNY_ERF, berr,
+			    NULL);
+			errf_free(berr);
+			ent->re_slot = NULL;
+		}
+	}
+
+	if ((err = agent_piv_open(at)))
+		goto out;
+	for (i = 0; i < nents; ++i) {
+		ent = &ents[i];
+		if (ent->re_slot == NULL)
+			continue;
+
+		canskip = B_TRUE;
+		rauth = piv_slot_get_auth(at->at_selk, ent->re_slot);
+		if (rauth & PIV_SLOT_AUTH_PIN)
+			canskip = B_FALSE;
+		if ((rauth & PIV_SLOT_AUTH_TOUCH) && ent->re_slot != touched) {
+			send_touch_notify(e, piv_slot_id(ent->re_slot));
+			touched = ent->re_slot;
+		}
+
+pin_again:
+		if (!pinned || !canskip) {
+			if ((err = agent_piv_try_pin(at, canskip))) {
+				agent_piv_close(at, B_TRUE);
+				goto out;
+			}
+			pinned = B_TRUE;
+		}
+		berr = piv_box_open(at->at_selk, ent->re_slot, ent->re_box);
+		if (errf_caused_by(berr, "PermissionError") &&
+		    at->at_pin_len != 0 && piv_token_is_ykpiv(at->at_selk) &&
+		    canskip) {
+			/* See process_ext_rebox() about "PIN Always". */
+			errf_free(berr);
+			canskip = B_FALSE;
+			goto pin_again;
+		} else if (errf_caused_by(berr, "PermissionError")) {
+			try_askpass(at);
+			if (at->at_pin_len != 0) {
+				errf_free(berr);
+				canskip = B_FALSE;
+				goto pin_again;
+			}
+			agent_piv_close(at, B_TRUE);
+			err = nopinerrf(berr);
+			goto out;
+		} else if (berr) {
+			bunyan_log(BNY_WARN, "failed to open box in batch",
+			    "index", BNY_UINT, i, "error", BNY_ERF, berr,
+			    NULL);
+			errf_free(berr);
+			force = B_TRUE;
+			continue;
+		}
+		VERIFY0(piv_box_take_data(ent->re_box, &ent->re_secret,
+		    &ent->re_seclen));
+	}
+	agent_piv_close(at, force);
+
+	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	for (i = 0; i < nents; ++i) {
+		ent = &ents[i];
+		if (ent->re_secret == NULL) {
+			/* An empty string. */
+			if ((r = sshbuf_put_u32(msg, 0)) != 0)
+				fatal("%s: buffer error: %s", __func__,
+				    ssh_err(r));
+			continue;
+		}
+		if ((err = rebox_seal(ent->re_secret, ent->re_seclen,
+		    ent->re_guidb, ent->re_slotid, partner, &out, &outlen)))
+			goto out;
+		if ((r = sshbuf_put_string(msg, out, outlen)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		explicit_bzero(out, outlen);
+		free(out);
+		out = NULL;
+	}
+
+	if ((r = sshbuf_put_stringb(e->se_output, msg)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+out:
+	for (i = 0; i < nents; ++i) {
+		ent = &ents[i];
+		piv_box_free(ent->re_box);
+		sshbuf_free(ent->re_guidb);
+		if (ent->re_secret != NULL) {
+			explicit_bzero(ent->re_secret, ent->re_seclen);
+			free(ent->re_secret);
+		}
+	}
+	free(ents);
+	piv_key_index_free(keyidx);
+	sshbuf_free(msg);
+	sshbuf_free(boxbuf);
+	sshkey_free(partner);
+	return (err);
+}
+
 static errf_t *
 process_ext_x509_certs(socket_entry_t *e, struct sshbuf *buf)
 {
@@ -1617,6 +2953,7 @@ process_ext_x509_certs(socket_entry_t *e, struct sshbuf *buf)
 static errf_t *
 process_ext_attest(socket_entry_t *e, struct sshbuf *buf)
 {
+	struct agent_token *at = e->se_tok;
 	int r;
 	errf_t *err;
 	struct sshbuf *msg;
@@ -1642,34 +2979,35 @@ process_ext_attest(socket_entry_t *e, struct sshbuf *buf)
 		goto out;
 	}
 
-	if ((err = agent_piv_open()))
+	if ((err = agent_piv_open(at)))
 		goto out;
 
-	while ((slot = piv_slot_next(selk, slot)) != NULL) {
+	while ((slot = piv_slot_next(at->at_selk, slot)) != NULL) {
 		if (sshkey_equal(piv_slot_pubkey(slot), key)) {
 			found = 1;
 			break;
 		}
 	}
 	if (!found || !is_slot_enabled(slot)) {
-		agent_piv_close(B_FALSE);
+		agent_piv_close(at, B_FALSE);
 		err = errf("NotFoundError", NULL, "specified key not found");
 		goto out;
 	}
-	bunyan_add_vars(msg_log_frame,
+	bunyan_add_vars(e->se_log_frame,
 	    "slotid", BNY_UINT, (uint)piv_slot_id(slot), NULL);
 
-	err = ykpiv_attest(selk, slot, &cert, &certlen);
+	err = ykpiv_attest(at->at_selk, slot, &cert, &certlen);
 	if (err) {
-		agent_piv_close(B_TRUE);
+		agent_piv_close(at, B_TRUE);
 		goto out;
 	}
-	err = piv_read_file(selk, PIV_TAG_CERT_YK_ATTESTATION, &chain, &chainlen);
+	err = piv_read_file(at->at_selk, PIV_TAG_CERT_YK_ATTESTATION, &chain,
+	    &chainlen);
 	if (err) {
-		agent_piv_close(B_TRUE);
+		agent_piv_close(at, B_TRUE);
 		goto out;
 	}
-	agent_piv_close(B_FALSE);
+	agent_piv_close(at, B_FALSE);
 
 	tlv = tlv_init(chain, 0, chainlen);
 	if ((err = tlv_read_tag(tlv, &tag)))
@@ -1732,10 +3070,288 @@ process_ext_query(socket_entry_t *e, struct sshbuf *buf)
 	return (NULL);
 }
 
+static void
+apdu_observe(uint8_t ins, const char *ins_name, uint16_t sw, uint64_t usec)
+{
+	struct apdu_lat *al = &apdu_lat[ins];
+	size_t i;
+
+	for (i = 0; i < APDU_LAT_NBOUNDS; ++i) {
+		if (usec <= apdu_lat_bounds[i])
+			break;
+	}
+	VERIFY0(pthread_mutex_lock(&apdu_lat_mtx));
+	al->al_name = ins_name;
+	++al->al_count;
+	al->al_sum += usec;
+	++al->al_buckets[i];
+	VERIFY0(pthread_mutex_unlock(&apdu_lat_mtx));
+}
+
+enum stat_kind {
+	STAT_COUNTER = 0,
+	STAT_GAUGE = 1
+};
+
+static void
+put_stat(struct sshbuf *buf, uint *n, const char *name, enum stat_kind kind,
+    uint64_t val)
+{
+	int r;
+	++(*n);
+	if ((r = sshbuf_put_cstring(buf, name)) != 0 ||
+	    (r = sshbuf_put_u8(buf, kind)) != 0 ||
+	    (r = sshbuf_put_u64(buf, val)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+}
+
+/*
+ * Reply format:
+ *   u8		SSH_AGENT_SUCCESS
+ *   u32	number of stats, then per stat:
+ *		  cstring name, u8 kind (enum stat_kind), u64 value
+ *   u32	number of latency bucket bounds, then each as u64 usec
+ *   u32	number of instructions, then per instruction:
+ *		  u8 ins, cstring name, u64 count, u64 sum of usec,
+ *		  u64 bucket counts (one more than the number of bounds,
+ *		  not cumulative)
+ */
+static errf_t *
+process_ext_stats(socket_entry_t *e, struct sshbuf *buf)
+{
+	int r;
+	uint i, j, n = 0, nstats = 0;
+	struct sshbuf *msg, *sbuf;
+	struct apdu_lat *lat;
+	struct agent_stats sas;
+	struct txn_hold_stats sths;
+	const struct agent_stats *as = &sas;
+	const struct txn_hold_stats *ths = &sths;
+	struct agent_token *at;
+	uint64_t hold_avg = 0, ntxnopen = 0, npin = 0;
+	uint64_t ephem_hits, ephem_misses;
+
+	if ((msg = sshbuf_new()) == NULL || (sbuf = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+
+	VERIFY0(pthread_mutex_lock(&stats_mtx));
+	sas = agent_stats;
+	sths = txn_hold_stats;
+	VERIFY0(pthread_mutex_unlock(&stats_mtx));
+	piv_ephem_pool_stats(&ephem_hits, &ephem_misses);
+
+	/*
+	 * The gauges are summed over all our tokens (and the hold average is
+	 * the longest of theirs). Token workers publish theirs under at_mtx.
+	 */
+	for (i = 0; i < ntokens; ++i) {
+		at = &tokens[i];
+		VERIFY0(pthread_mutex_lock(&at->at_mtx));
+		hold_avg = MAXIMUM(hold_avg, at->at_pub_hold_avg);
+		if (at->at_pub_txnopen)
+			++ntxnopen;
+		if (at->at_pub_havepin)
+			++npin;
+		VERIFY0(pthread_mutex_unlock(&at->at_mtx));
+	}
+
+	put_stat(sbuf, &nstats, "sign_requests", STAT_COUNTER, as->as_sign);
+	put_stat(sbuf, &nstats, "sign_failures", STAT_COUNTER,
+	    as->as_sign_fail);
+	put_stat(sbuf, &nstats, "ecdh_requests", STAT_COUNTER, as->as_ecdh);
+	put_stat(sbuf, &nstats, "ecdh_failures", STAT_COUNTER,
+	    as->as_ecdh_fail);
+	put_stat(sbuf, &nstats, "rebox_requests", STAT_COUNTER, as->as_rebox);
+	put_stat(sbuf, &nstats, "rebox_failures", STAT_COUNTER,
+	    as->as_rebox_fail);
+	put_stat(sbuf, &nstats, "txn_opened", STAT_COUNTER, as->as_txn_open);
+	put_stat(sbuf, &nstats, "txn_reused", STAT_COUNTER, as->as_txn_reuse);
+	put_stat(sbuf, &nstats, "reconnects", STAT_COUNTER, as->as_reconnect);
+	put_stat(sbuf, &nstats, "reconnects_direct", STAT_COUNTER,
+	    as->as_reconnect_direct);
+	put_stat(sbuf, &nstats, "piv_find_calls", STAT_COUNTER,
+	    as->as_piv_find);
+	put_stat(sbuf, &nstats, "probes", STAT_COUNTER, as->as_probe);
+	put_stat(sbuf, &nstats, "probe_failures", STAT_COUNTER,
+	    as->as_probe_fail);
+	put_stat(sbuf, &nstats, "cak_checks", STAT_COUNTER, as->as_cak_run);
+	put_stat(sbuf, &nstats, "cak_checks_skipped", STAT_COUNTER,
+	    as->as_cak_skip);
+	put_stat(sbuf, &nstats, "cak_failures", STAT_COUNTER,
+	    as->as_cak_fail);
+	put_stat(sbuf, &nstats, "identities_cached", STAT_COUNTER,
+	    as->as_ident_cached);
+	put_stat(sbuf, &nstats, "identities_rebuilt", STAT_COUNTER,
+	    as->as_ident_rebuild);
+	put_stat(sbuf, &nstats, "identities_coalesced", STAT_COUNTER,
+	    as->as_ident_coalesced);
+	put_stat(sbuf, &nstats, "txn_hold_decisions", STAT_COUNTER,
+	    ths->ths_decisions);
+	put_stat(sbuf, &nstats, "txn_hold_clamped_min", STAT_COUNTER,
+	    ths->ths_clamped_min);
+	put_stat(sbuf, &nstats, "txn_hold_clamped_max", STAT_COUNTER,
+	    ths->ths_clamped_max);
+	put_stat(sbuf, &nstats, "txn_hold_idle_gaps", STAT_COUNTER,
+	    ths->ths_idle_gaps);
+	put_stat(sbuf, &nstats, "txn_hold_last_ms", STAT_GAUGE,
+	    ths->ths_last_hold);
+	put_stat(sbuf, &nstats, "txn_hold_avg_gap_ms", STAT_GAUGE, hold_avg);
+	put_stat(sbuf, &nstats, "ephem_pool_hits", STAT_COUNTER, ephem_hits);
+	put_stat(sbuf, &nstats, "ephem_pool_misses", STAT_COUNTER,
+	    ephem_misses);
+	put_stat(sbuf, &nstats, "txn_open", STAT_GAUGE, ntxnopen);
+	put_stat(sbuf, &nstats, "pin_cached", STAT_GAUGE, npin);
+	put_stat(sbuf, &nstats, "tokens", STAT_GAUGE, ntokens);
+
+	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
+	    (r = sshbuf_put_u32(msg, nstats)) != 0 ||
+	    (r = sshbuf_putb(msg, sbuf)) != 0 ||
+	    (r = sshbuf_put_u32(msg, APDU_LAT_NBOUNDS)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	for (i = 0; i < APDU_LAT_NBOUNDS; ++i) {
+		if ((r = sshbuf_put_u64(msg, apdu_lat_bounds[i])) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	}
+
+	VERIFY0(pthread_mutex_lock(&apdu_lat_mtx));
+	for (i = 0; i < 256; ++i) {
+		if (apdu_lat[i].al_count > 0)
+			++n;
+	}
+	if ((r = sshbuf_put_u32(msg, n)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	for (i = 0; i < 256; ++i) {
+		lat = &apdu_lat[i];
+		if (lat->al_count == 0)
+			continue;
+		if ((r = sshbuf_put_u8(msg, i)) != 0 ||
+		    (r = sshbuf_put_cstring(msg, lat->al_name)) != 0 ||
+		    (r = sshbuf_put_u64(msg, lat->al_count)) != 0 ||
+		    (r = sshbuf_put_u64(msg, lat->al_sum)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		for (j = 0; j <= APDU_LAT_NBOUNDS; ++j) {
+			r = sshbuf_put_u64(msg, lat->al_buckets[j]);
+			if (r != 0) {
+				fatal("%s: buffer error: %s", __func__,
+				    ssh_err(r));
+			}
+		}
+	}
+	VERIFY0(pthread_mutex_unlock(&apdu_lat_mtx));
+
+	if ((r = sshbuf_put_stringb(e->se_output, msg)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	sshbuf_free(sbuf);
+	sshbuf_free(msg);
+
+	return (NULL);
+}
+
+/*
+ * Reply format:
+ *   u8		SSH_AGENT_SUCCESS
+ *   u32	number of records, then per record (oldest first):
+ *		  u64 seq, u64 time (usec since epoch), u32 duration (usec),
+ *		  u32 lc, u32 le, u32 reply length, u16 sw,
+ *		  u8 cla, u8 ins, u8 p1, u8 p2, u8 flags (piv_apdu_rec_flags),
+ *		  string first bytes of command data
+ */
+static errf_t *
+process_ext_apdu_log(socket_entry_t *e, struct sshbuf *buf)
+{
+	struct piv_apdu_rec *recs;
+	struct piv_apdu_rec *rec;
+	struct sshbuf *msg;
+	size_t n, i;
+	int r;
+
+	recs = calloc(PIV_APDU_REC_COUNT, sizeof (struct piv_apdu_rec));
+	if ((msg = sshbuf_new()) == NULL || recs == NULL)
+		fatal("%s: allocation failed", __func__);
+	n = piv_apdu_rec_dump(recs, PIV_APDU_REC_COUNT);
+
+	if ((r = sshbuf_put_u8(msg, SSH_AGENT_SUCCESS)) != 0 ||
+	    (r = sshbuf_put_u32(msg, n)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	for (i = 0; i < n; ++i) {
+		rec = &recs[i];
+		if ((r = sshbuf_put_u64(msg, rec->par_seq)) != 0 ||
+		    (r = sshbuf_put_u64(msg, rec->par_time)) != 0 ||
+		    (r = sshbuf_put_u32(msg, rec->par_usec)) != 0 ||
+		    (r = sshbuf_put_u32(msg, rec->par_lc)) != 0 ||
+		    (r = sshbuf_put_u32(msg, rec->par_le)) != 0 ||
+		    (r = sshbuf_put_u32(msg, rec->par_lr)) != 0 ||
+		    (r = sshbuf_put_u16(msg, rec->par_sw)) != 0 ||
+		    (r = sshbuf_put_u8(msg, rec->par_cls)) != 0 ||
+		    (r = sshbuf_put_u8(msg, rec->par_ins)) != 0 ||
+		    (r = sshbuf_put_u8(msg, rec->par_p1)) != 0 ||
+		    (r = sshbuf_put_u8(msg, rec->par_p2)) != 0 ||
+		    (r = sshbuf_put_u8(msg, rec->par_flags)) != 0 ||
+		    (r = sshbuf_put_string(msg, rec->par_data,
+		    rec->par_datalen)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	}
+
+	if ((r = sshbuf_put_stringb(e->se_output, msg)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	sshbuf_free(msg);
+	free(recs);
+
+	return (NULL);
+}
+
+/*
+ * On SIGUSR1 we write the APDU flight recorder out to the log (from the main
+ * loop, not the signal handler).
+ */
+static volatile sig_atomic_t apdu_log_wanted = 0;
+
+static void
+apdu_log_handler(int sig)
+{
+	apdu_log_wanted = 1;
+}
+
+static void
+apdu_log_dump(void)
+{
+	struct piv_apdu_rec *recs, *rec;
+	size_t n, i;
+
+	apdu_log_wanted = 0;
+	recs = calloc(PIV_APDU_REC_COUNT, sizeof (struct piv_apdu_rec));
+	VERIFY(recs != NULL);
+	n = piv_apdu_rec_dump(recs, PIV_APDU_REC_COUNT);
+	bunyan_log(BNY_WARN, "dumping APDU flight recorder",
+	    "count", BNY_SIZE_T, n, NULL);
+	for (i = 0; i < n; ++i) {
+		rec = &recs[i];
+		bunyan_log(BNY_WARN, "APDU record",
+		    "seq", BNY_UINT64, rec->par_seq,
+		    "time_us", BNY_UINT64, rec->par_time,
+		    "dur_us", BNY_UINT, (uint)rec->par_usec,
+		    "ins", BNY_UINT, (uint)rec->par_ins,
+		    "ins_name", BNY_STRING, piv_ins_name(rec->par_ins),
+		    "p1", BNY_UINT, (uint)rec->par_p1,
+		    "p2", BNY_UINT, (uint)rec->par_p2,
+		    "lc", BNY_UINT, (uint)rec->par_lc,
+		    "le", BNY_UINT, (uint)rec->par_le,
+		    "lr", BNY_UINT, (uint)rec->par_lr,
+		    "sw", BNY_UINT, (uint)rec->par_sw,
+		    "flags", BNY_UINT, (uint)rec->par_flags,
+		    "data", BNY_BIN_HEX, rec->par_data,
+		    (size_t)rec->par_datalen, NULL);
+	}
+	free(recs);
+}
+
 struct exthandler exthandlers[] = {
 	{ "query", process_ext_query },
+	{ "stats@joyent.com", process_ext_stats },
+	{ "apdu-log@joyent.com", process_ext_apdu_log },
 	{ "ecdh@joyent.com", process_ext_ecdh },
 	{ "ecdh-rebox@joyent.com", process_ext_rebox },
+	{ "ecdh-rebox-batch@joyent.com", process_ext_rebox_batch },
 	{ "x509-certs@joyent.com", process_ext_x509_certs },
 	{ "ykpiv-attest@joyent.com", process_ext_attest },
 	{ NULL, NULL }
@@ -1773,10 +3389,21 @@ process_extension(socket_entry_t *e)
 		goto out;
 	}
 
-	bunyan_add_vars(msg_log_frame,
+	bunyan_add_vars(e->se_log_frame,
 	    "extension", BNY_STRING, h->eh_name, NULL);
 	err = hdlr->eh_handler(e, inner);
 
+	if (hdlr->eh_handler == process_ext_ecdh) {
+		stat_inc(&agent_stats.as_ecdh);
+		if (err)
+			stat_inc(&agent_stats.as_ecdh_fail);
+	} else if (hdlr->eh_handler == process_ext_rebox ||
+	    hdlr->eh_handler == process_ext_rebox_batch) {
+		stat_inc(&agent_stats.as_rebox);
+		if (err)
+			stat_inc(&agent_stats.as_rebox_fail);
+	}
+
 	if (err) {
 		send_extfail(e);
 		bunyan_log(BNY_WARN, "failed to process extension command",
@@ -1798,6 +3425,7 @@ out:
 static errf_t *
 process_lock_agent(socket_entry_t *e, int lock)
 {
+	struct agent_token *at = e->se_tok;
 	int r;
 	char *passwd;
 	size_t pwlen;
@@ -1814,32 +3442,41 @@ process_lock_agent(socket_entry_t *e, int lock)
 	VERIFY(passwd != NULL);
 
 	if (lock) {
-		drop_pin();
+		drop_pin(at);
 		send_status(e, 1);
 	} else {
-		if ((err = valid_pin(passwd)))
+		/*
+		 * Once we get as far as asking a card (or the passphrase
+		 * can't be a PIN at all), trying other tokens won't help:
+		 * see unlock_continue().
+		 */
+		if ((err = valid_pin(passwd))) {
+			e->se_pin_checked = B_TRUE;
 			goto out;
+		}
 
-		if ((err = agent_piv_open()))
+		if ((err = agent_piv_open(at)))
 			goto out;
 
-		err = piv_verify_pin(selk, piv_token_default_auth(selk),
+		e->se_pin_checked = B_TRUE;
+		err = piv_verify_pin(at->at_selk,
+		    piv_token_default_auth(at->at_selk),
 		    passwd, &retries, B_FALSE);
 
 		if (err == ERRF_OK) {
-			agent_piv_close(B_FALSE);
-			if (pin_len != 0)
-				explicit_bzero(pin, pin_len);
-			pin_len = pwlen;
-			bcopy(passwd, pin, pwlen + 1);
+			agent_piv_close(at, B_FALSE);
+			if (at->at_pin_len != 0)
+				explicit_bzero(at->at_pin, at->at_pin_len);
+			at->at_pin_len = pwlen;
+			bcopy(passwd, at->at_pin, pwlen + 1);
 			send_status(e, 1);
 			bunyan_log(BNY_INFO, "storing PIN in memory", NULL);
-			card_probe_interval = card_probe_interval_pin;
+			at->at_probe_interval = card_probe_interval_pin;
 			goto out;
 		}
-		agent_piv_close(B_TRUE);
+		agent_piv_close(at, B_TRUE);
 
-		err = wrap_pin_error(err, retries);
+		err = wrap_pin_error(at, err, retries);
 	}
 out:
 	explicit_bzero(passwd, pwlen);
@@ -1876,6 +3513,990 @@ msg_type_to_name(int msg)
 	}
 }
 
+/*
+ * Run one ssh-agent message that's sitting in e->se_request. This happens
+ * on the main thread, or on a token worker (with e a private copy of the
+ * connection made by job_new()).
+ */
+static void
+run_message(socket_entry_t *e, u_char type)
+{
+	errf_t *err;
+
+	e->se_log_frame = bunyan_push(
+	    "fd", BNY_INT, e->se_fd,
+	    "msg_type", BNY_INT, (int)type,
+	    "msg_type_name", BNY_STRING, msg_type_to_name(type),
+	    "remote_pid", BNY_INT, (int)e->se_pid,
+	    "remote_cmd", BNY_STRING,
+	    (e->se_exepath == NULL) ? "???" : e->se_exepath,
+	    NULL);
+	if (e->se_tok != NULL && ntokens > 1) {
+		bunyan_add_vars(e->se_log_frame,
+		    "token", BNY_UINT, e->se_tok->at_idx, NULL);
+	}
+	bunyan_log(BNY_DEBUG, "received ssh-agent message", NULL);
+	PIVY_PROBE4(agent__msg__start, e->se_fd, type, e->se_pid,
+	    e->se_exepath);
+
+	if (e->se_tok != NULL)
+		e->se_tok->at_last_op = monotime();
+
+	switch (type) {
+	case SSH_AGENTC_LOCK:
+	case SSH_AGENTC_UNLOCK:
+		err = process_lock_agent(e, type == SSH_AGENTC_LOCK);
+		break;
+	/* ssh2 */
+	case SSH2_AGENTC_SIGN_REQUEST:
+		err = process_sign_request2(e);
+		stat_inc(&agent_stats.as_sign);
+		if (err)
+			stat_inc(&agent_stats.as_sign_fail);
+		break;
+	case SSH2_AGENTC_REQUEST_IDENTITIES:
+		err = process_request_identities(e);
+		break;
+	case SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
+		err = process_remove_all_identities(e);
+		break;
+	case SSH2_AGENTC_EXTENSION:
+		err = process_extension(e);
+		break;
+	default:
+		/* Unknown message.  Respond with failure. */
+		err = errf("UnknownMessageError", NULL,
+		    "unknown/unsupported agent protocol message %d", type);
+		break;
+	}
+
+	if (err) {
+		bunyan_log(BNY_WARN, "failed to process command",
+		    "error", BNY_ERF, err, NULL);
+		if (errf_caused_by(err, "NoPINError") &&
+		    bunyan_get_level() > BNY_WARN) {
+			warnfx(err, "denied command due to lack of PIN");
+		}
+		sshbuf_reset(e->se_request);
+		send_status(e, 0);
+		errf_free(err);
+	} else {
+		bunyan_log(BNY_INFO, "processed ssh-agent message", NULL);
+	}
+	PIVY_PROBE3(agent__msg__done, e->se_fd, type, err == ERRF_OK);
+
+	bunyan_pop(e->se_log_frame);
+	e->se_log_frame = NULL;
+}
+
+/*
+ * Token workers.
+ *
+ * The main thread only reads and parses requests, so a slow card operation
+ * (or one waiting on a touch) never holds up other clients. Anything which
+ * needs a card is handed to the worker for the token which has the key in
+ * question as an agent_job, with a private copy of the connection to work
+ * on. The worker runs it with run_message() and puts the finished job on
+ * jobs_done (poking jobs_fds[1]) so the main thread can copy the answer back
+ * out.
+ *
+ * While a connection has a job out, it's marked se_busy and we don't look at
+ * any further requests on it, so answers still go out in order.
+ *
+ * Requests that aren't about one particular key (listing identities, lock,
+ * unlock and remove-all) go to every worker, and the main thread merges the
+ * answers in an agent_fanout once they've all come back. Identity requests
+ * can usually skip the workers entirely: see cached_identities(). Unlock
+ * goes to one token first, and only to the rest once that one has accepted
+ * the PIN: see unlock_continue().
+ */
+enum agent_job_type {
+	JOB_MESSAGE,
+	JOB_CARD_EVENT
+};
+
+/* Another connection waiting on the answer to someone else's fan-out. */
+struct fanout_waiter {
+	struct fanout_waiter *fw_next;
+	u_int fw_socknum;
+	uint64_t fw_gen;
+};
+
+struct agent_fanout {
+	u_char af_type;
+	uint af_pending;
+	uint af_ok;
+	uint af_nkeys;
+	struct sshbuf *af_keys;
+	struct fanout_waiter *af_waiters;
+
+	/*
+	 * Unlock only: our own copy of the request, and the next token to
+	 * try while we're still looking for one to check the PIN.
+	 */
+	struct sshbuf *af_request;
+	boolean_t af_probing;
+	uint af_next;
+};
+
+/*
+ * The identities fan-out currently out with the workers, if any. Listing
+ * identities doesn't change anything, so any more requests for it that
+ * arrive before the answer comes back just wait for the same one instead
+ * of sending every worker (and card) another round trip each.
+ */
+static struct agent_fanout *ident_fanout = NULL;
+
+struct agent_job {
+	struct agent_job *aj_next;
+	enum agent_job_type aj_type;
+	struct agent_token *aj_tok;
+
+	/* JOB_MESSAGE */
+	u_int aj_socknum;
+	uint64_t aj_gen;
+	u_char aj_msgtype;
+	socket_entry_t aj_e;
+	pid_entry_t aj_pid;
+	struct agent_fanout *aj_fanout;
+
+	/* JOB_CARD_EVENT */
+	struct card_event aj_ev;
+};
+
+static pthread_mutex_t jobs_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct agent_job *jobs_done = NULL;
+static int jobs_fds[2] = { -1, -1 };
+
+static struct agent_job *
+job_new(u_int socknum, struct agent_token *at, u_char type,
+    struct sshbuf *req)
+{
+	socket_entry_t *e = &sockets[socknum];
+	struct agent_job *job;
+
+	job = calloc(1, sizeof (struct agent_job));
+	VERIFY(job != NULL);
+	job->aj_type = JOB_MESSAGE;
+	job->aj_tok = at;
+	job->aj_socknum = socknum;
+	job->aj_gen = e->se_gen;
+	job->aj_msgtype = type;
+
+	job->aj_e = *e;
+	job->aj_e.se_tok = at;
+	job->aj_e.se_input = NULL;
+	job->aj_e.se_log_frame = NULL;
+	job->aj_e.se_pin_checked = B_FALSE;
+	if (e->se_exepath != NULL)
+		VERIFY((job->aj_e.se_exepath = strdup(e->se_exepath)) != NULL);
+	if (e->se_exeargs != NULL)
+		VERIFY((job->aj_e.se_exeargs = strdup(e->se_exeargs)) != NULL);
+	/*
+	 * The worker gets a view of the request rather than its own copy.
+	 * Only this thread ever touches the refcounts (job_free() runs here
+	 * too), and nothing writes to se_input while it has children.
+	 */
+	if ((job->aj_e.se_request = sshbuf_fromb(req)) == NULL ||
+	    (job->aj_e.se_output = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if (e->se_pid_ent != NULL) {
+		job->aj_pid = *e->se_pid_ent;
+		job->aj_e.se_pid_ent = &job->aj_pid;
+	}
+
+	return (job);
+}
+
+static void
+job_free(struct agent_job *job)
+{
+	if (job == NULL)
+		return;
+	if (job->aj_type == JOB_MESSAGE) {
+		free(job->aj_e.se_exepath);
+		free(job->aj_e.se_exeargs);
+		sshbuf_free(job->aj_e.se_request);
+		sshbuf_free(job->aj_e.se_output);
+	}
+	free(job);
+}
+
+static void
+token_submit(struct agent_token *at, struct agent_job *job)
+{
+	VERIFY0(pthread_mutex_lock(&at->at_mtx));
+	if (at->at_jobs_tail == NULL)
+		at->at_jobs = job;
+	else
+		at->at_jobs_tail->aj_next = job;
+	at->at_jobs_tail = job;
+	VERIFY0(pthread_cond_signal(&at->at_cv));
+	VERIFY0(pthread_mutex_unlock(&at->at_mtx));
+}
+
+static void
+token_submit_event(struct agent_token *at, const struct card_event *ev)
+{
+	struct agent_job *job;
+
+	job = calloc(1, sizeof (struct agent_job));
+	VERIFY(job != NULL);
+	job->aj_type = JOB_CARD_EVENT;
+	job->aj_tok = at;
+	job->aj_ev = *ev;
+	token_submit(at, job);
+}
+
+/*
+ * Update the copy of this token's public keys (and the bits of state the
+ * stats extension reports) that the main thread reads.
+ */
+static void
+token_publish(struct agent_token *at)
+{
+	struct piv_slot *slot = NULL;
+	struct sshkey **keys = NULL, **okeys;
+	struct sshbuf *ids = NULL, *oids = NULL;
+	uint nkeys = 0, onkeys, i;
+	boolean_t rekey;
+	int r;
+
+	rekey = (at->at_selk != at->at_keys_selk ||
+	    at->at_last_update != at->at_keys_update);
+	if (rekey && at->at_selk != NULL) {
+		while ((slot = piv_slot_next(at->at_selk, slot)) != NULL)
+			++nkeys;
+		keys = calloc(nkeys + 1, sizeof (struct sshkey *));
+		VERIFY(keys != NULL);
+		nkeys = 0;
+		while ((slot = piv_slot_next(at->at_selk, slot)) != NULL) {
+			if (piv_slot_pubkey(slot) == NULL)
+				continue;
+			VERIFY0(sshkey_demote(piv_slot_pubkey(slot),
+			    &keys[nkeys]));
+			++nkeys;
+		}
+	}
+	at->at_keys_selk = at->at_selk;
+	at->at_keys_update = at->at_last_update;
+
+	if (at->at_selk != NULL && !idcache_valid(at)) {
+		stat_inc(&agent_stats.as_ident_rebuild);
+		idcache_build(at);
+	}
+	if (idcache_valid(at) && (rekey || at->at_pub_ids == NULL)) {
+		if ((ids = sshbuf_new()) == NULL)
+			fatal("%s: sshbuf_new failed", __func__);
+		if ((r = sshbuf_putb(ids, at->at_idcache)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	}
+
+	VERIFY0(pthread_mutex_lock(&at->at_mtx));
+	okeys = at->at_keys;
+	onkeys = at->at_nkeys;
+	/*
+	 * If the card has gone away we keep routing to it: the worker will
+	 * try to find it again and give a sensible error if it can't.
+	 */
+	if (rekey && at->at_selk != NULL) {
+		at->at_keys = keys;
+		at->at_nkeys = nkeys;
+	} else {
+		okeys = NULL;
+	}
+	at->at_pub_txnopen = at->at_txnopen;
+	at->at_pub_havepin = (at->at_pin_len != 0);
+	at->at_pub_hold_avg = at->at_hold_avg;
+	if (ids != NULL) {
+		oids = at->at_pub_ids;
+		at->at_pub_ids = ids;
+		at->at_pub_ids_update = at->at_last_update;
+	}
+	at->at_pub_busy = B_FALSE;
+	VERIFY0(pthread_mutex_unlock(&at->at_mtx));
+	sshbuf_free(oids);
+
+	if (okeys != NULL) {
+		for (i = 0; i < onkeys; ++i)
+			sshkey_free(okeys[i]);
+		free(okeys);
+	}
+}
+
+/*
+ * Absolute time (in monotime() ms) at which this token next needs attention
+ * from its timers (closing the held transaction, or an idle probe), or 0.
+ */
+static uint64_t
+token_deadline(struct agent_token *at)
+{
+	uint64_t deadline = 0, probe;
+
+	if (at->at_txnopen)
+		deadline = at->at_txntimeout;
+	if (!card_watcher && at->at_probe_interval != 0) {
+		probe = at->at_last_op + at->at_probe_interval * 1000;
+		deadline = (deadline == 0) ? probe : MINIMUM(deadline, probe);
+	}
+	if (at->at_lazy_pending && at->at_selk != NULL) {
+		probe = at->at_last_op + LAZY_IDLE_MS;
+		deadline = (deadline == 0) ? probe : MINIMUM(deadline, probe);
+	}
+	return (deadline);
+}
+
+static void
+token_timers(struct agent_token *at)
+{
+	uint64_t now = monotime();
+
+	if (!card_watcher && at->at_probe_interval != 0 &&
+	    (now - at->at_last_op) >= at->at_probe_interval * 1000) {
+		probe_card(at);
+	}
+	if (at->at_txnopen && now >= at->at_txntimeout)
+		agent_piv_close(at, B_TRUE);
+}
+
+/*
+ * With -l, reads the retired slots agent_read_certs() skipped, one at a time
+ * while no requests are waiting. Once they're all done we bump
+ * at_last_update, which makes token_publish() rebuild the identities answer
+ * and the keys we route by.
+ */
+static void
+token_lazy_load(struct agent_token *at)
+{
+	errf_t *err;
+	boolean_t busy = B_FALSE;
+	uint slotid;
+
+	if (!at->at_lazy_pending || at->at_selk == NULL)
+		return;
+	if (monotime() - at->at_last_op < LAZY_IDLE_MS)
+		return;
+
+	if ((err = agent_piv_open(at))) {
+		bunyan_log(BNY_DEBUG, "failed to open card for lazy slot load",
+		    "error", BNY_ERF, err, NULL);
+		errf_free(err);
+		/* We start again from scratch when the card is found. */
+		at->at_lazy_pending = B_FALSE;
+		return;
+	}
+
+	while (at->at_lazy_pending && !busy) {
+		slotid = PIV_SLOT_RETIRED_1 + at->at_lazy_next++;
+		err = piv_read_cert(at->at_selk, slotid);
+		if (err && !errf_caused_by(err, "NotFoundError") &&
+		    !errf_caused_by(err, "PermissionError") &&
+		    !errf_caused_by(err, "NotSupportedError") &&
+		    !errf_caused_by(err, "APDUError")) {
+			bunyan_log(BNY_WARN, "lazy slot load failed",
+			    "slot", BNY_UINT, slotid,
+			    "error", BNY_ERF, err, NULL);
+			errf_free(err);
+			agent_piv_close(at, B_TRUE);
+			at->at_lazy_pending = B_FALSE;
+			return;
+		}
+		errf_free(err);
+		if (at->at_lazy_next >=
+		    piv_token_keyhistory_oncard(at->at_selk)) {
+			at->at_lazy_pending = B_FALSE;
+			at->at_last_update = monotime();
+			bunyan_log(BNY_DEBUG, "lazy slot load done",
+			    "nslots", BNY_UINT, at->at_lazy_next, NULL);
+		}
+
+		VERIFY0(pthread_mutex_lock(&at->at_mtx));
+		busy = (at->at_jobs != NULL);
+		VERIFY0(pthread_mutex_unlock(&at->at_mtx));
+	}
+
+	agent_piv_close(at, B_FALSE);
+}
+
+/*
+ * Tops up the pool of ephemeral keys that rebox seals with (see
+ * piv_ephem_take()), a key at a time while nothing else is waiting for this
+ * worker, so that requests don't have to sit through a key generation.
+ */
+static void
+token_ephem_refill(struct agent_token *at)
+{
+	boolean_t busy = B_FALSE;
+
+	while (!busy && piv_ephem_pool_refill()) {
+		VERIFY0(pthread_mutex_lock(&at->at_mtx));
+		busy = (at->at_jobs != NULL);
+		VERIFY0(pthread_mutex_unlock(&at->at_mtx));
+	}
+}
+
+static void
+job_done(struct agent_job *job)
+{
+	const char c = 'J';
+
+	VERIFY0(pthread_mutex_lock(&jobs_mtx));
+	job->aj_next = jobs_done;
+	jobs_done = job;
+	VERIFY0(pthread_mutex_unlock(&jobs_mtx));
+	/* EAGAIN just means the main thread already has a wakeup pending. */
+	while (write(jobs_fds[1], &c, 1) < 0 && errno == EINTR)
+		;
+}
+
+static void *
+token_worker(void *arg)
+{
+	struct agent_token *at = arg;
+	struct agent_job *jobs, *job, *next;
+	struct bunyan_frame *f;
+	struct timespec ts;
+	uint64_t deadline;
+	errf_t *err;
+
+	f = bunyan_push("token", BNY_UINT, at->at_idx, NULL);
+
+	if ((err = agent_piv_open(at))) {
+		errf_free(err);
+	} else {
+		agent_piv_close(at, B_TRUE);
+	}
+	at->at_last_op = monotime();
+	token_publish(at);
+	token_ephem_refill(at);
+
+	VERIFY0(pthread_mutex_lock(&at->at_mtx));
+	while (1) {
+		if (at->at_jobs == NULL) {
+			deadline = token_deadline(at);
+			if (deadline == 0) {
+				VERIFY0(pthread_cond_wait(&at->at_cv,
+				    &at->at_mtx));
+			} else {
+				/* monotime() is wall-clock ms, as is ts */
+				ts.tv_sec = deadline / 1000;
+				ts.tv_nsec = (deadline % 1000) * 1000000L;
+				(void) pthread_cond_timedwait(&at->at_cv,
+				    &at->at_mtx, &ts);
+			}
+		}
+		jobs = at->at_jobs;
+		at->at_jobs = at->at_jobs_tail = NULL;
+		if (jobs != NULL)
+			at->at_pub_busy = B_TRUE;
+		VERIFY0(pthread_mutex_unlock(&at->at_mtx));
+
+		token_timers(at);
+		if (jobs == NULL)
+			token_lazy_load(at);
+
+		/* As in process_pending(), do a queue in one transaction. */
+		at->at_txnbatch = (jobs != NULL && jobs->aj_next != NULL);
+		for (job = jobs; job != NULL; job = next) {
+			next = job->aj_next;
+			job->aj_next = NULL;
+			if (job->aj_type == JOB_CARD_EVENT) {
+				card_token_event(at, &job->aj_ev);
+				job_free(job);
+				continue;
+			}
+			run_message(&job->aj_e, job->aj_msgtype);
+			job_done(job);
+		}
+		if (at->at_txnbatch) {
+			at->at_txnbatch = B_FALSE;
+			if (at->at_txnopen)
+				agent_piv_close(at, B_FALSE);
+		}
+
+		token_publish(at);
+		token_ephem_refill(at);
+		VERIFY0(pthread_mutex_lock(&at->at_mtx));
+	}
+
+	bunyan_pop(f);
+	return (NULL);
+}
+
+static void
+token_workers_start(void)
+{
+	sigset_t set, oset;
+	uint i;
+
+	if (pipe(jobs_fds) != 0)
+		fatal("failed to create token worker pipe: %s",
+		    strerror(errno));
+	(void) fcntl(jobs_fds[0], F_SETFL, O_NONBLOCK);
+	(void) fcntl(jobs_fds[1], F_SETFL, O_NONBLOCK);
+	(void) fcntl(jobs_fds[0], F_SETFD, FD_CLOEXEC);
+	(void) fcntl(jobs_fds[1], F_SETFD, FD_CLOEXEC);
+#if defined(AGENT_EPOLL) || defined(AGENT_KQUEUE)
+	ev_add(jobs_fds[0]);
+#endif
+
+	/* Signals should all go to the main thread. */
+	VERIFY0(sigfillset(&set));
+	VERIFY0(pthread_sigmask(SIG_BLOCK, &set, &oset));
+	for (i = 0; i < ntokens; ++i) {
+		if (pthread_create(&tokens[i].at_thread, NULL, token_worker,
+		    &tokens[i]) != 0) {
+			fatal("failed to start worker thread for token %u: %s",
+			    i, strerror(errno));
+		}
+	}
+	VERIFY0(pthread_sigmask(SIG_SETMASK, &oset, NULL));
+}
+
+/*
+ * Find the token which has the given public key on it, going by what the
+ * workers last published.
+ */
+static struct agent_token *
+key_owner(const struct sshkey *key)
+{
+	struct agent_token *at, *found = NULL;
+	uint i, j;
+
+	for (i = 0; i < ntokens && found == NULL; ++i) {
+		at = &tokens[i];
+		VERIFY0(pthread_mutex_lock(&at->at_mtx));
+		for (j = 0; j < at->at_nkeys; ++j) {
+			if (sshkey_equal_public(at->at_keys[j], key)) {
+				found = at;
+				break;
+			}
+		}
+		VERIFY0(pthread_mutex_unlock(&at->at_mtx));
+	}
+	return (found);
+}
+
+/*
+ * Work out which key a request is about, without consuming it. Returns
+ * B_FALSE if it isn't one that goes to a particular token at all (in which
+ * case the main thread answers it). On B_TRUE, *keyp may still be NULL if
+ * the request is malformed.
+ */
+static boolean_t
+msg_key(socket_entry_t *e, u_char type, struct sshkey **keyp)
+{
+	struct sshbuf *req, *inner = NULL, *boxbuf = NULL;
+	struct piv_ecdh_box *box = NULL;
+	char *extname = NULL;
+	boolean_t ret = B_FALSE;
+	errf_t *err;
+
+	*keyp = NULL;
+	if ((req = sshbuf_fromb(e->se_request)) == NULL)
+		fatal("%s: sshbuf_fromb failed", __func__);
+
+	if (type == SSH2_AGENTC_SIGN_REQUEST) {
+		ret = B_TRUE;
+		(void) sshkey_froms(req, keyp);
+		goto out;
+	}
+	if (type != SSH2_AGENTC_EXTENSION ||
+	    sshbuf_get_cstring(req, &extname, NULL) != 0 ||
+	    sshbuf_froms(req, &inner) != 0)
+		goto out;
+
+	if (strcmp(extname, "ecdh@joyent.com") == 0 ||
+	    strcmp(extname, "ykpiv-attest@joyent.com") == 0) {
+		ret = B_TRUE;
+		(void) sshkey_froms(inner, keyp);
+	} else if (strcmp(extname, "ecdh-rebox@joyent.com") == 0) {
+		ret = B_TRUE;
+		if (sshbuf_froms(inner, &boxbuf) != 0)
+			goto out;
+		if ((err = sshbuf_get_piv_box(boxbuf, &box))) {
+			errf_free(err);
+			goto out;
+		}
+		(void) sshkey_demote(piv_box_pubkey(box), keyp);
+	} else if (strcmp(extname, "ecdh-rebox-batch@joyent.com") == 0) {
+		struct sshkey *partner = NULL;
+		uint flags, nents;
+
+		/* The first box decides which token gets the batch. */
+		ret = B_TRUE;
+		if (sshkey_froms(inner, &partner) != 0)
+			goto out;
+		sshkey_free(partner);
+		if (sshbuf_get_u32(inner, &flags) != 0 ||
+		    sshbuf_get_u32(inner, &nents) != 0 ||
+		    sshbuf_froms(inner, &boxbuf) != 0)
+			goto out;
+		if ((err = sshbuf_get_piv_box(boxbuf, &box))) {
+			errf_free(err);
+			goto out;
+		}
+		(void) sshkey_demote(piv_box_pubkey(box), keyp);
+	}
+
+out:
+	piv_box_free(box);
+	sshbuf_free(boxbuf);
+	sshbuf_free(inner);
+	free(extname);
+	sshbuf_free(req);
+	return (ret);
+}
+
+static void fanout_merge(struct agent_fanout *, struct sshbuf *);
+static void fanout_finish(socket_entry_t *, struct agent_fanout *);
+
+/*
+ * Answer an identities request on the main thread from what the workers
+ * last published, if every token has something we can use: either it's
+ * recent enough that the worker wouldn't probe the card anyway, or the
+ * worker is busy (e.g. waiting on a touch) and we'd rather hand back a
+ * slightly stale answer than make the client wait behind it.
+ */
+static boolean_t
+cached_identities(socket_entry_t *e)
+{
+	struct agent_fanout af;
+	struct agent_token *at;
+	struct sshbuf *out;
+	uint64_t now;
+	boolean_t ok = B_TRUE;
+	uint i;
+	int r;
+
+	bzero(&af, sizeof (af));
+	af.af_type = SSH2_AGENTC_REQUEST_IDENTITIES;
+	if ((af.af_keys = sshbuf_new()) == NULL ||
+	    (out = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+
+	now = monotime();
+	for (i = 0; i < ntokens && ok; ++i) {
+		at = &tokens[i];
+		VERIFY0(pthread_mutex_lock(&at->at_mtx));
+		if (at->at_pub_ids == NULL || (!at->at_pub_busy &&
+		    (now - at->at_pub_ids_update) >=
+		    at->at_probe_interval * 1000)) {
+			ok = B_FALSE;
+		} else {
+			sshbuf_reset(out);
+			if ((r = sshbuf_put_stringb(out, at->at_pub_ids)) != 0)
+				fatal("%s: buffer error: %s", __func__,
+				    ssh_err(r));
+			fanout_merge(&af, out);
+		}
+		VERIFY0(pthread_mutex_unlock(&at->at_mtx));
+	}
+
+	if (ok) {
+		bunyan_log(BNY_DEBUG, "answered identities from cache",
+		    "fd", BNY_INT, e->se_fd, NULL);
+		stat_inc(&agent_stats.as_ident_cached);
+		sshbuf_reset(e->se_request);
+		fanout_finish(e, &af);
+	}
+	sshbuf_free(out);
+	sshbuf_free(af.af_keys);
+	return (ok);
+}
+
+static void
+route_message(u_int socknum, u_char type)
+{
+	socket_entry_t *e = &sockets[socknum];
+	struct agent_fanout *af;
+	struct fanout_waiter *fw;
+	struct agent_job *job;
+	struct agent_token *at = NULL;
+	struct sshkey *key = NULL;
+	uint i;
+
+	switch (type) {
+	case SSH2_AGENTC_REQUEST_IDENTITIES:
+		if (cached_identities(e))
+			return;
+		if ((af = ident_fanout) != NULL) {
+			fw = calloc(1, sizeof (struct fanout_waiter));
+			VERIFY(fw != NULL);
+			fw->fw_socknum = socknum;
+			fw->fw_gen = e->se_gen;
+			fw->fw_next = af->af_waiters;
+			af->af_waiters = fw;
+			bunyan_log(BNY_DEBUG, "waiting on identities fan-out",
+			    "fd", BNY_INT, e->se_fd, NULL);
+			stat_inc(&agent_stats.as_ident_coalesced);
+			e->se_busy = B_TRUE;
+			sshbuf_reset(e->se_request);
+			return;
+		}
+		/* FALLTHROUGH */
+	case SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
+	case SSH_AGENTC_LOCK:
+	case SSH_AGENTC_UNLOCK:
+		af = calloc(1, sizeof (struct agent_fanout));
+		VERIFY(af != NULL);
+		af->af_type = type;
+		af->af_pending = ntokens;
+		if ((af->af_keys = sshbuf_new()) == NULL)
+			fatal("%s: sshbuf_new failed", __func__);
+		if (type == SSH2_AGENTC_REQUEST_IDENTITIES)
+			ident_fanout = af;
+		if (type == SSH_AGENTC_UNLOCK && ntokens > 1) {
+			/* Kept until we know which tokens get it. */
+			if ((af->af_request = sshbuf_new()) == NULL ||
+			    sshbuf_putb(af->af_request, e->se_request) != 0)
+				fatal("%s: sshbuf_new failed", __func__);
+			af->af_probing = B_TRUE;
+			af->af_next = 1;
+			af->af_pending = 1;
+			job = job_new(socknum, &tokens[0], type,
+			    af->af_request);
+			job->aj_fanout = af;
+			token_submit(&tokens[0], job);
+			e->se_busy = B_TRUE;
+			sshbuf_reset(e->se_request);
+			return;
+		}
+		for (i = 0; i < ntokens; ++i) {
+			job = job_new(socknum, &tokens[i], type,
+			    e->se_request);
+			job->aj_fanout = af;
+			token_submit(&tokens[i], job);
+		}
+		e->se_busy = B_TRUE;
+		sshbuf_reset(e->se_request);
+		return;
+	case SSH2_AGENTC_SIGN_REQUEST:
+	case SSH2_AGENTC_EXTENSION:
+		if (!msg_key(e, type, &key))
+			break;
+		if (key != NULL)
+			at = key_owner(key);
+		sshkey_free(key);
+		if (at == NULL) {
+			bunyan_log(BNY_WARN, "no token has the requested key",
+			    "fd", BNY_INT, e->se_fd,
+			    "msg_type_name", BNY_STRING, msg_type_to_name(type),
+			    NULL);
+			sshbuf_reset(e->se_request);
+			if (type == SSH2_AGENTC_EXTENSION)
+				send_extfail(e);
+			else
+				send_status(e, 0);
+			return;
+		}
+		bunyan_log(BNY_TRACE, "routing request to token",
+		    "fd", BNY_INT, e->se_fd,
+		    "token", BNY_UINT, at->at_idx, NULL);
+		token_submit(at, job_new(socknum, at, type, e->se_request));
+		e->se_busy = B_TRUE;
+		sshbuf_reset(e->se_request);
+		return;
+	default:
+		break;
+	}
+	run_message(e, type);
+}
+
+/* Merge one worker's answer into the fan-out it belongs to. */
+static void
+fanout_merge(struct agent_fanout *af, struct sshbuf *out)
+{
+	struct sshbuf *reply = NULL;
+	const u_char *key, *comment;
+	size_t keylen, commentlen;
+	u_char code;
+	u_int n, i;
+	int r;
+
+	if (sshbuf_froms(out, &reply) != 0 ||
+	    sshbuf_get_u8(reply, &code) != 0)
+		goto out;
+	if (af->af_type != SSH2_AGENTC_REQUEST_IDENTITIES) {
+		if (code == SSH_AGENT_SUCCESS)
+			++af->af_ok;
+		goto out;
+	}
+	if (code != SSH2_AGENT_IDENTITIES_ANSWER ||
+	    sshbuf_get_u32(reply, &n) != 0)
+		goto out;
+	++af->af_ok;
+	for (i = 0; i < n; ++i) {
+		if (sshbuf_get_string_direct(reply, &key, &keylen) != 0 ||
+		    sshbuf_get_string_direct(reply, &comment,
+		    &commentlen) != 0)
+			break;
+		if ((r = sshbuf_put_string(af->af_keys, key, keylen)) != 0 ||
+		    (r = sshbuf_put_string(af->af_keys, comment,
+		    commentlen)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		++af->af_nkeys;
+	}
+out:
+	sshbuf_free(reply);
+}
+
+static void
+fanout_finish(socket_entry_t *e, struct agent_fanout *af)
+{
+	struct sshbuf *msg;
+	int r;
+
+	if (af->af_type != SSH2_AGENTC_REQUEST_IDENTITIES) {
+		send_status(e, af->af_ok > 0);
+		return;
+	}
+	if (af->af_ok == 0) {
+		send_status(e, 0);
+		return;
+	}
+	if ((msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_put_u8(msg, SSH2_AGENT_IDENTITIES_ANSWER)) != 0 ||
+	    (r = sshbuf_put_u32(msg, af->af_nkeys)) != 0 ||
+	    (r = sshbuf_putb(msg, af->af_keys)) != 0 ||
+	    (r = sshbuf_put_stringb(e->se_output, msg)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	sshbuf_free(msg);
+}
+
+/* Hand a finished fan-out's answer to everyone else who was waiting on it. */
+static void
+fanout_wake(struct agent_fanout *af)
+{
+	struct fanout_waiter *fw, *next;
+	socket_entry_t *e;
+
+	if (af == ident_fanout)
+		ident_fanout = NULL;
+	for (fw = af->af_waiters; fw != NULL; fw = next) {
+		next = fw->fw_next;
+		e = &sockets[fw->fw_socknum];
+		if (e->se_type == AUTH_CONNECTION && e->se_gen == fw->fw_gen) {
+			fanout_finish(e, af);
+			e->se_busy = B_FALSE;
+		}
+		free(fw);
+	}
+	af->af_waiters = NULL;
+}
+
+/*
+ * An unlock goes to one token at a time until one of them has actually
+ * checked the PIN, so that a mistyped passphrase costs a retry on one card
+ * rather than on all of them (and repeating it can't lock them all). Tokens
+ * which couldn't try it (say, because they're not plugged in) are skipped.
+ * Once one has accepted the PIN, the others all get it at once.
+ *
+ * Called when the job for the token being tried comes back, with its answer
+ * already merged. Returns B_TRUE if more jobs went out for af.
+ */
+static boolean_t
+unlock_continue(struct agent_job *job, struct agent_fanout *af)
+{
+	struct agent_job *nj;
+	uint i, n = 0;
+
+	if (af->af_ok == 0) {
+		if (job->aj_e.se_pin_checked || af->af_next >= ntokens)
+			return (B_FALSE);
+		nj = job_new(job->aj_socknum, &tokens[af->af_next], af->af_type,
+		    af->af_request);
+		nj->aj_fanout = af;
+		token_submit(&tokens[af->af_next++], nj);
+		af->af_pending = 1;
+		return (B_TRUE);
+	}
+
+	af->af_probing = B_FALSE;
+	for (i = 0; i < ntokens; ++i) {
+		if (&tokens[i] == job->aj_tok)
+			continue;
+		nj = job_new(job->aj_socknum, &tokens[i], af->af_type,
+		    af->af_request);
+		nj->aj_fanout = af;
+		token_submit(&tokens[i], nj);
+		++n;
+	}
+	if (n == 0)
+		return (B_FALSE);
+	af->af_pending = n;
+	return (B_TRUE);
+}
+
+/* Collect finished jobs from the token workers. */
+static void
+jobs_read(void)
+{
+	struct agent_job *jobs, *job, *next;
+	struct agent_fanout *af;
+	socket_entry_t *e;
+	char buf[64];
+	int r;
+
+	while (read(jobs_fds[0], buf, sizeof (buf)) > 0)
+		;
+
+	VERIFY0(pthread_mutex_lock(&jobs_mtx));
+	jobs = jobs_done;
+	jobs_done = NULL;
+	VERIFY0(pthread_mutex_unlock(&jobs_mtx));
+
+	for (job = jobs; job != NULL; job = next) {
+		next = job->aj_next;
+		e = &sockets[job->aj_socknum];
+		if (e->se_type != AUTH_CONNECTION || e->se_gen != job->aj_gen)
+			e = NULL;
+
+		if (e != NULL) {
+			if (job->aj_e.se_authz != AUTHZ_NOT_YET)
+				e->se_authz = job->aj_e.se_authz;
+			if (e->se_pid_ent != NULL && job->aj_pid.pe_last_auth >
+			    e->se_pid_ent->pe_last_auth) {
+				e->se_pid_ent->pe_last_auth =
+				    job->aj_pid.pe_last_auth;
+			}
+		}
+
+		if ((af = job->aj_fanout) != NULL) {
+			fanout_merge(af, job->aj_e.se_output);
+			if (af->af_probing && e != NULL &&
+			    unlock_continue(job, af)) {
+				job_free(job);
+				continue;
+			}
+			if (--af->af_pending == 0) {
+				if (e != NULL) {
+					fanout_finish(e, af);
+					e->se_busy = B_FALSE;
+				}
+				fanout_wake(af);
+				sshbuf_free(af->af_keys);
+				sshbuf_free(af->af_request);
+				free(af);
+			}
+		} else if (e != NULL && sshbuf_len(e->se_output) == 0) {
+			/* Nothing queued ahead of it: take the whole buffer. */
+			sshbuf_free(e->se_output);
+			e->se_output = job->aj_e.se_output;
+			job->aj_e.se_output = NULL;
+			e->se_busy = B_FALSE;
+		} else if (e != NULL) {
+			r = sshbuf_putb(e->se_output, job->aj_e.se_output);
+			if (r != 0)
+				fatal("%s: buffer error: %s", __func__,
+				    ssh_err(r));
+			e->se_busy = B_FALSE;
+		}
+		job_free(job);
+	}
+}
+
 /* dispatch incoming messages */
 static int
 process_message(u_int socknum)
@@ -1884,7 +4505,6 @@ process_message(u_int socknum)
 	u_char type;
 	const u_char *cp;
 	int r;
-	errf_t *err;
 	socket_entry_t *e;
 
 	if (socknum >= sockets_alloc) {
@@ -1905,10 +4525,16 @@ process_message(u_int socknum)
 	if (sshbuf_len(e->se_input) < msg_len + 4)
 		return 0;		/* Incomplete message body. */
 
-	/* move the current input to e->request */
-	sshbuf_reset(e->se_request);
-	if ((r = sshbuf_get_stringb(e->se_input, e->se_request)) != 0 ||
+	/*
+	 * e->se_request is a read-only view of the message where it sits in
+	 * se_input rather than a copy, and job_new() hands the token worker
+	 * another view of that. We drop ours once the message is routed.
+	 */
+	VERIFY3P(e->se_request, ==, NULL);
+	if ((r = sshbuf_froms(e->se_input, &e->se_request)) != 0 ||
 	    (r = sshbuf_get_u8(e->se_request, &type)) != 0) {
+		sshbuf_free(e->se_request);
+		e->se_request = NULL;
 		if (r == SSH_ERR_MESSAGE_INCOMPLETE ||
 		    r == SSH_ERR_STRING_TOO_LARGE) {
 			sdebug("%s: buffer error: %s", __func__, ssh_err(r));
@@ -1917,59 +4543,55 @@ process_message(u_int socknum)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 	}
 
-	msg_log_frame = bunyan_push(
-	    "fd", BNY_INT, e->se_fd,
-	    "msg_type", BNY_INT, (int)type,
-	    "msg_type_name", BNY_STRING, msg_type_to_name(type),
-	    "remote_pid", BNY_INT, (int)e->se_pid,
-	    "remote_cmd", BNY_STRING,
-	    (e->se_exepath == NULL) ? "???" : e->se_exepath,
-	    NULL);
-	bunyan_log(BNY_DEBUG, "received ssh-agent message", NULL);
+	route_message(socknum, type);
+	sshbuf_free(e->se_request);
+	e->se_request = NULL;
+	return 0;
+}
 
-	last_op = monotime();
+static boolean_t
+msg_complete(socket_entry_t *e)
+{
+	const u_char *cp;
 
-	switch (type) {
-	case SSH_AGENTC_LOCK:
-	case SSH_AGENTC_UNLOCK:
-		err = process_lock_agent(e, type == SSH_AGENTC_LOCK);
-		break;
-	/* ssh2 */
-	case SSH2_AGENTC_SIGN_REQUEST:
-		err = process_sign_request2(e);
-		break;
-	case SSH2_AGENTC_REQUEST_IDENTITIES:
-		err = process_request_identities(e);
-		break;
-	case SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
-		err = process_remove_all_identities(e);
-		break;
-	case SSH2_AGENTC_EXTENSION:
-		err = process_extension(e);
-		break;
-	default:
-		/* Unknown message.  Respond with failure. */
-		err = errf("UnknownMessageError", NULL,
-		    "unknown/unsupported agent protocol message %d", type);
-		break;
-	}
+	if (sshbuf_len(e->se_input) < 5)
+		return (B_FALSE);
+	cp = sshbuf_ptr(e->se_input);
+	/* Oversized messages count, so process_message() can reject them. */
+	return (PEEK_U32(cp) > AGENT_MAX_LEN ||
+	    sshbuf_len(e->se_input) >= PEEK_U32(cp) + 4);
+}
 
-	if (err) {
-		bunyan_log(BNY_WARN, "failed to process command",
-		    "error", BNY_ERF, err, NULL);
-		if (errf_caused_by(err, "NoPINError") &&
-		    bunyan_get_level() > BNY_WARN) {
-			warnfx(err, "denied command due to lack of PIN");
-		}
-		sshbuf_reset(e->se_request);
-		send_status(e, 0);
-		errf_free(err);
-	} else {
-		bunyan_log(BNY_INFO, "processed ssh-agent message", NULL);
-	}
+/*
+ * Process every complete message we have buffered, taking one at a time
+ * from each connection in turn so that replies on any one connection go
+ * out in the order the requests came in.
+ *
+ * Anything for a card goes onto its worker's queue from here, so when a lot
+ * of clients show up at once the worker finds them all waiting and runs them
+ * as one batch inside a single card transaction, instead of each paying for
+ * a SELECT (and possibly CAK auth) of its own.
+ */
+static void
+process_pending(void)
+{
+	u_int i;
+	boolean_t progress;
 
-	bunyan_pop(msg_log_frame);
-	return 0;
+	do {
+		progress = B_FALSE;
+		for (i = 0; i < sockets_alloc; i++) {
+			if (sockets[i].se_type != AUTH_CONNECTION ||
+			    sockets[i].se_busy ||
+			    !msg_complete(&sockets[i]))
+				continue;
+			if (process_message(i) != 0) {
+				close_socket(&sockets[i]);
+				continue;
+			}
+			progress = B_TRUE;
+		}
+	} while (progress);
 }
 
 extern void *reallocarray(void *ptr, size_t nmemb, size_t size);
@@ -1991,9 +4613,19 @@ new_socket(sock_type_t type, int fd)
 				fatal("%s: sshbuf_new failed", __func__);
 			if ((sockets[i].se_output = sshbuf_new()) == NULL)
 				fatal("%s: sshbuf_new failed", __func__);
-			if ((sockets[i].se_request = sshbuf_new()) == NULL)
-				fatal("%s: sshbuf_new failed", __func__);
+			sockets[i].se_request = NULL;
 			sockets[i].se_type = type;
+			sockets[i].se_wantwrite = B_FALSE;
+			sockets[i].se_tok = NULL;
+			sockets[i].se_pid_ent = NULL;
+			sockets[i].se_exepath = NULL;
+			sockets[i].se_exeargs = NULL;
+			sockets[i].se_busy = B_FALSE;
+			sockets[i].se_gen = ++sockets_gen;
+			fd_sock_set(fd, i);
+#if defined(AGENT_EPOLL) || defined(AGENT_KQUEUE)
+			ev_add(fd);
+#endif
 			return (&sockets[i]);
 		}
 	old_alloc = sockets_alloc;
@@ -2008,9 +4640,19 @@ new_socket(sock_type_t type, int fd)
 		fatal("%s: sshbuf_new failed", __func__);
 	if ((sockets[old_alloc].se_output = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
-	if ((sockets[old_alloc].se_request = sshbuf_new()) == NULL)
-		fatal("%s: sshbuf_new failed", __func__);
+	sockets[old_alloc].se_request = NULL;
 	sockets[old_alloc].se_type = type;
+	sockets[old_alloc].se_wantwrite = B_FALSE;
+	sockets[old_alloc].se_tok = NULL;
+	sockets[old_alloc].se_pid_ent = NULL;
+	sockets[old_alloc].se_exepath = NULL;
+	sockets[old_alloc].se_exeargs = NULL;
+	sockets[old_alloc].se_busy = B_FALSE;
+	sockets[old_alloc].se_gen = ++sockets_gen;
+	fd_sock_set(fd, old_alloc);
+#if defined(AGENT_EPOLL) || defined(AGENT_KQUEUE)
+	ev_add(fd);
+#endif
 	return (&sockets[old_alloc]);
 }
 
@@ -2023,31 +4665,20 @@ handle_socket_read(u_int socknum)
 	gid_t egid;
 	int fd;
 	pid_t pid = 0;
-#if defined(__sun) || defined(SO_PEERCRED)
-	uint i;
-	FILE *f;
-#endif
-	char *exepath = NULL;
-	char *exeargs = NULL;
 	socket_entry_t *ent;
-	uint64_t start_time;
+	pid_entry_t *pe;
 #if defined(__sun)
 	ucred_t *peer = NULL;
-	struct psinfo *psinfo;
 	zoneid_t zid;
-	char fn[128];
 #elif defined(__OpenBSD__)
 	struct sockpeercred *peer;
 	socklen_t len;
 #elif defined(__APPLE__)
 	struct xucred *peer;
 	socklen_t len;
-	char pathBuf[PROC_PIDPATHINFO_MAXSIZE];
-	int rc;
 #elif defined(SO_PEERCRED)
 	struct ucred *peer;
 	socklen_t len;
-	char fn[128], ln[1024];
 #endif
 	slen = sizeof(sunaddr);
 	fd = accept(sockets[socknum].se_fd, (struct sockaddr *)&sunaddr, &slen);
@@ -2066,19 +4697,6 @@ handle_socket_read(u_int socknum)
 	pid = ucred_getpid(peer);
 	zid = ucred_getzoneid(peer);
 	ucred_free(peer);
-	psinfo = calloc(1, sizeof (struct psinfo));
-	snprintf(fn, sizeof (fn), "/proc/%d/psinfo", (int)pid);
-	f = fopen(fn, "r");
-	if (f != NULL) {
-		if (fread(psinfo, sizeof (struct psinfo), 1, f) == 1) {
-			exepath = strndup(psinfo->pr_fname,
-			    sizeof (psinfo->pr_fname));
-			exeargs = strndup(psinfo->pr_psargs,
-			    sizeof (psinfo->pr_psargs));
-		}
-		fclose(f);
-	}
-	free(psinfo);
 	if (check_client_zoneid && zid != getzoneid()) {
 		error("zoneid mismatch: peer zoneid %u != zoneid %u",
 		    (u_int) zid, (u_int) getzoneid());
@@ -2112,12 +4730,8 @@ handle_socket_read(u_int socknum)
 		egid = peer->cr_groups[0];
 	free(peer);
 	len = sizeof (pid);
-	if (getsockopt(fd, SOL_LOCAL, LOCAL_PEERPID, &pid, &len) == 0) {
-		rc = proc_pidpath(pid, pathBuf, sizeof (pathBuf));
-		if (rc > 0) {
-			exepath = strdup(pathBuf);
-		}
-	}
+	if (getsockopt(fd, SOL_LOCAL, LOCAL_PEERPID, &pid, &len) != 0)
+		pid = 0;
 #elif defined(SO_PEERCRED)
 	peer = calloc(1, sizeof (struct ucred));
 	len = sizeof (struct ucred);
@@ -2131,20 +4745,6 @@ handle_socket_read(u_int socknum)
 	egid = peer->gid;
 	pid = peer->pid;
 	free(peer);
-	snprintf(fn, sizeof (fn), "/proc/%d/exe", (int)pid);
-	len = readlink(fn, ln, sizeof (ln));
-	if (len > 0 && len < sizeof (ln)) {
-		exepath = strndup(ln, len);
-	}
-	snprintf(fn, sizeof (fn), "/proc/%d/cmdline", (int)pid);
-	f = fopen(fn, "r");
-	len = fread(ln, 1, sizeof (ln) - 1, f);
-	fclose(f);
-	for (i = 0; i < len; ++i) {
-		if (ln[i] == '\0')
-			ln[i] = ' ';
-	}
-	exeargs = strndup(ln, len);
 #else
 	if (getpeereid(fd, &euid, &egid) < 0) {
 		error("getpeereid %d failed: %s", fd, strerror(errno));
@@ -2158,38 +4758,43 @@ handle_socket_read(u_int socknum)
 		close(fd);
 		return -1;
 	}
+	pe = find_or_make_pid_entry(pid, euid);
 	ent = new_socket(AUTH_CONNECTION, fd);
 	ent->se_pid = pid;
 	ent->se_gid = egid;
-	ent->se_exepath = exepath;
-	ent->se_exeargs = exeargs;
-	start_time = get_pid_start_time(pid);
-	ent->se_pid_ent = find_or_make_pid_entry(pid, start_time);
-	ent->se_pid_idx = ent->se_pid_ent->pe_conn_count++;
+	if (pe->pe_exepath != NULL)
+		VERIFY((ent->se_exepath = strdup(pe->pe_exepath)) != NULL);
+	if (pe->pe_exeargs != NULL)
+		VERIFY((ent->se_exeargs = strdup(pe->pe_exeargs)) != NULL);
+	ent->se_pid_ent = pe;
+	ent->se_pid_idx = pe->pe_conn_count++;
 	return 0;
 }
 
 static int
 handle_conn_read(u_int socknum)
 {
-	char buf[1024];
-	ssize_t len;
+	socket_entry_t *e = &sockets[socknum];
 	int r;
 
-	if ((len = read(sockets[socknum].se_fd, buf, sizeof(buf))) <= 0) {
-		if (len == -1) {
-			if (errno == EAGAIN || errno == EINTR)
-				return 0;
+	/*
+	 * Requests still out with a token worker are views straight into
+	 * se_input (see process_message()), so if there are any we have to
+	 * move on to a fresh buffer before reading more onto the end.
+	 */
+	if ((r = sshbuf_unshare(&e->se_input)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	if ((r = sshbuf_read(e->se_fd, e->se_input, 1024, NULL)) != 0) {
+		if (r != SSH_ERR_SYSTEM_ERROR)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		if (errno != EPIPE) {
 			error("%s: read error on socket %u (fd %d): %s",
-			    __func__, socknum, sockets[socknum].se_fd,
-			    strerror(errno));
+			    __func__, socknum, e->se_fd, strerror(errno));
 		}
 		return -1;
 	}
-	if ((r = sshbuf_put(sockets[socknum].se_input, buf, len)) != 0)
-		fatal("%s: buffer error: %s", __func__, ssh_err(r));
-	explicit_bzero(buf, sizeof(buf));
-	process_message(socknum);
 	return 0;
 }
 
@@ -2218,56 +4823,74 @@ handle_conn_write(u_int socknum)
 	return 0;
 }
 
+static void
+handle_socket_events(u_int socknum, int revents)
+{
+	switch (sockets[socknum].se_type) {
+	case AUTH_SOCKET:
+		if ((revents & (POLLIN|POLLERR)) != 0 &&
+		    handle_socket_read(socknum) != 0)
+			close_socket(&sockets[socknum]);
+		break;
+	case AUTH_CONNECTION:
+		if ((revents & (POLLIN|POLLERR)) != 0 &&
+		    handle_conn_read(socknum) != 0) {
+			close_socket(&sockets[socknum]);
+			break;
+		}
+		if ((revents & (POLLOUT|POLLHUP)) != 0 &&
+		    handle_conn_write(socknum) != 0)
+			close_socket(&sockets[socknum]);
+		break;
+	default:
+		break;
+	}
+}
+
 static void
 after_poll(struct pollfd *pfd, size_t npfd)
 {
 	size_t i;
-	u_int socknum;
+	int socknum;
 
 	for (i = 0; i < npfd; i++) {
 		if (pfd[i].revents == 0)
 			continue;
-		/* Find sockets entry */
-		for (socknum = 0; socknum < sockets_alloc; socknum++) {
-			if (sockets[socknum].se_type != AUTH_SOCKET &&
-			    sockets[socknum].se_type != AUTH_CONNECTION)
-				continue;
-			if (pfd[i].fd == sockets[socknum].se_fd)
-				break;
+		if (card_watcher && pfd[i].fd == card_watch_fds[0]) {
+			card_watch_read();
+			continue;
 		}
-		if (socknum >= sockets_alloc) {
-			error("%s: no socket for fd %d", __func__, pfd[i].fd);
+		if (pfd[i].fd == jobs_fds[0]) {
+			jobs_read();
 			continue;
 		}
-		/* Process events */
-		switch (sockets[socknum].se_type) {
-		case AUTH_SOCKET:
-			if ((pfd[i].revents & (POLLIN|POLLERR)) != 0 &&
-			    handle_socket_read(socknum) != 0)
-				close_socket(&sockets[socknum]);
-			break;
-		case AUTH_CONNECTION:
-			if ((pfd[i].revents & (POLLIN|POLLERR)) != 0 &&
-			    handle_conn_read(socknum) != 0) {
-				close_socket(&sockets[socknum]);
-				break;
-			}
-			if ((pfd[i].revents & (POLLOUT|POLLHUP)) != 0 &&
-			    handle_conn_write(socknum) != 0)
-				close_socket(&sockets[socknum]);
-			break;
-		default:
-			break;
+		if ((socknum = fd_sock_get(pfd[i].fd)) == -1) {
+			error("%s: no socket for fd %d", __func__, pfd[i].fd);
+			continue;
 		}
+		handle_socket_events(socknum, pfd[i].revents);
 	}
 }
 
+static int
+poll_timeout(void)
+{
+	uint64_t deadline;
+
+	/* Token workers look after their own timers. */
+	if (parent_alive_interval == 0)
+		return (-1); /* INFTIM */
+	deadline = parent_alive_interval * 1000;
+	if (deadline > INT_MAX)
+		return (INT_MAX);
+	return (deadline);
+}
+
 static int
 prepare_poll(struct pollfd **pfdp, size_t *npfdp, int *timeoutp)
 {
 	struct pollfd *pfd = *pfdp;
 	size_t i, j, npfd = 0;
-	uint64_t now, deadline;
 
 	/* Count active sockets */
 	for (i = 0; i < sockets_alloc; i++) {
@@ -2283,6 +4906,10 @@ prepare_poll(struct pollfd **pfdp, size_t *npfdp, int *timeoutp)
 			break;
 		}
 	}
+	if (card_watcher)
+		npfd++;
+	if (jobs_fds[0] != -1)
+		npfd++;
 	if (npfd != *npfdp &&
 	    (pfd = recallocarray(pfd, *npfdp, npfd, sizeof(struct pollfd))) == NULL)
 		fatal("%s: recallocarray failed", __func__);
@@ -2305,25 +4932,111 @@ prepare_poll(struct pollfd **pfdp, size_t *npfdp, int *timeoutp)
 			break;
 		}
 	}
-	now = monotime();
-	deadline = txnopen ? (txntimeout - now) : 0;
-	if (parent_alive_interval != 0)
-		deadline = (deadline == 0) ? parent_alive_interval * 1000 :
-		    MINIMUM(deadline, parent_alive_interval * 1000);
-	if (card_probe_interval != 0)
-		deadline = (deadline == 0) ? card_probe_interval * 1000 :
-		    MINIMUM(deadline, card_probe_interval * 1000);
-	if (deadline == 0) {
-		*timeoutp = -1; /* INFTIM */
-	} else {
-		if (deadline > INT_MAX)
-			*timeoutp = INT_MAX;
-		else
-			*timeoutp = deadline;
+	if (card_watcher) {
+		pfd[j].fd = card_watch_fds[0];
+		pfd[j].revents = 0;
+		pfd[j].events = POLLIN;
+		j++;
+	}
+	if (jobs_fds[0] != -1) {
+		pfd[j].fd = jobs_fds[0];
+		pfd[j].revents = 0;
+		pfd[j].events = POLLIN;
+		j++;
 	}
+	*timeoutp = poll_timeout();
 	return (1);
 }
 
+#if defined(AGENT_EPOLL) || defined(AGENT_KQUEUE)
+/*
+ * Bring the kernel's write interest for each connection into line with
+ * whether it has output queued. Request handlers only ever queue output
+ * on the connection they're serving, but doing the sweep here before
+ * sleeping keeps that from being something we rely on.
+ */
+static void
+ev_sync_writes(void)
+{
+	u_int i;
+	boolean_t want;
+
+	for (i = 0; i < sockets_alloc; i++) {
+		if (sockets[i].se_type != AUTH_CONNECTION)
+			continue;
+		want = (sshbuf_len(sockets[i].se_output) > 0);
+		if (want == sockets[i].se_wantwrite)
+			continue;
+		ev_set_write(sockets[i].se_fd, want);
+		sockets[i].se_wantwrite = want;
+	}
+}
+
+static int
+ev_wait(int timeout)
+{
+#if defined(AGENT_KQUEUE)
+	struct timespec ts, *tsp = NULL;
+#endif
+
+	ev_sync_writes();
+#if defined(AGENT_EPOLL)
+	return (epoll_wait(ev_fd, ev_list, EV_MAX_EVENTS, timeout));
+#else
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		tsp = &ts;
+	}
+	return (kevent(ev_fd, NULL, 0, ev_list, EV_MAX_EVENTS, tsp));
+#endif
+}
+
+static void
+ev_dispatch(int nev)
+{
+	int i, fd, revents, socknum;
+
+	for (i = 0; i < nev; i++) {
+#if defined(AGENT_EPOLL)
+		fd = ev_list[i].data.fd;
+		revents = 0;
+		if (ev_list[i].events & EPOLLIN)
+			revents |= POLLIN;
+		if (ev_list[i].events & EPOLLOUT)
+			revents |= POLLOUT;
+		if (ev_list[i].events & EPOLLERR)
+			revents |= POLLERR;
+		if (ev_list[i].events & EPOLLHUP)
+			revents |= POLLHUP;
+#else
+		fd = (int)ev_list[i].ident;
+		if (ev_list[i].flags & EV_ERROR)
+			revents = POLLERR;
+		else if (ev_list[i].filter == EVFILT_WRITE)
+			revents = POLLOUT;
+		else
+			revents = POLLIN;
+#endif
+		if (card_watcher && fd == card_watch_fds[0]) {
+			card_watch_read();
+			continue;
+		}
+		if (fd == jobs_fds[0]) {
+			jobs_read();
+			continue;
+		}
+		/*
+		 * An earlier event in this batch may have closed the socket
+		 * this one was for.
+		 */
+		if ((socknum = fd_sock_get(fd)) == -1)
+			continue;
+		handle_socket_events(socknum, revents);
+	}
+}
+#endif	/* AGENT_EPOLL || AGENT_KQUEUE */
+
 static void
 cleanup_socket(void)
 {
@@ -2340,6 +5053,7 @@ void
 cleanup_exit(int i)
 {
 	cleanup_socket();
+	bunyan_flush();
 	_exit(i);
 }
 
@@ -2348,10 +5062,10 @@ static void
 cleanup_handler(int sig)
 {
 	cleanup_socket();
-	if (selk != NULL && piv_token_in_txn(selk))
-		piv_txn_end(selk);
-	piv_release(ks);
-	SCardReleaseContext(ctx);
+	/*
+	 * Token workers may be in the middle of using their cards, so leave
+	 * it to pcscd to clean up after them when we exit.
+	 */
 	_exit(2);
 }
 
@@ -2374,8 +5088,10 @@ static void
 usage(void)
 {
 	fprintf(stderr,
-	    "usage: pivy-agent [-c | -s] [-Ddim] [-a bind_address] [-E fingerprint_hash]\n"
-	    "                  [-K cak] -g guid [command [arg ...]]\n"
+	    "usage: pivy-agent [-c | -s] [-Ddilm] [-a bind_address] [-E fingerprint_hash]\n"
+	    "                  [-K cak] [-A recheck] [-T hold]\n"
+	    "                  -g guid [-g guid [-K cak] ...]\n"
+	    "                  [command [arg ...]]\n"
 	    "       pivy-agent [-c | -s] -k\n"
 	    "\n"
 	    "An ssh-agent work-alike which always contains the keys stored on\n"
@@ -2393,9 +5109,18 @@ usage(void)
 	    "                        (one -C = confirm only forwarded agent,\n"
 	    "                         two -C = confirm all connections)\n"
 	    "  -m                    Allow signing with 9D (KEY_MGMT) key\n"
+	    "  -l                    Serve keys from the primary slots as soon\n"
+	    "                        as the card is found, and read retired\n"
+	    "                        (key history) slots while it's idle\n"
 	    "  -E fp_hash            Set hash algo for fingerprints\n"
 	    "  -g guid               GUID or GUID prefix of PIV token to use\n"
-	    "  -K cak                9E (card auth) key to authenticate PIV token\n"
+	    "                        (may be given more than once to serve\n"
+	    "                        several tokens)\n"
+	    "  -K cak                9E (card auth) key to authenticate the PIV\n"
+	    "                        token given by the preceding -g\n"
+	    "  -A secs|always        How often to re-check the CAK while the\n"
+	    "                        card stays connected (default 300 secs).\n"
+	    "                        It's always checked after a reconnect.\n"
 	    "  -k                    Kill an already-running agent\n"
 	    "  -U                    Don't check client UID (allow any uid to connect)\n"
 #if defined(__sun)
@@ -2406,6 +5131,11 @@ usage(void)
 	    "                        use '!9e' for example to disable just 9e.\n"
 	    "                        !all will disable everything, allowing to\n"
 	    "                        whitelist instead.\n"
+	    "  -T ms|adaptive[:min-max]\n"
+	    "                        How long to keep the card transaction\n"
+	    "                        open after a request (default 2000 ms).\n"
+	    "                        'adaptive' sizes it from recent request\n"
+	    "                        arrival times (default 250-5000 ms).\n"
 	    "\n"
 	    "Environment variables:\n"
 	    "  SSH_ASKPASS           Path to ssh-askpass command to run to get\n"
@@ -2413,6 +5143,18 @@ usage(void)
 	    "  SSH_CONFIRM           Path to a program to run to confirm that\n"
 	    "                        a new client should be allowed to use the\n"
 	    "                        keys in the agent. Can be 'zenity'.\n"
+	    "  PIVY_CERT_CACHE       Directory in which to cache slot public\n"
+	    "                        keys, so a re-inserted token can serve\n"
+	    "                        identities without re-reading its certs\n"
+	    "  PIVY_SOFT_TOKEN       Path to a software PIV token to use as\n"
+	    "                        well as real cards, for testing (created\n"
+	    "                        if missing; keys are NOT protected)\n"
+	    "  PIVY_SOFT_TOKEN_LATENCY\n"
+	    "                        Delay in usec added to each APDU sent to\n"
+	    "                        the software token\n"
+	    "\n"
+	    "Send SIGUSR1 to write the last APDUs exchanged with the card(s)\n"
+	    "to the log (or use 'pivy-tool apdu-log').\n"
 	    );
 	exit(1);
 }
@@ -2584,10 +5326,12 @@ main(int ac, char **av)
 	int timeout = -1; /* INFTIM */
 	struct pollfd *pfd = NULL;
 	size_t npfd = 0;
-	uint64_t now;
 	char *ptr;
 	int r;
 	errf_t *err;
+	struct agent_token *at;
+	struct sshkey *cak = NULL;
+	uint i;
 
 #if !defined(__APPLE__)
 	int fd;
@@ -2605,13 +5349,23 @@ main(int ac, char **av)
 	bunyan_init();
 	bunyan_set_name("pivy-agent");
 
+	piv_cert_cache_dir = getenv("PIVY_CERT_CACHE");
+	/* We only ever use the keys from slots, never their certs. */
+	piv_compact_slots = B_TRUE;
+	piv_ephem_pool_init(AGENT_EPHEM_POOL);
+
 	__progname = "pivy-agent";
 
-	while ((ch = getopt(ac, av, "cCDdkisE:a:P:g:K:mZUS:")) != -1) {
+	while ((ch = getopt(ac, av, "cCDdkilsA:E:a:P:g:K:mZUS:T:")) != -1) {
 		switch (ch) {
 		case 'g':
-			guid = parse_hex(optarg, &len);
-			guid_len = len;
+			tokens = recallocarray(tokens, ntokens, ntokens + 1,
+			    sizeof (struct agent_token));
+			VERIFY(tokens != NULL);
+			at = &tokens[ntokens];
+			at->at_idx = ntokens++;
+			at->at_guid = parse_hex(optarg, &len);
+			at->at_guid_len = len;
 			if (len > 16) {
 				fprintf(stderr, "error: GUID must be <=16 bytes"
 				    " in length (you gave %u)\n", len);
@@ -2627,12 +5381,23 @@ main(int ac, char **av)
 			break;
 #endif
 		case 'K':
+			/*
+			 * A -K goes with the -g before it (or the first one,
+			 * if it comes before any).
+			 */
+			if ((ntokens == 0 && cak != NULL) ||
+			    (ntokens > 0 && tokens[ntokens - 1].at_cak != NULL))
+				usage();
 			cak = sshkey_new(KEY_UNSPEC);
 			VERIFY(cak != NULL);
 			ptr = optarg;
 			r = sshkey_read(cak, &ptr);
 			if (r != 0)
 				fatal("Invalid CAK key given: %ld", r);
+			if (ntokens > 0) {
+				tokens[ntokens - 1].at_cak = cak;
+				cak = NULL;
+			}
 			break;
 		case 'S':
 			err = parse_slot_spec(optarg);
@@ -2641,6 +5406,20 @@ main(int ac, char **av)
 				    optarg);
 			}
 			break;
+		case 'A':
+			err = parse_cak_spec(optarg);
+			if (err) {
+				errfx(1, err, "Invalid CAK recheck interval "
+				    "(-A): %s", optarg);
+			}
+			break;
+		case 'T':
+			err = parse_hold_spec(optarg);
+			if (err) {
+				errfx(1, err, "Invalid hold spec (-T): %s",
+				    optarg);
+			}
+			break;
 		case 'E':
 			fingerprint_hash = ssh_digest_alg_by_name(optarg);
 			if (fingerprint_hash == -1)
@@ -2666,6 +5445,9 @@ main(int ac, char **av)
 		case 'm':
 			sign_9d = B_TRUE;
 			break;
+		case 'l':
+			lazy_slots = B_TRUE;
+			break;
 		case 's':
 			if (c_flag)
 				usage();
@@ -2701,8 +5483,16 @@ main(int ac, char **av)
 		    strncmp(shell + len - 3, "csh", 3) == 0)
 			c_flag = 1;
 	}
-	if (guid == NULL)
+	if (ntokens == 0)
 		usage();
+	if (cak != NULL) {
+		if (tokens[0].at_cak != NULL)
+			usage();
+		tokens[0].at_cak = cak;
+		cak = NULL;
+	}
+	if (!k_flag && (err = piv_soft_card_add_env()))
+		errfx(1, err, "Failed to set up PIVY_SOFT_TOKEN");
 	if (k_flag) {
 		const char *errstr = NULL;
 
@@ -2852,6 +5642,12 @@ main(int ac, char **av)
 
 skip:
 
+	/*
+	 * From here on we don't want request handling to wait on stderr
+	 * (which may well be journald), so hand log output to a thread.
+	 */
+	bunyan_set_async();
+
 	r = mlockall(MCL_CURRENT | MCL_FUTURE);
 	if (r != 0) {
 		bunyan_log(BNY_WARN, "mlockall() failed, sensitive data (e.g. PIN) "
@@ -2860,21 +5656,31 @@ skip:
 	}
 
 	long pgsz = sysconf(_SC_PAGESIZE);
-	pinmem = mmap(NULL, 3*pgsz, PROT_READ | PROT_WRITE,
-	    MAP_PRIVATE | MAP_ANON, -1, 0);
-	VERIFY(pinmem != MAP_FAILED);
+	for (i = 0; i < ntokens; ++i) {
+		char *pinmem;
+
+		at = &tokens[i];
+		pinmem = mmap(NULL, 3*pgsz, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANON, -1, 0);
+		VERIFY(pinmem != MAP_FAILED);
 #if defined(MADV_DONTDUMP)
-	r = madvise(pinmem, 3*pgsz, MADV_DONTDUMP);
-	if (r != 0) {
-		bunyan_log(BNY_WARN, "madvice(MADV_DONTDUMP) failed, sensitive "
-		    "data (e.g. PIN) may be contined in core dumps",
-		    "error", BNY_STRING, strerror(errno), NULL);
-	}
+		r = madvise(pinmem, 3*pgsz, MADV_DONTDUMP);
+		if (r != 0) {
+			bunyan_log(BNY_WARN, "madvice(MADV_DONTDUMP) failed, "
+			    "sensitive data (e.g. PIN) may be contined in "
+			    "core dumps",
+			    "error", BNY_STRING, strerror(errno), NULL);
+		}
 #endif
-	VERIFY0(mprotect(pinmem, pgsz, PROT_NONE));
-	VERIFY0(mprotect(pinmem + 2*pgsz, pgsz, PROT_NONE));
-	pin = pinmem + pgsz;
-	explicit_bzero(pin, MAX_PIN_LEN);
+		VERIFY0(mprotect(pinmem, pgsz, PROT_NONE));
+		VERIFY0(mprotect(pinmem + 2*pgsz, pgsz, PROT_NONE));
+		at->at_pin = pinmem + pgsz;
+		explicit_bzero(at->at_pin, MAX_PIN_LEN);
+
+		at->at_probe_interval = card_probe_interval_nopin;
+		VERIFY0(pthread_mutex_init(&at->at_mtx, NULL));
+		VERIFY0(pthread_cond_init(&at->at_cv, NULL));
+	}
 
 	cleanup_pid = getpid();
 
@@ -2889,43 +5695,62 @@ skip:
 #endif
 	signal(SIGHUP, cleanup_handler);
 	signal(SIGTERM, cleanup_handler);
-
-	r = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &ctx);
-	if (r != SCARD_S_SUCCESS) {
-		err = pcscerrf("SCardEstablishContext", r);
-		bunyan_log(BNY_ERROR, "error setting up PCSC lib context",
-		    "error", BNY_ERF, err, NULL);
-		return (1);
+	signal(SIGUSR1, apdu_log_handler);
+
+	/* Each token worker needs its own PCSC context. */
+	for (i = 0; i < ntokens; ++i) {
+		r = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL,
+		    &tokens[i].at_ctx);
+		if (r != SCARD_S_SUCCESS) {
+			err = pcscerrf("SCardEstablishContext", r);
+			bunyan_log(BNY_ERROR, "error setting up PCSC lib "
+			    "context", "error", BNY_ERF, err, NULL);
+			return (1);
+		}
 	}
 
-	err = agent_piv_open();
-	if (err) {
-		errf_free(err);
-	} else {
-		agent_piv_close(B_TRUE);
-	}
-	last_op = monotime();
+	piv_apdu_observer = apdu_observe;
+
+	/*
+	 * Look these up now, before there are any token workers around to
+	 * race with each other over them.
+	 */
+	askpass = getenv("SSH_ASKPASS");
+	confirm = getenv("SSH_CONFIRM");
+	notify = getenv("SSH_NOTIFY_SEND");
+
+	card_watch_start();
+	token_workers_start();
 
 	while (1) {
-		prepare_poll(&pfd, &npfd, &timeout);
-		result = poll(pfd, npfd, timeout);
+#if defined(AGENT_EPOLL) || defined(AGENT_KQUEUE)
+		if (ev_fd != -1) {
+			result = ev_wait(poll_timeout());
+		} else
+#endif
+		{
+			prepare_poll(&pfd, &npfd, &timeout);
+			result = poll(pfd, npfd, timeout);
+		}
 		saved_errno = errno;
+		if (apdu_log_wanted)
+			apdu_log_dump();
 		if (parent_alive_interval != 0)
 			check_parent_exists();
-		now = monotime();
-		if (card_probe_interval != 0 &&
-		    (now - last_op) >= card_probe_interval * 1000) {
-			probe_card();
-		}
-		if (txnopen && now >= txntimeout)
-			agent_piv_close(B_TRUE);
 		/*(void) reaper();*/	/* remove expired keys */
 		if (result < 0) {
 			if (saved_errno == EINTR)
 				continue;
 			fatal("poll: %s", strerror(saved_errno));
-		} else if (result > 0)
-			after_poll(pfd, npfd);
+		} else if (result > 0) {
+#if defined(AGENT_EPOLL) || defined(AGENT_KQUEUE)
+			if (ev_fd != -1)
+				ev_dispatch(result);
+			else
+#endif
+				after_poll(pfd, npfd);
+			process_pending();
+		}
 	}
 	/* NOTREACHED */
 }
@@ -0,0 +1,604 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Offline micro-benchmarks for the layers that don't need a card: the ebox
+ * format and streams, SSS, chacha/poly1305, ed25519 and TLV parsing. Built
+ * from the same objects as pivy-box, so "make bench" numbers track what ships.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <errno.h>
+#include <strings.h>
+#include <err.h>
+
+#include "libssh/sshkey.h"
+#include "libssh/sshbuf.h"
+#include "libssh/ssherr.h"
+
+#include "ed25519/crypto_api.h"
+#include "ed25519/fe25519.h"
+#include "chapoly/chacha.h"
+#include "chapoly/poly1305.h"
+#include "sss/hazmat.h"
+
+#include "utils.h"
+#include "debug.h"
+#include "tlv.h"
+#include "errf.h"
+#include "piv.h"
+#include "ebox.h"
+
+enum pivy_bench_exit_status {
+	EXIT_OK = 0,
+	EXIT_ERROR = 1,
+	EXIT_BAD_ARGS = 2,
+};
+
+/* Size of the bulk buffer used by the throughput benchmarks. */
+#define	BENCH_BULK_LEN		(128 * 1024)
+
+static double bench_secs = 0.5;
+static boolean_t bench_json = B_FALSE;
+static const char *bench_filter = NULL;
+static uint bench_nresults = 0;
+
+static uint8_t *bulk;
+static struct ebox_tpl *tpl;
+
+/*
+ * A benchmark runs its operation "n" times and returns the number of bytes
+ * each run processed (0 for operations where only the rate matters).
+ */
+struct bench {
+	const char	*b_name;
+	size_t		(*b_func)(uint64_t n);
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+bench_check(errf_t *err, const char *what)
+{
+	if (err != ERRF_OK)
+		errfx(EXIT_ERROR, err, "%s failed", what);
+}
+
+static size_t
+bench_chacha(uint64_t n)
+{
+	static const uint8_t key[32], iv[CHACHA_NONCELEN], ctr[CHACHA_CTRLEN];
+	struct chacha_ctx ctx;
+	uint64_t i;
+
+	chacha_keysetup(&ctx, key, 256);
+	chacha_ivsetup(&ctx, iv, ctr);
+	for (i = 0; i < n; ++i)
+		chacha_encrypt_bytes(&ctx, bulk, bulk, BENCH_BULK_LEN);
+	return (BENCH_BULK_LEN);
+}
+
+static size_t
+bench_poly1305(uint64_t n)
+{
+	static const uint8_t key[POLY1305_KEYLEN];
+	uint8_t tag[POLY1305_TAGLEN];
+	uint64_t i;
+
+	for (i = 0; i < n; ++i)
+		poly1305_auth(tag, bulk, BENCH_BULK_LEN, key);
+	return (BENCH_BULK_LEN);
+}
+
+static size_t
+bench_fe25519_mul(uint64_t n)
+{
+	fe25519 a, b;
+	uint8_t buf[32];
+	uint64_t i;
+
+	arc4random_buf(buf, sizeof (buf));
+	fe25519_unpack(&a, buf);
+	arc4random_buf(buf, sizeof (buf));
+	fe25519_unpack(&b, buf);
+	for (i = 0; i < n; ++i)
+		fe25519_mul(&a, &a, &b);
+	fe25519_pack(buf, &a);
+	return (0);
+}
+
+static size_t
+bench_fe25519_invert(uint64_t n)
+{
+	fe25519 a;
+	uint8_t buf[32];
+	uint64_t i;
+
+	arc4random_buf(buf, sizeof (buf));
+	fe25519_unpack(&a, buf);
+	for (i = 0; i < n; ++i)
+		fe25519_invert(&a, &a);
+	fe25519_pack(buf, &a);
+	return (0);
+}
+
+static size_t
+bench_ed25519_sign(uint64_t n)
+{
+	uint8_t pk[crypto_sign_ed25519_PUBLICKEYBYTES];
+	uint8_t sk[crypto_sign_ed25519_SECRETKEYBYTES];
+	uint8_t sm[64 + crypto_sign_ed25519_BYTES];
+	unsigned long long smlen;
+	uint64_t i;
+
+	VERIFY0(crypto_sign_ed25519_keypair(pk, sk));
+	for (i = 0; i < n; ++i)
+		VERIFY0(crypto_sign_ed25519(sm, &smlen, bulk, 64, sk));
+	return (0);
+}
+
+static size_t
+bench_ed25519_verify(uint64_t n)
+{
+	uint8_t pk[crypto_sign_ed25519_PUBLICKEYBYTES];
+	uint8_t sk[crypto_sign_ed25519_SECRETKEYBYTES];
+	uint8_t sm[64 + crypto_sign_ed25519_BYTES];
+	uint8_t m[sizeof (sm)];
+	unsigned long long smlen, mlen;
+	uint64_t i;
+
+	VERIFY0(crypto_sign_ed25519_keypair(pk, sk));
+	VERIFY0(crypto_sign_ed25519(sm, &smlen, bulk, 64, sk));
+	for (i = 0; i < n; ++i)
+		VERIFY0(crypto_sign_ed25519_open(m, &mlen, sm, smlen, pk));
+	return (0);
+}
+
+static size_t
+bench_sss_create(uint64_t n)
+{
+	sss_Keyshare shares[5];
+	uint64_t i;
+
+	for (i = 0; i < n; ++i)
+		sss_create_keyshares(shares, bulk, 5, 3);
+	return (0);
+}
+
+static size_t
+bench_sss_combine(uint64_t n)
+{
+	sss_Keyshare shares[5];
+	uint8_t key[32];
+	uint64_t i;
+
+	sss_create_keyshares(shares, bulk, 5, 3);
+	for (i = 0; i < n; ++i)
+		sss_combine_keyshares(key, shares, 3);
+	VERIFY0(bcmp(key, bulk, sizeof (key)));
+	return (0);
+}
+
+/*
+ * A PIV cert object as it comes back from GET DATA: a 53 tag holding the
+ * DER cert (70), certinfo (71) and an empty LRC (FE).
+ */
+static size_t
+bench_tlv_parse(uint64_t n)
+{
+	struct tlv_state *w, ts, *r;
+	const uint8_t *data;
+	uint8_t *obj;
+	size_t objlen, len;
+	uint tag;
+	uint64_t i;
+
+	w = tlv_init_write();
+	tlv_pushl(w, 0x53, 2048);
+	tlv_pushl(w, 0x70, 1024);
+	tlv_write(w, bulk, 1024);
+	tlv_pop(w);
+	tlv_push(w, 0x71);
+	tlv_write_byte(w, 0x00);
+	tlv_pop(w);
+	tlv_push(w, 0xFE);
+	tlv_pop(w);
+	tlv_pop(w);
+	objlen = tlv_len(w);
+	obj = malloc(objlen);
+	VERIFY(obj != NULL);
+	bcopy(tlv_buf(w), obj, objlen);
+	tlv_free(w);
+
+	for (i = 0; i < n; ++i) {
+		r = tlv_init_local(&ts, obj, 0, objlen);
+		VERIFY(r != NULL);
+		bench_check(tlv_read_tag(r, &tag), "tlv_read_tag");
+		VERIFY3U(tag, ==, 0x53);
+		while (!tlv_at_end(r)) {
+			bench_check(tlv_read_tag(r, &tag), "tlv_read_tag");
+			bench_check(tlv_read_ref(r, &data, &len),
+			    "tlv_read_ref");
+			bench_check(tlv_end(r), "tlv_end");
+		}
+		bench_check(tlv_end(r), "tlv_end");
+		tlv_free(r);
+	}
+	free(obj);
+	return (objlen);
+}
+
+static struct ebox *
+make_ebox(void)
+{
+	struct ebox *box;
+	errf_t *err;
+
+	err = ebox_create(tpl, bulk, 32, NULL, 0, &box);
+	if (err != ERRF_OK)
+		errfx(EXIT_ERROR, err, "ebox_create failed");
+	return (box);
+}
+
+static size_t
+bench_ebox_create(uint64_t n)
+{
+	uint64_t i;
+
+	for (i = 0; i < n; ++i)
+		ebox_free(make_ebox());
+	return (0);
+}
+
+static size_t
+bench_ebox_parse(uint64_t n)
+{
+	struct ebox *box;
+	struct sshbuf *buf, *rbuf;
+	uint64_t i;
+
+	box = make_ebox();
+	buf = sshbuf_new();
+	VERIFY(buf != NULL);
+	bench_check(sshbuf_put_ebox(buf, box), "sshbuf_put_ebox");
+	ebox_free(box);
+
+	for (i = 0; i < n; ++i) {
+		rbuf = sshbuf_from(sshbuf_ptr(buf), sshbuf_len(buf));
+		VERIFY(rbuf != NULL);
+		bench_check(sshbuf_get_ebox(rbuf, &box), "sshbuf_get_ebox");
+		ebox_free(box);
+		sshbuf_free(rbuf);
+	}
+	n = sshbuf_len(buf);
+	sshbuf_free(buf);
+	return (n);
+}
+
+static struct ebox_stream *
+make_stream(const char *cipher)
+{
+	struct ebox_stream *es;
+	errf_t *err;
+
+	if (cipher == NULL)
+		err = ebox_stream_new(tpl, &es);
+	else
+		err = ebox_stream_new_cipher(tpl, cipher, &es);
+	if (err == ERRF_OK)
+		err = ebox_stream_set_chunk_size(es, BENCH_BULK_LEN);
+	if (err != ERRF_OK)
+		errfx(EXIT_ERROR, err, "failed to set up ebox stream");
+	return (es);
+}
+
+static size_t
+bench_stream_enc(uint64_t n, const char *cipher)
+{
+	struct ebox_stream *es;
+	struct ebox_stream_chunk *chunk;
+	uint64_t i;
+
+	es = make_stream(cipher);
+	bench_check(ebox_stream_chunk_new(es, bulk, BENCH_BULK_LEN, 0,
+	    &chunk), "ebox_stream_chunk_new");
+
+	for (i = 0; i < n; ++i) {
+		bench_check(ebox_stream_chunk_reset(chunk, bulk,
+		    BENCH_BULK_LEN, i), "ebox_stream_chunk_reset");
+		bench_check(ebox_stream_encrypt_chunk(chunk),
+		    "ebox_stream_encrypt_chunk");
+	}
+
+	ebox_stream_chunk_free(chunk);
+	ebox_stream_free(es);
+	return (BENCH_BULK_LEN);
+}
+
+/*
+ * The decrypt benchmarks each encrypt one chunk the first time they run
+ * (during run_bench()'s calibration) and keep it, so the timed run only
+ * parses and decrypts.
+ */
+struct stream_ct {
+	const char		*sc_cipher;
+	struct ebox_stream	*sc_stream;
+	struct sshbuf		*sc_buf;
+};
+
+static struct stream_ct stream_ct_default = { NULL, NULL, NULL };
+static struct stream_ct stream_ct_aead = {
+	"chacha20-poly1305", NULL, NULL
+};
+
+static size_t
+bench_stream_dec(uint64_t n, struct stream_ct *sc)
+{
+	struct ebox_stream_chunk *chunk;
+	struct sshbuf *rbuf;
+	const uint8_t *data;
+	size_t len;
+	uint64_t i;
+
+	if (sc->sc_buf == NULL) {
+		sc->sc_stream = make_stream(sc->sc_cipher);
+		sc->sc_buf = sshbuf_new();
+		VERIFY(sc->sc_buf != NULL);
+		bench_check(ebox_stream_chunk_new(sc->sc_stream, bulk,
+		    BENCH_BULK_LEN, 0, &chunk), "ebox_stream_chunk_new");
+		bench_check(ebox_stream_encrypt_chunk(chunk),
+		    "ebox_stream_encrypt_chunk");
+		bench_check(sshbuf_put_ebox_stream_chunk(sc->sc_buf, chunk),
+		    "sshbuf_put_ebox_stream_chunk");
+		ebox_stream_chunk_free(chunk);
+	}
+
+	for (i = 0; i < n; ++i) {
+		rbuf = sshbuf_from(sshbuf_ptr(sc->sc_buf),
+		    sshbuf_len(sc->sc_buf));
+		VERIFY(rbuf != NULL);
+		bench_check(sshbuf_get_ebox_stream_chunk_ref(rbuf,
+		    sc->sc_stream, &chunk),
+		    "sshbuf_get_ebox_stream_chunk_ref");
+		bench_check(ebox_stream_decrypt_chunk(chunk),
+		    "ebox_stream_decrypt_chunk");
+		data = ebox_stream_chunk_data(chunk, &len);
+		VERIFY3U(len, ==, BENCH_BULK_LEN);
+		VERIFY(data != NULL);
+		ebox_stream_chunk_free(chunk);
+		sshbuf_free(rbuf);
+	}
+	return (BENCH_BULK_LEN);
+}
+
+static void
+stream_ct_free(struct stream_ct *sc)
+{
+	sshbuf_free(sc->sc_buf);
+	ebox_stream_free(sc->sc_stream);
+	sc->sc_buf = NULL;
+	sc->sc_stream = NULL;
+}
+
+static size_t
+bench_stream_encrypt(uint64_t n)
+{
+	return (bench_stream_enc(n, NULL));
+}
+
+static size_t
+bench_stream_decrypt(uint64_t n)
+{
+	return (bench_stream_dec(n, &stream_ct_default));
+}
+
+static size_t
+bench_stream_encrypt_aead(uint64_t n)
+{
+	return (bench_stream_enc(n, "chacha20-poly1305"));
+}
+
+static size_t
+bench_stream_decrypt_aead(uint64_t n)
+{
+	return (bench_stream_dec(n, &stream_ct_aead));
+}
+
+static const struct bench benches[] = {
+	{ "chacha20",			bench_chacha },
+	{ "poly1305",			bench_poly1305 },
+	{ "fe25519-mul",		bench_fe25519_mul },
+	{ "fe25519-invert",		bench_fe25519_invert },
+	{ "ed25519-sign",		bench_ed25519_sign },
+	{ "ed25519-verify",		bench_ed25519_verify },
+	{ "sss-create-3of5",		bench_sss_create },
+	{ "sss-combine-3of5",		bench_sss_combine },
+	{ "tlv-parse-cert",		bench_tlv_parse },
+	{ "ebox-create",		bench_ebox_create },
+	{ "ebox-parse",			bench_ebox_parse },
+	{ "stream-encrypt",		bench_stream_encrypt },
+	{ "stream-decrypt",		bench_stream_decrypt },
+	{ "stream-encrypt-aead",	bench_stream_encrypt_aead },
+	{ "stream-decrypt-aead",	bench_stream_decrypt_aead },
+	{ NULL, NULL }
+};
+
+static void
+report(const char *name, uint64_t n, uint64_t ns, size_t bytes)
+{
+	double nsop = (double)ns / n;
+	double mbs = 0.0;
+
+	if (bytes > 0)
+		mbs = ((double)bytes * n / (1024.0 * 1024.0)) / (ns / 1e9);
+
+	if (bench_json) {
+		printf("%s\n    {\"name\": \"%s\", \"iterations\": %llu, "
+		    "\"ns_per_op\": %.1f", bench_nresults > 0 ? "," : "", name,
+		    (unsigned long long)n, nsop);
+		if (bytes > 0)
+			printf(", \"bytes_per_op\": %zu, \"mib_per_s\": %.2f",
+			    bytes, mbs);
+		printf("}");
+	} else {
+		if (bench_nresults == 0) {
+			printf("%-22s %10s %14s %10s\n", "BENCHMARK", "N",
+			    "NS/OP", "MiB/S");
+		}
+		if (bytes > 0) {
+			printf("%-22s %10llu %14.1f %10.2f\n", name,
+			    (unsigned long long)n, nsop, mbs);
+		} else {
+			printf("%-22s %10llu %14.1f %10s\n", name,
+			    (unsigned long long)n, nsop, "-");
+		}
+	}
+	++bench_nresults;
+}
+
+/*
+ * Doubles the iteration count until one run takes at least a tenth of the
+ * time budget, then does a single timed run scaled to fill the budget.
+ */
+static void
+run_bench(const struct bench *b)
+{
+	uint64_t n = 1, t0, ns;
+	size_t bytes;
+
+	for (;;) {
+		t0 = now_ns();
+		(void) b->b_func(n);
+		ns = now_ns() - t0;
+		if (ns >= bench_secs * 1e8 || n >= (1ULL << 40))
+			break;
+		n *= 2;
+	}
+	n = (uint64_t)(n * (bench_secs * 1e9 / (ns > 0 ? ns : 1)));
+	if (n < 1)
+		n = 1;
+
+	t0 = now_ns();
+	bytes = b->b_func(n);
+	ns = now_ns() - t0;
+	report(b->b_name, n, ns, bytes);
+}
+
+static void
+setup_tpl(void)
+{
+	struct ebox_tpl_config *config;
+	struct ebox_tpl_part *part;
+	struct sshkey *key, *pubkey;
+	uint8_t guid[16];
+	uint i;
+	int rv;
+
+	tpl = ebox_tpl_alloc();
+	VERIFY(tpl != NULL);
+	config = ebox_tpl_config_alloc(EBOX_PRIMARY);
+	VERIFY(config != NULL);
+	ebox_tpl_add_config(tpl, config);
+
+	/* Three P-256 parts, as for a typical primary config. */
+	for (i = 0; i < 3; ++i) {
+		rv = sshkey_generate(KEY_ECDSA, 256, &key);
+		if (rv != 0) {
+			errfx(EXIT_ERROR, ssherrf("sshkey_generate", rv),
+			    "failed to generate key");
+		}
+		VERIFY0(sshkey_demote(key, &pubkey));
+		sshkey_free(key);
+		arc4random_buf(guid, sizeof (guid));
+		part = ebox_tpl_part_alloc(guid, sizeof (guid),
+		    PIV_SLOT_KEY_MGMT, pubkey);
+		VERIFY(part != NULL);
+		sshkey_free(pubkey);
+		ebox_tpl_config_add_part(config, part);
+	}
+}
+
+static void
+usage(void)
+{
+	const struct bench *b;
+
+	fprintf(stderr,
+	    "usage: pivy-bench [-j] [-t secs] [name-filter]\n"
+	    "Runs offline (no token needed) micro-benchmarks.\n"
+	    "Options:\n"
+	    "  -j                     Output results as JSON\n"
+	    "  -t <secs>              Time to spend on each benchmark\n"
+	    "                         (default 0.5)\n"
+	    "Benchmarks:\n");
+	for (b = benches; b->b_name != NULL; ++b)
+		fprintf(stderr, "  %s\n", b->b_name);
+	exit(EXIT_BAD_ARGS);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct bench *b;
+	char *p;
+	int c;
+
+	while ((c = getopt(argc, argv, "jt:")) != -1) {
+		switch (c) {
+		case 'j':
+			bench_json = B_TRUE;
+			break;
+		case 't':
+			errno = 0;
+			bench_secs = strtod(optarg, &p);
+			if (errno != 0 || *p != '\0' || bench_secs <= 0.0) {
+				warnx("invalid time '%s'", optarg);
+				usage();
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc)
+		bench_filter = argv[optind++];
+	if (optind < argc)
+		usage();
+
+	bulk = malloc(BENCH_BULK_LEN);
+	VERIFY(bulk != NULL);
+	arc4random_buf(bulk, BENCH_BULK_LEN);
+	setup_tpl();
+
+	if (bench_json)
+		printf("{\"version\": \"%s\", \"results\": [", PIVY_VERSION);
+	for (b = benches; b->b_name != NULL; ++b) {
+		if (bench_filter != NULL &&
+		    strstr(b->b_name, bench_filter) == NULL)
+			continue;
+		run_bench(b);
+	}
+	if (bench_json)
+		printf("\n]}\n");
+
+	stream_ct_free(&stream_ct_default);
+	stream_ct_free(&stream_ct_aead);
+	ebox_tpl_free(tpl);
+	free(bulk);
+	return (EXIT_OK);
+}
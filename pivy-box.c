@@ -21,6 +21,7 @@
 #include <limits.h>
 #include <err.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #if defined(__APPLE__)
 #include <PCSC/wintypes.h>
@@ -39,6 +40,8 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 
 #include "libssh/sshkey.h"
 #include "libssh/sshbuf.h"
@@ -65,6 +68,35 @@ static boolean_t ebox_raw_out = B_FALSE;
 static boolean_t ebox_interactive = B_FALSE;
 static struct ebox_tpl *ebox_stpl;
 static size_t ebox_keylen = 32;
+static uint ebox_stream_jobs = 1;
+static const char *ebox_stream_ciphername = "aes256-ctr";
+static size_t ebox_stream_chunksz = 0;		/* 0 = library default */
+static boolean_t ebox_stream_chunk_auto = B_FALSE;
+static const char *ebox_stream_comp = NULL;
+static boolean_t ebox_stream_trailer = B_FALSE;
+static size_t ebox_stream_offset = 0;
+static size_t ebox_stream_length = SIZE_MAX;
+
+/* Ephemeral keys per curve for the pool thread to keep ready. */
+#define	EBOX_EPHEM_POOL		16
+
+/*
+ * The commands that seal new boxes, and so are worth starting the ephemeral
+ * key pool thread for. Everything else at most makes the odd key on demand.
+ */
+static boolean_t
+op_seals_boxes(const char *type, const char *op)
+{
+	if (strcmp(type, "key") == 0) {
+		return (strcmp(op, "generate") == 0 ||
+		    strcmp(op, "lock") == 0 ||
+		    strcmp(op, "relock") == 0 ||
+		    strcmp(op, "relock-all") == 0);
+	}
+	if (strcmp(type, "stream") == 0)
+		return (strcmp(op, "encrypt") == 0);
+	return (B_FALSE);
+}
 
 static errf_t *
 parse_hex(const char *str, uint8_t **out, size_t *outlen)
@@ -870,6 +902,7 @@ interactive_unlock_ebox(struct ebox *ebox, const char *fn)
 	struct question *q;
 	struct answer *a;
 	char k = '0';
+	struct ebox_session *sess = ebox_local_session();
 
 	if (fn == NULL)
 		fn = "pivy-box data";
@@ -881,11 +914,13 @@ interactive_unlock_ebox(struct ebox *ebox, const char *fn)
 		if (ebox_tpl_config_type(tconfig) == EBOX_PRIMARY) {
 			part = ebox_config_next_part(config, NULL);
 			tpart = ebox_part_tpl(part);
-			error = local_unlock_agent(ebox_part_box(part));
+			error = ebox_session_agent_unlock(sess,
+			    ebox_part_box(part));
 			if (error) {
 				errf_free(error);
 				continue;
 			}
+			ebox_session_end(sess);
 			error = ebox_unlock(ebox, config);
 			if (error)
 				return (error);
@@ -899,21 +934,25 @@ interactive_unlock_ebox(struct ebox *ebox, const char *fn)
 		if (ebox_tpl_config_type(tconfig) == EBOX_PRIMARY) {
 			part = ebox_config_next_part(config, NULL);
 			tpart = ebox_part_tpl(part);
-			error = local_unlock(ebox_part_box(part),
-			    ebox_tpl_part_cak(tpart),
+			error = ebox_session_local_unlock(sess,
+			    ebox_part_box(part), ebox_tpl_part_cak(tpart),
 			    ebox_tpl_part_name(tpart));
-			if (error && !errf_caused_by(error, "NotFoundError"))
+			if (error && !errf_caused_by(error, "NotFoundError")) {
+				ebox_session_end(sess);
 				return (error);
+			}
 			if (error) {
 				errf_free(error);
 				continue;
 			}
+			ebox_session_end(sess);
 			error = ebox_unlock(ebox, config);
 			if (error)
 				return (error);
 			goto done;
 		}
 	}
+	ebox_session_end(sess);
 
 	if (ebox_batch) {
 		error = errf("InteractiveError", NULL,
@@ -1311,53 +1350,33 @@ cmd_tpl_show(int argc, char *argv[])
 static errf_t *
 cmd_tpl_list(int argc, char *argv[])
 {
-	struct dirent *ent;
-	DIR *d;
-	char *dpath;
-	char *fpath;
 	const struct ebox_tpl_path_ent *tpe;
-	struct ebox_tpl *tpl;
-	struct ebox_tpl_config *c;
-	struct answer a;
-	errf_t *err = NULL;
+	struct tpl_index *ti;
+	const struct tpl_index_ent *tie;
+	errf_t *err = NULL, *tierr;
 	boolean_t success = B_FALSE;
+	uint i;
 
 	tpe = ebox_tpl_path;
 	while (tpe != NULL) {
-		dpath = compose_path(tpe->tpe_segs, "");
-
-		d = opendir(dpath);
-		if (d == NULL) {
+		tierr = tpl_index_get(tpe, &ti);
+		if (tierr != ERRF_OK) {
 			errf_free(err);
-			err = errfno("opendir", errno, "%s", dpath);
+			err = tierr;
 			goto next;
 		}
 
-		printf("ebox templates in %s:\n", dpath);
-
-		while ((ent = readdir(d)) != NULL) {
-			if (ent->d_name[0] == '.')
-				continue;
-
-			fpath = compose_path(tpe->tpe_segs, ent->d_name);
-			tpl = read_tpl_file(fpath);
-
-			printf("  %s:\n", ent->d_name);
-			c = NULL;
-			while ((c = ebox_tpl_next_config(tpl, c)) != NULL) {
-				bzero(&a, sizeof (a));
-				make_answer_text_for_config(c, &a);
-				printf("   * %s\n", a.a_text);
-			}
+		printf("ebox templates in %s:\n", ti->ti_dpath);
 
-			free(fpath);
+		for (tie = ti->ti_ents; tie != NULL; tie = tie->tie_next) {
+			printf("  %s:\n", tie->tie_name);
+			for (i = 0; i < tie->tie_nconfigs; ++i)
+				printf("   * %s\n", tie->tie_configs[i]);
 		}
 		success = B_TRUE;
 		printf("\n");
 
-		closedir(d);
-
-		free(dpath);
+		tpl_index_free(ti);
 
 next:
 		tpe = tpe->tpe_next;
@@ -1508,6 +1527,278 @@ cmd_key_relock(int argc, char *argv[])
 	return (ERRF_OK);
 }
 
+/*
+ * "key relock-all": relock a whole set of ebox files to a new template.
+ *
+ * Everything is read and parsed up front, then unlocked together in one
+ * unlock session (local_unlock_eboxes()), so each token is found and asked
+ * for its PIN once no matter how many of the eboxes it can open. Anything
+ * that's left over goes through interactive_unlock_ebox() as usual.
+ *
+ * Making the new eboxes doesn't need any hardware, so that's done on a pool
+ * of -j threads, each of which writes its results back to the original file
+ * via a temporary file and rename(), so a file always holds either the old
+ * ebox or the new one.
+ */
+struct relock_all {
+	struct ebox **ra_eboxes;
+	const char **ra_fnames;
+	boolean_t *ra_unlocked;
+	errf_t **ra_errs;
+	size_t ra_n;
+	size_t ra_next;		/* atomic */
+	size_t ra_done;		/* atomic */
+};
+
+static errf_t *
+write_file_atomic(const char *fname, const uint8_t *data, size_t len)
+{
+	struct stat st;
+	char *tmp;
+	int fd;
+	ssize_t done;
+	size_t off = 0;
+	errf_t *error = ERRF_OK;
+
+	if (asprintf(&tmp, "%s.XXXXXX", fname) < 0)
+		return (ERRF_NOMEM);
+	if ((fd = mkstemp(tmp)) < 0) {
+		error = errfno("mkstemp", errno, "creating temp file for %s",
+		    fname);
+		free(tmp);
+		return (error);
+	}
+	if (stat(fname, &st) == 0)
+		(void) fchmod(fd, st.st_mode & 07777);
+	while (off < len) {
+		done = write(fd, data + off, len - off);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done < 0) {
+			error = errfno("write", errno, "writing %s", tmp);
+			goto out;
+		}
+		off += done;
+	}
+	if (fsync(fd) != 0) {
+		error = errfno("fsync", errno, "writing %s", tmp);
+		goto out;
+	}
+	if (close(fd) != 0) {
+		fd = -1;
+		error = errfno("close", errno, "writing %s", tmp);
+		goto out;
+	}
+	fd = -1;
+	if (rename(tmp, fname) != 0)
+		error = errfno("rename", errno, "replacing %s", fname);
+out:
+	if (fd != -1)
+		(void) close(fd);
+	if (error)
+		(void) unlink(tmp);
+	free(tmp);
+	return (error);
+}
+
+static errf_t *
+relock_one(struct ebox *ebox, const char *fname)
+{
+	struct ebox *nebox;
+	struct sshbuf *buf;
+	const uint8_t *key;
+	size_t keylen, len, off, rem;
+	char *b64;
+	int rc;
+	errf_t *error;
+
+	key = ebox_key(ebox, &keylen);
+	if ((error = ebox_create(ebox_stpl, key, keylen, NULL, 0, &nebox)))
+		return (error);
+	if ((buf = sshbuf_new()) == NULL) {
+		ebox_free(nebox);
+		return (ERRF_NOMEM);
+	}
+	if ((error = sshbuf_put_ebox(buf, nebox)))
+		goto out;
+	if (!ebox_raw_out) {
+		/* Same line-wrapped base64 as printwrap() gives "relock". */
+		b64 = sshbuf_dtob64(buf);
+		sshbuf_reset(buf);
+		if (b64 == NULL) {
+			error = ERRF_NOMEM;
+			goto out;
+		}
+		len = strlen(b64);
+		for (off = 0; off < len; off += rem) {
+			rem = len - off;
+			if (rem > BASE64_LINE_LEN)
+				rem = BASE64_LINE_LEN;
+			if ((rc = sshbuf_put(buf, b64 + off, rem)) != 0 ||
+			    (rc = sshbuf_put_u8(buf, '\n')) != 0) {
+				error = ssherrf("sshbuf_put", rc);
+				break;
+			}
+		}
+		free(b64);
+		if (error)
+			goto out;
+	}
+	error = write_file_atomic(fname, sshbuf_ptr(buf), sshbuf_len(buf));
+out:
+	sshbuf_free(buf);
+	ebox_free(nebox);
+	return (error);
+}
+
+static void *
+relock_worker(void *arg)
+{
+	struct relock_all *ra = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&ra->ra_next, 1, __ATOMIC_RELAXED)) <
+	    ra->ra_n) {
+		if (ra->ra_unlocked[i]) {
+			ra->ra_errs[i] = relock_one(ra->ra_eboxes[i],
+			    ra->ra_fnames[i]);
+		}
+		(void) __atomic_add_fetch(&ra->ra_done, 1, __ATOMIC_RELEASE);
+	}
+	return (NULL);
+}
+
+static double
+relock_elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &now));
+	return ((now.tv_sec - start->tv_sec) +
+	    (now.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+static errf_t *
+cmd_key_relock_all(int argc, char *argv[])
+{
+	struct relock_all ra;
+	struct timespec start;
+	pthread_t *workers;
+	size_t i, n, done, nfail = 0;
+	boolean_t progress;
+	double secs;
+	errf_t *error;
+	FILE *file;
+	struct sshbuf *buf;
+	uint j, nworkers;
+
+	if (argc < 1) {
+		errx(EXIT_USAGE, "pivy-box key relock-all requires at least "
+		    "one file");
+	}
+	n = argc;
+
+	bzero(&ra, sizeof (ra));
+	ra.ra_n = n;
+	ra.ra_eboxes = calloc(n, sizeof (struct ebox *));
+	ra.ra_fnames = calloc(n, sizeof (const char *));
+	ra.ra_unlocked = calloc(n, sizeof (boolean_t));
+	ra.ra_errs = calloc(n, sizeof (errf_t *));
+	if (ra.ra_eboxes == NULL || ra.ra_fnames == NULL ||
+	    ra.ra_unlocked == NULL || ra.ra_errs == NULL)
+		err(EXIT_ERROR, "failed to allocate memory");
+
+	for (i = 0; i < n; ++i) {
+		ra.ra_fnames[i] = argv[i];
+		file = fopen(argv[i], "r");
+		if (file == NULL)
+			err(EXIT_USAGE, "failed to open file %s", argv[i]);
+		buf = read_file_b64(EBOX_MAX_SIZE, file);
+		fclose(file);
+		error = sshbuf_get_ebox(buf, &ra.ra_eboxes[i]);
+		if (error) {
+			errfx(EXIT_ERROR, error, "failed to parse %s as "
+			    "an ebox", argv[i]);
+		}
+		sshbuf_free(buf);
+	}
+
+	(void) mlockall(MCL_CURRENT | MCL_FUTURE);
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &start));
+	local_unlock_eboxes(ra.ra_eboxes, ra.ra_unlocked, n);
+	for (i = 0; i < n; ++i) {
+		if (ra.ra_unlocked[i])
+			continue;
+		error = interactive_unlock_ebox(ra.ra_eboxes[i],
+		    ra.ra_fnames[i]);
+		if (error) {
+			ra.ra_errs[i] = error;
+			continue;
+		}
+		ra.ra_unlocked[i] = B_TRUE;
+	}
+	if (!ebox_batch) {
+		fprintf(stderr, "unlocked %zu eboxes in %.1fs\n", n,
+		    relock_elapsed(&start));
+	}
+
+	nworkers = ebox_stream_jobs;
+	if (nworkers > n)
+		nworkers = n;
+	/* We're already keeping the CPUs busy, one ebox per thread. */
+	if (nworkers > 1)
+		ebox_set_seal_threads(1);
+	workers = calloc(nworkers, sizeof (pthread_t));
+	if (workers == NULL)
+		err(EXIT_ERROR, "failed to allocate memory");
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &start));
+	for (j = 0; j < nworkers; ++j)
+		VERIFY0(pthread_create(&workers[j], NULL, relock_worker, &ra));
+
+	progress = !ebox_batch && isatty(STDERR_FILENO);
+	while ((done = __atomic_load_n(&ra.ra_done, __ATOMIC_ACQUIRE)) < n) {
+		if (progress) {
+			secs = relock_elapsed(&start);
+			fprintf(stderr, "\rrelocking: %zu/%zu (%.0f/s)  ",
+			    done, n, (secs > 0) ? done / secs : 0.0);
+		}
+		(void) usleep(100000);
+	}
+	for (j = 0; j < nworkers; ++j)
+		VERIFY0(pthread_join(workers[j], NULL));
+	free(workers);
+	secs = relock_elapsed(&start);
+
+	for (i = 0; i < n; ++i) {
+		if (ra.ra_errs[i] == ERRF_OK)
+			continue;
+		++nfail;
+		warnfx(ra.ra_errs[i], "failed to relock %s", ra.ra_fnames[i]);
+		errf_free(ra.ra_errs[i]);
+	}
+	if (progress)
+		fprintf(stderr, "\r");
+	if (!ebox_batch) {
+		fprintf(stderr, "relocked %zu of %zu eboxes in %.1fs "
+		    "(%.0f/s, %u threads)\n", n - nfail, n, secs,
+		    (secs > 0) ? (n - nfail) / secs : 0.0, nworkers);
+	}
+
+	for (i = 0; i < n; ++i)
+		ebox_free(ra.ra_eboxes[i]);
+	free(ra.ra_eboxes);
+	free(ra.ra_fnames);
+	free(ra.ra_unlocked);
+	free(ra.ra_errs);
+
+	if (nfail > 0) {
+		return (errf("RelockError", NULL, "%zu of %zu eboxes could not "
+		    "be relocked", nfail, n));
+	}
+	return (ERRF_OK);
+}
+
 static errf_t *
 cmd_key_info(int argc, char *argv[])
 {
@@ -1609,140 +1900,1263 @@ cmd_key_unlock(int argc, char *argv[])
 	return (ERRF_OK);
 }
 
+/*
+ * Stream pipelines.
+ *
+ * "stream encrypt" and "stream decrypt" both read their input in chunks,
+ * transform each chunk (encrypt or decrypt it) and write the results out
+ * in the same order. With -j N we run N worker threads doing the transform
+ * step, while the main thread reads and a separate writer thread emits
+ * the results in sequence order, so the output is byte-for-byte identical
+ * to running serially.
+ *
+ * Chunks live in a fixed ring of slots (twice the number of workers, times
+ * the batch size) which move from FREE -> FILLED (by the reader) -> BUSY (a
+ * worker owns it) -> DONE -> FREE (once the writer has output it). All of
+ * the state is protected by a single mutex: with the default chunk size the
+ * time spent holding it is tiny compared to the crypto work.
+ *
+ * Workers take up to sp_batch FILLED slots at a time, so that streams with
+ * an HMAC can have the MACs of several chunks done at once (see
+ * ebox_stream_encrypt_chunks()). We only batch up as many chunks as fit in
+ * SPIPE_BATCH_BYTES, to keep the ring from getting too big.
+ *
+ * Errors from any stage are recorded against the slot they belong to, so
+ * that everything ahead of the failing chunk is still written out before
+ * we stop (just like the serial path).
+ *
+ * When the input is a regular file or a block device, each slot maps its
+ * own window of it (see spipe_map_input()) instead of reading into ss_buf,
+ * and the workers read straight out of the page cache. Output is written
+ * with writev() on the underlying fd, so that the chunk frame header and
+ * the ciphertext (or plaintext) go out in one call without being copied
+ * together first.
+ *
+ * A mapped input must not be truncated while we're running: touching a
+ * page of a window past the new end of the file gets us SIGBUS. We check
+ * the size of the file before mapping each window and go back to read()
+ * if it has shrunk (see spipe_map_check()), but that can't cover the file
+ * shrinking after a window has been handed to a worker.
+ */
+enum spipe_slot_state {
+	SLOT_FREE = 0,
+	SLOT_FILLED,
+	SLOT_BUSY,
+	SLOT_DONE
+};
+
+/* A chunk frame on the wire starts with a u32 seqnr and a u32 length */
+#define	SPIPE_FRAME_HDR		8
+
+#define	SPIPE_MAX_BATCH		16
+#define	SPIPE_BATCH_BYTES	(4 * 1024 * 1024)
+
+struct spipe_slot {
+	enum spipe_slot_state ss_state;
+	size_t ss_seq;
+	uint8_t *ss_buf;		/* input read into this slot */
+	size_t ss_bufsz;
+	const uint8_t *ss_in;		/* the input: ss_buf or in ss_map */
+	size_t ss_len;
+	void *ss_map;			/* mapped window of the input */
+	size_t ss_maplen;
+	uint8_t ss_hdr[SPIPE_FRAME_HDR];	/* encrypt: frame header */
+	size_t ss_hdrlen;
+	/*
+	 * Each slot holds on to its chunk between uses, which saves setting
+	 * up the buffers and the cipher and MAC contexts again every time.
+	 */
+	struct ebox_stream_chunk *ss_chunk;
+	const uint8_t *ss_data;		/* output, set by the work function */
+	size_t ss_datalen;
+	errf_t *ss_err;
+};
+
+struct spipe;
+
+/* Reads the next unit of input into a slot. Sets *eof at end of input. */
+typedef errf_t *(*spipe_read_f)(struct spipe *, struct spipe_slot *,
+    boolean_t *);
+/*
+ * Transforms a batch of filled slots, setting ss_err on each. Called on
+ * worker threads.
+ */
+typedef void (*spipe_work_f)(struct spipe *, struct spipe_slot **, uint);
+/*
+ * Called on each transformed slot just before it's written out, in order and
+ * on one thread at a time (so this is where any running state goes).
+ */
+typedef errf_t *(*spipe_post_f)(struct spipe *, struct spipe_slot *);
+
+/*
+ * Restricts a decrypt pipeline to a range of chunks (and of the plaintext
+ * they produce), for "stream decrypt -O/-L".
+ */
+struct spipe_range {
+	size_t sr_firstseq;
+	size_t sr_lastseq;
+	size_t sr_skip;		/* bytes of output to drop from the front */
+	size_t sr_len;		/* bytes of output to write after that */
+};
+
+struct spipe {
+	pthread_mutex_t sp_mtx;
+	pthread_cond_t sp_cv;
+	struct ebox_stream *sp_stream;
+	FILE *sp_in;
+	FILE *sp_out;
+	struct sshbuf *sp_lead;		/* already read, not yet consumed */
+	int sp_mapfd;			/* -1 if not mapping the input */
+	off_t sp_mapoff;		/* next byte of input to map */
+	off_t sp_mapend;
+	spipe_read_f sp_read;
+	spipe_work_f sp_work;
+	spipe_post_f sp_post;		/* may be NULL */
+	struct spipe_slot *sp_slots;
+	size_t sp_nslots;
+	uint sp_batch;
+	size_t sp_next_read;
+	size_t sp_next_work;
+	size_t sp_next_write;
+	size_t sp_seq;
+	size_t sp_firstseq;
+	size_t sp_maxseq;		/* 0 if unlimited */
+	boolean_t sp_trailer_seen;
+	size_t sp_skip;
+	size_t sp_limit;
+	boolean_t sp_eof;
+	boolean_t sp_abort;
+	errf_t *sp_err;
+};
+
+/*
+ * Reads exactly len bytes of input (using up anything left in lead first).
+ * The number of bytes read is only short at EOF.
+ */
+static errf_t *
+stream_input(FILE *in, struct sshbuf *lead, uint8_t *buf, size_t len,
+    size_t *got)
+{
+	size_t done = 0, n;
+
+	if (lead != NULL && sshbuf_len(lead) > 0) {
+		n = sshbuf_len(lead);
+		if (n > len)
+			n = len;
+		bcopy(sshbuf_ptr(lead), buf, n);
+		VERIFY0(sshbuf_consume(lead, n));
+		done += n;
+	}
+	while (done < len) {
+		n = fread(&buf[done], 1, len - done, in);
+		done += n;
+		if (n == 0 && ferror(in))
+			return (errfno("fread", errno, "reading stream input"));
+		if (n == 0 && feof(in))
+			break;
+	}
+	*got = done;
+	return (ERRF_OK);
+}
+
 static errf_t *
-cmd_stream_encrypt(int argc, char *argv[])
+spipe_input(struct spipe *sp, uint8_t *buf, size_t len, size_t *got)
 {
-	struct ebox_stream *es;
-	struct ebox_stream_chunk *esc;
-	errf_t *error;
-	uint8_t *ibuf;
-	struct sshbuf *obuf;
-	size_t chunksz, nread, nwrote;
-	size_t seq = 0;
+	return (stream_input(sp->sp_in, sp->sp_lead, buf, len, got));
+}
 
-	(void) mlockall(MCL_CURRENT | MCL_FUTURE);
+static void
+spipe_slot_reserve(struct spipe_slot *slot, size_t len)
+{
+	uint8_t *nbuf;
 
-	error = ebox_stream_new(ebox_stpl, &es);
-	if (error)
-		return (error);
-	chunksz = ebox_stream_chunk_size(es);
-	ibuf = malloc(chunksz);
-	if (ibuf == NULL)
-		errx(EXIT_ERROR, "failed to allocate memory");
-	obuf = sshbuf_new();
-	if (obuf == NULL)
+	if (slot->ss_bufsz >= len)
+		return;
+	nbuf = malloc(len);
+	if (nbuf == NULL)
 		errx(EXIT_ERROR, "failed to allocate memory");
+	freezero(slot->ss_buf, slot->ss_bufsz);
+	slot->ss_buf = nbuf;
+	slot->ss_bufsz = len;
+}
 
-	error = sshbuf_put_ebox_stream(obuf, es);
-	if (error)
-		return (error);
-	while (sshbuf_len(obuf) > 0) {
-		nwrote = fwrite(sshbuf_ptr(obuf), 1, sshbuf_len(obuf), stdout);
-		sshbuf_consume(obuf, nwrote);
-	}
-	sshbuf_reset(obuf);
+static void
+spipe_slot_unmap(struct spipe_slot *slot)
+{
+	if (slot->ss_map == NULL)
+		return;
+	VERIFY0(munmap(slot->ss_map, slot->ss_maplen));
+	slot->ss_map = NULL;
+	slot->ss_maplen = 0;
+}
 
-	while (!feof(stdin) && !ferror(stdin)) {
-		nread = fread(ibuf, 1, chunksz, stdin);
-		if (nread < 1)
-			continue;
-		error = ebox_stream_chunk_new(es, ibuf, nread, ++seq, &esc);
-		if (error)
-			return (error);
-		error = ebox_stream_encrypt_chunk(esc);
-		if (error)
-			return (error);
-		error = sshbuf_put_ebox_stream_chunk(obuf, esc);
-		if (error)
-			return (error);
-		while (sshbuf_len(obuf) > 0) {
-			nwrote = fwrite(sshbuf_ptr(obuf), 1, sshbuf_len(obuf),
-			    stdout);
-			sshbuf_consume(obuf, nwrote);
-		}
-		sshbuf_reset(obuf);
-		ebox_stream_chunk_free(esc);
+/*
+ * Decides whether we can map the input, and if so works out where the next
+ * byte to read is (anything in sp_lead is dropped: we'll map it again).
+ */
+static void
+spipe_map_setup(struct spipe *sp)
+{
+	struct stat st;
+	off_t pos, cur, end;
+	void *p;
+	int fd;
+
+	sp->sp_mapfd = -1;
+	fd = fileno(sp->sp_in);
+	if (fd == -1 || fstat(fd, &st) != 0)
+		return;
+	if (!S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode))
+		return;
+	if ((pos = ftello(sp->sp_in)) == -1)
+		return;
+	/* st_size isn't set for block devices. */
+	if ((cur = lseek(fd, 0, SEEK_CUR)) == -1)
+		return;
+	end = lseek(fd, 0, SEEK_END);
+	if (lseek(fd, cur, SEEK_SET) == -1)
+		err(EXIT_ERROR, "failed to restore input file offset");
+	if (end == -1)
+		return;
+
+	/* Make sure mapping works at all before we commit to it. */
+	p = mmap(NULL, 1, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		return;
+	VERIFY0(munmap(p, 1));
+
+	if (sp->sp_lead != NULL) {
+		pos -= sshbuf_len(sp->sp_lead);
+		sshbuf_reset(sp->sp_lead);
 	}
+	sp->sp_mapfd = fd;
+	sp->sp_mapoff = pos;
+	sp->sp_mapend = end;
+#if defined(POSIX_FADV_SEQUENTIAL)
+	(void) posix_fadvise(fd, pos, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
 
-	ebox_stream_free(es);
+/*
+ * Stops mapping the input if it's a regular file which has shrunk since
+ * spipe_map_setup() (mapping past its end now would get us SIGBUS), and
+ * carries on with read() from sp_mapoff instead. That sees the truncation
+ * the same way it would have if we'd never mapped anything.
+ */
+static errf_t *
+spipe_map_check(struct spipe *sp)
+{
+	struct stat st;
+
+	if (sp->sp_mapfd == -1)
+		return (ERRF_OK);
+	if (fstat(sp->sp_mapfd, &st) != 0)
+		return (errfno("fstat", errno, "checking stream input"));
+	if (!S_ISREG(st.st_mode) || st.st_size >= sp->sp_mapend)
+		return (ERRF_OK);
+	if (fseeko(sp->sp_in, sp->sp_mapoff, SEEK_SET) != 0)
+		return (errfno("fseeko", errno, "reading stream input"));
+	sp->sp_mapfd = -1;
 	return (ERRF_OK);
 }
 
+/*
+ * Maps up to len bytes of input starting at sp_mapoff as the slot's window
+ * (it stays mapped until the slot is next filled). The caller advances
+ * sp_mapoff past whatever it uses.
+ *
+ * We map a window per slot rather than the whole input so that what we
+ * have mapped at any one time stays proportional to the pipeline depth
+ * rather than the size of the input.
+ */
 static errf_t *
-cmd_stream_decrypt(int argc, char *argv[])
+spipe_map_input(struct spipe *sp, struct spipe_slot *slot, size_t len,
+    const uint8_t **pdata, size_t *got)
 {
-	struct ebox_stream *es = NULL;
-	struct ebox_stream_chunk *esc = NULL;
-	struct ebox *ebox;
-	errf_t *error;
-	uint8_t *buf;
+	off_t base;
+	size_t skew;
+	long pgsz;
+	void *p;
+
+	spipe_slot_unmap(slot);
+	if (sp->sp_mapend - sp->sp_mapoff < (off_t)len)
+		len = sp->sp_mapend - sp->sp_mapoff;
+	*got = len;
+	*pdata = NULL;
+	if (len == 0)
+		return (ERRF_OK);
+
+	pgsz = sysconf(_SC_PAGESIZE);
+	base = sp->sp_mapoff - (sp->sp_mapoff % pgsz);
+	skew = sp->sp_mapoff - base;
+	p = mmap(NULL, skew + len, PROT_READ, MAP_PRIVATE, sp->sp_mapfd, base);
+	if (p == MAP_FAILED)
+		return (errfno("mmap", errno, "mapping stream input"));
+	slot->ss_map = p;
+	slot->ss_maplen = skew + len;
+	*pdata = (const uint8_t *)p + skew;
+	return (ERRF_OK);
+}
+
+static errf_t *
+spipe_write_slot(struct spipe *sp, struct spipe_slot *slot)
+{
+	struct iovec iov[2], *v = iov;
 	const uint8_t *data;
-	struct sshbuf *ibuf, *nbuf;
-	size_t nread, nwrote, poff;
-	FILE *file;
-	const char *fname = NULL;
+	size_t len, nwrote;
+	ssize_t n;
+	int niov = 0;
+	errf_t *error = ERRF_OK;
+
+	data = slot->ss_data;
+	len = slot->ss_datalen;
+	if (sp->sp_skip > 0) {
+		nwrote = (len < sp->sp_skip) ? len : sp->sp_skip;
+		data += nwrote;
+		len -= nwrote;
+		sp->sp_skip -= nwrote;
+	}
+	if (len > sp->sp_limit)
+		len = sp->sp_limit;
+	sp->sp_limit -= len;
 
-	if (argc == 1) {
-		fname = argv[0];
-		file = fopen(fname, "r");
-		if (file == NULL)
-			err(EXIT_USAGE, "failed to open file %s", fname);
-	} else if (argc == 0) {
-		file = stdin;
-	} else {
-		errx(EXIT_USAGE, "too many arguments for pivy-box "
-		    "stream decrypt");
+	if (slot->ss_hdrlen > 0) {
+		iov[niov].iov_base = slot->ss_hdr;
+		iov[niov++].iov_len = slot->ss_hdrlen;
+	}
+	if (len > 0) {
+		iov[niov].iov_base = (void *)data;
+		iov[niov++].iov_len = len;
+	}
+	while (niov > 0) {
+		n = writev(fileno(sp->sp_out), v, niov);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1) {
+			error = errfno("writev", errno, "writing stream "
+			    "chunk %zu", slot->ss_seq);
+			break;
+		}
+		nwrote = n;
+		while (niov > 0 && nwrote >= v->iov_len) {
+			nwrote -= v->iov_len;
+			++v;
+			--niov;
+		}
+		if (niov > 0) {
+			v->iov_base = (uint8_t *)v->iov_base + nwrote;
+			v->iov_len -= nwrote;
+		}
 	}
+	return (error);
+}
 
-	(void) mlockall(MCL_CURRENT | MCL_FUTURE);
+static void *
+spipe_worker(void *arg)
+{
+	struct spipe *sp = arg;
+	struct spipe_slot *slot, *batch[SPIPE_MAX_BATCH];
+	uint i, n;
+
+	VERIFY0(pthread_mutex_lock(&sp->sp_mtx));
+	while (!sp->sp_abort) {
+		if (sp->sp_next_work == sp->sp_next_read) {
+			if (sp->sp_eof)
+				break;
+			VERIFY0(pthread_cond_wait(&sp->sp_cv, &sp->sp_mtx));
+			continue;
+		}
+		/* Take as many as are ready, up to a batch. */
+		n = 0;
+		while (n < sp->sp_batch &&
+		    sp->sp_next_work != sp->sp_next_read) {
+			slot = &sp->sp_slots[sp->sp_next_work % sp->sp_nslots];
+			++sp->sp_next_work;
+			/* The reader may have already failed this slot. */
+			if (slot->ss_state != SLOT_FILLED)
+				continue;
+			slot->ss_state = SLOT_BUSY;
+			batch[n++] = slot;
+		}
+		if (n == 0)
+			continue;
+		VERIFY0(pthread_mutex_unlock(&sp->sp_mtx));
 
-	buf = malloc(8192);
-	VERIFY(buf != NULL);
+		sp->sp_work(sp, batch, n);
 
-	ibuf = sshbuf_new();
-	VERIFY(ibuf != NULL);
+		VERIFY0(pthread_mutex_lock(&sp->sp_mtx));
+		for (i = 0; i < n; ++i)
+			batch[i]->ss_state = SLOT_DONE;
+		VERIFY0(pthread_cond_broadcast(&sp->sp_cv));
+	}
+	VERIFY0(pthread_mutex_unlock(&sp->sp_mtx));
+	return (NULL);
+}
 
-	while (es == NULL) {
-		nread = fread(buf, 1, 8192, file);
-		if (nread < 1 && ferror(file))
-			err(EXIT_ERROR, "failed to read input");
-		VERIFY0(sshbuf_put(ibuf, buf, nread));
+static void *
+spipe_writer(void *arg)
+{
+	struct spipe *sp = arg;
+	struct spipe_slot *slot;
+	errf_t *error;
 
-		poff = ibuf->off;
-		error = sshbuf_get_ebox_stream(ibuf, &es);
-		if (errf_caused_by(error, "IncompleteMessageError")) {
-			if (feof(file))
-				errfx(EXIT_ERROR, error, "input too short");
-			ibuf->off = poff;
-			errf_free(error);
+	VERIFY0(pthread_mutex_lock(&sp->sp_mtx));
+	while (!sp->sp_abort) {
+		slot = &sp->sp_slots[sp->sp_next_write % sp->sp_nslots];
+		if (sp->sp_next_write == sp->sp_next_read && sp->sp_eof)
+			break;
+		if (sp->sp_next_write == sp->sp_next_read ||
+		    slot->ss_state != SLOT_DONE) {
+			VERIFY0(pthread_cond_wait(&sp->sp_cv, &sp->sp_mtx));
 			continue;
-		} else if (error) {
+		}
+		VERIFY0(pthread_mutex_unlock(&sp->sp_mtx));
+
+		error = slot->ss_err;
+		slot->ss_err = NULL;
+		if (error == ERRF_OK && sp->sp_post != NULL)
+			error = sp->sp_post(sp, slot);
+		if (error == ERRF_OK)
+			error = spipe_write_slot(sp, slot);
+
+		VERIFY0(pthread_mutex_lock(&sp->sp_mtx));
+		if (error != ERRF_OK) {
+			sp->sp_err = error;
+			sp->sp_abort = B_TRUE;
+			VERIFY0(pthread_cond_broadcast(&sp->sp_cv));
+			break;
+		}
+		slot->ss_state = SLOT_FREE;
+		++sp->sp_next_write;
+		VERIFY0(pthread_cond_broadcast(&sp->sp_cv));
+	}
+	VERIFY0(pthread_mutex_unlock(&sp->sp_mtx));
+	return (NULL);
+}
+
+static errf_t *
+spipe_run_serial(struct spipe *sp)
+{
+	struct spipe_slot *slot, *batch[SPIPE_MAX_BATCH];
+	boolean_t eof = B_FALSE;
+	errf_t *error, *rerror = ERRF_OK;
+	uint i, n;
+
+	while (!eof && rerror == ERRF_OK) {
+		for (n = 0; n < sp->sp_batch && !eof; ++n) {
+			slot = &sp->sp_slots[n];
+			slot->ss_len = 0;
+			/* Finish what we've read before reporting this. */
+			if ((rerror = sp->sp_read(sp, slot, &eof)))
+				break;
+			if (slot->ss_len == 0)
+				break;
+			batch[n] = slot;
+		}
+		if (n == 0)
+			break;
+		sp->sp_work(sp, batch, n);
+		for (i = 0; i < n; ++i) {
+			slot = batch[i];
+			error = slot->ss_err;
+			slot->ss_err = NULL;
+			if (error == ERRF_OK && sp->sp_post != NULL)
+				error = sp->sp_post(sp, slot);
+			if (error == ERRF_OK)
+				error = spipe_write_slot(sp, slot);
+			if (error) {
+				errf_free(rerror);
+				return (error);
+			}
+		}
+	}
+	return (rerror);
+}
+
+static errf_t *
+spipe_run_parallel(struct spipe *sp, uint nworkers)
+{
+	struct spipe_slot *slot;
+	pthread_t *workers, writer;
+	boolean_t eof = B_FALSE;
+	errf_t *error;
+	uint i;
+
+	workers = calloc(nworkers, sizeof (pthread_t));
+	if (workers == NULL)
+		errx(EXIT_ERROR, "failed to allocate memory");
+	for (i = 0; i < nworkers; ++i) {
+		VERIFY0(pthread_create(&workers[i], NULL, spipe_worker, sp));
+	}
+	VERIFY0(pthread_create(&writer, NULL, spipe_writer, sp));
+
+	VERIFY0(pthread_mutex_lock(&sp->sp_mtx));
+	while (!sp->sp_abort && !eof) {
+		slot = &sp->sp_slots[sp->sp_next_read % sp->sp_nslots];
+		if (slot->ss_state != SLOT_FREE) {
+			VERIFY0(pthread_cond_wait(&sp->sp_cv, &sp->sp_mtx));
+			continue;
+		}
+		VERIFY0(pthread_mutex_unlock(&sp->sp_mtx));
+
+		/*
+		 * The slot is FREE and sp_next_read hasn't moved past it, so
+		 * nobody else will touch it while we fill it up.
+		 */
+		slot->ss_len = 0;
+		error = sp->sp_read(sp, slot, &eof);
+
+		VERIFY0(pthread_mutex_lock(&sp->sp_mtx));
+		if (error != ERRF_OK) {
+			slot->ss_err = error;
+			slot->ss_state = SLOT_DONE;
+			eof = B_TRUE;
+		} else if (slot->ss_len == 0) {
+			continue;
+		} else {
+			slot->ss_state = SLOT_FILLED;
+		}
+		++sp->sp_next_read;
+		VERIFY0(pthread_cond_broadcast(&sp->sp_cv));
+	}
+	sp->sp_eof = B_TRUE;
+	VERIFY0(pthread_cond_broadcast(&sp->sp_cv));
+	VERIFY0(pthread_mutex_unlock(&sp->sp_mtx));
+
+	for (i = 0; i < nworkers; ++i)
+		VERIFY0(pthread_join(workers[i], NULL));
+	VERIFY0(pthread_join(writer, NULL));
+	free(workers);
+
+	return (sp->sp_err);
+}
+
+static errf_t *
+spipe_run(struct ebox_stream *es, FILE *in, FILE *out, struct sshbuf *lead,
+    const struct spipe_range *range, spipe_read_f readf, spipe_work_f workf,
+    spipe_post_f postf, uint nworkers)
+{
+	struct spipe sp;
+	struct spipe_slot *slot;
+	errf_t *error;
+	uint i;
+
+	bzero(&sp, sizeof (sp));
+	sp.sp_stream = es;
+	sp.sp_in = in;
+	sp.sp_out = out;
+	sp.sp_lead = lead;
+	sp.sp_read = readf;
+	sp.sp_work = workf;
+	sp.sp_post = postf;
+	sp.sp_limit = SIZE_MAX;
+	sp.sp_firstseq = 1;
+	if (range != NULL) {
+		sp.sp_firstseq = range->sr_firstseq;
+		sp.sp_seq = range->sr_firstseq - 1;
+		sp.sp_maxseq = range->sr_lastseq;
+		sp.sp_skip = range->sr_skip;
+		sp.sp_limit = range->sr_len;
+	}
+	/* Anything written with stdio has to go out before our writev()s. */
+	if (fflush(out) != 0)
+		return (errfno("fflush", errno, "writing stream output"));
+	spipe_map_setup(&sp);
+
+	sp.sp_batch = ebox_stream_batch_size(es);
+	if (sp.sp_batch > SPIPE_MAX_BATCH)
+		sp.sp_batch = SPIPE_MAX_BATCH;
+	if (sp.sp_batch > SPIPE_BATCH_BYTES / ebox_stream_chunk_size(es))
+		sp.sp_batch = SPIPE_BATCH_BYTES / ebox_stream_chunk_size(es);
+	if (sp.sp_batch < 1)
+		sp.sp_batch = 1;
+	sp.sp_nslots = (nworkers > 1) ? 2 * nworkers * sp.sp_batch :
+	    sp.sp_batch;
+	sp.sp_slots = calloc(sp.sp_nslots, sizeof (struct spipe_slot));
+	if (sp.sp_slots == NULL)
+		errx(EXIT_ERROR, "failed to allocate memory");
+
+	if (nworkers > 1) {
+		VERIFY0(pthread_mutex_init(&sp.sp_mtx, NULL));
+		VERIFY0(pthread_cond_init(&sp.sp_cv, NULL));
+		error = spipe_run_parallel(&sp, nworkers);
+		VERIFY0(pthread_cond_destroy(&sp.sp_cv));
+		VERIFY0(pthread_mutex_destroy(&sp.sp_mtx));
+	} else {
+		error = spipe_run_serial(&sp);
+	}
+
+	for (i = 0; i < sp.sp_nslots; ++i) {
+		slot = &sp.sp_slots[i];
+		errf_free(slot->ss_err);
+		ebox_stream_chunk_free(slot->ss_chunk);
+		freezero(slot->ss_buf, slot->ss_bufsz);
+		spipe_slot_unmap(slot);
+	}
+	free(sp.sp_slots);
+
+	return (error);
+}
+
+static errf_t *
+spipe_read_plain(struct spipe *sp, struct spipe_slot *slot, boolean_t *eof)
+{
+	size_t chunksz = ebox_stream_chunk_size(sp->sp_stream);
+	errf_t *error;
+
+	if ((error = spipe_map_check(sp)))
+		return (error);
+	if (sp->sp_mapfd != -1) {
+		error = spipe_map_input(sp, slot, chunksz, &slot->ss_in,
+		    &slot->ss_len);
+		if (error)
+			return (error);
+		sp->sp_mapoff += slot->ss_len;
+	} else {
+		spipe_slot_reserve(slot, chunksz);
+		error = spipe_input(sp, slot->ss_buf, chunksz, &slot->ss_len);
+		if (error)
 			return (error);
+		slot->ss_in = slot->ss_buf;
+	}
+	if (slot->ss_len < chunksz)
+		*eof = B_TRUE;
+	if (slot->ss_len > 0)
+		slot->ss_seq = ++sp->sp_seq;
+	return (ERRF_OK);
+}
+
+static void
+spipe_encrypt(struct spipe *sp, struct spipe_slot **slots, uint n)
+{
+	struct spipe_slot *slot, *ready[SPIPE_MAX_BATCH];
+	struct ebox_stream_chunk *chunks[SPIPE_MAX_BATCH];
+	errf_t *errs[SPIPE_MAX_BATCH];
+	uint i, nready = 0;
+
+	for (i = 0; i < n; ++i) {
+		slot = slots[i];
+		if (slot->ss_chunk == NULL) {
+			slot->ss_err = ebox_stream_chunk_new(sp->sp_stream,
+			    slot->ss_in, slot->ss_len, slot->ss_seq,
+			    &slot->ss_chunk);
+		} else {
+			slot->ss_err = ebox_stream_chunk_reset(slot->ss_chunk,
+			    slot->ss_in, slot->ss_len, slot->ss_seq);
 		}
-		break;
+		if (slot->ss_err != ERRF_OK)
+			continue;
+		ready[nready] = slot;
+		chunks[nready++] = slot->ss_chunk;
 	}
+	ebox_stream_encrypt_chunks(chunks, nready, errs);
 
-	if (es == NULL) {
-		return (errf("IncompleteInputError", NULL,
-		    "input was incomplete"));
+	for (i = 0; i < nready; ++i) {
+		slot = ready[i];
+		if ((slot->ss_err = errs[i]) != ERRF_OK)
+			continue;
+		/* This is the same framing as sshbuf_put_ebox_stream_chunk(). */
+		slot->ss_data = ebox_stream_chunk_ciphertext(slot->ss_chunk,
+		    &slot->ss_datalen);
+		POKE_U32(&slot->ss_hdr[0], slot->ss_seq);
+		POKE_U32(&slot->ss_hdr[4], slot->ss_datalen);
+		slot->ss_hdrlen = sizeof (slot->ss_hdr);
 	}
+}
+
+static errf_t *
+spipe_encrypt_post(struct spipe *sp, struct spipe_slot *slot)
+{
+	if (!ebox_stream_has_trailer(sp->sp_stream))
+		return (ERRF_OK);
+	return (ebox_stream_add_chunk(sp->sp_stream, slot->ss_chunk));
+}
+
+/*
+ * On the wire a chunk is a u32 sequence number followed by an ssh-style
+ * string of ciphertext. We read the frame straight into the slot buffer (or
+ * map it) and then parse it in place with sshbuf_get_ebox_stream_chunk_ref().
+ */
+#define	SPIPE_FRAME_SLACK	1024
+
+/*
+ * Called once a frame has been read into a slot. The trailer (if the stream
+ * has one) must be the last thing in the input, unless an append is in
+ * progress (see EBOX_STREAM_F_APPENDING): then whatever follows it is left
+ * over from the append, and we stop reading.
+ */
+static errf_t *
+spipe_frame_read(struct spipe *sp, struct spipe_slot *slot, boolean_t trailer,
+    boolean_t *eof)
+{
+	uint8_t b;
+	size_t got;
+	errf_t *error;
+
+	if (!trailer) {
+		slot->ss_seq = ++sp->sp_seq;
+		return (ERRF_OK);
+	}
+	slot->ss_seq = 0;
+	sp->sp_trailer_seen = B_TRUE;
+	*eof = B_TRUE;
+
+	if (ebox_stream_appending(sp->sp_stream))
+		return (ERRF_OK);
+	if (sp->sp_mapfd != -1) {
+		got = (sp->sp_mapoff < sp->sp_mapend) ? 1 : 0;
+	} else if ((error = spipe_input(sp, &b, 1, &got))) {
+		return (error);
+	}
+	if (got > 0) {
+		return (errf("InvalidDataError", NULL, "input continues after "
+		    "the end of the stream"));
+	}
+	return (ERRF_OK);
+}
+
+static errf_t *
+spipe_read_frame(struct spipe *sp, struct spipe_slot *slot, boolean_t *eof)
+{
+	uint8_t hdr[SPIPE_FRAME_HDR];
+	const uint8_t *win = NULL;
+	size_t got, wgot = 0, len, maxlen;
+	boolean_t trailer;
+	errf_t *error;
+
+	if (sp->sp_maxseq != 0 && sp->sp_seq >= sp->sp_maxseq) {
+		*eof = B_TRUE;
+		return (ERRF_OK);
+	}
+	maxlen = ebox_stream_chunk_size(sp->sp_stream) + SPIPE_FRAME_SLACK;
+again:
+	if ((error = spipe_map_check(sp)))
+		return (error);
+	if (sp->sp_mapfd != -1) {
+		/* Map enough for the biggest frame we'd accept. */
+		error = spipe_map_input(sp, slot, sizeof (hdr) + maxlen, &win,
+		    &wgot);
+		if (error)
+			return (error);
+		got = (wgot < sizeof (hdr)) ? wgot : sizeof (hdr);
+		if (got > 0)
+			bcopy(win, hdr, got);
+	} else if ((error = spipe_input(sp, hdr, sizeof (hdr), &got))) {
+		return (error);
+	}
+	if (got == 0) {
+		if (ebox_stream_has_trailer(sp->sp_stream) &&
+		    !sp->sp_trailer_seen) {
+			return (errf("IncompleteInputError", NULL, "input "
+			    "ended without the stream trailer (truncated "
+			    "after chunk %zu)", sp->sp_seq));
+		}
+		*eof = B_TRUE;
+		return (ERRF_OK);
+	}
+	if (got < sizeof (hdr)) {
+		return (errf("IncompleteInputError", NULL, "input too short "
+		    "(truncated chunk header after chunk %zu)", sp->sp_seq));
+	}
+	trailer = ebox_stream_is_trailer_seqnr(sp->sp_stream, PEEK_U32(hdr));
+	/*
+	 * In range mode we got here by seeking, so make sure we really are
+	 * reading the chunks we think we are.
+	 */
+	if (!trailer && sp->sp_maxseq != 0 &&
+	    PEEK_U32(hdr) != sp->sp_seq + 1) {
+		return (errf("InvalidDataError", NULL, "stream chunk out of "
+		    "sequence (expected %zu, got %u)", sp->sp_seq + 1,
+		    PEEK_U32(hdr)));
+	}
+	len = PEEK_U32(&hdr[4]);
+	if (len > maxlen) {
+		return (errf("InvalidDataError", NULL, "stream chunk length "
+		    "(%zu) is larger than the maximum for this stream (%zu)",
+		    len, maxlen));
+	}
+	/* A trailer some earlier append replaced: skip over it. */
+	if (ebox_stream_is_dead_seqnr(sp->sp_stream, PEEK_U32(hdr))) {
+		if (win != NULL) {
+			if (wgot < sizeof (hdr) + len)
+				goto truncated;
+			sp->sp_mapoff += sizeof (hdr) + len;
+			goto again;
+		}
+		spipe_slot_reserve(slot, len);
+		error = spipe_input(sp, slot->ss_buf, len, &got);
+		if (error)
+			return (error);
+		if (got < len)
+			goto truncated;
+		goto again;
+	}
+
+	if (win != NULL) {
+		if (wgot < sizeof (hdr) + len)
+			goto truncated;
+		sp->sp_mapoff += sizeof (hdr) + len;
+		slot->ss_in = win;
+		slot->ss_len = sizeof (hdr) + len;
+		return (spipe_frame_read(sp, slot, trailer, eof));
+	}
+
+	spipe_slot_reserve(slot, sizeof (hdr) + len);
+	bcopy(hdr, slot->ss_buf, sizeof (hdr));
+	if ((error = spipe_input(sp, &slot->ss_buf[sizeof (hdr)], len, &got)))
+		return (error);
+	if (got < len)
+		goto truncated;
+	slot->ss_in = slot->ss_buf;
+	slot->ss_len = sizeof (hdr) + len;
+	return (spipe_frame_read(sp, slot, trailer, eof));
+
+truncated:
+	return (errf("IncompleteInputError", NULL, "input too short "
+	    "(truncated chunk after chunk %zu)", sp->sp_seq));
+}
+
+static void
+spipe_decrypt(struct spipe *sp, struct spipe_slot **slots, uint n)
+{
+	struct spipe_slot *slot, *ready[SPIPE_MAX_BATCH];
+	struct ebox_stream_chunk *chunks[SPIPE_MAX_BATCH];
+	errf_t *errs[SPIPE_MAX_BATCH];
+	struct sshbuf *buf;
+	uint i, nready = 0;
+
+	for (i = 0; i < n; ++i) {
+		slot = slots[i];
+		buf = sshbuf_from(slot->ss_in, slot->ss_len);
+		if (buf == NULL) {
+			slot->ss_err = ERRF_NOMEM;
+			continue;
+		}
+		if (slot->ss_chunk == NULL) {
+			slot->ss_err = sshbuf_get_ebox_stream_chunk_ref(buf,
+			    sp->sp_stream, &slot->ss_chunk);
+		} else {
+			slot->ss_err = sshbuf_get_ebox_stream_chunk_into(buf,
+			    slot->ss_chunk);
+		}
+		sshbuf_free(buf);
+		if (slot->ss_err != ERRF_OK)
+			continue;
+		ready[nready] = slot;
+		chunks[nready++] = slot->ss_chunk;
+	}
+	ebox_stream_decrypt_chunks(chunks, nready, errs);
+
+	for (i = 0; i < nready; ++i) {
+		slot = ready[i];
+		if ((slot->ss_err = errs[i]) != ERRF_OK)
+			continue;
+		slot->ss_data = ebox_stream_chunk_data(slot->ss_chunk,
+		    &slot->ss_datalen);
+	}
+}
+
+/*
+ * Reading a whole stream, we add up its chunks to check against the trailer
+ * at the end. Reading a range of it, each chunk is checked against the
+ * trailer if we could read that first, and otherwise we only know where the
+ * stream ends if we get as far as the trailer.
+ */
+static errf_t *
+spipe_decrypt_post(struct spipe *sp, struct spipe_slot *slot)
+{
+	struct ebox_stream *es = sp->sp_stream;
+	uint64_t nchunks, plainlen;
+	errf_t *error;
+
+	if (!ebox_stream_has_trailer(es))
+		return (ERRF_OK);
+	if (!ebox_stream_chunk_is_trailer(slot->ss_chunk)) {
+		if (sp->sp_maxseq != 0)
+			return (ebox_stream_check_chunk(es, slot->ss_chunk));
+		return (ebox_stream_add_chunk(es, slot->ss_chunk));
+	}
+
+	slot->ss_datalen = 0;
+	if ((error = ebox_stream_read_trailer(es, slot->ss_chunk)))
+		return (error);
+	if (sp->sp_maxseq == 0)
+		return (ebox_stream_verify_trailer(es));
+	if ((error = ebox_stream_trailer_info(es, &nchunks, &plainlen)))
+		return (error);
+	/* Either we read up to the end, or the range started after it. */
+	if (nchunks == sp->sp_seq ||
+	    (sp->sp_seq < sp->sp_firstseq && nchunks < sp->sp_firstseq))
+		return (ERRF_OK);
+	return (errf("InvalidDataError", NULL, "stream trailer says there "
+	    "are %" PRIu64 " chunks, but it came after chunk %zu", nchunks,
+	    sp->sp_seq));
+}
+
+/*
+ * Picks a chunk size for "-s auto". Pipes and terminals get small chunks, so
+ * that data (e.g. logs being shipped) comes out the other end without waiting
+ * for a big buffer to fill. Large regular files get bigger chunks (aiming for
+ * around a thousand of them), which cuts down on per-chunk framing and MAC
+ * overhead.
+ */
+static size_t
+stream_auto_chunk_size(FILE *in)
+{
+	struct stat st;
+	size_t sz;
+
+	if (fstat(fileno(in), &st) != 0 || !S_ISREG(st.st_mode))
+		return (16 * 1024);
+	sz = 128 * 1024;
+	while (sz < 8 * 1024 * 1024 && (off_t)sz * 1024 < st.st_size)
+		sz *= 2;
+	return (sz);
+}
+
+/* Parses a size like "4096", "64k" or "2m". */
+static int
+parse_size(const char *str, size_t *psize)
+{
+	unsigned long long parsed, mult = 1;
+	char *p;
+
+	errno = 0;
+	parsed = strtoull(str, &p, 10);
+	if (errno != 0 || p == str)
+		return (-1);
+	if (*p == 'k' || *p == 'K') {
+		mult = 1024;
+		++p;
+	} else if (*p == 'm' || *p == 'M') {
+		mult = 1024 * 1024;
+		++p;
+	}
+	if (*p != '\0' || parsed > SIZE_MAX / mult)
+		return (-1);
+	*psize = parsed * mult;
+	return (0);
+}
+
+static errf_t *
+cmd_stream_encrypt(int argc, char *argv[])
+{
+	struct ebox_stream *es;
+	struct ebox_stream_chunk *tchunk;
+	errf_t *error;
+	struct sshbuf *obuf;
+	size_t nwrote;
+
+	/*
+	 * No mlockall() here: the stream key, shares and PIN live in the
+	 * locked pool (see calloc_locked()), and the chunk buffers are bulk
+	 * data we're happy for the kernel to page.
+	 */
+	error = ebox_stream_new_cipher(ebox_stpl, ebox_stream_ciphername, &es);
+	if (error)
+		return (error);
+	if (ebox_stream_chunk_auto)
+		ebox_stream_chunksz = stream_auto_chunk_size(stdin);
+	if (ebox_stream_chunksz != 0) {
+		error = ebox_stream_set_chunk_size(es, ebox_stream_chunksz);
+		if (error)
+			return (error);
+	}
+	if (ebox_stream_comp != NULL) {
+		error = ebox_stream_set_compression(es, ebox_stream_comp);
+		if (error)
+			return (error);
+	}
+	if (ebox_stream_trailer) {
+		error = ebox_stream_set_trailer(es, B_TRUE);
+		if (error)
+			return (error);
+	}
+	obuf = sshbuf_new();
+	if (obuf == NULL)
+		errx(EXIT_ERROR, "failed to allocate memory");
+
+	error = sshbuf_put_ebox_stream(obuf, es);
+	if (error)
+		return (error);
+	while (sshbuf_len(obuf) > 0) {
+		nwrote = fwrite(sshbuf_ptr(obuf), 1, sshbuf_len(obuf), stdout);
+		sshbuf_consume(obuf, nwrote);
+	}
+
+	error = spipe_run(es, stdin, stdout, NULL, NULL, spipe_read_plain,
+	    spipe_encrypt, spipe_encrypt_post, ebox_stream_jobs);
+	if (error)
+		return (error);
+
+	if (ebox_stream_has_trailer(es)) {
+		error = ebox_stream_trailer_chunk(es, &tchunk);
+		if (error)
+			return (error);
+		error = sshbuf_put_ebox_stream_chunk(obuf, tchunk);
+		ebox_stream_chunk_free(tchunk);
+		if (error)
+			return (error);
+		while (sshbuf_len(obuf) > 0) {
+			nwrote = fwrite(sshbuf_ptr(obuf), 1, sshbuf_len(obuf),
+			    stdout);
+			sshbuf_consume(obuf, nwrote);
+		}
+	}
+	sshbuf_free(obuf);
+
+	ebox_stream_free(es);
+	return (ERRF_OK);
+}
+
+/* Pushes data back onto the front of lead, to be read again. */
+static void
+stream_unread(struct sshbuf *lead, const uint8_t *data, size_t len)
+{
+	struct sshbuf *nbuf;
+
+	nbuf = sshbuf_new();
+	if (nbuf == NULL)
+		errx(EXIT_ERROR, "failed to allocate memory");
+	VERIFY0(sshbuf_put(nbuf, data, len));
+	VERIFY0(sshbuf_putb(nbuf, lead));
+	sshbuf_reset(lead);
+	VERIFY0(sshbuf_putb(lead, nbuf));
+	sshbuf_free(nbuf);
+}
+
+/*
+ * Skips over input until the next thing to read is the frame for chunk
+ * "want" (any bytes we had to read to find that out are left in lead).
+ *
+ * Since every chunk but the last is full-sized, we can normally work out
+ * where the chunk starts and seek straight there. If the input can't seek,
+ * the stream is compressed or has been appended to (so its chunks vary in
+ * size), or the frame there isn't the one we expected, we fall back to
+ * walking the frame headers from the start of the stream: that still avoids
+ * decrypting (and on a seekable file, even reading) any of the chunks we
+ * skip.
+ *
+ * If the stream ends before chunk "want", we leave the input at EOF.
+ */
+static errf_t *
+stream_seek_chunk(struct ebox_stream *es, FILE *file, off_t hdrend,
+    struct sshbuf *lead, size_t want)
+{
+	uint8_t hdr[SPIPE_FRAME_HDR];
+	uint8_t *buf;
+	size_t got, len, n;
+	off_t off;
+	errf_t *error;
+
+	if (hdrend != -1 && ebox_stream_compression(es) == NULL &&
+	    !ebox_stream_appended(es)) {
+		off = hdrend + ebox_stream_seek_offset(es,
+		    (want - 1) * ebox_stream_chunk_size(es));
+		if (fseeko(file, off, SEEK_SET) != 0) {
+			return (errfno("fseeko", errno, "seeking to stream "
+			    "chunk %zu", want));
+		}
+		sshbuf_reset(lead);
+		if ((error = stream_input(file, NULL, hdr, sizeof (hdr), &got)))
+			return (error);
+		if (got == sizeof (hdr) && PEEK_U32(hdr) == want) {
+			stream_unread(lead, hdr, sizeof (hdr));
+			return (ERRF_OK);
+		}
+		if (fseeko(file, hdrend, SEEK_SET) != 0) {
+			return (errfno("fseeko", errno, "seeking to start "
+			    "of stream"));
+		}
+	}
+
+	buf = malloc(8192);
+	if (buf == NULL)
+		return (ERRF_NOMEM);
+	while (1) {
+		if ((error = stream_input(file, lead, hdr, sizeof (hdr), &got)))
+			goto out;
+		if (got == 0)
+			goto out;
+		if (got < sizeof (hdr)) {
+			error = errf("IncompleteInputError", NULL, "input too "
+			    "short (truncated chunk header)");
+			goto out;
+		}
+		/* If we reach the trailer, "want" is past the end. */
+		if (PEEK_U32(hdr) == want ||
+		    ebox_stream_is_trailer_seqnr(es, PEEK_U32(hdr))) {
+			stream_unread(lead, hdr, sizeof (hdr));
+			goto out;
+		}
+		len = PEEK_U32(&hdr[4]);
+
+		n = (sshbuf_len(lead) < len) ? sshbuf_len(lead) : len;
+		VERIFY0(sshbuf_consume(lead, n));
+		len -= n;
+		if (len > 0 && hdrend != -1) {
+			if (fseeko(file, len, SEEK_CUR) != 0) {
+				error = errfno("fseeko", errno, "skipping "
+				    "stream chunk %u", PEEK_U32(hdr));
+				goto out;
+			}
+			continue;
+		}
+		while (len > 0) {
+			n = (len < 8192) ? len : 8192;
+			error = stream_input(file, NULL, buf, n, &got);
+			if (error)
+				goto out;
+			if (got < n) {
+				error = errf("IncompleteInputError", NULL,
+				    "input too short (truncated chunk %u)",
+				    PEEK_U32(hdr));
+				goto out;
+			}
+			len -= n;
+		}
+	}
+
+out:
+	free(buf);
+	return (error);
+}
+
+/*
+ * Finds the trailer in a seekable input. It's at the end, unless an append
+ * is in progress: then it's the first one that isn't dead, which we find by
+ * walking the frame headers from hdrend.
+ */
+static errf_t *
+stream_find_trailer(struct ebox_stream *es, FILE *file, off_t hdrend,
+    off_t *ptoff)
+{
+	uint8_t hdr[SPIPE_FRAME_HDR];
+	size_t got;
+	off_t off;
+	errf_t *error;
+
+	if (!ebox_stream_appending(es)) {
+		off = -(off_t)ebox_stream_trailer_size(es);
+		if (fseeko(file, off, SEEK_END) != 0 ||
+		    (off = ftello(file)) == -1) {
+			return (errfno("fseeko", errno, "seeking to stream "
+			    "trailer"));
+		}
+		*ptoff = off;
+		return (ERRF_OK);
+	}
+	for (off = hdrend; ; off += sizeof (hdr) + PEEK_U32(&hdr[4])) {
+		if (fseeko(file, off, SEEK_SET) != 0) {
+			return (errfno("fseeko", errno, "looking for stream "
+			    "trailer"));
+		}
+		error = stream_input(file, NULL, hdr, sizeof (hdr), &got);
+		if (error)
+			return (error);
+		if (got < sizeof (hdr)) {
+			return (errf("IncompleteInputError", NULL, "input "
+			    "ended without the stream trailer (it may have "
+			    "been truncated)"));
+		}
+		if (ebox_stream_is_trailer_seqnr(es, PEEK_U32(hdr)))
+			break;
+	}
+	*ptoff = off;
+	return (ERRF_OK);
+}
+
+/*
+ * Reads and decrypts the trailer from a seekable input (see
+ * stream_find_trailer()), leaving the file position where it was. If ptend
+ * isn't NULL, it gets the offset just past the end of the trailer.
+ */
+static errf_t *
+stream_read_trailer(struct ebox_stream *es, FILE *file, off_t hdrend,
+    off_t *ptend)
+{
+	struct ebox_stream_chunk *tchunk = NULL;
+	struct sshbuf *tbuf = NULL;
+	uint8_t *buf;
+	size_t len, got;
+	off_t pos, toff;
+	errf_t *error;
+
+	len = ebox_stream_trailer_size(es);
+	if ((pos = ftello(file)) == -1)
+		return (errfno("ftello", errno, "reading stream trailer"));
+	if ((error = stream_find_trailer(es, file, hdrend, &toff)))
+		return (error);
+	if (fseeko(file, toff, SEEK_SET) != 0) {
+		return (errfno("fseeko", errno, "seeking to stream "
+		    "trailer"));
+	}
+	buf = malloc(len);
+	if (buf == NULL)
+		return (ERRF_NOMEM);
+	error = stream_input(file, NULL, buf, len, &got);
+	if (error == ERRF_OK && got < len) {
+		error = errf("IncompleteInputError", NULL, "input too short "
+		    "(truncated stream trailer)");
+	}
+	if (error)
+		goto out;
+
+	tbuf = sshbuf_from(buf, len);
+	if (tbuf == NULL) {
+		error = ERRF_NOMEM;
+		goto out;
+	}
+	error = sshbuf_get_ebox_stream_chunk(tbuf, es, &tchunk);
+	if (error == ERRF_OK && (sshbuf_len(tbuf) != 0 ||
+	    !ebox_stream_chunk_is_trailer(tchunk))) {
+		error = errf("IncompleteInputError", NULL, "input doesn't end "
+		    "with the stream trailer (it may have been truncated)");
+	}
+	if (error == ERRF_OK)
+		error = ebox_stream_decrypt_chunk(tchunk);
+	if (error == ERRF_OK)
+		error = ebox_stream_read_trailer(es, tchunk);
+	if (error)
+		goto out;
+	if (ptend != NULL)
+		*ptend = toff + len;
+
+	if (fseeko(file, pos, SEEK_SET) != 0) {
+		error = errfno("fseeko", errno, "seeking back from stream "
+		    "trailer");
+	}
+
+out:
+	ebox_stream_chunk_free(tchunk);
+	sshbuf_free(tbuf);
+	free(buf);
+	return (error);
+}
 
-	ebox = ebox_stream_ebox(es);
+/*
+ * Reads the stream header from the start of a file. Anything we read past
+ * the end of it is left in ibuf.
+ */
+static errf_t *
+stream_read_header(FILE *file, struct sshbuf *ibuf, struct ebox_stream **pes)
+{
+	struct ebox_stream *es = NULL;
+	uint8_t *buf;
+	size_t nread, poff;
+	errf_t *error;
 
-	error = interactive_unlock_ebox(ebox, fname);
-	if (error)
-		return (error);
+	buf = malloc(8192);
+	VERIFY(buf != NULL);
 
-	while (1) {
+	while (es == NULL) {
 		nread = fread(buf, 1, 8192, file);
 		if (nread < 1 && ferror(file))
 			err(EXIT_ERROR, "failed to read input");
-		else if (nread < 1 && feof(file) && sshbuf_len(ibuf) == 0)
-			break;
 		VERIFY0(sshbuf_put(ibuf, buf, nread));
 
 		poff = ibuf->off;
-		error = sshbuf_get_ebox_stream_chunk(ibuf, es, &esc);
+		error = sshbuf_get_ebox_stream(ibuf, &es);
 		if (errf_caused_by(error, "IncompleteMessageError")) {
 			if (feof(file))
 				errfx(EXIT_ERROR, error, "input too short");
@@ -1750,35 +3164,427 @@ cmd_stream_decrypt(int argc, char *argv[])
 			errf_free(error);
 			continue;
 		} else if (error) {
+			free(buf);
 			return (error);
 		}
+		break;
+	}
+	free(buf);
+
+	if (es == NULL) {
+		return (errf("IncompleteInputError", NULL,
+		    "input was incomplete"));
+	}
+	*pes = es;
+	return (ERRF_OK);
+}
+
+static errf_t *
+cmd_stream_decrypt(int argc, char *argv[])
+{
+	struct ebox_stream *es = NULL;
+	struct ebox *ebox;
+	errf_t *error;
+	struct sshbuf *ibuf;
+	size_t chunksz;
+	struct spipe_range range, *rangep = NULL;
+	uint64_t nchunks, plainlen;
+	off_t hdrend;
+	FILE *file;
+	const char *fname = NULL;
+
+	if (argc == 1) {
+		fname = argv[0];
+		file = fopen(fname, "r");
+		if (file == NULL)
+			err(EXIT_USAGE, "failed to open file %s", fname);
+	} else if (argc == 0) {
+		file = stdin;
+	} else {
+		errx(EXIT_USAGE, "too many arguments for pivy-box "
+		    "stream decrypt");
+	}
+
+	/* See cmd_stream_encrypt() on why there's no mlockall() here. */
+	ibuf = sshbuf_new();
+	VERIFY(ibuf != NULL);
+
+	if ((error = stream_read_header(file, ibuf, &es)))
+		return (error);
+
+	ebox = ebox_stream_ebox(es);
 
-		error = ebox_stream_decrypt_chunk(esc);
+	error = interactive_unlock_ebox(ebox, fname);
+	if (error)
+		return (error);
+
+	if (ebox_stream_offset != 0 || ebox_stream_length != SIZE_MAX) {
+		if (ebox_stream_length == 0)
+			goto done;
+		bzero(&range, sizeof (range));
+		/*
+		 * We can't tell which chunk an offset is in when chunks in the
+		 * middle of the stream can be short, so read the whole thing
+		 * and drop what's outside the range on the way out.
+		 */
+		if (ebox_stream_appended(es)) {
+			range.sr_firstseq = 1;
+			range.sr_skip = ebox_stream_offset;
+			range.sr_len = ebox_stream_length;
+			rangep = &range;
+			goto run;
+		}
+		chunksz = ebox_stream_chunk_size(es);
+		range.sr_firstseq = ebox_stream_offset / chunksz + 1;
+		range.sr_skip = ebox_stream_offset % chunksz;
+		range.sr_len = ebox_stream_length;
+		if (ebox_stream_length > SIZE_MAX - ebox_stream_offset) {
+			range.sr_lastseq = SIZE_MAX;
+		} else {
+			range.sr_lastseq = (ebox_stream_offset +
+			    ebox_stream_length - 1) / chunksz + 1;
+		}
+		rangep = &range;
+
+		hdrend = ftello(file);
+		if (hdrend != -1)
+			hdrend -= sshbuf_len(ibuf);
+		/*
+		 * If we can, read the trailer first: then we know exactly
+		 * where the stream ends without reading the rest of it.
+		 */
+		if (hdrend != -1 && ebox_stream_has_trailer(es)) {
+			error = stream_read_trailer(es, file, hdrend, NULL);
+			if (error == ERRF_OK) {
+				error = ebox_stream_trailer_info(es, &nchunks,
+				    &plainlen);
+			}
+			if (error)
+				return (error);
+			if (ebox_stream_offset >= plainlen)
+				goto done;
+			if (range.sr_lastseq > nchunks)
+				range.sr_lastseq = nchunks;
+		}
+		error = stream_seek_chunk(es, file, hdrend, ibuf,
+		    range.sr_firstseq);
 		if (error)
 			return (error);
+	}
+
+run:
+	/*
+	 * Whatever is left over in ibuf after the stream header is the start
+	 * of the first chunk: it gets consumed before we read any more.
+	 */
+	error = spipe_run(es, file, stdout, ibuf, rangep, spipe_read_frame,
+	    spipe_decrypt, spipe_decrypt_post, ebox_stream_jobs);
+	if (error)
+		return (error);
+
+done:
+	sshbuf_free(ibuf);
+	ebox_stream_free(es);
+	return (ERRF_OK);
+}
+
+/*
+ * Writes the stream header's params back over the ones in an existing
+ * stream file (which they're the same size as) and syncs it.
+ */
+static errf_t *
+stream_update_params(struct ebox_stream *es, FILE *ofile, off_t hdrend,
+    const char *fname)
+{
+	struct sshbuf *buf;
+	errf_t *error;
+
+	buf = sshbuf_new();
+	if (buf == NULL)
+		return (ERRF_NOMEM);
+	if ((error = sshbuf_put_ebox_stream_params(buf, es)))
+		goto out;
+	if (fseeko(ofile, hdrend - sshbuf_len(buf), SEEK_SET) != 0 ||
+	    fwrite(sshbuf_ptr(buf), sshbuf_len(buf), 1, ofile) != 1 ||
+	    fflush(ofile) != 0) {
+		error = errfno("fwrite", errno, "updating stream header in %s",
+		    fname);
+		goto out;
+	}
+	if (fsync(fileno(ofile)) != 0)
+		error = errfno("fsync", errno, "writing %s", fname);
+out:
+	sshbuf_free(buf);
+	return (error);
+}
 
-		data = ebox_stream_chunk_data(esc, &nread);
+/*
+ * Adds more data from stdin to the end of an existing stream file, carrying
+ * on the chunk sequence with the same key (so we only unlock the ebox once
+ * and don't make a new one).
+ *
+ * A short last chunk is left as it is rather than re-encrypted with more
+ * data (it would have to keep its seqnr, and so its IV or nonce), and the
+ * stream is marked as appended instead. We walk the existing chunks to
+ * rebuild the Merkle tree from their tags (checking it against the trailer).
+ *
+ * The file is changed in place, so an append only costs as much as the new
+ * data; see EBOX_STREAM_F_APPENDING in ebox.c for how this stays safe if we
+ * die part way through. In short: the new chunks and trailer go after the
+ * old trailer and are synced before the old trailer is killed, so the file
+ * always reads as either the old stream or the new one.
+ */
+static errf_t *
+cmd_stream_append(int argc, char *argv[])
+{
+	struct ebox_stream *es = NULL;
+	struct ebox_stream_chunk *chunk = NULL;
+	struct spipe_range range;
+	struct sshbuf *ibuf, *buf = NULL;
+	uint8_t hdr[SPIPE_FRAME_HDR];
+	uint8_t *frame = NULL, b;
+	size_t taglen, len, got, framesz, datalen = 0, nchunks = 0;
+	off_t hdrend, off, lastoff = -1, end, tend;
+	struct stat st;
+	FILE *file, *ofile = NULL;
+	const char *fname;
+	errf_t *error;
+
+	if (argc != 1) {
+		errx(EXIT_USAGE, "pivy-box stream append takes exactly one "
+		    "file argument");
+	}
+	fname = argv[0];
+	file = fopen(fname, "r");
+	if (file == NULL)
+		err(EXIT_USAGE, "failed to open file %s", fname);
+	if (fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode))
+		errx(EXIT_USAGE, "%s is not a regular file", fname);
+
+	/* See cmd_stream_encrypt() on why there's no mlockall() here. */
+	ibuf = sshbuf_new();
+	VERIFY(ibuf != NULL);
+	if ((error = stream_read_header(file, ibuf, &es)))
+		return (error);
+	if ((hdrend = ftello(file)) == -1)
+		return (errfno("ftello", errno, "reading stream header"));
+	hdrend -= sshbuf_len(ibuf);
+	sshbuf_free(ibuf);
+	ibuf = NULL;
+
+	/*
+	 * Only the trailer tells us for sure how many chunks there are (and
+	 * so which seqnr, and IV, comes next): a file which has been cut
+	 * short, or torn part way through a write, can't be told apart from
+	 * a complete one without it.
+	 */
+	if (!ebox_stream_has_trailer(es)) {
+		return (errf("NoTrailerError", NULL, "%s has no trailer (only "
+		    "streams made with 'encrypt -T' can be appended to)",
+		    fname));
+	}
+
+	error = interactive_unlock_ebox(ebox_stream_ebox(es), fname);
+	if (error)
+		return (error);
+
+	if ((error = stream_read_trailer(es, file, hdrend, &tend)))
+		return (error);
+	end = tend - ebox_stream_trailer_size(es);
+
+	/*
+	 * Walk the frame headers to find the last chunk and (if we need them)
+	 * the tags at the end of each one, without decrypting anything.
+	 */
+	taglen = ebox_stream_tag_size(es);
+	framesz = SPIPE_FRAME_HDR + ebox_stream_chunk_size(es) +
+	    SPIPE_FRAME_SLACK;
+	frame = malloc(framesz);
+	if (frame == NULL)
+		return (ERRF_NOMEM);
+	for (off = hdrend; off < end; off += sizeof (hdr) + len) {
+		if (fseeko(file, off, SEEK_SET) != 0) {
+			error = errfno("fseeko", errno, "seeking to stream "
+			    "chunk %zu", nchunks + 1);
+			goto out;
+		}
+		error = stream_input(file, NULL, hdr, sizeof (hdr), &got);
+		if (error)
+			goto out;
+		len = PEEK_U32(&hdr[4]);
+		if (got < sizeof (hdr) || end - off < (off_t)(got + len)) {
+			error = errf("IncompleteInputError", NULL, "input too "
+			    "short (truncated chunk after chunk %zu)",
+			    nchunks);
+			goto out;
+		}
+		/* Trailers replaced by earlier appends. */
+		if (ebox_stream_is_dead_seqnr(es, PEEK_U32(hdr)))
+			continue;
+		if (PEEK_U32(hdr) != nchunks + 1) {
+			error = errf("InvalidDataError", NULL, "stream chunk "
+			    "out of sequence (expected %zu, got %u)",
+			    nchunks + 1, PEEK_U32(hdr));
+			goto out;
+		}
+		if (len < taglen || len > ebox_stream_chunk_size(es) +
+		    SPIPE_FRAME_SLACK) {
+			error = errf("InvalidDataError", NULL, "stream chunk "
+			    "%u has a bad length (%zu)", PEEK_U32(hdr), len);
+			goto out;
+		}
+		if (fseeko(file, len - taglen, SEEK_CUR) != 0) {
+			error = errfno("fseeko", errno, "seeking to tag of "
+			    "stream chunk %u", PEEK_U32(hdr));
+			goto out;
+		}
+		error = stream_input(file, NULL, frame, taglen, &got);
+		if (error == ERRF_OK) {
+			error = ebox_stream_add_tag(es, PEEK_U32(hdr), frame,
+			    taglen, 0);
+		}
+		if (error)
+			goto out;
+		lastoff = off;
+		++nchunks;
+	}
+	if (off != end) {
+		error = errf("InvalidDataError", NULL, "stream chunks overrun "
+		    "the trailer");
+		goto out;
+	}
+	if ((error = ebox_stream_resume(es)))
+		goto out;
 
-		nwrote = fwrite(data, 1, nread, stdout);
-		if (nwrote < nread)
-			err(EXIT_ERROR, "failed to write data");
+	if ((ofile = fopen(fname, "r+")) == NULL) {
+		error = errfno("fopen", errno, "opening %s for writing",
+		    fname);
+		goto out;
+	}
 
-		ebox_stream_chunk_free(esc);
-		esc = NULL;
+	/*
+	 * An earlier append didn't finish: drop whatever it left after the
+	 * trailer we just read.
+	 */
+	if (ebox_stream_appending(es)) {
+		if (ftruncate(fileno(ofile), tend) != 0) {
+			error = errfno("ftruncate", errno, "cutting off an "
+			    "unfinished append from %s", fname);
+			goto out;
+		}
+		ebox_stream_set_appending(es, B_FALSE);
+		if ((error = stream_update_params(es, ofile, hdrend, fname)))
+			goto out;
+	}
 
-		if (sshbuf_len(ibuf) > 0) {
-			nbuf = sshbuf_new();
-			VERIFY(nbuf != NULL);
-			VERIFY0(sshbuf_put(nbuf, sshbuf_ptr(ibuf),
-			    sshbuf_len(ibuf)));
-			sshbuf_free(ibuf);
-			ibuf = nbuf;
+	/* Nothing more to do without new data. */
+	if (fread(&b, 1, 1, stdin) < 1) {
+		if (ferror(stdin))
+			err(EXIT_ERROR, "failed to read input");
+		goto out;
+	}
+	ibuf = sshbuf_new();
+	VERIFY(ibuf != NULL);
+	VERIFY0(sshbuf_put_u8(ibuf, b));
+
+	/*
+	 * If the last chunk is short, the new ones will come after it, so
+	 * mark the stream as appended.
+	 */
+	if (lastoff != -1 && !ebox_stream_appended(es)) {
+		len = end - lastoff;
+		if (fseeko(file, lastoff, SEEK_SET) != 0) {
+			error = errfno("fseeko", errno, "seeking to last "
+			    "stream chunk");
+			goto out;
+		}
+		error = stream_input(file, NULL, frame, len, &got);
+		if (error)
+			goto out;
+		buf = sshbuf_from(frame, got);
+		if (buf == NULL) {
+			error = ERRF_NOMEM;
+			goto out;
 		}
+		error = sshbuf_get_ebox_stream_chunk(buf, es, &chunk);
+		if (error == ERRF_OK)
+			error = ebox_stream_decrypt_chunk(chunk);
+		if (error)
+			goto out;
+		(void) ebox_stream_chunk_data(chunk, &datalen);
+		sshbuf_free(buf);
+		buf = NULL;
+	}
+	if (chunk != NULL && datalen < ebox_stream_chunk_size(es))
+		ebox_stream_set_appended(es);
+	ebox_stream_set_appending(es, B_TRUE);
+	if ((error = stream_update_params(es, ofile, hdrend, fname)))
+		goto out;
+
+	/* spipe_run() writes to the fd directly, so flush stdio first. */
+	if (fflush(ofile) != 0 || fseeko(ofile, tend, SEEK_SET) != 0) {
+		error = errfno("fwrite", errno, "writing %s", fname);
+		goto out;
+	}
+	bzero(&range, sizeof (range));
+	range.sr_firstseq = nchunks + 1;
+	range.sr_len = SIZE_MAX;
+	error = spipe_run(es, stdin, ofile, ibuf, &range, spipe_read_plain,
+	    spipe_encrypt, spipe_encrypt_post, ebox_stream_jobs);
+	if (error)
+		goto out;
+
+	ebox_stream_chunk_free(chunk);
+	chunk = NULL;
+	if ((error = ebox_stream_trailer_chunk(es, &chunk)))
+		goto out;
+	buf = sshbuf_new();
+	if (buf == NULL) {
+		error = ERRF_NOMEM;
+		goto out;
+	}
+	if ((error = sshbuf_put_ebox_stream_chunk(buf, chunk)))
+		goto out;
+	/* spipe_run() wrote behind stdio's back: re-sync with fseeko */
+	if (fseeko(ofile, 0, SEEK_END) != 0 ||
+	    fwrite(sshbuf_ptr(buf), sshbuf_len(buf), 1, ofile) != 1 ||
+	    fflush(ofile) != 0) {
+		error = errfno("fwrite", errno, "writing stream trailer");
+		goto out;
 	}
+	if (fsync(fileno(ofile)) != 0) {
+		error = errfno("fsync", errno, "writing %s", fname);
+		goto out;
+	}
+
+	/*
+	 * The new chunks and trailer are safely on disk: killing the old
+	 * trailer is what makes readers carry on past it.
+	 */
+	POKE_U32(hdr, EBOX_STREAM_DEAD_SEQ);
+	if (fseeko(ofile, end, SEEK_SET) != 0 ||
+	    fwrite(hdr, 4, 1, ofile) != 1 || fflush(ofile) != 0) {
+		error = errfno("fwrite", errno, "replacing old stream "
+		    "trailer");
+		goto out;
+	}
+	if (fsync(fileno(ofile)) != 0) {
+		error = errfno("fsync", errno, "writing %s", fname);
+		goto out;
+	}
+	ebox_stream_set_appending(es, B_FALSE);
+	error = stream_update_params(es, ofile, hdrend, fname);
 
+out:
+	if (ofile != NULL && fclose(ofile) != 0 && error == ERRF_OK)
+		error = errfno("fclose", errno, "writing %s", fname);
+	(void) fclose(file);
+	ebox_stream_chunk_free(chunk);
+	sshbuf_free(ibuf);
+	sshbuf_free(buf);
+	free(frame);
 	ebox_stream_free(es);
-	ebox_stream_chunk_free(esc);
-	return (ERRF_OK);
+	return (error);
 }
 
 static void
@@ -1807,6 +3613,10 @@ print_challenge(const struct ebox_challenge *chal)
 	    ebox_challenge_desc(chal));
 	fprintf(stderr, "%-20s   %s\n", "Hostname",
 	    ebox_challenge_hostname(chal));
+	if (ebox_challenge_is_bundle(chal)) {
+		fprintf(stderr, "%-20s   %zu\n", "Parts in bundle",
+		    ebox_challenge_nboxes(chal));
+	}
 
 	bzero(&tmctime, sizeof (tmctime));
 	ctime = (time_t)ebox_challenge_ctime(chal);
@@ -1829,7 +3639,7 @@ cmd_challenge_info(int argc, char *argv[])
 	struct piv_ecdh_box *box;
 	errf_t *error;
 
-	sbuf = read_stdin_b64(TPL_MAX_SIZE);
+	sbuf = read_stdin_b64(CHAL_MAX_SIZE);
 	error = sshbuf_get_piv_box(sbuf, &box);
 	if (error) {
 		errfx(EXIT_ERROR, error, "failed to parse input as "
@@ -1853,6 +3663,45 @@ cmd_challenge_info(int argc, char *argv[])
 	return (NULL);
 }
 
+/*
+ * Opens every keybox in a challenge bundle. They're all for the same device,
+ * so with a session this is one transaction (and one PIN entry) for the lot.
+ */
+static errf_t *
+unlock_challenge_bundle(struct ebox_challenge *chal)
+{
+	struct ebox_session *sess = ebox_local_session();
+	struct piv_ecdh_box **boxes;
+	boolean_t *opened;
+	size_t i, n;
+	errf_t *error = ERRF_OK;
+
+	n = ebox_challenge_nboxes(chal);
+	boxes = calloc(n, sizeof (struct piv_ecdh_box *));
+	opened = calloc(n, sizeof (boolean_t));
+	if (boxes == NULL || opened == NULL)
+		err(EXIT_ERROR, "failed to allocate memory");
+	for (i = 0; i < n; ++i)
+		boxes[i] = ebox_challenge_box_at(chal, i);
+
+	ebox_session_agent_unlock_batch(sess, boxes, opened, n);
+	for (i = 0; i < n; ++i) {
+		if (opened[i])
+			continue;
+		error = ebox_session_local_unlock(sess, boxes[i], NULL, NULL);
+		if (error) {
+			error = errf("BundleError", error, "failed to unlock "
+			    "part %zu of %zu in bundle", i + 1, n);
+			break;
+		}
+	}
+	ebox_session_end(sess);
+
+	free(boxes);
+	free(opened);
+	return (error);
+}
+
 static errf_t *
 cmd_challenge_respond(int argc, char *argv[])
 {
@@ -1862,7 +3711,7 @@ cmd_challenge_respond(int argc, char *argv[])
 	errf_t *error;
 	char *line;
 
-	sbuf = read_stdin_b64(TPL_MAX_SIZE);
+	sbuf = read_stdin_b64(CHAL_MAX_SIZE);
 	error = sshbuf_get_piv_box(sbuf, &box);
 	if (error) {
 		errfx(EXIT_ERROR, error, "failed to parse input as "
@@ -1894,8 +3743,12 @@ cmd_challenge_respond(int argc, char *argv[])
 		exit(EXIT_ERROR);
 	free(line);
 
-	box = ebox_challenge_box(chal);
-	error = local_unlock(box, NULL, NULL);
+	if (ebox_challenge_is_bundle(chal)) {
+		error = unlock_challenge_bundle(chal);
+	} else {
+		box = ebox_challenge_box(chal);
+		error = local_unlock(box, NULL, NULL);
+	}
 	if (error) {
 		errfx(EXIT_ERROR, error, "failed to unlock challenge");
 	}
@@ -2027,7 +3880,9 @@ usage_tpl(const char *op)
 		    "usage: pivy-box tpl list\n"
 		    "\n"
 		    "Lists templates stored in the standard template path, with\n"
-		    "brief information about each.\n");
+		    "brief information about each. The information is kept in\n"
+		    "an index under $XDG_CACHE_HOME/pivy-box (or ~/.cache) and\n"
+		    "only changed templates are re-read.\n");
 	} else {
 noop:
 		fprintf(stderr,
@@ -2109,6 +3964,22 @@ usage_key(const char *op)
 		    "  -r         raw input, don't base64-decode stdin\n"
 		    "  -R         raw output, don't base64-encode stdout\n"
 		    "\n");
+	} else if (strcmp(op, "relock-all") == 0) {
+		fprintf(stderr,
+		    "usage: pivy-box key relock-all [-brR] [-j jobs] <newtpl> "
+		    "<file>...\n"
+		    "\n"
+		    "Relocks each of the given ebox files to a new template,\n"
+		    "replacing the file's contents. Each device is only asked\n"
+		    "for its PIN once for the whole set.\n"
+		    "\n"
+		    "Options:\n"
+		    "  -b         batch mode, don't talk to terminal\n"
+		    "  -j jobs    create new eboxes using this many threads\n"
+		    "             (0 = one per CPU, default 1)\n"
+		    "  -r         raw input, don't base64-decode files\n"
+		    "  -R         raw output, don't base64-encode files\n"
+		    "\n");
 	} else {
 noop:
 		fprintf(stderr,
@@ -2117,7 +3988,8 @@ noop:
 		    "  lock                  Ebox a pre-generated key\n"
 		    "  info                  Prints information about a key ebox\n"
 		    "  unlock                Unlock a key ebox\n"
-		    "  relock                Unlock + lock to new template\n");
+		    "  relock                Unlock + lock to new template\n"
+		    "  relock-all            Relock many ebox files at once\n");
 	}
 }
 
@@ -2128,13 +4000,36 @@ usage_stream(const char *op)
 		goto noop;
 	} else if (strcmp(op, "encrypt") == 0) {
 		fprintf(stderr,
-		    "usage: pivy-box stream encrypt <tpl>\n"
+		    "usage: pivy-box stream encrypt [-T] [-j jobs] [-c cipher] "
+		    "[-s size]\n"
+		    "                               [-z codec] <tpl>\n"
 		    "\n"
 		    "Accepts streaming data on stdin and encrypts it to the\n"
-		    "given template in chunks. Output is binary.\n");
+		    "given template in chunks. Output is binary.\n"
+		    "\n"
+		    "Options:\n"
+		    "  -j jobs    encrypt chunks using this many threads\n"
+		    "             (0 = one per CPU, default 1)\n"
+		    "  -c cipher  cipher to use: 'aes256-ctr' (default),\n"
+		    "             'aes128-ctr', 'aes192-ctr', 'aes128-gcm',\n"
+		    "             'aes256-gcm' or 'chacha20-poly1305' (faster\n"
+		    "             without AES hardware). All but the -ctr\n"
+		    "             ciphers need a newer pivy to decrypt.\n"
+		    "  -s size    plaintext bytes per chunk (e.g. 16k, 4m),\n"
+		    "             or 'auto' to pick based on the input\n"
+		    "             (default 128k)\n"
+		    "  -z codec   compress each chunk before encrypting it:\n"
+		    "             'zlib' or 'none' (default; 'zlib' needs a\n"
+		    "             newer pivy to decrypt)\n"
+		    "  -T         end the stream with a trailer, so that\n"
+		    "             truncation is detected when decrypting\n"
+		    "             (needs a newer pivy to decrypt)\n"
+		    "\n");
 	} else if (strcmp(op, "decrypt") == 0) {
 		fprintf(stderr,
-		    "usage: pivy-box stream decrypt [-b] [file]\n"
+		    "usage: pivy-box stream decrypt [-b] [-j jobs] [-O offset] "
+		    "[-L length]\n"
+		    "                               [file]\n"
 		    "\n"
 		    "Accepts output from 'stream encrypt' on stdin, decrypts\n"
 		    "it and outputs the plaintext. Data is only output after\n"
@@ -2142,13 +4037,37 @@ usage_stream(const char *op)
 		    "\n"
 		    "Options:\n"
 		    "  -b         batch mode, don't talk to terminal\n"
+		    "  -j jobs    decrypt chunks using this many threads\n"
+		    "             (0 = one per CPU, default 1)\n"
+		    "  -O offset  start output at this offset into the\n"
+		    "             plaintext (seeks past earlier chunks)\n"
+		    "  -L length  output at most this many bytes\n"
+		    "\n");
+	} else if (strcmp(op, "append") == 0) {
+		fprintf(stderr,
+		    "usage: pivy-box stream append [-b] [-j jobs] file\n"
+		    "\n"
+		    "Encrypts data from stdin and adds it to the end of an\n"
+		    "existing stream file, using the same key and settings\n"
+		    "(the stream's ebox is unlocked once, as for decrypt).\n"
+		    "The stream must have a trailer (see 'encrypt -T'). The\n"
+		    "file is updated in place, and still reads as the old\n"
+		    "stream if the append is interrupted. If the stream's\n"
+		    "last chunk isn't full, the result needs a newer pivy\n"
+		    "to decrypt.\n"
+		    "\n"
+		    "Options:\n"
+		    "  -b         batch mode, don't talk to terminal\n"
+		    "  -j jobs    encrypt chunks using this many threads\n"
+		    "             (0 = one per CPU, default 1)\n"
 		    "\n");
 	} else {
 noop:
 		fprintf(stderr,
 		    "pivy-box stream <op>:\n"
 		    "  encrypt               Encrypt streaming data\n"
-		    "  decrypt               Decrypt streaming data\n");
+		    "  decrypt               Decrypt streaming data\n"
+		    "  append                Add data to an encrypted stream\n");
 	}
 }
 
@@ -2174,7 +4093,11 @@ usage_challenge(const char *op)
 		    "waits for user confirmation before generating a response.\n"
 		    "\n"
 		    "The response must then be transported back to the program\n"
-		    "which generated the challenge to complete the process.\n");
+		    "which generated the challenge to complete the process.\n"
+		    "\n"
+		    "A challenge bundle (such as those from 'pivy-zfs\n"
+		    "unlock -r') covers many parts for the same device, and is\n"
+		    "answered with a single response.\n");
 	} else {
 noop:
 		fprintf(stderr,
@@ -2207,12 +4130,13 @@ usage(const char *type, const char *op)
 int
 main(int argc, char *argv[])
 {
-	const char *optstring = "bl:irRP:i:o:f:";
+	const char *optstring = "bl:irRP:i:o:f:j:O:L:c:s:z:T";
 	const char *type = NULL, *op = NULL, *tplname;
 	int c;
 	char tpl[PATH_MAX] = { 0 };
 	errf_t *error = NULL;
 	unsigned long int parsed;
+	unsigned long long parsedull;
 	char *p;
 
 	qa_term_setup();
@@ -2267,6 +4191,97 @@ main(int argc, char *argv[])
 			}
 			ebox_keylen = parsed;
 			break;
+		case 'j':
+			if (strcmp(type, "stream") != 0 &&
+			    (strcmp(type, "key") != 0 ||
+			    strcmp(op, "relock-all") != 0)) {
+				warnx("option -j only supported with "
+				    "'stream' and 'key relock-all' "
+				    "subcommands");
+				usage(type, op);
+				return (EXIT_USAGE);
+			}
+			errno = 0;
+			parsed = strtoul(optarg, &p, 0);
+			if (errno != 0 || *p != '\0' || parsed > 256) {
+				errx(EXIT_USAGE,
+				    "invalid argument for -j: '%s'", optarg);
+			}
+			if (parsed == 0) {
+				long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+				parsed = (ncpu < 1) ? 1 : ncpu;
+				if (parsed > 256)
+					parsed = 256;
+			}
+			ebox_stream_jobs = parsed;
+			break;
+		case 'c':
+			if (strcmp(type, "stream") != 0 ||
+			    strcmp(op, "encrypt") != 0) {
+				warnx("option -c only supported with "
+				    "'stream encrypt' subcommand");
+				usage(type, op);
+				return (EXIT_USAGE);
+			}
+			ebox_stream_ciphername = optarg;
+			break;
+		case 's':
+			if (strcmp(type, "stream") != 0 ||
+			    strcmp(op, "encrypt") != 0) {
+				warnx("option -s only supported with "
+				    "'stream encrypt' subcommand");
+				usage(type, op);
+				return (EXIT_USAGE);
+			}
+			if (strcmp(optarg, "auto") == 0) {
+				ebox_stream_chunk_auto = B_TRUE;
+				break;
+			}
+			if (parse_size(optarg, &ebox_stream_chunksz) != 0) {
+				errx(EXIT_USAGE,
+				    "invalid argument for -s: '%s'", optarg);
+			}
+			break;
+		case 'z':
+			if (strcmp(type, "stream") != 0 ||
+			    strcmp(op, "encrypt") != 0) {
+				warnx("option -z only supported with "
+				    "'stream encrypt' subcommand");
+				usage(type, op);
+				return (EXIT_USAGE);
+			}
+			ebox_stream_comp = optarg;
+			break;
+		case 'T':
+			if (strcmp(type, "stream") != 0 ||
+			    strcmp(op, "encrypt") != 0) {
+				warnx("option -T only supported with "
+				    "'stream encrypt' subcommand");
+				usage(type, op);
+				return (EXIT_USAGE);
+			}
+			ebox_stream_trailer = B_TRUE;
+			break;
+		case 'O':
+		case 'L':
+			if (strcmp(type, "stream") != 0 ||
+			    strcmp(op, "decrypt") != 0) {
+				warnx("option -%c only supported with "
+				    "'stream decrypt' subcommand", c);
+				usage(type, op);
+				return (EXIT_USAGE);
+			}
+			errno = 0;
+			parsedull = strtoull(optarg, &p, 0);
+			if (errno != 0 || *p != '\0' || parsedull > SIZE_MAX) {
+				errx(EXIT_USAGE,
+				    "invalid argument for -%c: '%s'", c, optarg);
+			}
+			if (c == 'O')
+				ebox_stream_offset = parsedull;
+			else
+				ebox_stream_length = parsedull;
+			break;
 		default:
 			usage(type, op);
 			return (EXIT_USAGE);
@@ -2276,6 +4291,19 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	if ((error = piv_soft_card_add_env()))
+		goto out;
+
+	/*
+	 * Commands that seal boxes get a thread making ephemeral keys ready
+	 * while we read input and talk to cards.
+	 */
+	if (op_seals_boxes(type, op)) {
+		piv_ephem_pool_init(EBOX_EPHEM_POOL);
+		if ((error = piv_ephem_pool_start()))
+			goto out;
+	}
+
 	if (strcmp(type, "tpl") == 0 || strcmp(type, "template") == 0) {
 		if (strcmp(op, "show") == 0 && argc == 0 && tpl[0] == 0) {
 			error = cmd_tpl_show(argc, argv);
@@ -2298,6 +4326,9 @@ main(int argc, char *argv[])
 		if (strcmp(op, "decrypt") == 0) {
 			error = cmd_stream_decrypt(argc, argv);
 			goto out;
+		} else if (strcmp(op, "append") == 0) {
+			error = cmd_stream_append(argc, argv);
+			goto out;
 		}
 
 	} else if (strcmp(type, "challenge") == 0) {
@@ -2372,6 +4403,11 @@ main(int argc, char *argv[])
 			ebox_stpl = read_tpl_file(tpl);
 			error = cmd_key_relock(argc, argv);
 			goto out;
+
+		} else if (strcmp(op, "relock-all") == 0) {
+			ebox_stpl = read_tpl_file(tpl);
+			error = cmd_key_relock_all(argc, argv);
+			goto out;
 		}
 
 	} else if (strcmp(type, "stream") == 0) {
@@ -87,6 +87,7 @@ unlock_or_recover(struct ebox *ebox, const char *descr, boolean_t *recovered)
 	struct question *q = NULL;
 	struct answer *a;
 	char k = '0';
+	struct ebox_session *sess = ebox_local_session();
 
 	/* Try to use the pivy-agent to unlock first if we have one. */
 	config = NULL;
@@ -95,11 +96,13 @@ unlock_or_recover(struct ebox *ebox, const char *descr, boolean_t *recovered)
 		if (ebox_tpl_config_type(tconfig) == EBOX_PRIMARY) {
 			part = ebox_config_next_part(config, NULL);
 			tpart = ebox_part_tpl(part);
-			error = local_unlock_agent(ebox_part_box(part));
+			error = ebox_session_agent_unlock(sess,
+			    ebox_part_box(part));
 			if (error) {
 				errf_free(error);
 				continue;
 			}
+			ebox_session_end(sess);
 			error = ebox_unlock(ebox, config);
 			if (error)
 				return (error);
@@ -114,15 +117,18 @@ unlock_or_recover(struct ebox *ebox, const char *descr, boolean_t *recovered)
 		if (ebox_tpl_config_type(tconfig) == EBOX_PRIMARY) {
 			part = ebox_config_next_part(config, NULL);
 			tpart = ebox_part_tpl(part);
-			error = local_unlock(ebox_part_box(part),
-			    ebox_tpl_part_cak(tpart),
+			error = ebox_session_local_unlock(sess,
+			    ebox_part_box(part), ebox_tpl_part_cak(tpart),
 			    ebox_tpl_part_name(tpart));
-			if (error && !errf_caused_by(error, "NotFoundError"))
+			if (error && !errf_caused_by(error, "NotFoundError")) {
+				ebox_session_end(sess);
 				return (error);
+			}
 			if (error) {
 				errf_free(error);
 				continue;
 			}
+			ebox_session_end(sess);
 			error = ebox_unlock(ebox, config);
 			if (error)
 				return (error);
@@ -130,6 +136,7 @@ unlock_or_recover(struct ebox *ebox, const char *descr, boolean_t *recovered)
 			goto done;
 		}
 	}
+	ebox_session_end(sess);
 
 	q = calloc(1, sizeof (struct question));
 	question_printf(q, "-- Recovery mode --\n");
@@ -453,6 +460,327 @@ done:
 	crypt_free(cd);
 }
 
+/* Max number of device activations we run at once. */
+#define	ACTIVATE_PAR		8
+#define	CRYPTTAB_PATH		"/etc/crypttab"
+
+struct luks_unlock {
+	char *lu_devname;
+	char *lu_mapper;
+	struct crypt_device *lu_cd;
+	struct ebox *lu_ebox;
+	boolean_t lu_unlocked;
+	boolean_t lu_recovered;
+	pid_t lu_pid;
+	int lu_rc;
+};
+
+/*
+ * Loads the ebox for one device. Returns B_FALSE (having warned, if "quiet"
+ * isn't set) if the device is already active or doesn't have one.
+ */
+static boolean_t
+unlock_all_load(struct luks_unlock *lu, boolean_t quiet)
+{
+	int rc;
+	const char *json;
+	json_object *jv, *obj = NULL;
+	struct sshbuf *buf = NULL;
+	errf_t *error = NULL;
+
+	rc = crypt_init(&lu->lu_cd, lu->lu_devname);
+	if (rc < 0) {
+		error = lukserrf("crypt_init", rc);
+		goto fail;
+	}
+	if (crypt_status(lu->lu_cd, lu->lu_mapper) == CRYPT_ACTIVE) {
+		if (!quiet) {
+			warnx("device '%s' already unlocked and active",
+			    lu->lu_devname);
+		}
+		goto out;
+	}
+	rc = crypt_load(lu->lu_cd, CRYPT_LUKS2, NULL);
+	if (rc < 0) {
+		error = lukserrf("crypt_load", rc);
+		goto fail;
+	}
+	rc = crypt_token_json_get(lu->lu_cd, 1, &json);
+	if (rc < 0) {
+		error = lukserrf("crypt_token_json_get", rc);
+		goto fail;
+	}
+	obj = json_tokener_parse(json);
+	if (obj == NULL) {
+		error = errf("JSONError", NULL, "failed to parse json");
+		goto fail;
+	}
+	jv = json_object_object_get(obj, "type");
+	if (jv == NULL || strcmp("ebox", json_object_get_string(jv)) != 0) {
+		error = errf("TokenError", NULL, "no ebox token in slot 1");
+		goto fail;
+	}
+	jv = json_object_object_get(obj, "ebox");
+	if (jv == NULL) {
+		error = errf("TokenError", NULL,
+		    "no 'ebox' property in LUKS token json");
+		goto fail;
+	}
+	buf = sshbuf_new();
+	if (buf == NULL)
+		err(EXIT_ERROR, "failed to allocate buffer");
+	if ((rc = sshbuf_b64tod(buf, json_object_get_string(jv)))) {
+		error = ssherrf("sshbuf_b64tod", rc);
+		goto fail;
+	}
+	if ((error = sshbuf_get_ebox(buf, &lu->lu_ebox)))
+		goto fail;
+
+	sshbuf_free(buf);
+	json_object_put(obj);
+	return (B_TRUE);
+
+fail:
+	if (!quiet) {
+		warnfx(error, "failed to load ebox from device '%s', "
+		    "skipping", lu->lu_devname);
+	}
+	errf_free(error);
+out:
+	sshbuf_free(buf);
+	if (obj != NULL)
+		json_object_put(obj);
+	crypt_free(lu->lu_cd);
+	lu->lu_cd = NULL;
+	return (B_FALSE);
+}
+
+/*
+ * Turns the device field of a crypttab line into a path. Returns NULL for
+ * forms we don't understand.
+ */
+static char *
+crypttab_device(const char *spec)
+{
+	static const struct {
+		const char *prefix;
+		const char *dir;
+	} tags[] = {
+		{ "UUID=", "/dev/disk/by-uuid/" },
+		{ "PARTUUID=", "/dev/disk/by-partuuid/" },
+		{ "LABEL=", "/dev/disk/by-label/" },
+		{ "PARTLABEL=", "/dev/disk/by-partlabel/" },
+	};
+	char *path;
+	uint i;
+
+	if (spec[0] == '/')
+		return (strdup(spec));
+	for (i = 0; i < sizeof (tags) / sizeof (tags[0]); ++i) {
+		size_t plen = strlen(tags[i].prefix);
+		if (strncmp(spec, tags[i].prefix, plen) != 0)
+			continue;
+		if (asprintf(&path, "%s%s", tags[i].dir, spec + plen) < 0)
+			return (NULL);
+		return (path);
+	}
+	return (NULL);
+}
+
+static void
+cmd_unlock_all(const char *crypttab, const char **args, int nargs)
+{
+	struct luks_unlock *lus = NULL, *lu;
+	size_t n = 0, nalloc = 0, i, desclen, nrun, nfail = 0;
+	size_t nrecovered = 0;
+	struct ebox **eboxes;
+	boolean_t *unlocked;
+	char *descr, *p;
+	const uint8_t *key;
+	size_t keylen;
+	errf_t *error;
+	FILE *f = NULL;
+	char *line = NULL, *name, *dev, *lasts;
+	size_t linesz = 0;
+	boolean_t quiet;
+	pid_t kid;
+	int rc, status;
+
+	/*
+	 * With no devices given, take everything in crypttab whose LUKS
+	 * header has an ebox token.
+	 */
+	quiet = (nargs == 0);
+	if (quiet) {
+		f = fopen(crypttab, "r");
+		if (f == NULL)
+			err(EXIT_ERROR, "failed to open %s", crypttab);
+	}
+	for (i = 0; ; ++i) {
+		if (f != NULL) {
+			if (getline(&line, &linesz, f) < 0)
+				break;
+			name = strtok_r(line, " \t\n", &lasts);
+			if (name == NULL || name[0] == '#')
+				continue;
+			dev = strtok_r(NULL, " \t\n", &lasts);
+			if (dev == NULL)
+				continue;
+			if ((dev = crypttab_device(dev)) == NULL)
+				continue;
+			name = strdup(name);
+		} else {
+			if (i >= (size_t)nargs)
+				break;
+			/* Device paths can contain ':', mapper names don't. */
+			p = strrchr(args[i], ':');
+			if (p == NULL || p == args[i] || p[1] == '\0') {
+				warnx("expected <device>:<mapper name>, got "
+				    "'%s'", args[i]);
+				usage();
+			}
+			dev = strndup(args[i], p - args[i]);
+			name = strdup(p + 1);
+		}
+		if (dev == NULL || name == NULL)
+			err(EXIT_ERROR, "failed to allocate memory");
+
+		if (n == nalloc) {
+			nalloc = nalloc ? nalloc * 2 : 16;
+			lus = reallocarray(lus, nalloc,
+			    sizeof (struct luks_unlock));
+			if (lus == NULL)
+				err(EXIT_ERROR, "failed to allocate memory");
+		}
+		lu = &lus[n];
+		bzero(lu, sizeof (*lu));
+		lu->lu_devname = dev;
+		lu->lu_mapper = name;
+		if (unlock_all_load(lu, quiet)) {
+			++n;
+		} else {
+			free(dev);
+			free(name);
+		}
+	}
+	if (f != NULL) {
+		free(line);
+		fclose(f);
+	}
+
+	if (n == 0)
+		errx(EXIT_ALREADY_UNLOCKED, "no LUKS devices left to unlock");
+
+	fprintf(stderr, "Attempting to unlock %zu LUKS devices...\n", n);
+	(void) mlockall(MCL_CURRENT | MCL_FUTURE);
+
+	/* One card transaction (and PIN) per token for the primaries. */
+	eboxes = calloc(n, sizeof (struct ebox *));
+	unlocked = calloc(n, sizeof (boolean_t));
+	if (eboxes == NULL || unlocked == NULL)
+		err(EXIT_ERROR, "failed to allocate memory");
+	for (i = 0; i < n; ++i)
+		eboxes[i] = lus[i].lu_ebox;
+	local_unlock_eboxes(eboxes, unlocked, n);
+	for (i = 0; i < n; ++i)
+		lus[i].lu_unlocked = unlocked[i];
+	free(eboxes);
+	free(unlocked);
+
+	/* Then the rest one at a time, including recovery. */
+	for (i = 0; i < n; ++i) {
+		lu = &lus[i];
+		if (lu->lu_unlocked)
+			continue;
+		desclen = strlen(lu->lu_devname) + 128;
+		descr = calloc(1, desclen);
+		VERIFY(descr != NULL);
+		snprintf(descr, desclen, "LUKS device %s", lu->lu_devname);
+		fprintf(stderr, "Attempting to unlock device '%s'...\n",
+		    lu->lu_devname);
+		error = unlock_or_recover(lu->lu_ebox, descr,
+		    &lu->lu_recovered);
+		free(descr);
+		if (error) {
+			warnfx(error, "failed to unlock ebox for '%s'",
+			    lu->lu_devname);
+			errf_free(error);
+			continue;
+		}
+		lu->lu_unlocked = B_TRUE;
+	}
+
+	/*
+	 * Activate in parallel, ACTIVATE_PAR at a time, so that the key
+	 * digest checks and device-mapper setup overlap. libcryptsetup
+	 * isn't safe to use from several threads, so we fork: each child
+	 * activates one device using the crypt_device we already loaded.
+	 */
+	nrun = 0;
+	for (i = 0; i <= n; ++i) {
+		while (nrun > 0 && (nrun >= ACTIVATE_PAR || i == n)) {
+			kid = wait(&status);
+			if (kid < 0 && errno == EINTR)
+				continue;
+			VERIFY3S(kid, >, 0);
+			for (lu = lus; lu < &lus[n]; ++lu) {
+				if (lu->lu_pid != kid)
+					continue;
+				if (WIFEXITED(status))
+					lu->lu_rc = WEXITSTATUS(status);
+				else
+					lu->lu_rc = EINTR;
+				lu->lu_pid = 0;
+			}
+			--nrun;
+		}
+		if (i == n)
+			break;
+		lu = &lus[i];
+		if (!lu->lu_unlocked)
+			continue;
+		key = ebox_key(lu->lu_ebox, &keylen);
+		kid = fork();
+		if (kid == -1)
+			err(EXIT_ERROR, "fork");
+		if (kid == 0) {
+			rc = crypt_activate_by_volume_key(lu->lu_cd,
+			    lu->lu_mapper, (const char *)key, keylen, 0);
+			_exit(rc < 0 ? -rc : 0);
+		}
+		lu->lu_pid = kid;
+		++nrun;
+	}
+
+	for (i = 0; i < n; ++i) {
+		lu = &lus[i];
+		if (!lu->lu_unlocked) {
+			++nfail;
+		} else if (lu->lu_rc != 0) {
+			warnfx(errfno("crypt_activate_by_volume_key",
+			    lu->lu_rc, NULL), "failed to activate device '%s'",
+			    lu->lu_devname);
+			++nfail;
+		} else if (lu->lu_recovered) {
+			++nrecovered;
+		}
+		ebox_free(lu->lu_ebox);
+		crypt_free(lu->lu_cd);
+		free(lu->lu_devname);
+		free(lu->lu_mapper);
+	}
+	free(lus);
+
+	if (nrecovered > 0) {
+		fprintf(stderr, "%zu device(s) were unlocked using a recovery "
+		    "config. If the original primary PIV\ntoken has been "
+		    "lost or damaged, use `pivy-luks rekey' on each of them "
+		    "to\nreplace it.\n", nrecovered);
+	}
+	if (nfail > 0)
+		errx(EXIT_ERROR, "failed to unlock %zu of %zu devices", nfail, n);
+}
+
 static void
 cmd_format(const char *devname)
 {
@@ -537,6 +865,10 @@ usage(void)
 	    "\n"
 	    "Available operations:\n"
 	    "  unlock <device> <mapper name>         Unlock/activate a LUKS device\n"
+	    "  unlock-all [-c crypttab] [<device>:<mapper name> ...]\n"
+	    "                                        Unlock/activate several LUKS\n"
+	    "                                        devices at once (default: all\n"
+	    "                                        with ebox tokens in crypttab)\n"
 	    "  rekey <device>                        Update LUKS metadata to new template\n"
 	    "  format <device>                       Set up a new LUKS device\n");
 	fprintf(stderr, "\nTemplates are stored in:\n");
@@ -594,6 +926,23 @@ main(int argc, char *argv[])
 		usage();
 	}
 	const char *op = argv[optind++];
+
+	if (strcmp(op, "unlock-all") == 0) {
+		const char *crypttab = CRYPTTAB_PATH;
+		while ((c = getopt(argc, argv, "c:")) != -1) {
+			switch (c) {
+			case 'c':
+				crypttab = optarg;
+				break;
+			default:
+				usage();
+			}
+		}
+		cmd_unlock_all(crypttab, (const char **)&argv[optind],
+		    argc - optind);
+		return (0);
+	}
+
 	if (optind >= argc) {
 		warnx("device required");
 		usage();
@@ -35,11 +35,16 @@
 #include <sys/fork.h>
 #endif
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include "libssh/sshkey.h"
 #include "libssh/sshbuf.h"
 #include "libssh/digest.h"
 #include "libssh/ssherr.h"
+#include "libssh/authfd.h"
 
 #include <openssl/err.h>
 #include <openssl/x509.h>
@@ -68,7 +73,15 @@ int PEM_write_X509(FILE *fp, X509 *x);
 
 boolean_t debug = B_FALSE;
 static boolean_t parseable = B_FALSE;
+static boolean_t batch_binary = B_FALSE;
+static boolean_t sign_stream = B_FALSE;
 static boolean_t enum_all_retired = B_FALSE;
+
+/*
+ * For when all we want to know up front about each token is its GUID. The
+ * rest is read from the ones we actually go on to use, when we use them.
+ */
+static const struct piv_enum_opts guid_only = { PIV_READ_CHUID };
 static const char *cn = NULL;
 static const char *upn = NULL;
 static boolean_t save_pinfo_admin = B_TRUE;
@@ -257,6 +270,49 @@ read_stdin(size_t limit, size_t *outlen)
 	return (buf);
 }
 
+/*
+ * Length-prefixed framing for the -L batch modes: a 4-byte big-endian length
+ * followed by that many bytes. read_frame() returns NULL at a clean EOF.
+ */
+static uint8_t *
+read_frame(size_t limit, size_t *outlen)
+{
+	uint8_t lenbuf[4];
+	uint8_t *buf;
+	size_t n, len;
+
+	n = fread(lenbuf, 1, sizeof (lenbuf), stdin);
+	if (n == 0 && feof(stdin))
+		return (NULL);
+	if (n != sizeof (lenbuf))
+		errx(EXIT_BAD_ARGS, "truncated frame length");
+	len = ((size_t)lenbuf[0] << 24) | (lenbuf[1] << 16) |
+	    (lenbuf[2] << 8) | lenbuf[3];
+	if (len == 0 || len > limit) {
+		errx(EXIT_BAD_ARGS, "invalid frame length %zu (max %zu bytes)",
+		    len, limit);
+	}
+	buf = calloc(1, len);
+	VERIFY(buf != NULL);
+	if (fread(buf, 1, len, stdin) != len)
+		errx(EXIT_BAD_ARGS, "truncated frame");
+	*outlen = len;
+	return (buf);
+}
+
+static void
+write_frame(const uint8_t *buf, size_t len)
+{
+	uint8_t lenbuf[4];
+
+	lenbuf[0] = (len >> 24) & 0xFF;
+	lenbuf[1] = (len >> 16) & 0xFF;
+	lenbuf[2] = (len >> 8) & 0xFF;
+	lenbuf[3] = len & 0xFF;
+	fwrite(lenbuf, 1, sizeof (lenbuf), stdout);
+	fwrite(buf, 1, len, stdout);
+}
+
 static char *
 piv_token_shortid(struct piv_token *pk)
 {
@@ -619,7 +675,7 @@ cmd_list(void)
 }
 
 static errf_t *
-save_pinfo_admin_key(struct piv_token *tk)
+save_pinfo_admin_key(struct piv_token *tk, const uint8_t *key, size_t keylen)
 {
 	struct tlv_state *tlv;
 	errf_t *err;
@@ -627,7 +683,7 @@ save_pinfo_admin_key(struct piv_token *tk)
 	tlv = tlv_init_write();
 	tlv_push(tlv, 0x88);
 	tlv_push(tlv, 0x89);
-	tlv_write(tlv, admin_key, key_length);
+	tlv_write(tlv, key, keylen);
 	tlv_pop(tlv);
 	tlv_pop(tlv);
 
@@ -720,7 +776,7 @@ cmd_update_keyhist(void)
 	if ((err = piv_txn_begin(selk)))
 		return (err);
 	assert_select(selk);
-	if ((err = piv_read_all_certs(selk))) {
+	if ((err = piv_read_all_pubkeys(selk))) {
 		piv_txn_end(selk);
 		return (err);
 	}
@@ -765,12 +821,15 @@ admin_again:
 	return (ERRF_OK);
 }
 
-static errf_t *
-cmd_init(void)
+/*
+ * Builds a fresh CCC and CHUID (with a new random GUID, returned in nguid)
+ * for writing to a blank card.
+ */
+static void
+make_init_objects(uint8_t *nguid, struct tlv_state **cccp,
+    struct tlv_state **chuidp)
 {
-	errf_t *err;
 	struct tlv_state *ccc, *chuid;
-	uint8_t nguid[16];
 	uint8_t fascn[25];
 	uint8_t expiry[8] = { '2', '0', '5', '0', '0', '1', '0', '1' };
 	uint8_t cardId[21] = {
@@ -783,7 +842,7 @@ cmd_init(void)
 		0x00
 	};
 
-	arc4random_buf(nguid, sizeof (nguid));
+	arc4random_buf(nguid, GUID_LEN);
 	arc4random_buf(&cardId[6], sizeof (cardId) - 6);
 	bzero(fascn, sizeof (fascn));
 
@@ -836,7 +895,7 @@ cmd_init(void)
 	tlv_pop(chuid);
 
 	tlv_push(chuid, 0x34);
-	tlv_write(chuid, nguid, sizeof (nguid));
+	tlv_write(chuid, nguid, GUID_LEN);
 	tlv_pop(chuid);
 
 	tlv_push(chuid, 0x35);
@@ -848,6 +907,19 @@ cmd_init(void)
 	tlv_push(chuid, 0xFE);
 	tlv_pop(chuid);
 
+	*cccp = ccc;
+	*chuidp = chuid;
+}
+
+static errf_t *
+cmd_init(void)
+{
+	errf_t *err;
+	struct tlv_state *ccc, *chuid;
+	uint8_t nguid[GUID_LEN];
+
+	make_init_objects(nguid, &ccc, &chuid);
+
 	if ((err = piv_txn_begin(selk)))
 		return (err);
 	assert_select(selk);
@@ -924,7 +996,8 @@ admin_again:
 		if (!err && save_pinfo_admin) {
 			admin_key = new_admin_key;
 			key_length = len;
-			if ((err = save_pinfo_admin_key(selk))) {
+			if ((err = save_pinfo_admin_key(selk, admin_key,
+			    key_length))) {
 				err = funcerrf(err, "Failed to write new "
 				    "admin key to printed info object");
 			}
@@ -994,6 +1067,46 @@ cmd_set_system(void)
 }
 #endif
 
+/* Asks for a new PIN (or PUK) twice, for the token or tokens named by who. */
+static errf_t *
+prompt_new_pin(enum piv_pin pintype, const char *who, const char *charType,
+    char **newpinp)
+{
+	char prompt[64];
+	char *p, *newpin;
+
+again:
+	snprintf(prompt, 64, "Enter new %s (%s): ",
+	    pin_type_to_name(pintype), who);
+	do {
+		p = getpass(prompt);
+	} while (p == NULL && errno == EINTR);
+	if (p == NULL)
+		return (errfno("getpass", errno, ""));
+	if (strlen(p) < 4 || strlen(p) > 8) {
+		warnx("PIN must be 4-8 %s", charType);
+		goto again;
+	}
+	newpin = strdup(p);
+	VERIFY(newpin != NULL);
+	snprintf(prompt, 64, "Confirm new %s (%s): ",
+	    pin_type_to_name(pintype), who);
+	do {
+		p = getpass(prompt);
+	} while (p == NULL && errno == EINTR);
+	if (p == NULL) {
+		free(newpin);
+		return (errfno("getpass", errno, ""));
+	}
+	if (strcmp(p, newpin) != 0) {
+		warnx("PINs do not match");
+		free(newpin);
+		goto again;
+	}
+	*newpinp = newpin;
+	return (ERRF_OK);
+}
+
 static errf_t *
 cmd_change_pin(enum piv_pin pintype)
 {
@@ -1018,34 +1131,8 @@ cmd_change_pin(enum piv_pin pintype)
 		}
 		pin = strdup(p);
 	}
-again:
-	snprintf(prompt, 64, "Enter new %s (%s): ",
-	    pin_type_to_name(pintype), guidhex);
-	do {
-		p = getpass(prompt);
-	} while (p == NULL && errno == EINTR);
-	if (p == NULL) {
-		err = errfno("getpass", errno, "");
-		return (err);
-	}
-	if (strlen(p) < 4 || strlen(p) > 8) {
-		warnx("PIN must be 4-8 %s", charType);
-		goto again;
-	}
-	newpin = strdup(p);
-	snprintf(prompt, 64, "Confirm new %s (%s): ",
-	    pin_type_to_name(pintype), guidhex);
-	do {
-		p = getpass(prompt);
-	} while (p == NULL && errno == EINTR);
-	if (p == NULL) {
-		err = errfno("getpass", errno, "");
+	if ((err = prompt_new_pin(pintype, guidhex, charType, &newpin)))
 		return (err);
-	}
-	if (strcmp(p, newpin) != 0) {
-		warnx("PINs do not match");
-		goto again;
-	}
 	free(guidhex);
 
 	if ((err = piv_txn_begin(selk)))
@@ -1132,8 +1219,15 @@ again:
 	return (ERRF_OK);
 }
 
+/*
+ * Makes a self-signed cert for the key in a slot and writes it out. If
+ * spin is given, that's the PIN to use, and a wrong one is returned as an
+ * error rather than prompting again (or exiting): setup-batch runs this on
+ * many tokens at once in worker threads.
+ */
 static errf_t *
-selfsign_slot(uint slotid, enum piv_alg alg, struct sshkey *pub)
+selfsign_slot(struct piv_token *tk, struct piv_slot *slot, uint slotid,
+    enum piv_alg alg, struct sshkey *pub, const char *spin)
 {
 	int rv;
 	errf_t *err;
@@ -1156,8 +1250,9 @@ selfsign_slot(uint slotid, enum piv_alg alg, struct sshkey *pub)
 	const char *guidhex;
 	const char *myupn = upn;
 	const char *mycn = cn;
+	uint retries = min_retries;
 
-	guidhex = piv_token_shortid(selk);
+	guidhex = piv_token_shortid(tk);
 
 	name = calloc(1, 64);
 
@@ -1210,10 +1305,10 @@ selfsign_slot(uint slotid, enum piv_alg alg, struct sshkey *pub)
 		snprintf(name, 64, "piv-retired-%u@%s", slotid - 0x81, guidhex);
 		basic = "critical,CA:FALSE";
 		ku = "critical,digitalSignature,nonRepudiation";
-		if (slotid - 0x82 > piv_token_keyhistory_oncard(selk)) {
+		if (slotid - 0x82 > piv_token_keyhistory_oncard(tk)) {
 			err = funcerrf(NULL, "next available key history "
 			    "slot is %02X (must be used in order)",
-			    0x82 + piv_token_keyhistory_oncard(selk));
+			    0x82 + piv_token_keyhistory_oncard(tk));
 			return (err);
 		}
 		break;
@@ -1255,8 +1350,8 @@ selfsign_slot(uint slotid, enum piv_alg alg, struct sshkey *pub)
 		rv = EVP_PKEY_assign_EC_KEY(pkey, copy);
 		VERIFY(rv == 1);
 
-		for (i = 0; i < piv_token_nalgs(selk); ++i) {
-			enum piv_alg alg = piv_token_alg(selk, i);
+		for (i = 0; i < piv_token_nalgs(tk); ++i) {
+			enum piv_alg alg = piv_token_alg(tk, i);
 			if (alg == PIV_ALG_ECCP256_SHA256) {
 				haveSha256 = B_TRUE;
 			} else if (alg == PIV_ALG_ECCP256_SHA1) {
@@ -1354,13 +1449,22 @@ selfsign_slot(uint slotid, enum piv_alg alg, struct sshkey *pub)
 
 	hashalg = wantalg;
 
-	assert_pin(selk, override, B_FALSE);
+	err = ERRF_OK;
+	if (spin != NULL) {
+		err = piv_verify_pin(tk, piv_token_default_auth(tk), spin,
+		    &retries, B_FALSE);
+	} else {
+		assert_pin(tk, slot, B_FALSE);
+	}
 
 signagain:
-	err = piv_sign(selk, override, tbs, tbslen, &hashalg, &sig, &siglen);
+	if (err == ERRF_OK)
+		err = piv_sign(tk, slot, tbs, tbslen, &hashalg, &sig, &siglen);
 
-	if (errf_caused_by(err, "PermissionError")) {
-		assert_pin(selk, override, B_TRUE);
+	if (spin == NULL && errf_caused_by(err, "PermissionError")) {
+		errf_free(err);
+		err = ERRF_OK;
+		assert_pin(tk, slot, B_TRUE);
 		goto signagain;
 	} else if (err) {
 		err = funcerrf(err, "failed to sign cert with key");
@@ -1385,20 +1489,20 @@ signagain:
 	cdlen = (size_t)rv;
 
 	flags = PIV_COMP_NONE;
-	err = piv_write_cert(selk, slotid, cdata, cdlen, flags);
+	err = piv_write_cert(tk, slotid, cdata, cdlen, flags);
 
 	if (err == ERRF_OK && slotid >= 0x82 && slotid <= 0x95 &&
-	    piv_token_keyhistory_oncard(selk) <= slotid - 0x82) {
+	    piv_token_keyhistory_oncard(tk) <= slotid - 0x82) {
 		uint oncard, offcard;
 		const char *url;
 
-		oncard = piv_token_keyhistory_oncard(selk);
-		offcard = piv_token_keyhistory_offcard(selk);
-		url = piv_token_offcard_url(selk);
+		oncard = piv_token_keyhistory_oncard(tk);
+		offcard = piv_token_keyhistory_offcard(tk);
+		url = piv_token_offcard_url(tk);
 
 		++oncard;
 
-		err = piv_write_keyhistory(selk, oncard, offcard, url);
+		err = piv_write_keyhistory(tk, oncard, offcard, url);
 
 		if (err) {
 			warnfx(err, "failed to update key "
@@ -1509,7 +1613,7 @@ admin_again:
 	}
 
 	override = piv_force_slot(selk, slotid, alg);
-	err = selfsign_slot(slotid, alg, pub);
+	err = selfsign_slot(selk, override, slotid, alg, pub, NULL);
 	piv_txn_end(selk);
 
 	if (err) {
@@ -1556,7 +1660,7 @@ admin_again:
 		return (err);
 	}
 
-	err = selfsign_slot(slotid, alg, pub);
+	err = selfsign_slot(selk, override, slotid, alg, pub, NULL);
 	piv_txn_end(selk);
 
 	if (err) {
@@ -1768,40 +1872,315 @@ again:
 	return (ERRF_OK);
 }
 
-static errf_t *
-cmd_box(uint slotid)
+/*
+ * For 'sign -S' (or 'sign <slot> <file>'): the input is hashed on a thread of
+ * its own while the main one opens the card and asks for the PIN, and never
+ * has to be held in memory all at once. Regular files are mapped a window at
+ * a time; anything else is read in chunks.
+ */
+#define	SIGN_MAP_WINDOW		(64 * 1024 * 1024)
+#define	SIGN_READ_CHUNK		(256 * 1024)
+
+struct sign_stream {
+	int ss_fd;
+	enum sshdigest_types ss_hashalg;
+	uint8_t ss_dg[SSH_DIGEST_MAX_LENGTH];
+	size_t ss_dglen;
+	uint64_t ss_len;
+	errf_t *ss_err;
+};
+
+static void *
+sign_stream_hash(void *arg)
 {
-	struct piv_slot *slot = NULL;
-	struct piv_ecdh_box *box;
-	errf_t *err;
+	struct sign_stream *ss = arg;
+	struct ssh_digest_ctx *hctx;
+	struct stat st;
+	uint8_t *buf;
+	void *map;
+	off_t off;
 	size_t len;
+	ssize_t n;
+
+	hctx = ssh_digest_start(ss->ss_hashalg);
+	VERIFY(hctx != NULL);
+
+	if (fstat(ss->ss_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		for (off = 0; off < st.st_size; off += len) {
+			len = st.st_size - off;
+			if (len > SIGN_MAP_WINDOW)
+				len = SIGN_MAP_WINDOW;
+			map = mmap(NULL, len, PROT_READ, MAP_PRIVATE,
+			    ss->ss_fd, off);
+			if (map == MAP_FAILED) {
+				ss->ss_err = errfno("mmap", errno, NULL);
+				goto out;
+			}
+			(void) madvise(map, len, MADV_SEQUENTIAL);
+			VERIFY0(ssh_digest_update(hctx, map, len));
+			VERIFY0(munmap(map, len));
+			ss->ss_len += len;
+		}
+	} else {
+		buf = malloc(SIGN_READ_CHUNK);
+		VERIFY(buf != NULL);
+		while ((n = read(ss->ss_fd, buf, SIGN_READ_CHUNK)) != 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0) {
+				ss->ss_err = errfno("read", errno, NULL);
+				free(buf);
+				goto out;
+			}
+			VERIFY0(ssh_digest_update(hctx, buf, n));
+			ss->ss_len += n;
+		}
+		free(buf);
+	}
+
+	ss->ss_dglen = ssh_digest_bytes(ss->ss_hashalg);
+	VERIFY0(ssh_digest_final(hctx, ss->ss_dg, ss->ss_dglen));
+out:
+	ssh_digest_free(hctx);
+	return (NULL);
+}
+
+static errf_t *
+cmd_sign_stream(uint slotid, const char *fname)
+{
+	struct piv_slot *cert;
+	struct sign_stream ss;
+	pthread_t thr;
+	uint8_t *sig;
+	size_t siglen;
+	errf_t *err = ERRF_OK;
+
+	assert_slotid(slotid);
+
+	if (override == NULL) {
+		if ((err = piv_txn_begin(selk)))
+			return (err);
+		assert_select(selk);
+		err = piv_read_cert(selk, slotid);
+		piv_txn_end(selk);
+
+		cert = piv_get_slot(selk, slotid);
+	} else {
+		cert = override;
+	}
+
+	if (cert == NULL || err) {
+		err = funcerrf(err, "failed to read cert for signing key in "
+		    "slot %02X", slotid);
+		return (err);
+	}
+
+	bzero(&ss, sizeof (ss));
+	ss.ss_fd = STDIN_FILENO;
+	if (fname != NULL && (ss.ss_fd = open(fname, O_RDONLY)) < 0)
+		return (errfno("open", errno, "%s", fname));
+
+	if ((err = piv_txn_begin(selk)))
+		goto out;
+	assert_select(selk);
+
+	ss.ss_hashalg = 0;
+	if ((err = piv_sign_hashalg(selk, cert, &ss.ss_hashalg))) {
+		piv_txn_end(selk);
+		err = funcerrf(err, "can't sign streamed data with the key in "
+		    "slot %02X", slotid);
+		goto out;
+	}
+	VERIFY0(pthread_create(&thr, NULL, sign_stream_hash, &ss));
+	assert_pin(selk, cert, B_FALSE);
+	VERIFY0(pthread_join(thr, NULL));
+	if (ss.ss_err != ERRF_OK) {
+		piv_txn_end(selk);
+		err = funcerrf(ss.ss_err, "failed to read data to sign");
+		goto out;
+	}
+	bunyan_log(BNY_DEBUG, "hashed data to sign",
+	    "length", BNY_UINT64, ss.ss_len,
+	    "hash", BNY_STRING, ssh_digest_alg_name(ss.ss_hashalg), NULL);
+
+again:
+	err = piv_sign_digest(selk, cert, ss.ss_dg, ss.ss_dglen, ss.ss_hashalg,
+	    &sig, &siglen);
+	if (errf_caused_by(err, "PermissionError")) {
+		errf_free(err);
+		assert_pin(selk, cert, B_TRUE);
+		goto again;
+	}
+	piv_txn_end(selk);
+	if (err) {
+		err = funcerrf(err, "failed to sign data");
+		goto out;
+	}
+
+	fwrite(sig, 1, siglen, stdout);
+	free(sig);
+
+out:
+	if (fname != NULL)
+		(void) close(ss.ss_fd);
+	return (err);
+}
+
+/* Longest digest we'll accept in sign-batch (SHA-512). */
+#define	MAX_BATCH_DIGEST	64
+
+/*
+ * Reads the next digest for sign-batch from stdin, either as a line of hex
+ * or (with -L) as a frame. Returns NULL at EOF.
+ */
+static uint8_t *
+read_batch_digest(size_t *outlen)
+{
+	static char *line = NULL;
+	static size_t linesz = 0;
 	uint8_t *buf;
+	ssize_t n;
+	uint hlen;
 
-	if (slotid != 0 || opubkey == NULL) {
+	if (batch_binary)
+		return (read_frame(MAX_BATCH_DIGEST, outlen));
+
+	do {
+		if ((n = getline(&line, &linesz, stdin)) < 0) {
+			free(line);
+			line = NULL;
+			linesz = 0;
+			return (NULL);
+		}
+		buf = parse_hex(line, &hlen);
+		if (hlen == 0)
+			free(buf);
+	} while (hlen == 0);
+	if (hlen > MAX_BATCH_DIGEST) {
+		errx(EXIT_BAD_ARGS, "digest too long (%u bytes, max %d)",
+		    hlen, MAX_BATCH_DIGEST);
+	}
+	*outlen = hlen;
+	return (buf);
+}
+
+/*
+ * Signs a stream of already-hashed digests from stdin with one card
+ * transaction and one PIN entry for the whole lot, writing the signatures to
+ * stdout in the same order and format as the input.
+ */
+static errf_t *
+cmd_sign_batch(uint slotid)
+{
+	struct piv_slot *cert;
+	uint8_t *dg, *sig;
+	uint8_t hash[MAX_BATCH_DIGEST];
+	size_t dglen, hashlen, siglen;
+	char *hex;
+	uint64_t count = 0;
+	errf_t *err = ERRF_OK;
+
+	assert_slotid(slotid);
+
+	if (override == NULL) {
 		if ((err = piv_txn_begin(selk)))
 			return (err);
 		assert_select(selk);
 		err = piv_read_cert(selk, slotid);
 		piv_txn_end(selk);
+
+		cert = piv_get_slot(selk, slotid);
+	} else {
+		cert = override;
+	}
+
+	if (cert == NULL || err) {
+		err = funcerrf(err, "failed to read cert for signing key in "
+		    "slot %02X", slotid);
+		return (err);
+	}
+
+	/*
+	 * For an RSA key the card wants the whole PKCS#1 block, and which hash
+	 * it was can't be told from its length alone, so we only do EC here.
+	 */
+	switch (piv_slot_alg(cert)) {
+	case PIV_ALG_ECCP256:
+		hashlen = 32;
+		break;
+	case PIV_ALG_ECCP384:
+		hashlen = 48;
+		break;
+	default:
+		return (errf("NotSupportedError", NULL, "sign-batch only "
+		    "supports EC keys (slot %02X is %s)", slotid,
+		    alg_to_string(piv_slot_alg(cert))));
+	}
+
+	if ((err = piv_txn_begin(selk)))
+		return (err);
+	assert_select(selk);
+	assert_pin(selk, cert, B_FALSE);
+
+	while ((dg = read_batch_digest(&dglen)) != NULL) {
+		/*
+		 * ECDSA uses the leftmost bits of the digest up to the size of
+		 * the curve order, so a short one is zero-padded on the left
+		 * and a long one truncated.
+		 */
+		bzero(hash, sizeof (hash));
+		if (dglen < hashlen)
+			bcopy(dg, hash + (hashlen - dglen), dglen);
+		else
+			bcopy(dg, hash, hashlen);
+		free(dg);
+again:
+		err = piv_sign_prehash(selk, cert, hash, hashlen, &sig,
+		    &siglen);
+		if (errf_caused_by(err, "PermissionError")) {
+			errf_free(err);
+			assert_pin(selk, cert, B_TRUE);
+			goto again;
+		}
 		if (err) {
-			err = funcerrf(err, "while reading cert for slot "
-			    "%02X", slotid);
-			return (err);
+			piv_txn_end(selk);
+			return (funcerrf(err, "failed to sign digest %llu",
+			    (unsigned long long)count + 1));
 		}
 
-		slot = piv_get_slot(selk, slotid);
-		VERIFY3P(slot, !=, NULL);
+		if (batch_binary) {
+			write_frame(sig, siglen);
+		} else {
+			hex = buf_to_hex(sig, siglen, B_FALSE);
+			printf("%s\n", hex);
+			free(hex);
+		}
+		/* Whoever is feeding us may be waiting on each one. */
+		fflush(stdout);
+		free(sig);
+		++count;
 	}
+	piv_txn_end(selk);
+
+	if (ferror(stdin))
+		return (errf("IOError", NULL, "error reading stdin"));
+
+	return (ERRF_OK);
+}
+
+static errf_t *
+box_one(struct piv_slot *slot, uint slotid, uint8_t *data, size_t datalen)
+{
+	struct piv_ecdh_box *box;
+	errf_t *err;
+	size_t len;
+	uint8_t *buf;
 
 	box = piv_box_new();
 	VERIFY3P(box, !=, NULL);
 
-	buf = read_stdin(8192, &len);
-	assert(buf != NULL);
-	VERIFY3U(len, >, 0);
-	VERIFY0(piv_box_set_data(box, buf, len));
-	explicit_bzero(buf, len);
-	free(buf);
+	VERIFY3U(datalen, >, 0);
+	VERIFY0(piv_box_set_data(box, data, datalen));
 
 	if (opubkey == NULL) {
 		err = piv_box_seal(selk, slot, box);
@@ -1809,6 +2188,7 @@ cmd_box(uint slotid)
 		err = piv_box_seal_offline(opubkey, box);
 	}
 	if (err) {
+		piv_box_free(box);
 		if (slotid != 0) {
 			err = errf("box", err, "failed sealing new box to key "
 			    "in slot %02x", slotid);
@@ -1821,13 +2201,169 @@ cmd_box(uint slotid)
 	VERIFY0(piv_box_to_binary(box, &buf, &len));
 	piv_box_free(box);
 
-	fwrite(buf, 1, len, stdout);
+	if (batch_binary)
+		write_frame(buf, len);
+	else
+		fwrite(buf, 1, len, stdout);
 	explicit_bzero(buf, len);
 	free(buf);
 
 	return (ERRF_OK);
 }
 
+static errf_t *
+cmd_box(uint slotid)
+{
+	struct piv_slot *slot = NULL;
+	errf_t *err;
+	size_t len;
+	uint8_t *buf;
+
+	if (slotid != 0 || opubkey == NULL) {
+		if ((err = piv_txn_begin(selk)))
+			return (err);
+		assert_select(selk);
+		err = piv_read_cert(selk, slotid);
+		piv_txn_end(selk);
+		if (err) {
+			err = funcerrf(err, "while reading cert for slot "
+			    "%02X", slotid);
+			return (err);
+		}
+
+		slot = piv_get_slot(selk, slotid);
+		VERIFY3P(slot, !=, NULL);
+	}
+
+	if (!batch_binary) {
+		buf = read_stdin(8192, &len);
+		assert(buf != NULL);
+		err = box_one(slot, slotid, buf, len);
+		explicit_bzero(buf, len);
+		free(buf);
+		return (err);
+	}
+
+	/* With -L, box every frame on stdin against the same key. */
+	while ((buf = read_frame(8192, &len)) != NULL) {
+		err = box_one(slot, slotid, buf, len);
+		explicit_bzero(buf, len);
+		free(buf);
+		if (err)
+			return (err);
+	}
+	fflush(stdout);
+
+	return (ERRF_OK);
+}
+
+struct unbox_ent {
+	struct piv_ecdh_box *ue_box;
+	struct piv_token *ue_tk;
+	struct piv_slot *ue_slot;
+	boolean_t ue_done;
+};
+
+/*
+ * unbox -L: read every framed box on stdin, enumerate the tokens once, then
+ * open all the boxes for each (token, slot) together in a single transaction
+ * (so at most one PIN entry per token). The contents are written back out as
+ * frames in the order the boxes came in.
+ */
+static errf_t *
+cmd_unbox_batch(void)
+{
+	struct unbox_ent *ents = NULL, *ue, *uj;
+	struct piv_key_index *keyidx = NULL;
+	size_t nents = 0, nalloc = 0, i, j, len;
+	uint8_t *buf;
+	errf_t *err = ERRF_OK;
+
+	while ((buf = read_frame(8192, &len)) != NULL) {
+		if (nents >= nalloc) {
+			nalloc = (nalloc == 0) ? 64 : nalloc * 2;
+			ents = recallocarray(ents, nents, nalloc,
+			    sizeof (struct unbox_ent));
+			VERIFY(ents != NULL);
+		}
+		ue = &ents[nents++];
+		err = piv_box_from_binary(buf, len, &ue->ue_box);
+		free(buf);
+		if (err) {
+			err = funcerrf(err, "failed to parse box %zu", nents);
+			goto out;
+		}
+	}
+	if (nents == 0)
+		goto out;
+
+	if ((err = piv_enumerate_opts(ctx, &guid_only, &ks)))
+		goto out;
+	selk = ks;
+
+	if ((err = piv_key_index_new(ks, &keyidx)))
+		goto out;
+	for (i = 0; i < nents; ++i) {
+		ue = &ents[i];
+		err = piv_box_find_token_index(keyidx, ue->ue_box, &ue->ue_tk,
+		    &ue->ue_slot);
+		if (errf_caused_by(err, "NotFoundError")) {
+			err = funcerrf(err, "no token found on system that can "
+			    "unlock box %zu", i + 1);
+			goto out;
+		} else if (err) {
+			goto out;
+		}
+	}
+
+	for (i = 0; i < nents; ++i) {
+		ue = &ents[i];
+		if (ue->ue_done)
+			continue;
+		if ((err = piv_txn_begin(ue->ue_tk)))
+			goto out;
+		assert_select(ue->ue_tk);
+		assert_pin(ue->ue_tk, ue->ue_slot, B_FALSE);
+		for (j = i; j < nents; ++j) {
+			uj = &ents[j];
+			if (uj->ue_done || uj->ue_tk != ue->ue_tk ||
+			    uj->ue_slot != ue->ue_slot)
+				continue;
+again:
+			err = piv_box_open(uj->ue_tk, uj->ue_slot, uj->ue_box);
+			if (errf_caused_by(err, "PermissionError")) {
+				errf_free(err);
+				assert_pin(uj->ue_tk, uj->ue_slot, B_TRUE);
+				goto again;
+			}
+			if (err) {
+				piv_txn_end(ue->ue_tk);
+				err = funcerrf(err, "failed to open box %zu",
+				    j + 1);
+				goto out;
+			}
+			uj->ue_done = B_TRUE;
+		}
+		piv_txn_end(ue->ue_tk);
+	}
+
+	for (i = 0; i < nents; ++i) {
+		if ((err = piv_box_take_data(ents[i].ue_box, &buf, &len)))
+			goto out;
+		write_frame(buf, len);
+		explicit_bzero(buf, len);
+		free(buf);
+	}
+	fflush(stdout);
+
+out:
+	for (i = 0; i < nents; ++i)
+		piv_box_free(ents[i].ue_box);
+	free(ents);
+	piv_key_index_free(keyidx);
+	return (err);
+}
+
 static errf_t *
 cmd_unbox(void)
 {
@@ -1838,6 +2374,9 @@ cmd_unbox(void)
 	size_t len;
 	uint8_t *buf;
 
+	if (batch_binary)
+		return (cmd_unbox_batch());
+
 	buf = read_stdin(8192, &len);
 	assert(buf != NULL);
 	VERIFY3U(len, >, 0);
@@ -1846,10 +2385,12 @@ cmd_unbox(void)
 		return (err);
 	free(buf);
 
-	if (piv_box_has_guidslot(box))
-		err = piv_find(ctx, piv_box_guid(box), GUID_LEN, &tk);
+	if (piv_box_has_guidslot(box)) {
+		err = piv_find_opts(ctx, piv_box_guid(box), GUID_LEN,
+		    &guid_only, &tk);
+	}
 	if (err || !piv_box_has_guidslot(box))
-		err = piv_enumerate(ctx, &tk);
+		err = piv_enumerate_opts(ctx, &guid_only, &tk);
 	if (err)
 		return (err);
 	ks = (selk = tk);
@@ -2006,76 +2547,559 @@ cmd_box_info(void)
 	return (ERRF_OK);
 }
 
+/*
+ * Fetches counters and APDU latency histograms from a running pivy-agent
+ * (through the stats@joyent.com extension) and prints them in the Prometheus
+ * text exposition format.
+ */
 static errf_t *
-cmd_bench(uint slotid)
+cmd_agent_stats(void)
 {
-	struct piv_slot *cert;
-	struct sshkey *pubkey;
-	errf_t *err = NULL;
-	uint i, n = 60;
-	struct timespec t1;
-	struct timespec t2;
+	struct sshbuf *req = NULL, *reply = NULL;
+	errf_t *err = ERRF_OK;
+	int fd = -1, rc;
+	uint8_t code, kind, ins;
+	uint32_t nstats, nbounds, nins, i, j;
+	uint64_t val, count, sum, cum;
+	uint64_t *bounds = NULL;
+	char *name = NULL;
+
+	if ((rc = ssh_get_authentication_socket(&fd)) != 0) {
+		err = ssherrf("ssh_get_authentication_socket", rc);
+		goto out;
+	}
 
-	switch (slotid) {
-	case 0x9A:
-	case 0x9C:
-	case 0x9D:
-	case 0x9E:
-		break;
-	default:
-		if (slotid >= 0x82 && slotid <= 0x95)
-			break;
-		err = funcerrf(NULL, "PIV slot %02X cannot be "
-		    "used for signing", slotid);
-		return (err);
+	if ((req = sshbuf_new()) == NULL || (reply = sshbuf_new()) == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+	if ((rc = sshbuf_put_u8(req, SSH2_AGENTC_EXTENSION)) ||
+	    (rc = sshbuf_put_cstring(req, "stats@joyent.com")) ||
+	    (rc = sshbuf_put_string(req, NULL, 0))) {
+		err = ssherrf("sshbuf_put", rc);
+		goto out;
+	}
+	if ((rc = ssh_request_reply(fd, req, reply))) {
+		err = ssherrf("ssh_request_reply", rc);
+		goto out;
+	}
+	if ((rc = sshbuf_get_u8(reply, &code))) {
+		err = ssherrf("sshbuf_get_u8", rc);
+		goto out;
+	}
+	if (code != SSH_AGENT_SUCCESS) {
+		err = errf("SSHAgentError", NULL, "SSH agent returned "
+		    "message code %d to stats request (is it pivy-agent?)",
+		    (int)code);
+		goto out;
 	}
 
-	if (override == NULL) {
-		if ((err = piv_txn_begin(selk)))
-			return (err);
-		assert_select(selk);
-		err = piv_read_cert(selk, slotid);
-		piv_txn_end(selk);
+	if ((rc = sshbuf_get_u32(reply, &nstats))) {
+		err = ssherrf("sshbuf_get_u32", rc);
+		goto out;
+	}
+	for (i = 0; i < nstats; ++i) {
+		if ((rc = sshbuf_get_cstring(reply, &name, NULL)) ||
+		    (rc = sshbuf_get_u8(reply, &kind)) ||
+		    (rc = sshbuf_get_u64(reply, &val))) {
+			err = ssherrf("sshbuf_get", rc);
+			goto out;
+		}
+		printf("# TYPE pivy_agent_%s %s\n", name,
+		    kind == 0 ? "counter" : "gauge");
+		printf("pivy_agent_%s %llu\n", name, (unsigned long long)val);
+		free(name);
+		name = NULL;
+	}
 
-		cert = piv_get_slot(selk, slotid);
-	} else {
-		cert = override;
+	if ((rc = sshbuf_get_u32(reply, &nbounds))) {
+		err = ssherrf("sshbuf_get_u32", rc);
+		goto out;
+	}
+	if (nbounds > 64) {
+		err = errf("SSHAgentError", NULL, "Agent sent too many "
+		    "histogram buckets (%u)", nbounds);
+		goto out;
+	}
+	bounds = calloc(nbounds, sizeof (uint64_t));
+	if (bounds == NULL && nbounds > 0) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+	for (i = 0; i < nbounds; ++i) {
+		if ((rc = sshbuf_get_u64(reply, &bounds[i]))) {
+			err = ssherrf("sshbuf_get_u64", rc);
+			goto out;
+		}
 	}
 
-	if (cert == NULL || err) {
-		err = funcerrf(err, "failed to read cert for signing key");
-		return (err);
+	if ((rc = sshbuf_get_u32(reply, &nins))) {
+		err = ssherrf("sshbuf_get_u32", rc);
+		goto out;
+	}
+	printf("# TYPE pivy_agent_apdu_duration_seconds histogram\n");
+	for (i = 0; i < nins; ++i) {
+		if ((rc = sshbuf_get_u8(reply, &ins)) ||
+		    (rc = sshbuf_get_cstring(reply, &name, NULL)) ||
+		    (rc = sshbuf_get_u64(reply, &count)) ||
+		    (rc = sshbuf_get_u64(reply, &sum))) {
+			err = ssherrf("sshbuf_get", rc);
+			goto out;
+		}
+		cum = 0;
+		for (j = 0; j <= nbounds; ++j) {
+			if ((rc = sshbuf_get_u64(reply, &val))) {
+				err = ssherrf("sshbuf_get_u64", rc);
+				goto out;
+			}
+			cum += val;
+			printf("pivy_agent_apdu_duration_seconds_bucket"
+			    "{ins=\"%s\",le=", name);
+			if (j < nbounds)
+				printf("\"%g\"", bounds[j] / 1000000.0);
+			else
+				printf("\"+Inf\"");
+			printf("} %llu\n", (unsigned long long)cum);
+		}
+		printf("pivy_agent_apdu_duration_seconds_sum{ins=\"%s\"} %g\n",
+		    name, sum / 1000000.0);
+		printf("pivy_agent_apdu_duration_seconds_count{ins=\"%s\"} "
+		    "%llu\n", name, (unsigned long long)count);
+		free(name);
+		name = NULL;
 	}
 
-	pubkey = piv_slot_pubkey(cert);
+out:
+	free(name);
+	free(bounds);
+	sshbuf_free(req);
+	sshbuf_free(reply);
+	if (fd != -1)
+		close(fd);
+	return (err);
+}
 
-	if ((err = piv_txn_begin(selk)))
-		errfx(1, err, "failed to open transaction");
-	assert_select(selk);
-	assert_pin(selk, cert, B_FALSE);
-	clock_gettime(CLOCK_MONOTONIC, &t1);
+static errf_t *
+cmd_apdu_log(void)
+{
+	struct sshbuf *req = NULL, *reply = NULL;
+	errf_t *err = ERRF_OK;
+	int fd = -1, rc;
+	uint8_t code, cls, ins, p1, p2, flags;
+	uint16_t sw;
+	uint32_t n, i, usec, lc, le, lr;
+	uint64_t seq, when;
+	const u_char *data;
+	size_t dlen;
+	char *hex;
+	time_t secs;
+	struct tm *tm;
+	char tbuf[32];
+
+	if ((rc = ssh_get_authentication_socket(&fd)) != 0) {
+		err = ssherrf("ssh_get_authentication_socket", rc);
+		goto out;
+	}
+
+	if ((req = sshbuf_new()) == NULL || (reply = sshbuf_new()) == NULL) {
+		err = ERRF_NOMEM;
+		goto out;
+	}
+	if ((rc = sshbuf_put_u8(req, SSH2_AGENTC_EXTENSION)) ||
+	    (rc = sshbuf_put_cstring(req, "apdu-log@joyent.com")) ||
+	    (rc = sshbuf_put_string(req, NULL, 0))) {
+		err = ssherrf("sshbuf_put", rc);
+		goto out;
+	}
+	if ((rc = ssh_request_reply(fd, req, reply))) {
+		err = ssherrf("ssh_request_reply", rc);
+		goto out;
+	}
+	if ((rc = sshbuf_get_u8(reply, &code))) {
+		err = ssherrf("sshbuf_get_u8", rc);
+		goto out;
+	}
+	if (code != SSH_AGENT_SUCCESS) {
+		err = errf("SSHAgentError", NULL, "SSH agent returned "
+		    "message code %d to APDU log request (is it pivy-agent?)",
+		    (int)code);
+		goto out;
+	}
+
+	if ((rc = sshbuf_get_u32(reply, &n))) {
+		err = ssherrf("sshbuf_get_u32", rc);
+		goto out;
+	}
+	printf("%-8s %-23s %8s %-20s %-5s %5s %5s %5s %-4s %s\n",
+	    "SEQ", "TIME", "USEC", "INS", "P1P2", "LC", "LE", "LR", "SW",
+	    "DATA");
 	for (i = 0; i < n; ++i) {
-again:
-		if (err != NULL)
-			errf_free(err);
-		err = piv_auth_key(selk, cert, pubkey);
+		if ((rc = sshbuf_get_u64(reply, &seq)) ||
+		    (rc = sshbuf_get_u64(reply, &when)) ||
+		    (rc = sshbuf_get_u32(reply, &usec)) ||
+		    (rc = sshbuf_get_u32(reply, &lc)) ||
+		    (rc = sshbuf_get_u32(reply, &le)) ||
+		    (rc = sshbuf_get_u32(reply, &lr)) ||
+		    (rc = sshbuf_get_u16(reply, &sw)) ||
+		    (rc = sshbuf_get_u8(reply, &cls)) ||
+		    (rc = sshbuf_get_u8(reply, &ins)) ||
+		    (rc = sshbuf_get_u8(reply, &p1)) ||
+		    (rc = sshbuf_get_u8(reply, &p2)) ||
+		    (rc = sshbuf_get_u8(reply, &flags)) ||
+		    (rc = sshbuf_get_string_direct(reply, &data, &dlen))) {
+			err = ssherrf("sshbuf_get", rc);
+			goto out;
+		}
+		secs = when / 1000000;
+		tm = gmtime(&secs);
+		tbuf[0] = '\0';
+		if (tm != NULL) {
+			snprintf(tbuf, sizeof (tbuf),
+			    "%02d:%02d:%02d.%06u", tm->tm_hour, tm->tm_min,
+			    tm->tm_sec, (uint)(when % 1000000));
+		}
+		printf("%-8llu %-23s %8u %-20s %02X%02X %5u %5u %5u ",
+		    (unsigned long long)seq, tbuf, usec, piv_ins_name(ins),
+		    p1, p2, lc, le, lr);
+		if (flags & PIV_APDU_REC_PCSC_FAIL)
+			printf("%-4s ", "-");
+		else
+			printf("%04X ", sw);
+		if (flags & PIV_APDU_REC_REDACTED) {
+			printf("(redacted)\n");
+			continue;
+		}
+		hex = buf_to_hex(data, dlen, B_FALSE);
+		printf("%s%s\n", hex, (lc > dlen) ? "..." : "");
+		free(hex);
+	}
+
+out:
+	sshbuf_free(req);
+	sshbuf_free(reply);
+	if (fd != -1)
+		close(fd);
+	return (err);
+}
+
+/*
+ * pivy-tool bench: times a set of card operations (SELECT, a bare GET DATA
+ * round trip, and per slot: reading the cert, signing, ECDH and opening a
+ * box) and reports latency percentiles for each, as a table or as JSON.
+ */
+static uint bench_iters = 60;
+static uint bench_warmup = 3;
+static boolean_t bench_json = B_FALSE;
+static uint bench_nresults = 0;
+
+static uint
+bench_parse_count(const char *str, ulong min, ulong max, const char *what)
+{
+	char *p;
+	ulong v;
+
+	errno = 0;
+	v = strtoul(str, &p, 10);
+	if (errno != 0 || *str == '\0' || *str == '-' || *p != '\0' ||
+	    v < min || v > max) {
+		errx(EXIT_BAD_ARGS, "invalid %s '%s': must be between %lu "
+		    "and %lu", what, str, min, max);
+	}
+	return ((uint)v);
+}
+
+struct bench_state {
+	struct piv_slot		*bs_slot;
+	struct sshkey		*bs_peer;	/* for ecdh */
+	struct piv_ecdh_box	*bs_box;	/* sealed, for box-open */
+	uint8_t			 bs_data[64];	/* for sign */
+};
+
+typedef errf_t *(*bench_op_t)(struct bench_state *);
+
+static errf_t *
+bench_op_select(struct bench_state *bs)
+{
+	return (piv_select(selk));
+}
+
+static errf_t *
+bench_op_apdu(struct bench_state *bs)
+{
+	/* GET DATA for the discovery object: short, and needs no auth. */
+	static const uint8_t getdisc[] = { 0x5C, 0x01, 0x7E };
+	struct apdu *apdu;
+	errf_t *err;
+
+	apdu = piv_apdu_borrow(selk, CLA_ISO, INS_GET_DATA, 0x3F, 0xFF);
+	piv_apdu_set_cmd(apdu, getdisc, sizeof (getdisc));
+	err = piv_apdu_transceive_chain(selk, apdu);
+	piv_apdu_free(apdu);
+	return (err);
+}
+
+static errf_t *
+bench_op_read_cert(struct bench_state *bs)
+{
+	return (piv_read_cert(selk, piv_slot_id(bs->bs_slot)));
+}
+
+static errf_t *
+bench_op_sign(struct bench_state *bs)
+{
+	enum sshdigest_types hashalg = SSH_DIGEST_SHA256;
+	uint8_t *sig = NULL;
+	size_t siglen;
+	errf_t *err;
+
+	err = piv_sign(selk, bs->bs_slot, bs->bs_data, sizeof (bs->bs_data),
+	    &hashalg, &sig, &siglen);
+	free(sig);
+	return (err);
+}
+
+static errf_t *
+bench_op_ecdh(struct bench_state *bs)
+{
+	uint8_t *sec = NULL;
+	size_t seclen;
+	errf_t *err;
+
+	err = piv_ecdh(selk, bs->bs_slot, bs->bs_peer, &sec, &seclen);
+	if (err == ERRF_OK)
+		freezero(sec, seclen);
+	return (err);
+}
+
+static errf_t *
+bench_op_box_open(struct bench_state *bs)
+{
+	struct piv_ecdh_box *box;
+	errf_t *err;
+
+	box = piv_box_clone(bs->bs_box);
+	VERIFY(box != NULL);
+	err = piv_box_open(selk, bs->bs_slot, box);
+	piv_box_free(box);
+	return (err);
+}
+
+static int
+bench_cmp_ns(const void *a, const void *b)
+{
+	const uint64_t *ap = a, *bp = b;
+	if (*ap < *bp)
+		return (-1);
+	if (*ap > *bp)
+		return (1);
+	return (0);
+}
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+bench_report(const char *name, struct piv_slot *slot, uint64_t *ns, uint n)
+{
+	uint64_t total = 0;
+	double mean, p50, p99, max;
+	char slotstr[8] = "";
+	const char *alg = "";
+	uint i;
+
+	qsort(ns, n, sizeof (uint64_t), bench_cmp_ns);
+	for (i = 0; i < n; ++i)
+		total += ns[i];
+	mean = (double)total / n / 1000000.0;
+	p50 = ns[(n - 1) / 2] / 1000000.0;
+	p99 = ns[((n - 1) * 99) / 100] / 1000000.0;
+	max = ns[n - 1] / 1000000.0;
+
+	if (slot != NULL) {
+		snprintf(slotstr, sizeof (slotstr), "%02X",
+		    (uint)piv_slot_id(slot));
+		alg = alg_to_string(piv_slot_alg(slot));
+	}
+
+	if (bench_json) {
+		printf("%s\n    {\"op\": \"%s\", ", bench_nresults > 0 ? "," : "",
+		    name);
+		if (slot != NULL)
+			printf("\"slot\": \"%s\", \"alg\": \"%s\", ", slotstr, alg);
+		printf("\"iterations\": %u, \"mean_ms\": %.3f, "
+		    "\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f}",
+		    n, mean, p50, p99, max);
+	} else {
+		if (bench_nresults == 0) {
+			printf("%-10s %-4s %-14s %6s %9s %9s %9s %9s\n",
+			    "OP", "SLOT", "ALG", "N", "MEAN(ms)", "P50(ms)",
+			    "P99(ms)", "MAX(ms)");
+		}
+		printf("%-10s %-4s %-14s %6u %9.2f %9.2f %9.2f %9.2f\n",
+		    name, slotstr, alg, n, mean, p50, p99, max);
+	}
+	++bench_nresults;
+}
+
+/*
+ * Runs "op" bench_warmup times untimed, then bench_iters times timed, inside
+ * the current transaction. An iteration that fails with PermissionError
+ * (e.g. a PIN-always slot) gets the PIN entered and is run again; only the
+ * successful run is timed.
+ */
+static errf_t *
+bench_run(const char *name, bench_op_t op, struct bench_state *bs)
+{
+	uint64_t *ns, t0;
+	uint i, total = bench_warmup + bench_iters;
+	errf_t *err = ERRF_OK;
+
+	ns = calloc(bench_iters, sizeof (uint64_t));
+	VERIFY(ns != NULL);
+
+	for (i = 0; i < total; ++i) {
+		t0 = bench_now_ns();
+		err = op(bs);
 		if (errf_caused_by(err, "PermissionError")) {
-			assert_pin(selk, cert, B_TRUE);
-			goto again;
+			errf_free(err);
+			assert_pin(selk, bs->bs_slot, B_TRUE);
+			t0 = bench_now_ns();
+			err = op(bs);
 		}
+		if (err != ERRF_OK)
+			break;
+		if (i >= bench_warmup)
+			ns[i - bench_warmup] = bench_now_ns() - t0;
 	}
-	clock_gettime(CLOCK_MONOTONIC, &t2);
-	piv_txn_end(selk);
-	const double t1d = t1.tv_sec + ((double)t1.tv_nsec / 1000000000.0f);
-	const double t2d = t2.tv_sec + ((double)t2.tv_nsec / 1000000000.0f);
-	const double delta = (t2d - t1d) / ((double)n);
-	fprintf(stderr, "time per sign = %.1f ms\n", delta * 1000);
-	if (err) {
-		err = funcerrf(err, "key authentication failed");
+
+	if (err == ERRF_OK)
+		bench_report(name, bs->bs_slot, ns, bench_iters);
+	free(ns);
+	if (err != ERRF_OK) {
+		err = funcerrf(err, "benchmark '%s' failed", name);
+	}
+	return (err);
+}
+
+static errf_t *
+bench_slot(struct piv_slot *slot)
+{
+	struct bench_state bs;
+	struct sshkey *pubkey = piv_slot_pubkey(slot);
+	errf_t *err;
+	int rv;
+
+	bzero(&bs, sizeof (bs));
+	bs.bs_slot = slot;
+	arc4random_buf(bs.bs_data, sizeof (bs.bs_data));
+
+	if (override == NULL) {
+		if ((err = bench_run("read-cert", bench_op_read_cert, &bs)))
+			return (err);
+	}
+
+	assert_pin(selk, slot, B_FALSE);
+	if ((err = bench_run("sign", bench_op_sign, &bs)))
+		return (err);
+
+	if (pubkey->type != KEY_ECDSA)
+		return (ERRF_OK);
+
+	rv = sshkey_generate(KEY_ECDSA, sshkey_size(pubkey), &bs.bs_peer);
+	if (rv != 0)
+		return (ssherrf("sshkey_generate", rv));
+	err = bench_run("ecdh", bench_op_ecdh, &bs);
+	sshkey_free(bs.bs_peer);
+	if (err)
 		return (err);
+
+	bs.bs_box = piv_box_new();
+	VERIFY(bs.bs_box != NULL);
+	err = piv_box_set_data(bs.bs_box, bs.bs_data, 32);
+	if (err == ERRF_OK)
+		err = piv_box_seal(selk, slot, bs.bs_box);
+	if (err == ERRF_OK)
+		err = bench_run("box-open", bench_op_box_open, &bs);
+	piv_box_free(bs.bs_box);
+
+	return (err);
+}
+
+static errf_t *
+cmd_bench(uint *slotids, uint nslots)
+{
+	static const uint defslots[] = { 0x9A, 0x9C, 0x9D, 0x9E };
+	struct bench_state bs;
+	struct piv_slot *slot;
+	errf_t *err = ERRF_OK;
+	boolean_t all = B_FALSE;
+	uint i;
+
+	if (bench_iters == 0)
+		return (funcerrf(NULL, "iteration count must be at least 1"));
+
+	if (nslots == 0) {
+		slotids = (uint *)defslots;
+		nslots = sizeof (defslots) / sizeof (defslots[0]);
+		all = B_TRUE;
+	}
+	for (i = 0; i < nslots; ++i) {
+		if (all)
+			continue;
+		if (slotids[i] >= 0x9A && slotids[i] <= 0x9E &&
+		    slotids[i] != 0x9B)
+			continue;
+		if (slotids[i] >= 0x82 && slotids[i] <= 0x95)
+			continue;
+		return (funcerrf(NULL, "PIV slot %02X cannot be used for "
+		    "signing", slotids[i]));
 	}
 
-	return (ERRF_OK);
+	if ((err = piv_txn_begin(selk)))
+		return (err);
+	assert_select(selk);
+
+	if (bench_json)
+		printf("{\"guid\": \"%s\", \"reader\": \"%s\", \"results\": [",
+		    piv_token_guid_hex(selk), piv_token_rdrname(selk));
+
+	bzero(&bs, sizeof (bs));
+	if ((err = bench_run("select", bench_op_select, &bs)))
+		goto out;
+	if ((err = bench_run("apdu", bench_op_apdu, &bs)))
+		goto out;
+
+	for (i = 0; i < nslots; ++i) {
+		if (override != NULL) {
+			slot = override;
+		} else {
+			err = piv_read_cert(selk, slotids[i]);
+			if (err != ERRF_OK && all &&
+			    errf_caused_by(err, "NotFoundError")) {
+				errf_free(err);
+				continue;
+			}
+			if (err != ERRF_OK) {
+				err = funcerrf(err, "failed to read cert for "
+				    "PIV slot %02X", slotids[i]);
+				goto out;
+			}
+			slot = piv_get_slot(selk, slotids[i]);
+		}
+		if ((err = bench_slot(slot)))
+			goto out;
+	}
+
+out:
+	piv_txn_end(selk);
+	if (bench_json)
+		printf("\n]}\n");
+	return (err);
 }
 
 static errf_t *
@@ -2421,6 +3445,341 @@ again9d:
 	return (ERRF_OK);
 }
 
+/*
+ * setup-batch: does what setup does, for every blank YubiKey (one with no
+ * CHUID) on the system at once.
+ *
+ * The CCC and CHUID writes are quick, so we do those for every token first
+ * and then enumerate again to pick the tokens back up with their new GUIDs.
+ * Then each token gets its own thread for the rest (the tokens already each
+ * have their own PCSC context from piv_enumerate()), so that the on-card
+ * key generation, which takes seconds per RSA key, happens on all of them
+ * at the same time. The new PIN and PUK are asked for once and used on
+ * every token.
+ *
+ * Each token's lines go onto the manifest just before its admin key is
+ * changed (so that with -R, the new key is never only on the card):
+ *   <guid> <slot> <public key>
+ *   <guid> admin <hex>		(only with -R, see cmd_setup())
+ *
+ * Tokens are expected to still have the default PIN and PUK. Nothing run
+ * from the worker threads may prompt or exit: a token that isn't as
+ * expected just fails on its own.
+ */
+struct setup_job {
+	struct piv_token *sj_tk;
+	pthread_t sj_thread;
+	boolean_t sj_started;
+	const char *sj_newpin;
+	const char *sj_newpuk;
+	FILE *sj_manifest;
+	errf_t *sj_err;
+};
+
+static const struct setup_slot {
+	enum piv_slotid ss_slotid;
+	enum piv_alg ss_alg;
+} setup_slots[] = {
+	{ PIV_SLOT_9E, PIV_ALG_ECCP256 },
+	{ PIV_SLOT_9A, PIV_ALG_ECCP256 },
+	{ PIV_SLOT_9C, PIV_ALG_RSA2048 },
+	{ PIV_SLOT_9D, PIV_ALG_ECCP256 },
+};
+#define	SETUP_NSLOTS	(sizeof (setup_slots) / sizeof (setup_slots[0]))
+
+#define	SETUP_DEFAULT_PIN	"123456"
+#define	SETUP_DEFAULT_PUK	"12345678"
+
+static pthread_mutex_t setup_manifest_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Writes the CCC and CHUID to a blank token, returning its new GUID. */
+static errf_t *
+setup_batch_init(struct piv_token *tk, uint8_t *nguid)
+{
+	struct tlv_state *ccc, *chuid;
+	errf_t *err;
+
+	make_init_objects(nguid, &ccc, &chuid);
+
+	if ((err = piv_txn_begin(tk)))
+		goto out;
+	if ((err = piv_select(tk)) == ERRF_OK)
+		err = piv_auth_admin(tk, admin_key, key_length, key_alg);
+	if (err == ERRF_OK) {
+		err = piv_write_file(tk, PIV_TAG_CARDCAP,
+		    tlv_buf(ccc), tlv_len(ccc));
+	}
+	if (err == ERRF_OK) {
+		err = piv_write_file(tk, PIV_TAG_CHUID,
+		    tlv_buf(chuid), tlv_len(chuid));
+	}
+	piv_txn_end(tk);
+
+out:
+	tlv_free(ccc);
+	tlv_free(chuid);
+	return (err);
+}
+
+/* Writes a token's lines to the manifest. */
+static errf_t *
+setup_batch_record(struct setup_job *sj, struct sshkey **pubs,
+    const uint8_t *akey, size_t akeylen)
+{
+	const char *guidhex = piv_token_guid_hex(sj->sj_tk);
+	FILE *mf = sj->sj_manifest;
+	errf_t *err = ERRF_OK;
+	char *hex;
+	uint i;
+
+	VERIFY0(pthread_mutex_lock(&setup_manifest_mtx));
+	for (i = 0; i < SETUP_NSLOTS; ++i) {
+		fprintf(mf, "%s %02X ", guidhex, setup_slots[i].ss_slotid);
+		(void) sshkey_write(pubs[i], mf);
+		fprintf(mf, "\n");
+	}
+	if (!save_pinfo_admin) {
+		hex = buf_to_hex(akey, akeylen, B_FALSE);
+		fprintf(mf, "%s admin %s\n", guidhex, hex);
+		freezero(hex, strlen(hex));
+	}
+	if (fflush(mf) != 0 || ferror(mf))
+		err = errfno("fflush", errno, "writing manifest");
+	VERIFY0(pthread_mutex_unlock(&setup_manifest_mtx));
+	return (err);
+}
+
+static errf_t *
+setup_batch_token(struct setup_job *sj, struct sshkey **pubs,
+    uint8_t *akey, size_t akeylen)
+{
+	struct piv_token *tk = sj->sj_tk;
+	const struct setup_slot *ss;
+	struct piv_slot *slot;
+	enum ykpiv_touch_policy touch;
+	boolean_t usetouch;
+	uint i, retries = min_retries;
+	errf_t *err;
+
+	usetouch = (ykpiv_version_compare(tk, 4, 3, 0) == 1);
+
+	if ((err = piv_txn_begin(tk)))
+		return (err);
+	if ((err = piv_select(tk)))
+		goto out;
+	if ((err = piv_auth_admin(tk, admin_key, key_length, key_alg))) {
+		err = funcerrf(err, "admin auth failed");
+		goto out;
+	}
+	/* Check this once up front, rather than on every slot. */
+	if ((err = piv_verify_pin(tk, PIV_PIN, SETUP_DEFAULT_PIN, &retries,
+	    B_FALSE))) {
+		err = funcerrf(err, "token doesn't have the default PIN");
+		goto out;
+	}
+
+	for (i = 0; i < SETUP_NSLOTS; ++i) {
+		ss = &setup_slots[i];
+		touch = YKPIV_TOUCH_DEFAULT;
+		if (ss->ss_slotid == PIV_SLOT_9D && usetouch)
+			touch = YKPIV_TOUCH_CACHED;
+again:
+		if (touch == YKPIV_TOUCH_DEFAULT) {
+			err = piv_generate(tk, ss->ss_slotid, ss->ss_alg,
+			    &pubs[i]);
+		} else {
+			err = ykpiv_generate(tk, ss->ss_slotid, ss->ss_alg,
+			    YKPIV_PIN_DEFAULT, touch, &pubs[i]);
+		}
+		if (touch != YKPIV_TOUCH_DEFAULT &&
+		    (errf_caused_by(err, "ArgumentError") ||
+		    errf_caused_by(err, "NotSupportedError") ||
+		    errf_caused_by(err, "APDUError"))) {
+			errf_free(err);
+			touch = YKPIV_TOUCH_DEFAULT;
+			usetouch = B_FALSE;
+			goto again;
+		}
+		if (err == ERRF_OK) {
+			slot = piv_force_slot(tk, ss->ss_slotid, ss->ss_alg);
+			err = selfsign_slot(tk, slot, ss->ss_slotid,
+			    ss->ss_alg, pubs[i], SETUP_DEFAULT_PIN);
+		}
+		if (err) {
+			err = funcerrf(err, "failed to generate key in "
+			    "slot %02X", ss->ss_slotid);
+			goto out;
+		}
+	}
+
+	if ((err = piv_change_pin(tk, PIV_PIN, SETUP_DEFAULT_PIN,
+	    sj->sj_newpin)) ||
+	    (err = piv_change_pin(tk, PIV_PUK, SETUP_DEFAULT_PUK,
+	    sj->sj_newpuk))) {
+		err = funcerrf(err, "failed to change PIN/PUK");
+		goto out;
+	}
+
+	arc4random_buf(akey, akeylen);
+	if ((err = setup_batch_record(sj, pubs, akey, akeylen))) {
+		err = funcerrf(err, "failed to write manifest, not changing "
+		    "admin key");
+		goto out;
+	}
+	err = ykpiv_set_admin(tk, akey, akeylen, key_new_alg,
+	    usetouch ? YKPIV_TOUCH_ALWAYS : YKPIV_TOUCH_DEFAULT);
+	if (err == ERRF_OK && save_pinfo_admin)
+		err = save_pinfo_admin_key(tk, akey, akeylen);
+	if (err)
+		err = funcerrf(err, "failed to set new admin key");
+
+out:
+	piv_txn_end(tk);
+	return (err);
+}
+
+static void *
+setup_batch_worker(void *arg)
+{
+	struct setup_job *sj = arg;
+	struct sshkey *pubs[SETUP_NSLOTS];
+	size_t akeylen = len_for_admin_alg(key_new_alg);
+	uint8_t *akey;
+	uint i;
+
+	bzero(pubs, sizeof (pubs));
+	akey = calloc(1, akeylen);
+	VERIFY(akey != NULL);
+
+	sj->sj_err = setup_batch_token(sj, pubs, akey, akeylen);
+	if (sj->sj_err == ERRF_OK) {
+		fprintf(stderr, "Finished token %s\n",
+		    piv_token_guid_hex(sj->sj_tk));
+	}
+
+	for (i = 0; i < SETUP_NSLOTS; ++i)
+		sshkey_free(pubs[i]);
+	freezero(akey, akeylen);
+	return (NULL);
+}
+
+static errf_t *
+cmd_setup_batch(SCARDCONTEXT ctx, const char *manifest)
+{
+	struct piv_token *tk;
+	struct setup_job *jobs = NULL;
+	uint8_t (*guids)[GUID_LEN] = NULL;
+	char *newpin = NULL, *newpuk = NULL;
+	FILE *mf = stdout;
+	size_t nblank = 0, ntotal, njobs = 0, nfailed = 0, i;
+	errf_t *err;
+
+	if ((err = piv_enumerate(ctx, &ks)))
+		return (err);
+	for (tk = ks; tk != NULL; tk = piv_token_next(tk)) {
+		if (piv_token_is_ykpiv(tk) && !piv_token_has_chuid(tk))
+			++nblank;
+	}
+	if (nblank == 0) {
+		err = funcerrf(NULL, "no blank YubiKeys found");
+		goto out;
+	}
+	fprintf(stderr, "Found %zu blank YubiKey(s)\n", nblank);
+	ntotal = nblank;
+
+	if ((err = prompt_new_pin(PIV_PIN, "all tokens", "characters",
+	    &newpin)) ||
+	    (err = prompt_new_pin(PIV_PUK, "all tokens", "characters",
+	    &newpuk))) {
+		goto out;
+	}
+	if (manifest != NULL && (mf = fopen(manifest, "a")) == NULL) {
+		err = errfno("fopen", errno, "%s", manifest);
+		goto out;
+	}
+
+	fprintf(stderr, "Initializing CCC and CHUID files...\n");
+	guids = calloc(nblank, GUID_LEN);
+	VERIFY(guids != NULL);
+	i = 0;
+	for (tk = ks; tk != NULL; tk = piv_token_next(tk)) {
+		if (!piv_token_is_ykpiv(tk) || piv_token_has_chuid(tk))
+			continue;
+		if ((err = setup_batch_init(tk, guids[i]))) {
+			warnfx(err, "failed to initialize token in reader "
+			    "'%s', skipping it", piv_token_rdrname(tk));
+			errf_free(err);
+			++nfailed;
+			continue;
+		}
+		++i;
+	}
+	nblank = i;
+
+	/* Pick them back up so they have their new GUIDs. */
+	piv_release(ks);
+	ks = NULL;
+	if ((err = piv_enumerate(ctx, &ks)))
+		goto out;
+	jobs = calloc(nblank, sizeof (struct setup_job));
+	VERIFY(jobs != NULL);
+	for (tk = ks; tk != NULL; tk = piv_token_next(tk)) {
+		if (!piv_token_has_chuid(tk))
+			continue;
+		for (i = 0; i < nblank; ++i) {
+			if (bcmp(piv_token_guid(tk), guids[i], GUID_LEN) == 0)
+				break;
+		}
+		if (i == nblank)
+			continue;
+		jobs[njobs].sj_tk = tk;
+		jobs[njobs].sj_newpin = newpin;
+		jobs[njobs].sj_newpuk = newpuk;
+		jobs[njobs].sj_manifest = mf;
+		++njobs;
+	}
+	/* Any we initialized but didn't find again count as failures. */
+	nfailed += nblank - njobs;
+
+	fprintf(stderr, "Generating keys on %zu token(s)...\n", njobs);
+	fprintf(stderr, "Please touch each YubiKey when it is flashing\n");
+	for (i = 0; i < njobs; ++i) {
+		if (pthread_create(&jobs[i].sj_thread, NULL,
+		    setup_batch_worker, &jobs[i]) == 0) {
+			jobs[i].sj_started = B_TRUE;
+		} else {
+			/* Just do it here instead. */
+			(void) setup_batch_worker(&jobs[i]);
+		}
+	}
+	for (i = 0; i < njobs; ++i) {
+		if (jobs[i].sj_started)
+			VERIFY0(pthread_join(jobs[i].sj_thread, NULL));
+		if (jobs[i].sj_err != ERRF_OK) {
+			warnfx(jobs[i].sj_err, "setup failed on token %s",
+			    piv_token_guid_hex(jobs[i].sj_tk));
+			errf_free(jobs[i].sj_err);
+			++nfailed;
+		}
+	}
+
+	if (nfailed > 0) {
+		err = funcerrf(NULL, "setup failed on %zu of %zu token(s)",
+		    nfailed, ntotal);
+	} else {
+		fprintf(stderr, "Done!\n");
+	}
+
+out:
+	if (mf != stdout && mf != NULL)
+		fclose(mf);
+	free(jobs);
+	free(guids);
+	freezero(newpin, newpin == NULL ? 0 : strlen(newpin));
+	freezero(newpuk, newpuk == NULL ? 0 : strlen(newpuk));
+	return (err);
+}
+
 #if defined(__sun)
 const char *
 _umem_debug_init()
@@ -2444,6 +3803,10 @@ usage(void)
 	    "  setup                  Quick setup procedure for new YubiKey\n"
 	    "                         (does init + generate + change-pin +\n"
 	    "                         change-puk + set-admin)\n"
+	    "  setup-batch [manifest] Runs setup on every blank YubiKey\n"
+	    "                         present at once, writing their GUIDs\n"
+	    "                         and public keys to manifest (or\n"
+	    "                         stdout)\n"
 	    "  generate <slot>        Generate a new private key and a\n"
 	    "                         self-signed cert\n"
 	    "  import <slot>          Accept a SSH private key on stdin\n"
@@ -2459,19 +3822,28 @@ usage(void)
 	    "  update-keyhist         Scan all retired key slots and then\n"
 	    "                         re-generate the PIV Key History object\n"
 	    "\n"
-	    "  sign <slot>            Signs data on stdin\n"
+	    "  sign <slot> [file]     Signs data on stdin (or in file)\n"
+	    "  sign-batch <slot>      Signs a stream of digests on stdin,\n"
+	    "                         one hex digest per line (EC only)\n"
 	    "  ecdh <slot>            Do ECDH with pubkey on stdin\n"
 	    "  auth <slot>            Does a round-trip signature test to\n"
 	    "                         verify that the pubkey on stdin\n"
 	    "                         matches the one in the slot\n"
 	    "  attest <slot>          (Yubikey only) Output attestation cert\n"
 	    "                         and chain for a given slot.\n"
+	    "  bench [slot...]        Times card operations on the given\n"
+	    "                         slots (default: all of 9A-9E present)\n"
 	    "\n"
 	    "  box [slot]             Encrypts stdin data with an ECDH box\n"
 	    "  unbox                  Decrypts stdin data with an ECDH box\n"
 	    "                         Chooses token and slot automatically\n"
 	    "  box-info               Prints metadata about a box from stdin\n"
 	    "\n"
+	    "  agent-stats            Prints statistics from the running\n"
+	    "                         pivy-agent (in Prometheus text format)\n"
+	    "  apdu-log               Prints the last APDUs the running\n"
+	    "                         pivy-agent exchanged with its card(s)\n"
+	    "\n"
 	    "General options:\n"
 	    "  -g <hex>               GUID of the PIV token to use\n"
 	    "                         (Required if >1 token on system)\n"
@@ -2508,16 +3880,46 @@ usage(void)
 	    "  -i <never|always|once> Set the PIN policy. Only supported\n"
 	    "                         with YubiKeys\n"
 	    "\n"
+	    "Options for 'sign':\n"
+	    "  -S                     Hash the input as it's read rather\n"
+	    "                         than holding it in memory (no size\n"
+	    "                         limit; implied when a file is given)\n"
+	    "\n"
+	    "Options for 'sign-batch':\n"
+	    "  -L                     Read and write length-prefixed binary\n"
+	    "                         (4-byte big-endian length, then data)\n"
+	    "                         instead of hex lines\n"
+	    "\n"
+	    "Options for 'bench':\n"
+	    "  -c <count>             Timed iterations per operation\n"
+	    "                         (default 60)\n"
+	    "  -w <count>             Untimed warm-up iterations per\n"
+	    "                         operation (default 3)\n"
+	    "  -j                     Output results as JSON\n"
+	    "\n"
 	    "Options for 'box'/'unbox':\n"
 	    "  -k <pubkey>            Use a public key for box operation\n"
 	    "                         instead of a slot\n"
+	    "  -L                     Box/unbox a stream of length-prefixed\n"
+	    "                         inputs on stdin (as for sign-batch)\n"
 	    "\n"
 	    "Options for 'set-admin'/'setup':\n"
 	    "  -R                     Don't save admin key in the PIV\n"
 	    "                         'printed info' object (compat with\n"
 	    "                         Yubico PIV manager)\n"
 	    "  -N <new key type>      Change the type of admin key, same\n"
-	    "                         args as -A.\n");
+	    "                         args as -A.\n"
+	    "\n"
+	    "Environment variables:\n"
+	    "  PIVY_CERT_CACHE        Directory in which to cache slot\n"
+	    "                         public keys between runs (makes 'list'\n"
+	    "                         and friends faster)\n"
+	    "  PIVY_SOFT_TOKEN        Path to a software PIV token to use as\n"
+	    "                         well as real cards, for testing (created\n"
+	    "                         if missing; keys are NOT protected)\n"
+	    "  PIVY_SOFT_TOKEN_LATENCY\n"
+	    "                         Delay in usec added to each APDU sent\n"
+	    "                         to the software token\n");
 	exit(EXIT_BAD_ARGS);
 }
 
@@ -2530,7 +3932,7 @@ usage(void)
     "f(force)"
     "K:(admin-key)"
     "k:(key)";*/
-const char *optstring = "dpg:P:a:fK:k:n:t:i:u:RXA:N:";
+const char *optstring = "dpg:P:a:fK:k:n:t:i:u:RXA:N:Lc:w:jS";
 
 int
 main(int argc, char *argv[])
@@ -2550,6 +3952,8 @@ main(int argc, char *argv[])
 	bunyan_init();
 	bunyan_set_name("pivy-tool");
 
+	piv_cert_cache_dir = getenv("PIVY_CERT_CACHE");
+
 	while ((c = getopt(argc, argv, optstring)) != -1) {
 		switch (c) {
 		case 'd':
@@ -2563,6 +3967,23 @@ main(int argc, char *argv[])
 		case 'X':
 			enum_all_retired = B_TRUE;
 			break;
+		case 'L':
+			batch_binary = B_TRUE;
+			break;
+		case 'S':
+			sign_stream = B_TRUE;
+			break;
+		case 'c':
+			bench_iters = bench_parse_count(optarg, 1, 1000000,
+			    "iteration count");
+			break;
+		case 'w':
+			bench_warmup = bench_parse_count(optarg, 0, 1000000,
+			    "warm-up count");
+			break;
+		case 'j':
+			bench_json = B_TRUE;
+			break;
 		case 'A':
 			if (strcasecmp(optarg, "3des") == 0) {
 				key_alg = PIV_ALG_3DES;
@@ -2694,6 +4115,9 @@ main(int argc, char *argv[])
 
 	const char *op = argv[optind++];
 
+	if ((err = piv_soft_card_add_env()))
+		errfx(EXIT_IO_ERROR, err, "failed to set up PIVY_SOFT_TOKEN");
+
 	rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &ctx);
 	if (rv != SCARD_S_SUCCESS) {
 		errfx(EXIT_IO_ERROR, pcscerrf("SCardEstablishContext", rv),
@@ -2706,7 +4130,7 @@ main(int argc, char *argv[])
 #endif
 
 	if (strcmp(op, "list") == 0) {
-		err = piv_enumerate(ctx, &ks);
+		err = piv_enumerate_opts(ctx, &guid_only, &ks);
 		if (err)
 			errfx(1, err, "failed to enumerate PIV tokens");
 		if (optind < argc)
@@ -2804,6 +4228,7 @@ main(int argc, char *argv[])
 
 	} else if (strcmp(op, "sign") == 0) {
 		uint slotid;
+		const char *fname = NULL;
 
 		if (optind >= argc) {
 			warnx("not enough arguments for %s", op);
@@ -2811,6 +4236,9 @@ main(int argc, char *argv[])
 		}
 		slotid = strtol(argv[optind++], NULL, 16);
 
+		if (optind < argc)
+			fname = argv[optind++];
+
 		if (optind < argc) {
 			warnx("too many arguments for %s", op);
 			usage();
@@ -2819,9 +4247,12 @@ main(int argc, char *argv[])
 		check_select_key();
 		if (hasover)
 			override = piv_force_slot(selk, slotid, overalg);
-		err = cmd_sign(slotid);
+		if (sign_stream || fname != NULL)
+			err = cmd_sign_stream(slotid, fname);
+		else
+			err = cmd_sign(slotid);
 
-	} else if (strcmp(op, "bench") == 0) {
+	} else if (strcmp(op, "sign-batch") == 0) {
 		uint slotid;
 
 		if (optind >= argc) {
@@ -2838,7 +4269,29 @@ main(int argc, char *argv[])
 		check_select_key();
 		if (hasover)
 			override = piv_force_slot(selk, slotid, overalg);
-		err = cmd_bench(slotid);
+		err = cmd_sign_batch(slotid);
+
+	} else if (strcmp(op, "bench") == 0) {
+		uint slotids[8];
+		uint nslots = 0;
+
+		while (optind < argc) {
+			if (nslots >= sizeof (slotids) / sizeof (slotids[0])) {
+				warnx("too many arguments for %s", op);
+				usage();
+			}
+			slotids[nslots++] = strtol(argv[optind++], NULL, 16);
+		}
+
+		check_select_key();
+		if (hasover) {
+			if (nslots != 1) {
+				warnx("-a requires exactly one slot for %s", op);
+				usage();
+			}
+			override = piv_force_slot(selk, slotids[0], overalg);
+		}
+		err = cmd_bench(slotids, nslots);
 
 	} else if (strcmp(op, "pubkey") == 0) {
 		uint slotid;
@@ -2884,6 +4337,16 @@ main(int argc, char *argv[])
 		check_select_key();
 		err = cmd_setup(ctx);
 
+	} else if (strcmp(op, "setup-batch") == 0) {
+		const char *manifest = NULL;
+		if (optind < argc)
+			manifest = argv[optind++];
+		if (optind < argc) {
+			warnx("too many arguments for %s", op);
+			usage();
+		}
+		err = cmd_setup_batch(ctx, manifest);
+
 	} else if (strcmp(op, "factory-reset") == 0) {
 		if (optind < argc) {
 			warnx("too many arguments for %s", op);
@@ -2985,6 +4448,20 @@ main(int argc, char *argv[])
 		}
 		err = cmd_box_info();
 
+	} else if (strcmp(op, "agent-stats") == 0) {
+		if (optind < argc) {
+			warnx("too many arguments for %s", op);
+			usage();
+		}
+		err = cmd_agent_stats();
+
+	} else if (strcmp(op, "apdu-log") == 0) {
+		if (optind < argc) {
+			warnx("too many arguments for %s", op);
+			usage();
+		}
+		err = cmd_apdu_log();
+
 	} else if (strcmp(op, "sgdebug") == 0) {
 		if (optind < argc) {
 			warnx("too many arguments for %s", op);
@@ -20,6 +20,7 @@
 #include <strings.h>
 #include <limits.h>
 #include <err.h>
+#include <pthread.h>
 
 #if defined(__APPLE__)
 #include <PCSC/wintypes.h>
@@ -93,19 +94,25 @@ unlock_or_recover(struct ebox *ebox, const char *descr, boolean_t *recovered)
 	struct question *q = NULL;
 	struct answer *a;
 	char k = '0';
+	struct ebox_session *sess = ebox_local_session();
 
 	/* Try to use the pivy-agent to unlock first if we have one. */
 	config = NULL;
 	while ((config = ebox_next_config(ebox, config)) != NULL) {
 		tconfig = ebox_config_tpl(config);
 		if (ebox_tpl_config_type(tconfig) == EBOX_PRIMARY) {
-			part = ebox_config_next_part(config, NULL);
+			if ((error = load_primary_part(ebox, config, &part))) {
+				ebox_session_end(sess);
+				return (error);
+			}
 			tpart = ebox_part_tpl(part);
-			error = local_unlock_agent(ebox_part_box(part));
+			error = ebox_session_agent_unlock(sess,
+			    ebox_part_box(part));
 			if (error) {
 				errf_free(error);
 				continue;
 			}
+			ebox_session_end(sess);
 			error = ebox_unlock(ebox, config);
 			if (error)
 				return (error);
@@ -118,17 +125,23 @@ unlock_or_recover(struct ebox *ebox, const char *descr, boolean_t *recovered)
 	while ((config = ebox_next_config(ebox, config)) != NULL) {
 		tconfig = ebox_config_tpl(config);
 		if (ebox_tpl_config_type(tconfig) == EBOX_PRIMARY) {
-			part = ebox_config_next_part(config, NULL);
+			if ((error = load_primary_part(ebox, config, &part))) {
+				ebox_session_end(sess);
+				return (error);
+			}
 			tpart = ebox_part_tpl(part);
-			error = local_unlock(ebox_part_box(part),
-			    ebox_tpl_part_cak(tpart),
+			error = ebox_session_local_unlock(sess,
+			    ebox_part_box(part), ebox_tpl_part_cak(tpart),
 			    ebox_tpl_part_name(tpart));
-			if (error && !errf_caused_by(error, "NotFoundError"))
+			if (error && !errf_caused_by(error, "NotFoundError")) {
+				ebox_session_end(sess);
 				return (error);
+			}
 			if (error) {
 				errf_free(error);
 				continue;
 			}
+			ebox_session_end(sess);
 			error = ebox_unlock(ebox, config);
 			if (error)
 				return (error);
@@ -136,6 +149,11 @@ unlock_or_recover(struct ebox *ebox, const char *descr, boolean_t *recovered)
 			goto done;
 		}
 	}
+	ebox_session_end(sess);
+
+	/* Recovery needs the whole ebox (and its template, to rebox it). */
+	if ((error = ebox_load(ebox)))
+		return (error);
 
 	q = calloc(1, sizeof (struct question));
 	question_printf(q, "-- Recovery mode --\n");
@@ -261,7 +279,7 @@ cmd_unlock(const char *fsname)
 		errfx(EXIT_ERROR, error, "failed to parse rfd77:ebox property"
 		    " on %s as base64", fsname);
 	}
-	if ((error = sshbuf_get_ebox(buf, &ebox))) {
+	if ((error = sshbuf_get_ebox_lazy(buf, &ebox))) {
 		errfx(EXIT_ERROR, error, "failed to parse rfd77:ebox property"
 		    " on %s as a valid ebox", fsname);
 	}
@@ -373,6 +391,332 @@ done:
 	zfs_close(ds);
 }
 
+#if defined(DMU_OT_ENCRYPTED)
+
+/* Max number of 'zfs load-key' calls we have in flight at once. */
+#define	LOAD_KEY_THREADS	8
+
+struct zfs_unlock {
+	zfs_handle_t *zu_ds;
+	const char *zu_name;
+	char *zu_b64;
+	const char *zu_propname;
+	struct ebox *zu_ebox;
+	boolean_t zu_unlocked;
+	boolean_t zu_recovered;
+	int zu_rc;
+};
+
+struct zfs_unlock_set {
+	struct zfs_unlock *zus_ents;
+	size_t zus_n;
+	size_t zus_alloc;
+	size_t zus_loaded;
+	size_t zus_next;
+};
+
+static int
+unlock_r_collect(zfs_handle_t *ds, void *arg)
+{
+	struct zfs_unlock_set *set = arg;
+	struct zfs_unlock *zu;
+	nvlist_t *props, *prop;
+	const char *propname;
+	char encroot[ZFS_MAX_DATASET_NAME_LEN];
+	struct sshbuf *buf;
+	errf_t *error;
+	int rc;
+
+	(void) zfs_iter_filesystems(ds, unlock_r_collect, set);
+
+	/*
+	 * Keys are only loaded at encryption roots, and everything under one
+	 * inherits its ebox property too, so skip the rest.
+	 */
+	if (zfs_prop_get(ds, ZFS_PROP_ENCRYPTION_ROOT, encroot,
+	    sizeof (encroot), NULL, NULL, 0, B_TRUE) != 0 ||
+	    strcmp(encroot, zfs_get_name(ds)) != 0) {
+		zfs_close(ds);
+		return (0);
+	}
+	if (zfs_prop_get_int(ds, ZFS_PROP_KEYSTATUS) ==
+	    ZFS_KEYSTATUS_AVAILABLE) {
+		++set->zus_loaded;
+		zfs_close(ds);
+		return (0);
+	}
+
+	props = zfs_get_user_props(ds);
+	VERIFY(props != NULL);
+	propname = PROP_RFD77_TEMP;
+	rc = nvlist_lookup_nvlist(props, propname, &prop);
+	if (rc) {
+		propname = PROP_RFD77;
+		rc = nvlist_lookup_nvlist(props, propname, &prop);
+	}
+	if (rc) {
+		propname = PROP_JOYENT;
+		rc = nvlist_lookup_nvlist(props, propname, &prop);
+	}
+	if (rc) {
+		warnx("no ebox property could be read on dataset %s, "
+		    "skipping", zfs_get_name(ds));
+		zfs_close(ds);
+		return (0);
+	}
+
+	if (set->zus_n == set->zus_alloc) {
+		set->zus_alloc = set->zus_alloc ? set->zus_alloc * 2 : 16;
+		set->zus_ents = reallocarray(set->zus_ents, set->zus_alloc,
+		    sizeof (struct zfs_unlock));
+		if (set->zus_ents == NULL)
+			err(EXIT_ERROR, "failed to allocate memory");
+	}
+	zu = &set->zus_ents[set->zus_n];
+	bzero(zu, sizeof (*zu));
+	zu->zu_ds = ds;
+	zu->zu_name = zfs_get_name(ds);
+	zu->zu_propname = propname;
+	VERIFY0(nvlist_lookup_string(prop, "value", &zu->zu_b64));
+
+	buf = sshbuf_new();
+	if (buf == NULL)
+		err(EXIT_ERROR, "failed to allocate buffer");
+	if ((rc = sshbuf_b64tod(buf, zu->zu_b64))) {
+		error = ssherrf("sshbuf_b64tod", rc);
+		warnfx(error, "failed to parse ebox property on %s as "
+		    "base64, skipping", zu->zu_name);
+		errf_free(error);
+		sshbuf_free(buf);
+		zfs_close(ds);
+		return (0);
+	}
+	if ((error = sshbuf_get_ebox_lazy(buf, &zu->zu_ebox))) {
+		warnfx(error, "failed to parse ebox property on %s as a "
+		    "valid ebox, skipping", zu->zu_name);
+		errf_free(error);
+		sshbuf_free(buf);
+		zfs_close(ds);
+		return (0);
+	}
+	sshbuf_free(buf);
+
+	++set->zus_n;
+	return (0);
+}
+
+static void *
+unlock_r_load_worker(void *arg)
+{
+	struct zfs_unlock_set *set = arg;
+	struct zfs_unlock *zu;
+	const uint8_t *key;
+	size_t i, keylen;
+
+	while ((i = __atomic_fetch_add(&set->zus_next, 1,
+	    __ATOMIC_RELAXED)) < set->zus_n) {
+		zu = &set->zus_ents[i];
+		if (!zu->zu_unlocked)
+			continue;
+		key = ebox_key(zu->zu_ebox, &keylen);
+		zu->zu_rc = lzc_load_key(zu->zu_name, B_FALSE, (uint8_t *)key,
+		    keylen);
+	}
+	return (NULL);
+}
+
+static void
+cmd_unlock_recursive(const char *fsname)
+{
+	struct zfs_unlock_set set;
+	struct zfs_unlock *zu;
+	zfs_handle_t *root;
+	pthread_t workers[LOAD_KEY_THREADS];
+	size_t i, desclen, nworkers, nfail = 0, nrecovered = 0, nleft;
+	struct ebox **eboxes;
+	boolean_t *unlocked, *recovered;
+	char *description, *line;
+	errf_t *error;
+	int rc;
+
+	bzero(&set, sizeof (set));
+
+	root = zfs_open(zfshdl, fsname, ZFS_TYPE_FILESYSTEM);
+	if (root == NULL)
+		err(EXIT_ERROR, "failed to open dataset %s", fsname);
+	/* This takes ownership of root. */
+	(void) unlock_r_collect(root, &set);
+
+	if (set.zus_n == 0) {
+		if (set.zus_loaded > 0) {
+			errx(EXIT_ALREADY_UNLOCKED, "keys already loaded for "
+			    "all encrypted datasets under %s", fsname);
+		}
+		errx(EXIT_ERROR, "no encrypted datasets with an ebox "
+		    "property found under %s", fsname);
+	}
+
+	fprintf(stderr, "Attempting to unlock %zu ZFS datasets under "
+	    "'%s'...\n", set.zus_n, fsname);
+	(void) mlockall(MCL_CURRENT | MCL_FUTURE);
+
+	/*
+	 * First do everything we can with the primary tokens that are
+	 * present, one transaction (and PIN entry) per token.
+	 */
+	eboxes = calloc(set.zus_n, sizeof (struct ebox *));
+	unlocked = calloc(set.zus_n, sizeof (boolean_t));
+	recovered = calloc(set.zus_n, sizeof (boolean_t));
+	if (eboxes == NULL || unlocked == NULL || recovered == NULL)
+		err(EXIT_ERROR, "failed to allocate memory");
+	for (i = 0; i < set.zus_n; ++i)
+		eboxes[i] = set.zus_ents[i].zu_ebox;
+	local_unlock_eboxes(eboxes, unlocked, set.zus_n);
+	for (i = 0; i < set.zus_n; ++i)
+		set.zus_ents[i].zu_unlocked = unlocked[i];
+
+	/*
+	 * If there are several left over, offer to recover them all together:
+	 * each recovery device then only has to answer one challenge bundle,
+	 * rather than one challenge per dataset.
+	 */
+	for (i = 0, nleft = 0; i < set.zus_n; ++i) {
+		if (!unlocked[i])
+			++nleft;
+	}
+	if (nleft > 1 && !ebox_batch) {
+		fprintf(stderr, "%zu datasets could not be unlocked with the "
+		    "tokens present.\n", nleft);
+		line = readline("Recover them all together with one challenge "
+		    "per recovery device? [y/N] ");
+		if (line != NULL && (line[0] == 'y' || line[0] == 'Y')) {
+			bcopy(unlocked, recovered,
+			    set.zus_n * sizeof (boolean_t));
+			error = interactive_recovery_batch(eboxes, recovered,
+			    set.zus_n, "ZFS datasets");
+			if (error) {
+				warnfx(error, "batch recovery failed");
+				errf_free(error);
+			}
+			for (i = 0; i < set.zus_n; ++i) {
+				zu = &set.zus_ents[i];
+				if (zu->zu_unlocked || !recovered[i])
+					continue;
+				zu->zu_unlocked = B_TRUE;
+				zu->zu_recovered = B_TRUE;
+			}
+		}
+		free(line);
+	}
+	free(eboxes);
+	free(unlocked);
+	free(recovered);
+
+	/*
+	 * Anything left over (no primary token present, or it failed) goes
+	 * through the normal one-at-a-time path, which includes recovery.
+	 */
+	for (i = 0; i < set.zus_n; ++i) {
+		zu = &set.zus_ents[i];
+		if (zu->zu_unlocked)
+			continue;
+		desclen = strlen(zu->zu_name) + 128;
+		description = calloc(1, desclen);
+		VERIFY(description != NULL);
+		snprintf(description, desclen, "ZFS filesystem %s",
+		    zu->zu_name);
+		fprintf(stderr, "Attempting to unlock ZFS '%s'...\n",
+		    zu->zu_name);
+		error = unlock_or_recover(zu->zu_ebox, description,
+		    &zu->zu_recovered);
+		free(description);
+		if (error) {
+			warnfx(error, "failed to unlock ebox for %s",
+			    zu->zu_name);
+			errf_free(error);
+			++nfail;
+			continue;
+		}
+		zu->zu_unlocked = B_TRUE;
+	}
+
+	nworkers = set.zus_n < LOAD_KEY_THREADS ? set.zus_n : LOAD_KEY_THREADS;
+	for (i = 0; i < nworkers; ++i) {
+		VERIFY0(pthread_create(&workers[i], NULL, unlock_r_load_worker,
+		    &set));
+	}
+	for (i = 0; i < nworkers; ++i)
+		VERIFY0(pthread_join(workers[i], NULL));
+
+	for (i = 0; i < set.zus_n; ++i) {
+		zu = &set.zus_ents[i];
+		if (!zu->zu_unlocked)
+			goto next;
+		if (zu->zu_rc != 0) {
+			errno = zu->zu_rc;
+			warn("failed to load key material into ZFS for %s",
+			    zu->zu_name);
+			++nfail;
+			goto next;
+		}
+		if (zu->zu_recovered)
+			++nrecovered;
+		if (zu->zu_propname == PROP_RFD77_TEMP) {
+			rc = zfs_prop_set(zu->zu_ds, PROP_RFD77, zu->zu_b64);
+			if (rc != 0) {
+				errno = rc;
+				warn("failed to set ZFS property rfd77:ebox "
+				    "on dataset %s", zu->zu_name);
+				++nfail;
+				goto next;
+			}
+			rc = zfs_prop_inherit(zu->zu_ds, PROP_RFD77_TEMP,
+			    B_FALSE);
+			if (rc != 0) {
+				errno = rc;
+				warn("failed to delete temporary ZFS "
+				    "property on dataset %s", zu->zu_name);
+				++nfail;
+			}
+		}
+next:
+		ebox_free(zu->zu_ebox);
+		zfs_close(zu->zu_ds);
+	}
+	free(set.zus_ents);
+
+	/* As in cmd_unlock(), best-effort mount if this was a whole pool. */
+	if (strchr(fsname, '/') == NULL) {
+		zpool_handle_t *pool;
+		pool = zpool_open_canfail(zfshdl, fsname);
+		if (pool != NULL) {
+			(void) zpool_enable_datasets(pool, NULL, 0);
+			zpool_close(pool);
+		}
+	}
+
+	if (nrecovered > 0) {
+		fprintf(stderr, "%zu dataset(s) were unlocked using a recovery "
+		    "config. If the original primary PIV\ntoken has been "
+		    "lost or damaged, use `pivy-zfs rekey' on each of them "
+		    "to\nreplace it.\n", nrecovered);
+	}
+	if (nfail > 0) {
+		errx(EXIT_ERROR, "failed to unlock %zu of %zu datasets",
+		    nfail, set.zus_n);
+	}
+}
+
+#else
+
+static void
+cmd_unlock_recursive(const char *fsname)
+{
+	errx(EXIT_ERROR, "this ZFS implementation does not support encryption");
+}
+
+#endif
+
 static void
 cmd_rekey(const char *fsname)
 {
@@ -665,7 +1009,9 @@ usage(void)
 	    "  -t tplname              Specify ebox template name\n"
 	    "\n"
 	    "Available operations:\n"
-	    "  unlock <zfs>            Unlock an encrypted ZFS filesystem\n"
+	    "  unlock [-r] <zfs>       Unlock an encrypted ZFS filesystem\n"
+	    "                          (-r: and all encrypted filesystems\n"
+	    "                          under it)\n"
 	    "  zfs-create -- <args>    Run 'zfs create' with arguments and\n"
 	    "                          input transformed to provide keys for\n"
 	    "                          encryption.\n"
@@ -691,8 +1037,9 @@ main(int argc, char *argv[])
 	extern char *optarg;
 	extern int optind;
 	int c;
-	const char *optstring = "t:d";
+	const char *optstring = "t:dr";
 	const char *tpl = NULL;
+	boolean_t recursive = B_FALSE;
 
 	qa_term_setup();
 
@@ -708,6 +1055,9 @@ main(int argc, char *argv[])
 		case 't':
 			tpl = optarg;
 			break;
+		case 'r':
+			recursive = B_TRUE;
+			break;
 		}
 	}
 
@@ -726,6 +1076,17 @@ main(int argc, char *argv[])
 	if (strcmp(op, "unlock") == 0) {
 		const char *fsname;
 
+		/* For getopt()s which stop at the first non-option. */
+		while ((c = getopt(argc, argv, "r")) != -1) {
+			switch (c) {
+			case 'r':
+				recursive = B_TRUE;
+				break;
+			default:
+				usage();
+			}
+		}
+
 		if (optind >= argc) {
 			warnx("target zfs required");
 			usage();
@@ -737,7 +1098,10 @@ main(int argc, char *argv[])
 			usage();
 		}
 
-		cmd_unlock(fsname);
+		if (recursive)
+			cmd_unlock_recursive(fsname);
+		else
+			cmd_unlock(fsname);
 
 	} else if (strcmp(op, "rekey") == 0) {
 		const char *fsname;
@@ -0,0 +1,59 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#if !defined(_PIVY_PROBES_H)
+#define	_PIVY_PROBES_H
+
+/*
+ * Static (USDT) probes for the "pivy" provider.
+ *
+ * On Linux we use the systemtap <sys/sdt.h> (from systemtap-sdt-dev or
+ * systemtap-sdt-devel), which needs nothing at link time and is what
+ * bpftrace's usdt: probes and perf read. On other platforms, or if the
+ * header isn't there, or if built with -DPIVY_NO_USDT (USE_USDT=no), every
+ * probe compiles down to nothing.
+ *
+ * Probe arguments should always be cheap to evaluate: they're computed even
+ * when nobody is tracing.
+ *
+ *   pivy:apdu__start(ins, p1, p2, lc)
+ *   pivy:apdu__done(ins, sw, usec, lr)		usec == 0 if not timed
+ *   pivy:apdu__fail(ins, pcsc_rv)
+ *   pivy:txn__begin(rdrname)
+ *   pivy:txn__begun(rdrname, ok)
+ *   pivy:txn__end(rdrname)
+ *   pivy:sign__start(slotid, datalen)
+ *   pivy:sign__done(slotid, ok)
+ *   pivy:ecdh__start(slotid)
+ *   pivy:ecdh__done(slotid, ok)
+ *   pivy:box__open__start(slotid)
+ *   pivy:box__open__done(slotid, ok)
+ *   pivy:agent__msg__start(fd, type, client_pid, client_cmd)
+ *   pivy:agent__msg__done(fd, type, ok)
+ */
+
+#if !defined(PIVY_NO_USDT) && defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define	PIVY_USDT	1
+#endif
+#endif
+
+#if defined(PIVY_USDT)
+#define	PIVY_PROBE0(n)			DTRACE_PROBE(pivy, n)
+#define	PIVY_PROBE1(n, a)		DTRACE_PROBE1(pivy, n, a)
+#define	PIVY_PROBE2(n, a, b)		DTRACE_PROBE2(pivy, n, a, b)
+#define	PIVY_PROBE3(n, a, b, c)		DTRACE_PROBE3(pivy, n, a, b, c)
+#define	PIVY_PROBE4(n, a, b, c, d)	DTRACE_PROBE4(pivy, n, a, b, c, d)
+#else
+#define	PIVY_PROBE0(n)			((void)0)
+#define	PIVY_PROBE1(n, a)		((void)0)
+#define	PIVY_PROBE2(n, a, b)		((void)0)
+#define	PIVY_PROBE3(n, a, b, c)		((void)0)
+#define	PIVY_PROBE4(n, a, b, c, d)	((void)0)
+#endif
+
+#endif	/* _PIVY_PROBES_H */
@@ -0,0 +1,238 @@
+/*
+ * Bitsliced GF(2^8) arithmetic, included by hazmat.c once for each word
+ * type it works with. The includer defines:
+ *
+ *   GF256_WORD	the type holding one bit of every byte being worked on
+ *		(uint32_t for one 32-byte key, or a vector of them to work
+ *		on several keys at once)
+ *   GF256_FN(n)	the name to give the function "n"
+ *   GF256_ATTR	function attributes (e.g. a target("avx2") attribute)
+ *
+ * Everything in here only uses bitwise operations, so it works the same
+ * (and is just as constant-time) with plain integers or vector types.
+ */
+
+/*
+ * Add (XOR) `r` with `x` and store the result in `r`.
+ */
+static void GF256_ATTR
+GF256_FN(add)(GF256_WORD r[8], const GF256_WORD x[8])
+{
+	size_t idx;
+	for (idx = 0; idx < 8; idx++) r[idx] ^= x[idx];
+}
+
+
+/*
+ * Safely multiply two bitsliced polynomials in GF(2^8) reduced by
+ * x^8 + x^4 + x^3 + x + 1. `r` and `a` may overlap, but overlapping of `r`
+ * and `b` will produce an incorrect result! If you need to square a polynomial
+ * use `gf256_square` instead.
+ */
+static void GF256_ATTR
+GF256_FN(mul)(GF256_WORD r[8], const GF256_WORD a[8], const GF256_WORD b[8])
+{
+	/* This function implements Russian Peasant multiplication on two
+	 * bitsliced polynomials.
+	 *
+	 * I personally think that these kinds of long lists of operations
+	 * are often a bit ugly. A double for loop would be nicer and would
+	 * take up a lot less lines of code.
+	 * However, some compilers seem to fail in optimizing these kinds of
+	 * loops. So we will just have to do this by hand.
+	 */
+	GF256_WORD a2[8];
+	memcpy(a2, a, sizeof(GF256_WORD[8]));
+
+	r[0] = a2[0] & b[0]; /* add (assignment, because r is 0) */
+	r[1] = a2[1] & b[0];
+	r[2] = a2[2] & b[0];
+	r[3] = a2[3] & b[0];
+	r[4] = a2[4] & b[0];
+	r[5] = a2[5] & b[0];
+	r[6] = a2[6] & b[0];
+	r[7] = a2[7] & b[0];
+	a2[0] ^= a2[7]; /* reduce */
+	a2[2] ^= a2[7];
+	a2[3] ^= a2[7];
+
+	r[0] ^= a2[7] & b[1]; /* add */
+	r[1] ^= a2[0] & b[1];
+	r[2] ^= a2[1] & b[1];
+	r[3] ^= a2[2] & b[1];
+	r[4] ^= a2[3] & b[1];
+	r[5] ^= a2[4] & b[1];
+	r[6] ^= a2[5] & b[1];
+	r[7] ^= a2[6] & b[1];
+	a2[7] ^= a2[6]; /* reduce */
+	a2[1] ^= a2[6];
+	a2[2] ^= a2[6];
+
+	r[0] ^= a2[6] & b[2]; /* add */
+	r[1] ^= a2[7] & b[2];
+	r[2] ^= a2[0] & b[2];
+	r[3] ^= a2[1] & b[2];
+	r[4] ^= a2[2] & b[2];
+	r[5] ^= a2[3] & b[2];
+	r[6] ^= a2[4] & b[2];
+	r[7] ^= a2[5] & b[2];
+	a2[6] ^= a2[5]; /* reduce */
+	a2[0] ^= a2[5];
+	a2[1] ^= a2[5];
+
+	r[0] ^= a2[5] & b[3]; /* add */
+	r[1] ^= a2[6] & b[3];
+	r[2] ^= a2[7] & b[3];
+	r[3] ^= a2[0] & b[3];
+	r[4] ^= a2[1] & b[3];
+	r[5] ^= a2[2] & b[3];
+	r[6] ^= a2[3] & b[3];
+	r[7] ^= a2[4] & b[3];
+	a2[5] ^= a2[4]; /* reduce */
+	a2[7] ^= a2[4];
+	a2[0] ^= a2[4];
+
+	r[0] ^= a2[4] & b[4]; /* add */
+	r[1] ^= a2[5] & b[4];
+	r[2] ^= a2[6] & b[4];
+	r[3] ^= a2[7] & b[4];
+	r[4] ^= a2[0] & b[4];
+	r[5] ^= a2[1] & b[4];
+	r[6] ^= a2[2] & b[4];
+	r[7] ^= a2[3] & b[4];
+	a2[4] ^= a2[3]; /* reduce */
+	a2[6] ^= a2[3];
+	a2[7] ^= a2[3];
+
+	r[0] ^= a2[3] & b[5]; /* add */
+	r[1] ^= a2[4] & b[5];
+	r[2] ^= a2[5] & b[5];
+	r[3] ^= a2[6] & b[5];
+	r[4] ^= a2[7] & b[5];
+	r[5] ^= a2[0] & b[5];
+	r[6] ^= a2[1] & b[5];
+	r[7] ^= a2[2] & b[5];
+	a2[3] ^= a2[2]; /* reduce */
+	a2[5] ^= a2[2];
+	a2[6] ^= a2[2];
+
+	r[0] ^= a2[2] & b[6]; /* add */
+	r[1] ^= a2[3] & b[6];
+	r[2] ^= a2[4] & b[6];
+	r[3] ^= a2[5] & b[6];
+	r[4] ^= a2[6] & b[6];
+	r[5] ^= a2[7] & b[6];
+	r[6] ^= a2[0] & b[6];
+	r[7] ^= a2[1] & b[6];
+	a2[2] ^= a2[1]; /* reduce */
+	a2[4] ^= a2[1];
+	a2[5] ^= a2[1];
+
+	r[0] ^= a2[1] & b[7]; /* add */
+	r[1] ^= a2[2] & b[7];
+	r[2] ^= a2[3] & b[7];
+	r[3] ^= a2[4] & b[7];
+	r[4] ^= a2[5] & b[7];
+	r[5] ^= a2[6] & b[7];
+	r[6] ^= a2[7] & b[7];
+	r[7] ^= a2[0] & b[7];
+}
+
+
+/*
+ * Square `x` in GF(2^8) and write the result to `r`. `r` and `x` may overlap.
+ */
+static void GF256_ATTR
+GF256_FN(square)(GF256_WORD r[8], const GF256_WORD x[8])
+{
+	GF256_WORD r8, r10, r12, r14;
+	/* Use the Freshman's Dream rule to square the polynomial
+	 * Assignments are done from 7 downto 0, because this allows the user
+	 * to execute this function in-place (e.g. `gf256_square(r, r);`).
+	 */
+	r14  = x[7];
+	r12  = x[6];
+	r10  = x[5];
+	r8   = x[4];
+	r[6] = x[3];
+	r[4] = x[2];
+	r[2] = x[1];
+	r[0] = x[0];
+
+	/* Reduce with  x^8 + x^4 + x^3 + x + 1 until order is less than 8 */
+	r[7]  = r14;  /* r[7] was 0 */
+	r[6] ^= r14;
+	r10  ^= r14;
+	/* Skip, because r13 is always 0 */
+	r[4] ^= r12;
+	r[5]  = r12;  /* r[5] was 0 */
+	r[7] ^= r12;
+	r8   ^= r12;
+	/* Skip, because r11 is always 0 */
+	r[2] ^= r10;
+	r[3]  = r10; /* r[3] was 0 */
+	r[5] ^= r10;
+	r[6] ^= r10;
+	r[1]  = r14; /* r[1] was 0 */
+	r[2] ^= r14; /* Substitute r9 by r14 because they will always be equal*/
+	r[4] ^= r14;
+	r[5] ^= r14;
+	r[0] ^= r8;
+	r[1] ^= r8;
+	r[3] ^= r8;
+	r[4] ^= r8;
+}
+
+
+/*
+ * Invert `x` in GF(2^8) and write the result to `r`
+ */
+static void GF256_ATTR
+GF256_FN(inv)(GF256_WORD r[8], GF256_WORD x[8])
+{
+	GF256_WORD y[8], z[8];
+
+	GF256_FN(square)(y, x); // y = x^2
+	GF256_FN(square)(y, y); // y = x^4
+	GF256_FN(square)(r, y); // r = x^8
+	GF256_FN(mul)(z, r, x); // z = x^9
+	GF256_FN(square)(r, r); // r = x^16
+	GF256_FN(mul)(r, r, z); // r = x^25
+	GF256_FN(square)(r, r); // r = x^50
+	GF256_FN(square)(z, r); // z = x^100
+	GF256_FN(square)(z, z); // z = x^200
+	GF256_FN(mul)(r, r, z); // r = x^250
+	GF256_FN(mul)(r, r, y); // r = x^254
+}
+
+
+/*
+ * Compute the secret (the value at x = 0) of the polynomial through the `k`
+ * bitsliced points (`xs[i]`, `ys[i]`) using Lagrange interpolation.
+ */
+static void GF256_ATTR
+GF256_FN(interpolate0)(GF256_WORD secret[8], GF256_WORD xs[][8],
+    GF256_WORD ys[][8], uint8_t k)
+{
+	size_t idx1, idx2;
+	GF256_WORD num[8], denom[8], tmp[8];
+
+	memset(secret, 0, sizeof(GF256_WORD[8]));
+	for (idx1 = 0; idx1 < k; idx1++) {
+		memset(num, 0, sizeof(num));
+		memset(denom, 0, sizeof(denom));
+		num[0] = ~(GF256_WORD){0}; /* num is the numerator (=1) */
+		denom[0] = ~(GF256_WORD){0}; /* denom is the numerator (=1) */
+		for (idx2 = 0; idx2 < k; idx2++) {
+			if (idx1 == idx2) continue;
+			GF256_FN(mul)(num, num, xs[idx2]);
+			memcpy(tmp, xs[idx1], sizeof(GF256_WORD[8]));
+			GF256_FN(add)(tmp, xs[idx2]);
+			GF256_FN(mul)(denom, denom, tmp);
+		}
+		GF256_FN(inv)(tmp, denom); /* inverted denominator */
+		GF256_FN(mul)(num, num, tmp); /* basis polynomial */
+		GF256_FN(mul)(num, num, ys[idx1]); /* scaled coefficient */
+		GF256_FN(add)(secret, num);
+	}
+}
@@ -22,6 +22,7 @@
 #include "hazmat.h"
 #include <assert.h>
 #include <string.h>
+#include <pthread.h>
 
 
 typedef struct {
@@ -30,17 +31,42 @@ typedef struct {
 } ByteShare;
 
 
+/*
+ * Transpose the 8x8 bit matrix held in `x` (one row per byte), so that bit
+ * `j` of byte `i` becomes bit `i` of byte `j` (Hacker's Delight, 7-3).
+ */
+static uint64_t
+transpose8(uint64_t x)
+{
+	uint64_t t;
+
+	t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+	x = x ^ t ^ (t << 28);
+	return x;
+}
+
+
 static void
 bitslice(uint32_t r[8], const uint8_t x[32])
 {
-	size_t bit_idx, arr_idx;
-	uint32_t cur;
+	size_t bit_idx, arr_idx, word_idx;
+	uint64_t cur;
 
 	memset(r, 0, sizeof(uint32_t[8]));
-	for (arr_idx = 0; arr_idx < 32; arr_idx++) {
-		cur = (uint32_t) x[arr_idx];
+	for (word_idx = 0; word_idx < 4; word_idx++) {
+		cur = 0;
+		for (arr_idx = 0; arr_idx < 8; arr_idx++) {
+			cur |= (uint64_t) x[8 * word_idx + arr_idx] <<
+			    (8 * arr_idx);
+		}
+		cur = transpose8(cur);
 		for (bit_idx = 0; bit_idx < 8; bit_idx++) {
-			r[bit_idx] |= ((cur & (1 << bit_idx)) >> bit_idx) << arr_idx;
+			r[bit_idx] |= (uint32_t) ((cur >> (8 * bit_idx)) &
+			    0xff) << (8 * word_idx);
 		}
 	}
 }
@@ -49,14 +75,19 @@ bitslice(uint32_t r[8], const uint8_t x[32])
 static void
 unbitslice(uint8_t r[32], const uint32_t x[8])
 {
-	size_t bit_idx, arr_idx;
-	uint32_t cur;
-
-	memset(r, 0, sizeof(uint8_t[32]));
-	for (bit_idx = 0; bit_idx < 8; bit_idx++) {
-		cur = (uint32_t) x[bit_idx];
-		for (arr_idx = 0; arr_idx < 32; arr_idx++) {
-			r[arr_idx] |= ((cur & (1 << arr_idx)) >> arr_idx) << bit_idx;
+	size_t bit_idx, arr_idx, word_idx;
+	uint64_t cur;
+
+	for (word_idx = 0; word_idx < 4; word_idx++) {
+		cur = 0;
+		for (bit_idx = 0; bit_idx < 8; bit_idx++) {
+			cur |= (uint64_t) ((x[bit_idx] >> (8 * word_idx)) &
+			    0xff) << (8 * bit_idx);
+		}
+		cur = transpose8(cur);
+		for (arr_idx = 0; arr_idx < 8; arr_idx++) {
+			r[8 * word_idx + arr_idx] =
+			    (uint8_t) (cur >> (8 * arr_idx));
 		}
 	}
 }
@@ -72,198 +103,13 @@ bitslice_setall(uint32_t r[8], const uint8_t x)
 }
 
 
-/*
- * Add (XOR) `r` with `x` and store the result in `r`.
- */
-static void
-gf256_add(uint32_t r[8], const uint32_t x[8])
-{
-	size_t idx;
-	for (idx = 0; idx < 8; idx++) r[idx] ^= x[idx];
-}
-
-
-/*
- * Safely multiply two bitsliced polynomials in GF(2^8) reduced by
- * x^8 + x^4 + x^3 + x + 1. `r` and `a` may overlap, but overlapping of `r`
- * and `b` will produce an incorrect result! If you need to square a polynomial
- * use `gf256_square` instead.
- */
-static void
-gf256_mul(uint32_t r[8], const uint32_t a[8], const uint32_t b[8])
-{
-	/* This function implements Russian Peasant multiplication on two
-	 * bitsliced polynomials.
-	 *
-	 * I personally think that these kinds of long lists of operations
-	 * are often a bit ugly. A double for loop would be nicer and would
-	 * take up a lot less lines of code.
-	 * However, some compilers seem to fail in optimizing these kinds of
-	 * loops. So we will just have to do this by hand.
-	 */
-	uint32_t a2[8];
-	memcpy(a2, a, sizeof(uint32_t[8]));
-
-	r[0] = a2[0] & b[0]; /* add (assignment, because r is 0) */
-	r[1] = a2[1] & b[0];
-	r[2] = a2[2] & b[0];
-	r[3] = a2[3] & b[0];
-	r[4] = a2[4] & b[0];
-	r[5] = a2[5] & b[0];
-	r[6] = a2[6] & b[0];
-	r[7] = a2[7] & b[0];
-	a2[0] ^= a2[7]; /* reduce */
-	a2[2] ^= a2[7];
-	a2[3] ^= a2[7];
-
-	r[0] ^= a2[7] & b[1]; /* add */
-	r[1] ^= a2[0] & b[1];
-	r[2] ^= a2[1] & b[1];
-	r[3] ^= a2[2] & b[1];
-	r[4] ^= a2[3] & b[1];
-	r[5] ^= a2[4] & b[1];
-	r[6] ^= a2[5] & b[1];
-	r[7] ^= a2[6] & b[1];
-	a2[7] ^= a2[6]; /* reduce */
-	a2[1] ^= a2[6];
-	a2[2] ^= a2[6];
-
-	r[0] ^= a2[6] & b[2]; /* add */
-	r[1] ^= a2[7] & b[2];
-	r[2] ^= a2[0] & b[2];
-	r[3] ^= a2[1] & b[2];
-	r[4] ^= a2[2] & b[2];
-	r[5] ^= a2[3] & b[2];
-	r[6] ^= a2[4] & b[2];
-	r[7] ^= a2[5] & b[2];
-	a2[6] ^= a2[5]; /* reduce */
-	a2[0] ^= a2[5];
-	a2[1] ^= a2[5];
-
-	r[0] ^= a2[5] & b[3]; /* add */
-	r[1] ^= a2[6] & b[3];
-	r[2] ^= a2[7] & b[3];
-	r[3] ^= a2[0] & b[3];
-	r[4] ^= a2[1] & b[3];
-	r[5] ^= a2[2] & b[3];
-	r[6] ^= a2[3] & b[3];
-	r[7] ^= a2[4] & b[3];
-	a2[5] ^= a2[4]; /* reduce */
-	a2[7] ^= a2[4];
-	a2[0] ^= a2[4];
-
-	r[0] ^= a2[4] & b[4]; /* add */
-	r[1] ^= a2[5] & b[4];
-	r[2] ^= a2[6] & b[4];
-	r[3] ^= a2[7] & b[4];
-	r[4] ^= a2[0] & b[4];
-	r[5] ^= a2[1] & b[4];
-	r[6] ^= a2[2] & b[4];
-	r[7] ^= a2[3] & b[4];
-	a2[4] ^= a2[3]; /* reduce */
-	a2[6] ^= a2[3];
-	a2[7] ^= a2[3];
-
-	r[0] ^= a2[3] & b[5]; /* add */
-	r[1] ^= a2[4] & b[5];
-	r[2] ^= a2[5] & b[5];
-	r[3] ^= a2[6] & b[5];
-	r[4] ^= a2[7] & b[5];
-	r[5] ^= a2[0] & b[5];
-	r[6] ^= a2[1] & b[5];
-	r[7] ^= a2[2] & b[5];
-	a2[3] ^= a2[2]; /* reduce */
-	a2[5] ^= a2[2];
-	a2[6] ^= a2[2];
-
-	r[0] ^= a2[2] & b[6]; /* add */
-	r[1] ^= a2[3] & b[6];
-	r[2] ^= a2[4] & b[6];
-	r[3] ^= a2[5] & b[6];
-	r[4] ^= a2[6] & b[6];
-	r[5] ^= a2[7] & b[6];
-	r[6] ^= a2[0] & b[6];
-	r[7] ^= a2[1] & b[6];
-	a2[2] ^= a2[1]; /* reduce */
-	a2[4] ^= a2[1];
-	a2[5] ^= a2[1];
-
-	r[0] ^= a2[1] & b[7]; /* add */
-	r[1] ^= a2[2] & b[7];
-	r[2] ^= a2[3] & b[7];
-	r[3] ^= a2[4] & b[7];
-	r[4] ^= a2[5] & b[7];
-	r[5] ^= a2[6] & b[7];
-	r[6] ^= a2[7] & b[7];
-	r[7] ^= a2[0] & b[7];
-}
-
-
-/*
- * Square `x` in GF(2^8) and write the result to `r`. `r` and `x` may overlap.
- */
-static void
-gf256_square(uint32_t r[8], const uint32_t x[8])
-{
-	uint32_t r8, r10, r12, r14;
-	/* Use the Freshman's Dream rule to square the polynomial
-	 * Assignments are done from 7 downto 0, because this allows the user
-	 * to execute this function in-place (e.g. `gf256_square(r, r);`).
-	 */
-	r14  = x[7];
-	r12  = x[6];
-	r10  = x[5];
-	r8   = x[4];
-	r[6] = x[3];
-	r[4] = x[2];
-	r[2] = x[1];
-	r[0] = x[0];
-
-	/* Reduce with  x^8 + x^4 + x^3 + x + 1 until order is less than 8 */
-	r[7]  = r14;  /* r[7] was 0 */
-	r[6] ^= r14;
-	r10  ^= r14;
-	/* Skip, because r13 is always 0 */
-	r[4] ^= r12;
-	r[5]  = r12;  /* r[5] was 0 */
-	r[7] ^= r12;
-	r8   ^= r12;
-	/* Skip, because r11 is always 0 */
-	r[2] ^= r10;
-	r[3]  = r10; /* r[3] was 0 */
-	r[5] ^= r10;
-	r[6] ^= r10;
-	r[1]  = r14; /* r[1] was 0 */
-	r[2] ^= r14; /* Substitute r9 by r14 because they will always be equal*/
-	r[4] ^= r14;
-	r[5] ^= r14;
-	r[0] ^= r8;
-	r[1] ^= r8;
-	r[3] ^= r8;
-	r[4] ^= r8;
-}
-
-
-/*
- * Invert `x` in GF(2^8) and write the result to `r`
- */
-static void
-gf256_inv(uint32_t r[8], uint32_t x[8])
-{
-	uint32_t y[8], z[8];
-
-	gf256_square(y, x); // y = x^2
-	gf256_square(y, y); // y = x^4
-	gf256_square(r, y); // r = x^8
-	gf256_mul(z, r, x); // z = x^9
-	gf256_square(r, r); // r = x^16
-	gf256_mul(r, r, z); // r = x^25
-	gf256_square(r, r); // r = x^50
-	gf256_square(z, r); // z = x^100
-	gf256_square(z, z); // z = x^200
-	gf256_mul(r, r, z); // r = x^250
-	gf256_mul(r, r, y); // r = x^254
-}
+#define	GF256_WORD	uint32_t
+#define	GF256_FN(n)	gf256_##n
+#define	GF256_ATTR
+#include "hazmat-gf256.h"
+#undef	GF256_WORD
+#undef	GF256_FN
+#undef	GF256_ATTR
 
 
 /*
@@ -320,10 +166,9 @@ gf256_inv(uint32_t r[8], uint32_t x[8])
                             const sss_Keyshare *key_shares,
                             uint8_t k)
 {
-	size_t share_idx, idx1, idx2;
+	size_t share_idx;
 	uint32_t xs[k][8], ys[k][8];
-	uint32_t num[8], denom[8], tmp[8];
-	uint32_t secret[8] = {0};
+	uint32_t secret[8];
 
 	/* Collect the x and y values */
 	for (share_idx = 0; share_idx < k; share_idx++) {
@@ -332,22 +177,143 @@ gf256_inv(uint32_t r[8], uint32_t x[8])
 	}
 
 	/* Use Lagrange basis polynomials to calculate the secret coefficient */
-	for (idx1 = 0; idx1 < k; idx1++) {
-		memset(num, 0, sizeof(num));
-		memset(denom, 0, sizeof(denom));
-		num[0] = ~0; /* num is the numerator (=1) */
-		denom[0] = ~0; /* denom is the numerator (=1) */
-		for (idx2 = 0; idx2 < k; idx2++) {
-			if (idx1 == idx2) continue;
-			gf256_mul(num, num, xs[idx2]);
-			memcpy(tmp, xs[idx1], sizeof(uint32_t[8]));
-			gf256_add(tmp, xs[idx2]);
-			gf256_mul(denom, denom, tmp);
+	gf256_interpolate0(secret, xs, ys, k);
+	unbitslice(key, secret);
+}
+
+
+#if defined(__GNUC__)
+/*
+ * For the batch API, each bit of the bitsliced form becomes a vector with
+ * one uint32_t lane per key. With AVX2 a whole vector fits in one register;
+ * elsewhere the compiler splits it over narrower ones (SSE2, NEON), which
+ * is still a lot better than one key at a time.
+ */
+typedef uint32_t gf256_vec __attribute__((vector_size(sss_BATCH_LANES * 4)));
+
+#define	GF256_WORD	gf256_vec
+#define	GF256_FN(n)	gf256v_##n
+#define	GF256_ATTR
+#include "hazmat-gf256.h"
+#undef	GF256_WORD
+#undef	GF256_FN
+#undef	GF256_ATTR
+
+typedef void (*gf256v_interpolate_t)(gf256_vec[8], gf256_vec[][8],
+    gf256_vec[][8], uint8_t);
+
+#if defined(__x86_64__) || defined(__i386__)
+#define	GF256_WORD	gf256_vec
+#define	GF256_FN(n)	gf256v_avx2_##n
+#define	GF256_ATTR	__attribute__((target("avx2")))
+#include "hazmat-gf256.h"
+#undef	GF256_WORD
+#undef	GF256_FN
+#undef	GF256_ATTR
+
+static gf256v_interpolate_t
+gf256v_select(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return (gf256v_avx2_interpolate0);
+	return (gf256v_interpolate0);
+}
+#else
+static gf256v_interpolate_t
+gf256v_select(void)
+{
+	return (gf256v_interpolate0);
+}
+#endif
+
+/* Chosen once, under pthread_once. */
+static pthread_once_t gf256v_once = PTHREAD_ONCE_INIT;
+static gf256v_interpolate_t gf256v_interpolate = NULL;
+
+static void
+gf256v_init(void)
+{
+	gf256v_interpolate = gf256v_select();
+}
+
+
+/*
+ * Restore up to sss_BATCH_LANES keys at once. Lanes past `nsets` are left
+ * as zero shares and their output is dropped.
+ */
+static void
+combine_keyshares_lanes(uint8_t (*keys)[32],
+                        const sss_Keyshare *const *key_shares,
+                        uint8_t k,
+                        size_t nsets)
+{
+	size_t share_idx, set_idx, bit_idx;
+	gf256_vec xs[k][8], ys[k][8], secret[8];
+	uint32_t x[sss_BATCH_LANES][8], y[sss_BATCH_LANES][8];
+	uint32_t lane[8];
+
+	(void) pthread_once(&gf256v_once, gf256v_init);
+
+	/* Collect the x and y values, one lane per set */
+	for (share_idx = 0; share_idx < k; share_idx++) {
+		memset(x, 0, sizeof(x));
+		memset(y, 0, sizeof(y));
+		for (set_idx = 0; set_idx < nsets; set_idx++) {
+			const uint8_t *share = key_shares[set_idx][share_idx];
+			bitslice_setall(x[set_idx], share[0]);
+			bitslice(y[set_idx], &share[1]);
+		}
+		for (bit_idx = 0; bit_idx < 8; bit_idx++) {
+			for (set_idx = 0; set_idx < sss_BATCH_LANES; set_idx++) {
+				xs[share_idx][bit_idx][set_idx] =
+				    x[set_idx][bit_idx];
+				ys[share_idx][bit_idx][set_idx] =
+				    y[set_idx][bit_idx];
+			}
 		}
-		gf256_inv(tmp, denom); /* inverted denominator */
-		gf256_mul(num, num, tmp); /* basis polynomial */
-		gf256_mul(num, num, ys[idx1]); /* scaled coefficient */
-		gf256_add(secret, num);
 	}
-	unbitslice(key, secret);
+
+	gf256v_interpolate(secret, xs, ys, k);
+
+	for (set_idx = 0; set_idx < nsets; set_idx++) {
+		for (bit_idx = 0; bit_idx < 8; bit_idx++)
+			lane[bit_idx] = secret[bit_idx][set_idx];
+		unbitslice(keys[set_idx], lane);
+	}
+
+	memset(x, 0, sizeof(x));
+	memset(y, 0, sizeof(y));
+	memset(lane, 0, sizeof(lane));
+	memset(xs, 0, sizeof(xs));
+	memset(ys, 0, sizeof(ys));
+	memset(secret, 0, sizeof(secret));
+}
+#endif	/* __GNUC__ */
+
+
+/*
+ * Restore `nsets` keys from `k` shares each, sss_BATCH_LANES at a time.
+ */
+ void sss_combine_keyshares_batch(uint8_t (*keys)[32],
+                                  const sss_Keyshare *const *key_shares,
+                                  uint8_t k,
+                                  size_t nsets)
+{
+#if defined(__GNUC__)
+	size_t n;
+
+	while (nsets > 0) {
+		n = nsets < sss_BATCH_LANES ? nsets : sss_BATCH_LANES;
+		combine_keyshares_lanes(keys, key_shares, k, n);
+		keys += n;
+		key_shares += n;
+		nsets -= n;
+	}
+#else
+	size_t set_idx;
+
+	for (set_idx = 0; set_idx < nsets; set_idx++)
+		sss_combine_keyshares(keys[set_idx], key_shares[set_idx], k);
+#endif
 }
@@ -67,4 +67,26 @@ void sss_combine_keyshares(uint8_t key[32],
                            uint8_t k);
 
 
+/*
+ * The number of key sets `sss_combine_keyshares_batch` works on at once.
+ */
+#define sss_BATCH_LANES 8
+
+
+/*
+ * Combine `nsets` independent sets of `k` shares each, as if by calling
+ * `sss_combine_keyshares(keys[i], key_shares[i], k)` for each set. The sets
+ * are bitsliced side by side into vector registers and combined together,
+ * which is a lot quicker than doing them one by one when there are many.
+ *
+ * Every set must use the same number of shares `k`. As with
+ * `sss_combine_keyshares`, shares and keys are treated as secret values,
+ * while `k` and `nsets` are public.
+ */
+void sss_combine_keyshares_batch(uint8_t (*keys)[32],
+                                 const sss_Keyshare *const *key_shares,
+                                 uint8_t k,
+                                 size_t nsets);
+
+
 #endif /* sss_HAZMAT_H_ */
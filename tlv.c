@@ -12,6 +12,7 @@
 #include <time.h>
 #include <stdint.h>
 #include <string.h>
+#include <stddef.h>
 
 #include "utils.h"
 #include "tlv.h"
@@ -24,25 +25,47 @@ enum tlv_tag_bits {
 	TLV_TAG_CONT = 0xFF & TLV_TAG_MASK,
 };
 
-struct tlv_state *
-tlv_init(const uint8_t *buf, size_t offset, size_t len)
+static void
+tlv_init_state(struct tlv_state *ts)
 {
-	struct tlv_state *ts = calloc(1, sizeof (struct tlv_state));
-	if (ts == NULL)
-		return (NULL);
-	struct tlv_context *tc = calloc(1, sizeof (struct tlv_context));
-	if (tc == NULL) {
-		free(ts);
-		return (NULL);
-	}
+	struct tlv_context *tc = &ts->ts_ctx[0];
+
+	ts->ts_nctx = 1;
 	ts->ts_root = tc;
 	ts->ts_now = tc;
+}
+
+static void
+tlv_init_read(struct tlv_state *ts, const uint8_t *buf, size_t offset,
+    size_t len)
+{
+	tlv_init_state(ts);
 
 	ts->ts_buf = (uint8_t *)buf;
 	ts->ts_pos = offset;
 
-	tc->tc_begin = offset;
-	tc->tc_end = offset + len;
+	ts->ts_root->tc_begin = offset;
+	ts->ts_root->tc_end = offset + len;
+}
+
+struct tlv_state *
+tlv_init(const uint8_t *buf, size_t offset, size_t len)
+{
+	struct tlv_state *ts = calloc(1, sizeof (struct tlv_state));
+	if (ts == NULL)
+		return (NULL);
+	tlv_init_read(ts, buf, offset, len);
+	return (ts);
+}
+
+struct tlv_state *
+tlv_init_local(struct tlv_state *ts, const uint8_t *buf, size_t offset,
+    size_t len)
+{
+	/* Only the root context needs to start out zeroed. */
+	bzero(ts, offsetof(struct tlv_state, ts_ctx[1]));
+	tlv_init_read(ts, buf, offset, len);
+	ts->ts_local = B_TRUE;
 	return (ts);
 }
 
@@ -58,27 +81,61 @@ tlv_init_write(void)
 	struct tlv_state *ts = calloc(1, sizeof (struct tlv_state));
 	if (ts == NULL)
 		return (NULL);
-	struct tlv_context *tc = calloc(1, sizeof (struct tlv_context));
-	if (tc == NULL) {
-		free(ts);
-		return (NULL);
-	}
-	ts->ts_root = tc;
-	ts->ts_now = tc;
+	tlv_init_state(ts);
 
 	ts->ts_buf = calloc(1, MAX_APDU_SIZE);
 	if (ts->ts_buf == NULL) {
 		free(ts);
-		free(tc);
 		return (NULL);
 	}
 	ts->ts_freebuf = B_TRUE;
-	tc->tc_end = MAX_APDU_SIZE;
+	ts->ts_root->tc_end = MAX_APDU_SIZE;
+	return (ts);
+}
+
+struct tlv_state *
+tlv_init_write_local(struct tlv_state *ts, uint8_t *buf, size_t len)
+{
+	bzero(ts, offsetof(struct tlv_state, ts_ctx[1]));
+	tlv_init_state(ts);
+	ts->ts_local = B_TRUE;
+
+	ts->ts_buf = buf;
+	ts->ts_root->tc_end = len;
 	return (ts);
 }
 
 const uint8_t TLV_CONT = (1 << 7);
 
+/*
+ * Contexts are only ever released in the reverse order to the one they were
+ * allocated in (they form a stack via tc_next), so the inline ones can just
+ * be handed out and taken back from the end of ts_ctx.
+ */
+static struct tlv_context *
+tlv_ctx_alloc(struct tlv_state *ts)
+{
+	struct tlv_context *tc;
+
+	if (ts->ts_nctx < TLV_INLINE_CTX) {
+		tc = &ts->ts_ctx[ts->ts_nctx++];
+		bzero(tc, sizeof (*tc));
+		return (tc);
+	}
+	return (calloc(1, sizeof (struct tlv_context)));
+}
+
+static void
+tlv_ctx_release(struct tlv_state *ts, struct tlv_context *tc)
+{
+	if (tc >= &ts->ts_ctx[0] && tc < &ts->ts_ctx[TLV_INLINE_CTX]) {
+		VERIFY(tc == &ts->ts_ctx[ts->ts_nctx - 1]);
+		--ts->ts_nctx;
+		return;
+	}
+	free(tc);
+}
+
 static void
 tlv_ctx_push(struct tlv_state *ts, struct tlv_context *tc)
 {
@@ -102,12 +159,14 @@ tlv_pushl(struct tlv_state *ts, uint tag, size_t maxlen)
 	uint8_t *buf = ts->ts_buf;
 	struct tlv_context *tc;
 
-	tc = calloc(1, sizeof (struct tlv_context));
+	tc = tlv_ctx_alloc(ts);
 	VERIFY(tc != NULL);
 
 	tlv_write_u8to32(ts, tag);
 
 	tc->tc_lenptr = ts->ts_pos;
+	VERIFY3U(tlv_root_rem(ts), >=,
+	    tlv_hdr_len(tag, maxlen) - tlv_u8to32_len(tag));
 
 	if (maxlen < (1 << 7)) {
 		buf[ts->ts_pos++] = 0x00;
@@ -152,7 +211,7 @@ tlv_pop(struct tlv_state *ts)
 		buf[tc->tc_lenptr + 3] = (len & 0x0000FF);
 	}
 
-	free(tc);
+	tlv_ctx_release(ts, tc);
 }
 
 errf_t *
@@ -164,16 +223,12 @@ tlv_read_tag(struct tlv_state *ts, uint *ptag)
 	size_t len;
 	struct tlv_context *tc;
 	size_t origin = ts->ts_pos;
+	size_t lenptr;
 	errf_t *error;
 
-	tc = calloc(1, sizeof (struct tlv_context));
-	if (tc == NULL)
-		return (ERRF_NOMEM);
-
 	if (tlv_at_end(ts)) {
 		error = errf("LengthError", NULL, "tlv_read_tag called "
 		    "past end of context");
-		free(tc);
 		return (error);
 	}
 	d = buf[ts->ts_pos++];
@@ -184,7 +239,6 @@ tlv_read_tag(struct tlv_state *ts, uint *ptag)
 			if (tlv_at_end(ts)) {
 				error = errf("LengthError", NULL, "TLV tag "
 				    "continued past end of context");
-				free(tc);
 				return (error);
 			}
 			d = buf[ts->ts_pos++];
@@ -193,12 +247,11 @@ tlv_read_tag(struct tlv_state *ts, uint *ptag)
 		} while ((d & TLV_CONT) == TLV_CONT);
 	}
 
-	tc->tc_lenptr = ts->ts_pos;
+	lenptr = ts->ts_pos;
 
 	if (tlv_at_end(ts)) {
 		error = errf("LengthError", NULL, "TLV tag length continued "
 		    "past end of context");
-		free(tc);
 		return (error);
 	}
 	d = buf[ts->ts_pos++];
@@ -207,14 +260,12 @@ tlv_read_tag(struct tlv_state *ts, uint *ptag)
 		if (octs < 1 || octs > 4) {
 			error = errf("LengthError", NULL, "TLV tag had invalid "
 			    "length indicator: %d octets", octs);
-			free(tc);
 			return (error);
 		}
 		len = 0;
 		if (tlv_rem(ts) < octs) {
 			error = errf("LengthError", NULL, "TLV tag length "
 			    "bytes continued past end of context");
-			free(tc);
 			return (error);
 		}
 		for (; octs > 0; --octs) {
@@ -228,16 +279,18 @@ tlv_read_tag(struct tlv_state *ts, uint *ptag)
 	if (tlv_root_rem(ts) < len) {
 		error = errf("LengthError", NULL, "TLV tag length is too "
 		    "long for buffer: %zu", len);
-		free(tc);
 		return (error);
 	}
 	if (tlv_rem(ts) < len) {
 		error = errf("LengthError", NULL, "TLV tag length is too "
 		    "long for enclosing tag: %zu", len);
-		free(tc);
 		return (error);
 	}
 
+	tc = tlv_ctx_alloc(ts);
+	if (tc == NULL)
+		return (ERRF_NOMEM);
+	tc->tc_lenptr = lenptr;
 	tc->tc_begin = ts->ts_pos;
 	tc->tc_end = ts->ts_pos + len;
 
@@ -265,7 +318,7 @@ tlv_end(struct tlv_state *ts)
 		return (errf("LengthError", NULL, "tlv_end() called at +%zu "
 		    "but tag ends at +%zu", ts->ts_pos, tc->tc_end));
 	}
-	free(tc);
+	tlv_ctx_release(ts, tc);
 	return (NULL);
 }
 
@@ -280,7 +333,7 @@ tlv_skip(struct tlv_state *ts)
 	VERIFY3U(ts->ts_pos, >=, tc->tc_begin);
 	VERIFY3U(ts->ts_pos, <=, tc->tc_end);
 	ts->ts_pos = tc->tc_end;
-	free(tc);
+	tlv_ctx_release(ts, tc);
 }
 
 void
@@ -292,7 +345,7 @@ tlv_abort(struct tlv_state *ts)
 		tc = tc->tc_next;
 		VERIFY3U(ts->ts_pos, >=, tc->tc_begin);
 		VERIFY3U(ts->ts_pos, <=, tc->tc_end);
-		free(tofree);
+		tlv_ctx_release(ts, tofree);
 	}
 	ts->ts_now = ts->ts_root;
 	ts->ts_pos = ts->ts_root->tc_end;
@@ -384,6 +437,31 @@ tlv_read_string(struct tlv_state *ts, char **dest)
 	return (NULL);
 }
 
+errf_t *
+tlv_read_ref(struct tlv_state *ts, const uint8_t **pdata, size_t *plen)
+{
+	*plen = tlv_rem(ts);
+	*pdata = &ts->ts_buf[ts->ts_pos];
+	ts->ts_pos += *plen;
+	return (NULL);
+}
+
+errf_t *
+tlv_read_strref(struct tlv_state *ts, const char **pstr, size_t *plen)
+{
+	const size_t len = tlv_rem(ts);
+	const uint8_t *p = &ts->ts_buf[ts->ts_pos];
+
+	if (memchr(p, 0, len) != NULL) {
+		return (errf("StringError", NULL, "tlv_read_strref() "
+		    "encountered a NUL character unexpectedly"));
+	}
+	*pstr = (const char *)p;
+	*plen = len;
+	ts->ts_pos += len;
+	return (NULL);
+}
+
 errf_t *
 tlv_read_alloc(struct tlv_state *ts, uint8_t **pdata, size_t *plen)
 {
@@ -425,8 +503,8 @@ tlv_free(struct tlv_state *ts)
 		    root->tc_end - root->tc_begin);
 		free(ts->ts_buf);
 	}
-	free(root);
-	free(ts);
+	if (!ts->ts_local)
+		free(ts);
 }
 
 void
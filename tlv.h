@@ -35,7 +35,13 @@
  * Each time we read a tag in tlv_read_tag() we create a new one of these
  * which spans some subset of the context above it and set ts_now to point at
  * it.
+ *
+ * The root and the first TLV_INLINE_CTX - 1 levels of nesting live in the
+ * tlv_state itself (ts_ctx), so parsing anything the PIV spec describes
+ * doesn't allocate at all. Deeper nesting falls back to the heap.
  */
+#define	TLV_INLINE_CTX	8
+
 struct tlv_context {
 	struct tlv_context *tc_next;
 	size_t tc_begin;	/* beginning index in ts_buf */
@@ -51,6 +57,9 @@ struct tlv_state {
 	size_t ts_pos;
 	boolean_t ts_freebuf;		/* if B_TRUE we malloc'd the buffer */
 	boolean_t ts_debug;
+	boolean_t ts_local;		/* from tlv_init_local(), not malloc'd */
+	uint ts_nctx;			/* entries of ts_ctx in use */
+	struct tlv_context ts_ctx[TLV_INLINE_CTX];
 };
 
 /*
@@ -61,6 +70,17 @@ struct tlv_state {
 struct tlv_state *tlv_init(const uint8_t *buf, size_t offset, size_t len);
 void tlv_free(struct tlv_state *ts);
 
+/*
+ * Like tlv_init(), but sets up a caller-provided (normally on-stack)
+ * tlv_state instead of allocating one. Returns ts, for convenience.
+ *
+ * tlv_free() on one of these is fine (and does nothing beyond checking that
+ * all tags were ended), so it can share cleanup paths with tlv_init() state.
+ * Combined with tlv_read_ref() this parses without touching the heap at all.
+ */
+struct tlv_state *tlv_init_local(struct tlv_state *ts, const uint8_t *buf,
+    size_t offset, size_t len);
+
 void tlv_enable_debug(struct tlv_state *ts);
 
 /*
@@ -125,6 +145,20 @@ errf_t *tlv_read_upto(struct tlv_state *ts, uint8_t *dest, size_t maxLen,
 MUST_CHECK
 errf_t *tlv_read_string(struct tlv_state *ts, char **dest);
 
+/*
+ * Borrowing versions of tlv_read_alloc() and tlv_read_string(): these return
+ * a view of the remaining contents of the current tag, pointing into the
+ * buffer being parsed, and consume it. The view is only valid for as long as
+ * that buffer is.
+ *
+ * The string from tlv_read_strref() is *not* NUL-terminated (we check it
+ * doesn't contain any NULs, though).
+ */
+MUST_CHECK
+errf_t *tlv_read_ref(struct tlv_state *ts, const uint8_t **data, size_t *len);
+MUST_CHECK
+errf_t *tlv_read_strref(struct tlv_state *ts, const char **str, size_t *len);
+
 static inline boolean_t
 tlv_at_root_end(const struct tlv_state *ts)
 {
@@ -164,6 +198,19 @@ tlv_ptr(const struct tlv_state *ts)
 /* Begins a write-mode BER-TLV generator with an internal buffer. */
 struct tlv_state *tlv_init_write(void);
 
+/*
+ * Begins a write-mode generator in a caller-provided tlv_state, writing
+ * straight into buf (of size len) rather than an internal buffer. Nothing is
+ * allocated, and tlv_free() on it leaves buf alone.
+ *
+ * Running off the end of buf is a VERIFY failure, so work out how big the
+ * output will be first, using tlv_hdr_len(). If you also give tlv_pushl() the
+ * exact length of each tag's contents, every length field comes out in its
+ * shortest form and the whole thing is written in one pass.
+ */
+struct tlv_state *tlv_init_write_local(struct tlv_state *ts, uint8_t *buf,
+    size_t len);
+
 void tlv_pushl(struct tlv_state *ts, uint tag, size_t maxlen);
 void tlv_pop(struct tlv_state *ts);
 
@@ -177,6 +224,37 @@ tlv_len(const struct tlv_state *ts)
 	return (ts->ts_pos);
 }
 
+/* Number of bytes tlv_write_u8to32() will use for val. */
+static inline size_t
+tlv_u8to32_len(uint32_t val)
+{
+	if (val < (1 << 8))
+		return (1);
+	if (val < (1 << 16))
+		return (2);
+	if (val < (1 << 24))
+		return (3);
+	return (4);
+}
+
+/*
+ * Number of bytes taken up by the tag and length header written by
+ * tlv_pushl(ts, tag, len).
+ */
+static inline size_t
+tlv_hdr_len(uint tag, size_t len)
+{
+	size_t n = tlv_u8to32_len(tag);
+
+	if (len < (1 << 7))
+		return (n + 1);
+	if (len < (1 << 8))
+		return (n + 2);
+	if (len < (1 << 16))
+		return (n + 3);
+	return (n + 4);
+}
+
 static inline void
 tlv_push(struct tlv_state *ts, uint tag)
 {
@@ -8,8 +8,10 @@
  */
 
 #include <string.h>
+#include <strings.h>
 #include <sys/mman.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "utils.h"
 #include "debug.h"
@@ -44,6 +46,171 @@ calloc_conceal(size_t nmemb, size_t size)
 	return (ptr);
 }
 
+/*
+ * The locked pool is a handful of mmap()ed regions, each mlock()ed and
+ * excluded from core dumps once when it's created. Allocations are runs of
+ * LOCKED_GRAIN-byte grains tracked in a bitmap per region, which packs the
+ * 32-byte keys and shares we keep in here tightly, so that the whole pool
+ * fits comfortably inside the default RLIMIT_MEMLOCK.
+ */
+enum {
+	LOCKED_GRAIN = 16,
+	LOCKED_REGION_SIZE = 16384,
+	LOCKED_NGRAINS = LOCKED_REGION_SIZE / LOCKED_GRAIN,
+	LOCKED_MAX_REGIONS = 4
+};
+
+struct locked_region {
+	uint8_t		*lr_base;
+	uint64_t	 lr_used[LOCKED_NGRAINS / 64];
+	/* Marks the last grain of each allocation */
+	uint64_t	 lr_end[LOCKED_NGRAINS / 64];
+};
+
+static struct locked_region locked_regions[LOCKED_MAX_REGIONS];
+static uint locked_nregions = 0;
+static pthread_mutex_t locked_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static boolean_t
+locked_bit(const uint64_t *map, size_t g)
+{
+	return ((map[g / 64] & (1ULL << (g % 64))) != 0);
+}
+
+static void
+locked_bit_set(uint64_t *map, size_t g, boolean_t val)
+{
+	if (val)
+		map[g / 64] |= (1ULL << (g % 64));
+	else
+		map[g / 64] &= ~(1ULL << (g % 64));
+}
+
+static void *
+locked_region_alloc(struct locked_region *lr, size_t n)
+{
+	size_t g, run = 0;
+
+	for (g = 0; g < LOCKED_NGRAINS; ++g) {
+		if (locked_bit(lr->lr_used, g)) {
+			run = 0;
+			continue;
+		}
+		if (++run == n) {
+			locked_bit_set(lr->lr_end, g, B_TRUE);
+			g = g + 1 - n;
+			for (run = 0; run < n; ++run)
+				locked_bit_set(lr->lr_used, g + run, B_TRUE);
+			return (lr->lr_base + g * LOCKED_GRAIN);
+		}
+	}
+	return (NULL);
+}
+
+static struct locked_region *
+locked_region_new(void)
+{
+	struct locked_region *lr;
+	void *base;
+
+	if (locked_nregions >= LOCKED_MAX_REGIONS)
+		return (NULL);
+	base = mmap(NULL, LOCKED_REGION_SIZE, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (base == MAP_FAILED)
+		return (NULL);
+	set_no_dump(base, LOCKED_REGION_SIZE);
+
+	lr = &locked_regions[locked_nregions++];
+	lr->lr_base = base;
+	bzero(lr->lr_used, sizeof (lr->lr_used));
+	bzero(lr->lr_end, sizeof (lr->lr_end));
+	return (lr);
+}
+
+static struct locked_region *
+locked_region_owning(const void *ptr)
+{
+	const uint8_t *p = ptr;
+	uint i;
+
+	for (i = 0; i < locked_nregions; ++i) {
+		struct locked_region *lr = &locked_regions[i];
+		if (p >= lr->lr_base && p < lr->lr_base + LOCKED_REGION_SIZE)
+			return (lr);
+	}
+	return (NULL);
+}
+
+void *
+calloc_locked(size_t nmemb, size_t size)
+{
+	struct locked_region *lr;
+	size_t len, n;
+	void *ptr = NULL;
+	uint i;
+
+	if (size != 0 && nmemb > SIZE_MAX / size)
+		return (NULL);
+	len = nmemb * size;
+	n = (len + LOCKED_GRAIN - 1) / LOCKED_GRAIN;
+	if (n == 0)
+		n = 1;
+
+	if (n <= LOCKED_NGRAINS / 4) {
+		VERIFY0(pthread_mutex_lock(&locked_lock));
+		for (i = 0; i < locked_nregions && ptr == NULL; ++i)
+			ptr = locked_region_alloc(&locked_regions[i], n);
+		if (ptr == NULL && (lr = locked_region_new()) != NULL)
+			ptr = locked_region_alloc(lr, n);
+		VERIFY0(pthread_mutex_unlock(&locked_lock));
+	}
+
+	/*
+	 * Anything too big for the pool (or once it's full) gets the old
+	 * treatment instead. Pool grains are zeroed when they're freed, so
+	 * there's nothing to clear here.
+	 */
+	if (ptr == NULL)
+		ptr = calloc_conceal(nmemb, size);
+	return (ptr);
+}
+
+void
+freezero_locked(void *ptr, size_t size)
+{
+	struct locked_region *lr;
+	size_t g;
+	boolean_t last;
+
+	if (ptr == NULL)
+		return;
+
+	/*
+	 * For pool memory the size is only a hint: the whole run of grains
+	 * (up to the end marker) is zeroed and released.
+	 */
+	VERIFY0(pthread_mutex_lock(&locked_lock));
+	lr = locked_region_owning(ptr);
+	if (lr != NULL) {
+		g = ((uint8_t *)ptr - lr->lr_base) / LOCKED_GRAIN;
+		VERIFY(locked_bit(lr->lr_used, g));
+		do {
+			VERIFY3U(g, <, LOCKED_NGRAINS);
+			last = locked_bit(lr->lr_end, g);
+			explicit_bzero(lr->lr_base + g * LOCKED_GRAIN,
+			    LOCKED_GRAIN);
+			locked_bit_set(lr->lr_used, g, B_FALSE);
+			locked_bit_set(lr->lr_end, g, B_FALSE);
+			++g;
+		} while (!last);
+	}
+	VERIFY0(pthread_mutex_unlock(&locked_lock));
+
+	if (lr == NULL)
+		freezero(ptr, size);
+}
+
 #if !defined(__OpenBSD__) && !defined(__sun)
 void
 freezero(void *ptr, size_t sz)
@@ -30,6 +30,16 @@ void *calloc_conceal(size_t nmemb, size_t size) __attribute__((malloc));
 
 void set_no_dump(void *ptr, size_t size);
 
+/*
+ * Small allocations for key material (keys, key shares, PINs) from a pool of
+ * pages which are mlock()ed and excluded from core dumps, so that callers
+ * don't need mlockall(). Falls back to calloc_conceal() when the pool is
+ * full. Memory from calloc_locked() must be released with freezero_locked()
+ * (with the same size), never free().
+ */
+void *calloc_locked(size_t nmemb, size_t size) __attribute__((malloc));
+void freezero_locked(void *ptr, size_t size);
+
 #if !defined(__OpenBSD__) && !defined(__sun)
 void freezero(void *ptr, size_t size);
 #endif